@@ -14,28 +14,104 @@ static const unsigned char base64_table[] = {
     '4', '5', '6', '7', '8', '9', '+', '/'
 };
 
-/* This function converts 3 bytes of 'data' to 4 base64 ASCII characters. */ 
-static inline void do_convert_and_write(kbuffer *base64, uint8_t *data) {
-    uint8_t out[4];
+/* SSSE3 kernels. They are compiled for that instruction set regardless of the
+ * compiler flags and only used if the CPU supports them.
+ */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__i386__) || defined(__x86_64__))
+#define BASE64_SSSE3
+#include <tmmintrin.h>
+#endif
+
+#ifdef BASE64_SSSE3
+/* True if the CPU supports SSSE3, -1 if we don't know yet. */
+static int base64_ssse3_flag = -1;
+
+/* This function returns true if the SSSE3 kernels can be used. */
+static inline int base64_has_ssse3() {
+    if (base64_ssse3_flag == -1) {
+    	__builtin_cpu_init();
+	base64_ssse3_flag = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    }
+
+    return base64_ssse3_flag;
+}
+
+/* This function converts 12 bytes of 'data' to 16 base64 ASCII characters. It
+ * reads 16 bytes of 'data'.
+ */
+__attribute__((target("ssse3")))
+static inline void do_convert_ssse3(uint8_t *out, uint8_t *data) {
+    __m128i in, t0, t1, t2, t3, res, less;
+
+    /* Spread the 3 bytes groups on 4 bytes and extract the 6 bits indices. */
+    in = _mm_loadu_si128((__m128i *) data);
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    in = _mm_or_si128(t1, t3);
+
+    /* Map the indices to the offsets of their character ranges and add them. */
+    res = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    less = _mm_cmpgt_epi8(_mm_set1_epi8(26), in);
+    res = _mm_or_si128(res, _mm_and_si128(less, _mm_set1_epi8(13)));
+    res = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    	    	    	    	    	 '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+					 '/' - 63, 'A', 0, 0), res);
+    _mm_storeu_si128((__m128i *) out, _mm_add_epi8(res, in));
+}
 
+/* This function converts 16 base64 ASCII characters of 'data' to 12 bytes. It
+ * writes 16 bytes in 'out'. It returns -1 if some characters are not
+ * significant base64 characters, in which case nothing is converted.
+ */
+__attribute__((target("ssse3")))
+static inline int do_unconvert_ssse3(uint8_t *out, uint8_t *data) {
+    __m128i in, hi, lo, eq_2f, res;
+
+    in = _mm_loadu_si128((__m128i *) data);
+    hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+
+    /* Check that all characters are in A-Z, a-z, 0-9, + and /. */
+    lo = _mm_shuffle_epi8(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    	    	    	    	    	0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a), lo);
+    res = _mm_shuffle_epi8(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    	    	    	    	    	 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10), hi);
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, res), _mm_setzero_si128()))) return -1;
+
+    /* Map the characters to their 6 bits values. */
+    eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+    res = _mm_shuffle_epi8(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0),
+    	    	    	   _mm_add_epi8(eq_2f, hi));
+    in = _mm_add_epi8(in, res);
+
+    /* Pack the 6 bits values. */
+    in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+    in = _mm_shuffle_epi8(in, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *) out, in);
+    return 0;
+}
+#endif
+
+/* This function converts 3 bytes of 'data' to 4 base64 ASCII characters. */ 
+static inline void do_convert(uint8_t *out, uint8_t *data) {
     out[0] = base64_table[data[0]>>2];
     out[1] = base64_table[(data[0]&0x3)<<4 | (data)[1]>>4];
     out[2] = base64_table[(data[1]&0xF)<<2 | (data)[2]>>6];
     out[3] = base64_table[data[2]&0x3F];
-    kbuffer_write(base64, (char *)out, 4);
 }
 
 /* This function converts the end of the buffer specified into 4 base64 ASCII
  * characters, dealing with padding as necessary.
  */
-static void do_convert_and_write_tail(kbuffer *base64, uint8_t *data, uint32_t len) {
-    uint8_t out[4];
+static void do_convert_tail(uint8_t *out, uint8_t *data, uint32_t len) {
     uint8_t in[2];
 
-    assert(base64);
-    assert(len < 3);
-
-    if (len == 0) return;
+    assert(len > 0 && len < 3);
 
     /* Copy the data first then pad the buffer with 0s. */
     in[0] = data[0];
@@ -45,22 +121,34 @@ static void do_convert_and_write_tail(kbuffer *base64, uint8_t *data, uint32_t l
     out[1] = base64_table[(in[0]&0x3)<<4 | in[1]>>4];
     out[2] = (len == 2) ?  base64_table[(in[1]&0xF)<<2] : '=';
     out[3] = '=';
-    
-    kbuffer_write(base64, (char *)out, 4);
 }
 
 /* This function converts a binary buffer to a base64 buffer. */
 void bin2b64(kbuffer *buffer, kbuffer *base64_buffer) {
-    uint32_t nb2write = buffer->len;
-    
-    kbuffer_set_size(base64_buffer, (buffer->len * 4 + 2) / 3);
+    uint8_t *data = buffer->data;
+    uint8_t *end = buffer->data + buffer->len;
+    uint32_t out_len = (buffer->len + 2) / 3 * 4;
+    uint8_t *out = kbuffer_begin_write(base64_buffer, out_len);
 
-    while (nb2write >= 3) {
-        do_convert_and_write(base64_buffer, (uint8_t *)(buffer->data + buffer->len - nb2write));
-        nb2write -=3;
+    #ifdef BASE64_SSSE3
+    if (base64_has_ssse3()) {
+    	while (end - data >= 16) {
+	    do_convert_ssse3(out, data);
+	    data += 12;
+	    out += 16;
+	}
     }
-    
-    do_convert_and_write_tail(base64_buffer, (uint8_t *)(buffer->data + buffer->len - nb2write), nb2write);
+    #endif
+
+    while (end - data >= 3) {
+        do_convert(out, data);
+	data += 3;
+	out += 4;
+    }
+
+    if (end > data) do_convert_tail(out, data, end - data);
+
+    kbuffer_end_write(base64_buffer, out_len);
 }
 
 /******************** b642bin **********************/
@@ -258,6 +346,60 @@ static inline int b642bin_q1(kbuffer *in, kbuffer *out, unsigned char *cs, int i
     }
 }
 
+/* This function converts 4 base64 ASCII characters of 'data' to 3 bytes. It
+ * returns -1 if some characters are not significant base64 characters, in
+ * which case nothing is converted.
+ */
+static inline int do_unconvert(uint8_t *out, uint8_t *data) {
+    signed char a = b642bin_tbl[data[0]];
+    signed char b = b642bin_tbl[data[1]];
+    signed char c = b642bin_tbl[data[2]];
+    signed char d = b642bin_tbl[data[3]];
+
+    /* INV and PAD are negative. */
+    if ((a | b | c | d) < 0) return -1;
+
+    out[0] = a << 2 | b >> 4;
+    out[1] = b << 4 | c >> 2;
+    out[2] = c << 6 | d;
+    return 0;
+}
+
+/* This function converts the run of significant base64 characters found at
+ * the current position of 'in', 4 characters at a time, without going through
+ * the automaton. It stops at the first group of 4 characters that contains
+ * padding, an invalid character or the end of the buffer; the automaton
+ * handles it from there. Since the automaton is in its first state at the
+ * beginning and at the end of a group, the result is the same.
+ */
+static void b642bin_run(kbuffer *in, kbuffer *out) {
+    uint8_t *data = in->data + in->pos;
+    uint8_t *end = in->data + in->len;
+    uint8_t *out_start, *out_pos;
+
+    if (end - data < 4) return;
+
+    /* The SSSE3 kernel writes 4 bytes past its output. */
+    out_start = out_pos = kbuffer_begin_write(out, (end - data) / 4 * 3 + 4);
+
+    #ifdef BASE64_SSSE3
+    if (base64_has_ssse3()) {
+    	while (end - data >= 16 && do_unconvert_ssse3(out_pos, data) == 0) {
+	    data += 16;
+	    out_pos += 12;
+	}
+    }
+    #endif
+
+    while (end - data >= 4 && do_unconvert(out_pos, data) == 0) {
+    	data += 4;
+	out_pos += 3;
+    }
+
+    kbuffer_end_write(out, out_pos - out_start);
+    in->pos = data - in->data;
+}
+
 /* This function converts a buffer in base64 to a binary buffer.
    'ignore_invalid' is true if invalid base64 characters must be skipped
    silently. This function returns -1 on error, 0 otherwise. */
@@ -266,9 +408,15 @@ int b642bin(kbuffer *in, kbuffer *out, int ignore_invalid) {
     
     /* We convert four base64 characters at a time. */
     unsigned char cs[4];
+    
+    /* Make room for the whole output. */
+    kbuffer_set_size(out, out->len + kbuffer_left(in) / 4 * 3 + 4);
 
     /* Get the first character. */
     while (1) {
+    
+	/* Convert the significant characters that follow in bulk. */
+	b642bin_run(in, out);
       
 	/* There are no more characters. We decoded the whole buffer. */
 	if (! (cs[0] = kbuffer_read8(in))) {
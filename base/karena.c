@@ -0,0 +1,153 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#include "karena.h"
+
+/* Chunk of memory of an arena. The data follows the header. */
+struct karena_chunk {
+
+    /* Previous chunk, NULL for the first chunk. */
+    struct karena_chunk *next;
+
+    /* Size of the data of the chunk. */
+    uint32_t size;
+
+    /* Number of data bytes used. */
+    uint32_t pos;
+};
+
+/* Cleanup handler of an arena. It is allocated in the arena. */
+struct karena_cleanup {
+    void (*func)(void *);
+    void *obj;
+    struct karena_cleanup *next;
+};
+
+/* Size of the chunk header, rounded so that the data is aligned. */
+#define KARENA_HEADER_SIZE ((sizeof(struct karena_chunk) + KARENA_ALIGN - 1) & ~(KARENA_ALIGN - 1))
+
+/* This function runs the cleanup handlers of the arena. */
+static void karena_run_cleanup(karena *self) {
+    while (self->cleanup) {
+    	struct karena_cleanup *cleanup = self->cleanup;
+	self->cleanup = cleanup->next;
+	cleanup->func(cleanup->obj);
+    }
+}
+
+/* This function frees the chunk specified and the chunks linked to it. */
+static void karena_free_chunks(struct karena_chunk *chunk) {
+    while (chunk) {
+    	struct karena_chunk *next = chunk->next;
+	free(chunk);
+	chunk = next;
+    }
+}
+
+/* This function allocates a new chunk that can hold at least 'size' bytes and
+ * returns it.
+ */
+static struct karena_chunk * karena_add_chunk(karena *self, uint32_t size) {
+    struct karena_chunk *chunk;
+
+    if (size < self->chunk_size) size = self->chunk_size;
+
+    chunk = (struct karena_chunk *) kmo_malloc(KARENA_HEADER_SIZE + size);
+    chunk->size = size;
+    chunk->pos = 0;
+
+    /* A large block gets its own chunk. Keep the current chunk in front since
+     * it probably has room left.
+     */
+    if (self->chunk && size > self->chunk_size) {
+	chunk->next = self->chunk->next;
+	self->chunk->next = chunk;
+    }
+
+    else {
+	chunk->next = self->chunk;
+	self->chunk = chunk;
+    }
+
+    return chunk;
+}
+
+void karena_init(karena *self, uint32_t chunk_size) {
+    self->chunk = NULL;
+    self->cleanup = NULL;
+    self->chunk_size = chunk_size ? chunk_size : KARENA_DEF_CHUNK_SIZE;
+}
+
+void karena_free(karena *self) {
+    if (self == NULL) return;
+
+    karena_run_cleanup(self);
+    karena_free_chunks(self->chunk);
+    self->chunk = NULL;
+}
+
+void karena_reset(karena *self) {
+    struct karena_chunk *chunk = self->chunk;
+    struct karena_chunk *keep = NULL;
+
+    karena_run_cleanup(self);
+
+    /* Keep one chunk of the regular size. The large block chunks go away. */
+    while (chunk) {
+    	struct karena_chunk *next = chunk->next;
+
+	if (keep == NULL && chunk->size == self->chunk_size) keep = chunk;
+	else free(chunk);
+
+	chunk = next;
+    }
+
+    if (keep) {
+    	keep->next = NULL;
+	keep->pos = 0;
+    }
+
+    self->chunk = keep;
+}
+
+void * karena_alloc(karena *self, uint32_t size) {
+    struct karena_chunk *chunk = self->chunk;
+    char *block;
+
+    size = (size + KARENA_ALIGN - 1) & ~(KARENA_ALIGN - 1);
+
+    if (chunk == NULL || chunk->size - chunk->pos < size) {
+    	chunk = karena_add_chunk(self, size);
+    }
+
+    block = (char *) chunk + KARENA_HEADER_SIZE + chunk->pos;
+    chunk->pos += size;
+    return block;
+}
+
+void * karena_calloc(karena *self, uint32_t size) {
+    void *block = karena_alloc(self, size);
+    memset(block, 0, size);
+    return block;
+}
+
+void karena_add_cleanup(karena *self, void (*func)(void *), void *obj) {
+    struct karena_cleanup *cleanup = (struct karena_cleanup *) karena_alloc(self, sizeof(struct karena_cleanup));
+    cleanup->func = func;
+    cleanup->obj = obj;
+    cleanup->next = self->cleanup;
+    self->cleanup = cleanup;
+}
+
+kstr * karena_kstr_new(karena *self) {
+    kstr *str = (kstr *) karena_alloc(self, sizeof(kstr));
+    kstr_init(str);
+    karena_add_cleanup(self, (void (*)(void *)) kstr_free, str);
+    return str;
+}
+
+karray * karena_karray_new(karena *self) {
+    karray *array = (karray *) karena_alloc(self, sizeof(karray));
+    karray_init(array);
+    karena_add_cleanup(self, (void (*)(void *)) karray_free, array);
+    return array;
+}
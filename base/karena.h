@@ -0,0 +1,70 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KARENA_H
+#define _KARENA_H
+
+#include "kmo_base.h"
+
+/* Default size of an arena chunk. */
+#define KARENA_DEF_CHUNK_SIZE	4096
+
+/* Alignment of the memory returned by the arena. */
+#define KARENA_ALIGN		8
+
+/* Region allocator. The memory obtained from an arena is not freed piece by
+ * piece; it is all released at once when the arena is reset or freed. This is
+ * used for the objects that live for the duration of a single request.
+ *
+ * The arena can also own kstr and karray objects. The object itself is
+ * allocated in the arena, but its buffer stays on the heap since it may be
+ * reallocated by kstr_grow() and karray_grow(). The buffer is freed
+ * automatically when the arena is reset. Such an object must not be passed to
+ * kstr_destroy() or karray_destroy().
+ */
+typedef struct karena {
+
+    /* Current chunk. The other chunks are linked to it, the first one last. */
+    struct karena_chunk *chunk;
+
+    /* Cleanup handlers to run on reset, the most recently added first. */
+    struct karena_cleanup *cleanup;
+
+    /* Size of the chunks allocated by the arena. */
+    uint32_t chunk_size;
+} karena;
+
+/* This function initializes the arena. 'chunk_size' is the size of the chunks
+ * allocated by the arena, 0 for the default size. No memory is allocated until
+ * the first allocation is made.
+ */
+void karena_init(karena *self, uint32_t chunk_size);
+
+/* This function releases all the memory held by the arena. */
+void karena_free(karena *self);
+
+/* This function releases all the memory obtained from the arena. One chunk
+ * is kept so that the next request does not have to allocate it again.
+ */
+void karena_reset(karena *self);
+
+/* This function returns a block of 'size' bytes allocated in the arena. */
+void * karena_alloc(karena *self, uint32_t size);
+
+/* This function returns a block of 'size' bytes allocated in the arena and set
+ * to 0.
+ */
+void * karena_calloc(karena *self, uint32_t size);
+
+/* This function registers a function to call with 'obj' when the arena is
+ * reset or freed. The functions are called in the reverse order of their
+ * registration.
+ */
+void karena_add_cleanup(karena *self, void (*func)(void *), void *obj);
+
+/* This function returns an empty kstr owned by the arena. */
+kstr * karena_kstr_new(karena *self);
+
+/* This function returns an empty karray owned by the arena. */
+karray * karena_karray_new(karena *self);
+
+#endif
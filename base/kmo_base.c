@@ -101,27 +101,67 @@ void karray_append_karray(karray *self, karray *append_array) {
 /*******************************************/
 /* khash functions. */
 
-/* Prime table used to grow the hash. */
-static unsigned int khash_prime_table[] = {
-    23, 53, 97, 193, 389, 769, 1543, 3079, 6151, 12289, 24593, 49157, 98317,
-    196613, 393241, 786433, 1572869, 3145739, 6291469, 12582917, 25165843, 50331653,
-    100663319, 201326611, 402653189, 805306457, 1610612741, 4294967291u
-};
-
-/* The proportion of the cells that must be used before we decide to grow the 
- * hash table.
+/* Initial sizes of the cell array and of the index table. */
+#define KHASH_INIT_ALLOC_SIZE	8
+#define KHASH_INIT_TABLE_SIZE	16
+
+/* This function mixes the bits of the integer returned by the key function,
+ * so that the low bits used to index the table depend on all of them.
  */
-#define KHASH_FILL_THRESHOLD 0.7
+inline static unsigned int khash_mix(unsigned int h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
 
-/* This function assumes that pos1 comes before pos2. It returns the distance between the two.
- * It is used internally.
- * Arguments:
- * Position 1.
- * Position 2.
- * Size of the hash (for modulus operation).
+/* This function returns the slot of the index table at which the probing for
+ * the hash specified begins.
+ */
+inline static int khash_home_slot(khash *self, unsigned int hash) {
+    return (int) (hash & (unsigned int) (self->table_size - 1));
+}
+
+/* This function returns the slot of the index table referring to the key
+ * specified, or -1 if the key is not in the hash.
  */
-inline static int khash_dist(int pos1, int pos2, int base) {
-    return (pos1 <= pos2) ? pos2 - pos1 : base - (pos1 - pos2);
+static int khash_locate_slot(khash *self, void *key, unsigned int hash) {
+    int mask = self->table_size - 1;
+    int slot = khash_home_slot(self, hash);
+    
+    while (1) {
+    	int index = self->index_table[slot];
+	
+	/* Empty slot (the key is not there). */
+	if (index == 0)
+	    return -1;
+	
+	/* Compare the hashes, then the keys. */
+	index--;
+	
+	if (self->cell_array[index].hash == hash && self->cmp_func(self->cell_array[index].key, key))
+	    return slot;
+	
+	slot = (slot + 1) & mask;
+    }
+}
+
+/* This function rebuilds the index table with the size specified. */
+static void khash_rebuild(khash *self, int table_size) {
+    int index;
+    int mask = table_size - 1;
+    
+    free(self->index_table);
+    self->table_size = table_size;
+    self->index_table = (int *) kmo_calloc(table_size * sizeof(int));
+    
+    for (index = 0; index < self->size; index++) {
+    	int slot = khash_home_slot(self, self->cell_array[index].hash);
+	while (self->index_table[slot]) slot = (slot + 1) & mask;
+	self->index_table[slot] = index + 1;
+    }
 }
 
 khash * khash_new() {
@@ -147,14 +187,17 @@ void khash_init_func(khash *self, unsigned int (*key_func) (void *), int (*cmp_f
     self->key_func = key_func;
     self->cmp_func = cmp_func;
     self->size = 0;
-    self->used_limit = (int) (11 * KHASH_FILL_THRESHOLD);
-    self->next_prime_index = 0;
-    self->alloc_size = 11;
-    self->cell_array = (struct khash_cell *) kmo_calloc(self->alloc_size * sizeof(struct khash_cell));
+    self->alloc_size = KHASH_INIT_ALLOC_SIZE;
+    self->cell_array = (struct khash_cell *) kmo_malloc(self->alloc_size * sizeof(struct khash_cell));
+    self->table_size = KHASH_INIT_TABLE_SIZE;
+    self->index_table = (int *) kmo_calloc(self->table_size * sizeof(int));
 }
 
-/* This function sets the key hash and compare functions used to hash objects. */
+/* This function sets the key hash and compare functions used to hash objects.
+ * The hash must be empty.
+ */
 void khash_set_func(khash *self, unsigned int (*key_func) (void *), int (*cmp_func) (void *, void *)) {
+    assert(self->size == 0);
     self->key_func = key_func;
     self->cmp_func = cmp_func;
 }
@@ -165,50 +208,12 @@ void khash_free(khash *self) {
     	return;
     
     free(self->cell_array);
+    free(self->index_table);
 }
 
-/* This function increases the size of the hash. */
+/* This function doubles the size of the index table of the hash. */
 void khash_grow(khash *self) {
-    int index;
-    int new_alloc_size;
-    struct khash_cell *new_cell_array;
-    
-    /* Get the new size. */
-    new_alloc_size = khash_prime_table[self->next_prime_index];
-    self->next_prime_index++;
-    self->used_limit = (int) (new_alloc_size * KHASH_FILL_THRESHOLD);
-
-    /* Allocate the new table. */
-    new_cell_array = (struct khash_cell *) kmo_calloc(new_alloc_size * sizeof(struct khash_cell));
-    
-    /* Copy the elements. */
-    for (index = 0; index < self->alloc_size; index++) {
-        void *key = self->cell_array[index].key;
-        
-        if (key != NULL) {
-            /* Put the key at the right place. */
-            int i = self->key_func(key) % new_alloc_size;
-            
-            while (1) {
-                /* OK, found an empty slot. */
-                if (new_cell_array[i].key == NULL) {
-                    /* Set the key / value pair. */
-                    new_cell_array[i].key = key;
-                    new_cell_array[i].value = self->cell_array[index].value;
-                    break;
-    	    	}
-
-                i = (i + 1) % new_alloc_size;
-    	    }
-    	}
-    }
-    
-    /* Free the old table. */
-    free(self->cell_array);
-    
-    /* Assign the new table and the new size. */
-    self->alloc_size = new_alloc_size;
-    self->cell_array = new_cell_array;
+    khash_rebuild(self, self->table_size * 2);
 }    
 
 /* This function returns the position corresponding to the key in the hash, or -1
@@ -217,26 +222,11 @@ void khash_grow(khash *self) {
  * Key to locate.
  */
 int khash_locate_key(khash *self, void *key) {
-    int index;
+    int slot;
     assert(key != NULL);
     
-    /* Go where the key should be close. */
-    index = self->key_func(key) % self->alloc_size;
-        
-    while (1) {
-        /* Empty slot (the key is not there). */
-        if (self->cell_array[index].key == NULL)
-            return -1;
-            
-        /* Same slot. Must compare key values. */
-        else if (self->cmp_func(self->cell_array[index].key, key))
-            return index;
-        
-        /* Not the same key. Advance to the next position, possibly looping back
-	 * to the beginning.
-	 */
-        index = (index + 1) % self->alloc_size;
-    }
+    slot = khash_locate_slot(self, key, khash_mix(self->key_func(key)));
+    return (slot == -1) ? -1 : self->index_table[slot] - 1;
 }
 
 /* This function adds a key / value pair in the hash. If the key is already
@@ -246,32 +236,46 @@ int khash_locate_key(khash *self, void *key) {
  * Value to add.
  */
 void khash_add(khash *self, void *key, void *value) {
-    int index;
+    unsigned int hash;
+    int mask;
+    int slot;
     assert(key != NULL);
     
-    /* Grow hash if it is too small. */
-    if (self->size >= self->used_limit)
+    hash = khash_mix(self->key_func(key));
+    
+    /* Grow the index table if it would become more than half full. */
+    if (2 * (self->size + 1) > self->table_size)
         khash_grow(self);
 
-    /* Go where the key should be close. */
-    index = self->key_func(key) % self->alloc_size;
+    mask = self->table_size - 1;
+    slot = khash_home_slot(self, hash);
 
     while (1) {
+    	int index = self->index_table[slot];
     
         /* Empty slot. It's a new key. */
-        if (self->cell_array[index].key == NULL) {
-	
-            /* Increment use count. */
-            self->size++;
-            
+        if (index == 0) {
+	    
+	    /* Grow the cell array if it is full. */
+	    if (self->size == self->alloc_size) {
+	    	self->alloc_size *= 2;
+		self->cell_array = (struct khash_cell *) kmo_realloc(self->cell_array,
+		    	    	    	    	    	    	     self->alloc_size * sizeof(struct khash_cell));
+	    }
+	    
             /* Set the key / value pair. */
-            self->cell_array[index].key = key;
-            self->cell_array[index].value = value;
+            self->cell_array[self->size].key = key;
+            self->cell_array[self->size].value = value;
+            self->cell_array[self->size].hash = hash;
+            self->size++;
+	    self->index_table[slot] = self->size;
             return;
     	}
         
         /* Must compare key values. If they are the same, replace them. */
-        if (self->cmp_func(self->cell_array[index].key, key)) {
+	index--;
+	
+        if (self->cell_array[index].hash == hash && self->cmp_func(self->cell_array[index].key, key)) {
 	
             /* Replace key / value pair. */
             self->cell_array[index].key = key;
@@ -279,10 +283,10 @@ void khash_add(khash *self, void *key, void *value) {
             return;
     	}
         
-        /* Not the same key. Advance to the next position, possibly looping back
-	 * to the beginning.
+        /* Not the same key. Advance to the next slot, possibly looping back to
+	 * the beginning.
 	 */
-        index = (index + 1) % self->alloc_size;
+        slot = (slot + 1) & mask;
     }
 }
 
@@ -291,64 +295,50 @@ void khash_add(khash *self, void *key, void *value) {
  * Key to remove.
  */
 void khash_remove(khash *self, void *key) {
-    int index = khash_locate_key(self, key);
-    int gap_position = index;
-    int scanned_pos = index;
+    int mask = self->table_size - 1;
+    int slot = khash_locate_slot(self, key, khash_mix(self->key_func(key)));
+    int gap_slot = slot;
+    int index;
+    int last;
     
     /* Key is not present in the hash. */
-    if(index == -1)
+    if (slot == -1)
         return;
     
-    /* We must ensure that other keys remain contiguous when we remove a key.
-     * The situation where we need to move a key up is when the position of the
-     * key given by key_func() is farther than the actual position of the key in
-     * the hash, counting  from the position of the gap. Picture:
-     *
-     * The key wants to be here. (Distance between gap and pos wanted is far.)
-     * A gap is here.            (So we move the key here.)
-     * The key is here.          (Distance between gap and key is close.)
-     *
-     * In this situation, we don't move:
-     * The gap is here.        
-     * The key wants to be here. (Distance between gap and pos wanted is short.)
-     * The key is here.          (Distance between gap and key is far.)
-     *
-     * If the gap position matches the wanted pos, we must move the key to fill
-     * the gap.
-     *
-     * So here's the plan:
-     * First we locate the key to remove. Removing it causes a gap. We start
-     * scanning the keys coming next. If we meet a NULL, we're done. If we meet
-     * a key, we check where it wants to be. If it wants to be before the gap,
-     * we move it there. Then the gap is now at the position of the key we
-     * moved, and we continue at the next position. Otherwise, we just continue 
-     * with the next position.
+    index = self->index_table[slot] - 1;
+    
+    /* Close the gap in the index table without leaving a tombstone. The slots
+     * that follow the gap are scanned until an empty slot is met. A slot is
+     * moved into the gap if the gap lies between the home slot of its key and
+     * the slot itself, counting circularly; the gap then moves to that slot.
      */
     while (1) {
-    	int wanted_pos_dist;
-	int key_dist;
+    	int home_slot;
 	
-        /* Scan the next position. */
-        scanned_pos = (scanned_pos + 1) % self->alloc_size;
-
-        /* We're done. Just set the gap to NULL. */
-        if (self->cell_array[scanned_pos].key == NULL) {
-            self->cell_array[gap_position].key = NULL;
-            break;
-    	}
-
-        /* Calculate the distances. */
-        wanted_pos_dist = khash_dist(gap_position,
-	    	    	    	     self->key_func(self->cell_array[scanned_pos].key) % self->alloc_size,
-				     self->alloc_size);
-        key_dist = khash_dist(gap_position, scanned_pos, self->alloc_size);    
-
-        /* Situations where we must move key (and value). */
-        if (wanted_pos_dist > key_dist || wanted_pos_dist == 0) {
-            self->cell_array[gap_position].key = self->cell_array[scanned_pos].key;
-            self->cell_array[gap_position].value = self->cell_array[scanned_pos].value;
-            gap_position = scanned_pos;
-    	}
+        slot = (slot + 1) & mask;
+	
+	/* We're done. Just empty the gap. */
+	if (self->index_table[slot] == 0) {
+	    self->index_table[gap_slot] = 0;
+	    break;
+	}
+	
+	home_slot = khash_home_slot(self, self->cell_array[self->index_table[slot] - 1].hash);
+	
+	if (((slot - home_slot) & mask) >= ((slot - gap_slot) & mask)) {
+	    self->index_table[gap_slot] = self->index_table[slot];
+	    gap_slot = slot;
+	}
+    }
+    
+    /* Move the last cell into the cell removed, to keep the cells contiguous. */
+    last = self->size - 1;
+    
+    if (index != last) {
+    	self->cell_array[index] = self->cell_array[last];
+	slot = khash_home_slot(self, self->cell_array[index].hash);
+	while (self->index_table[slot] != last + 1) slot = (slot + 1) & mask;
+	self->index_table[slot] = index + 1;
     }
 
     /* Decrement the usage count. */
@@ -388,18 +378,19 @@ void * khash_get_key(khash *self, void *key) {
 /* This function clears all entries in the hash. */
 void khash_clear(khash *self) {
     self->size = 0;
-    self->used_limit = (int) (11 * KHASH_FILL_THRESHOLD);
-    self->next_prime_index = 0;
-    self->alloc_size = 11;
+    self->alloc_size = KHASH_INIT_ALLOC_SIZE;
     self->cell_array = (struct khash_cell *) kmo_realloc(self->cell_array,
     	    	    	    	    	    	    	 self->alloc_size * sizeof(struct khash_cell));
-    memset(self->cell_array, 0, self->alloc_size * sizeof(struct khash_cell));
+    self->table_size = KHASH_INIT_TABLE_SIZE;
+    self->index_table = (int *) kmo_realloc(self->index_table, self->table_size * sizeof(int));
+    memset(self->index_table, 0, self->table_size * sizeof(int));
 }
 
 /* This function sets the key / value pair of the next element in the
  * enumeration. It is safe to call this function even if some of the keys in
  * the hash are invalid, e.g. if you freed the pointers to the objects used as
- * the keys. Be careful not to iterate past the end of the hash.
+ * the keys. Be careful not to iterate past the end of the hash. The hash must
+ * not be modified during the enumeration.
  * Arguments:
  * Pointer to iterator index, which should be initialized to -1 prior to the 
  *   first call.
@@ -407,42 +398,28 @@ void khash_clear(khash *self) {
  * Pointer to the location where you wish the value to be set; can be NULL.
  */
 void khash_iter_next(khash *self, int *index, void **key_handle, void **value_handle) {
+    (*index)++;
+    assert(*index < self->size);
     
-    for ((*index)++; *index < self->alloc_size; (*index)++) {
-        if (self->cell_array[*index].key != NULL) {
-            if (key_handle != NULL)
-                *key_handle = self->cell_array[*index].key;
-            
-            if (value_handle != NULL)
-                *value_handle = self->cell_array[*index].value;
-    	    
-            return;
-        }
-    }
+    if (key_handle != NULL)
+        *key_handle = self->cell_array[*index].key;
     
-    assert(0);
+    if (value_handle != NULL)
+        *value_handle = self->cell_array[*index].value;
 }
 
 /* Same as above, except that it returns only the next key. */
 void * khash_iter_next_key(khash *self, int *index) {
-
-    for ((*index)++; *index < self->alloc_size; (*index)++)
-        if (self->cell_array[*index].key != NULL)
-            return self->cell_array[*index].key;
-    
-    assert(0);
-    return NULL;
+    (*index)++;
+    assert(*index < self->size);
+    return self->cell_array[*index].key;
 }
 
 /* Same as above, except that it returns only the next value. */
 void * khash_iter_next_value(khash *self, int *index) {
-    
-    for ((*index)++; *index < self->alloc_size; (*index)++)
-        if (self->cell_array[*index].key != NULL)
-            return self->cell_array[*index].value;
-    
-    assert(0);
-    return NULL;
+    (*index)++;
+    assert(*index < self->size);
+    return self->cell_array[*index].value;
 }
 
 
@@ -462,8 +439,8 @@ void kstr_destroy(kstr *str) {
 
 void kstr_init(kstr *self) {
     self->slen = 0;
-    self->mlen = 8;
-    self->data = (char *) kmo_malloc(self->mlen);
+    self->mlen = KSTR_INLINE_SIZE;
+    self->data = self->buf;
     self->data[0] = 0;
 }
 
@@ -480,11 +457,11 @@ void kstr_init_kstr(kstr *self, kstr *init_str) {
 }
 
 void kstr_init_buf(kstr *self, const void *buf, int buf_len) {
-    self->slen = buf_len;
-    self->mlen = buf_len + 1;
-    self->data = (char *) kmo_malloc(self->mlen);
+    kstr_init(self);
+    kstr_reserve(self, buf_len);
     memcpy(self->data, buf, buf_len);
     self->data[buf_len] = 0;
+    self->slen = buf_len;
 }
 
 void kstr_free(kstr *self) {
@@ -492,27 +469,43 @@ void kstr_free(kstr *self) {
     if (self == NULL)
     	return;
 
-    free(self->data);
+    if (self->data != self->buf)
+    	free(self->data);
+}
+
+/* This function sets the size of the string buffer to 'mlen', which must be
+ * larger than the current size. The content of the string is kept.
+ */
+static void kstr_resize(kstr *self, int mlen) {
+    if (self->data == self->buf) {
+    	self->data = (char *) kmo_malloc(mlen);
+	memcpy(self->data, self->buf, self->slen + 1);
+    }
+    
+    else {
+        self->data = (char *) kmo_realloc(self->data, mlen);
+    }
+    
+    self->mlen = mlen;
 }
 
 void kstr_grow(kstr *self, int min_slen) {
     assert(min_slen >= 0);
     
+    /* Snap the size to a power of 2, so that repeated reallocations are
+     * avoided.
+     */
     if (min_slen >= self->mlen) {
-    
-        /* Compute the snapped size for a given requested size. By snapping to powers
-         * of 2 like this, repeated reallocations are avoided.
-         */
-        if (min_slen < 8) {
-            self->mlen = 8;
-        }
-        
-        else {
-	    self->mlen = next_power_of_2(min_slen);
-        }
-        
+	kstr_resize(self, next_power_of_2(min_slen));
         assert(self->mlen > min_slen);    
-        self->data = (char *) kmo_realloc(self->data, self->mlen);
+    }
+}
+
+void kstr_reserve(kstr *self, int slen) {
+    assert(slen >= 0);
+    
+    if (slen >= self->mlen) {
+    	kstr_resize(self, slen + 1);
     }
 }
 
@@ -555,10 +548,36 @@ void kstr_assign_buf(kstr *self, const void *buf, int buf_len) {
     self->slen = buf_len;
 }
 
+void kstr_swap(kstr *first, kstr *second) {
+    kstr tmp = *first;
+    *first = *second;
+    *second = tmp;
+    
+    /* The inline buffers were exchanged as well. Point to them again. */
+    if (first->data == second->buf) first->data = first->buf;
+    if (second->data == first->buf) second->data = second->buf;
+}
+
+void kstr_take(kstr *self, kstr *src) {
+    
+    /* Copy the short strings. */
+    if (src->data == src->buf) {
+    	kstr_assign_buf(self, src->data, src->slen);
+	kstr_clear(src);
+    }
+    
+    else {
+    	kstr_free(self);
+	self->data = src->data;
+	self->slen = src->slen;
+	self->mlen = src->mlen;
+	kstr_init(src);
+    }
+}
+
 void kstr_append_char(kstr *self, char c) {
-    self->slen++;
-    kstr_grow(self, self->slen);
-    self->data[self->slen - 1] = c;
+    kstr_grow(self, self->slen + 1);
+    self->data[self->slen++] = c;
     self->data[self->slen] = 0;
 }
 
@@ -591,21 +610,25 @@ void kstr_sfv(kstr *self, const char *format, va_list arg) {
      */
     #ifndef __WINDOWS__
     
-    /* Determine the size of the resulting string. */
+    /* Format in the current buffer. vsnprintf() returns the size of the
+     * resulting string, so a second pass is needed only if the buffer is too
+     * small.
+     */
     int print_size;
     va_list arg2;
     
     va_copy(arg2, arg);
-    print_size = vsnprintf(NULL, 0, format, arg2);
+    print_size = vsnprintf(self->data, self->mlen, format, arg2);
     assert(print_size >= 0);
     va_end(arg2);
     
-    self->slen = print_size;
-    kstr_grow(self, self->slen);
+    if (print_size >= self->mlen) {
+    	self->slen = 0;
+    	kstr_grow(self, print_size);
+	print_size = vsnprintf(self->data, self->mlen, format, arg);
+    }
     
-    /* Do the sprintf(). */
-    print_size = vsnprintf(self->data, self->slen + 1, format, arg);
-    assert(print_size == self->slen);
+    self->slen = print_size;
     
     /* Windows doesn't support it correctly, though. */
     #else
@@ -650,11 +673,16 @@ int kstr_equal_kstr(kstr *first, kstr *second) {
 /*******************************************/
 /* KMO error API */
 
-/* Error string currently set. */
-static kstr kmo_error_str;
+/* Error string currently set. Each thread has its own error string, which
+ * must be initialized with kmo_error_start() by the thread.
+ */
+static __thread kstr kmo_error_str;
 
 /* Scratch space for sprintf() and friends. */
-static kstr kmo_scratch_str;
+static __thread kstr kmo_scratch_str;
+
+/* Function called by kmo_fatalerror() before the program exits, or NULL. */
+static void (*kmo_fatal_hook) (void) = NULL;
 
 void kmo_error_start() {
     kstr_init(&kmo_error_str);
@@ -705,13 +733,23 @@ void kmo_clearerror() {
     kstr_clear(&kmo_error_str);
 }
 
+void kmo_set_fatal_hook(void (*hook) (void)) {
+    kmo_fatal_hook = hook;
+}
+
 void kmo_fatalerror(const char *format, ...) {
+    void (*hook) (void) = kmo_fatal_hook;
+    
     /* Make the fprintf(). */
     va_list arg;
     va_start(arg, format);
     vfprintf(stderr, format, arg);
     va_end(arg);
     
+    /* Let the hook save what it can. It is called only once. */
+    kmo_fatal_hook = NULL;
+    if (hook) hook();
+    
     /* Exit now. */
     _exit(1);
 }
@@ -738,16 +776,35 @@ int khash_pointer_cmp(void *key_1, void *key_2) {
     return key_1 == key_2;
 }
 
+/* This function hashes the buffer specified 8 bytes at a time, with a
+ * multiply-xorshift mix per word. The byte order of the host does not matter,
+ * since the hashes are not stored.
+ */
+static unsigned int khash_buf_key(const void *buf, int len) {
+    const uint8_t *p = (const uint8_t *) buf;
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ (uint64_t) len;
+    uint64_t word;
+    
+    for (; len >= 8; p += 8, len -= 8) {
+    	memcpy(&word, p, 8);
+	h = (h ^ word) * 0xff51afd7ed558ccdull;
+	h ^= h >> 32;
+    }
+    
+    if (len) {
+    	word = 0;
+	memcpy(&word, p, len);
+	h = (h ^ word) * 0xff51afd7ed558ccdull;
+	h ^= h >> 32;
+    }
+    
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return (unsigned int) (h ^ (h >> 32));
+}
+
 unsigned int khash_cstr_key(void *key) {
     char *str = (char *) key;
-    unsigned int value = 0;
-    int str_size = strlen(str);
-    int index ;
-
-    for(index = 0; index < str_size; index++)
-    	value += str[index];
-
-    return value;
+    return khash_buf_key(str, strlen(str));
 }
 
 int khash_cstr_cmp(void *key_1, void *key_2) {
@@ -755,7 +812,8 @@ int khash_cstr_cmp(void *key_1, void *key_2) {
 }
 
 unsigned int khash_kstr_key(void *key) {
-    return khash_cstr_key(((kstr *) key)->data);
+    kstr *str = (kstr *) key;
+    return khash_buf_key(str->data, str->slen);
 }
 
 int khash_kstr_cmp(void *key_1, void *key_2) {
@@ -68,6 +68,31 @@
  * of memory, since we cannot recover from an 'out of memory' condition in
  * general.
  */
+#ifdef __KMO_HEAP_STATS__
+
+/* When the heap accounting is enabled, the wrappers record the size and the
+ * accounting tag of each block, and free() is redirected so that the blocks
+ * can be released as usual. See kmo_heap.h.
+ */
+void * kmo_heap_alloc(unsigned int count, int zero_flag);
+void * kmo_heap_realloc(void *ptr, unsigned int count);
+void kmo_heap_free(void *ptr);
+#define free(ptr) kmo_heap_free(ptr)
+
+static inline void * kmo_malloc(unsigned int count) {
+    return kmo_heap_alloc(count, 0);
+}
+
+static inline void * kmo_calloc(unsigned int count) {
+    return kmo_heap_alloc(count, 1);
+}
+
+static inline void * kmo_realloc(void *ptr, unsigned int count) {
+    return kmo_heap_realloc(ptr, count);
+}
+
+#else
+
 static inline void * kmo_malloc(unsigned int count) {
     void *ptr = malloc(count);
     
@@ -101,6 +126,8 @@ static inline void * kmo_realloc(void *ptr, unsigned int count) {
     return ptr;
 }
 
+#endif
+
 
 /*******************************************/
 /* Minimal implementation of an array object. */
@@ -153,18 +180,25 @@ void karray_append_karray(karray *self, karray *append_array);
 /*******************************************/
 /* Hash implementation. */
 
-/* A cell in the hash table: a key and its associated value. */
+/* A cell in the hash table: a key, its associated value and the hash of the
+ * key.
+ */
 struct khash_cell {
     void *key;
     void *value;
+    unsigned int hash;
 };
 
-/* The hash itself. */
+/* The hash itself. The cells are stored contiguously in an array, and a
+ * power-of-two index table maps the hashes of the keys to the cells with
+ * linear probing. Iterating over the hash thus scans only the cells used.
+ */
 typedef struct khash {
     
     /* The hashing function used by this hash. This function takes a key object
      * as its argument and returns an integer often unique for that object. By
-     * default, we use the value of the pointer as the integer.
+     * default, we use the value of the pointer as the integer. The integer is
+     * mixed before it is used, so the function need not be strong.
      */
     unsigned int (*key_func) (void *);
 
@@ -174,20 +208,22 @@ typedef struct khash {
      */
     int (*cmp_func) (void *, void *);
 
-    /* The table containing the hash cells. */
+    /* The array containing the hash cells. The first 'size' cells are used. */
     struct khash_cell *cell_array;
 
-    /* Size of the table. */
+    /* Size of the cell array. */
     int alloc_size;
 
-    /* Number of cells used in the table. */
+    /* Number of cells used in the array. */
     int size;
 
-    /* Maximum number of cells that can be used before the hash is expanded. */
-    int used_limit;
+    /* Index table. Each slot contains 1 + the index of a cell, or 0 if the
+     * slot is empty. The table is at most half full.
+     */
+    int *index_table;
 
-    /* Next index in the prime table to grow the hash. */
-    int next_prime_index;
+    /* Size of the index table, a power of 2. */
+    int table_size;
 } khash;
 
 khash * khash_new();
@@ -219,6 +255,15 @@ static inline int khash_exist(khash *self, void *key) {
 /*******************************************/
 /* Minimal implementation of a string object. */
 
+/* Size of the buffer stored inside the kstr object. The strings shorter than
+ * that are not allocated on the heap.
+ */
+#define KSTR_INLINE_SIZE 32
+
+/* Since 'data' may point inside the object, a kstr must not be copied or
+ * moved in memory with a plain assignment or memcpy(). Use kstr_swap() or
+ * kstr_take() instead.
+ */
 typedef struct kstr
 {
     /* The allocated buffer size. */
@@ -228,9 +273,13 @@ typedef struct kstr
     int slen;
     
     /* The character buffer, always terminated by a '0'.
-     * Note that there may be other '0' in the string.
+     * Note that there may be other '0' in the string. It points to 'buf'
+     * while the string is short.
      */
     char *data;
+    
+    /* Inline storage of the short strings. */
+    char buf[KSTR_INLINE_SIZE];
 } kstr;
 
 /* This function allocates and returns an empty kstr. */
@@ -259,6 +308,12 @@ void kstr_free(kstr *self);
  */
 void kstr_grow(kstr *self, int min_slen);
 
+/* This function makes sure that the string may contain 'slen' characters (not
+ * counting the terminating '0') without reallocation. Unlike kstr_grow(), the
+ * size is not rounded up; use it when the final size is known.
+ */
+void kstr_reserve(kstr *self, int slen);
+
 /* This function assigns the empty string to the string. */
 void kstr_clear(kstr *self);
 void kstr_shrink(kstr *self, int max_size);
@@ -272,6 +327,16 @@ void kstr_assign_kstr(kstr *self, kstr *assign_str);
 /* This function assigns the content of a raw buffer to the string. */
 void kstr_assign_buf(kstr *self, const void *buf, int buf_len);
 
+/* This function exchanges the content of the two strings without copying it.
+ * The short strings are copied.
+ */
+void kstr_swap(kstr *first, kstr *second);
+
+/* This function moves the content of 'src' to the string, without copying it
+ * unless it is short. 'src' is left empty.
+ */
+void kstr_take(kstr *self, kstr *src);
+
 /* This function appends a character to the string. */
 void kstr_append_char(kstr *self, char c);
 
@@ -374,10 +439,17 @@ void kmo_clearerror();
 
 /**
  * This function should be called when a fatal error occurs.
- * The program will terminate immediately.
+ * The program will terminate immediately, after calling the hook set with
+ * kmo_set_fatal_hook(), if any.
  */
 void kmo_fatalerror(const char *format, ...);
 
+/**
+ * This function sets the function called by kmo_fatalerror() before the
+ * program exits, such as a function that flushes the logs. NULL removes it.
+ */
+void kmo_set_fatal_hook(void (*hook) (void));
+
 
 /*******************************************/
 /* Misc. functions. */
@@ -0,0 +1,338 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#include "kmo_heap.h"
+
+#ifdef __KMO_HEAP_STATS__
+
+/* This file manages the blocks itself. */
+#undef free
+
+/* Initial size of the table of the live blocks. It must be a power of 2. */
+#define KMO_HEAP_TABLE_MIN_SIZE	1024
+
+/* Entry of the table of the live blocks. */
+struct kmo_heap_block {
+    void *ptr;
+    uint32_t size;
+    uint32_t tag;
+};
+
+/* Table of the blocks allocated by kmo_heap_alloc() and not yet freed, with
+ * open addressing and linear probing. The blocks allocated directly with
+ * malloc() are not in the table, so that they can still be released with
+ * free(). The table is allocated with malloc() and protected by a spin lock,
+ * since the worker threads allocate too.
+ */
+static struct kmo_heap_block *block_table = NULL;
+static uint32_t block_table_size = 0;
+static uint32_t nb_block = 0;
+static volatile int block_table_lock = 0;
+
+/* Accounting of a tag. */
+struct kmo_heap_stat {
+
+    /* Number of bytes currently allocated, and the maximum reached. */
+    uint64_t current;
+    uint64_t peak;
+
+    /* Number of blocks ever allocated, and number of blocks not yet freed. */
+    uint64_t count;
+    uint64_t live;
+
+    /* Number of bytes allocated when the current command began, and the
+     * maximum reached since.
+     */
+    uint64_t command_base;
+    uint64_t command_peak;
+
+    /* Largest growth of the heap during a command, and the identifier of that
+     * command.
+     */
+    uint64_t command_max;
+    int command_max_id;
+};
+
+static const char *tag_name_array[KMO_HEAP_NB_TAG] = {
+    "other", "k3p", "knp", "eval", "pkg", "maildb", "crypt"
+};
+
+/* Accounting of each tag, and of the whole heap. */
+static struct kmo_heap_stat stat_array[KMO_HEAP_NB_TAG];
+static struct kmo_heap_stat total_stat;
+
+/* Tag charged for the blocks allocated now by this thread. The worker threads
+ * do not set it, so their blocks are charged to KMO_HEAP_OTHER instead of the
+ * step the main thread is in.
+ */
+static __thread int current_tag = KMO_HEAP_OTHER;
+
+/* This function charges 'delta' bytes (possibly negative) and 'live_delta'
+ * blocks to the tag specified. The caller holds the lock of the table.
+ */
+static void kmo_heap_charge(int tag, int64_t delta, int live_delta) {
+    struct kmo_heap_stat *stat_list[2] = { stat_array + tag, &total_stat };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+    	struct kmo_heap_stat *stat = stat_list[i];
+	stat->current += delta;
+	stat->live += live_delta;
+	if (live_delta > 0) stat->count++;
+	if (stat->current > stat->peak) stat->peak = stat->current;
+	if (stat->current > stat->command_peak) stat->command_peak = stat->current;
+    }
+}
+
+static void kmo_heap_lock() {
+    while (__sync_lock_test_and_set(&block_table_lock, 1)) {}
+}
+
+static void kmo_heap_unlock() {
+    __sync_lock_release(&block_table_lock);
+}
+
+/* This function returns the slot of the table where the block specified is, or
+ * the empty slot where it would be inserted.
+ */
+static struct kmo_heap_block * kmo_heap_find_slot(void *ptr) {
+    uint32_t mask = block_table_size - 1;
+    uint32_t i = (uint32_t) ((uintptr_t) ptr >> 4) * 2654435761u & mask;
+
+    while (block_table[i].ptr && block_table[i].ptr != ptr) i = (i + 1) & mask;
+    return block_table + i;
+}
+
+/* This function adds the block specified to the table. The caller holds the
+ * lock of the table.
+ */
+static void kmo_heap_insert(void *ptr, uint32_t size, uint32_t tag) {
+    struct kmo_heap_block *slot;
+
+    /* Keep the table half empty. */
+    if (2 * (nb_block + 1) > block_table_size) {
+    	struct kmo_heap_block *old_table = block_table;
+	uint32_t old_size = block_table_size;
+	uint32_t i;
+
+	block_table_size = old_size ? old_size * 2 : KMO_HEAP_TABLE_MIN_SIZE;
+	block_table = calloc(block_table_size, sizeof(struct kmo_heap_block));
+
+	if (block_table == NULL) {
+            fprintf(stderr, "out of memory");
+            exit(1);
+	}
+
+	for (i = 0; i < old_size; i++) {
+	    if (old_table[i].ptr) *kmo_heap_find_slot(old_table[i].ptr) = old_table[i];
+	}
+
+	free(old_table);
+    }
+
+    slot = kmo_heap_find_slot(ptr);
+    slot->ptr = ptr;
+    slot->size = size;
+    slot->tag = tag;
+    nb_block++;
+}
+
+/* This function removes the block specified from the table and copies its
+ * entry in 'block'. It returns -1 if the block is not in the table. The caller
+ * holds the lock of the table.
+ */
+static int kmo_heap_remove(void *ptr, struct kmo_heap_block *block) {
+    uint32_t mask = block_table_size - 1;
+    struct kmo_heap_block *slot;
+    uint32_t i, j;
+
+    if (nb_block == 0) return -1;
+
+    slot = kmo_heap_find_slot(ptr);
+    if (slot->ptr == NULL) return -1;
+
+    *block = *slot;
+    nb_block--;
+
+    /* Shift back the entries that follow, so that no probe sequence is broken
+     * by the slot emptied.
+     */
+    i = slot - block_table;
+    j = i;
+
+    while (1) {
+    	uint32_t home;
+
+    	block_table[i].ptr = NULL;
+
+	while (1) {
+	    j = (j + 1) & mask;
+	    if (block_table[j].ptr == NULL) return 0;
+
+	    /* The entry at 'j' may move to 'i' if its home slot is not
+	     * cyclically in (i, j].
+	     */
+	    home = (uint32_t) ((uintptr_t) block_table[j].ptr >> 4) * 2654435761u & mask;
+	    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) break;
+	}
+
+	block_table[i] = block_table[j];
+	i = j;
+    }
+}
+
+/* This function allocates a block of 'count' bytes, charged to the current
+ * tag. The block is zeroed if 'zero_flag' is true. It exits when KMO is out of
+ * memory, like kmo_malloc().
+ */
+void * kmo_heap_alloc(unsigned int count, int zero_flag) {
+    void *ptr = zero_flag ? calloc(1, count) : malloc(count);
+
+    if (ptr == NULL) {
+        fprintf(stderr, "out of memory");
+        exit(1);
+    }
+
+    kmo_heap_lock();
+    kmo_heap_insert(ptr, count, current_tag);
+    kmo_heap_charge(current_tag, count, 1);
+    kmo_heap_unlock();
+    return ptr;
+}
+
+/* This function resizes the block specified, like kmo_realloc(). The block
+ * remains charged to its tag. The blocks allocated directly with malloc() are
+ * resized without being accounted.
+ */
+void * kmo_heap_realloc(void *ptr, unsigned int count) {
+    struct kmo_heap_block block;
+    int found_flag;
+
+    if (ptr == NULL) return kmo_heap_alloc(count, 0);
+
+    kmo_heap_lock();
+    found_flag = ! kmo_heap_remove(ptr, &block);
+    kmo_heap_unlock();
+
+    ptr = realloc(ptr, count);
+
+    if (ptr == NULL) {
+        fprintf(stderr, "out of memory");
+        exit(1);
+    }
+
+    if (found_flag) {
+	kmo_heap_lock();
+	kmo_heap_insert(ptr, count, block.tag);
+	kmo_heap_charge(block.tag, (int64_t) count - (int64_t) block.size, 0);
+	kmo_heap_unlock();
+    }
+
+    return ptr;
+}
+
+/* This function frees the block specified, which may have been allocated
+ * directly with malloc(). It replaces free().
+ */
+void kmo_heap_free(void *ptr) {
+    struct kmo_heap_block block;
+
+    if (ptr == NULL) return;
+
+    kmo_heap_lock();
+    if (! kmo_heap_remove(ptr, &block)) kmo_heap_charge(block.tag, -(int64_t) block.size, -1);
+    kmo_heap_unlock();
+    free(ptr);
+}
+
+/* This function sets the tag charged for the blocks allocated from now on by
+ * the calling thread. It returns the previous tag, to be restored afterwards.
+ */
+int kmo_heap_set_tag(int tag) {
+    int prev_tag = current_tag;
+    assert(tag >= 0 && tag < KMO_HEAP_NB_TAG);
+    current_tag = tag;
+    return prev_tag;
+}
+
+/* This function marks the beginning of a command, for the peak report of
+ * kmo_heap_dump_command().
+ */
+void kmo_heap_begin_command() {
+    int i;
+
+    for (i = 0; i <= KMO_HEAP_NB_TAG; i++) {
+    	struct kmo_heap_stat *stat = (i < KMO_HEAP_NB_TAG) ? stat_array + i : &total_stat;
+	stat->command_base = stat->current;
+	stat->command_peak = stat->current;
+    }
+}
+
+/* This function marks the end of the command having the identifier specified.
+ * The commands that grew the heap the most are remembered by kmo_heap_dump().
+ */
+void kmo_heap_end_command(int id) {
+    int i;
+
+    for (i = 0; i <= KMO_HEAP_NB_TAG; i++) {
+    	struct kmo_heap_stat *stat = (i < KMO_HEAP_NB_TAG) ? stat_array + i : &total_stat;
+	uint64_t growth = stat->command_peak - stat->command_base;
+
+	if (growth > stat->command_max) {
+	    stat->command_max = growth;
+	    stat->command_max_id = id;
+	}
+    }
+}
+
+/* This function appends the peak growth of the heap during the last command to
+ * the string specified, on a single line, for the tags that grew:
+ *   total=+<bytes> <tag>=+<bytes> ...
+ */
+void kmo_heap_dump_command(kstr *str) {
+    kstr item;
+    int i;
+
+    kstr_init(&item);
+    kstr_sf(&item, "total=+%llu", (unsigned long long) (total_stat.command_peak - total_stat.command_base));
+    kstr_append_kstr(str, &item);
+
+    for (i = 0; i < KMO_HEAP_NB_TAG; i++) {
+    	struct kmo_heap_stat *stat = stat_array + i;
+	if (stat->command_peak == stat->command_base) continue;
+
+	kstr_sf(&item, " %s=+%llu", tag_name_array[i], (unsigned long long) (stat->command_peak - stat->command_base));
+	kstr_append_kstr(str, &item);
+    }
+
+    kstr_append_char(str, '\n');
+    kstr_free(&item);
+}
+
+/* This function appends the line describing the accounting specified to the
+ * string specified.
+ */
+static void kmo_heap_dump_stat(kstr *str, const char *name, struct kmo_heap_stat *stat) {
+    kstr line;
+
+    kstr_init(&line);
+    kstr_sf(&line, "heap %s current=%llu peak=%llu count=%llu live=%llu command_peak=%llu command=%x\n",
+    	    name, (unsigned long long) stat->current, (unsigned long long) stat->peak,
+	    (unsigned long long) stat->count, (unsigned long long) stat->live,
+	    (unsigned long long) stat->command_max, stat->command_max_id);
+    kstr_append_kstr(str, &line);
+    kstr_free(&line);
+}
+
+/* This function appends the accounting of the heap to the string specified,
+ * one tag per line, as kmo_stats_dump() does:
+ *   heap <tag> current=<bytes> peak=<bytes> count=<blocks> live=<blocks>
+ *        command_peak=<bytes> command=<id of that command>
+ */
+void kmo_heap_dump(kstr *str) {
+    int i;
+
+    kmo_heap_dump_stat(str, "total", &total_stat);
+    for (i = 0; i < KMO_HEAP_NB_TAG; i++) kmo_heap_dump_stat(str, tag_name_array[i], stat_array + i);
+}
+
+#endif
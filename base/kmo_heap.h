@@ -0,0 +1,53 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KMO_HEAP_H
+#define _KMO_HEAP_H
+
+#include "kmo_base.h"
+
+/* Accounting tags of the heap blocks. A block is charged to the tag that was
+ * current when it was allocated, until it is freed.
+ */
+enum {
+    KMO_HEAP_OTHER,
+    KMO_HEAP_K3P,
+    KMO_HEAP_KNP,
+    KMO_HEAP_EVAL,
+    KMO_HEAP_PKG,
+    KMO_HEAP_MAILDB,
+    KMO_HEAP_CRYPT,
+    KMO_HEAP_NB_TAG
+};
+
+/* The heap accounting is compiled in only when __KMO_HEAP_STATS__ is defined
+ * ('heap_stats' build option). It keeps, for each tag, the current and the
+ * peak number of bytes allocated, the number of blocks allocated and live, and
+ * the peak growth of the heap during a command. Otherwise, the functions below
+ * do nothing and the allocation wrappers are left untouched.
+ *
+ * Each thread has its own current tag, which is KMO_HEAP_OTHER until the
+ * thread changes it. The main thread changes it around the natural steps of
+ * the processing:
+ *   int tag = kmo_heap_set_tag(KMO_HEAP_KNP);
+ *   ...
+ *   kmo_heap_set_tag(tag);
+ */
+#ifdef __KMO_HEAP_STATS__
+
+int kmo_heap_set_tag(int tag);
+void kmo_heap_begin_command();
+void kmo_heap_end_command(int id);
+void kmo_heap_dump_command(kstr *str);
+void kmo_heap_dump(kstr *str);
+
+#else
+
+static inline int kmo_heap_set_tag(int tag) { return tag; }
+static inline void kmo_heap_begin_command() {}
+static inline void kmo_heap_end_command(int id) { (void) id; }
+static inline void kmo_heap_dump_command(kstr *str) { (void) str; }
+static inline void kmo_heap_dump(kstr *str) { (void) str; }
+
+#endif
+
+#endif
@@ -0,0 +1,204 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#include "kmo_stats.h"
+#include "kmo_trace.h"
+
+#define KMO_STAT_COUNTER(name)	{ name, 0, 0, 0, 0, { 0 } }
+#define KMO_STAT_TIMER(name)	{ name, 1, 0, 0, 0, { 0 } }
+
+/* Statistics that are always present, indexed by identifier. */
+static struct kmo_stat fixed_array[KMO_STAT_NB] = {
+    KMO_STAT_TIMER("maildb.set_mail_info"),
+    KMO_STAT_TIMER("maildb.set_unsigned_mail"),
+    KMO_STAT_TIMER("maildb.get_mail_info"),
+    KMO_STAT_TIMER("maildb.get_mail_info_batch"),
+    KMO_STAT_TIMER("maildb.load_mail_info"),
+    KMO_STAT_TIMER("maildb.sender_info"),
+    KMO_STAT_TIMER("maildb.sig_key_info"),
+    KMO_STAT_TIMER("maildb.pwd"),
+    KMO_STAT_TIMER("maildb.commit_group"),
+    KMO_STAT_TIMER("maildb.maintain"),
+    KMO_STAT_COUNTER("hub.read_bytes"),
+    KMO_STAT_COUNTER("hub.write_bytes"),
+    KMO_STAT_COUNTER("hub.timeouts"),
+    KMO_STAT_COUNTER("cache.sig_key.hit"),
+    KMO_STAT_COUNTER("cache.sig_key.miss"),
+    KMO_STAT_COUNTER("cache.sym_key.hit"),
+    KMO_STAT_COUNTER("cache.sym_key.miss"),
+    KMO_STAT_COUNTER("cache.status.hit"),
+    KMO_STAT_COUNTER("cache.status.miss"),
+    KMO_STAT_COUNTER("cache.resolver.hit"),
+    KMO_STAT_COUNTER("cache.resolver.miss"),
+    KMO_STAT_COUNTER("knp.pool.hit"),
+    KMO_STAT_COUNTER("knp.pool.miss"),
+    KMO_STAT_COUNTER("knp.compress.raw_bytes"),
+    KMO_STAT_COUNTER("knp.compress.packed_bytes"),
+    KMO_STAT_COUNTER("knp.decompress.packed_bytes"),
+    KMO_STAT_COUNTER("knp.decompress.raw_bytes"),
+    KMO_STAT_COUNTER("knp.breaker.opened"),
+    KMO_STAT_COUNTER("knp.breaker.rejected"),
+    KMO_STAT_COUNTER("eval.fast_reject")
+};
+
+/* Hash of the statistics created by name, keyed by the name of the statistic.
+ * The statistics are listed in creation order.
+ */
+static khash named_hash;
+
+/* True if the hash above has been initialized. */
+static int named_hash_init_flag = 0;
+
+/* This function returns the current time in microseconds, as given by a clock
+ * that is not affected by the changes of the system time.
+ */
+uint64_t kmo_stats_now() {
+    #ifdef __WINDOWS__
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t) count.QuadPart * 1000000 / (uint64_t) freq.QuadPart;
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    #endif
+}
+
+/* This function records an event having the value specified. */
+static void kmo_stat_record(struct kmo_stat *stat, uint64_t value) {
+    stat->count++;
+    stat->total += value;
+    if (value > stat->max) stat->max = value;
+
+    if (stat->timer_flag) {
+    	int i = 0;
+	while (i < KMO_STATS_NB_BUCKET - 1 && (value >> i)) i++;
+	stat->bucket_array[i]++;
+    }
+}
+
+/* This function adds an event having the value specified to the fixed
+ * counter specified.
+ */
+void kmo_stats_add(int id, uint64_t value) {
+    assert(id >= 0 && id < KMO_STAT_NB);
+    kmo_stat_record(fixed_array + id, value);
+}
+
+/* This function adds an event that started at the time specified, as returned
+ * by kmo_stats_now(), to the fixed timer specified.
+ */
+void kmo_stats_add_time(int id, uint64_t start) {
+    assert(id >= 0 && id < KMO_STAT_NB);
+    assert(fixed_array[id].timer_flag);
+    kmo_stats_record_time(fixed_array + id, start);
+}
+
+/* This function returns the timer having the name specified, in printf()
+ * format. The timer is created if it does not exist.
+ */
+struct kmo_stat * kmo_stats_get_timer(const char *format, ...) {
+    char name[KMO_STATS_MAX_NAME];
+    struct kmo_stat *stat;
+    va_list arg;
+
+    va_start(arg, format);
+    vsnprintf(name, sizeof(name), format, arg);
+    va_end(arg);
+    name[KMO_STATS_MAX_NAME - 1] = 0;
+
+    if (! named_hash_init_flag) {
+    	khash_init_func(&named_hash, khash_cstr_key, khash_cstr_cmp);
+	named_hash_init_flag = 1;
+    }
+
+    stat = (struct kmo_stat *) khash_get(&named_hash, name);
+
+    if (stat == NULL) {
+    	stat = (struct kmo_stat *) kmo_calloc(sizeof(struct kmo_stat));
+	strcpy(stat->name, name);
+	stat->timer_flag = 1;
+	khash_add(&named_hash, stat->name, stat);
+    }
+
+    return stat;
+}
+
+/* This function adds an event that started at the time specified, as returned
+ * by kmo_stats_now(), to the timer specified.
+ */
+void kmo_stats_record_time(struct kmo_stat *stat, uint64_t start) {
+    uint64_t now = kmo_stats_now();
+    kmo_stat_record(stat, now > start ? now - start : 0);
+    
+    /* Each timed event is also a span of the flight recorder. */
+    kmo_trace_span(stat->name, start);
+}
+
+/* This function appends the line describing a counter to the string specified.
+ * It can be used for the counters kept outside this module.
+ */
+void kmo_stats_dump_counter(kstr *str, const char *name, uint64_t count, uint64_t total) {
+    kstr line;
+    kstr_init(&line);
+    kstr_sf(&line, "counter %s count=%llu total=%llu\n", name, (unsigned long long) count,
+    	    (unsigned long long) total);
+    kstr_append_kstr(str, &line);
+    kstr_free(&line);
+}
+
+/* This function appends the line describing the statistic specified to the
+ * string specified.
+ */
+static void kmo_stats_dump_stat(kstr *str, struct kmo_stat *stat) {
+    kstr line;
+    int i;
+
+    if (! stat->timer_flag) {
+    	kmo_stats_dump_counter(str, stat->name, stat->count, stat->total);
+	return;
+    }
+
+    kstr_init(&line);
+    kstr_sf(&line, "timer %s count=%llu total_us=%llu max_us=%llu hist=", stat->name,
+    	    (unsigned long long) stat->count, (unsigned long long) stat->total, (unsigned long long) stat->max);
+    kstr_append_kstr(str, &line);
+
+    for (i = 0; i < KMO_STATS_NB_BUCKET; i++) {
+    	kstr_sf(&line, i ? ",%llu" : "%llu", (unsigned long long) stat->bucket_array[i]);
+	kstr_append_kstr(str, &line);
+    }
+
+    kstr_append_char(str, '\n');
+    kstr_free(&line);
+}
+
+/* This function appends the description of all the statistics to the string
+ * specified, one statistic per line:
+ *   counter <name> count=<events> total=<sum>
+ *   timer <name> count=<events> total_us=<sum> max_us=<max> hist=<b0>,...,<b23>
+ */
+void kmo_stats_dump(kstr *str) {
+    int i;
+
+    for (i = 0; i < KMO_STAT_NB; i++) kmo_stats_dump_stat(str, fixed_array + i);
+
+    if (named_hash_init_flag) {
+    	int index = -1;
+
+	for (i = 0; i < named_hash.size; i++)
+	    kmo_stats_dump_stat(str, (struct kmo_stat *) khash_iter_next_value(&named_hash, &index));
+    }
+}
+
+/* This function frees the statistics created by name. */
+void kmo_stats_free() {
+    int i, index = -1;
+
+    if (! named_hash_init_flag) return;
+
+    for (i = 0; i < named_hash.size; i++) free(khash_iter_next_value(&named_hash, &index));
+
+    khash_free(&named_hash);
+    named_hash_init_flag = 0;
+}
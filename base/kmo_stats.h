@@ -0,0 +1,96 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KMO_STATS_H
+#define _KMO_STATS_H
+
+#include "kmo_base.h"
+
+/* Number of buckets of a latency histogram. The bucket i counts the durations
+ * shorter than 2^i microseconds that were not counted by the previous bucket.
+ * The last bucket counts the durations of 2^22 microseconds (about 4 seconds)
+ * and more.
+ */
+#define KMO_STATS_NB_BUCKET 	24
+
+/* Maximum length of the name of a statistic. */
+#define KMO_STATS_MAX_NAME  	64
+
+/* Identifiers of the statistics that are always present. The other statistics
+ * are created by name on first use.
+ */
+enum {
+    KMO_STAT_MAILDB_SET_MAIL_INFO,
+    KMO_STAT_MAILDB_SET_UNSIGNED_MAIL,
+    KMO_STAT_MAILDB_GET_MAIL_INFO,
+    KMO_STAT_MAILDB_GET_MAIL_INFO_BATCH,
+    KMO_STAT_MAILDB_LOAD_MAIL_INFO,
+    KMO_STAT_MAILDB_SENDER_INFO,
+    KMO_STAT_MAILDB_SIG_KEY_INFO,
+    KMO_STAT_MAILDB_PWD,
+    KMO_STAT_MAILDB_COMMIT_GROUP,
+    KMO_STAT_MAILDB_MAINTAIN,
+    KMO_STAT_HUB_READ,
+    KMO_STAT_HUB_WRITE,
+    KMO_STAT_HUB_TIMEOUT,
+    KMO_STAT_SIG_KEY_CACHE_HIT,
+    KMO_STAT_SIG_KEY_CACHE_MISS,
+    KMO_STAT_SYM_KEY_CACHE_HIT,
+    KMO_STAT_SYM_KEY_CACHE_MISS,
+    KMO_STAT_STATUS_CACHE_HIT,
+    KMO_STAT_STATUS_CACHE_MISS,
+    KMO_STAT_RESOLVER_CACHE_HIT,
+    KMO_STAT_RESOLVER_CACHE_MISS,
+    KMO_STAT_KNP_POOL_HIT,
+    KMO_STAT_KNP_POOL_MISS,
+    KMO_STAT_KNP_COMPRESS_RAW,
+    KMO_STAT_KNP_COMPRESS_PACKED,
+    KMO_STAT_KNP_DECOMPRESS_PACKED,
+    KMO_STAT_KNP_DECOMPRESS_RAW,
+    KMO_STAT_KNP_BREAKER_OPEN,
+    KMO_STAT_KNP_BREAKER_REJECT,
+    KMO_STAT_EVAL_FAST_REJECT,
+    KMO_STAT_NB
+};
+
+/* Counter or latency histogram. A counter counts events and sums a value per
+ * event, e.g. a number of bytes. A timer also sums a duration per event, in
+ * microseconds, and keeps its histogram.
+ */
+struct kmo_stat {
+
+    /* Name of the statistic. */
+    char name[KMO_STATS_MAX_NAME];
+
+    /* True if the statistic is a timer. */
+    int timer_flag;
+
+    /* Number of events. */
+    uint64_t count;
+
+    /* Sum and maximum of the values of the events. */
+    uint64_t total;
+    uint64_t max;
+
+    /* Histogram of the durations, for a timer. */
+    uint64_t bucket_array[KMO_STATS_NB_BUCKET];
+};
+
+/* The statistics are global and always enabled. Recording an event costs a few
+ * additions, and a hash lookup for the statistics created by name. They must be
+ * updated by the main thread only.
+ */
+uint64_t kmo_stats_now();
+void kmo_stats_add(int id, uint64_t value);
+void kmo_stats_add_time(int id, uint64_t start);
+struct kmo_stat * kmo_stats_get_timer(const char *format, ...);
+void kmo_stats_record_time(struct kmo_stat *stat, uint64_t start);
+void kmo_stats_dump(kstr *str);
+void kmo_stats_dump_counter(kstr *str, const char *name, uint64_t count, uint64_t total);
+void kmo_stats_free();
+
+/* This function counts an event of the counter specified. */
+static inline void kmo_stats_count(int id) {
+    kmo_stats_add(id, 1);
+}
+
+#endif
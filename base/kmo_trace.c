@@ -0,0 +1,81 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#include "kmo_trace.h"
+#include "kmo_stats.h"
+
+/* Span recorded by the flight recorder. The times are from kmo_stats_now(). */
+struct kmo_trace_span {
+    char name[KMO_TRACE_MAX_NAME];
+    uint64_t start;
+    uint64_t end;
+};
+
+/* Circular buffer of the spans, and number of spans ever recorded. The span
+ * number i is stored at i % KMO_TRACE_NB_SPAN.
+ */
+static struct kmo_trace_span span_array[KMO_TRACE_NB_SPAN];
+static uint64_t nb_span = 0;
+
+/* This function records a span having the name specified that started at the
+ * time specified, as returned by kmo_stats_now(), and that ends now.
+ */
+void kmo_trace_span(const char *name, uint64_t start) {
+    struct kmo_trace_span *span = span_array + (nb_span % KMO_TRACE_NB_SPAN);
+    int i;
+    
+    /* The names are identifiers, but don't let one break the JSON. */
+    for (i = 0; i < KMO_TRACE_MAX_NAME - 1 && name[i]; i++) {
+    	char c = name[i];
+	span->name[i] = (c == '"' || c == '\\' || (unsigned char) c < 0x20) ? '_' : c;
+    }
+    
+    span->name[i] = 0;
+    span->start = start;
+    span->end = kmo_stats_now();
+    if (span->end < start) span->end = start;
+    
+    nb_span++;
+}
+
+/* This function appends the spans kept that started at or after the time
+ * specified to the string specified, as Chrome trace events ("complete"
+ * events, in microseconds), one per line, each followed by a comma. The result
+ * can be used in the JSON array format of the Chrome traces, whose closing
+ * ']' is optional, so that the events of several dumps can be appended to the
+ * same file.
+ */
+void kmo_trace_dump_events(kstr *str, uint64_t since) {
+    uint64_t i = (nb_span > KMO_TRACE_NB_SPAN) ? nb_span - KMO_TRACE_NB_SPAN : 0;
+    kstr line;
+    
+    kstr_init(&line);
+    
+    for (; i < nb_span; i++) {
+    	struct kmo_trace_span *span = span_array + (i % KMO_TRACE_NB_SPAN);
+	
+	if (span->start < since) continue;
+	
+	kstr_sf(&line, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":1},\n",
+	    	span->name, (unsigned long long) span->start, (unsigned long long) (span->end - span->start));
+	kstr_append_kstr(str, &line);
+    }
+    
+    kstr_free(&line);
+}
+
+/* This function appends all the spans kept to the string specified, as a
+ * Chrome trace in the JSON object format.
+ */
+void kmo_trace_dump(kstr *str) {
+    kstr_append_cstr(str, "{\"traceEvents\":[\n");
+    kmo_trace_dump_events(str, 0);
+    
+    /* Remove the last comma. */
+    if (str->slen >= 2 && str->data[str->slen - 2] == ',') {
+    	str->data[str->slen - 2] = '\n';
+	str->slen--;
+	str->data[str->slen] = 0;
+    }
+    
+    kstr_append_cstr(str, "],\"displayTimeUnit\":\"ms\"}\n");
+}
@@ -0,0 +1,27 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KMO_TRACE_H
+#define _KMO_TRACE_H
+
+#include "kmo_base.h"
+
+/* Number of spans kept by the flight recorder. The oldest spans are
+ * overwritten.
+ */
+#define KMO_TRACE_NB_SPAN	4096
+
+/* Maximum length of the name of a span. */
+#define KMO_TRACE_MAX_NAME	48
+
+/* The flight recorder keeps the last spans recorded, i.e. the named intervals
+ * of time spent in the natural steps of the processing (K3P commands, KNP
+ * phases, maildb operations, cryptography, waits). The spans end when they are
+ * recorded, so the enclosing spans are recorded after the spans they contain.
+ * Recording a span costs a copy of its name. The spans must be recorded by the
+ * main thread only, like the statistics.
+ */
+void kmo_trace_span(const char *name, uint64_t start);
+void kmo_trace_dump_events(kstr *str, uint64_t since);
+void kmo_trace_dump(kstr *str);
+
+#endif
@@ -0,0 +1,171 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#include "krope.h"
+
+void krope_init(krope *self, uint32_t chunk_size) {
+    self->seg_array = NULL;
+    self->nb_seg = 0;
+    self->seg_alloc = 0;
+    self->chunk_size = chunk_size ? chunk_size : KROPE_DEF_CHUNK_SIZE;
+    self->len = 0;
+    self->pos = 0;
+    self->read_seg = 0;
+    self->read_off = 0;
+}
+
+void krope_clean(krope *self) {
+    if (self == NULL) return;
+    krope_clear(self);
+    free(self->seg_array);
+    self->seg_array = NULL;
+    self->seg_alloc = 0;
+}
+
+void krope_clear(krope *self) {
+    int i;
+
+    for (i = 0; i < self->nb_seg; i++) {
+    	struct krope_seg *seg = self->seg_array + i;
+
+	if (seg->allocated) free(seg->data);
+	else if (seg->free_func) seg->free_func(seg->data);
+    }
+
+    self->nb_seg = 0;
+    self->len = 0;
+    self->pos = 0;
+    self->read_seg = 0;
+    self->read_off = 0;
+}
+
+/* This function adds a segment at the end of the rope and returns it. */
+static struct krope_seg * krope_add_seg(krope *self) {
+    struct krope_seg *seg;
+
+    if (self->nb_seg == self->seg_alloc) {
+    	self->seg_alloc = self->seg_alloc ? self->seg_alloc * 2 : 8;
+	self->seg_array = (struct krope_seg *) kmo_realloc(self->seg_array, self->seg_alloc * sizeof(struct krope_seg));
+    }
+
+    seg = self->seg_array + self->nb_seg++;
+    seg->data = NULL;
+    seg->len = 0;
+    seg->allocated = 0;
+    seg->free_func = NULL;
+    return seg;
+}
+
+/* This function returns the last chunk of the rope if it has room for 'size'
+ * bytes, otherwise it allocates a new chunk that can hold at least 'size'
+ * bytes.
+ */
+static struct krope_seg * krope_get_chunk(krope *self, uint32_t size) {
+    struct krope_seg *seg = self->nb_seg ? self->seg_array + self->nb_seg - 1 : NULL;
+
+    if (seg && seg->allocated && seg->allocated - seg->len >= size) return seg;
+
+    seg = krope_add_seg(self);
+    seg->allocated = size > self->chunk_size ? size : self->chunk_size;
+    seg->data = (uint8_t *) kmo_malloc(seg->allocated);
+    return seg;
+}
+
+void krope_write(krope *self, const uint8_t *data, uint32_t len) {
+    while (len) {
+    	struct krope_seg *seg = krope_get_chunk(self, 1);
+	uint32_t n = seg->allocated - seg->len;
+	if (n > len) n = len;
+
+	memcpy(seg->data + seg->len, data, n);
+	seg->len += n;
+	self->len += n;
+	data += n;
+	len -= n;
+    }
+}
+
+uint8_t * krope_append_nbytes(krope *self, uint32_t size) {
+    struct krope_seg *seg = krope_get_chunk(self, size);
+    uint8_t *ret_pos = seg->data + seg->len;
+
+    seg->len += size;
+    self->len += size;
+    return ret_pos;
+}
+
+void krope_adopt(krope *self, uint8_t *data, uint32_t len, void (*free_func)(void *)) {
+    struct krope_seg *seg = krope_add_seg(self);
+    seg->data = data;
+    seg->len = len;
+    seg->free_func = free_func;
+    self->len += len;
+}
+
+uint32_t krope_read(krope *self, uint8_t *data, uint32_t len) {
+    uint32_t nb_read = 0;
+
+    while (nb_read < len && self->read_seg < self->nb_seg) {
+    	struct krope_seg *seg = self->seg_array + self->read_seg;
+	uint32_t n = seg->len - self->read_off;
+
+	/* The segment has been read. The read position stays at the end of the
+	 * last segment, since more data may be written to it.
+	 */
+	if (n == 0) {
+	    if (self->read_seg + 1 == self->nb_seg) break;
+	    self->read_seg++;
+	    self->read_off = 0;
+	    continue;
+	}
+
+	if (n > len - nb_read) n = len - nb_read;
+	memcpy(data + nb_read, seg->data + self->read_off, n);
+	self->read_off += n;
+	nb_read += n;
+    }
+
+    self->pos += nb_read;
+    return nb_read;
+}
+
+void krope_seek(krope *self, int32_t offset, int whence) {
+    int64_t target = offset;
+    uint32_t left;
+
+    switch (whence) {
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            target += self->pos;
+            break;
+        case SEEK_END:
+            target += self->len;
+            break;
+	default: assert(0);
+    }
+
+    if (target < 0) target = 0;
+    if (target > self->len) target = self->len;
+    self->pos = (uint32_t) target;
+
+    /* Locate the segment containing the new position. */
+    left = self->pos;
+    self->read_seg = 0;
+
+    while (self->read_seg + 1 < self->nb_seg && left > self->seg_array[self->read_seg].len) {
+    	left -= self->seg_array[self->read_seg].len;
+	self->read_seg++;
+    }
+
+    self->read_off = left;
+}
+
+void krope_flatten(krope *self, kbuffer *buf) {
+    int i;
+
+    kbuffer_set_size(buf, buf->len + self->len);
+
+    for (i = 0; i < self->nb_seg; i++) {
+    	kbuffer_write(buf, self->seg_array[i].data, self->seg_array[i].len);
+    }
+}
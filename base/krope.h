@@ -0,0 +1,144 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KROPE_H
+#define _KROPE_H
+
+#include "kmo_base.h"
+#include "kbuffer.h"
+#include "ntohll.h"
+
+/* Default size of a rope chunk. */
+#define KROPE_DEF_CHUNK_SIZE	(64*1024)
+
+/* Segment of a rope. The chunks allocated by the rope can be filled up to
+ * 'allocated' bytes. The slices adopted by the rope are never written to; their
+ * 'allocated' field is 0. 'free_func' is called on the data of an adopted slice
+ * when the rope is cleared, if it is not NULL.
+ */
+struct krope_seg {
+    uint8_t *data;
+    uint32_t len;
+    uint32_t allocated;
+    void (*free_func)(void *);
+};
+
+/* Segmented buffer. The data is stored in a chain of fixed-size chunks instead
+ * of a single buffer, so that a large payload is assembled without being
+ * copied when it grows, and without the slack of kbuffer. External slices can
+ * be inserted in the chain without being copied.
+ *
+ * The content of the rope is sent segment by segment by iterating over
+ * 'seg_array'. The reading functions mirror those of kbuffer.
+ */
+typedef struct krope {
+
+    /* Segments of the rope, in order. */
+    struct krope_seg *seg_array;
+    int nb_seg;
+    int seg_alloc;
+
+    /* Size of the chunks allocated by the rope. */
+    uint32_t chunk_size;
+
+    /* Total length of the data, and read position. */
+    uint32_t len;
+    uint32_t pos;
+
+    /* Segment containing the read position, and offset in that segment. */
+    int read_seg;
+    uint32_t read_off;
+} krope;
+
+/* This function initializes the rope. 'chunk_size' is the size of the chunks
+ * allocated by the rope, 0 for the default size. No memory is allocated until
+ * the first write is made.
+ */
+void krope_init(krope *self, uint32_t chunk_size);
+
+/* This function releases the resources held by the rope. */
+void krope_clean(krope *self);
+
+/* This function empties the rope. The chunks are freed and 'free_func' is
+ * called on the adopted slices.
+ */
+void krope_clear(krope *self);
+
+/* This function appends 'len' bytes to the rope. */
+void krope_write(krope *self, const uint8_t *data, uint32_t len);
+
+/* This function grows the rope by 'size' contiguous bytes and returns a pointer
+ * to them, so that the caller can fill them.
+ */
+uint8_t * krope_append_nbytes(krope *self, uint32_t size);
+
+/* This function appends the external slice specified to the rope without
+ * copying it. The slice must not be modified until the rope is cleared.
+ * 'free_func' is called on 'data' when the rope is cleared, if it is not NULL.
+ */
+void krope_adopt(krope *self, uint8_t *data, uint32_t len, void (*free_func)(void *));
+
+/* This function reads up to 'len' bytes from the rope and advances the read
+ * position. It returns the number of bytes read.
+ */
+uint32_t krope_read(krope *self, uint8_t *data, uint32_t len);
+
+/* This function changes the read position in the rope, like kbuffer_seek(). */
+void krope_seek(krope *self, int32_t offset, int whence);
+
+/* This function appends the content of the rope to the buffer specified. It is
+ * used when the data must be contiguous.
+ */
+void krope_flatten(krope *self, kbuffer *buf);
+
+static inline uint32_t krope_tell(krope *self) {
+    return self->pos;
+}
+
+static inline uint32_t krope_left(krope *self) {
+    return self->len - self->pos;
+}
+
+static inline void krope_write8(krope *self, uint8_t data) {
+    krope_write(self, &data, sizeof(uint8_t));
+}
+
+static inline void krope_write16(krope *self, uint16_t data) {
+    uint16_t nbo = htons(data);
+    krope_write(self, (uint8_t *) &nbo, sizeof(uint16_t));
+}
+
+static inline void krope_write32(krope *self, uint32_t data) {
+    uint32_t nbo = htonl(data);
+    krope_write(self, (uint8_t *) &nbo, sizeof(uint32_t));
+}
+
+static inline void krope_write64(krope *self, uint64_t data) {
+    uint64_t nbo = htonll(data);
+    krope_write(self, (uint8_t *) &nbo, sizeof(uint64_t));
+}
+
+static inline uint8_t krope_read8(krope *self) {
+    uint8_t nbo = 0;
+    krope_read(self, &nbo, sizeof(uint8_t));
+    return nbo;
+}
+
+static inline uint16_t krope_read16(krope *self) {
+    uint16_t nbo = 0;
+    krope_read(self, (uint8_t *) &nbo, sizeof(uint16_t));
+    return ntohs(nbo);
+}
+
+static inline uint32_t krope_read32(krope *self) {
+    uint32_t nbo = 0;
+    krope_read(self, (uint8_t *) &nbo, sizeof(uint32_t));
+    return ntohl(nbo);
+}
+
+static inline uint64_t krope_read64(krope *self) {
+    uint64_t nbo = 0;
+    krope_read(self, (uint8_t *) &nbo, sizeof(uint64_t));
+    return ntohll(nbo);
+}
+
+#endif
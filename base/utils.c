@@ -42,6 +42,35 @@ void util_get_current_time(struct timeval *tv) {
     #endif
 }
 
+/* This function puts the time elapsed since an arbitrary point in the past in
+ * the timeval passed in the parameters. Unlike the current time, this time does
+ * not jump when the system clock is changed. Use it for the deadlines.
+ * Arguments:
+ * Timeval.
+ */
+void util_get_monotonic_time(struct timeval *tv) {
+    #ifdef __WINDOWS__
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    tv->tv_sec = count.QuadPart / freq.QuadPart;
+    tv->tv_usec = (count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+    
+    #elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+	    kmo_fatalerror("cannot get monotonic time");
+    }
+    
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+    
+    #else
+    util_get_current_time(tv);
+    #endif
+}
+
 /* This function returns -1 if first comes before second, 0 if the times are the
  * same and 1 if first comes after second.
  * Arguments:
@@ -300,6 +329,13 @@ int util_open_file(FILE **file_handle, char *path, char *mode) {
     	return -1;
     }
 
+    /* Opening /dev/fd/N duplicates the descriptor on Mac OS X and the BSDs, so
+     * the file offset is shared with the descriptor and with the previous
+     * opens. Rewind the file so that every pass reads it from the start. This
+     * fails harmlessly on pipes.
+     */
+    if (mode[0] == 'r') fseek(file, 0, SEEK_SET);
+
     *file_handle = file;
     return 0;
 }
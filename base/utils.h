@@ -13,6 +13,7 @@
 #endif
 
 void util_get_current_time(struct timeval *tv);
+void util_get_monotonic_time(struct timeval *tv);
 int util_timeval_cmp(struct timeval *first, struct timeval *second);
 void util_timeval_subtract(struct timeval *result, struct timeval *x, struct timeval *y);
 void util_timeval_add(struct timeval *result, struct timeval *x, struct timeval *y);
@@ -41,6 +41,57 @@ void kmocrypt_hash(kbuffer * input, kbuffer * hash, int algo) {
                         (size_t)input_size);
 }
 
+/**
+ * Initialize an incremental hash context for the algorithm specified.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int kmocrypt_hash_init(struct kmocrypt_hash_ctx *ctx, int algo) {
+    gcry_error_t err;
+
+    assert(gcry_md_test_algo(algo) == 0);
+
+    ctx->algo = algo;
+    err = gcry_md_open(&ctx->hd, algo, 0);
+
+    if (err) {
+        ctx->hd = NULL;
+        kmo_seterror("cannot open hash context: %s", gcry_strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Feed data to an incremental hash context.
+ */
+void kmocrypt_hash_update(struct kmocrypt_hash_ctx *ctx, const void *data, size_t len) {
+    gcry_md_write(ctx->hd, data, len);
+}
+
+/**
+ * Put the digest of the data fed to the context in 'digest', which must be at
+ * least kmocrypt_hash_len() bytes long, and free the context. The length of the
+ * digest is returned.
+ */
+uint32_t kmocrypt_hash_final(struct kmocrypt_hash_ctx *ctx, uint8_t *digest) {
+    uint32_t digest_len = gcry_md_get_algo_dlen(ctx->algo);
+
+    memcpy(digest, gcry_md_read(ctx->hd, ctx->algo), digest_len);
+    kmocrypt_hash_free(ctx);
+    return digest_len;
+}
+
+/**
+ * Free an incremental hash context, if required.
+ */
+void kmocrypt_hash_free(struct kmocrypt_hash_ctx *ctx) {
+    if (ctx->hd) {
+        gcry_md_close(ctx->hd);
+        ctx->hd = NULL;
+    }
+}
+
 void kmocrypt_init()
 {
     gcry_check_version (NULL);
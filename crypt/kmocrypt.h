@@ -36,4 +36,22 @@ static inline void kmocrypt_sha256_hash(kbuffer * input, kbuffer * hash) {
     kmocrypt_hash(input, hash, GCRY_MD_SHA256);
 }
 
+/* Incremental hash context. The data is fed piece by piece, which yields the
+ * same digest as hashing the concatenation of the pieces with kmocrypt_hash().
+ */
+struct kmocrypt_hash_ctx {
+    gcry_md_hd_t hd;
+    int algo;
+};
+
+int kmocrypt_hash_init(struct kmocrypt_hash_ctx *ctx, int algo);
+void kmocrypt_hash_update(struct kmocrypt_hash_ctx *ctx, const void *data, size_t len);
+uint32_t kmocrypt_hash_final(struct kmocrypt_hash_ctx *ctx, uint8_t *digest);
+void kmocrypt_hash_free(struct kmocrypt_hash_ctx *ctx);
+
+/* This function returns the length of the digests of the algorithm specified. */
+static inline uint32_t kmocrypt_hash_len(int algo) {
+    return gcry_md_get_algo_dlen(algo);
+}
+
 #endif /* __KMOCRYPT_H__ */
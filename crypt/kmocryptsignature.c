@@ -684,8 +684,17 @@ static void sig_check_attachments_name_payload(kmocrypt_signature * self,
         /* Hash the KMO name and payloads. */
         gcry_md_hash_buffer(self->hash_algo, attch_cache[i].name_hash, 
                             att->name->data, att->name->slen);
-        gcry_md_hash_buffer(self->hash_algo, attch_cache[i].payload_hash,
-                            att->data->data, att->data->slen);    
+
+        /* The payload digest may have been computed while the data was read. */
+        if (att->payload_hash_len == n && att->payload_hash_algo == (int) self->hash_algo) {
+            memcpy(attch_cache[i].payload_hash, att->payload_hash, n);
+        }
+
+        else {
+            assert(! att->data_is_file_path);
+            gcry_md_hash_buffer(self->hash_algo, attch_cache[i].payload_hash,
+                                att->data->data, att->data->slen);
+        }
 
         sp = self->subpackets[KMO_SP_TYPE_ATTACHMENT];
 
@@ -96,28 +96,55 @@ static int recognize_ksp_signature(struct kmocrypt_signature2 *self, kbuffer *bu
     return 0;
 }
 
-/* This function free()'s the specified subpacket. */
-static void clean_simple_free(void *data) {
-    free(data);
+/* These functions read a number in network byte order in the subpacket data
+ * specified.
+ */
+static inline uint16_t subpacket_read16(uint8_t *data) {
+    uint16_t nbo;
+    memcpy(&nbo, data, sizeof(nbo));
+    return ntohs(nbo);
 }
 
-/* This function recognizes a hash subpacket.
- * This function sets the KMO error string. It returns -1 on failure.
+static inline uint32_t subpacket_read32(uint8_t *data) {
+    uint32_t nbo;
+    memcpy(&nbo, data, sizeof(nbo));
+    return ntohl(nbo);
+}
+
+static inline uint64_t subpacket_read64(uint8_t *data) {
+    uint64_t nbo;
+    memcpy(&nbo, data, sizeof(nbo));
+    return ntohll(nbo);
+}
+
+/* This function returns the data of the subpacket specified. */
+static inline uint8_t * subpacket_data(struct kmocrypt_signature2 *self, struct kmocrypt_subpacket2 *sp) {
+    return self->data + sp->offset;
+}
+
+/* This function returns the last subpacket of the type specified, or NULL if
+ * there is none. The last subpacket of a type overrides the previous ones.
+ */
+static struct kmocrypt_subpacket2 * get_subpacket(struct kmocrypt_signature2 *self, int type) {
+    if (self->type_index[type] == self->type_index[type + 1]) return NULL;
+    return &self->subpacket_array[self->type_index[type + 1] - 1];
+}
+
+/* The functions below check the content of a subpacket of a given type. The
+ * content is read when it is requested.
+ * These functions set the KMO error string. They return -1 on failure.
  */
-static int recognize_hash(struct kmocrypt_signature2 *self, kbuffer *buffer, void **data_handle, uint32_t packet_len) {
+static int recognize_hash(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
     if (gcry_md_get_algo_dlen(self->hash_algo) != packet_len) {
     	kmo_seterror("KSP HASH subpacket is malformed");
 	return -1;
     }
     
-    *data_handle = kmo_malloc(packet_len);
-    kbuffer_read(buffer, (char *) *data_handle, packet_len);
     return 0;
 }
 
 /* This function verifies that the data specified hashes to the hash value
  * specified.
- * This function sets the KMO error string. It returns -1 on failure.
  */
 static int check_hash(struct kmocrypt_signature2 *self, uint8_t *hash, uint8_t *data, uint32_t len) {
     uint8_t digest[MAX_DIGEST_LEN];
@@ -133,318 +160,387 @@ static int check_hash(struct kmocrypt_signature2 *self, uint8_t *hash, uint8_t *
     return 0;
 }
 
-/* This function recognizes a PROTO subpacket.
- * This function sets the KMO error string. It returns -1 on failure.
- */
-static int recognize_proto(struct kmocrypt_signature2 *self, kbuffer *buffer, void **data_handle, uint32_t packet_len) {
-    struct kmocrypt_proto2 *proto;
-    
+static int recognize_proto(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
     if (packet_len != 8) {
         kmo_seterror("KSP PROTO subpacket is malformed");
         return -1;
     }
     
-    *data_handle = proto = (struct  kmocrypt_proto2 *) kmo_malloc(sizeof(struct kmocrypt_proto2));
-    proto->major = kbuffer_read32(buffer);
-    proto->minor = kbuffer_read32(buffer);
     return 0;
 }
 
-/* This function recognizes an IPV4 subpacket.
- * This function sets the KMO error string. It returns -1 on failure.
- */
-static int recognize_ipv4(struct kmocrypt_signature2 *self, kbuffer *buffer, void **data_handle, uint32_t packet_len) {
+static int recognize_ipv4(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
     if (packet_len != 4) {
     	kmo_seterror("KSP IPV4 subpacket is malformed");
 	return -1;
     }
     
-    *data_handle = kmo_malloc(packet_len);
-    *(uint32_t *) *data_handle = kbuffer_read32(buffer);
     return 0;
 }
 
-/* This function recognizes an IPV6 subpacket.
- * This function sets the KMO error string. It returns -1 on failure.
- */
-static int recognize_ipv6(struct kmocrypt_signature2 *self, kbuffer *buffer, void **data_handle, uint32_t packet_len) {
+static int recognize_ipv6(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
     if (packet_len != 16) {
     	kmo_seterror("KSP IPV6 subpacket is malformed");
 	return -1;
     }
     
-    /* Normally it should be natively in NBO. */
-    *data_handle = kmo_malloc(packet_len);
-    kbuffer_read(buffer, (char *) *data_handle, packet_len);
     return 0;
 }
 
-/* This function recognizes an attachment subpacket.
- * This function sets the KMO error string. It returns -1 on failure.
- */
-static int recognize_attachment(struct kmocrypt_signature2 *self, kbuffer *buffer,
-    	    	    	    	void **data_handle, uint32_t packet_len) {
-    			
+static int recognize_attachment(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
     if (packet_len != gcry_md_get_algo_dlen(self->hash_algo) * 2) {
         kmo_seterror("KSP ATTACHMENT subpacket is malformed");
         return -1;
     }
     
-    *data_handle = kmo_malloc(packet_len);
-    kbuffer_read(buffer, (char *) *data_handle, packet_len);
     return 0;
 }
 
-/* This function recognizes a symmetric key subpacket. Only the member ID field
- * is read however.
- * This function sets the KMO error string. It returns -1 on failure.
- */
-static int recognize_symkey(struct kmocrypt_signature2 *self, kbuffer *buffer,
-    	    	    	    void **data_handle, uint32_t packet_len) {
-    
+/* Only the member ID field of a symmetric key subpacket is used. */
+static int recognize_symkey(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
     if (packet_len < 8) {
         kmo_seterror("KSP SYMKEY subpacket is malformed");
         return -1;
     }
     
-    *data_handle = kmo_malloc(8);
-    *(uint64_t *) *data_handle = kbuffer_read64(buffer);
     return 0;
 }
 
-/* This function recognizes a subpacket of an "opaque" type. It does not read
- * its content however.
- * This function sets the KMO error string. It returns -1 on failure.
- */
-static int recognize_opaque(struct kmocrypt_signature2 *self, kbuffer *buffer,
-    	    	    	    void **data_handle, uint32_t packet_len) {
-    *data_handle = NULL;
+/* The content of a subpacket of an "opaque" type is not used. */
+static int recognize_opaque(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
     return 0;
 }
 
-/* This function recognizes a blob. It does read it in a buffer.
- * This function sets the KMO error string. It returns -1 on failure.
- */
-struct kmo_blob {
-    uint32_t type;
-    kbuffer *buffer;
-};
-
-static int recognize_blob(struct kmocrypt_signature2 *self, kbuffer *buffer, void **data_handle, uint32_t packet_len) {
-    uint32_t len;
-    struct kmo_blob *blob = kmo_calloc(sizeof(struct kmo_blob));
-    
-    do {
-        if (kbuffer_left(buffer) < 2 * sizeof(uint32_t)) {
-            kmo_seterror("KSP BLOB subpacket is malformed");
-	    break;
-	}
-
-        blob->type = kbuffer_read32(buffer);
-        len = kbuffer_read32(buffer);
-
-        blob->buffer = kbuffer_new(len);
-        if (kbuffer_read_into(buffer, blob->buffer, len) != len) {
-	    kmo_seterror("KSP BLOB subpacket is malformed");
-            break;
-	}
-	
-	if (packet_len != 8 + len) {
-	    kmo_seterror("KSP BLOB subpacket is malformed");
-	    break;
-	}
-
-        *data_handle = blob;
-        return 0;
-	
-    } while (0);
+/* A blob contains its type and its length, followed by its bytes. */
+static int recognize_blob(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
+    if (packet_len < 8 || packet_len != 8 + subpacket_read32(data + 4)) {
+        kmo_seterror("KSP BLOB subpacket is malformed");
+        return -1;
+    }
     
-    kbuffer_destroy(blob->buffer);
-    free(blob);
-    return -1;
-}
-
-static void clean_blob(void *data) {
-    struct kmo_blob *blob = (struct kmo_blob *) data;
-    if (blob)
-        kbuffer_destroy(blob->buffer);
-    free(blob);
+    return 0;
 }
 
-/* This function recognizes a KSN subpacket.
- * This function sets the KMO error string. It returns -1 on failure.
- */
-static int recognize_ksn(struct kmocrypt_signature2 *self, kbuffer *buffer, void **data_handle, uint32_t packet_len) {
+static int recognize_ksn(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
     if (packet_len != KMOCRYPT_KSN_SIZE) {
     	kmo_seterror("KSP KSN subpacket is malformed");
 	return -1;
     }
     
-    *data_handle = kmo_malloc(packet_len);
-    kbuffer_read(buffer, (char *) *data_handle, packet_len);
     return 0;
 }
 
-/* This function recognizes a mail client subpacket.
- * This function sets the KMO error string. It returns -1 on failure.
- */
-static int recognize_mail_client(struct kmocrypt_signature2 *self, kbuffer *buffer,
-    	    	    	    	 void **data_handle, uint32_t packet_len) {
-    
-    struct kmocrypt_mail_client2 *client = NULL;
-    
+static int recognize_mail_client(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
     if (packet_len != 64) {
     	kmo_seterror("KSP MAIL CLIENT subpacket is malformed");
 	return -1;
     }
     
-    client = (struct kmocrypt_mail_client2 *) kmo_malloc(sizeof(struct kmocrypt_mail_client2));
-    client->product = kbuffer_read16(buffer);
-    client->version = kbuffer_read16(buffer);
-    client->release = kbuffer_read16(buffer);
-    client->kpp_version = kbuffer_read16(buffer);
-
-    *data_handle = client;
     return 0;
 }
 
-static int recognize_date(struct kmocrypt_signature2 *self, kbuffer *buffer,
-                          void **data_handle, uint32_t packet_len) {
-    if (packet_len < 8)
+static int recognize_date(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
+    if (packet_len < 8) {
+    	kmo_seterror("KSP DATE subpacket is malformed");
         return -1;
-    struct timeval *tv = (struct timeval *)kmo_malloc(sizeof(struct timeval));
-    tv->tv_sec  = kbuffer_read32(buffer);
-    tv->tv_usec = kbuffer_read32(buffer);
-    *data_handle = tv;
-
+    }
+    
     return 0;
 }
 
-struct kpg_data {
-    uint8_t type;
-    kstr addr;
-    uint16_t port; // in native byte order
-};
-
-static int recognize_kpg(struct kmocrypt_signature2 *self, kbuffer *buffer,
-                          void **data_handle, uint32_t packet_len) {
-    struct kpg_data *kpg = (struct kpg_data *) kmo_malloc(sizeof(struct kpg_data));
-    uint32_t length;
-    uint8_t *buf;
-    if (packet_len < 13) {
-	free(kpg);
+/* A KPG subpacket contains the type of the KPG, the type and the length of a
+ * header, the length of the address, the address and the port.
+ */
+static int recognize_kpg(struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len) {
+    if (packet_len < 13 || packet_len - 13 < subpacket_read32(data + 9)) {
 	kmo_seterror("KPG packet too short");
         return -1;
     }
     
-    kpg->type = kbuffer_read8(buffer);
-    kbuffer_read32(buffer); // Header type
-    kbuffer_read32(buffer); // Header length
-    length = kbuffer_read32(buffer);
-    buf = kbuffer_read_nbytes(buffer, length);
-    kstr_init_buf(&kpg->addr, buf, length);
-    kpg->port = kbuffer_read16(buffer);
-    *data_handle = (void *)kpg;
-
     return 0;
 }
 
-static void clean_kpg (void *data) {
-    struct kpg_data *kpg = (struct kpg_data *)data;
-    kstr_free(&kpg->addr);
-    free(kpg);
-}
-
-
 /* This structure represents an entry in the table below.
- * 'recognize' is the function that recognizes the corresponding subpacket type.
- * 'clean' is the function that frees the subpacket data.
+ * 'recognize' is the function that checks the corresponding subpacket type.
  */
 struct subpackets_ops {
-    int (*recognize) (struct kmocrypt_signature2 *self, kbuffer *buffer, void **data_handle, uint32_t packet_len);
-    void (*clean) (void *data);
+    int (*recognize) (struct kmocrypt_signature2 *self, uint8_t *data, uint32_t packet_len);
 };
 
-/* This table is used to dispatch subpacket handling to the right functions. */
+/* This table is used to dispatch subpacket handling to the right functions.
+ * The subpackets of the types without a function are ignored.
+ */
 static struct subpackets_ops subpackets_ops[KMO_SP_NB_TYPE] = {
-    { NULL, NULL },         	    	    	    /* NONE */
-    { recognize_proto, clean_simple_free },         /* KMO_SP_TYPE_PROTO */
-    { recognize_hash, clean_simple_free },          /* KMO_SP_TYPE_FROM_NAME */
-    { recognize_hash, clean_simple_free },          /* KMO_SP_TYPE_FROM_ADDR */
-    { recognize_hash, clean_simple_free },          /* KMO_SP_TYPE_TO */
-    { recognize_hash, clean_simple_free },          /* KMO_SP_TYPE_CC */
-    { recognize_hash, clean_simple_free },          /* KMO_SP_TYPE_SUBJECT */
-    { recognize_hash, clean_simple_free },          /* KMO_SP_TYPE_PLAIN */
-    { recognize_hash, clean_simple_free },          /* KMO_SP_TYPE_HTML */
-    { recognize_ipv4, clean_simple_free },          /* KMO_SP_TYPE_IPV4 */
-    { recognize_ipv6, clean_simple_free },          /* KMO_SP_TYPE_IPV6 */
-    { recognize_attachment, clean_simple_free },    /* KMO_SP_TYPE_ATTACHMENT */
-    { recognize_symkey, clean_simple_free }, 	    /* KMO_SP_TYPE_SYMKEY */	   
-    { recognize_opaque, NULL }, 	     	    /* KMO_SP_TYPE_SND_SYMKEY */  
-    { recognize_opaque, NULL }, 	     	    /* KMO_SP_TYPE_PASSWD */	   
-    { recognize_mail_client, clean_simple_free },   /* KMO_SP_TYPE_MAIL_CLIENT */
-    { recognize_blob, clean_blob },          	    /* KMO_SP_TYPE_BLOB */
-    { recognize_ksn, clean_simple_free },           /* KMO_SP_TYPE_KSN */
-    { recognize_opaque, NULL },          	    /* KMO_SP_TYPE_PODTO */
-    { NULL, NULL },                                 /* KMO_SP_TYPE_LANG */
-    { recognize_date, clean_simple_free },          /* KMO_SP_TYPE_DATE */
-    { recognize_opaque, NULL },                     /* KMO_SP_TYPE_RESERVED1 */
-    { recognize_kpg, clean_kpg },                   /* KMO_SP_TYPE_KPG */
+    { NULL },         	    	    	    	    /* NONE */
+    { recognize_proto },         	    	    /* KMO_SP_TYPE_PROTO */
+    { recognize_hash },          	    	    /* KMO_SP_TYPE_FROM_NAME */
+    { recognize_hash },          	    	    /* KMO_SP_TYPE_FROM_ADDR */
+    { recognize_hash },          	    	    /* KMO_SP_TYPE_TO */
+    { recognize_hash },          	    	    /* KMO_SP_TYPE_CC */
+    { recognize_hash },          	    	    /* KMO_SP_TYPE_SUBJECT */
+    { recognize_hash },          	    	    /* KMO_SP_TYPE_PLAIN */
+    { recognize_hash },          	    	    /* KMO_SP_TYPE_HTML */
+    { recognize_ipv4 },          	    	    /* KMO_SP_TYPE_IPV4 */
+    { recognize_ipv6 },          	    	    /* KMO_SP_TYPE_IPV6 */
+    { recognize_attachment },    	    	    /* KMO_SP_TYPE_ATTACHMENT */
+    { recognize_symkey }, 	    	    	    /* KMO_SP_TYPE_SYMKEY */	   
+    { recognize_opaque }, 	     	    	    /* KMO_SP_TYPE_SND_SYMKEY */  
+    { recognize_opaque }, 	     	    	    /* KMO_SP_TYPE_PASSWD */	   
+    { recognize_mail_client },   	    	    /* KMO_SP_TYPE_MAIL_CLIENT */
+    { recognize_blob },          	    	    /* KMO_SP_TYPE_BLOB */
+    { recognize_ksn },           	    	    /* KMO_SP_TYPE_KSN */
+    { recognize_opaque },          	    	    /* KMO_SP_TYPE_PODTO */
+    { NULL },                                 	    /* KMO_SP_TYPE_LANG */
+    { recognize_date },          	    	    /* KMO_SP_TYPE_DATE */
+    { recognize_opaque },                     	    /* KMO_SP_TYPE_RESERVED1 */
+    { recognize_kpg },                   	    /* KMO_SP_TYPE_KPG */
 };
 
-/* This function recognizes the subpackets inside the KSP.
+/* This function returns true if the subpackets of the type specified are
+ * kept.
+ */
+static inline int is_known_type(uint8_t type) {
+    return type < KMO_SP_NB_TYPE && subpackets_ops[type].recognize;
+}
+
+/* This function recognizes the subpackets inside the KSP. The subpacket
+ * section is copied once, in the same block as the views of the subpackets.
+ * The views are grouped by type, in the order of the KSP.
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int recognize_subpackets(struct kmocrypt_signature2 *self, kbuffer *buffer, uint32_t total_len) {
-    int error = 0;
+    uint8_t *section = kbuffer_current_pos(buffer);
+    int cursor_array[KMO_SP_NB_TYPE];
+    int nb_subpacket = 0;
+    uint32_t pos;
+    int i;
+    
+    /* Count the subpackets of each type. */
+    memset(self->type_index, 0, sizeof(self->type_index));
     
-    /* Pass all subpackets. */
-    while (total_len) {
-    	uint8_t type;
-	uint16_t subpacket_len;
-	uint32_t seek_pos;
+    for (pos = 0; pos < total_len; ) {
+	uint32_t subpacket_len;
 	
-	/* Get the type and length of the current subpacket. */
-	if (total_len < 3) {
+	if (total_len - pos < 3) {
 	    kmo_seterror("last subpacket is malformed");
 	    return -1;
 	}
     	
-	type = kbuffer_read8(buffer);
-	subpacket_len = kbuffer_read16(buffer);
+	subpacket_len = subpacket_read16(section + pos + 1);
 	
-	if (total_len < 3 + subpacket_len)
-	{
+	if (total_len - pos - 3 < subpacket_len) {
 	    kmo_seterror("last subpacket is too long");
 	    return -1;
 	}
 	
-	seek_pos = buffer->pos + subpacket_len;
-	total_len -= 3 + subpacket_len;
-    	
-	/* We know about this packet type. */
-	if (type < KMO_SP_NB_TYPE && subpackets_ops[type].recognize) {
-	    void *subpacket_data = NULL;
-	    struct kmocrypt_subpacket_list2 *list_node = NULL;
-	    
-	    /* Recognize the subpacket. */
-	    error = subpackets_ops[type].recognize(self, buffer, &subpacket_data, subpacket_len);
-	    if (error) return error;
+	if (is_known_type(section[pos])) {
+	    self->type_index[section[pos] + 1]++;
+	    nb_subpacket++;
+	}
+	
+	pos += 3 + subpacket_len;
+    }
+    
+    for (i = 0; i < KMO_SP_NB_TYPE; i++) {
+    	self->type_index[i + 1] += self->type_index[i];
+	cursor_array[i] = self->type_index[i];
+    }
+    
+    /* Copy the section after the views. */
+    self->nb_subpacket = nb_subpacket;
+    self->subpacket_array = (struct kmocrypt_subpacket2 *)
+	kmo_malloc(nb_subpacket * sizeof(struct kmocrypt_subpacket2) + total_len);
+    self->data = (uint8_t *) (self->subpacket_array + nb_subpacket);
+    memcpy(self->data, section, total_len);
+    buffer->pos += total_len;
+    
+    /* Check and index the subpackets. */
+    for (pos = 0; pos < total_len; ) {
+	uint8_t type = self->data[pos];
+	uint32_t subpacket_len = subpacket_read16(self->data + pos + 1);
+	
+	if (is_known_type(type)) {
+	    struct kmocrypt_subpacket2 *sp = &self->subpacket_array[cursor_array[type]++];
+	    sp->type = type;
+	    sp->offset = pos + 3;
+	    sp->len = subpacket_len;
 	    
-	    /* Store the data. */
-	    list_node = (struct kmocrypt_subpacket_list2 *) kmo_malloc(sizeof(struct kmocrypt_subpacket_list2));
-	    list_node->next = self->subpacket_array[type];
-	    list_node->data = subpacket_data;
-	    self->subpacket_array[type] = list_node;
+	    if (subpackets_ops[type].recognize(self, self->data + sp->offset, sp->len)) return -1;
 	}
 	
-	/* In case we didn't read the subpacket, seek to the correct position in the buffer. */
-	buffer->pos = seek_pos;
+	pos += 3 + subpacket_len;
     }
     
     return 0;
 }
 
+/* Kinds of keys of the attachment index. */
+#define ATT_KEY_NAME_PAYLOAD	0
+#define ATT_KEY_NAME		1
+#define ATT_KEY_PAYLOAD		2
+#define ATT_KEY_NB		3
+
+/* Entry of the attachment index. It lists the attachment subpackets that have
+ * the digest of the entry, in the order of the KSP.
+ */
+struct kmocrypt_attachment_entry {
+    
+    /* Digest. It points in the subpacket data. */
+    uint8_t *hash;
+    uint32_t len;
+    
+    /* Position of the first and last subpackets having this digest. */
+    int first;
+    int last;
+    
+    /* Position from which to look for a subpacket not yet matched while the
+     * attachments are checked.
+     */
+    int cursor;
+};
+
+/* Index of the attachment subpackets. The subpackets are identified by their
+ * position among the attachment subpackets. There is one hash per kind of key.
+ */
+struct kmocrypt_attachment_index {
+    
+    /* Number of attachment subpackets. */
+    int count;
+    
+    /* Position of the next subpacket having the same digest, -1 if none, for
+     * each kind of key.
+     */
+    int *next_array[ATT_KEY_NB];
+    
+    /* Entries of the index, for each kind of key. */
+    struct kmocrypt_attachment_entry *entry_array[ATT_KEY_NB];
+    int nb_entry[ATT_KEY_NB];
+    
+    /* Hashes mapping an entry to itself, for each kind of key. */
+    khash hash[ATT_KEY_NB];
+};
+
+/* Hashing functions of the attachment index. The digests are already
+ * uniformly distributed.
+ */
+static unsigned int attachment_entry_key(void *key) {
+    struct kmocrypt_attachment_entry *entry = (struct kmocrypt_attachment_entry *) key;
+    unsigned int value = 0;
+    memcpy(&value, entry->hash, MIN(entry->len, sizeof(value)));
+    return value;
+}
+
+static int attachment_entry_cmp(void *key_1, void *key_2) {
+    struct kmocrypt_attachment_entry *entry_1 = (struct kmocrypt_attachment_entry *) key_1;
+    struct kmocrypt_attachment_entry *entry_2 = (struct kmocrypt_attachment_entry *) key_2;
+    return entry_1->len == entry_2->len && ! memcmp(entry_1->hash, entry_2->hash, entry_1->len);
+}
+
+/* This function frees the attachment index. */
+static void attachment_index_destroy(struct kmocrypt_attachment_index *index) {
+    int k;
+    
+    if (index == NULL) return;
+    
+    for (k = 0; k < ATT_KEY_NB; k++) {
+    	khash_free(&index->hash[k]);
+	free(index->entry_array[k]);
+	free(index->next_array[k]);
+    }
+    
+    free(index);
+}
+
+/* This function indexes the attachment subpackets of the signature, if any, so
+ * that the attachments can be matched without scanning the subpacket list.
+ */
+static void attachment_index_build(struct kmocrypt_signature2 *self) {
+    struct kmocrypt_attachment_index *index;
+    struct kmocrypt_subpacket2 *sp;
+    uint32_t n = gcry_md_get_algo_dlen(self->hash_algo);
+    int count = self->type_index[KMO_SP_TYPE_ATTACHMENT + 1] - self->type_index[KMO_SP_TYPE_ATTACHMENT];
+    int j, k;
+    
+    if (count == 0) return;
+    
+    index = (struct kmocrypt_attachment_index *) kmo_calloc(sizeof(struct kmocrypt_attachment_index));
+    index->count = count;
+    
+    for (k = 0; k < ATT_KEY_NB; k++) {
+    	index->next_array[k] = (int *) kmo_malloc(count * sizeof(int));
+	index->entry_array[k] = (struct kmocrypt_attachment_entry *)
+	    kmo_malloc(count * sizeof(struct kmocrypt_attachment_entry));
+	khash_init_func(&index->hash[k], attachment_entry_key, attachment_entry_cmp);
+    }
+    
+    sp = &self->subpacket_array[self->type_index[KMO_SP_TYPE_ATTACHMENT]];
+    
+    for (j = 0; j < count; j++, sp++) {
+    	for (k = 0; k < ATT_KEY_NB; k++) {
+	    struct kmocrypt_attachment_entry *entry = &index->entry_array[k][index->nb_entry[k]];
+	    struct kmocrypt_attachment_entry *prev;
+	    
+	    /* The subpacket contains the name digest followed by the payload
+	     * digest.
+	     */
+	    entry->hash = subpacket_data(self, sp) + (k == ATT_KEY_PAYLOAD ? n : 0);
+	    entry->len = (k == ATT_KEY_NAME_PAYLOAD ? 2 * n : n);
+	    index->next_array[k][j] = -1;
+	    
+	    prev = (struct kmocrypt_attachment_entry *) khash_get(&index->hash[k], entry);
+	    
+	    if (prev) {
+	    	index->next_array[k][prev->last] = j;
+		prev->last = j;
+	    }
+	    
+	    else {
+	    	entry->first = entry->last = j;
+		khash_add(&index->hash[k], entry, entry);
+		index->nb_entry[k]++;
+	    }
+	}
+    }
+    
+    self->attachment_index = index;
+}
+
+/* This function prepares the attachment index for a check. */
+static void attachment_index_reset(struct kmocrypt_attachment_index *index) {
+    int i, k;
+    
+    for (k = 0; k < ATT_KEY_NB; k++) {
+    	for (i = 0; i < index->nb_entry[k]; i++) {
+	    index->entry_array[k][i].cursor = index->entry_array[k][i].first;
+	}
+    }
+}
+
+/* This function returns the position of the first attachment subpacket having
+ * the digest specified that has not been matched yet, or -1 if there is none.
+ * The subpacket is marked as matched.
+ */
+static int attachment_index_match(struct kmocrypt_attachment_index *index, int kind,
+    	    	    	    	  uint8_t *hash, uint32_t len, int *sig_seen) {
+    struct kmocrypt_attachment_entry key;
+    struct kmocrypt_attachment_entry *entry;
+    int j;
+    
+    key.hash = hash;
+    key.len = len;
+    entry = (struct kmocrypt_attachment_entry *) khash_get(&index->hash[kind], &key);
+    if (entry == NULL) return -1;
+    
+    /* The subpackets matched by a previous lookup are never unmatched, so the
+     * cursor only moves forward.
+     */
+    for (j = entry->cursor; j != -1 && sig_seen[j]; j = index->next_array[kind][j]) ;
+    
+    entry->cursor = j;
+    if (j != -1) sig_seen[j] = 1;
+    return j;
+}
+
 /* This function recognizes the KSP content.
  * This function sets the KMO error string. It returns -1 on failure.
  */
@@ -508,6 +604,9 @@ int kmocrypt_recognize_ksp2(struct kmocrypt_signature2 *self, kbuffer *buffer) {
         return -1;
     }
     
+    /* Index the attachments for kmocrypt_signature_check_attachments2(). */
+    attachment_index_build(self);
+    
     /* Recognize the signature of the KSP, unless it's the encryption key. */
     if (self->mid && recognize_ksp_signature(self, buffer, buffer->len - buffer->pos)) {
         return -1;
@@ -534,7 +633,7 @@ int kmocrypt_signature_validate2(struct kmocrypt_signature2 *self, kmocrypt_pkey
  * specified type.
  */
 int kmocrypt_signature_contain2(struct kmocrypt_signature2 *self, int type) {
-    return (self->subpacket_array[type] != NULL);
+    return (get_subpacket(self, type) != NULL);
 }
 
 /* This function checks the validity of a hashed field (e.g. from). 'type' is
@@ -543,14 +642,17 @@ int kmocrypt_signature_contain2(struct kmocrypt_signature2 *self, int type) {
  * This function sets the KMO error string. It returns -1 on failure.
  */
 int kmocrypt_signature_check_hash2(struct kmocrypt_signature2 *self, int type, unsigned char *data, uint32_t len) {
+    struct kmocrypt_subpacket2 *sp;
+    
     assert(type < KMO_SP_NB_TYPE && subpackets_ops[type].recognize == recognize_hash);
+    sp = get_subpacket(self, type);
 
-    if (! self->subpacket_array[type]) {
+    if (! sp) {
         kmo_seterror("unavailable type %d in KSP", type);
         return -1;
     }
 
-    return check_hash(self, self->subpacket_array[type]->data, data, len);
+    return check_hash(self, subpacket_data(self, sp), data, len);
 }
 
 struct kmocrypt_attachment_hash {
@@ -562,15 +664,13 @@ struct kmocrypt_attachment_hash {
  * valid attachments.
  */
 static void sig_check_attachments_name_payload(struct kmocrypt_signature2 * self, 
-                                               size_t spkt_cnt,
                                                karray * attch_array, 
                                                int * sig_seen, 
                                                int * kmo_seen,
                                                struct kmocrypt_attachment_hash * attch_cache) {
     int i;
-    size_t n, j;
-    struct kmocrypt_subpacket_list2 * sp;
-    uint8_t * att_hash;
+    size_t n;
+    uint8_t att_hash[2 * MAX_DIGEST_LEN];
     struct kmod_attachment * att;
 
     n = gcry_md_get_algo_dlen(self->hash_algo);
@@ -586,32 +686,25 @@ static void sig_check_attachments_name_payload(struct kmocrypt_signature2 * self
         /* Hash the KMO name and payloads. */
         gcry_md_hash_buffer(self->hash_algo, attch_cache[i].name_hash, 
                             att->name->data, att->name->slen);
-        gcry_md_hash_buffer(self->hash_algo, attch_cache[i].payload_hash,
-                            att->data->data, att->data->slen);    
 
-        sp = self->subpacket_array[KMO_SP_TYPE_ATTACHMENT];
+        /* The payload digest may have been computed while the data was read. */
+        if (att->payload_hash_len == n && att->payload_hash_algo == (int) self->hash_algo) {
+            memcpy(attch_cache[i].payload_hash, att->payload_hash, n);
+        }
 
-        /* Loop through all the attachments. */
-        for (j = 0; j < spkt_cnt; j++) {
-	    att_hash = sp->data;
-	    
-            /* Move to next in case there was a match on this signed
-               attachment. */
-            if (sig_seen[j] == 0) {
-
-                /* If the filename hash match... */
-                if (memcmp(att_hash, attch_cache[i].name_hash, n) == 0 && 
-                    memcmp(att_hash + n, attch_cache[i].payload_hash, n) == 0) {
-		    
-                    att->status = KMO_EVAL_ATTACHMENT_INTACT;
-                    kmo_seen[i] = 1;
-                    sig_seen[j] = 1;
-		    break;
-                }
-            }
-            
-	    
-	    sp = sp->next;
+        else {
+            assert(! att->data_is_file_path);
+            gcry_md_hash_buffer(self->hash_algo, attch_cache[i].payload_hash,
+                                att->data->data, att->data->slen);
+        }
+
+        /* If the filename and payload hashes match a signed attachment... */
+        memcpy(att_hash, attch_cache[i].name_hash, n);
+        memcpy(att_hash + n, attch_cache[i].payload_hash, n);
+        
+        if (attachment_index_match(self->attachment_index, ATT_KEY_NAME_PAYLOAD, att_hash, 2 * n, sig_seen) != -1) {
+            att->status = KMO_EVAL_ATTACHMENT_INTACT;
+            kmo_seen[i] = 1;
         }
     }
 }
@@ -620,15 +713,12 @@ static void sig_check_attachments_name_payload(struct kmocrypt_signature2 * self
  * are considered to have an invalid payload.
  */
 static void sig_check_attachments_name(struct kmocrypt_signature2 * self,
-                                       size_t spkt_cnt, 
                                        karray * attch_array, 
                                        int * sig_seen, 
                                        int * kmo_seen,
                                        struct kmocrypt_attachment_hash * attch_cache) {
     int i;
-    size_t n, j;
-    uint8_t * att_hash;
-    struct kmocrypt_subpacket_list2 * sp;
+    size_t n;
     struct kmod_attachment * att;
 
     n = gcry_md_get_algo_dlen(self->hash_algo);
@@ -640,25 +730,10 @@ static void sig_check_attachments_name(struct kmocrypt_signature2 * self,
         if (kmo_seen[i] == 1) 
             continue;
 
-        sp = self->subpacket_array[KMO_SP_TYPE_ATTACHMENT];
-        
-        for (j = 0; j < spkt_cnt; j++) {
-	    att_hash = sp->data;
-	    
-            /* If the signature attachment has already been seen above, move to
-               the next element in the signature. */
-            if (sig_seen[j] == 0) {
-                
-                /* If the filename hash matches... */
-                if (memcmp(att_hash, attch_cache[i].name_hash, n) == 0) {
-                    att->status = KMO_EVAL_ATTACHMENT_MODIFIED;
-                    kmo_seen[i] = 1;
-                    sig_seen[j] = 1;
-		    break;
-                }
-            }
-
-            sp = sp->next;           
+        /* If the filename hash matches a signed attachment not seen above... */
+        if (attachment_index_match(self->attachment_index, ATT_KEY_NAME, attch_cache[i].name_hash, n, sig_seen) != -1) {
+            att->status = KMO_EVAL_ATTACHMENT_MODIFIED;
+            kmo_seen[i] = 1;
         }
     }    
 }
@@ -667,15 +742,12 @@ static void sig_check_attachments_name(struct kmocrypt_signature2 * self,
  * payload are considered to have an invalid name.
  */
 static void sig_check_attachments_payload(struct kmocrypt_signature2 * self, 
-                                          size_t spkt_cnt,
                                           karray * attch_array, 
                                           int * sig_seen, 
                                           int * kmo_seen,
                                           struct kmocrypt_attachment_hash * attch_cache) {
     int i;
-    size_t n, j;
-    struct kmocrypt_subpacket_list2 * sp;
-    uint8_t * att_hash;
+    size_t n;
     struct kmod_attachment * att;
 
     n = gcry_md_get_algo_dlen(self->hash_algo);
@@ -687,26 +759,10 @@ static void sig_check_attachments_payload(struct kmocrypt_signature2 * self,
         if (kmo_seen[i] == 1) 
             continue;
 
-        /* Hash the KMO name and payloads. */
-        sp = self->subpacket_array[KMO_SP_TYPE_ATTACHMENT];
-
-        for (j = 0; j < spkt_cnt; j++) {
-	    att_hash = sp->data + n;
- 
-            /* If the signature attachment has already been seen above, move to
-               the next element in the signature. */
-            if (sig_seen[j] == 0) {                
-
-		/* If the payload hash matches... */
-                if (memcmp(att_hash, attch_cache[i].payload_hash, n) == 0) {
-                    att->status = KMO_EVAL_ATTACHMENT_MODIFIED;
-                    kmo_seen[i] = 1;
-                    sig_seen[j] = 1;
-		    break;
-                }
-            }
-
-            sp = sp->next;
+        /* If the payload hash matches a signed attachment not seen above... */
+        if (attachment_index_match(self->attachment_index, ATT_KEY_PAYLOAD, attch_cache[i].payload_hash, n, sig_seen) != -1) {
+            att->status = KMO_EVAL_ATTACHMENT_MODIFIED;
+            kmo_seen[i] = 1;
         }
     }    
 }
@@ -718,11 +774,10 @@ void kmocrypt_signature_check_attachments2(struct kmocrypt_signature2 *self, kar
     int * sig_seen, * kmo_seen;
     struct kmocrypt_attachment_hash * attch_cache;
     struct kmod_attachment * att;
-    struct kmocrypt_subpacket_list2 * sp;
     
     /* If there are no attachments in the signature, then any attachment sent by
        the plugin needs to be viewed as injected. */
-    if (self->subpacket_array[KMO_SP_TYPE_ATTACHMENT] == NULL) {
+    if (self->attachment_index == NULL) {
         for (i = 0; i < attch_array->size; i++) {
 	    att = (struct kmod_attachment *) attch_array->data[i];
 	    
@@ -735,12 +790,9 @@ void kmocrypt_signature_check_attachments2(struct kmocrypt_signature2 *self, kar
         return;
     }
 
-    /* Count the attachments in the signature. */
-    sp = self->subpacket_array[KMO_SP_TYPE_ATTACHMENT];
-    do {
-        spkt_cnt++;
-	sp = sp->next;
-    } while (sp != NULL);
+    /* Get the number of attachments in the signature. */
+    spkt_cnt = self->attachment_index->count;
+    attachment_index_reset(self->attachment_index);
 
     /* Allocate the seen array and the hash-cache array. */
     sig_seen = kmo_calloc(spkt_cnt * sizeof(uint32_t));
@@ -757,13 +809,13 @@ void kmocrypt_signature_check_attachments2(struct kmocrypt_signature2 *self, kar
     }
 
     /* Check the name/payload matches. */
-    sig_check_attachments_name_payload(self, spkt_cnt, attch_array, sig_seen, kmo_seen, attch_cache);
+    sig_check_attachments_name_payload(self, attch_array, sig_seen, kmo_seen, attch_cache);
     
     /* Check name-only matches(potentially changed payloads). */
-    sig_check_attachments_name(self, spkt_cnt, attch_array, sig_seen, kmo_seen, attch_cache);
+    sig_check_attachments_name(self, attch_array, sig_seen, kmo_seen, attch_cache);
     
     /* Check payload matches(potentially changed names). */
-    sig_check_attachments_payload(self, spkt_cnt, attch_array, sig_seen, kmo_seen, attch_cache);
+    sig_check_attachments_payload(self, attch_array, sig_seen, kmo_seen, attch_cache);
 
     /* Search for injected attachments in what KMO has sent. */
     for (i = 0; i < attch_array->size; i++) {
@@ -794,12 +846,14 @@ void kmocrypt_signature_check_attachments2(struct kmocrypt_signature2 *self, kar
  * This function sets the KMO error string. It returns -1 on failure.
  */
 int kmocrypt_signature_get_ksn2(struct kmocrypt_signature2 *self, char **ksn, size_t *len) {
-    if (! self->subpacket_array[KMO_SP_TYPE_KSN]) {
+    struct kmocrypt_subpacket2 *sp = get_subpacket(self, KMO_SP_TYPE_KSN);
+    
+    if (! sp) {
         kmo_seterror("No KSN subpacket in KSP");
         return -1;
     }
 
-    *ksn = (char *) self->subpacket_array[KMO_SP_TYPE_KSN]->data;
+    *ksn = (char *) subpacket_data(self, sp);
     *len = KMOCRYPT_KSN_SIZE;
 
     return 0;
@@ -809,14 +863,18 @@ int kmocrypt_signature_get_ksn2(struct kmocrypt_signature2 *self, char **ksn, si
  * This function sets the KMO error string. It returns -1 on failure.
  */
 int kmocrypt_signature_get_ip2(struct kmocrypt_signature2 *self, struct sockaddr *addr) {   
-    if (self->subpacket_array[KMO_SP_TYPE_IPV4]) {
+    struct kmocrypt_subpacket2 *sp;
+    
+    if ((sp = get_subpacket(self, KMO_SP_TYPE_IPV4))) {
+    	/* The address is stored in host byte order, as it always was. */
+    	uint32_t value = subpacket_read32(subpacket_data(self, sp));
         addr->sa_family = PF_INET;
-        memcpy(&((struct sockaddr_in *) addr)->sin_addr.s_addr, self->subpacket_array[KMO_SP_TYPE_IPV4]->data, 4);
+        memcpy(&((struct sockaddr_in *) addr)->sin_addr.s_addr, &value, 4);
     }
     
-    else if (self->subpacket_array[KMO_SP_TYPE_IPV6]) {
+    else if ((sp = get_subpacket(self, KMO_SP_TYPE_IPV6))) {
         addr->sa_family = PF_INET6;
-        memcpy(&((struct sockaddr_in6 *) addr)->sin6_addr, self->subpacket_array[KMO_SP_TYPE_IPV6]->data, 16);
+        memcpy(&((struct sockaddr_in6 *) addr)->sin6_addr, subpacket_data(self, sp), 16);
     }
     
     else {
@@ -831,12 +889,19 @@ int kmocrypt_signature_get_ip2(struct kmocrypt_signature2 *self, struct sockaddr
  * This function sets the KMO error string. It returns -1 on failure.
  */
 int kmocrypt_signature_get_mail_client2(struct kmocrypt_signature2 *self, struct kmocrypt_mail_client2 *mailer) {
-    if (! self->subpacket_array[KMO_SP_TYPE_MAIL_CLIENT]) {
+    struct kmocrypt_subpacket2 *sp = get_subpacket(self, KMO_SP_TYPE_MAIL_CLIENT);
+    uint8_t *data;
+    
+    if (! sp) {
         kmo_seterror("unavailable type (MAIL_CLIENT) in KSP");
         return -1;
     }
     
-    memcpy(mailer, self->subpacket_array[KMO_SP_TYPE_MAIL_CLIENT]->data, sizeof(struct kmocrypt_mail_client2));
+    data = subpacket_data(self, sp);
+    mailer->product = subpacket_read16(data);
+    mailer->version = subpacket_read16(data + 2);
+    mailer->release = subpacket_read16(data + 4);
+    mailer->kpp_version = subpacket_read16(data + 6);
     return 0;
 }
 
@@ -844,11 +909,10 @@ int kmocrypt_signature_get_mail_client2(struct kmocrypt_signature2 *self, struct
  * ID.
  */
 int kmocrypt_signature_has_symkey_for2(struct kmocrypt_signature2 *self, uint64_t mid) {
-    struct kmocrypt_subpacket_list2 *list;
+    int i;
     
-    for (list = self->subpacket_array[KMO_SP_TYPE_SYMKEY]; list; list = list->next) {
-        uint64_t spkt_mid = *(uint64_t *) list->data;
-        if (spkt_mid == mid) return 1;
+    for (i = self->type_index[KMO_SP_TYPE_SYMKEY]; i < self->type_index[KMO_SP_TYPE_SYMKEY + 1]; i++) {
+        if (subpacket_read64(subpacket_data(self, &self->subpacket_array[i])) == mid) return 1;
     }
 
     return 0;
@@ -856,31 +920,37 @@ int kmocrypt_signature_has_symkey_for2(struct kmocrypt_signature2 *self, uint64_
 
 /* This function frees a KSP object. */
 void kmocrypt_signature_free2(struct kmocrypt_signature2 *self) {
-    int i;
     
     /* Free the gcrypt things used to validate the signature. */
     gcry_sexp_release(self->sig_sexp);
     gcry_mpi_release(self->sig_mpi);
     gcry_sexp_release(self->sig_hash);
     
-    /* Free the subpackets. */
-    for (i = 1; i < KMO_SP_NB_TYPE; i++) {
-        struct kmocrypt_subpacket_list2 *current = self->subpacket_array[i];
-	
-        while (current) {
-	    struct kmocrypt_subpacket_list2 *next = current->next;
-	    if (subpackets_ops[i].clean) subpackets_ops[i].clean(current->data);
-	    free(current);
-	    current = next;
-        }
-    }
+    /* Free the subpackets and their data. */
+    free(self->subpacket_array);
+    self->subpacket_array = NULL;
+    self->data = NULL;
+    self->nb_subpacket = 0;
+    memset(self->type_index, 0, sizeof(self->type_index));
+    
+    attachment_index_destroy(self->attachment_index);
+    self->attachment_index = NULL;
 }
 
 void kmocrypt_get_kpg_host2(struct kmocrypt_signature2 *self, kstr *addr, int *port) {
-    struct kpg_data *kpg = (struct kpg_data *) self->subpacket_array[KMO_SP_TYPE_KPG]->data;
-    if (kpg->type == 0) {
-	kstr_assign_kstr(addr, &kpg->addr);
-	*port = kpg->port;
+    struct kmocrypt_subpacket2 *sp = get_subpacket(self, KMO_SP_TYPE_KPG);
+    uint8_t *data;
+    uint32_t addr_len;
+    
+    if (sp == NULL) return;
+    
+    /* Skip the header type and length. */
+    data = subpacket_data(self, sp);
+    addr_len = subpacket_read32(data + 9);
+    
+    if (data[0] == 0) {
+	kstr_assign_buf(addr, data + 13, addr_len);
+	*port = (sp->len >= 15 + addr_len) ? subpacket_read16(data + 13 + addr_len) : 0;
     }
 }
 
@@ -900,8 +970,7 @@ int kmocrypt_signed_pkey_check(struct kmocrypt_signed_pkey *signed_pkey, kmocryp
 /* The pkey is the kryptiva signing pkey. */
 struct kmocrypt_signed_pkey *kmocrypt_sign_get_pkey(kbuffer *buffer) {
     struct kmocrypt_signed_pkey *signed_pkey = kmo_malloc(sizeof(struct kmocrypt_signed_pkey));
-    struct kmo_blob *key;
-    struct timeval *tv;
+    struct kmocrypt_subpacket2 *blob, *date;
     kbuffer *buf_bin = NULL;
 
     memset(signed_pkey, 0, sizeof(struct kmocrypt_signed_pkey));
@@ -915,23 +984,20 @@ struct kmocrypt_signed_pkey *kmocrypt_sign_get_pkey(kbuffer *buffer) {
 
         signed_pkey->mid = signed_pkey->sign.mid;
 
-        if (signed_pkey->sign.subpacket_array[KMO_SP_TYPE_BLOB] == NULL ||
-	    signed_pkey->sign.subpacket_array[KMO_SP_TYPE_DATE] == NULL) {
+        blob = get_subpacket(&signed_pkey->sign, KMO_SP_TYPE_BLOB);
+        date = get_subpacket(&signed_pkey->sign, KMO_SP_TYPE_DATE);
+        
+        if (blob == NULL || date == NULL) {
             kmo_seterror("the required fields (BLOB & DATE) for a signed key are not present in the packet");
             break;
         }
 
-        key = (struct kmo_blob *)signed_pkey->sign.subpacket_array[KMO_SP_TYPE_BLOB]->data;
-        if (key == NULL) {
-            kmo_seterror("the public key packet does not contain any key");
-            break;
-        }
-
-        tv = (struct timeval *)signed_pkey->sign.subpacket_array[KMO_SP_TYPE_DATE]->data;
-        signed_pkey->time.tv_sec = tv->tv_sec;
-        signed_pkey->time.tv_usec = tv->tv_usec;
+        /* The date contains the seconds and the microseconds. */
+        signed_pkey->time.tv_sec = subpacket_read32(subpacket_data(&signed_pkey->sign, date));
+        signed_pkey->time.tv_usec = subpacket_read32(subpacket_data(&signed_pkey->sign, date) + 4);
 
-        signed_pkey->key = kmocrypt_pkey_wired_new(key->buffer->data, key->buffer->len);
+        /* The key follows the type and the length of the blob. */
+        signed_pkey->key = kmocrypt_pkey_wired_new(subpacket_data(&signed_pkey->sign, blob) + 8, blob->len - 8);
     } while (0);
 
     kbuffer_destroy(buf_bin);
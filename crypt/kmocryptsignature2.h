@@ -42,14 +42,17 @@ struct kmocrypt_mail_client2 {
     uint16_t kpp_version;   
 };
 
-/* Subpacket list inside the KSP. */
-struct kmocrypt_subpacket_list2 {
+/* View of a subpacket inside the KSP. */
+struct kmocrypt_subpacket2 {
     
-    /* Pointer to the next subpacket, if any. */
-    struct kmocrypt_subpacket_list2 *next;
+    /* Offset of the data of the subpacket in the data of the signature. */
+    uint32_t offset;
     
-    /* Data of the subpacket. */
-    void *data;
+    /* Length of the data of the subpacket. */
+    uint16_t len;
+    
+    /* Type of the subpacket. */
+    uint8_t type;
 };
 
 /* This object represents the data contained in the signature of a Kryptiva
@@ -82,10 +85,21 @@ struct kmocrypt_signature2 {
     /* The hash for the signature. */
     gcry_sexp_t sig_hash;
 
-    /* Each slot of this array contains a chained list of subpackets of a given 
-     * type.
+    /* Subpackets of the known types, grouped by type, in the order of the KSP,
+     * and their number. The subpackets of type T are located from
+     * type_index[T] to type_index[T + 1] excluded.
+     */
+    struct kmocrypt_subpacket2 *subpacket_array;
+    int nb_subpacket;
+    int type_index[KMO_SP_NB_TYPE + 1];
+    
+    /* Copy of the subpacket section of the KSP, referred to by the subpackets.
+     * It is stored in the same block as the subpackets.
      */
-    struct kmocrypt_subpacket_list2 * subpacket_array[KMO_SP_NB_TYPE]; 
+    uint8_t *data;
+    
+    /* Index of the attachment subpackets by digest, NULL if there are none. */
+    struct kmocrypt_attachment_index * attachment_index;
 };
 
 int kmocrypt_recognize_ksp2(struct kmocrypt_signature2 *self, kbuffer *buffer);
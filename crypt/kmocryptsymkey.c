@@ -93,44 +93,54 @@ void kmocrypt_symkey_clean (kmocrypt_symkey *self)
 
 #define KMO_SYMKEY_ENC_MAGIC (0x23A6F9DDE35CF931ll)
 
-int kmocrypt_symkey_decrypt (kmocrypt_symkey  *self,
-                             unsigned char    *in,
-                             uint32_t          in_len,
-                             unsigned char    *out, 
-                             uint32_t         *out_len)
+int kmocrypt_symkey_decrypt_in_place (kmocrypt_symkey  *self,
+                                      unsigned char    *buf,
+                                      uint32_t          len,
+                                      uint32_t         *offset)
 {
     gcry_error_t err;
-    char *tmp        = (char *)kmo_malloc (in_len);
-    if (!tmp) {
-        kmo_seterror (strerror (errno));
-        return -1;
-    }
-    uint32_t tmp_len = in_len;
-    int i;
+    uint32_t i;
 
     err = gcry_cipher_reset (self->hd); if (err) goto GCRY_ERR;
     err = gcry_cipher_setiv (self->hd, self->iv, self->block_len); if (err) goto GCRY_ERR;
-    err = gcry_cipher_decrypt (self->hd, tmp, tmp_len, in, in_len); if (err) goto GCRY_ERR;
-
-    if (ntohll(*(uint64_t*)tmp) != KMO_SYMKEY_ENC_MAGIC) {
+    err = gcry_cipher_decrypt (self->hd, buf, len, NULL, 0); if (err) goto GCRY_ERR;
+
+    /* Wrong key. Encrypt the data back so that the caller may try another
+     * key. */
+    if (len < 8 || ntohll(*(uint64_t*)buf) != KMO_SYMKEY_ENC_MAGIC) {
+        err = gcry_cipher_reset (self->hd); if (err) goto GCRY_ERR;
+        err = gcry_cipher_setiv (self->hd, self->iv, self->block_len); if (err) goto GCRY_ERR;
+        err = gcry_cipher_encrypt (self->hd, buf, len, NULL, 0); if (err) goto GCRY_ERR;
         kmo_seterror ("invalid decryption");
-        goto ERR;
+        return -1;
     }
 
-    for (i = 8 ; i < (int) tmp_len ;)
-        if (tmp[i++] == '\0')
+    for (i = 8 ; i < len ;)
+        if (buf[i++] == '\0')
             break;
 
-    memcpy ((char *)out, tmp + i, tmp_len - i);
-    *out_len = tmp_len - i;
-
-    free (tmp);
+    *offset = i;
     return 0;
 
 GCRY_ERR:
     kmo_seterror ("gcrypt error : %s", gcry_strerror (err));
-ERR:
-    free (tmp);
-
     return -1;
 }
+
+int kmocrypt_symkey_decrypt (kmocrypt_symkey  *self,
+                             unsigned char    *in,
+                             uint32_t          in_len,
+                             unsigned char    *out, 
+                             uint32_t         *out_len)
+{
+    uint32_t offset;
+
+    memcpy (out, in, in_len);
+    if (kmocrypt_symkey_decrypt_in_place (self, out, in_len, &offset))
+        return -1;
+
+    memmove (out, out + offset, in_len - offset);
+    *out_len = in_len - offset;
+
+    return 0;
+}
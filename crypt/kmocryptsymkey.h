@@ -54,6 +54,21 @@ int kmocrypt_symkey_decrypt (kmocrypt_symkey   *self,
                              unsigned char     *out,
                              uint32_t          *out_len);
 
+/** decrypt data encrypted with a symmetric key in place
+ *
+ * \param self the symmetric key object.
+ * \param buf the encrypted data, replaced by the decrypted data. It is left
+ *        encrypted if the key is wrong.
+ * \param len the encrypted data length.
+ * \param offset returned offset of the plaintext in buf. The plaintext
+ *        length is len - offset.
+ * \return 0 on success, -1 on error.
+ */
+int kmocrypt_symkey_decrypt_in_place (kmocrypt_symkey   *self,
+                                      unsigned char     *buf,
+                                      uint32_t           len,
+                                      uint32_t          *offset);
+
 /** Destroy a symmetric key object.
  *
  * \param self the symmetric key to destroy.
@@ -2,10 +2,19 @@
 
 #include "k3p.h"
 #include "kmod.h"
+#include "kmo_log.h"
+#include "kmo_stats.h"
+#include "kmo_trace.h"
+#include "utils.h"
 
 /* Prefered size of the data buffer. */
 #define DATA_BUF_SIZE (64*1024)
 
+/* Strings smaller than this are copied in the data buffer even when they are
+ * written by reference.
+ */
+#define K3P_OUT_REF_MIN_LEN (4*1024)
+
 
 /* This function returns a string describing the K3P element specified. */
 static inline char * k3p_get_element_desc(int type) {
@@ -19,32 +28,86 @@ static inline char * k3p_get_element_desc(int type) {
     return NULL;
 }
 
-/* This function destroys the K3P element specified. */
-static inline void k3p_element_destroy(struct k3p_element *el) {
-    if (el == NULL) return;
+/* This function appends an element of the type specified to the element
+ * array and returns it. The elements are stored in the array and reused from
+ * one message to the next, along with the buffer of their string.
+ */
+static struct k3p_element * k3p_add_element(k3p_proto *k3p, int type) {
+    struct k3p_element *el;
     
-    if (el->str != NULL) {
-    	free(el->str);
+    if (k3p->element_array_size == k3p->element_array_alloc) {
+    	int i;
+	struct k3p_element *old_array = k3p->element_array;
+	int old_alloc = k3p->element_array_alloc;
+	
+	/* The strings cannot be moved with realloc(), since they may point to
+	 * their own storage. Move them one by one.
+	 */
+	k3p->element_array_alloc = old_alloc ? old_alloc * 2 : 16;
+	k3p->element_array = (struct k3p_element *) kmo_malloc(k3p->element_array_alloc * sizeof(struct k3p_element));
+	
+	for (i = 0; i < k3p->element_array_alloc; i++) {
+	    kstr_init(&k3p->element_array[i].str);
+	    
+	    if (i < old_alloc) {
+	    	k3p->element_array[i].type = old_array[i].type;
+		k3p->element_array[i].value = old_array[i].value;
+		k3p->element_array[i].spill_flag = old_array[i].spill_flag;
+	    	kstr_take(&k3p->element_array[i].str, &old_array[i].str);
+		kstr_free(&old_array[i].str);
+	    }
+	}
+	
+	free(old_array);
     }
     
-    free(el);
+    el = &k3p->element_array[k3p->element_array_size++];
+    el->type = type;
+    el->value = 0;
+    el->spill_flag = 0;
+    
+    /* Do not keep a large buffer we got back from a consumer around. */
+    kstr_shrink(&el->str, DATA_BUF_SIZE);
+    
+    return el;
+}
+
+/* This function removes the last element of the element array. It is used
+ * when the element could not be parsed.
+ */
+static inline void k3p_drop_element(k3p_proto *k3p) {
+    assert(k3p->element_array_size > 0);
+    k3p->element_array_size--;
 }
 
 /* This function initializes the K3P communication object. */
 void k3p_proto_init(k3p_proto *k3p) {
     memset(k3p, 0, sizeof(k3p_proto));
     k3p->state = K3P_INITIALIZED;
-    karray_init(&k3p->element_array);
     kbuffer_init(&k3p->data_buf, DATA_BUF_SIZE);
     kmo_data_transfer_init(&k3p->transfer);
+    kstr_init(&k3p->spill_dir);
+    karray_init(&k3p->spill_file_array);
 }
 
 /* This function frees the K3P communication object. */
 void k3p_proto_free(k3p_proto *k3p) {
+    int i;
+    
     k3p_proto_disconnect(k3p);
-    karray_free(&k3p->element_array);
+    
+    for (i = 0; i < k3p->element_array_alloc; i++)
+    	kstr_free(&k3p->element_array[i].str);
+    
+    free(k3p->element_array);
+    free(k3p->out_ref_array);
+    free(k3p->out_iov);
     kbuffer_clean(&k3p->data_buf);
     kmo_data_transfer_free(&k3p->transfer);
+    k3p_remove_spill_files(k3p);
+    karray_free(&k3p->spill_file_array);
+    free(k3p->passed_fd_array);
+    kstr_free(&k3p->spill_dir);
 }
 
 /* This function disconnects KMOD from the remote side, if it is connected. */
@@ -61,13 +124,10 @@ void k3p_proto_disconnect(k3p_proto *k3p) {
     	k3p->transfer.driver.disconnect(&k3p->transfer.fd);
     }
     
-    /* Destroy all incoming K3P elements. */
-    while (k3p->element_array_pos < k3p->element_array.size) {
-    	k3p_element_destroy((struct k3p_element *) k3p->element_array.data[k3p->element_array_pos]);
-	k3p->element_array_pos++;
-    }
-    
-    k3p->element_array_pos = k3p->element_array.size = 0;
+    /* Drop all incoming K3P elements and the strings to send. */
+    k3p->element_array_pos = k3p->element_array_size = 0;
+    k3p->out_ref_size = 0;
+    k3p_remove_spill_files(k3p);
     
     /* Shrink the data buffer. */
     kbuffer_shrink(&k3p->data_buf, DATA_BUF_SIZE);
@@ -83,7 +143,7 @@ void k3p_proto_disconnect(k3p_proto *k3p) {
 int k3p_perform_transfer(k3p_proto *k3p) {
     int error = 0;
     
-    kmod_log_msg(3, "k3p_perform_transfer() called.\n");
+    kmod_log_trace("k3p_perform_transfer() called.\n");
     
     /* Add the transfer. */
     kmo_transfer_hub_add(k3p->hub, &k3p->transfer);
@@ -116,7 +176,7 @@ int k3p_perform_transfer(k3p_proto *k3p) {
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int k3p_extend_data_buf(k3p_proto *k3p, uint32_t n) {
-    kmod_log_msg(3, "k3p_extend_data_buf() called.\n");
+    kmod_log_trace("k3p_extend_data_buf() called.\n");
     
     k3p->transfer.read_flag = 1;
     k3p->transfer.min_len = n;
@@ -133,46 +193,61 @@ static int k3p_extend_data_buf(k3p_proto *k3p, uint32_t n) {
     return 0;
 }
 
+/* This function reads 'n' bytes from the remote side directly in the buffer
+ * specified, bypassing the data buffer.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int k3p_read_direct(k3p_proto *k3p, char *buf, uint32_t n) {
+    kmod_log_trace("k3p_read_direct() called.\n");
+    
+    k3p->transfer.read_flag = 1;
+    k3p->transfer.min_len = n;
+    k3p->transfer.max_len = n;
+    k3p->transfer.op_timeout = k3p->timeout_enabled ? k3p->timeout : 0;
+    k3p->transfer.buf = buf;
+    
+    return k3p_perform_transfer(k3p);
+}
+
 /* This function parses a K3P instruction. 
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int k3p_parse_ins(k3p_proto *k3p) {
-    struct k3p_element *el = (struct k3p_element *) kmo_calloc(sizeof(struct k3p_element));
-    el->type = K3P_EL_INS;
+    int i;
+    uint8_t *buf;
+    uint32_t value = 0;
     
-    kmod_log_msg(3, "k3p_parse_ins() called.\n");
+    kmod_log_trace("k3p_parse_ins() called.\n");
     
-    /* Try. */
-    do {
-    	char buf[9];
-
-	/* Fetch the 8 bytes for the number. */
-	if (k3p->data_buf.pos + 8 > k3p->data_buf.len)
-    	    if (k3p_extend_data_buf(k3p, k3p->data_buf.pos + 8 - k3p->data_buf.len))
-	    	break;
-	
-	kbuffer_read(&k3p->data_buf, buf, 8);
-	buf[8] = 0;
+    /* Fetch the 8 bytes for the number. */
+    if (k3p->data_buf.pos + 8 > k3p->data_buf.len)
+	if (k3p_extend_data_buf(k3p, k3p->data_buf.pos + 8 - k3p->data_buf.len))
+	    return -1;
+    
+    buf = kbuffer_read_nbytes(&k3p->data_buf, 8);
+    
+    if (k3p_log) {
+	if (k3p_log_mode != 1) { k3p_log_mode = 1; kmo_log_printf(k3p_log, "\nINPUT>\n"); }
+	kmo_log_printf(k3p_log, "INS%.8s\n", buf);
+    }
+    
+    /* Parse the hexadecimal number. */
+    for (i = 0; i < 8; i++) {
+    	uint8_t c = buf[i];
 	
-	if (k3p_log) {
-    	    if (k3p_log_mode != 1) { k3p_log_mode = 1; fprintf(k3p_log, "\nINPUT>\n"); }
-    	    fprintf(k3p_log, "INS%s\n", buf);
-	}
+	if (c >= '0' && c <= '9') value = (value << 4) | (c - '0');
+	else if (c >= 'a' && c <= 'f') value = (value << 4) | (c - 'a' + 10);
+	else if (c >= 'A' && c <= 'F') value = (value << 4) | (c - 'A' + 10);
 	
-	/* Try to parse the content. */
-	if (sscanf(buf, "%x", &el->value) < 1) {
+	else {
     	    kmo_seterror("bad instruction format");
-	    break;
+	    return -1;
 	}
-    	
-	/* Queue the element. */
-	karray_add(&k3p->element_array, el);
-	return 0;
-    
-    } while (0);
+    }
     
-    free(el);
-    return -1;
+    /* Queue the element. */
+    k3p_add_element(k3p, K3P_EL_INS)->value = value;
+    return 0;
 }
 
 /* This function parses a number up to the '>' delimiter.
@@ -180,10 +255,11 @@ static int k3p_parse_ins(k3p_proto *k3p) {
  */
 static int k3p_parse_number(k3p_proto *k3p, uint32_t *num) {
     int i = 0;
+    uint64_t value = 0;
     
-    kmod_log_msg(3, "k3p_parse_number() called.\n");
+    kmod_log_trace("k3p_parse_number() called.\n");
     
-    /* Try to find the delimiter. */
+    /* Parse the digits until we find the delimiter. */
     while (1) {
     	char c;
 	
@@ -212,18 +288,17 @@ static int k3p_parse_number(k3p_proto *k3p, uint32_t *num) {
 	    return -1;
 	}
 	
+	value = value * 10 + (c - '0');
 	i++;
     }
     
-    /* Replace the delimiter by a zero, to get a NULL-terminated string. */
-    k3p->data_buf.data[k3p->data_buf.pos + i] = 0;
-    
-    /* Try to parse the number. */
-    if (sscanf(k3p->data_buf.data + k3p->data_buf.pos, "%u", num) < 1) {
+    if (value > UINT32_MAX) {
     	kmo_seterror("bad number format");
 	return -1;
     }
     
+    *num = (uint32_t) value;
+    
     /* Skip the number and the delimiter. */
     kbuffer_seek(&k3p->data_buf, i + 1, SEEK_CUR);    
     return 0;
@@ -233,33 +308,192 @@ static int k3p_parse_number(k3p_proto *k3p, uint32_t *num) {
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int k3p_parse_int(k3p_proto *k3p) {
-    struct k3p_element *el = (struct k3p_element *) kmo_calloc(sizeof(struct k3p_element));
-    el->type = K3P_EL_INT;
+    uint32_t value;
     
-    kmod_log_msg(3, "k3p_parse_int() called.\n");
+    kmod_log_trace("k3p_parse_int() called.\n");
     
-    if (k3p_parse_number(k3p, &el->value)) {
-    	free(el);
+    if (k3p_parse_number(k3p, &value)) {
 	return -1;
     }
     
     if (k3p_log) {
-    	if (k3p_log_mode != 1) { k3p_log_mode = 1; fprintf(k3p_log, "\nINPUT>\n"); }
-    	fprintf(k3p_log, "INT%u>\n", el->value);
+    	if (k3p_log_mode != 1) { k3p_log_mode = 1; kmo_log_printf(k3p_log, "\nINPUT>\n"); }
+    	kmo_log_printf(k3p_log, "INT%u>\n", value);
     }
     
-    karray_add(&k3p->element_array, el);
+    k3p_add_element(k3p, K3P_EL_INT)->value = value;
     return 0;
 }
 
+/* This function writes the data of the string element specified in a new
+ * temporary file of the spill directory. The part of the string that is in the
+ * data buffer is written first, then the rest is received by chunks. On
+ * return, the string of the element contains the path to the file.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int k3p_spill_str(k3p_proto *k3p, struct k3p_element *el) {
+    int error = 0;
+    FILE *file = NULL;
+    char *chunk = NULL;
+    char rand_buf[8];
+    kstr name;
+    kstr *path;
+    uint32_t left = el->value;
+    uint32_t n;
+    
+    kmod_log_trace("k3p_spill_str() called.\n");
+    
+    kstr_init(&name);
+    
+    /* Try. */
+    do {
+    	/* Create the file. Its path is remembered once it exists, so that it is
+	 * removed even if the transfer fails.
+	 */
+    	error = util_generate_random(rand_buf, sizeof(rand_buf));
+	if (error) break;
+	
+	util_bin_to_hex((unsigned char *) rand_buf, sizeof(rand_buf), &name);
+	kstr_sf(&el->str, "%s/k3p_%s", k3p->spill_dir.data, name.data);
+	
+	error = util_open_file(&file, el->str.data, "wb");
+	if (error) break;
+	
+	path = kstr_new();
+	kstr_assign_kstr(path, &el->str);
+	karray_add(&k3p->spill_file_array, path);
+	
+	/* Write the data already received. */
+	n = k3p->data_buf.len - k3p->data_buf.pos;
+	if (n > left) n = left;
+	
+	error = util_write_file(file, kbuffer_current_pos(&k3p->data_buf), n);
+	if (error) break;
+	
+	kbuffer_seek(&k3p->data_buf, n, SEEK_CUR);
+	left -= n;
+	
+	/* Receive the rest. */
+	if (left) chunk = (char *) kmo_malloc(DATA_BUF_SIZE);
+	
+	while (left) {
+	    n = left < DATA_BUF_SIZE ? left : DATA_BUF_SIZE;
+	    
+	    error = k3p_read_direct(k3p, chunk, n);
+	    if (error) break;
+	    
+	    error = util_write_file(file, chunk, n);
+	    if (error) break;
+	    
+	    left -= n;
+	}
+	
+	if (error) break;
+	
+	error = util_close_file(&file, 0);
+	if (error) break;
+	
+	el->spill_flag = 1;
+	
+	if (k3p_log) kmo_log_printf(k3p_log, "<written in %s>", el->str.data);
+	
+    } while (0);
+    
+    util_close_file(&file, 1);
+    free(chunk);
+    kstr_free(&name);
+    
+    return error;
+}
+
+/* This function reads the string written in a temporary file by
+ * k3p_spill_str() back in memory, in 'str'.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int k3p_load_spill_str(struct k3p_element *el, kstr *str) {
+    int error = 0;
+    FILE *file = NULL;
+    
+    kmod_log_trace("k3p_load_spill_str() called.\n");
+    
+    /* Try. */
+    do {
+    	error = util_open_file(&file, el->str.data, "rb");
+	if (error) break;
+	
+	kstr_grow(str, el->value);
+	
+	error = util_read_file(file, str->data, el->value);
+	if (error) break;
+	
+	str->data[el->value] = 0;
+	str->slen = el->value;
+	
+	error = util_close_file(&file, 0);
+	if (error) break;
+	
+    } while (0);
+    
+    util_close_file(&file, 1);
+    
+    return error;
+}
+
+/* This function takes the next descriptor passed by the remote side and sets
+ * 'path' to a path that opens the same file. The descriptor is closed by
+ * k3p_remove_spill_files(). On Mac OS X and the BSDs, the opens of the path
+ * share the offset of the descriptor; util_open_file() rewinds the file.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int k3p_take_passed_file(k3p_proto *k3p, kstr *path) {
+    int fd = -1;
+    
+    kmod_log_trace("k3p_take_passed_file() called.\n");
+    
+    if (k3p->transfer.driver.take_fd) fd = k3p->transfer.driver.take_fd(k3p->transfer.fd);
+    
+    if (fd == -1) {
+    	kmo_seterror("no file descriptor was received for the attachment");
+	return -1;
+    }
+    
+    if (k3p->passed_fd_size == k3p->passed_fd_alloc) {
+    	k3p->passed_fd_alloc = k3p->passed_fd_alloc ? k3p->passed_fd_alloc * 2 : 8;
+	k3p->passed_fd_array = (int *) kmo_realloc(k3p->passed_fd_array, k3p->passed_fd_alloc * sizeof(int));
+    }
+    
+    k3p->passed_fd_array[k3p->passed_fd_size++] = fd;
+    kstr_sf(path, "/dev/fd/%d", fd);
+    return 0;
+}
+
+/* This function removes the temporary files created for the incoming strings
+ * and closes the descriptors passed by the remote side. It is called once the
+ * strings have been consumed, i.e. after each instruction has been handled.
+ */
+void k3p_remove_spill_files(k3p_proto *k3p) {
+    int i;
+    
+    for (i = 0; i < k3p->passed_fd_size; i++) close(k3p->passed_fd_array[i]);
+    k3p->passed_fd_size = 0;
+    
+    for (i = 0; i < k3p->spill_file_array.size; i++) {
+    	kstr *path = (kstr *) k3p->spill_file_array.data[i];
+	
+	if (util_delete_regular_file(path->data))
+	    kmod_log_msg(1, "Cannot remove K3P temporary file: %s.\n", kmo_strerror());
+    }
+    
+    kmo_clear_kstr_array(&k3p->spill_file_array);
+}
+
 /* This function parses a K3P string.
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int k3p_parse_str(k3p_proto *k3p) {
-    struct k3p_element *el = (struct k3p_element *) kmo_calloc(sizeof(struct k3p_element));
-    el->type = K3P_EL_STR;
+    struct k3p_element *el = k3p_add_element(k3p, K3P_EL_STR);
     
-    kmod_log_msg(3, "k3p_parse_str() called.\n");
+    kmod_log_trace("k3p_parse_str() called.\n");
     
     /* Try. */
     do {
@@ -273,29 +507,53 @@ static int k3p_parse_str(k3p_proto *k3p) {
 	}
 	
 	if (k3p_log) {
-    	    if (k3p_log_mode != 1) { k3p_log_mode = 1; fprintf(k3p_log, "\nINPUT>\n"); }
-    	    fprintf(k3p_log, "STR%u>", el->value);
+    	    if (k3p_log_mode != 1) { k3p_log_mode = 1; kmo_log_printf(k3p_log, "\nINPUT>\n"); }
+    	    kmo_log_printf(k3p_log, "STR%u>", el->value);
 	}
 	
-	if (el->value) {	    
+	/* A large string is written in a temporary file. */
+	if (k3p->spill_threshold && el->value > k3p->spill_threshold) {
+	    if (k3p_spill_str(k3p, el))
+	    	break;
+	}
+	
+	else if (el->value) {
+	    uint32_t missing = 0;
+	    
 	    if (k3p->data_buf.pos + el->value > k3p->data_buf.len)
-    		if (k3p_extend_data_buf(k3p, k3p->data_buf.pos + el->value - k3p->data_buf.len))
+	    	missing = k3p->data_buf.pos + el->value - k3p->data_buf.len;
+	    
+	    /* A small string is completed in the data buffer, so that the
+	     * following elements are received along with it.
+	     */
+	    if (missing && missing < DATA_BUF_SIZE) {
+    		if (k3p_extend_data_buf(k3p, missing))
 	    	    break;
+		missing = 0;
+	    }
+	    
+	    /* The string is received once in the buffer of the element. The
+	     * rest of a large string is received directly in there.
+	     */
+	    kstr_grow(&el->str, el->value);
+	    kbuffer_read(&k3p->data_buf, (uint8_t *) el->str.data, el->value - missing);
+	    
+	    if (missing && k3p_read_direct(k3p, el->str.data + el->value - missing, missing))
+	    	break;
+	    
+	    el->str.data[el->value] = 0;
+	    el->str.slen = el->value;
 
-	    el->str = (char *) kmo_malloc(el->value);
-	    kbuffer_read(&k3p->data_buf, el->str, el->value);
-
-    	    if (k3p_log) fwrite(el->str, 1, el->value, k3p_log);
+    	    if (k3p_log) kmo_log_payload(k3p_log, el->str.data, el->value);
 	}
 	
-	if (k3p_log) fprintf(k3p_log, "\n");
+	if (k3p_log) kmo_log_write(k3p_log, "\n", 1);
 	
-	karray_add(&k3p->element_array, el);
 	return 0;
     
     } while (0);
     
-    k3p_element_destroy(el);
+    k3p_drop_element(k3p);
     return -1;
 }
 
@@ -307,13 +565,13 @@ static int k3p_parse_str(k3p_proto *k3p) {
 int k3p_receive_element(k3p_proto *k3p) {
     int error = 0;
     
-    kmod_log_msg(3, "k3p_receive_element() called.\n");
+    kmod_log_trace("k3p_receive_element() called.\n");
     
     /* Normally, in this context, we have consumed all the elements in the
      * element array. Anything else means the logic is wrong.
      */
-    assert(k3p->element_array_pos == k3p->element_array.size);
-    k3p->element_array_pos = k3p->element_array.size = 0;
+    assert(k3p->element_array_pos == k3p->element_array_size);
+    k3p->element_array_pos = k3p->element_array_size = 0;
     
     /* Try. */
     do {
@@ -329,7 +587,7 @@ int k3p_receive_element(k3p_proto *k3p) {
     	    
 	    /* If we're at the end of the data buffer, we're done. */
 	    if (k3p->data_buf.pos == k3p->data_buf.len) {
-		assert(k3p->element_array.size > 0);
+		assert(k3p->element_array_size > 0);
 		break;
 	    }
 
@@ -343,17 +601,17 @@ int k3p_receive_element(k3p_proto *k3p) {
 	    kbuffer_read(&k3p->data_buf, elem_type, 3);			
 	    elem_type[3] = 0;
 
-	    if (strcmp(elem_type, "INT") == 0) {
+	    if (memcmp(elem_type, "INT", 3) == 0) {
 		error = k3p_parse_int(k3p);
 		if (error) break;
 	    }
 
-	    else if (strcmp(elem_type, "INS") == 0) {
+	    else if (memcmp(elem_type, "INS", 3) == 0) {
 		error = k3p_parse_ins(k3p);
 		if (error) break;
 	    }
 
-	    else if (strcmp(elem_type, "STR") == 0) {
+	    else if (memcmp(elem_type, "STR", 3) == 0) {
 		error = k3p_parse_str(k3p);
 		if (error) break;
 	    }
@@ -379,25 +637,27 @@ int k3p_receive_element(k3p_proto *k3p) {
 }
 
 /* This function reads the element specified in the memory location specified.
- * It is used to compact the code.
+ * It is used to compact the code. If 'is_file_path' is not NULL and the string
+ * has been written in a temporary file, the path to the file is read and
+ * *is_file_path is set to true. Otherwise, the string is read back in memory.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int k3p_consume_next_element(struct k3p_proto *k3p, int type, void *loc) {
+static int k3p_consume_next_element(struct k3p_proto *k3p, int type, void *loc, uint32_t *is_file_path) {
     int error = 0;
     struct k3p_element *el = NULL;
     
-    kmod_log_msg(3, "k3p_consume_next_element() called.\n");
+    kmod_log_trace("k3p_consume_next_element() called.\n");
     
     /* Try. */
     do {
     	/* Read more elements, if needed. */
-    	if (k3p->element_array_pos == k3p->element_array.size) {
-	    k3p->element_array_pos = k3p->element_array.size = 0;
+    	if (k3p->element_array_pos == k3p->element_array_size) {
+	    k3p->element_array_pos = k3p->element_array_size = 0;
 	    error = k3p_receive_element(k3p);
 	    if (error) break;
 	}
 	
-	el = (struct k3p_element *) k3p->element_array.data[k3p->element_array_pos];
+	el = &k3p->element_array[k3p->element_array_pos];
 	k3p->element_array_pos++; 
     	
 	if (el->type != type) {
@@ -410,15 +670,28 @@ static int k3p_consume_next_element(struct k3p_proto *k3p, int type, void *loc)
 	    *(uint32_t *) loc = el->value;
 	}
 	
+	else if (el->spill_flag && is_file_path) {
+	    kstr_swap((kstr *) loc, &el->str);
+	    *is_file_path = 1;
+	}
+	
+	else if (el->spill_flag) {
+	    error = k3p_load_spill_str(el, (kstr *) loc);
+	    if (error) break;
+	}
+	
+	else if (el->value) {
+	    kstr_swap((kstr *) loc, &el->str);
+	}
+	
 	else {
-	    kstr_assign_buf((kstr *) loc, el->str, el->value);
+	    kstr_clear((kstr *) loc);
 	}
 	
     } while (0);
     
     if (error) k3p_proto_disconnect(k3p);
 
-    k3p_element_destroy(el);
     return error;
 }
 
@@ -426,24 +699,35 @@ static int k3p_consume_next_element(struct k3p_proto *k3p, int type, void *loc)
  * This function sets the KMO error string. It returns -1 on failure.
  */
 int k3p_read_inst(k3p_proto *k3p, uint32_t *i) {
-    kmod_log_msg(3, "k3p_read_inst() called.\n");
-    return k3p_consume_next_element(k3p, K3P_EL_INS, i);
+    kmod_log_trace("k3p_read_inst() called.\n");
+    return k3p_consume_next_element(k3p, K3P_EL_INS, i, NULL);
 }
 
 /* This function reads a 32 bit unsigned integer from the remote side.
  * This function sets the KMO error string. It returns -1 on failure.
  */
 int k3p_read_uint32(k3p_proto *k3p, uint32_t *i) {
-    kmod_log_msg(3, "k3p_read_uint32() called.\n");
-    return k3p_consume_next_element(k3p, K3P_EL_INT, i);
+    kmod_log_trace("k3p_read_uint32() called.\n");
+    return k3p_consume_next_element(k3p, K3P_EL_INT, i, NULL);
 }
 
 /* This function reads a kstr from the remote side.
  * This function sets the KMO error string. It returns -1 on failure.
  */
 int k3p_read_kstr(k3p_proto *k3p, kstr *str) {
-    kmod_log_msg(3, "k3p_read_kstr() called.\n");
-    return k3p_consume_next_element(k3p, K3P_EL_STR, str);
+    kmod_log_trace("k3p_read_kstr() called.\n");
+    return k3p_consume_next_element(k3p, K3P_EL_STR, str, NULL);
+}
+
+/* This function reads a kstr from the remote side. If the string is large, it
+ * may have been written in a temporary file. In that case, the path to the
+ * file is read instead and *is_file_path is set to true. The file is removed
+ * by k3p_remove_spill_files().
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int k3p_read_kstr_or_file(k3p_proto *k3p, kstr *str, uint32_t *is_file_path) {
+    kmod_log_trace("k3p_read_kstr_or_file() called.\n");
+    return k3p_consume_next_element(k3p, K3P_EL_STR, str, is_file_path);
 }
 
 /* This function writes an instruction to the remote side.
@@ -453,15 +737,15 @@ void k3p_write_inst(k3p_proto *k3p, uint32_t i) {
     char buf[12];
     int len = sprintf(buf, "INS%08x", i);
     
-    kmod_log_msg(3, "k3p_write_inst() called.\n");
+    kmod_log_trace("k3p_write_inst() called.\n");
     
     assert(len == 11);
     len = 0;
     kbuffer_write(&k3p->data_buf, buf, 11);
     
     if (k3p_log) {
-    	if (k3p_log_mode != 2) { k3p_log_mode = 2; fprintf(k3p_log, "\nOUTPUT>\n"); }
-    	fprintf(k3p_log, "%s\n", buf);
+    	if (k3p_log_mode != 2) { k3p_log_mode = 2; kmo_log_printf(k3p_log, "\nOUTPUT>\n"); }
+    	kmo_log_printf(k3p_log, "%s\n", buf);
     }
 }
 
@@ -472,14 +756,14 @@ void k3p_write_uint32(k3p_proto *k3p, uint32_t i) {
     char buf[15];
     int len = sprintf(buf, "INT%u>", i);
     
-    kmod_log_msg(3, "k3p_write_uint32() called.\n");
+    kmod_log_trace("k3p_write_uint32() called.\n");
     
     assert(len <= 14);
     kbuffer_write(&k3p->data_buf, buf, len);
     
     if (k3p_log) {
-    	if (k3p_log_mode != 2) { k3p_log_mode = 2; fprintf(k3p_log, "\nOUTPUT>\n"); }
-    	fprintf(k3p_log, "%s\n", buf);
+    	if (k3p_log_mode != 2) { k3p_log_mode = 2; kmo_log_printf(k3p_log, "\nOUTPUT>\n"); }
+    	kmo_log_printf(k3p_log, "%s\n", buf);
     }
 }
 
@@ -490,25 +774,178 @@ void k3p_write_kstr(k3p_proto *k3p, kstr *str) {
     char buf[15];
     int len = sprintf(buf, "STR%u>", str->slen);
     
-    kmod_log_msg(3, "k3p_write_kstr() called.\n");
+    kmod_log_trace("k3p_write_kstr() called.\n");
     
     assert(len <= 14);
     kbuffer_write(&k3p->data_buf, buf, len);
     kbuffer_write(&k3p->data_buf, str->data, str->slen);
     
     if (k3p_log) {
-    	if (k3p_log_mode != 2) { k3p_log_mode = 2; fprintf(k3p_log, "\nOUTPUT>\n"); }
-    	fprintf(k3p_log, "%s", buf);
-	fwrite(str->data, 1, str->slen, k3p_log);
-	fprintf(k3p_log, "\n");
+    	if (k3p_log_mode != 2) { k3p_log_mode = 2; kmo_log_printf(k3p_log, "\nOUTPUT>\n"); }
+    	kmo_log_printf(k3p_log, "%s", buf);
+	kmo_log_payload(k3p_log, str->data, str->slen);
+	kmo_log_write(k3p_log, "\n", 1);
     }
 }
 
+/* This function records a buffer to send after the data written so far,
+ * without copying it.
+ */
+static void k3p_add_out_ref(k3p_proto *k3p, char *data, uint32_t len) {
+    struct k3p_out_ref *ref;
+    
+    if (k3p->out_ref_size == k3p->out_ref_alloc) {
+    	k3p->out_ref_alloc = k3p->out_ref_alloc ? k3p->out_ref_alloc * 2 : 8;
+	k3p->out_ref_array = (struct k3p_out_ref *)
+	    kmo_realloc(k3p->out_ref_array, k3p->out_ref_alloc * sizeof(struct k3p_out_ref));
+    }
+    
+    ref = &k3p->out_ref_array[k3p->out_ref_size++];
+    ref->offset = k3p->data_buf.len;
+    ref->data = data;
+    ref->len = len;
+}
+
+/* This function writes a kstr to the remote side without copying its content.
+ * The string must not be modified or freed until k3p_send_data() has been
+ * called. Small strings are copied like k3p_write_kstr() does.
+ * The data is not sent until a send operation is requested.
+ */
+void k3p_write_kstr_ref(k3p_proto *k3p, kstr *str) {
+    char buf[15];
+    int len;
+    
+    if (str->slen < K3P_OUT_REF_MIN_LEN) {
+    	k3p_write_kstr(k3p, str);
+	return;
+    }
+    
+    kmod_log_trace("k3p_write_kstr_ref() called.\n");
+    
+    len = sprintf(buf, "STR%u>", str->slen);
+    assert(len <= 14);
+    kbuffer_write(&k3p->data_buf, buf, len);
+    k3p_add_out_ref(k3p, str->data, str->slen);
+    
+    if (k3p_log) {
+    	if (k3p_log_mode != 2) { k3p_log_mode = 2; kmo_log_printf(k3p_log, "\nOUTPUT>\n"); }
+    	kmo_log_printf(k3p_log, "%s", buf);
+	kmo_log_payload(k3p_log, str->data, str->slen);
+	kmo_log_write(k3p_log, "\n", 1);
+    }
+}
+
+/* This function writes the content of a rope to the remote side as a single
+ * string, without copying it. Each segment of the rope is sent from its own
+ * buffer. The rope must not be modified or freed until k3p_send_data() has
+ * been called.
+ * The data is not sent until a send operation is requested.
+ */
+void k3p_write_krope_ref(k3p_proto *k3p, krope *rope) {
+    char buf[15];
+    int len;
+    int i;
+    
+    kmod_log_trace("k3p_write_krope_ref() called.\n");
+    
+    len = sprintf(buf, "STR%u>", rope->len);
+    assert(len <= 14);
+    kbuffer_write(&k3p->data_buf, buf, len);
+    
+    for (i = 0; i < rope->nb_seg; i++) {
+    	if (rope->seg_array[i].len) k3p_add_out_ref(k3p, (char *) rope->seg_array[i].data, rope->seg_array[i].len);
+    }
+    
+    if (k3p_log) {
+    	if (k3p_log_mode != 2) { k3p_log_mode = 2; kmo_log_printf(k3p_log, "\nOUTPUT>\n"); }
+    	kmo_log_printf(k3p_log, "%s", buf);
+	
+	for (i = 0; i < rope->nb_seg; i++) {
+	    kmo_log_payload(k3p_log, rope->seg_array[i].data, rope->seg_array[i].len);
+	}
+	
+	kmo_log_write(k3p_log, "\n", 1);
+    }
+}
+
+/* This function copies the referenced strings in the data buffer. It is used
+ * when the driver does not support vectored writes.
+ */
+static void k3p_flatten_out_ref(k3p_proto *k3p) {
+    kbuffer flat;
+    uint32_t pos = 0;
+    int i;
+    
+    kbuffer_init(&flat, k3p->data_buf.len);
+    
+    for (i = 0; i < k3p->out_ref_size; i++) {
+    	struct k3p_out_ref *ref = &k3p->out_ref_array[i];
+	kbuffer_write(&flat, k3p->data_buf.data + pos, ref->offset - pos);
+	kbuffer_write(&flat, ref->data, ref->len);
+	pos = ref->offset;
+    }
+    
+    kbuffer_write(&flat, k3p->data_buf.data + pos, k3p->data_buf.len - pos);
+    
+    kbuffer_clean(&k3p->data_buf);
+    k3p->data_buf = flat;
+    k3p->out_ref_size = 0;
+}
+
+/* This function fills the buffer vector of the transfer with the data buffer
+ * and the referenced strings.
+ */
+static void k3p_prepare_out_iov(k3p_proto *k3p) {
+    uint32_t pos = 0, total = 0;
+    int i, count = 0;
+    
+    if (k3p->out_iov_alloc < 2 * k3p->out_ref_size + 1) {
+    	k3p->out_iov_alloc = 2 * k3p->out_ref_size + 1;
+	k3p->out_iov = (struct kmo_iovec *) kmo_realloc(k3p->out_iov, k3p->out_iov_alloc * sizeof(struct kmo_iovec));
+    }
+    
+    for (i = 0; i < k3p->out_ref_size; i++) {
+    	struct k3p_out_ref *ref = &k3p->out_ref_array[i];
+	
+	if (ref->offset > pos) {
+	    k3p->out_iov[count].buf = k3p->data_buf.data + pos;
+	    k3p->out_iov[count].len = ref->offset - pos;
+	    total += ref->offset - pos;
+	    count++;
+	}
+	
+	k3p->out_iov[count].buf = ref->data;
+	k3p->out_iov[count].len = ref->len;
+	total += ref->len;
+	count++;
+	pos = ref->offset;
+    }
+    
+    if (k3p->data_buf.len > pos) {
+	k3p->out_iov[count].buf = k3p->data_buf.data + pos;
+	k3p->out_iov[count].len = k3p->data_buf.len - pos;
+	total += k3p->data_buf.len - pos;
+	count++;
+    }
+    
+    k3p->transfer.iov = k3p->out_iov;
+    k3p->transfer.iov_count = count;
+    k3p->transfer.min_len = total;
+    k3p->transfer.max_len = total;
+}
+
 /* This function sends the data written to the remote side.
  * This function sets the KMO error string. It returns -1 on failure.
  */
 int k3p_send_data(k3p_proto *k3p) {
-    kmod_log_msg(3, "k3p_send_data() called.\n");
+    int error = 0;
+    uint64_t start = kmo_stats_now();
+    
+    kmod_log_trace("k3p_send_data() called.\n");
+    
+    if (k3p->out_ref_size && k3p->transfer.driver.write_iov == NULL) {
+    	k3p_flatten_out_ref(k3p);
+    }
     
     k3p->transfer.read_flag = 0;
     k3p->transfer.buf = k3p->data_buf.data;
@@ -516,7 +953,19 @@ int k3p_send_data(k3p_proto *k3p) {
     k3p->transfer.max_len = k3p->data_buf.len;
     k3p->transfer.op_timeout = k3p->timeout_enabled ? k3p->timeout : 0;
     
-    if (k3p_perform_transfer(k3p)) {
+    /* Send the referenced strings along with the data buffer. */
+    if (k3p->out_ref_size) {
+    	k3p_prepare_out_iov(k3p);
+    }
+    
+    error = k3p_perform_transfer(k3p);
+    kmo_trace_span("k3p.send", start);
+    
+    k3p->transfer.iov = NULL;
+    k3p->transfer.iov_count = 0;
+    k3p->out_ref_size = 0;
+    
+    if (error) {
     	k3p_proto_disconnect(k3p);
     	return -1;
     }
@@ -547,10 +996,11 @@ int k3p_read_mail_body(k3p_proto *k3p, struct kmod_mail_body *self) {
     return 0;
 }
 
+/* The bodies are written by reference. */
 void k3p_write_mail_body(k3p_proto *k3p, struct kmod_mail_body *self) {
     k3p_write_uint32(k3p, self->type);
-    k3p_write_kstr(k3p, &self->text);
-    k3p_write_kstr(k3p, &self->html);
+    k3p_write_kstr_ref(k3p, &self->text);
+    k3p_write_kstr_ref(k3p, &self->html);
 }
 
 void k3p_init_mail_attachment(struct kmod_mail_attachment *self) {
@@ -572,17 +1022,24 @@ void k3p_free_mail_attachment(struct kmod_mail_attachment *self) {
 int k3p_read_mail_attachment(k3p_proto *k3p, struct kmod_mail_attachment *self) {
     if (k3p_read_uint32(k3p, &self->tie)) return -1;
     if (k3p_read_uint32(k3p, &self->data_is_file_path)) return -1;
-    if (k3p_read_kstr(k3p, &self->data)) return -1;
+    if (k3p_read_kstr_or_file(k3p, &self->data, &self->data_is_file_path)) return -1;
+    
+    if (self->data_is_file_path == K3P_MAIL_ATTACHMENT_DATA_FD) {
+    	if (k3p_take_passed_file(k3p, &self->data)) return -1;
+	self->data_is_file_path = 1;
+    }
+    
     if (k3p_read_kstr(k3p, &self->name)) return -1;
     if (k3p_read_kstr(k3p, &self->encoding)) return -1;
     if (k3p_read_kstr(k3p, &self->mime_type)) return -1;
     return 0;
 }
 
+/* The attachment data is written by reference. */
 void k3p_write_mail_attachment(k3p_proto *k3p, struct kmod_mail_attachment *self) {
     k3p_write_uint32(k3p, self->tie);
     k3p_write_uint32(k3p, self->data_is_file_path);
-    k3p_write_kstr(k3p, &self->data);
+    k3p_write_kstr_ref(k3p, &self->data);
     k3p_write_kstr(k3p, &self->name);
     k3p_write_kstr(k3p, &self->encoding);
     k3p_write_kstr(k3p, &self->mime_type);
@@ -6,6 +6,7 @@
 #include "kmo_base.h"
 #include "kmo_comm.h"
 #include "kbuffer.h"
+#include "krope.h"
 #include "k3p_core_defs.h"
 
 /* State of the protocol. */
@@ -47,6 +48,15 @@ enum {
     K3P_EL_STR
 };
 
+/* String written to the remote side without being copied in the data buffer.
+ * The string is sent after the first 'offset' bytes of the data buffer.
+ */
+struct k3p_out_ref {
+    uint32_t offset;
+    char *data;
+    uint32_t len;
+};
+
 /* K3P data element. */
 struct k3p_element {
     
@@ -56,8 +66,16 @@ struct k3p_element {
     /* Instruction or integer value, if applicable, or the string length. */
     uint32_t value;
     
-    /* String data, if applicable. */
-    char *str;
+    /* String data, if applicable. The consumer of the element takes the
+     * content of the string instead of copying it. The string is reused by
+     * the next element stored at this position.
+     */
+    kstr str;
+    
+    /* True if the string data has been written in a temporary file, in which
+     * case 'str' contains the path to the file.
+     */
+    int spill_flag;
 };
 
 /* This object handles the communication between the plugin and KMOD through
@@ -74,8 +92,12 @@ typedef struct k3p_proto {
     /* Time to wait for the other side, in milliseconds. */
     uint32_t timeout;
     
-    /* Array of incoming K3P elements. */
-    karray element_array;
+    /* Array of incoming K3P elements, its size and its allocated size. The
+     * elements are stored inline and reused.
+     */
+    struct k3p_element *element_array;
+    int element_array_size;
+    int element_array_alloc;
     
     /* Read position in the element array. We do not add new elements in the
      * array until all elements have been consumed.
@@ -92,11 +114,50 @@ typedef struct k3p_proto {
      */
     kbuffer data_buf;
     
+    /* Strings to send along with the data buffer, their number and the
+     * allocated size of the array. See k3p_write_kstr_ref().
+     */
+    struct k3p_out_ref *out_ref_array;
+    int out_ref_size;
+    int out_ref_alloc;
+    
+    /* Buffers used to send the data buffer and the referenced strings, and
+     * the allocated size of the array.
+     */
+    struct kmo_iovec *out_iov;
+    int out_iov_alloc;
+    
     /* This object describes the current transfer operation. */
     struct kmo_data_transfer transfer;
     
     /* Pointer to the transfer hub. */
     struct kmo_transfer_hub *hub;
+    
+    /* Incoming strings larger than this are written in a temporary file of
+     * the directory 'spill_dir' instead of being kept in memory. 0 disables
+     * this.
+     */
+    uint32_t spill_threshold;
+    kstr spill_dir;
+    
+    /* Paths to the temporary files created for the incoming strings. See
+     * k3p_remove_spill_files().
+     */
+    karray spill_file_array;
+    
+    /* Descriptors passed by the remote side for the incoming attachments.
+     * See k3p_remove_spill_files().
+     */
+    int *passed_fd_array;
+    int passed_fd_size;
+    int passed_fd_alloc;
+    
+    /* True if the KNP transfers must stop as soon as the plugin sends an
+     * instruction. The instruction is left for the interaction loop and the
+     * transfers return -2. This is used for the work done while the plugin is
+     * idle.
+     */
+    int knp_yield_flag;
 } k3p_proto;
 
 /* K3P structures used internally by KMO. These structures are easier to work
@@ -223,6 +284,9 @@ struct kmod_eval_res {
 	struct kmod_otut otut;  
 };
 
+/* Maximum size of the digest of an attachment. */
+#define KMOD_ATTACHMENT_MAX_DIGEST_LEN	64
+
 /* Info about the attachments received/sent to the plugin. This is a catch-all
  * structure used in several places for different purposes.
  */
@@ -234,9 +298,21 @@ struct kmod_attachment {
     /* Status (using K3P constants, with 0 for uninitialized). */
     int status;
     
-    /* Attachment data. */
+    /* Attachment data, or path to the file containing the attachment data
+     * if 'data_is_file_path' is true.
+     */
     kstr *data;
     
+    /* True if the attachment data is read from the file on demand. */
+    int data_is_file_path;
+    
+    /* Digest of the attachment data computed with the algorithm
+     * 'payload_hash_algo', if 'payload_hash_len' is not 0.
+     */
+    int payload_hash_algo;
+    uint32_t payload_hash_len;
+    uint8_t payload_hash[KMOD_ATTACHMENT_MAX_DIGEST_LEN];
+    
     /* Attachment name. */
     kstr *name;
     
@@ -255,9 +331,13 @@ int k3p_receive_element(k3p_proto *k3p);
 int k3p_read_inst(k3p_proto *k3p, uint32_t *i);
 int k3p_read_uint32(k3p_proto *k3p, uint32_t *i);
 int k3p_read_kstr(k3p_proto *k3p, kstr *str);
+int k3p_read_kstr_or_file(k3p_proto *k3p, kstr *str, uint32_t *is_file_path);
+void k3p_remove_spill_files(k3p_proto *k3p);
 void k3p_write_inst(k3p_proto *k3p, uint32_t i);
 void k3p_write_uint32(k3p_proto *k3p, uint32_t i);
 void k3p_write_kstr(k3p_proto *k3p, kstr *str);
+void k3p_write_kstr_ref(k3p_proto *k3p, kstr *str);
+void k3p_write_krope_ref(k3p_proto *k3p, krope *rope);
 int k3p_send_data(k3p_proto *k3p);
 void k3p_init_mail_body(struct kmod_mail_body *self);
 void k3p_free_mail_body(struct kmod_mail_body *self);
@@ -95,6 +95,22 @@ typedef struct kpstr
  */
 #define K3P_EXCHANGE_KAAPSD_MESSAGE 	36
 
+/* Send a message to KAPPSD without waiting for the reply, so that several
+ * messages can be in flight.
+ * Input: as K3P_EXCHANGE_KAAPSD_MESSAGE.
+ * Output: inst 0 if successful, followed by the stream ID of the message (int).
+ *         inst 1 on error, followed by error string.
+ * Kappsd session must be closed if inst 1 is returned.
+ */
+#define K3P_SEND_KAPPSD_MESSAGE		47
+
+/* Receive the reply to a message sent with K3P_SEND_KAPPSD_MESSAGE. The
+ * replies can be received in any order.
+ * Input: Int stream ID of the message.
+ * Output: as K3P_EXCHANGE_KAAPSD_MESSAGE.
+ */
+#define K3P_RECV_KAPPSD_MESSAGE		48
+
 /* Kappsd messages:
  * 
  * Obtain port:
@@ -192,6 +208,29 @@ typedef struct kpstr
  *         Str Error String ("" if none).
  */
 
+/* Return the runtime statistics of KMOD. */
+#define K3P_GET_STATS				45
+/* Input:  None.
+ * Output: Str Statistics, one per line, as kmo_stats_dump().
+ */
+
+/* Return the trace of the last commands handled by KMOD. */
+#define K3P_GET_TRACE				46
+/* Input:  None.
+ * Output: Str Chrome trace in the JSON object format, as kmo_trace_dump().
+ */
+
+/* Hint that the mails specified are about to be displayed. The signature keys
+ * of their senders are fetched while KMOD is idle, so that the evaluation of
+ * the mails does not wait for the IKS. The hint replaces the previous one.
+ * Input:  Int Number of message IDs, then the message IDs (Str) of mails
+ *             already evaluated. Their senders are looked up in the maildb.
+ *         Int Number of member IDs, then the member IDs (marshalled as
+ *             strings).
+ * Output: Inst K3P_COMMAND_OK.
+ */
+#define K3P_PREFETCH_SIG_KEYS			49
+
 
 struct k3p_mail_body
 {
@@ -215,6 +254,13 @@ struct k3p_mail_attachment
 
         uint32_t tie;
 
+/* Value of 'data_is_file_path' when the plugin passes the attachment file
+ * descriptor along with the message, over a Unix-domain socket (SCM_RIGHTS).
+ * 'data' is then empty and one descriptor is consumed per such attachment, in
+ * order.
+ */
+#define K3P_MAIL_ATTACHMENT_DATA_FD	2
+
         uint32_t data_is_file_path;     /* filepath or actual content? */
         struct k3p_string data;     	/* path to the file or file content. */
 	struct k3p_string name; 	/* name, either a file name or the implicit attachment name. */
@@ -300,6 +346,14 @@ struct k3p_mail
 								* output: KMO_SET_DISPLAY_PREF_ACK or KMO_SET_DISPLAY_PREF_NACK.
 								*/
 
+#define KPP_EVAL_INCOMING_BATCH	    	KPP_MAGIC_NUMBER + 34  /* Evaluate several incoming mails.
+    	    	    	    	    	    	    	    	* input: nbr of mails (at most 100), then for each
+								*        mail: request ID, mail.
+								* output: for each mail, in no particular order:
+								*         KMO_EVAL_BATCH_RESULT, request ID, then
+								*         the reply to KPP_EVAL_INCOMING.
+								*/
+
 /* Dealing with stored messages */
 #define KPP_GET_EVAL_STATUS             KPP_MAGIC_NUMBER + 40  /* with nbr of entries + msg IDs */
 #define KPP_GET_STRING_STATUS		KPP_MAGIC_NUMBER + 41  /* Same input as above. The result is as follow:
@@ -453,6 +507,7 @@ struct kpp_mail_process_req
 #define KMO_MARK_UNSIGNED_MAIL	  KMO_MAGIC_NUMBER + 34  /* ACK for KPP_MARK_UNSIGNED_MAIL */
 #define KMO_SET_DISPLAY_PREF_ACK  KMO_MAGIC_NUMBER + 35
 #define KMO_SET_DISPLAY_PREF_NACK KMO_MAGIC_NUMBER + 36
+#define KMO_EVAL_BATCH_RESULT     KMO_MAGIC_NUMBER + 37  /* with request ID, followed by the reply to KPP_EVAL_INCOMING */
 
 #define KMO_PWD_ACK   	    	  KMO_MAGIC_NUMBER + 50
 
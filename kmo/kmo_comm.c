@@ -1,12 +1,76 @@
 /* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
 
 #include "kmo_comm.h"
+#include "kmo_stats.h"
+#include "kmo_trace.h"
 #include "utils.h"
 
+#ifdef KMO_COMM_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef KMO_COMM_USE_KQUEUE
+#include <sys/event.h>
+#endif
+
+#ifdef KMO_COMM_USE_IOCP
+#include <winsock2.h>
+#endif
+
+/* Interest flags of a registration. */
+#define KMO_COMM_REG_READ	1
+#define KMO_COMM_REG_WRITE	2
+
+/* Flag set on a registration that had an event during the current wait. */
+#define KMO_COMM_REG_EVENT	4
+
+/* Maximum number of events fetched from the event backend at once. */
+#define KMO_COMM_MAX_EVENT	32
+
+/* This object represents the registration of a file descriptor with the event
+ * backend of the transfer hub.
+ */
+struct kmo_comm_reg {
+    
+    /* File descriptor registered. */
+    int fd;
+    
+    /* Interest currently registered in the event backend. */
+    int armed;
+    
+    /* Directions for which an event was received during the current wait. */
+    int ready;
+    
+    /* Read and write transfers using the descriptor in the hub, if any. */
+    struct kmo_data_transfer *read_transfer;
+    struct kmo_data_transfer *write_transfer;
+    
+    #ifdef KMO_COMM_USE_IOCP
+    /* Overlapped read and write operations in flight on the descriptor. */
+    struct kmo_comm_op *read_op;
+    struct kmo_comm_op *write_op;
+    
+    /* Bytes received by a read operation that was cancelled, which have not
+     * been handed to a read transfer yet.
+     */
+    char *stash;
+    uint32_t stash_len;
+    uint32_t stash_pos;
+    #endif
+};
+
+#ifdef KMO_COMM_USE_IOCP
+struct kmo_comm_op;
+static int kmo_comm_iocp_arm(struct kmo_transfer_hub *hub, struct kmo_comm_reg *reg, int want, int check_flag);
+static void kmo_comm_iocp_cancel(struct kmo_transfer_hub *hub, struct kmo_comm_op *op, int account_flag);
+static void kmo_comm_iocp_close(struct kmo_transfer_hub *hub);
+#endif
+
 /* This function initializes a data transfer. */
 void kmo_data_transfer_init(struct kmo_data_transfer *self) {
     memset(self, 0, sizeof(struct kmo_data_transfer));
     self->fd = -1;
+    self->heap_index = -1;
 }
 
 /* This function frees the data associated to a transfer. */
@@ -18,16 +82,257 @@ void kmo_data_transfer_free(struct kmo_data_transfer *self) {
     }
 }
 
+/* This function returns true if the transfer hub must wait for the transfer
+ * specified.
+ */
+static inline int kmo_data_transfer_active(struct kmo_data_transfer *self) {
+    return (self->status == KMO_COMM_TRANS_PENDING ||
+	    (self->status == KMO_COMM_TRANS_COMPLETED && self->min_len < self->max_len));
+}
+
 /* This function initializes the transfer hub. */
 void kmo_transfer_hub_init(struct kmo_transfer_hub *self) {
     khash_init(&self->transfer_hash);
+    khash_init_func(&self->reg_hash, khash_int_key, khash_int_cmp);
+    self->event_fd = -1;
+    self->timer_heap = NULL;
+    self->timer_heap_size = self->timer_heap_alloc = 0;
+    
+    #if defined(KMO_COMM_USE_EPOLL)
+    self->event_fd = epoll_create(KMO_COMM_MAX_EVENT);
+    #elif defined(KMO_COMM_USE_KQUEUE)
+    self->event_fd = kqueue();
+    #elif defined(KMO_COMM_USE_IOCP)
+    self->op_list = NULL;
+    self->event_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    self->event_fd = self->event_port ? 0 : -1;
+    #endif
+    
+    /* We'll use select() if this fails. */
+    if (self->event_fd < 0) self->event_fd = -1;
+}
+
+/* This function stops using the event backend of the transfer hub and destroys
+ * the registrations. The hub uses select() afterwards.
+ */
+static void kmo_transfer_hub_drop_backend(struct kmo_transfer_hub *self) {
+    int i;
+    int iter_index = -1;
+    struct kmo_comm_reg *reg;
+    
+    #ifdef KMO_COMM_USE_IOCP
+    /* The operations in flight must finish before the registrations go away. */
+    kmo_comm_iocp_close(self);
+    #endif
+    
+    for (i = 0; i < self->reg_hash.size; i++) {
+    	khash_iter_next(&self->reg_hash, &iter_index, NULL, (void **) &reg);
+	if (reg->read_transfer) reg->read_transfer->reg = NULL;
+	if (reg->write_transfer) reg->write_transfer->reg = NULL;
+	#ifdef KMO_COMM_USE_IOCP
+	free(reg->stash);
+	#endif
+	free(reg);
+    }
+    
+    khash_clear(&self->reg_hash);
+    
+    if (self->event_fd != -1) {
+    	#ifndef KMO_COMM_USE_IOCP
+    	close(self->event_fd);
+	#endif
+	self->event_fd = -1;
+    }
 }
 
 /* This function frees the transfer hub. */
 void kmo_transfer_hub_free(struct kmo_transfer_hub *self) {
     if (self == NULL) return;
     
+    kmo_transfer_hub_drop_backend(self);
     khash_free(&self->transfer_hash);
+    khash_free(&self->reg_hash);
+    free(self->timer_heap);
+}
+
+/* This function swaps the transfers at the positions specified in the timer
+ * heap.
+ */
+static inline void kmo_timer_heap_swap(struct kmo_transfer_hub *hub, int i, int j) {
+    struct kmo_data_transfer *tmp = hub->timer_heap[i];
+    hub->timer_heap[i] = hub->timer_heap[j];
+    hub->timer_heap[j] = tmp;
+    hub->timer_heap[i]->heap_index = i;
+    hub->timer_heap[j]->heap_index = j;
+}
+
+/* This function returns true if the deadline of the transfer at position 'i'
+ * of the timer heap comes before the one of the transfer at position 'j'.
+ */
+static inline int kmo_timer_heap_less(struct kmo_transfer_hub *hub, int i, int j) {
+    return (util_timeval_cmp(&hub->timer_heap[i]->deadline, &hub->timer_heap[j]->deadline) == -1);
+}
+
+/* This function moves the transfer at position 'i' of the timer heap up or
+ * down until the heap is ordered.
+ */
+static void kmo_timer_heap_fix(struct kmo_transfer_hub *hub, int i) {
+    
+    /* Move up. */
+    while (i > 0 && kmo_timer_heap_less(hub, i, (i - 1) / 2)) {
+    	kmo_timer_heap_swap(hub, i, (i - 1) / 2);
+	i = (i - 1) / 2;
+    }
+    
+    /* Move down. */
+    while (1) {
+    	int child = 2 * i + 1;
+	if (child >= hub->timer_heap_size) break;
+	if (child + 1 < hub->timer_heap_size && kmo_timer_heap_less(hub, child + 1, child)) child++;
+	if (! kmo_timer_heap_less(hub, child, i)) break;
+	kmo_timer_heap_swap(hub, i, child);
+	i = child;
+    }
+}
+
+/* This function adds the transfer to the timer heap. */
+static void kmo_timer_heap_push(struct kmo_transfer_hub *hub, struct kmo_data_transfer *transfer) {
+    if (hub->timer_heap_size == hub->timer_heap_alloc) {
+    	hub->timer_heap_alloc = hub->timer_heap_alloc ? hub->timer_heap_alloc * 2 : 8;
+	hub->timer_heap = (struct kmo_data_transfer **)
+	    kmo_realloc(hub->timer_heap, hub->timer_heap_alloc * sizeof(struct kmo_data_transfer *));
+    }
+    
+    transfer->heap_index = hub->timer_heap_size;
+    hub->timer_heap[hub->timer_heap_size++] = transfer;
+    kmo_timer_heap_fix(hub, transfer->heap_index);
+}
+
+/* This function removes the transfer from the timer heap, if it is there. */
+static void kmo_timer_heap_remove(struct kmo_transfer_hub *hub, struct kmo_data_transfer *transfer) {
+    int i = transfer->heap_index;
+    
+    if (i == -1) return;
+    assert(hub->timer_heap[i] == transfer);
+    transfer->heap_index = -1;
+    hub->timer_heap_size--;
+    
+    if (i < hub->timer_heap_size) {
+    	hub->timer_heap[i] = hub->timer_heap[hub->timer_heap_size];
+	hub->timer_heap[i]->heap_index = i;
+	kmo_timer_heap_fix(hub, i);
+    }
+}
+
+/* This function updates the interest registered in the event backend for the
+ * descriptor specified. If 'check_flag' is true, the registration is refreshed
+ * even if the interest did not change, since the descriptor may have been
+ * closed and reused since it was registered.
+ * This function returns -1 on failure.
+ */
+static int kmo_transfer_hub_arm(struct kmo_transfer_hub *self, struct kmo_comm_reg *reg, int check_flag) {
+    int want = 0;
+    
+    if (reg->read_transfer && kmo_data_transfer_active(reg->read_transfer)) want |= KMO_COMM_REG_READ;
+    if (reg->write_transfer && kmo_data_transfer_active(reg->write_transfer)) want |= KMO_COMM_REG_WRITE;
+    
+    if (want == reg->armed && ! check_flag) return 0;
+    
+    #if defined(KMO_COMM_USE_EPOLL)
+    {
+    	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.data.ptr = reg;
+	if (want & KMO_COMM_REG_READ) ev.events |= EPOLLIN;
+	if (want & KMO_COMM_REG_WRITE) ev.events |= EPOLLOUT;
+	
+	/* The descriptor is not watched anymore. */
+	if (! want) {
+	    
+	    /* The descriptor may have been closed already. */
+	    if (reg->armed) epoll_ctl(self->event_fd, EPOLL_CTL_DEL, reg->fd, &ev);
+	}
+	
+	/* Modify the existing registration. If the descriptor has been closed in
+	 * the mean time, the kernel has forgotten about it and we register it
+	 * again.
+	 */
+	else if (reg->armed) {
+	    if (epoll_ctl(self->event_fd, EPOLL_CTL_MOD, reg->fd, &ev)) {
+	    	if (errno != ENOENT || epoll_ctl(self->event_fd, EPOLL_CTL_ADD, reg->fd, &ev)) return -1;
+	    }
+	}
+	
+	/* Register the descriptor. */
+	else {
+	    if (epoll_ctl(self->event_fd, EPOLL_CTL_ADD, reg->fd, &ev)) {
+	    	if (errno != EEXIST || epoll_ctl(self->event_fd, EPOLL_CTL_MOD, reg->fd, &ev)) return -1;
+	    }
+	}
+    }
+    
+    #elif defined(KMO_COMM_USE_KQUEUE)
+    {
+    	struct kevent changes[2];
+	int nb_change = 0;
+	
+	/* EV_ADD modifies the filter if it already exists. Deleting a filter
+	 * that does not exist anymore because the descriptor has been closed is
+	 * harmless, so we ignore that failure.
+	 */
+	if ((want & KMO_COMM_REG_READ) || (reg->armed & KMO_COMM_REG_READ)) {
+	    EV_SET(&changes[nb_change], reg->fd, EVFILT_READ,
+	    	   (want & KMO_COMM_REG_READ) ? EV_ADD | EV_ENABLE : EV_DELETE, 0, 0, reg);
+	    nb_change++;
+	}
+	
+	if ((want & KMO_COMM_REG_WRITE) || (reg->armed & KMO_COMM_REG_WRITE)) {
+	    EV_SET(&changes[nb_change], reg->fd, EVFILT_WRITE,
+	    	   (want & KMO_COMM_REG_WRITE) ? EV_ADD | EV_ENABLE : EV_DELETE, 0, 0, reg);
+	    nb_change++;
+	}
+	
+	if (nb_change && kevent(self->event_fd, changes, nb_change, NULL, 0, NULL) && want) return -1;
+    }
+    
+    #elif defined(KMO_COMM_USE_IOCP)
+    /* The interest armed is the set of directions having an operation in
+     * flight. It is cleared when the operation completes, so that the next
+     * operation is started here.
+     */
+    if (kmo_comm_iocp_arm(self, reg, want, check_flag)) return -1;
+    #endif
+    
+    reg->armed = want;
+    return 0;
+}
+
+/* This function registers the transfer with the event backend of the hub.
+ * This function returns -1 on failure.
+ */
+static int kmo_transfer_hub_register(struct kmo_transfer_hub *self, struct kmo_data_transfer *transfer) {
+    struct kmo_comm_reg *reg = (struct kmo_comm_reg *) khash_get(&self->reg_hash, &transfer->fd);
+    struct kmo_data_transfer **slot;
+    
+    #ifdef KMO_COMM_USE_IOCP
+    /* Only the sockets can be associated with the completion port. */
+    if (transfer->driver.read_data != kmo_sock_driver.read_data) return -1;
+    #endif
+    
+    if (reg == NULL) {
+    	reg = (struct kmo_comm_reg *) kmo_calloc(sizeof(struct kmo_comm_reg));
+	reg->fd = transfer->fd;
+	khash_add(&self->reg_hash, &reg->fd, reg);
+    }
+    
+    /* We don't support two transfers in the same direction on a descriptor. */
+    slot = transfer->read_flag ? &reg->read_transfer : &reg->write_transfer;
+    if (*slot != NULL) return -1;
+    
+    *slot = transfer;
+    transfer->reg = reg;
+    
+    return kmo_transfer_hub_arm(self, reg, 1);
 }
 
 /* This function adds a tranfer to the transfer hub. The transfer must not
@@ -43,15 +348,19 @@ void kmo_transfer_hub_add(struct kmo_transfer_hub *hub, struct kmo_data_transfer
     assert(transfer->driver.disconnect);
     assert(transfer->fd != -1);
     assert(transfer->min_len <= transfer->max_len);
+    assert(transfer->iov == NULL || (! transfer->read_flag && transfer->driver.write_iov));
     transfer->trans_len = 0;
     transfer->status = KMO_COMM_TRANS_PENDING;
+    transfer->reg = NULL;
+    transfer->heap_index = -1;
     
     if (transfer->op_timeout) {
     	struct timeval now;
 	transfer->deadline.tv_sec = transfer->op_timeout / 1000;
 	transfer->deadline.tv_usec = (transfer->op_timeout % 1000) * 1000;
-	util_get_current_time(&now);
+	util_get_monotonic_time(&now);
 	util_timeval_add(&transfer->deadline, &transfer->deadline, &now);
+	kmo_timer_heap_push(hub, transfer);
     }
     
     else {
@@ -66,37 +375,357 @@ void kmo_transfer_hub_add(struct kmo_transfer_hub *hub, struct kmo_data_transfer
     	kstr_destroy(transfer->err_msg);
 	transfer->err_msg = NULL;
     }
+    
+    /* Register the transfer with the event backend. Fall back to select() if
+     * that fails.
+     */
+    if (hub->event_fd != -1 && kmo_transfer_hub_register(hub, transfer)) {
+    	kmo_transfer_hub_drop_backend(hub);
+    }
 }
 
-/* This function removes a transfer from the transfer hub, if it exists. */
+/* This function removes a transfer from the transfer hub, if it exists. The
+ * registration of the descriptor is kept, so that it is cheap to add a transfer
+ * on the same descriptor again. If an event occurs on the descriptor in the
+ * mean time, the registration is disarmed.
+ */
 void kmo_transfer_hub_remove(struct kmo_transfer_hub *hub, struct kmo_data_transfer *transfer) {
+    
+    if (! khash_exist(&hub->transfer_hash, transfer)) return;
     khash_remove(&hub->transfer_hash, transfer);
+    kmo_timer_heap_remove(hub, transfer);
+    
+    if (transfer->reg) {
+    	#ifdef KMO_COMM_USE_IOCP
+	/* Cancel the operation in flight of the transfer. */
+	struct kmo_comm_op *op = transfer->read_flag ? transfer->reg->read_op : transfer->reg->write_op;
+	if (op) kmo_comm_iocp_cancel(hub, op, 0);
+	#endif
+	
+    	if (transfer->reg->read_transfer == transfer) transfer->reg->read_transfer = NULL;
+	if (transfer->reg->write_transfer == transfer) transfer->reg->write_transfer = NULL;
+	transfer->reg = NULL;
+    }
+}
+
+/* This function skips the first 'nb' bytes of the buffers of the vectored
+ * transfer specified.
+ */
+static void kmo_transfer_consume_iov(struct kmo_data_transfer *transfer, uint32_t nb) {
+    while (nb) {
+    	assert(transfer->iov_count > 0);
+	
+	if (nb < transfer->iov->len) {
+	    transfer->iov->buf += nb;
+	    transfer->iov->len -= nb;
+	    break;
+	}
+	
+	nb -= transfer->iov->len;
+	transfer->iov++;
+	transfer->iov_count--;
+    }
+}
+
+/* This function updates the transfer specified after an attempt to transfer
+ * data. 'error' is the value returned by the driver and 'nb' is the number of
+ * bytes transferred. This function returns true if the transfer has been
+ * completed or if an error occurred.
+ */
+static int kmo_transfer_hub_account(struct kmo_transfer_hub *hub, struct kmo_data_transfer *transfer,
+    	    	    	    	    int error, uint32_t nb, struct timeval *now) {
+    int done_flag = 0;
+    
+    /* Transfer error. */
+    if (error == -1) {
+	done_flag = 1;
+	transfer->status = KMO_COMM_TRANS_ERROR;
+	transfer->err_msg = kstr_new();
+	kstr_assign_kstr(transfer->err_msg, kmo_kstrerror());
+    }
+
+    /* Not ready? Surprising, but we'll let it pass. */
+    else if (error == -2) {
+	/* Void. */
+    }
+
+    /* Success. */
+    else {
+	assert(error == 0);
+	transfer->trans_len += nb;
+	kmo_stats_add(transfer->read_flag ? KMO_STAT_HUB_READ : KMO_STAT_HUB_WRITE, nb);
+
+	/* The transfer is completed. */
+	if (transfer->status == KMO_COMM_TRANS_PENDING && transfer->trans_len >= transfer->min_len) {
+	    done_flag = 1;
+	    transfer->status = KMO_COMM_TRANS_COMPLETED;
+	}
+
+	/* Reset its deadline. */
+	if (transfer->op_timeout) {
+	    transfer->deadline.tv_sec = transfer->op_timeout / 1000;
+	    transfer->deadline.tv_usec = (transfer->op_timeout % 1000) * 1000;
+	    util_timeval_add(&transfer->deadline, &transfer->deadline, now);
+	    if (transfer->heap_index != -1) kmo_timer_heap_fix(hub, transfer->heap_index);
+	}
+    }
+    
+    /* The hub no longer waits for this transfer. */
+    if (! kmo_data_transfer_active(transfer)) kmo_timer_heap_remove(hub, transfer);
+    
+    return done_flag;
+}
+
+/* This function attempts to transfer data for the transfer specified, which is
+ * ready. This function returns true if the transfer has been completed or if an
+ * error occurred.
+ */
+static int kmo_transfer_hub_process(struct kmo_transfer_hub *hub, struct kmo_data_transfer *transfer,
+				    struct timeval *now) {
+    int error = 0;
+    uint32_t nb = transfer->max_len - transfer->trans_len;
+    
+    /* Attempt to transfer data. */
+    if (nb > 0 && transfer->iov) {
+    	error = transfer->driver.write_iov(transfer->fd, transfer->iov, transfer->iov_count, &nb);
+	if (error == 0) kmo_transfer_consume_iov(transfer, nb);
+    }
+    
+    else if (nb > 0) {
+	int (*transfer_func) (int fd, char *buf, uint32_t *len) =
+	    transfer->read_flag ? transfer->driver.read_data : transfer->driver.write_data;
+
+	error = transfer_func(transfer->fd, transfer->buf + transfer->trans_len, &nb);
+    }
+    
+    return kmo_transfer_hub_account(hub, transfer, error, nb, now);
+}
+
+/* This function marks the transfers whose deadline has passed as expired. Only
+ * the expired transfers are examined. This function returns true if a transfer
+ * has expired.
+ */
+static int kmo_transfer_hub_expire(struct kmo_transfer_hub *hub, struct timeval *now) {
+    int done_flag = 0;
+    
+    while (hub->timer_heap_size && util_timeval_cmp(&hub->timer_heap[0]->deadline, now) == -1) {
+    	struct kmo_data_transfer *transfer = hub->timer_heap[0];
+	kmo_timer_heap_remove(hub, transfer);
+	kmo_stats_add(KMO_STAT_HUB_TIMEOUT, 1);
+	done_flag = 1;
+	transfer->status = KMO_COMM_TRANS_ERROR;
+	assert(transfer->err_msg == NULL);
+    }
+    
+    return done_flag;
 }
 
+/* This function waits for the descriptors of the transfers specified to become
+ * readable or writable using select() and processes the transfers that are
+ * ready. A NULL 'time_to_wait' means waiting until a descriptor is ready. This
+ * function returns true if a transfer has been completed or if an error
+ * occurred.
+ */
+static int kmo_transfer_hub_wait_select(struct kmo_transfer_hub *hub, karray *transfer_array,
+				        struct timeval *time_to_wait) {
+    int done_flag = 0;
+    int error = 0;
+    int max_sock = 0;
+    int i;
+    struct kmo_data_transfer *transfer;
+    struct timeval now;
+    fd_set read_set, write_set;
+    
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+    
+    /* Put the transfers in the appropriate select() set. */
+    for (i = 0; i < transfer_array->size; i++) {
+	transfer = (struct kmo_data_transfer *) transfer_array->data[i];
+	
+	if (transfer->read_flag)
+	    FD_SET((unsigned int) transfer->fd, &read_set);
+	else
+	    FD_SET((unsigned int) transfer->fd, &write_set);
+
+	max_sock = MAX(transfer->fd, max_sock);
+    }
+    
+    /* Wait for the sockets to become readable or writable. */
+    error = select(max_sock + 1, &read_set, &write_set, NULL, time_to_wait);
+
+    if (error < 0) {
+
+	#ifdef __UNIX__
+	/* Ignore EINTR. */
+	if (errno == EINTR) {
+	    return 0;
+	}
+	#endif
+
+	/* We can't handle other errors. */
+	kmo_fatalerror("select() failed: %s", kmo_neterror());
+    }
+    
+    /* Check what happened. */
+    util_get_monotonic_time(&now);
+
+    for (i = 0; i < transfer_array->size; i++) {
+	transfer = (struct kmo_data_transfer *) transfer_array->data[i];
+	fd_set *set = transfer->read_flag ? &read_set : &write_set;
+
+	/* This transfer is ready. */
+	if (FD_ISSET(transfer->fd, set)) {
+	    done_flag |= kmo_transfer_hub_process(hub, transfer, &now);
+	}
+    }
+    
+    /* The transfers that were ready have a new deadline. Check if the others
+     * are expired.
+     */
+    done_flag |= kmo_transfer_hub_expire(hub, &now);
+    
+    return done_flag;
+}
+
+#ifdef KMO_COMM_USE_IOCP
+#include "kmo_comm_iocp.c"
+#else
+
+/* This function processes the transfer of the registration specified, if it is
+ * ready. This function returns true if the transfer has been completed or if an
+ * error occurred.
+ */
+static int kmo_transfer_hub_process_reg(struct kmo_transfer_hub *hub, struct kmo_comm_reg *reg, int flag,
+    	    	    	    	    	struct timeval *now) {
+    struct kmo_data_transfer *transfer = (flag == KMO_COMM_REG_READ) ? reg->read_transfer : reg->write_transfer;
+    
+    if (transfer == NULL || ! kmo_data_transfer_active(transfer) || (reg->ready & flag)) return 0;
+    
+    /* Remember that the transfer was ready, so that it does not expire. */
+    reg->ready |= flag;
+    return kmo_transfer_hub_process(hub, transfer, now);
+}
+
+/* This function waits for the descriptors of the transfers of the hub to
+ * become readable or writable using the event backend and processes the
+ * transfers that are ready. The cost of this function is proportional to the
+ * number of descriptors that are ready or expired. A NULL 'time_to_wait' means
+ * waiting until a descriptor is ready. This function returns true if a transfer
+ * has been completed or if an error occurred, and -1 if the event backend
+ * failed.
+ */
+static int kmo_transfer_hub_wait_event(struct kmo_transfer_hub *hub, struct timeval *time_to_wait) {
+    int done_flag = 0;
+    int nb_event = 0;
+    int i;
+    struct timeval now;
+    karray ready_array;
+    
+    #if defined(KMO_COMM_USE_EPOLL)
+    struct epoll_event events[KMO_COMM_MAX_EVENT];
+    int timeout = -1;
+    
+    /* No deadline means waiting forever. */
+    if (time_to_wait && time_to_wait->tv_sec < INT_MAX / 1000 - 1)
+    	timeout = time_to_wait->tv_sec * 1000 + (time_to_wait->tv_usec + 999) / 1000;
+    
+    nb_event = epoll_wait(hub->event_fd, events, KMO_COMM_MAX_EVENT, timeout);
+    
+    #elif defined(KMO_COMM_USE_KQUEUE)
+    struct kevent events[KMO_COMM_MAX_EVENT];
+    struct timespec timeout;
+    
+    if (time_to_wait) {
+    	timeout.tv_sec = time_to_wait->tv_sec;
+	timeout.tv_nsec = time_to_wait->tv_usec * 1000;
+    }
+    
+    nb_event = kevent(hub->event_fd, NULL, 0, events, KMO_COMM_MAX_EVENT, time_to_wait ? &timeout : NULL);
+    
+    #else
+    assert(0);
+    #endif
+    
+    if (nb_event < 0) {
+	
+	/* Ignore EINTR. */
+	if (errno == EINTR) {
+	    return 0;
+	}
+	
+	return -1;
+    }
+    
+    util_get_monotonic_time(&now);
+    karray_init(&ready_array);
+    
+    /* Process the transfers that are ready. */
+    for (i = 0; i < nb_event; i++) {
+    	struct kmo_comm_reg *reg = NULL;
+	int read_flag = 0, write_flag = 0;
+	
+	#if defined(KMO_COMM_USE_EPOLL)
+	reg = (struct kmo_comm_reg *) events[i].data.ptr;
+	read_flag = (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP));
+	write_flag = (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP));
+	#elif defined(KMO_COMM_USE_KQUEUE)
+	reg = (struct kmo_comm_reg *) events[i].udata;
+	read_flag = (events[i].filter == EVFILT_READ);
+	write_flag = (events[i].filter == EVFILT_WRITE);
+	#endif
+	
+	/* A descriptor may be reported once per direction. */
+	if (! reg->ready) karray_add(&ready_array, reg);
+	reg->ready |= KMO_COMM_REG_EVENT;
+	
+	if (read_flag) done_flag |= kmo_transfer_hub_process_reg(hub, reg, KMO_COMM_REG_READ, &now);
+	if (write_flag) done_flag |= kmo_transfer_hub_process_reg(hub, reg, KMO_COMM_REG_WRITE, &now);
+    }
+    
+    /* Check if the transfers that were not ready are expired. */
+    done_flag |= kmo_transfer_hub_expire(hub, &now);
+    
+    /* Update the registrations that had an event. The registrations for
+     * descriptors that are no longer used by a pending transfer are disarmed
+     * here, so that they do not wake us up again.
+     */
+    for (i = 0; i < ready_array.size; i++) {
+    	struct kmo_comm_reg *reg = (struct kmo_comm_reg *) ready_array.data[i];
+	reg->ready = 0;
+	
+	if (kmo_transfer_hub_arm(hub, reg, 0)) {
+	    karray_free(&ready_array);
+	    return -1;
+	}
+    }
+    
+    karray_free(&ready_array);
+    return done_flag;
+}
+#endif
+
 /* This function waits for at least one of the current transfers to complete.
  * This function will return immediately if there is no pending transfer.
  * Otherwise, the time to wait is determined by the deadlines (not timeouts)
- * of the pending transfers.
+ * of the pending transfers, which are kept in a heap based on the monotonic
+ * clock.
  */
 void kmo_transfer_hub_wait(struct kmo_transfer_hub *hub) {
     int done_flag = 0;
+    int wait_flag = 0;
+    uint64_t start = kmo_stats_now();
     karray transfer_array;
     
     karray_init(&transfer_array);
     
     /* Loop until we manage to complete a transfer. */
     while (! done_flag) {
-	int error = 0;
-	int max_sock = 0;
     	int iter_index = -1;
 	int i;
 	struct kmo_data_transfer *transfer;
-	struct timeval deadline = { 2147483647, 0 };
 	struct timeval now, min_time, time_to_wait;
-	fd_set read_set, write_set;
-    	
-	FD_ZERO(&read_set);
-	FD_ZERO(&write_set);
+	struct timeval *wait_ptr = NULL;
     
 	/* Find which transfers must be processed. */
 	transfer_array.size = 0;
@@ -106,27 +735,13 @@ void kmo_transfer_hub_wait(struct kmo_transfer_hub *hub) {
     	    khash_iter_next(&hub->transfer_hash, &iter_index, (void **) &transfer, NULL);
     	    
 	    /* Unfinished transfer. */
-	    if (transfer->status == KMO_COMM_TRANS_PENDING ||
-	    	(transfer->status == KMO_COMM_TRANS_COMPLETED && transfer->min_len < transfer->max_len)) {
+	    if (kmo_data_transfer_active(transfer)) {
     	    	
 		/* Pending transfer. */
 		if (transfer->status == KMO_COMM_TRANS_PENDING) {
 		    done_flag = 0;
 		}
 		
-		/* Put the transfer in the appropriate select() set. */
-		if (transfer->read_flag)
-	    	    FD_SET((unsigned int) transfer->fd, &read_set);
-		else
-	    	    FD_SET((unsigned int) transfer->fd, &write_set);
-    	    	
-		max_sock = MAX(transfer->fd, max_sock);
-		
-		/* Compute deadline for select(). */
-		if (util_timeval_cmp(&transfer->deadline, &deadline) == -1) {
-		    deadline = transfer->deadline;
-		}
-		
 		/* Process this transfer. */
 		karray_add(&transfer_array, transfer);
 	    }
@@ -137,104 +752,65 @@ void kmo_transfer_hub_wait(struct kmo_transfer_hub *hub) {
 	    break;
 	}
 	
-	/* Wait at least one millisecond. */
-	util_get_current_time(&now);
-	min_time.tv_sec = 0;
-	min_time.tv_usec = 1000;
-	util_timeval_add(&time_to_wait, &now, &min_time);
-	
-	/* The deadline is already passed or too short. */
-	if (util_timeval_cmp(&time_to_wait, &deadline) >= 0) {
-	    time_to_wait = min_time;
-	}
-	
-	/* The deadline is long enough. */
-	else {
-	    util_timeval_subtract(&time_to_wait, &deadline, &now);
-	}
-    
-     	/* Wait for the sockets to become readable or writable. */
-    	error = select(max_sock + 1, &read_set, &write_set, NULL, &time_to_wait);
-
-	if (error < 0) {
-    	    
-	    #ifdef __UNIX__
-	    /* Ignore EINTR. */
-	    if (errno == EINTR) {
-	    	continue;
-	    }
-	    #endif
+	/* The next deadline is at the top of the timer heap. Without deadline,
+	 * we wait forever.
+	 */
+	if (hub->timer_heap_size) {
+	    struct timeval *deadline = &hub->timer_heap[0]->deadline;
+	    wait_ptr = &time_to_wait;
 	    
-	    /* We can't handle other errors. */
-    	    kmo_fatalerror("select() failed: %s", kmo_neterror());
-	}
-		
-	/* Check what happened. */
-	util_get_current_time(&now);
-	
-	for (i = 0; i < transfer_array.size; i++) {
-	    transfer = (struct kmo_data_transfer *) transfer_array.data[i];
-	    fd_set *set = transfer->read_flag ? &read_set : &write_set;
+	    /* Wait at least one millisecond. */
+	    util_get_monotonic_time(&now);
+	    min_time.tv_sec = 0;
+	    min_time.tv_usec = 1000;
+	    util_timeval_add(&time_to_wait, &now, &min_time);
 	    
-	    /* This transfer is ready. */
-	    if (FD_ISSET(transfer->fd, set)) {
-	    	
-		uint32_t nb = transfer->max_len - transfer->trans_len;
-		error = 0;
-		
-		/* Attempt to transfer data. */
-	    	if (nb > 0) {
-		    int (*transfer_func) (int fd, char *buf, uint32_t *len) =
-			transfer->read_flag ? transfer->driver.read_data : transfer->driver.write_data;
-
-		    error = transfer_func(transfer->fd, transfer->buf + transfer->trans_len, &nb);
-		}
-
-		/* Transfer error. */
-		if (error == -1) {
-		    done_flag = 1;
-		    transfer->status = KMO_COMM_TRANS_ERROR;
-		    transfer->err_msg = kstr_new();
-		    kstr_assign_kstr(transfer->err_msg, kmo_kstrerror());
-		}
-		
-		/* Not ready? Surprising, but we'll let it pass. */
-		else if (error == -2) {
-		    /* Void. */
-		}
-		
-		/* Success. */
-		else {
-		    assert(error == 0);
-		    transfer->trans_len += nb;
-		    
-		    /* The transfer is completed. */
-		    if (transfer->status == KMO_COMM_TRANS_PENDING && transfer->trans_len >= transfer->min_len) {
-		    	done_flag = 1;
-		    	transfer->status = KMO_COMM_TRANS_COMPLETED;
-		    }
-		    
-		    /* Reset its deadline. */
-		    if (transfer->op_timeout) {
-			transfer->deadline.tv_sec = transfer->op_timeout / 1000;
-			transfer->deadline.tv_usec = (transfer->op_timeout % 1000) * 1000;
-			util_timeval_add(&transfer->deadline, &transfer->deadline, &now);
-		    }
-		}
+	    /* The deadline is already passed or too short. */
+	    if (util_timeval_cmp(&time_to_wait, deadline) >= 0) {
+		time_to_wait = min_time;
 	    }
 	    
-	    /* The transfer is not ready. */
+	    /* The deadline is long enough. */
 	    else {
-	    
-	    	/* Check if it is expired. */
-		if (util_timeval_cmp(&transfer->deadline, &now) == -1) {
-		    done_flag = 1;
-		    transfer->status = KMO_COMM_TRANS_ERROR;
-		    assert(transfer->err_msg == NULL);
-		}
+		util_timeval_subtract(&time_to_wait, deadline, &now);
 	    }
 	}
+	
+	wait_flag = 1;
+	
+	/* Wait with the event backend if we have one. */
+	if (hub->event_fd != -1) {
+	    done_flag = kmo_transfer_hub_wait_event(hub, wait_ptr);
+	    if (done_flag != -1) continue;
+	    
+	    /* The event backend failed. Use select() from now on. */
+	    kmo_transfer_hub_drop_backend(hub);
+	    done_flag = 0;
+	}
+	
+	done_flag = kmo_transfer_hub_wait_select(hub, &transfer_array, wait_ptr);
     }
     
+    if (wait_flag) kmo_trace_span("hub.wait", start);
+    
     karray_free(&transfer_array);
 }
+
+/* This function returns true if the hub holds data received on the descriptor
+ * specified that has not been handed to a transfer yet. Such data cannot be
+ * seen by select() on the descriptor. Only the I/O completion port backend
+ * reads ahead of the transfers.
+ */
+int kmo_transfer_hub_has_input(struct kmo_transfer_hub *hub, int fd) {
+    #ifdef KMO_COMM_USE_IOCP
+    struct kmo_comm_reg *reg;
+    
+    if (hub->event_fd == -1) return 0;
+    reg = (struct kmo_comm_reg *) khash_get(&hub->reg_hash, &fd);
+    return (reg && reg->stash_len > reg->stash_pos);
+    #else
+    (void) hub;
+    (void) fd;
+    return 0;
+    #endif
+}
@@ -5,6 +5,35 @@
 
 #include "kmo_base.h"
 
+/* Event backend used by the transfer hub to wait for the descriptors. We use
+ * epoll on Linux and kqueue on the BSDs (including Mac OS X). Other platforms
+ * use select(). Define KMO_COMM_USE_SELECT to force the use of select().
+ *
+ * The I/O completion port backend is used on Windows only if KMO_COMM_USE_IOCP
+ * is defined explicitly, until it has been tested there.
+ */
+#if defined(__UNIX__) && defined(__linux__) && ! defined(KMO_COMM_USE_SELECT)
+#define KMO_COMM_USE_EPOLL
+#elif defined(__UNIX__) && (defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+			    defined(__NetBSD__)) && ! defined(KMO_COMM_USE_SELECT)
+#define KMO_COMM_USE_KQUEUE
+#endif
+
+#if defined(KMO_COMM_USE_IOCP) && (! defined(__WINDOWS__) || defined(KMO_COMM_USE_SELECT))
+#undef KMO_COMM_USE_IOCP
+#endif
+
+/* Maximum number of buffers passed to the driver in a single write_iov()
+ * call.
+ */
+#define KMO_COMM_MAX_IOV    64
+
+/* This object describes a buffer of a vectored write. */
+struct kmo_iovec {
+    char *buf;
+    uint32_t len;
+};
+
 /* This object represents a communication driver. */
 struct kmo_comm_driver {
     
@@ -24,11 +53,35 @@ struct kmo_comm_driver {
      * if needed.
      */
     void (*disconnect) (int *fd);
+    
+    /* This function sends the data of the 'count' buffers specified, in
+     * order, with a single system call if possible. At most
+     * KMO_COMM_MAX_IOV buffers are used per call. On success, 'len' is set to
+     * the number of bytes sent. The function otherwise behaves like
+     * write_data(). This function is optional; it is NULL if the driver does
+     * not support vectored writes.
+     */
+    int (*write_iov) (int fd, struct kmo_iovec *iov, int count, uint32_t *len);
+    
+    /* This function returns the oldest file descriptor passed by the remote
+     * side on the descriptor specified and removes it from the queue of the
+     * received descriptors. The caller owns the descriptor returned. This
+     * function returns -1 if no descriptor has been received. This function is
+     * optional; it is NULL if the driver cannot receive descriptors.
+     */
+    int (*take_fd) (int fd);
 };
 
 /* Communication driver for sockets. */
 extern struct kmo_comm_driver kmo_sock_driver;
 
+#ifdef __UNIX__
+/* Communication driver for Unix-domain sockets. It receives the descriptors
+ * passed by the remote side with SCM_RIGHTS.
+ */
+extern struct kmo_comm_driver kmo_unix_driver;
+#endif
+
 
 /* Status codes for kmo_data_transfer.  */
 enum {
@@ -73,6 +126,16 @@ struct kmo_data_transfer {
      */
     char *buf;
     
+    /* Buffers of a vectored write transfer, and their number. If 'iov' is
+     * non-NULL, the data is sent from these buffers with the write_iov()
+     * function of the driver instead of 'buf', and 'max_len' must be the total
+     * size of the buffers. The transfer hub advances the vector as the data is
+     * sent. These fields must be set prior to the call to
+     * kmo_transfer_hub_add().
+     */
+    struct kmo_iovec *iov;
+    int iov_count;
+    
     /* Miminum number of bytes to transfer for the transfer to be deemed
      * 'completed'. Note that if this field is 0, the transfer is completed as
      * soon as the descriptor becomes readable/writable. This field must be set
@@ -104,16 +167,27 @@ struct kmo_data_transfer {
     int status;
     
     /* Object used internally by the transfer hub to detect situations where a
-     * connection timeouts.
+     * connection timeouts. The deadline is based on the monotonic clock.
      */
     struct timeval deadline;
     
+    /* Position of the transfer in the timer heap of the transfer hub, or -1 if
+     * the transfer has no deadline. This field is used internally by the
+     * transfer hub.
+     */
+    int heap_index;
+    
     /* When status == KMO_COMM_TRANS_ERROR, this object describes the error that
      * occurred. If the pointer is NULL, a timeout occurred. Otherwise, the
      * pointer points to a string containing the error string set by the call to
      * transfer_func(). This field is initialized by kmo_transfer_hub_add().
      */
     kstr *err_msg;
+    
+    /* Registration of the descriptor with the event backend of the transfer
+     * hub, if any. This field is used internally by the transfer hub.
+     */
+    struct kmo_comm_reg *reg;
 };
 
 /* The transfer hub is used to wait for several transfers at the same time. */
@@ -121,6 +195,34 @@ struct kmo_transfer_hub {
 
     /* Hash containing the current transfers. */
     khash transfer_hash;
+    
+    /* Descriptor of the epoll/kqueue event backend, or -1 if select() is used.
+     * If the event backend fails, the hub falls back to select(). With the I/O
+     * completion port backend, it is 0 while the port is open.
+     */
+    int event_fd;
+    
+    #ifdef KMO_COMM_USE_IOCP
+    /* I/O completion port, and list of the overlapped operations whose
+     * completion has not been dequeued from the port yet.
+     */
+    HANDLE event_port;
+    struct kmo_comm_op *op_list;
+    #endif
+    
+    /* Hash mapping the file descriptors to their registration with the event
+     * backend. The registrations persist after the transfers are removed from
+     * the hub, so that the descriptors that are added over and over again are
+     * not re-armed every time.
+     */
+    khash reg_hash;
+    
+    /* Min-heap of the active transfers that have a deadline, ordered by
+     * deadline. The next deadline is the first element.
+     */
+    struct kmo_data_transfer **timer_heap;
+    int timer_heap_size;
+    int timer_heap_alloc;
 };
 
 /* This function returns the error message corresponding to the transfer error
@@ -138,6 +240,7 @@ void kmo_transfer_hub_free(struct kmo_transfer_hub *self);
 void kmo_transfer_hub_add(struct kmo_transfer_hub *hub, struct kmo_data_transfer *transfer);
 void kmo_transfer_hub_remove(struct kmo_transfer_hub *hub, struct kmo_data_transfer *transfer);
 void kmo_transfer_hub_wait(struct kmo_transfer_hub *hub);
+int kmo_transfer_hub_has_input(struct kmo_transfer_hub *hub, int fd);
 
 
 #endif
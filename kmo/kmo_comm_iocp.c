@@ -0,0 +1,378 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+/* This file is meant to be included by kmo_comm.c. It implements the event
+ * backend of the transfer hub with an I/O completion port.
+ *
+ * The completion port does not report readiness: the hub starts an overlapped
+ * read or write directly into the buffer of each active transfer and the port
+ * reports when the data has been transferred. A transfer has at most one
+ * operation in flight. An operation that is cancelled before its completion is
+ * dequeued is 'orphaned': it stays in the list of the hub until its completion
+ * packet arrives, since the system owns the OVERLAPPED structure until then.
+ *
+ * The bytes received by a read operation that is cancelled because its transfer
+ * was removed from the hub are kept in the registration of the socket, and
+ * they are handed to the next read transfer on that socket.
+ *
+ * CancelIoEx() and GetQueuedCompletionStatusEx() require Windows Vista.
+ */
+
+/* This object represents an overlapped operation started by the hub. */
+struct kmo_comm_op {
+
+    /* Overlapped structure of the operation. It must be the first field, since
+     * the port returns a pointer to it.
+     */
+    OVERLAPPED ov;
+
+    /* Registration and transfer of the operation. They are NULL if the
+     * operation has been orphaned.
+     */
+    struct kmo_comm_reg *reg;
+    struct kmo_data_transfer *transfer;
+
+    /* True if the completion packet was posted by the hub instead of the
+     * system. 'error' is then the Winsock error code of the operation, or 0,
+     * and 'len' is the number of bytes transferred.
+     */
+    int posted_flag;
+    int error;
+    uint32_t len;
+
+    /* Number of bytes requested. */
+    uint32_t req_len;
+
+    /* Buffers of the operation. */
+    WSABUF vec[KMO_COMM_MAX_IOV];
+
+    /* Links in the list of the operations of the hub. */
+    struct kmo_comm_op *prev;
+    struct kmo_comm_op *next;
+};
+
+/* This function sets the KMO error string to 'msg' followed by the system
+ * message of the Winsock error code specified.
+ */
+static void kmo_comm_iocp_seterror(char *msg, int code) {
+    char *sys_msg_buf = NULL;
+
+    FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
+        	  FORMAT_MESSAGE_FROM_SYSTEM |
+        	  FORMAT_MESSAGE_IGNORE_INSERTS,
+        	  NULL,
+        	  code,
+        	  MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+        	  (LPTSTR) &sys_msg_buf,
+        	  0,
+        	  NULL);
+
+    kmo_seterror(msg);
+    kstr_append_cstr(kmo_kstrerror(), ": ");
+    if (sys_msg_buf) kstr_append_cstr(kmo_kstrerror(), sys_msg_buf);
+    LocalFree(sys_msg_buf);
+}
+
+/* This function unlinks the operation specified from the list of the hub. */
+static void kmo_comm_iocp_unlink(struct kmo_transfer_hub *hub, struct kmo_comm_op *op) {
+    if (op->prev) op->prev->next = op->next;
+    else hub->op_list = op->next;
+    if (op->next) op->next->prev = op->prev;
+    op->prev = op->next = NULL;
+}
+
+/* This function returns a pointer to the slot of the registration that holds
+ * the operation of the transfer specified.
+ */
+static inline struct kmo_comm_op ** kmo_comm_iocp_slot(struct kmo_comm_reg *reg,
+						       struct kmo_data_transfer *transfer) {
+    return transfer->read_flag ? &reg->read_op : &reg->write_op;
+}
+
+/* This function hands the bytes kept in the registration to the read operation
+ * specified, and posts its completion. This function returns -1 on failure.
+ */
+static int kmo_comm_iocp_post_stash(struct kmo_transfer_hub *hub, struct kmo_comm_op *op) {
+    struct kmo_comm_reg *reg = op->reg;
+    uint32_t nb = reg->stash_len - reg->stash_pos;
+
+    if (nb > op->req_len) nb = op->req_len;
+    memcpy(op->vec[0].buf, reg->stash + reg->stash_pos, nb);
+    reg->stash_pos += nb;
+
+    if (reg->stash_pos == reg->stash_len) {
+    	free(reg->stash);
+	reg->stash = NULL;
+	reg->stash_len = reg->stash_pos = 0;
+    }
+
+    op->posted_flag = 1;
+    op->len = nb;
+    return PostQueuedCompletionStatus(hub->event_port, nb, 0, &op->ov) ? 0 : -1;
+}
+
+/* This function starts an overlapped operation for the transfer specified. If
+ * the operation cannot be started, its failure is posted to the port, so that
+ * it is reported like the failures of the operations in flight.
+ * This function returns -1 if the port failed.
+ */
+static int kmo_comm_iocp_start(struct kmo_transfer_hub *hub, struct kmo_comm_reg *reg,
+			       struct kmo_data_transfer *transfer) {
+    struct kmo_comm_op *op = (struct kmo_comm_op *) kmo_calloc(sizeof(struct kmo_comm_op));
+    uint32_t nb = transfer->max_len - transfer->trans_len;
+    DWORD count = 1;
+    DWORD flags = 0;
+    int error;
+
+    op->reg = reg;
+    op->transfer = transfer;
+
+    /* A transfer that has nothing to transfer waits for the socket to become
+     * readable or writable. That's what a zero-byte operation does.
+     */
+    if (nb > 0 && transfer->iov) {
+    	uint32_t i;
+
+    	count = transfer->iov_count < KMO_COMM_MAX_IOV ? transfer->iov_count : KMO_COMM_MAX_IOV;
+	nb = 0;
+
+	for (i = 0; i < count; i++) {
+	    op->vec[i].buf = transfer->iov[i].buf;
+	    op->vec[i].len = transfer->iov[i].len;
+	    nb += transfer->iov[i].len;
+	}
+    }
+
+    else {
+    	op->vec[0].buf = nb ? transfer->buf + transfer->trans_len : NULL;
+	op->vec[0].len = nb;
+    }
+
+    op->req_len = nb;
+
+    op->next = hub->op_list;
+    if (op->next) op->next->prev = op;
+    hub->op_list = op;
+    *kmo_comm_iocp_slot(reg, transfer) = op;
+
+    if (transfer->read_flag && reg->stash && nb) return kmo_comm_iocp_post_stash(hub, op);
+
+    if (transfer->read_flag)
+    	error = WSARecv((SOCKET) reg->fd, op->vec, count, NULL, &flags, &op->ov, NULL);
+    else
+    	error = WSASend((SOCKET) reg->fd, op->vec, count, NULL, 0, &op->ov, NULL);
+
+    /* The completion is queued even if the operation completed immediately. */
+    if (error != SOCKET_ERROR || WSAGetLastError() == WSA_IO_PENDING) return 0;
+
+    op->posted_flag = 1;
+    op->error = WSAGetLastError();
+    return PostQueuedCompletionStatus(hub->event_port, 0, 0, &op->ov) ? 0 : -1;
+}
+
+/* This function cancels the operation specified and waits for it to finish.
+ * If 'account_flag' is true, the bytes already transferred are accounted to the
+ * transfer, which stays in the hub. Otherwise, the bytes already received are
+ * kept in the registration for the next read transfer. The operation is
+ * orphaned.
+ */
+static void kmo_comm_iocp_cancel(struct kmo_transfer_hub *hub, struct kmo_comm_op *op, int account_flag) {
+    struct kmo_comm_reg *reg = op->reg;
+    struct kmo_data_transfer *transfer = op->transfer;
+    uint32_t nb = op->len;
+
+    if (reg == NULL) return;
+
+    if (! op->posted_flag) {
+    	DWORD nb_done = 0, flags = 0;
+
+	/* The operation may complete before it is cancelled, and the socket may
+	 * have been closed already, in which case the operation was aborted. In
+	 * all cases, the number of bytes transferred is left in the overlapped
+	 * structure once the wait returns.
+	 */
+	CancelIoEx((HANDLE) (intptr_t) reg->fd, &op->ov);
+	WSAGetOverlappedResult((SOCKET) reg->fd, &op->ov, &nb_done, TRUE, &flags);
+	nb = (uint32_t) op->ov.InternalHigh;
+    }
+
+    else if (op->error) {
+    	nb = 0;
+    }
+
+    if (nb && account_flag) {
+    	struct timeval now;
+	util_get_monotonic_time(&now);
+	if (transfer->iov) kmo_transfer_consume_iov(transfer, nb);
+	kmo_transfer_hub_account(hub, transfer, 0, nb, &now);
+    }
+
+    /* Keep the bytes received before the bytes kept already. */
+    else if (nb && transfer->read_flag) {
+    	uint32_t left = reg->stash_len - reg->stash_pos;
+	char *stash = (char *) kmo_malloc(nb + left);
+
+	memcpy(stash, op->vec[0].buf, nb);
+	if (left) memcpy(stash + nb, reg->stash + reg->stash_pos, left);
+	free(reg->stash);
+	reg->stash = stash;
+	reg->stash_len = nb + left;
+	reg->stash_pos = 0;
+    }
+
+    *kmo_comm_iocp_slot(reg, transfer) = NULL;
+    reg->armed &= ~(transfer->read_flag ? KMO_COMM_REG_READ : KMO_COMM_REG_WRITE);
+    op->reg = NULL;
+    op->transfer = NULL;
+}
+
+/* This function starts and cancels the operations of the registration
+ * specified according to the interest 'want'. If 'check_flag' is true, the
+ * socket is associated with the port first, since it may have been closed and
+ * reused since it was registered.
+ * This function returns -1 on failure.
+ */
+static int kmo_comm_iocp_arm(struct kmo_transfer_hub *hub, struct kmo_comm_reg *reg, int want, int check_flag) {
+
+    /* Associating a socket twice fails with ERROR_INVALID_PARAMETER. */
+    if (check_flag && CreateIoCompletionPort((HANDLE) (intptr_t) reg->fd, hub->event_port, 0, 0) == NULL &&
+	GetLastError() != ERROR_INVALID_PARAMETER) {
+	return -1;
+    }
+
+    if (reg->read_op && ! (want & KMO_COMM_REG_READ)) kmo_comm_iocp_cancel(hub, reg->read_op, 0);
+    if (reg->write_op && ! (want & KMO_COMM_REG_WRITE)) kmo_comm_iocp_cancel(hub, reg->write_op, 0);
+
+    if (! reg->read_op && (want & KMO_COMM_REG_READ) && kmo_comm_iocp_start(hub, reg, reg->read_transfer)) return -1;
+    if (! reg->write_op && (want & KMO_COMM_REG_WRITE) && kmo_comm_iocp_start(hub, reg, reg->write_transfer)) return -1;
+
+    return 0;
+}
+
+/* This function cancels the operations in flight, accounting the bytes already
+ * transferred to their transfers, frees all the operations and closes the port.
+ */
+static void kmo_comm_iocp_close(struct kmo_transfer_hub *hub) {
+    int i;
+    int iter_index = -1;
+    struct kmo_comm_reg *reg;
+
+    if (hub->event_fd == -1) return;
+
+    for (i = 0; i < hub->reg_hash.size; i++) {
+    	khash_iter_next(&hub->reg_hash, &iter_index, NULL, (void **) &reg);
+	if (reg->read_op) kmo_comm_iocp_cancel(hub, reg->read_op, 1);
+	if (reg->write_op) kmo_comm_iocp_cancel(hub, reg->write_op, 1);
+    }
+
+    /* The completion packets still queued are discarded with the port. */
+    while (hub->op_list) {
+    	struct kmo_comm_op *op = hub->op_list;
+	kmo_comm_iocp_unlink(hub, op);
+	free(op);
+    }
+
+    CloseHandle(hub->event_port);
+    hub->event_port = NULL;
+}
+
+/* This function waits for the operations of the hub to complete using the
+ * completion port and accounts them to their transfers, then starts the next
+ * operations. A NULL 'time_to_wait' means waiting until an operation completes.
+ * This function returns true if a transfer has been completed or if an error
+ * occurred, and -1 if the port failed.
+ */
+static int kmo_transfer_hub_wait_event(struct kmo_transfer_hub *hub, struct timeval *time_to_wait) {
+    int done_flag = 0;
+    ULONG nb_event = 0;
+    ULONG i;
+    DWORD timeout = INFINITE;
+    OVERLAPPED_ENTRY events[KMO_COMM_MAX_EVENT];
+    struct timeval now;
+    karray ready_array;
+
+    /* No deadline means waiting forever. */
+    if (time_to_wait && time_to_wait->tv_sec < INT_MAX / 1000 - 1)
+    	timeout = time_to_wait->tv_sec * 1000 + (time_to_wait->tv_usec + 999) / 1000;
+
+    if (! GetQueuedCompletionStatusEx(hub->event_port, events, KMO_COMM_MAX_EVENT, &nb_event, timeout, FALSE)) {
+    	if (GetLastError() != WAIT_TIMEOUT) return -1;
+	nb_event = 0;
+    }
+
+    util_get_monotonic_time(&now);
+    karray_init(&ready_array);
+
+    /* Account the operations that completed. */
+    for (i = 0; i < nb_event; i++) {
+    	struct kmo_comm_op *op = (struct kmo_comm_op *) events[i].lpOverlapped;
+	struct kmo_comm_reg *reg = op->reg;
+	struct kmo_data_transfer *transfer = op->transfer;
+	uint32_t nb = events[i].dwNumberOfBytesTransferred;
+	int error = 0;
+
+	kmo_comm_iocp_unlink(hub, op);
+
+	/* The operation was cancelled. */
+	if (reg == NULL) {
+	    free(op);
+	    continue;
+	}
+
+	*kmo_comm_iocp_slot(reg, transfer) = NULL;
+	reg->armed &= ~(transfer->read_flag ? KMO_COMM_REG_READ : KMO_COMM_REG_WRITE);
+
+	if (! reg->ready) karray_add(&ready_array, reg);
+	reg->ready |= KMO_COMM_REG_EVENT;
+
+	if (op->posted_flag) {
+	    nb = op->len;
+
+	    if (op->error) {
+	    	kmo_comm_iocp_seterror(transfer->read_flag ? "cannot read data" : "cannot send data", op->error);
+		error = -1;
+	    }
+	}
+
+	else {
+	    DWORD nb_done = 0, flags = 0;
+
+	    if (! WSAGetOverlappedResult((SOCKET) reg->fd, &op->ov, &nb_done, FALSE, &flags)) {
+	    	kmo_comm_iocp_seterror(transfer->read_flag ? "cannot read data" : "cannot send data",
+		    	    	       WSAGetLastError());
+		error = -1;
+	    }
+	}
+
+	/* Nothing was transferred while something was requested. */
+	if (! error && nb == 0 && op->req_len > 0) {
+	    kmo_seterror("%s: remote side closed connection",
+	    	    	 transfer->read_flag ? "cannot read data" : "cannot send data");
+	    error = -1;
+	}
+
+	if (! error && transfer->iov) kmo_transfer_consume_iov(transfer, nb);
+
+	free(op);
+	done_flag |= kmo_transfer_hub_account(hub, transfer, error, nb, &now);
+    }
+
+    /* Check if the transfers that did not complete an operation are expired. */
+    done_flag |= kmo_transfer_hub_expire(hub, &now);
+
+    /* Start the next operations of the registrations that had a completion.
+     * The operations of the transfers that are no longer active are not
+     * restarted.
+     */
+    for (i = 0; i < (ULONG) ready_array.size; i++) {
+    	struct kmo_comm_reg *reg = (struct kmo_comm_reg *) ready_array.data[i];
+	reg->ready = 0;
+
+	if (kmo_transfer_hub_arm(hub, reg, 0)) {
+	    karray_free(&ready_array);
+	    return -1;
+	}
+    }
+
+    karray_free(&ready_array);
+    return done_flag;
+}
@@ -0,0 +1,404 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+/* This module implements the asynchronous logs of KMOD. Each log has a ring
+ * buffer and a flusher thread.
+ *
+ * The writers reserve space in the ring by advancing 'reserve' with a
+ * compare-and-swap, copy their message and then publish it by advancing
+ * 'head', in reservation order. The flusher writes the bytes between 'tail'
+ * and 'head' to the file and advances 'tail'. The positions increase
+ * monotonically and wrap around naturally; the ring size is a power of 2.
+ */
+
+#ifdef __WINDOWS__
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "kmo_log.h"
+
+/* Delay between the checks of the flusher when the ring is empty, in
+ * milliseconds.
+ */
+#define KMO_LOG_FLUSH_DELAY 10
+
+/* Size of the buffer used to format the messages on the stack. */
+#define KMO_LOG_FORMAT_SIZE 512
+
+/* Maximum time kmo_log_flush() waits for the flusher, in milliseconds. */
+#define KMO_LOG_FLUSH_WAIT 1000
+
+struct kmo_log {
+
+    /* Log file. It is written by the flusher thread only, unless the log is
+     * held.
+     */
+    FILE *file;
+
+    /* Ring buffer. */
+    char *ring;
+    uint32_t ring_size;
+
+    /* Position up to which space has been reserved by the writers. */
+    uint32_t reserve;
+
+    /* Position up to which the messages have been published. */
+    uint32_t head;
+
+    /* Position up to which the messages have been written to the file. */
+    uint32_t tail;
+
+    /* Maximum number of bytes logged per second, 0 if unlimited. */
+    uint32_t max_rate;
+
+    /* Second of the current rate window and number of bytes logged in it. */
+    uint32_t rate_time;
+    uint32_t rate_bytes;
+
+    /* Maximum number of bytes written to the file, 0 if unlimited. */
+    uint32_t max_size;
+
+    /* Number of bytes written to the file. */
+    uint32_t size;
+
+    /* Number of messages dropped and not yet reported. */
+    uint32_t dropped;
+
+    /* Payload logging mode. */
+    int payload_mode;
+
+    /* Hold handshake: 'hold' is set by kmo_log_hold(), 'held' is set by the
+     * flusher when it has flushed the ring and stopped writing.
+     */
+    int hold;
+    int held;
+
+    /* Lock taken by the holder of the log, since the messages too large for
+     * the ring are written while the log is held, by any thread.
+     */
+    int hold_lock;
+
+    /* True if the flusher must exit once the ring is flushed. */
+    int stop;
+
+    /* Flusher thread. */
+#ifdef __WINDOWS__
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+};
+
+/* This function sleeps for the number of milliseconds specified. */
+static void kmo_log_sleep(int ms) {
+#ifdef __WINDOWS__
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+/* This function writes the bytes of the ring up to 'head' to the file. The
+ * file is flushed before 'tail' is advanced, so that kmo_log_flush() knows the
+ * bytes are out of the process.
+ */
+static void kmo_log_flush_ring(struct kmo_log *log, uint32_t head) {
+    uint32_t tail = log->tail;
+    uint32_t dropped;
+
+    while (tail != head) {
+    	uint32_t offset = tail & (log->ring_size - 1);
+	uint32_t len = MIN(head - tail, log->ring_size - offset);
+
+	uint32_t write_len = len;
+
+	/* Discard the data once the size cap is reached. */
+	if (log->max_size && log->size + len > log->max_size) {
+	    write_len = log->max_size - log->size;
+	}
+
+	if (write_len) {
+	    fwrite(log->ring + offset, 1, write_len, log->file);
+	    log->size += write_len;
+
+	    if (write_len < len) fprintf(log->file, "\n[log size limit reached]\n");
+	}
+
+	tail += len;
+    }
+
+    dropped = __atomic_exchange_n(&log->dropped, 0, __ATOMIC_ACQ_REL);
+    if (dropped) fprintf(log->file, "\n[%u log messages dropped]\n", dropped);
+
+    fflush(log->file);
+    __atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Flusher thread. */
+#ifdef __WINDOWS__
+static DWORD WINAPI kmo_log_flusher(LPVOID arg) {
+#else
+static void * kmo_log_flusher(void *arg) {
+#endif
+    struct kmo_log *log = (struct kmo_log *) arg;
+
+    while (1) {
+    	uint32_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+
+	if (head != log->tail) {
+	    kmo_log_flush_ring(log, head);
+	}
+
+	/* Let the holder use the file. */
+	else if (__atomic_load_n(&log->hold, __ATOMIC_ACQUIRE)) {
+	    __atomic_store_n(&log->held, 1, __ATOMIC_RELEASE);
+	    while (__atomic_load_n(&log->hold, __ATOMIC_ACQUIRE)) kmo_log_sleep(1);
+	    __atomic_store_n(&log->held, 0, __ATOMIC_RELEASE);
+	}
+
+	else if (__atomic_load_n(&log->stop, __ATOMIC_ACQUIRE)) {
+	    break;
+	}
+
+	else {
+	    kmo_log_sleep(KMO_LOG_FLUSH_DELAY);
+	}
+    }
+
+    return 0;
+}
+
+/* This function creates an asynchronous log writing to the file specified.
+ * 'ring_size' is rounded up to a power of 2. 'max_rate' is the maximum number
+ * of bytes logged per second and 'max_size' is the maximum number of bytes
+ * written to the file; 0 means unlimited. The log takes ownership of the file.
+ * This function sets the KMO error string. It returns NULL on failure.
+ */
+struct kmo_log * kmo_log_open(FILE *file, uint32_t ring_size, uint32_t max_rate, uint32_t max_size,
+    	    	    	      int payload_mode) {
+    struct kmo_log *log = (struct kmo_log *) kmo_calloc(sizeof(struct kmo_log));
+
+    log->file = file;
+    log->ring_size = 4096;
+    while (log->ring_size < ring_size) log->ring_size *= 2;
+    log->ring = (char *) kmo_malloc(log->ring_size);
+    log->max_rate = max_rate;
+    log->max_size = max_size;
+    log->payload_mode = payload_mode;
+
+#ifdef __WINDOWS__
+    log->thread = CreateThread(NULL, 0, kmo_log_flusher, log, 0, NULL);
+    if (log->thread == NULL) {
+#else
+    if (pthread_create(&log->thread, NULL, kmo_log_flusher, log)) {
+#endif
+    	kmo_seterror("cannot create log flusher thread");
+	free(log->ring);
+	free(log);
+	return NULL;
+    }
+
+    return log;
+}
+
+/* This function flushes the log, stops its flusher and closes the file. */
+void kmo_log_close(struct kmo_log *log) {
+    if (log == NULL) return;
+
+    __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+
+#ifdef __WINDOWS__
+    WaitForSingleObject(log->thread, INFINITE);
+    CloseHandle(log->thread);
+#else
+    pthread_join(log->thread, NULL);
+#endif
+
+    fclose(log->file);
+    free(log->ring);
+    free(log);
+}
+
+/* This function returns the payload logging mode of the log. */
+int kmo_log_get_payload_mode(struct kmo_log *log) {
+    return log->payload_mode;
+}
+
+/* This function writes a message too large for the ring directly to the file,
+ * after the messages published before it.
+ */
+static void kmo_log_write_direct(struct kmo_log *log, const void *data, uint32_t len) {
+    FILE *file = kmo_log_hold(log);
+    uint32_t write_len = len;
+
+    /* Discard the data once the size cap is reached. */
+    if (log->max_size && log->size + len > log->max_size) {
+    	write_len = log->max_size - log->size;
+    }
+
+    if (write_len) {
+    	fwrite(data, 1, write_len, file);
+	log->size += write_len;
+
+	if (write_len < len) fprintf(file, "\n[log size limit reached]\n");
+    }
+
+    fflush(file);
+    kmo_log_release(log);
+}
+
+/* This function appends the data specified to the log, unless a cap is
+ * reached or the ring is full. A message larger than the ring is written to
+ * the file synchronously.
+ */
+void kmo_log_write(struct kmo_log *log, const void *data, uint32_t len) {
+    uint32_t start, tail, offset, first_len;
+
+    if (len == 0) return;
+
+    /* The large payloads are not subject to the rate cap, since they would be
+     * the first messages dropped.
+     */
+    if (len > log->ring_size) {
+    	kmo_log_write_direct(log, data, len);
+	return;
+    }
+
+    /* Check the rate cap. The window is shared loosely by the writers. */
+    if (log->max_rate) {
+    	uint32_t now = (uint32_t) time(NULL);
+
+	if (__atomic_load_n(&log->rate_time, __ATOMIC_RELAXED) != now) {
+	    __atomic_store_n(&log->rate_time, now, __ATOMIC_RELAXED);
+	    __atomic_store_n(&log->rate_bytes, 0, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_add_fetch(&log->rate_bytes, len, __ATOMIC_RELAXED) > log->max_rate) {
+	    __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+	    return;
+	}
+    }
+
+    /* Reserve the space. */
+    start = __atomic_load_n(&log->reserve, __ATOMIC_RELAXED);
+
+    do {
+    	tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+
+	if (len > log->ring_size - (start - tail)) {
+	    __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+	    return;
+	}
+
+    } while (! __atomic_compare_exchange_n(&log->reserve, &start, start + len, 1,
+    	    	    	    	    	   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    /* Copy the data, wrapping around the end of the ring. */
+    offset = start & (log->ring_size - 1);
+    first_len = MIN(len, log->ring_size - offset);
+    memcpy(log->ring + offset, data, first_len);
+    memcpy(log->ring, (const char *) data + first_len, len - first_len);
+
+    /* Publish the data after the messages reserved before it. */
+    while (__atomic_load_n(&log->head, __ATOMIC_ACQUIRE) != start) kmo_log_sleep(0);
+    __atomic_store_n(&log->head, start + len, __ATOMIC_RELEASE);
+}
+
+/* This function formats a message and appends it to the log. */
+void kmo_log_vprintf(struct kmo_log *log, const char *format, va_list arg) {
+    char buf[KMO_LOG_FORMAT_SIZE];
+    char *str = buf;
+    va_list arg_copy;
+    int len;
+
+    va_copy(arg_copy, arg);
+    len = vsnprintf(buf, sizeof(buf), format, arg_copy);
+    va_end(arg_copy);
+
+    if (len < 0) return;
+
+    /* The message does not fit on the stack. */
+    if (len >= (int) sizeof(buf)) {
+    	str = (char *) kmo_malloc(len + 1);
+	vsnprintf(str, len + 1, format, arg);
+    }
+
+    kmo_log_write(log, str, len);
+    if (str != buf) free(str);
+}
+
+/* This function formats a message and appends it to the log. */
+void kmo_log_printf(struct kmo_log *log, const char *format, ...) {
+    va_list arg;
+    va_start(arg, format);
+    kmo_log_vprintf(log, format, arg);
+    va_end(arg);
+}
+
+/* This function appends a payload to the log according to the payload logging
+ * mode of the log. In digest mode, the payload is replaced by its length and
+ * its 64-bit FNV-1a digest. The digest is only used to correlate payloads.
+ */
+void kmo_log_payload(struct kmo_log *log, const void *data, uint32_t len) {
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t digest = 14695981039346656037ULL;
+    uint32_t i;
+
+    if (log->payload_mode == KMO_LOG_PAYLOAD_FULL) {
+    	kmo_log_write(log, data, len);
+	return;
+    }
+
+    for (i = 0; i < len; i++) {
+    	digest ^= p[i];
+	digest *= 1099511628211ULL;
+    }
+
+    kmo_log_printf(log, "<%u bytes, digest %.16"PRIx64">", len, digest);
+}
+
+/* This function waits for the flusher to write the messages logged so far and
+ * to stop writing, then returns the log file so that it can be used
+ * directly. kmo_log_release() must be called when done.
+ */
+FILE * kmo_log_hold(struct kmo_log *log) {
+    while (__atomic_exchange_n(&log->hold_lock, 1, __ATOMIC_ACQUIRE)) kmo_log_sleep(0);
+    __atomic_store_n(&log->hold, 1, __ATOMIC_RELEASE);
+    while (! __atomic_load_n(&log->held, __ATOMIC_ACQUIRE)) kmo_log_sleep(1);
+    return log->file;
+}
+
+/* This function lets the flusher resume writing to the file. */
+void kmo_log_release(struct kmo_log *log) {
+    __atomic_store_n(&log->hold, 0, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&log->held, __ATOMIC_ACQUIRE)) kmo_log_sleep(1);
+    __atomic_store_n(&log->hold_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* This function waits for the flusher to write the messages published so far
+ * to the file, for at most KMO_LOG_FLUSH_WAIT milliseconds. It is meant for the
+ * fatal error path, where the process exits without closing the log. It does
+ * not hold the log, so it returns even if the calling thread holds it.
+ */
+void kmo_log_flush(struct kmo_log *log) {
+    uint32_t head;
+    int i;
+
+    if (log == NULL) return;
+
+    head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < KMO_LOG_FLUSH_WAIT; i++) {
+    	if ((int32_t) (head - __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE)) <= 0) break;
+	kmo_log_sleep(1);
+    }
+}
+
+/* This function resets the size count of the log, after its file has been
+ * truncated. The log must be held.
+ */
+void kmo_log_reset_size(struct kmo_log *log) {
+    assert(log->held);
+    log->size = 0;
+}
@@ -0,0 +1,37 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KMO_LOG_H
+#define _KMO_LOG_H
+
+#include <stdarg.h>
+#include "kmo_base.h"
+
+/* Payload logging modes. */
+#define KMO_LOG_PAYLOAD_FULL	0   /* Log the payloads as they are. */
+#define KMO_LOG_PAYLOAD_DIGEST	1   /* Log the length and the digest of the payloads. */
+
+/* Asynchronous log. The messages are appended to an in-memory ring buffer and
+ * written to the log file by a background thread, so that logging does not
+ * wait for the disk. The ring may be written by several threads without
+ * locking. When the ring is full, or when the rate or size cap of the log is
+ * reached, the messages are dropped and the number of messages dropped is
+ * reported in the log. The messages larger than the ring are written to the
+ * file synchronously and they are not subject to the rate cap, so that large
+ * payloads are never lost.
+ */
+struct kmo_log;
+
+struct kmo_log * kmo_log_open(FILE *file, uint32_t ring_size, uint32_t max_rate, uint32_t max_size,
+    	    	    	      int payload_mode);
+void kmo_log_close(struct kmo_log *log);
+int kmo_log_get_payload_mode(struct kmo_log *log);
+void kmo_log_write(struct kmo_log *log, const void *data, uint32_t len);
+void kmo_log_vprintf(struct kmo_log *log, const char *format, va_list arg);
+void kmo_log_printf(struct kmo_log *log, const char *format, ...);
+void kmo_log_payload(struct kmo_log *log, const void *data, uint32_t len);
+FILE * kmo_log_hold(struct kmo_log *log);
+void kmo_log_release(struct kmo_log *log);
+void kmo_log_flush(struct kmo_log *log);
+void kmo_log_reset_size(struct kmo_log *log);
+
+#endif
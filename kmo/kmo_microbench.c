@@ -0,0 +1,923 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+/* This program measures the throughput of the primitives KMOD depends on: the
+ * base64 conversions, the hash table, the buffer growth, the K3P tokenizer,
+ * the KSP parser, the mail status scan and the mail database. Unlike
+ * kmod_bench, it does not involve KMOD itself.
+ *
+ * The inputs are generated from a fixed seed, so that the runs are comparable
+ * from one build to the next. Each benchmark is run several times and the
+ * results are printed on stdout, one benchmark per line:
+ *
+ *   bench <name> ops=<n> bytes=<n> runs=<n> min_ns=<ns> median_ns=<ns> mb_per_s=<MB/s>
+ *
+ * 'ops' and 'bytes' are the number of operations performed and of bytes
+ * processed by a run. 'min_ns' and 'median_ns' are the fastest and the median
+ * time of an operation over the runs. 'mb_per_s' is computed from the median
+ * time; it is 0 if the benchmark does not process bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gcrypt.h>
+#include "kmo_base.h"
+#include "kmo_stats.h"
+#include "kbuffer.h"
+#include "base64.h"
+#include "utils.h"
+#include "k3p.h"
+#include "mail.h"
+#include "maildb.h"
+#include "kmocrypt.h"
+#include "kmocryptsignature2.h"
+
+/* Default number of runs of each benchmark. */
+#define MBENCH_DEF_NB_RUN	5
+
+/* Default maximum number of rows of the mail database benchmarks. */
+#define MBENCH_DEF_MAX_ROW	1000000
+
+/* Number of lookups of a mail database read benchmark. */
+#define MBENCH_NB_LOOKUP	100000
+
+/* Number of message IDs per batch of the mail database batch benchmark. */
+#define MBENCH_BATCH_SIZE	100
+
+/* The logs of KMOD, unused here. */
+struct kmo_log *k3p_log = NULL;
+struct kmo_log *knp_log = NULL;
+struct kmo_log *kmod_log = NULL;
+int k3p_log_mode = 0;
+int kmod_log_level = 0;
+
+void kmod_log_msg(int level, const char *format, ...) { (void) level; (void) format; }
+
+/* Benchmark being run. */
+struct mbench {
+
+    /* Name of the benchmark. */
+    char *name;
+
+    /* Number of operations performed and of bytes processed by a run. */
+    uint64_t ops;
+    uint64_t bytes;
+
+    /* Function performing a run. */
+    void (*run)(struct mbench *b);
+
+    /* Argument of the function. */
+    void *arg;
+};
+
+/* Number of runs of each benchmark. */
+static int nb_run = MBENCH_DEF_NB_RUN;
+
+/* Only the benchmarks whose name contains this string are run, if set. */
+static char *filter = NULL;
+
+/* State of the pseudo-random generator. */
+static uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+
+/* This function returns the next pseudo-random number of the fixed sequence. */
+static uint32_t mbench_rand() {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return (uint32_t) (rand_state >> 16);
+}
+
+/* This function fills the buffer specified with 'len' pseudo-random bytes. */
+static void mbench_fill(kbuffer *buf, uint32_t len) {
+    uint8_t *p = kbuffer_begin_write(buf, len);
+    uint32_t i;
+    for (i = 0; i < len; i++) p[i] = (uint8_t) mbench_rand();
+    kbuffer_end_write(buf, len);
+}
+
+/* This function returns true if the benchmark specified must be run. */
+static int mbench_selected(char *name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static int mbench_cmp_time(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* This function runs the benchmark specified 'runs' times and prints the
+ * results.
+ */
+static void mbench_exec_runs(struct mbench *b, int runs) {
+    uint64_t *time_array;
+    double min_ns, median_ns, mb_per_s = 0;
+    int i;
+
+    if (! mbench_selected(b->name)) return;
+
+    time_array = (uint64_t *) kmo_malloc(runs * sizeof(uint64_t));
+
+    for (i = 0; i < runs; i++) {
+    	uint64_t start = kmo_stats_now();
+	b->run(b);
+	time_array[i] = kmo_stats_now() - start;
+    }
+
+    qsort(time_array, runs, sizeof(uint64_t), mbench_cmp_time);
+    min_ns = (double) time_array[0] * 1000 / b->ops;
+    median_ns = (double) time_array[runs / 2] * 1000 / b->ops;
+
+    if (b->bytes && time_array[runs / 2])
+    	mb_per_s = (double) b->bytes / time_array[runs / 2];
+
+    printf("bench %s ops=%llu bytes=%llu runs=%d min_ns=%.1f median_ns=%.1f mb_per_s=%.1f\n",
+    	   b->name, (unsigned long long) b->ops, (unsigned long long) b->bytes, runs,
+	   min_ns, median_ns, mb_per_s);
+    fflush(stdout);
+
+    free(time_array);
+}
+
+static void mbench_exec(struct mbench *b) {
+    mbench_exec_runs(b, nb_run);
+}
+
+/* Base64 benchmarks. */
+struct mbench_b64 {
+    kbuffer bin;
+    kbuffer b64;
+    kbuffer out;
+    int nb_iter;
+};
+
+static void mbench_run_b64_encode(struct mbench *b) {
+    struct mbench_b64 *s = (struct mbench_b64 *) b->arg;
+    int i;
+
+    for (i = 0; i < s->nb_iter; i++) {
+    	kbuffer_clear(&s->out);
+	bin2b64(&s->bin, &s->out);
+    }
+}
+
+static void mbench_run_b64_decode(struct mbench *b) {
+    struct mbench_b64 *s = (struct mbench_b64 *) b->arg;
+    int i;
+
+    for (i = 0; i < s->nb_iter; i++) {
+    	kbuffer_clear(&s->out);
+	s->b64.pos = 0;
+	if (b642bin(&s->b64, &s->out, 0)) abort();
+    }
+}
+
+static void mbench_base64() {
+    static uint32_t size_array[] = { 64, 4096, 1024 * 1024 };
+    static char *name_array[] = { "64", "4k", "1m" };
+    char name[64];
+    struct mbench_b64 s;
+    struct mbench b;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+	kbuffer_init(&s.bin, size_array[i]);
+	kbuffer_init(&s.b64, size_array[i] * 2);
+	kbuffer_init(&s.out, size_array[i] * 2);
+	mbench_fill(&s.bin, size_array[i]);
+	bin2b64(&s.bin, &s.b64);
+	s.nb_iter = 32 * 1024 * 1024 / size_array[i];
+
+	b.arg = &s;
+	b.name = name;
+	b.ops = s.nb_iter;
+
+	sprintf(name, "base64.encode.%s", name_array[i]);
+	b.bytes = (uint64_t) s.nb_iter * s.bin.len;
+	b.run = mbench_run_b64_encode;
+	mbench_exec(&b);
+
+	sprintf(name, "base64.decode.%s", name_array[i]);
+	b.bytes = (uint64_t) s.nb_iter * s.b64.len;
+	b.run = mbench_run_b64_decode;
+	mbench_exec(&b);
+
+	kbuffer_clean(&s.bin);
+	kbuffer_clean(&s.b64);
+	kbuffer_clean(&s.out);
+    }
+}
+
+/* Hash table benchmarks. */
+struct mbench_khash {
+    char **key_array;
+    int nb_key;
+    int nb_iter;
+    khash hash;
+};
+
+static void mbench_run_khash_add(struct mbench *b) {
+    struct mbench_khash *s = (struct mbench_khash *) b->arg;
+    khash hash;
+    int i, j;
+
+    for (j = 0; j < s->nb_iter; j++) {
+	khash_init_func(&hash, khash_cstr_key, khash_cstr_cmp);
+	for (i = 0; i < s->nb_key; i++) khash_add(&hash, s->key_array[i], s->key_array[i]);
+	khash_free(&hash);
+    }
+}
+
+static void mbench_run_khash_get(struct mbench *b) {
+    struct mbench_khash *s = (struct mbench_khash *) b->arg;
+    int i, j;
+
+    for (j = 0; j < s->nb_iter; j++)
+	for (i = 0; i < s->nb_key; i++)
+	    if (khash_get(&s->hash, s->key_array[(i * 7919) % s->nb_key]) == NULL) abort();
+}
+
+static void mbench_khash() {
+    static int size_array[] = { 1000, 100000 };
+    static char *name_array[] = { "1k", "100k" };
+    char name[64];
+    struct mbench_khash s;
+    struct mbench b;
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+    	s.nb_key = size_array[i];
+	s.key_array = (char **) kmo_malloc(s.nb_key * sizeof(char *));
+
+	for (j = 0; j < s.nb_key; j++) {
+	    char key[64];
+	    sprintf(key, "<%08x.%d@mail.example.com>", mbench_rand(), j);
+	    s.key_array[j] = strdup(key);
+	}
+
+	khash_init_func(&s.hash, khash_cstr_key, khash_cstr_cmp);
+	for (j = 0; j < s.nb_key; j++) khash_add(&s.hash, s.key_array[j], s.key_array[j]);
+
+	b.arg = &s;
+	b.name = name;
+	b.bytes = 0;
+
+	/* Keep the runs long enough to be measured. */
+	s.nb_iter = 1000000 / s.nb_key;
+	b.ops = (uint64_t) s.nb_key * s.nb_iter;
+
+	sprintf(name, "khash.add.%s", name_array[i]);
+	b.run = mbench_run_khash_add;
+	mbench_exec(&b);
+
+	sprintf(name, "khash.get.%s", name_array[i]);
+	b.run = mbench_run_khash_get;
+	mbench_exec(&b);
+
+	khash_free(&s.hash);
+	for (j = 0; j < s.nb_key; j++) free(s.key_array[j]);
+	free(s.key_array);
+    }
+}
+
+/* Buffer growth benchmarks. */
+struct mbench_kbuffer {
+    char *chunk;
+    uint32_t chunk_len;
+    int nb_write;
+};
+
+static void mbench_run_kbuffer_write(struct mbench *b) {
+    struct mbench_kbuffer *s = (struct mbench_kbuffer *) b->arg;
+    kbuffer buf;
+    int i;
+
+    kbuffer_init(&buf, 64);
+    for (i = 0; i < s->nb_write; i++) kbuffer_write(&buf, (uint8_t *) s->chunk, s->chunk_len);
+    kbuffer_clean(&buf);
+}
+
+static void mbench_kbuffer() {
+    static uint32_t size_array[] = { 16, 4096 };
+    static char *name_array[] = { "16", "4k" };
+    char name[64];
+    struct mbench_kbuffer s;
+    struct mbench b;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+    	s.chunk_len = size_array[i];
+	s.chunk = (char *) kmo_calloc(s.chunk_len);
+	s.nb_write = 32 * 1024 * 1024 / s.chunk_len;
+
+	sprintf(name, "kbuffer.write.%s", name_array[i]);
+	b.name = name;
+	b.arg = &s;
+	b.ops = s.nb_write;
+	b.bytes = (uint64_t) s.nb_write * s.chunk_len;
+	b.run = mbench_run_kbuffer_write;
+	mbench_exec(&b);
+
+	free(s.chunk);
+    }
+}
+
+/* K3P tokenizer benchmark. */
+struct mbench_k3p {
+    k3p_proto k3p;
+    kstr stream;
+    int nb_iter;
+};
+
+/* This function appends a K3P string element to the stream specified. */
+static void mbench_k3p_add_str(kstr *stream, char *data, int len) {
+    kstr tmp;
+    kstr_init(&tmp);
+    kstr_sf(&tmp, "STR%d>", len);
+    kstr_append_kstr(stream, &tmp);
+    kstr_append_buf(stream, data, len);
+    kstr_free(&tmp);
+}
+
+/* This function appends the elements of a recorded stream to the stream
+ * specified, as sent by the plugin. A plugin stream is recorded in the INPUT
+ * sections of the K3P logs of KMOD (the *_k3p.log files), provided the
+ * payloads were logged in full.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int mbench_k3p_load_log(char *path, kstr *stream) {
+    int error = 0;
+    int input_flag = 0;
+    int pos = 0;
+    FILE *file = NULL;
+    kstr buf;
+
+    kstr_init(&buf);
+
+    /* Try. */
+    do {
+    	error = util_open_file(&file, path, "rb");
+	if (error) break;
+
+	while (1) {
+	    char tmp[4096];
+	    int n = fread(tmp, 1, sizeof(tmp), file);
+	    if (n <= 0) break;
+	    kstr_append_buf(&buf, tmp, n);
+	}
+
+	while (pos < buf.slen) {
+	    char *p = buf.data + pos;
+	    int start = pos;
+
+	    if (*p == '\n' || *p == '\r' || *p == ' ') { pos++; continue; }
+
+	    if (! strncmp(p, "INPUT>", 6)) { input_flag = 1; pos += 6; continue; }
+	    if (! strncmp(p, "OUTPUT>", 7)) { input_flag = 0; pos += 7; continue; }
+
+	    if (! strncmp(p, "INS", 3)) {
+	    	pos += 11;
+	    }
+
+	    else if (! strncmp(p, "INT", 3) || ! strncmp(p, "STR", 3)) {
+	    	uint32_t value = 0;
+		pos += 3;
+		while (pos < buf.slen && buf.data[pos] >= '0' && buf.data[pos] <= '9')
+		    value = value * 10 + (buf.data[pos++] - '0');
+
+		if (pos == buf.slen || buf.data[pos] != '>') {
+		    kmo_seterror("invalid number at offset %d", start);
+		    error = -1;
+		    break;
+		}
+
+		pos++;
+		if (p[0] == 'S') pos += value;
+	    }
+
+	    else {
+	    	kmo_seterror("unknown element at offset %d", start);
+		error = -1;
+		break;
+	    }
+
+	    if (pos > buf.slen) {
+	    	kmo_seterror("truncated element at offset %d (payloads logged as digests?)", start);
+		error = -1;
+		break;
+	    }
+
+	    if (input_flag) kstr_append_buf(stream, buf.data + start, pos - start);
+	}
+
+	if (error) break;
+
+	if (stream->slen == 0) {
+	    kmo_seterror("no input element");
+	    error = -1;
+	    break;
+	}
+
+    } while (0);
+
+    if (error) kmo_seterror("cannot load %s: %s", path, kmo_strerror());
+
+    util_close_file(&file, 1);
+    kstr_free(&buf);
+    return error;
+}
+
+/* This function builds a stream similar to the evaluation of a few incoming
+ * mails.
+ */
+static void mbench_k3p_build_stream(kstr *stream) {
+    kstr tmp, body;
+    int i, j;
+
+    kstr_init(&tmp);
+    kstr_init(&body);
+
+    for (j = 0; j < 400; j++) kstr_append_cstr(&body, "The quick brown fox jumps over the lazy dog. ");
+
+    for (i = 0; i < 8; i++) {
+    	kstr_sf(&tmp, "INS%.8xINT%d>", 0x18, i);
+	kstr_append_kstr(stream, &tmp);
+
+	for (j = 0; j < 12; j++) {
+	    kstr_sf(&tmp, "field %d of mail %d <user%d@example.com>", j, i, j);
+	    mbench_k3p_add_str(stream, tmp.data, tmp.slen);
+	    kstr_sf(&tmp, "INT%u>", mbench_rand());
+	    kstr_append_kstr(stream, &tmp);
+	}
+
+	mbench_k3p_add_str(stream, body.data, body.slen);
+	mbench_k3p_add_str(stream, "", 0);
+    }
+
+    kstr_free(&tmp);
+    kstr_free(&body);
+}
+
+static void mbench_run_k3p_tokenize(struct mbench *b) {
+    struct mbench_k3p *s = (struct mbench_k3p *) b->arg;
+    int i;
+
+    for (i = 0; i < s->nb_iter; i++) {
+	kbuffer_clear(&s->k3p.data_buf);
+	kbuffer_write(&s->k3p.data_buf, (uint8_t *) s->stream.data, s->stream.slen);
+	s->k3p.element_array_pos = s->k3p.element_array_size = 0;
+	if (k3p_receive_element(&s->k3p)) abort();
+    }
+}
+
+static int mbench_k3p(char *log_path) {
+    struct mbench_k3p s;
+    struct mbench b;
+    int error = 0;
+
+    k3p_proto_init(&s.k3p);
+    kstr_init(&s.stream);
+
+    /* Try. */
+    do {
+    	if (log_path) {
+	    error = mbench_k3p_load_log(log_path, &s.stream);
+	    if (error) break;
+	}
+
+	else {
+	    mbench_k3p_build_stream(&s.stream);
+	}
+
+	s.nb_iter = 32 * 1024 * 1024 / s.stream.slen + 1;
+
+	/* Check the stream once. */
+	s.k3p.state = K3P_INTERACTING;
+	kbuffer_write(&s.k3p.data_buf, (uint8_t *) s.stream.data, s.stream.slen);
+	error = k3p_receive_element(&s.k3p);
+	if (error) break;
+
+	b.name = "k3p.tokenize";
+	b.arg = &s;
+	b.ops = s.nb_iter;
+	b.bytes = (uint64_t) s.nb_iter * s.stream.slen;
+	b.run = mbench_run_k3p_tokenize;
+	mbench_exec(&b);
+
+    } while (0);
+
+    kstr_free(&s.stream);
+    k3p_proto_free(&s.k3p);
+    return error;
+}
+
+/* KSP parser benchmark. */
+struct mbench_ksp {
+    kbuffer ksp;
+    int nb_iter;
+};
+
+/* This function appends a subpacket of pseudo-random data to the KSP
+ * specified.
+ */
+static void mbench_ksp_add_subpacket(kbuffer *ksp, uint8_t type, uint16_t len) {
+    kbuffer_write8(ksp, type);
+    kbuffer_write16(ksp, len);
+    mbench_fill(ksp, len);
+}
+
+/* This function builds a KSP similar to the signature of a mail having a few
+ * attachments. The KSP is not signed, as an encryption key KSP; the
+ * signature check is measured by kmocrypt, not here.
+ */
+static void mbench_ksp_build(kbuffer *ksp) {
+    uint32_t digest_len = gcry_md_get_algo_dlen(GCRY_MD_SHA256);
+    uint32_t len_pos;
+    int i;
+
+    kbuffer_write32(ksp, 0x23414143);
+    kbuffer_write32(ksp, 2);
+    kbuffer_write32(ksp, 1);
+    kbuffer_write64(ksp, 0);
+    kbuffer_write8(ksp, GCRY_MD_SHA256);
+    kbuffer_write8(ksp, GCRY_PK_RSA);
+    kbuffer_write8(ksp, 0);
+    len_pos = ksp->len;
+    kbuffer_write32(ksp, 0);
+
+    mbench_ksp_add_subpacket(ksp, KMO_SP_TYPE_FROM_NAME, digest_len);
+    mbench_ksp_add_subpacket(ksp, KMO_SP_TYPE_FROM_ADDR, digest_len);
+    mbench_ksp_add_subpacket(ksp, KMO_SP_TYPE_TO, digest_len);
+    mbench_ksp_add_subpacket(ksp, KMO_SP_TYPE_CC, digest_len);
+    mbench_ksp_add_subpacket(ksp, KMO_SP_TYPE_SUBJECT, digest_len);
+    mbench_ksp_add_subpacket(ksp, KMO_SP_TYPE_PLAIN, digest_len);
+    mbench_ksp_add_subpacket(ksp, KMO_SP_TYPE_HTML, digest_len);
+    mbench_ksp_add_subpacket(ksp, KMO_SP_TYPE_IPV4, 4);
+    mbench_ksp_add_subpacket(ksp, KMO_SP_TYPE_KSN, KMOCRYPT_KSN_SIZE);
+    for (i = 0; i < 8; i++) mbench_ksp_add_subpacket(ksp, KMO_SP_TYPE_ATTACHMENT, 2 * digest_len);
+
+    /* Patch the length of the subpackets. */
+    ksp->data[len_pos] = (ksp->len - len_pos - 4) >> 24;
+    ksp->data[len_pos + 1] = (ksp->len - len_pos - 4) >> 16;
+    ksp->data[len_pos + 2] = (ksp->len - len_pos - 4) >> 8;
+    ksp->data[len_pos + 3] = (ksp->len - len_pos - 4);
+}
+
+static void mbench_run_ksp(struct mbench *b) {
+    struct mbench_ksp *s = (struct mbench_ksp *) b->arg;
+    struct kmocrypt_signature2 sig;
+    int i;
+
+    for (i = 0; i < s->nb_iter; i++) {
+	memset(&sig, 0, sizeof(sig));
+	s->ksp.pos = 0;
+	if (kmocrypt_recognize_ksp2(&sig, &s->ksp)) abort();
+	kmocrypt_signature_free2(&sig);
+    }
+}
+
+static int mbench_ksp() {
+    struct mbench_ksp s;
+    struct kmocrypt_signature2 sig;
+    struct mbench b;
+    int error;
+
+    kbuffer_init(&s.ksp, 1024);
+    mbench_ksp_build(&s.ksp);
+    s.nb_iter = 200000;
+
+    /* Check the KSP once. */
+    memset(&sig, 0, sizeof(sig));
+    error = kmocrypt_recognize_ksp2(&sig, &s.ksp);
+    kmocrypt_signature_free2(&sig);
+
+    if (! error) {
+	b.name = "kmocrypt.recognize_ksp2";
+	b.arg = &s;
+	b.ops = s.nb_iter;
+	b.bytes = (uint64_t) s.nb_iter * s.ksp.len;
+	b.run = mbench_run_ksp;
+	mbench_exec(&b);
+    }
+
+    kbuffer_clean(&s.ksp);
+    return error;
+}
+
+/* Mail status benchmarks. */
+struct mbench_mail {
+    kstr text_body;
+    kstr html_body;
+    int nb_iter;
+    int expected;
+};
+
+static void mbench_run_mail_status(struct mbench *b) {
+    struct mbench_mail *s = (struct mbench_mail *) b->arg;
+    int i;
+
+    for (i = 0; i < s->nb_iter; i++)
+    	if (mail_get_mail_status(&s->text_body, &s->html_body, NULL, NULL) != s->expected) abort();
+}
+
+static void mbench_mail() {
+    static uint32_t size_array[] = { 64 * 1024, 4 * 1024 * 1024 };
+    static char *name_array[] = { "64k", "4m" };
+    char name[64];
+    struct mbench_mail s;
+    struct mbench b;
+    kstr body, sig;
+    int i;
+
+    kstr_init(&body);
+    kstr_init(&sig);
+    kstr_init(&s.text_body);
+    kstr_init(&s.html_body);
+
+    kstr_assign_cstr(&sig, "\n" KRYPTIVA_SIG_START "\n");
+    for (i = 0; i < 64; i++) kstr_append_cstr(&sig, "QUJDREVGR0hJSktMTU5PUFFSU1RVVldYWVo=\n");
+    kstr_append_cstr(&sig, KRYPTIVA_SIG_END "\n");
+
+    for (i = 0; i < 2; i++) {
+    	kstr_clear(&body);
+	while ((uint32_t) body.slen < size_array[i])
+	    kstr_append_cstr(&body, "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\r\n");
+
+	kstr_assign_cstr(&s.html_body, "<html><body>");
+	kstr_append_kstr(&s.html_body, &body);
+	kstr_append_cstr(&s.html_body, "</body></html>");
+	s.nb_iter = 256 * 1024 * 1024 / (body.slen * 2);
+
+	b.name = name;
+	b.arg = &s;
+	b.ops = s.nb_iter;
+	b.run = mbench_run_mail_status;
+
+	/* Unsigned mail: the whole body is scanned. */
+	kstr_assign_kstr(&s.text_body, &body);
+	b.bytes = (uint64_t) s.nb_iter * (s.text_body.slen + s.html_body.slen);
+	s.expected = mail_get_mail_status(&s.text_body, &s.html_body, NULL, NULL);
+	sprintf(name, "mail.status.unsigned.%s", name_array[i]);
+	mbench_exec(&b);
+
+	/* Signed mail. */
+	mail_build_signed_text_body(KPP_SIGN_MAIL, &body, &sig, &s.text_body);
+	s.expected = mail_get_mail_status(&s.text_body, &s.html_body, NULL, NULL);
+	b.bytes = (uint64_t) s.nb_iter * (s.text_body.slen + s.html_body.slen);
+	sprintf(name, "mail.status.signed.%s", name_array[i]);
+	mbench_exec(&b);
+    }
+
+    kstr_free(&body);
+    kstr_free(&sig);
+    kstr_free(&s.text_body);
+    kstr_free(&s.html_body);
+}
+
+/* Mail database benchmarks. */
+struct mbench_maildb {
+    char *path;
+    maildb *mdb;
+    int nb_row;
+};
+
+/* This function sets the mail info of the row specified. */
+static void mbench_maildb_set_row(maildb_mail_info *mi, int row) {
+    maildb_clear_mail_info(mi);
+    kstr_sf(&mi->msg_id, "<%d.bench@mail.example.com>", row);
+    kstr_sf(&mi->hash, "%020x", row);
+    kstr_sf(&mi->ksn, "%024x", row);
+    mi->status = 1;
+    mi->mid = row % 1000 + 1;
+}
+
+/* This function removes the database of the benchmark, if any. */
+static void mbench_maildb_remove(struct mbench_maildb *s) {
+    kstr path;
+    kstr_init(&path);
+    unlink(s->path);
+    kstr_sf(&path, "%s-wal", s->path);
+    unlink(path.data);
+    kstr_sf(&path, "%s-shm", s->path);
+    unlink(path.data);
+    kstr_free(&path);
+}
+
+/* This run creates the database and writes the rows in group commit mode, as
+ * KMOD does with the '-w' option.
+ */
+static void mbench_run_maildb_write(struct mbench *b) {
+    struct mbench_maildb *s = (struct mbench_maildb *) b->arg;
+    maildb_mail_info mi;
+    int i;
+
+    if (s->mdb) maildb_destroy(s->mdb);
+    mbench_maildb_remove(s);
+
+    s->mdb = maildb_sqlite_new(s->path);
+    if (s->mdb == NULL || maildb_set_group_commit(s->mdb, 1)) abort();
+
+    maildb_init_mail_info(&mi);
+
+    for (i = 0; i < s->nb_row; i++) {
+    	mbench_maildb_set_row(&mi, i);
+	if (maildb_set_mail_info(s->mdb, &mi)) abort();
+	if (maildb_get_group_size(s->mdb) >= MAILDB_BULK_WRITE_SIZE && maildb_commit_group(s->mdb)) abort();
+    }
+
+    if (maildb_commit_group(s->mdb)) abort();
+    maildb_free_mail_info(&mi);
+}
+
+static void mbench_run_maildb_read(struct mbench *b) {
+    struct mbench_maildb *s = (struct mbench_maildb *) b->arg;
+    maildb_mail_info mi;
+    int i;
+
+    maildb_init_mail_info(&mi);
+
+    for (i = 0; i < MBENCH_NB_LOOKUP; i++) {
+    	kstr_sf(&mi.msg_id, "<%d.bench@mail.example.com>", mbench_rand() % s->nb_row);
+	if (maildb_get_mail_info_from_msg_id(s->mdb, &mi, &mi.msg_id)) abort();
+    }
+
+    maildb_free_mail_info(&mi);
+}
+
+static void mbench_run_maildb_read_batch(struct mbench *b) {
+    struct mbench_maildb *s = (struct mbench_maildb *) b->arg;
+    karray id_array, mi_array, si_array;
+    int i, j;
+
+    karray_init(&id_array);
+    karray_init(&mi_array);
+    karray_init(&si_array);
+
+    for (j = 0; j < MBENCH_BATCH_SIZE; j++) {
+    	maildb_mail_info *mi = (maildb_mail_info *) kmo_malloc(sizeof(maildb_mail_info));
+	maildb_sender_info *si = (maildb_sender_info *) kmo_malloc(sizeof(maildb_sender_info));
+	maildb_init_mail_info(mi);
+	maildb_init_sender_info(si);
+	karray_add(&id_array, kstr_new());
+	karray_add(&mi_array, mi);
+	karray_add(&si_array, si);
+    }
+
+    for (i = 0; i < MBENCH_NB_LOOKUP / MBENCH_BATCH_SIZE; i++) {
+	for (j = 0; j < MBENCH_BATCH_SIZE; j++)
+	    kstr_sf((kstr *) id_array.data[j], "<%d.bench@mail.example.com>", mbench_rand() % s->nb_row);
+
+	if (maildb_get_mail_info_batch(s->mdb, &id_array, &mi_array, &si_array, 0)) abort();
+    }
+
+    for (j = 0; j < MBENCH_BATCH_SIZE; j++) {
+    	kstr_destroy((kstr *) id_array.data[j]);
+	maildb_free_mail_info((maildb_mail_info *) mi_array.data[j]);
+	maildb_free_sender_info((maildb_sender_info *) si_array.data[j]);
+	free(mi_array.data[j]);
+	free(si_array.data[j]);
+    }
+
+    karray_free(&id_array);
+    karray_free(&mi_array);
+    karray_free(&si_array);
+}
+
+static void mbench_maildb(char *dir_path, int max_row) {
+    static int size_array[] = { 10000, 100000, 1000000 };
+    static char *name_array[] = { "10k", "100k", "1m" };
+    char name[64];
+    struct mbench_maildb s;
+    struct mbench b;
+    kstr path;
+    int i;
+
+    kstr_init(&path);
+    kstr_sf(&path, "%s/kmo_microbench.db", dir_path);
+    s.path = path.data;
+    s.mdb = NULL;
+
+    for (i = 0; i < 3 && size_array[i] <= max_row; i++) {
+    	s.nb_row = size_array[i];
+
+	b.name = name;
+	b.arg = &s;
+	b.bytes = 0;
+	b.ops = s.nb_row;
+	b.run = mbench_run_maildb_write;
+
+	/* The large databases are written once. The reads need the rows
+	 * written even if the write benchmark is not selected.
+	 */
+	sprintf(name, "maildb.write.%s", name_array[i]);
+
+	if (mbench_selected(name)) {
+	    mbench_exec_runs(&b, s.nb_row > 10000 ? 1 : nb_run);
+	}
+
+	else {
+	    sprintf(name, "maildb.read.%s", name_array[i]);
+	    if (! mbench_selected(name)) sprintf(name, "maildb.read_batch.%s", name_array[i]);
+	    if (! mbench_selected(name)) continue;
+	    mbench_run_maildb_write(&b);
+	}
+
+	b.ops = MBENCH_NB_LOOKUP;
+
+	sprintf(name, "maildb.read.%s", name_array[i]);
+	b.run = mbench_run_maildb_read;
+	mbench_exec(&b);
+
+	sprintf(name, "maildb.read_batch.%s", name_array[i]);
+	b.run = mbench_run_maildb_read_batch;
+	mbench_exec(&b);
+    }
+
+    if (s.mdb) maildb_destroy(s.mdb);
+    mbench_maildb_remove(&s);
+    kstr_free(&path);
+}
+
+/* This function prints the usage on the stream specified. */
+static void mbench_print_usage(FILE *stream) {
+    fprintf(stream, "Usage: kmo_microbench [-r <runs>] [-f <filter>] [-k <k3p log>] [-d <dir>]\n"
+		    "                      [-m <rows>] [-h]\n"
+		    "\n"
+		    "-r <runs>        Number of runs of each benchmark. The default is 5.\n"
+		    "-f <filter>      Run only the benchmarks whose name contains this string.\n"
+		    "-k <k3p log>     Tokenize the input elements of this K3P log of KMOD instead\n"
+		    "                   of a generated stream. The payloads must have been logged\n"
+		    "                   in full.\n"
+		    "-d <dir>         Directory of the benchmark mail database. The default is\n"
+		    "                   the current directory.\n"
+		    "-m <rows>        Maximum number of rows of the mail database. The default\n"
+		    "                   is 1000000.\n"
+		    "-h               Show this help message and exit.\n"
+		    );
+}
+
+int main(int argc, char **argv) {
+    int error = 0;
+    int max_row = MBENCH_DEF_MAX_ROW;
+    char *log_path = NULL;
+    char *dir_path = ".";
+
+    kmo_error_start();
+
+    /* Try. */
+    do {
+	while (1) {
+	    int cmd = getopt(argc, argv, "r:f:k:d:m:h");
+
+	    if (cmd == -1) break;
+
+	    else if (cmd == 'r') {
+	    	nb_run = atoi(optarg);
+		if (nb_run <= 0) {
+		    fprintf(stderr, "Invalid number of runs (%s).\n", optarg);
+		    error = -1;
+		    break;
+		}
+	    }
+
+	    else if (cmd == 'f') filter = optarg;
+	    else if (cmd == 'k') log_path = optarg;
+	    else if (cmd == 'd') dir_path = optarg;
+	    else if (cmd == 'm') max_row = atoi(optarg);
+
+	    else {
+	    	mbench_print_usage(cmd == 'h' ? stdout : stderr);
+		error = (cmd == 'h') ? -2 : -1;
+		break;
+	    }
+	}
+
+	if (error) break;
+
+	/* Initialize kmocrypt for the KSP parser. */
+	kmocrypt_init();
+
+	mbench_base64();
+	mbench_khash();
+	mbench_kbuffer();
+
+	if (mbench_selected("k3p.tokenize")) {
+	    error = mbench_k3p(log_path);
+	    if (error) break;
+	}
+
+	if (mbench_selected("kmocrypt.recognize_ksp2")) {
+	    error = mbench_ksp();
+	    if (error) break;
+	}
+
+	mbench_mail();
+	mbench_maildb(dir_path, max_row);
+
+    } while (0);
+
+    if (error == -1 && kmo_strerror()[0]) fprintf(stderr, "Error: %s.\n", kmo_strerror());
+
+    kmo_error_end();
+    return error == -1 ? 1 : 0;
+}
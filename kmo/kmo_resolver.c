@@ -0,0 +1,654 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+/* This module implements the DNS resolver used to locate the KNP servers. */
+
+#include "kmo_resolver.h"
+#include "kmod.h"
+#include "kmo_stats.h"
+
+#ifdef __WINDOWS__
+#include <windns.h>
+#endif
+
+/* SRV record whose target addresses were not returned with the record. */
+struct kmo_resolver_target {
+    kstr host;
+    int port;
+};
+
+/* Cache entry. */
+struct kmo_resolver_entry {
+
+    /* Key of the entry: "srv:" or "addr:" followed by the name. */
+    kstr key;
+
+    /* Name looked up and type of lookup. */
+    kstr name;
+    int srv_flag;
+
+    /* True if the entry holds the result of a lookup. */
+    int resolved_flag;
+
+    /* Error message of the last lookup, empty if it succeeded. */
+    kstr error;
+
+    /* Time at which the entry expires and time at which it is refreshed. */
+    time_t expire_time;
+    time_t refresh_time;
+
+    /* Addresses found. The ports are set for the SRV records. */
+    int nb_addr;
+    struct kmo_sock_addr addr_array[KMO_RESOLVER_MAX_ADDR];
+
+    /* Array of kmo_resolver_target. Their addresses are looked up separately. */
+    karray target_array;
+
+    #ifdef __UNIX__
+    /* ADNS query in progress, if any. */
+    adns_query query;
+    #endif
+};
+
+/* Address to which a connection failed recently. */
+struct kmo_resolver_failure {
+
+    /* Key in the failure hash: the bytes of the address. */
+    kstr key;
+
+    /* Time of the last failure. */
+    time_t fail_time;
+};
+
+/* This function removes the result of the lookup from the entry. */
+static void kmo_resolver_entry_clear(struct kmo_resolver_entry *entry) {
+    int i;
+
+    for (i = 0; i < entry->target_array.size; i++) {
+    	struct kmo_resolver_target *target = (struct kmo_resolver_target *) entry->target_array.data[i];
+	kstr_free(&target->host);
+	free(target);
+    }
+
+    entry->target_array.size = 0;
+    entry->nb_addr = 0;
+    kstr_clear(&entry->error);
+}
+
+/* This function destroys a cache entry. */
+static void kmo_resolver_entry_destroy(struct kmo_resolver_entry *entry) {
+    kmo_resolver_entry_clear(entry);
+    karray_free(&entry->target_array);
+    kstr_free(&entry->key);
+    kstr_free(&entry->name);
+    kstr_free(&entry->error);
+    free(entry);
+}
+
+/* This function returns the cache entry of the name specified. The entry is
+ * created if needed.
+ */
+static struct kmo_resolver_entry * kmo_resolver_get_entry(struct kmo_resolver *self, char *name, int srv_flag) {
+    struct kmo_resolver_entry *entry;
+    kstr key;
+
+    kstr_init(&key);
+    kstr_sf(&key, "%s:%s", srv_flag ? "srv" : "addr", name);
+    entry = (struct kmo_resolver_entry *) khash_get(&self->cache, &key);
+
+    if (entry == NULL) {
+    	entry = (struct kmo_resolver_entry *) kmo_calloc(sizeof(struct kmo_resolver_entry));
+	kstr_init_kstr(&entry->key, &key);
+	kstr_init_cstr(&entry->name, name);
+	entry->srv_flag = srv_flag;
+	kstr_init(&entry->error);
+	karray_init(&entry->target_array);
+	khash_add(&self->cache, &entry->key, entry);
+    }
+
+    kstr_free(&key);
+    return entry;
+}
+
+/* This function sets the lifetime of the entry, given the time at which its
+ * records expire. The entry is refreshed when a quarter of its lifetime is
+ * left.
+ */
+static void kmo_resolver_set_ttl(struct kmo_resolver_entry *entry, time_t now, time_t expire_time) {
+    if (expire_time < now + KMO_RESOLVER_MIN_TTL) expire_time = now + KMO_RESOLVER_MIN_TTL;
+
+    entry->resolved_flag = 1;
+    entry->expire_time = expire_time;
+    entry->refresh_time = now + (expire_time - now) * 3 / 4;
+}
+
+/* This function records the failure of a lookup. If the entry still holds the
+ * result of a previous lookup, that result is kept for a while longer, since
+ * the servers have probably not moved.
+ */
+static void kmo_resolver_set_error(struct kmo_resolver_entry *entry, time_t now, const char *format, ...) {
+    va_list arg;
+
+    if (entry->resolved_flag && entry->error.slen == 0 && (entry->nb_addr || entry->target_array.size)) {
+    	entry->expire_time = entry->refresh_time = now + KMO_RESOLVER_NEG_TTL;
+	return;
+    }
+
+    kmo_resolver_entry_clear(entry);
+
+    va_start(arg, format);
+    kstr_sfv(&entry->error, format, arg);
+    va_end(arg);
+
+    entry->resolved_flag = 1;
+    entry->expire_time = entry->refresh_time = now + KMO_RESOLVER_NEG_TTL;
+}
+
+/* This function adds an address to the entry. */
+static void kmo_resolver_add_addr(struct kmo_resolver_entry *entry, struct sockaddr *sa, int len, int port) {
+    struct kmo_sock_addr *addr;
+
+    if (entry->nb_addr == KMO_RESOLVER_MAX_ADDR) return;
+    if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6) return;
+    if (len > (int) sizeof(addr->addr)) return;
+
+    addr = entry->addr_array + entry->nb_addr++;
+    memset(addr, 0, sizeof(struct kmo_sock_addr));
+    memcpy(&addr->addr, sa, len);
+    addr->len = len;
+    kmo_sock_addr_set_port(addr, port);
+}
+
+/* This function adds a SRV target to the entry. */
+static void kmo_resolver_add_target(struct kmo_resolver_entry *entry, char *host, int port) {
+    struct kmo_resolver_target *target = (struct kmo_resolver_target *) kmo_malloc(sizeof(struct kmo_resolver_target));
+    kstr_init_cstr(&target->host, host);
+    target->port = port;
+    karray_add(&entry->target_array, target);
+}
+
+/* This function looks up the addresses of the host of the entry with the
+ * system resolver. This call blocks.
+ */
+static void kmo_resolver_sys_lookup(struct kmo_resolver_entry *entry, time_t now) {
+    struct addrinfo hints, *info_list = NULL, *info;
+    int error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    error = getaddrinfo(entry->name.data, NULL, &hints, &info_list);
+
+    if (error) {
+    	kmo_resolver_set_error(entry, now, "cannot resolve %s: %s", entry->name.data, gai_strerror(error));
+	return;
+    }
+
+    kmo_resolver_entry_clear(entry);
+
+    for (info = info_list; info; info = info->ai_next) {
+    	kmo_resolver_add_addr(entry, info->ai_addr, info->ai_addrlen, 0);
+    }
+
+    freeaddrinfo(info_list);
+    kmo_resolver_set_ttl(entry, now, now + KMO_RESOLVER_SYS_TTL);
+}
+
+/* This function parses the name specified if it is a numeric address. This
+ * function returns -1 if the name is not a numeric address.
+ */
+static int kmo_resolver_parse_numeric(char *name, int port, struct kmo_resolver_result *result) {
+    struct addrinfo hints, *info = NULL;
+    struct kmo_sock_addr *addr = result->addr_array;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    if (getaddrinfo(name, NULL, &hints, &info)) return -1;
+
+    if (info->ai_addrlen > sizeof(addr->addr)) {
+    	freeaddrinfo(info);
+	return -1;
+    }
+
+    memset(addr, 0, sizeof(struct kmo_sock_addr));
+    memcpy(&addr->addr, info->ai_addr, info->ai_addrlen);
+    addr->len = info->ai_addrlen;
+    kmo_sock_addr_set_port(addr, port);
+    result->nb_addr = 1;
+
+    freeaddrinfo(info);
+    return 0;
+}
+
+#ifdef __UNIX__
+/* This function returns true if a lookup of the entry is in progress. */
+static inline int kmo_resolver_is_pending(struct kmo_resolver_entry *entry) {
+    return entry->query != NULL;
+}
+
+/* This function processes the answer to the lookup of an entry. */
+static void kmo_resolver_handle_answer(struct kmo_resolver *self, struct kmo_resolver_entry *entry,
+    	    	    	    	       adns_answer *answer) {
+    time_t now = time(NULL);
+    int i, j;
+
+    entry->query = NULL;
+    self->nb_pending--;
+
+    if (answer->status != adns_s_ok) {
+
+	/* ADNS does not read the hosts file. If the DNS says that the host does
+	 * not exist, ask the system resolver, which should not block since the
+	 * DNS is responding.
+	 */
+	if (! entry->srv_flag && (answer->status == adns_s_nxdomain || answer->status == adns_s_nodata)) {
+	    kmo_resolver_sys_lookup(entry, now);
+	}
+
+	else {
+	    kmo_resolver_set_error(entry, now, "cannot resolve %s: %s", entry->name.data,
+	    	    	    	   adns_strerror(answer->status));
+	}
+
+	free(answer);
+	return;
+    }
+
+    kmo_resolver_entry_clear(entry);
+
+    if (entry->srv_flag) {
+
+	/* The records are sorted by priority. */
+	for (i = 0; i < answer->nrrs; i++) {
+	    adns_rr_srvha *srv = answer->rrs.srvha + i;
+
+	    /* No addresses returned, resolve the SRV host name separately. */
+	    if (! srv->ha.naddrs) {
+	    	kmo_resolver_add_target(entry, srv->ha.host, srv->port);
+	    }
+
+	    for (j = 0; j < srv->ha.naddrs; j++) {
+		kmo_resolver_add_addr(entry, &srv->ha.addrs[j].addr.sa, srv->ha.addrs[j].len, srv->port);
+	    }
+	}
+    }
+
+    else {
+    	for (i = 0; i < answer->nrrs; i++) {
+	    kmo_resolver_add_addr(entry, &answer->rrs.addr[i].addr.sa, answer->rrs.addr[i].len, 0);
+	}
+    }
+
+    if (entry->nb_addr == 0 && entry->target_array.size == 0) {
+    	kmo_resolver_set_error(entry, now, "cannot resolve %s: no addresses found%s", entry->name.data,
+	    	    	       entry->srv_flag ? " for service" : "");
+    }
+
+    else {
+    	kmo_resolver_set_ttl(entry, now, answer->expires);
+    }
+
+    free(answer);
+}
+
+/* This function submits the lookup of an entry to ADNS. */
+static void kmo_resolver_start(struct kmo_resolver *self, struct kmo_resolver_entry *entry, time_t now) {
+    int r;
+    int flags = adns_qf_none;
+
+    /* Ask for the IPv6 addresses as well, if this version of ADNS can. */
+    #ifdef ADNS_FEATURE_MANYAF
+    flags |= adns_qf_want_allaf;
+    #endif
+
+    kmod_log_trace("kmo_resolver_start() called for %s.\n", entry->key.data);
+
+    if (self->state == NULL) {
+    	r = adns_init(&self->state, adns_if_noerrprint, NULL);
+
+	if (r) {
+	    kmo_resolver_set_error(entry, now, "cannot resolve %s: %s", entry->name.data, strerror(r));
+	    self->state = NULL; /* Don't call adns_finish(): ADNS sucks. */
+	    return;
+	}
+    }
+
+    r = adns_submit(self->state, entry->name.data, entry->srv_flag ? adns_r_srv : adns_r_addr, flags, entry,
+    	    	    &entry->query);
+
+    if (r) {
+    	kmo_resolver_set_error(entry, now, "cannot resolve %s: %s", entry->name.data, strerror(r));
+	entry->query = NULL;
+	return;
+    }
+
+    self->nb_pending++;
+}
+
+/* This function returns the transfer to add to the transfer hub to wait for
+ * the pending lookups, or NULL if there are none. kmo_resolver_process() must
+ * be called once the transfer is no longer pending.
+ */
+struct kmo_data_transfer * kmo_resolver_get_transfer(struct kmo_resolver *self) {
+    struct pollfd fds[8];
+    int nfds = 8;
+    int timeout = -1;
+    struct kmo_data_transfer *transfer = &self->transfer;
+
+    if (self->state == NULL || self->nb_pending == 0) return NULL;
+
+    if (adns_beforepoll(self->state, fds, &nfds, &timeout, NULL) || nfds == 0) return NULL;
+
+    /* ADNS normally uses a single UDP socket. Wait on the first descriptor and
+     * poll the others.
+     */
+    transfer->fd = fds[0].fd;
+    transfer->read_flag = (fds[0].events & POLLIN) ? 1 : 0;
+    transfer->buf = NULL;
+    transfer->min_len = transfer->max_len = 0;
+    transfer->op_timeout = KMO_RESOLVER_POLL_DELAY;
+    if (timeout >= 0 && timeout < KMO_RESOLVER_POLL_DELAY) transfer->op_timeout = timeout ? timeout : 1;
+
+    return transfer;
+}
+
+/* This function processes the activity of ADNS and the answers received. It
+ * does not block.
+ */
+void kmo_resolver_process(struct kmo_resolver *self) {
+    if (self->state == NULL) return;
+
+    adns_processany(self->state);
+
+    while (self->nb_pending) {
+    	adns_query query = NULL;
+	adns_answer *answer = NULL;
+	void *context = NULL;
+
+	if (adns_check(self->state, &query, &answer, &context)) break;
+	kmo_resolver_handle_answer(self, (struct kmo_resolver_entry *) context, answer);
+    }
+}
+
+#else
+/* The lookups are synchronous on Windows. */
+static inline int kmo_resolver_is_pending(struct kmo_resolver_entry *entry) {
+    return 0;
+}
+
+/* Sort function for the SRV records: the lowest priority comes first. */
+static int kmo_resolver_srv_sort(DNS_SRV_DATA **key_1, DNS_SRV_DATA **key_2) {
+    if ((*key_1)->wPriority < (*key_2)->wPriority) return -1;
+    if ((*key_1)->wPriority > (*key_2)->wPriority) return 1;
+    return 0;
+}
+
+/* This function looks up the SRV records of the entry with the Windows API. */
+static void kmo_resolver_srv_lookup(struct kmo_resolver_entry *entry, time_t now) {
+    PDNS_RECORD record_list = NULL;
+    PDNS_RECORD record;
+    karray srv_array;
+    DWORD ttl = 0xffffffff;
+    int error, i;
+
+    karray_init(&srv_array);
+
+    /* Try. */
+    do {
+	/* 33 = DNS_TYPE_SRV. */
+	error = DnsQuery_A(entry->name.data, 33, DNS_QUERY_STANDARD, NULL, &record_list, NULL);
+
+	if (error) {
+	    kmo_resolver_set_error(entry, now, "cannot resolve %s (error %d)", entry->name.data, error);
+	    break;
+	}
+
+	/* Ignore the other records, we can't depend on them being set. */
+	for (record = record_list; record; record = record->pNext) {
+	    if (record->wType == 33) {
+		karray_add(&srv_array, &record->Data.SRV);
+		if (record->dwTtl < ttl) ttl = record->dwTtl;
+	    }
+	}
+
+	if (! srv_array.size) {
+	    kmo_resolver_set_error(entry, now, "cannot resolve %s: no addresses returned", entry->name.data);
+	    break;
+	}
+
+	qsort(srv_array.data, srv_array.size, sizeof(void *),
+	      (int (*)(const void *, const void *)) kmo_resolver_srv_sort);
+
+	kmo_resolver_entry_clear(entry);
+
+	for (i = 0; i < srv_array.size; i++) {
+	    DNS_SRV_DATA *srv = (DNS_SRV_DATA *) srv_array.data[i];
+	    kmo_resolver_add_target(entry, srv->pNameTarget, srv->wPort);
+	}
+
+	kmo_resolver_set_ttl(entry, now, now + ttl);
+
+    } while (0);
+
+    if (record_list) DnsRecordListFree(record_list, DnsFreeRecordList);
+    karray_free(&srv_array);
+}
+
+/* This function performs the lookup of an entry. */
+static void kmo_resolver_start(struct kmo_resolver *self, struct kmo_resolver_entry *entry, time_t now) {
+    kmod_log_trace("kmo_resolver_start() called for %s.\n", entry->key.data);
+
+    if (entry->srv_flag) kmo_resolver_srv_lookup(entry, now);
+    else kmo_resolver_sys_lookup(entry, now);
+}
+
+struct kmo_data_transfer * kmo_resolver_get_transfer(struct kmo_resolver *self) {
+    return NULL;
+}
+
+void kmo_resolver_process(struct kmo_resolver *self) {}
+#endif
+
+/* This function sets the key of the failure hash for the address specified. */
+static void kmo_resolver_fail_key(kstr *key, struct kmo_sock_addr *addr) {
+    kstr_assign_buf(key, &addr->addr, addr->len);
+}
+
+/* This function reports the outcome of a connection to an address returned by
+ * kmo_resolver_lookup(). If 'fail_flag' is true, the address is tried after
+ * the others for a while.
+ */
+void kmo_resolver_report(struct kmo_resolver *self, struct kmo_sock_addr *addr, int fail_flag) {
+    struct kmo_resolver_failure *failure;
+    kstr key;
+
+    kstr_init(&key);
+    kmo_resolver_fail_key(&key, addr);
+    failure = (struct kmo_resolver_failure *) khash_get(&self->fail_hash, &key);
+
+    if (fail_flag) {
+    	if (failure == NULL) {
+	    failure = (struct kmo_resolver_failure *) kmo_malloc(sizeof(struct kmo_resolver_failure));
+	    kstr_init_kstr(&failure->key, &key);
+	    khash_add(&self->fail_hash, &failure->key, failure);
+	}
+
+	failure->fail_time = time(NULL);
+    }
+
+    else if (failure) {
+    	khash_remove(&self->fail_hash, &failure->key);
+	kstr_free(&failure->key);
+	free(failure);
+    }
+
+    kstr_free(&key);
+}
+
+/* This function returns true if a connection to the address specified failed
+ * recently.
+ */
+static int kmo_resolver_has_failed(struct kmo_resolver *self, struct kmo_sock_addr *addr, time_t now) {
+    struct kmo_resolver_failure *failure;
+    kstr key;
+
+    if (self->fail_hash.size == 0) return 0;
+
+    kstr_init(&key);
+    kmo_resolver_fail_key(&key, addr);
+    failure = (struct kmo_resolver_failure *) khash_get(&self->fail_hash, &key);
+    kstr_free(&key);
+
+    return (failure && now < failure->fail_time + KMO_RESOLVER_FAIL_DELAY);
+}
+
+/* This function moves the addresses to which a connection failed recently to
+ * the end of the result, keeping the order of the addresses otherwise.
+ */
+static void kmo_resolver_order_result(struct kmo_resolver *self, struct kmo_resolver_result *result, time_t now) {
+    struct kmo_sock_addr failed_array[KMO_RESOLVER_MAX_ADDR];
+    int nb_ok = 0, nb_failed = 0;
+    int i;
+
+    if (self->fail_hash.size == 0) return;
+
+    for (i = 0; i < result->nb_addr; i++) {
+    	if (kmo_resolver_has_failed(self, result->addr_array + i, now)) {
+	    failed_array[nb_failed++] = result->addr_array[i];
+	}
+
+	else {
+	    result->addr_array[nb_ok++] = result->addr_array[i];
+	}
+    }
+
+    for (i = 0; i < nb_failed; i++) result->addr_array[nb_ok + i] = failed_array[i];
+}
+
+/* This function initializes the resolver. */
+void kmo_resolver_init(struct kmo_resolver *self) {
+    khash_init_func(&self->cache, khash_kstr_key, khash_kstr_cmp);
+    khash_init_func(&self->fail_hash, khash_kstr_key, khash_kstr_cmp);
+
+    #ifdef __UNIX__
+    self->state = NULL;
+    self->nb_pending = 0;
+    kmo_data_transfer_init(&self->transfer);
+    self->transfer.driver = kmo_sock_driver;
+    #endif
+}
+
+/* This function frees the resolver and cancels the pending lookups. */
+void kmo_resolver_free(struct kmo_resolver *self) {
+    int index = -1;
+    int i;
+
+    for (i = 0; i < self->cache.size; i++) {
+    	struct kmo_resolver_entry *entry = (struct kmo_resolver_entry *) khash_iter_next_value(&self->cache, &index);
+
+	#ifdef __UNIX__
+	if (entry->query) adns_cancel(entry->query);
+	#endif
+
+	kmo_resolver_entry_destroy(entry);
+    }
+
+    khash_free(&self->cache);
+
+    index = -1;
+
+    for (i = 0; i < self->fail_hash.size; i++) {
+    	struct kmo_resolver_failure *failure =
+	    (struct kmo_resolver_failure *) khash_iter_next_value(&self->fail_hash, &index);
+	kstr_free(&failure->key);
+	free(failure);
+    }
+
+    khash_free(&self->fail_hash);
+
+    #ifdef __UNIX__
+    if (self->state) adns_finish(self->state);
+    self->state = NULL;
+
+    /* The descriptor belongs to ADNS. */
+    self->transfer.fd = -1;
+    kmo_data_transfer_free(&self->transfer);
+    #endif
+}
+
+/* This function looks up the addresses of the host specified, or of the
+ * servers of the service specified if 'srv_flag' is true. 'port' is the port
+ * set in the addresses of a host; the ports of the services come from their
+ * SRV records. The cached records are used while they are valid. The records
+ * are refreshed in the background once most of their lifetime has elapsed.
+ * This function returns -2 if the lookup is in progress, in which case it must
+ * be called again once kmo_resolver_process() has been called.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int kmo_resolver_lookup(struct kmo_resolver *self, char *name, int srv_flag, int port,
+    	    	    	struct kmo_resolver_result *result) {
+    struct kmo_resolver_entry *entry;
+    time_t now = time(NULL);
+    int pending_flag = 0;
+    int i;
+
+    result->nb_addr = 0;
+
+    /* Numeric addresses don't need a lookup. */
+    if (! srv_flag && ! kmo_resolver_parse_numeric(name, port, result)) return 0;
+
+    entry = kmo_resolver_get_entry(self, name, srv_flag);
+    
+    if (entry->resolved_flag) kmo_stats_count(KMO_STAT_RESOLVER_CACHE_HIT);
+    else if (! kmo_resolver_is_pending(entry)) kmo_stats_count(KMO_STAT_RESOLVER_CACHE_MISS);
+
+    /* Look the entry up if it has no result, or refresh it before it expires.
+     * While the refresh is pending, the current result is used.
+     */
+    if (! kmo_resolver_is_pending(entry) && (! entry->resolved_flag || now >= entry->refresh_time)) {
+    	kmo_resolver_start(self, entry, now);
+    }
+
+    if (! entry->resolved_flag) return -2;
+
+    if (entry->error.slen) {
+    	kmo_seterror("%s", entry->error.data);
+	return -1;
+    }
+
+    for (i = 0; i < entry->nb_addr; i++) {
+    	result->addr_array[result->nb_addr] = entry->addr_array[i];
+	if (! srv_flag) kmo_sock_addr_set_port(result->addr_array + result->nb_addr, port);
+	result->nb_addr++;
+    }
+
+    /* Resolve the SRV targets whose addresses were not returned. Ignore the
+     * errors, since it's likely the DNS that's badly configured if this
+     * fails.
+     */
+    for (i = 0; i < entry->target_array.size && result->nb_addr < KMO_RESOLVER_MAX_ADDR; i++) {
+    	struct kmo_resolver_target *target = (struct kmo_resolver_target *) entry->target_array.data[i];
+	struct kmo_resolver_result target_result;
+	int error = kmo_resolver_lookup(self, target->host.data, 0, target->port, &target_result);
+	int j;
+
+	if (error == -2) pending_flag = 1;
+	if (error) continue;
+
+	for (j = 0; j < target_result.nb_addr && result->nb_addr < KMO_RESOLVER_MAX_ADDR; j++) {
+	    result->addr_array[result->nb_addr++] = target_result.addr_array[j];
+	}
+    }
+
+    if (result->nb_addr == 0) {
+    	if (pending_flag) return -2;
+	kmo_seterror("cannot resolve %s: no addresses found for service", name);
+	return -1;
+    }
+
+    kmo_resolver_order_result(self, result, now);
+    return 0;
+}
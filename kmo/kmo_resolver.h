@@ -0,0 +1,85 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KMO_RESOLVER_H
+#define _KMO_RESOLVER_H
+
+#include "kmo_base.h"
+#include "kmo_comm.h"
+#include "kmo_sock.h"
+
+#ifdef __UNIX__
+#include <adns.h>
+#endif
+
+/* Maximum number of addresses returned by a lookup. */
+#define KMO_RESOLVER_MAX_ADDR	    8
+
+/* Delay in seconds during which a failed lookup is not retried. */
+#define KMO_RESOLVER_NEG_TTL	    10
+
+/* Minimum lifetime in seconds of a cached record. */
+#define KMO_RESOLVER_MIN_TTL	    5
+
+/* Lifetime in seconds of the records obtained from the system resolver, which
+ * does not tell their TTL.
+ */
+#define KMO_RESOLVER_SYS_TTL	    300
+
+/* Delay in seconds during which an address to which a connection failed is
+ * tried after the others.
+ */
+#define KMO_RESOLVER_FAIL_DELAY     300
+
+/* Maximum delay in milliseconds between two checks of the pending lookups
+ * while the transfer hub waits.
+ */
+#define KMO_RESOLVER_POLL_DELAY     1000
+
+/* Addresses obtained by a lookup, in order of preference. */
+struct kmo_resolver_result {
+    int nb_addr;
+    struct kmo_sock_addr addr_array[KMO_RESOLVER_MAX_ADDR];
+};
+
+/* DNS resolver with a cache. The SRV and the address (A and AAAA) records are
+ * cached for the duration of their TTL, and they are refreshed in the
+ * background when their lifetime is almost over. The addresses to which a
+ * connection failed recently are returned last.
+ *
+ * On UNIX, the lookups are performed asynchronously with a single ADNS state
+ * that lives as long as the resolver. The pending lookups are driven by the
+ * transfer hub: kmo_resolver_get_transfer() returns a transfer to add to the
+ * hub and kmo_resolver_process() must be called when it completes. On Windows,
+ * the lookups are synchronous, but cached.
+ */
+struct kmo_resolver {
+
+    /* Hash of the cache entries, keyed by kstr. */
+    khash cache;
+    
+    /* Hash of the addresses to which a connection failed recently, keyed by
+     * kstr holding the address bytes. The values are the failure times.
+     */
+    khash fail_hash;
+
+    #ifdef __UNIX__
+    /* ADNS state, NULL until the first lookup. */
+    adns_state state;
+
+    /* Number of lookups in progress. */
+    int nb_pending;
+
+    /* Transfer used to wait for the ADNS descriptor. */
+    struct kmo_data_transfer transfer;
+    #endif
+};
+
+void kmo_resolver_init(struct kmo_resolver *self);
+void kmo_resolver_free(struct kmo_resolver *self);
+int kmo_resolver_lookup(struct kmo_resolver *self, char *name, int srv_flag, int port,
+    	    	    	struct kmo_resolver_result *result);
+void kmo_resolver_report(struct kmo_resolver *self, struct kmo_sock_addr *addr, int fail_flag);
+struct kmo_data_transfer * kmo_resolver_get_transfer(struct kmo_resolver *self);
+void kmo_resolver_process(struct kmo_resolver *self);
+
+#endif
@@ -12,9 +12,45 @@
 #include "kmo_sock_win.c"
 #endif
 
+/* This function creates an IPv4 socket and sets it in 'fd' (which must be
+ * initialized to -1).
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int kmo_sock_create(int *fd) {
+    return kmo_sock_create_family(fd, AF_INET);
+}
+
+/* This function sets the port of the address specified. */
+void kmo_sock_addr_set_port(struct kmo_sock_addr *addr, int port) {
+    if (addr->addr.sa.sa_family == AF_INET6) addr->addr.inet6.sin6_port = htons(port);
+    else addr->addr.inet.sin_port = htons(port);
+}
+
+/* This function writes the numeric form of the address specified, without the
+ * port, in 'buf'.
+ */
+void kmo_sock_addr_str(struct kmo_sock_addr *addr, char *buf, int buf_len) {
+    if (getnameinfo(&addr->addr.sa, addr->len, buf, buf_len, NULL, 0, NI_NUMERICHOST)) {
+    	snprintf(buf, buf_len, "<unknown address>");
+    }
+}
+
 /* Setup the socket driver. */
 struct kmo_comm_driver kmo_sock_driver = {
     kmo_sock_read,
     kmo_sock_write,
-    kmo_sock_close
+    kmo_sock_close,
+    kmo_sock_write_iov,
+    NULL
+};
+
+#ifdef __UNIX__
+/* Setup the Unix-domain socket driver. */
+struct kmo_comm_driver kmo_unix_driver = {
+    kmo_sock_read_unix,
+    kmo_sock_write,
+    kmo_sock_close_unix,
+    kmo_sock_write_iov,
+    kmo_sock_take_fd
 };
+#endif
@@ -4,16 +4,50 @@
 #define _KMO_SOCK_H
 
 #include "kmo_base.h"
+#include "kmo_comm.h"
+
+#ifdef __WINDOWS__
+#include <ws2tcpip.h>
+#endif
+
+/* Address of a remote host, IPv4 or IPv6, including the port. */
+struct kmo_sock_addr {
+    
+    /* Length of the address in 'addr'. */
+    int len;
+    
+    union {
+    	struct sockaddr sa;
+	struct sockaddr_in inet;
+	struct sockaddr_in6 inet6;
+    } addr;
+};
 
 int kmo_sock_create(int *fd);
+int kmo_sock_create_family(int *fd, int family);
 void kmo_sock_close(int *fd);
 int kmo_sock_set_unblocking(int fd);
 int kmo_sock_bind(int fd, int port);
 int kmo_sock_listen(int fd);
 int kmo_sock_accept(int accept_fd, int *conn_fd);
 int kmo_sock_connect(int fd, char *host, int port);
+int kmo_sock_connect_addr(int fd, struct kmo_sock_addr *addr, char *host);
 int kmo_sock_connect_check(int fd, char *host);
+void kmo_sock_addr_set_port(struct kmo_sock_addr *addr, int port);
+void kmo_sock_addr_str(struct kmo_sock_addr *addr, char *buf, int buf_len);
 int kmo_sock_read(int fd, char *buf, uint32_t *len);
 int kmo_sock_write(int fd, char *buf, uint32_t *len);
+int kmo_sock_write_iov(int fd, struct kmo_iovec *iov, int count, uint32_t *len);
+
+#ifdef __UNIX__
+int kmo_sock_create_unix(int *fd);
+int kmo_sock_is_unix(int fd);
+int kmo_sock_bind_unix(int fd, char *path);
+int kmo_sock_connect_unix(int fd, char *path);
+int kmo_sock_set_buffer_size(int fd, int size);
+int kmo_sock_read_unix(int fd, char *buf, uint32_t *len);
+int kmo_sock_take_fd(int fd);
+void kmo_sock_close_unix(int *fd);
+#endif
 
 #endif
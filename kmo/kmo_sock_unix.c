@@ -2,6 +2,27 @@
 
 /* This file is meant to be included by kmo_sock.c. */
 
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/* Maximum number of descriptors held in the queue of the descriptors received
+ * on the Unix-domain sockets.
+ */
+#define KMO_SOCK_MAX_RECV_FD	64
+
+/* Maximum number of descriptors accepted with a single recvmsg() call. */
+#define KMO_SOCK_MAX_MSG_FD	16
+
+/* Descriptors received on the Unix-domain sockets and not taken yet, in the
+ * order they were received. 'sock_fd' is the socket the descriptor was
+ * received on.
+ */
+static struct {
+    int sock_fd;
+    int fd;
+} kmo_sock_recv_fd_array[KMO_SOCK_MAX_RECV_FD];
+static int kmo_sock_nb_recv_fd = 0;
+
 
 /* This function returns an error string describing the last socket error that
  * occurred.
@@ -10,13 +31,13 @@ static char * kmo_sock_err() {
     return kmo_syserror();
 }
 
-/* This function creates a socket and sets it in 'fd' (which must be initialized
- * to -1).
+/* This function creates a socket of the address family specified and sets it
+ * in 'fd' (which must be initialized to -1).
  * This function sets the KMO error string. It returns -1 on failure.
  */
-int kmo_sock_create(int *fd) {
+int kmo_sock_create_family(int *fd, int family) {
     assert(*fd == -1);
-    int error = socket(AF_INET, SOCK_STREAM, 0);
+    int error = socket(family, SOCK_STREAM, 0);
     
     if (error < 0) {
     	kmo_seterror("cannot create socket: %s", kmo_sock_err());
@@ -163,6 +184,24 @@ int kmo_sock_connect(int fd, char *host, int port) {
     return 0;
 }
 
+/* Same as kmo_sock_connect(), with an address that has already been resolved.
+ * 'host' is used in the error messages. The socket must have been created with
+ * the family of the address.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int kmo_sock_connect_addr(int fd, struct kmo_sock_addr *addr, char *host) {
+    if (connect(fd, &addr->addr.sa, addr->len) < 0) {
+	if (errno == EINPROGRESS || errno == EWOULDBLOCK) {
+	    return 0;
+	}
+	
+	kmo_seterror("cannot connect to %s: %s", host, kmo_sock_err());
+    	return -1;
+    }
+    
+    return 0;
+}
+
 /* This function checks if the connection request initiated with
  * kmo_sock_connect() has been completed.
  * This function sets the KMO error string. It returns -1 on failure.
@@ -237,3 +276,249 @@ int kmo_sock_write(int fd, char *buf, uint32_t *len) {
     return 0;
 }
 
+
+/* Same as above, for a vectored write. */
+int kmo_sock_write_iov(int fd, struct kmo_iovec *iov, int count, uint32_t *len) {
+    struct iovec vec[KMO_COMM_MAX_IOV];
+    int i, nb;
+    
+    assert(count > 0);
+    if (count > KMO_COMM_MAX_IOV) count = KMO_COMM_MAX_IOV;
+    
+    for (i = 0; i < count; i++) {
+    	vec[i].iov_base = iov[i].buf;
+	vec[i].iov_len = iov[i].len;
+    }
+    
+    nb = writev(fd, vec, count);
+    
+    if (nb == 0) {
+    	kmo_seterror("cannot send data: remote side closed connection");
+	return -1;
+    }
+    
+    else if (nb < 0) {
+    	if (errno == EAGAIN) {
+	    return -2;
+	}
+	
+    	kmo_seterror("cannot send data: %s", kmo_sock_err());
+	return -1;
+    }
+    
+    *len = nb;
+    return 0;
+}
+
+
+/* This function creates a Unix-domain stream socket and sets it in 'fd' (which
+ * must be initialized to -1).
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int kmo_sock_create_unix(int *fd) {
+    return kmo_sock_create_family(fd, AF_UNIX);
+}
+
+/* This function returns true if the descriptor specified is a Unix-domain
+ * socket.
+ */
+int kmo_sock_is_unix(int fd) {
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+    
+    if (getsockname(fd, (struct sockaddr *) &addr, &len)) return 0;
+    return (addr.sun_family == AF_UNIX);
+}
+
+/* This function fills the Unix-domain socket address of the path specified.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmo_sock_unix_addr(struct sockaddr_un *addr, char *path) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+    	kmo_seterror("socket path %s is too long", path);
+	return -1;
+    }
+    
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* This function binds the Unix-domain socket to the path specified. A stale
+ * socket file left at this path is removed. Only the current user may connect
+ * to the socket.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int kmo_sock_bind_unix(int fd, char *path) {
+    struct sockaddr_un addr;
+    
+    if (kmo_sock_unix_addr(&addr, path)) return -1;
+    unlink(path);
+    
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        kmo_seterror("cannot bind socket to %s: %s", path, kmo_sock_err());
+        return -1;
+    }
+    
+    if (chmod(path, 0600)) {
+    	kmo_seterror("cannot set the permissions of %s: %s", path, kmo_sock_err());
+	return -1;
+    }
+    
+    return 0;
+}
+
+/* This function sends a connection request to the Unix-domain socket bound to
+ * the path specified. See kmo_sock_connect().
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int kmo_sock_connect_unix(int fd, char *path) {
+    struct sockaddr_un addr;
+    
+    if (kmo_sock_unix_addr(&addr, path)) return -1;
+    
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	if (errno == EINPROGRESS || errno == EWOULDBLOCK) {
+	    return 0;
+	}
+	
+	kmo_seterror("cannot connect to %s: %s", path, kmo_sock_err());
+    	return -1;
+    }
+    
+    return 0;
+}
+
+/* This function sets the size of the send and receive buffers of the socket.
+ * The kernel may round or cap the size requested.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int kmo_sock_set_buffer_size(int fd, int size) {
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char *) &size, sizeof(size)) ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char *) &size, sizeof(size))) {
+    	kmo_seterror("cannot set socket buffer size: %s", kmo_sock_err());
+	return -1;
+    }
+    
+    return 0;
+}
+
+/* This function queues the descriptors received in the control message
+ * specified. The descriptors that do not fit in the queue are closed.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmo_sock_queue_recv_fd(int sock_fd, struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+    int error = 0;
+    
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    	int i, nb_fd;
+	int *fd_array;
+	
+    	if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+	
+	nb_fd = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	fd_array = (int *) CMSG_DATA(cmsg);
+	
+	for (i = 0; i < nb_fd; i++) {
+	    int fd;
+	    memcpy(&fd, fd_array + i, sizeof(int));
+	    
+	    if (kmo_sock_nb_recv_fd == KMO_SOCK_MAX_RECV_FD) {
+	    	close(fd);
+		error = -1;
+		continue;
+	    }
+	    
+	    kmo_sock_recv_fd_array[kmo_sock_nb_recv_fd].sock_fd = sock_fd;
+	    kmo_sock_recv_fd_array[kmo_sock_nb_recv_fd].fd = fd;
+	    kmo_sock_nb_recv_fd++;
+	}
+    }
+    
+    if (error || (msg->msg_flags & MSG_CTRUNC)) {
+    	kmo_seterror("cannot read data: too many file descriptors received");
+	return -1;
+    }
+    
+    return 0;
+}
+
+/* Same as kmo_sock_read(), for a Unix-domain socket. The descriptors passed by
+ * the remote side are queued; use kmo_sock_take_fd() to obtain them.
+ */
+int kmo_sock_read_unix(int fd, char *buf, uint32_t *len) {
+    union {
+    	struct cmsghdr align;
+	char buf[CMSG_SPACE(KMO_SOCK_MAX_MSG_FD * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec vec;
+    int flags = 0;
+    int nb;
+    
+    assert(*len > 0);
+    vec.iov_base = buf;
+    vec.iov_len = *len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    
+    #ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+    #endif
+    
+    nb = recvmsg(fd, &msg, flags);
+    
+    if (nb == 0) {
+    	kmo_seterror("cannot read data: remote side closed connection");
+	return -1;
+    }
+    
+    else if (nb < 0) {
+    	if (errno == EAGAIN) {
+	    return -2;
+	}
+	
+    	kmo_seterror("cannot read data: %s", kmo_sock_err());
+	return -1;
+    }
+    
+    if (msg.msg_controllen > 0 && kmo_sock_queue_recv_fd(fd, &msg)) return -1;
+    
+    *len = nb;
+    return 0;
+}
+
+/* This function returns the oldest descriptor received on the Unix-domain
+ * socket specified and removes it from the queue, or -1 if there is none.
+ */
+int kmo_sock_take_fd(int sock_fd) {
+    int i;
+    
+    for (i = 0; i < kmo_sock_nb_recv_fd; i++) {
+    	if (kmo_sock_recv_fd_array[i].sock_fd == sock_fd) {
+	    int fd = kmo_sock_recv_fd_array[i].fd;
+	    memmove(kmo_sock_recv_fd_array + i, kmo_sock_recv_fd_array + i + 1,
+	    	    (kmo_sock_nb_recv_fd - i - 1) * sizeof(kmo_sock_recv_fd_array[0]));
+	    kmo_sock_nb_recv_fd--;
+	    return fd;
+	}
+    }
+    
+    return -1;
+}
+
+/* Same as kmo_sock_close(), for a Unix-domain socket. The descriptors received
+ * on the socket and not taken yet are closed.
+ */
+void kmo_sock_close_unix(int *fd) {
+    int recv_fd;
+    
+    if (*fd == -1) return;
+    while ((recv_fd = kmo_sock_take_fd(*fd)) != -1) close(recv_fd);
+    kmo_sock_close(fd);
+}
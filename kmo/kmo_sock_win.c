@@ -24,13 +24,13 @@ static void kmo_sock_append_error() {
     LocalFree(sys_msg_buf);
 }
 
-/* This function creates a socket and sets it in 'fd' (which must be initialized
- * to -1).
+/* This function creates a socket of the address family specified and sets it
+ * in 'fd' (which must be initialized to -1).
  * This function sets the KMO error string. It returns -1 on failure.
  */
-int kmo_sock_create(int *fd) {
+int kmo_sock_create_family(int *fd, int family) {
     assert(*fd == -1);
-    int error = socket(AF_INET, SOCK_STREAM, 0);
+    int error = socket(family, SOCK_STREAM, 0);
     
     if (error < 0) {
     	kmo_seterror("cannot create socket");
@@ -183,6 +183,25 @@ int kmo_sock_connect(int fd, char *host, int port) {
     return 0;
 }
 
+/* Same as kmo_sock_connect(), with an address that has already been resolved.
+ * 'host' is used in the error messages. The socket must have been created with
+ * the family of the address.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int kmo_sock_connect_addr(int fd, struct kmo_sock_addr *addr, char *host) {
+    if (connect(fd, &addr->addr.sa, addr->len) < 0) {
+	if (WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK) {
+	    return 0;
+	}
+	
+	kmo_seterror("cannot connect to %s", host);
+    	kmo_sock_append_error();
+    	return -1;
+    }
+    
+    return 0;
+}
+
 /* This function checks if the connection request initiated with
  * kmo_sock_connect() has been completed.
  * This function sets the KMO error string. It returns -1 on failure.
@@ -261,3 +280,36 @@ int kmo_sock_write(int fd, char *buf, uint32_t *len) {
     return 0;
 }
 
+
+/* Same as above, for a vectored write. */
+int kmo_sock_write_iov(int fd, struct kmo_iovec *iov, int count, uint32_t *len) {
+    WSABUF vec[KMO_COMM_MAX_IOV];
+    DWORD nb = 0;
+    int i;
+    
+    assert(count > 0);
+    if (count > KMO_COMM_MAX_IOV) count = KMO_COMM_MAX_IOV;
+    
+    for (i = 0; i < count; i++) {
+    	vec[i].buf = iov[i].buf;
+	vec[i].len = iov[i].len;
+    }
+    
+    if (WSASend(fd, vec, count, &nb, 0, NULL, NULL) == SOCKET_ERROR) {
+    	if (WSAGetLastError() == WSAEWOULDBLOCK) {
+	    return -2;
+	}
+	
+    	kmo_seterror("cannot send data");
+        kmo_sock_append_error();
+	return -1;
+    }
+    
+    if (nb == 0) {
+    	kmo_seterror("cannot send data: remote side closed connection");
+	return -1;
+    }
+    
+    *len = nb;
+    return 0;
+}
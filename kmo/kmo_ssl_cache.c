@@ -0,0 +1,388 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+/* This module caches the SSL sessions negociated with the servers, so that
+ * the next connections to the same server can resume the session with an
+ * abbreviated handshake. The sessions are kept in memory and saved in the
+ * Teambox directory, so that they survive KMOD restarts.
+ */
+
+#include "kmo_ssl_cache.h"
+#include "kbuffer.h"
+#include "utils.h"
+#include "kmod.h"
+
+#ifdef __UNIX__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Magic number of the cache file. */
+#define KMO_SSL_CACHE_MAGIC 	    0x4b534331
+
+/* Maximum size of a serialized session. */
+#define KMO_SSL_CACHE_MAX_SESSION   20000
+
+/* Cached session. */
+struct kmo_ssl_cache_entry {
+
+    /* Identity of the server, i.e. "address:port". */
+    kstr server_id;
+
+    /* Session negociated with the server. */
+    SSL_SESSION *session;
+};
+
+/* Cached sessions, the most recently used last. */
+static karray cache_array;
+
+/* Path to the cache file, empty if the cache is not saved. */
+static kstr cache_path;
+
+/* True if the cache has been opened. */
+static int cache_open_flag = 0;
+
+/* Cache counters. */
+static struct kmo_ssl_cache_stats cache_stats;
+
+/* This function destroys a cache entry. */
+static void kmo_ssl_cache_entry_destroy(struct kmo_ssl_cache_entry *entry) {
+    if (entry == NULL) return;
+    kstr_free(&entry->server_id);
+    if (entry->session) SSL_SESSION_free(entry->session);
+    free(entry);
+}
+
+/* This function returns the position of the entry of the server specified, or
+ * -1 if there is none.
+ */
+static int kmo_ssl_cache_find(char *server_id) {
+    int i;
+
+    for (i = 0; i < cache_array.size; i++) {
+    	struct kmo_ssl_cache_entry *entry = (struct kmo_ssl_cache_entry *) cache_array.data[i];
+	if (kstr_equal_cstr(&entry->server_id, server_id)) return i;
+    }
+
+    return -1;
+}
+
+/* This function removes the entry at the position specified from the cache
+ * and returns it.
+ */
+static struct kmo_ssl_cache_entry * kmo_ssl_cache_take(int pos) {
+    struct kmo_ssl_cache_entry *entry = (struct kmo_ssl_cache_entry *) cache_array.data[pos];
+    memmove(cache_array.data + pos, cache_array.data + pos + 1, (cache_array.size - pos - 1) * sizeof(void *));
+    cache_array.size--;
+    return entry;
+}
+
+/* This function returns true if the session specified has expired. */
+static int kmo_ssl_cache_is_expired(SSL_SESSION *session) {
+    return (time(NULL) >= (time_t) (SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session)));
+}
+
+/* This function adds a session in the cache, evicting the least recently used
+ * session if the cache is full. The cache takes ownership of the session.
+ */
+static void kmo_ssl_cache_add(char *server_id, SSL_SESSION *session) {
+    struct kmo_ssl_cache_entry *entry;
+    int pos = kmo_ssl_cache_find(server_id);
+
+    if (pos != -1) kmo_ssl_cache_entry_destroy(kmo_ssl_cache_take(pos));
+    if (cache_array.size >= KMO_SSL_CACHE_MAX_ENTRY) kmo_ssl_cache_entry_destroy(kmo_ssl_cache_take(0));
+
+    entry = (struct kmo_ssl_cache_entry *) kmo_calloc(sizeof(struct kmo_ssl_cache_entry));
+    kstr_init_cstr(&entry->server_id, server_id);
+    entry->session = session;
+    karray_add(&cache_array, entry);
+}
+
+/* This function loads the cache file, if it exists. Invalid or expired entries
+ * are ignored.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmo_ssl_cache_load() {
+    int error = 0;
+    int size;
+    FILE *file = NULL;
+    kbuffer buf;
+    kstr server_id;
+
+    kbuffer_init(&buf, 0);
+    kstr_init(&server_id);
+
+    /* Try. */
+    do {
+    	uint32_t nb_entry, i;
+
+    	if (! util_check_regular_file_exist(cache_path.data)) break;
+
+    	error = util_open_file(&file, cache_path.data, "rb");
+	if (error) break;
+
+	error = util_get_file_size(file, &size);
+	if (error) break;
+
+	error = util_read_file(file, kbuffer_append_nbytes(&buf, size), size);
+	if (error) break;
+
+	util_close_file(&file, 1);
+
+	if (kbuffer_left(&buf) < 8 || kbuffer_read32(&buf) != KMO_SSL_CACHE_MAGIC) {
+	    kmo_seterror("invalid SSL session cache file");
+	    error = -1;
+	    break;
+	}
+
+	nb_entry = kbuffer_read32(&buf);
+
+	for (i = 0; i < nb_entry && i < KMO_SSL_CACHE_MAX_ENTRY; i++) {
+	    uint32_t len;
+	    const unsigned char *der;
+	    SSL_SESSION *session;
+
+	    /* Read the server identity. */
+	    if (kbuffer_left(&buf) < 4) break;
+	    len = kbuffer_read32(&buf);
+	    if (len > 1000 || kbuffer_left(&buf) < len) break;
+
+	    kstr_grow(&server_id, len);
+	    kbuffer_read(&buf, server_id.data, len);
+	    server_id.data[len] = 0;
+	    server_id.slen = len;
+
+	    /* Read the session. */
+	    if (kbuffer_left(&buf) < 4) break;
+	    len = kbuffer_read32(&buf);
+	    if (len > KMO_SSL_CACHE_MAX_SESSION || kbuffer_left(&buf) < len) break;
+
+	    der = kbuffer_current_pos(&buf);
+	    session = d2i_SSL_SESSION(NULL, &der, len);
+	    kbuffer_seek(&buf, len, SEEK_CUR);
+
+	    if (session == NULL) continue;
+
+	    if (kmo_ssl_cache_is_expired(session)) {
+	    	SSL_SESSION_free(session);
+		continue;
+	    }
+
+	    kmo_ssl_cache_add(server_id.data, session);
+	}
+
+    } while (0);
+
+    util_close_file(&file, 1);
+    kbuffer_clean(&buf);
+    kstr_free(&server_id);
+
+    return error;
+}
+
+/* This function saves the cache in the cache file. The file is written under a
+ * temporary name, then renamed, so that a crash does not corrupt the cache.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmo_ssl_cache_save() {
+    int error = 0;
+    int i;
+    FILE *file = NULL;
+    kbuffer buf;
+    kstr tmp_path;
+
+    if (cache_path.slen == 0) return 0;
+
+    kbuffer_init(&buf, 1024);
+    kstr_init(&tmp_path);
+    kstr_sf(&tmp_path, "%s.tmp", cache_path.data);
+
+    /* Try. */
+    do {
+    	uint32_t nb_entry = 0;
+
+	/* Skip the sessions that cannot be serialized. */
+	for (i = 0; i < cache_array.size; i++) {
+	    struct kmo_ssl_cache_entry *entry = (struct kmo_ssl_cache_entry *) cache_array.data[i];
+	    int len = i2d_SSL_SESSION(entry->session, NULL);
+	    if (len > 0 && len <= KMO_SSL_CACHE_MAX_SESSION) nb_entry++;
+	}
+
+    	kbuffer_write32(&buf, KMO_SSL_CACHE_MAGIC);
+	kbuffer_write32(&buf, nb_entry);
+
+	for (i = 0; i < cache_array.size; i++) {
+	    struct kmo_ssl_cache_entry *entry = (struct kmo_ssl_cache_entry *) cache_array.data[i];
+	    int len = i2d_SSL_SESSION(entry->session, NULL);
+	    unsigned char *der;
+
+	    if (len <= 0 || len > KMO_SSL_CACHE_MAX_SESSION) continue;
+
+	    kbuffer_write32(&buf, entry->server_id.slen);
+	    kbuffer_write(&buf, entry->server_id.data, entry->server_id.slen);
+	    kbuffer_write32(&buf, len);
+
+	    der = kbuffer_append_nbytes(&buf, len);
+	    i2d_SSL_SESSION(entry->session, &der);
+	}
+
+	/* The file contains the session secrets. Keep it private. */
+	#ifdef __UNIX__
+	{
+	    int fd = open(tmp_path.data, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	    if (fd == -1 || (file = fdopen(fd, "wb")) == NULL) {
+	    	kmo_seterror("cannot open %s: %s", tmp_path.data, kmo_syserror());
+		if (fd != -1) close(fd);
+		error = -1;
+		break;
+	    }
+	}
+	#else
+	error = util_open_file(&file, tmp_path.data, "wb");
+	if (error) break;
+	#endif
+
+	error = util_write_file(file, buf.data, buf.len);
+	if (error) break;
+
+	error = util_close_file(&file, 0);
+	if (error) break;
+
+	#ifdef __WINDOWS__
+	if (util_check_regular_file_exist(cache_path.data)) {
+	    error = util_delete_regular_file(cache_path.data);
+	    if (error) break;
+	}
+	#endif
+
+	error = util_rename_file(tmp_path.data, cache_path.data);
+	if (error) break;
+
+    } while (0);
+
+    util_close_file(&file, 1);
+    kbuffer_clean(&buf);
+    kstr_free(&tmp_path);
+
+    return error;
+}
+
+/* This function opens the SSL session cache. The sessions saved in the
+ * directory specified are loaded. If 'dir_path' is NULL, the sessions are only
+ * cached in memory.
+ */
+void kmo_ssl_cache_open(char *dir_path) {
+    kmod_log_msg(3, "kmo_ssl_cache_open() called.\n");
+
+    if (cache_open_flag) kmo_ssl_cache_close();
+
+    karray_init(&cache_array);
+    kstr_init(&cache_path);
+    memset(&cache_stats, 0, sizeof(cache_stats));
+    cache_open_flag = 1;
+
+    if (dir_path == NULL) return;
+
+    kstr_sf(&cache_path, "%s/ssl_session_cache", dir_path);
+
+    /* A bad cache is not fatal. We'll overwrite it. */
+    if (kmo_ssl_cache_load()) {
+    	kmod_log_msg(1, "Cannot load the SSL session cache: %s.\n", kmo_strerror());
+    }
+}
+
+/* This function logs the cache counters and frees the SSL session cache. */
+void kmo_ssl_cache_close() {
+    int i;
+
+    if (! cache_open_flag) return;
+
+    kmod_log_msg(2, "SSL session cache: %u handshakes, %u sessions offered, %u sessions resumed.\n",
+    	    	 cache_stats.nb_handshake, cache_stats.nb_offered, cache_stats.nb_resumed);
+
+    for (i = 0; i < cache_array.size; i++)
+    	kmo_ssl_cache_entry_destroy((struct kmo_ssl_cache_entry *) cache_array.data[i]);
+
+    karray_free(&cache_array);
+    kstr_free(&cache_path);
+    cache_open_flag = 0;
+}
+
+/* This function offers the session cached for the server specified, if any, to
+ * the SSL object specified. It must be called before the handshake.
+ */
+void kmo_ssl_cache_apply(SSL *ssl, char *server_id) {
+    int pos;
+    struct kmo_ssl_cache_entry *entry;
+
+    if (! cache_open_flag) return;
+
+    pos = kmo_ssl_cache_find(server_id);
+    if (pos == -1) return;
+
+    entry = (struct kmo_ssl_cache_entry *) cache_array.data[pos];
+
+    if (kmo_ssl_cache_is_expired(entry->session)) {
+    	kmo_ssl_cache_entry_destroy(kmo_ssl_cache_take(pos));
+	return;
+    }
+
+    if (SSL_set_session(ssl, entry->session) == 1) {
+    	kmod_log_msg(3, "kmo_ssl_cache_apply(): offering cached session to %s.\n", server_id);
+	cache_stats.nb_offered++;
+    }
+}
+
+/* This function remembers the session negociated by the SSL object specified
+ * with the server specified. It must be called after a successful handshake.
+ */
+void kmo_ssl_cache_store(SSL *ssl, char *server_id) {
+    SSL_SESSION *session;
+
+    if (! cache_open_flag) return;
+
+    cache_stats.nb_handshake++;
+
+    /* The cached session was resumed. Mark it as the most recently used. */
+    if (SSL_session_reused(ssl)) {
+    	int pos = kmo_ssl_cache_find(server_id);
+	cache_stats.nb_resumed++;
+
+	if (pos != -1) {
+	    karray_add(&cache_array, kmo_ssl_cache_take(pos));
+	    return;
+	}
+    }
+
+    session = SSL_get1_session(ssl);
+    if (session == NULL) return;
+
+    kmo_ssl_cache_add(server_id, session);
+
+    if (kmo_ssl_cache_save()) {
+    	kmod_log_msg(1, "Cannot save the SSL session cache: %s.\n", kmo_strerror());
+    }
+}
+
+/* This function forgets the session cached for the server specified. It should
+ * be called when a handshake fails, since the cached session may be the cause.
+ */
+void kmo_ssl_cache_remove(char *server_id) {
+    int pos;
+
+    if (! cache_open_flag) return;
+
+    pos = kmo_ssl_cache_find(server_id);
+    if (pos == -1) return;
+
+    kmo_ssl_cache_entry_destroy(kmo_ssl_cache_take(pos));
+
+    if (kmo_ssl_cache_save()) {
+    	kmod_log_msg(1, "Cannot save the SSL session cache: %s.\n", kmo_strerror());
+    }
+}
+
+/* This function returns the counters of the SSL session cache. */
+struct kmo_ssl_cache_stats * kmo_ssl_cache_get_stats() {
+    return &cache_stats;
+}
@@ -0,0 +1,32 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KMO_SSL_CACHE_H
+#define _KMO_SSL_CACHE_H
+
+#include <openssl/ssl.h>
+#include "kmo_base.h"
+
+/* Maximum number of SSL sessions kept in the cache. */
+#define KMO_SSL_CACHE_MAX_ENTRY     32
+
+/* Counters of the SSL session cache. */
+struct kmo_ssl_cache_stats {
+
+    /* Number of handshakes completed. */
+    uint32_t nb_handshake;
+
+    /* Number of handshakes for which a cached session was offered. */
+    uint32_t nb_offered;
+
+    /* Number of handshakes that resumed the offered session. */
+    uint32_t nb_resumed;
+};
+
+void kmo_ssl_cache_open(char *dir_path);
+void kmo_ssl_cache_close();
+void kmo_ssl_cache_apply(SSL *ssl, char *server_id);
+void kmo_ssl_cache_store(SSL *ssl, char *server_id);
+void kmo_ssl_cache_remove(char *server_id);
+struct kmo_ssl_cache_stats * kmo_ssl_cache_get_stats();
+
+#endif
@@ -0,0 +1,207 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+/* This module keeps the SSL contexts used to connect to the servers. A context
+ * is built once per pinned server certificate: the certificate is parsed and
+ * added to the certificate store of the context, and the protocol and
+ * verification settings are applied. The connections then only have to create
+ * their SSL object from the shared context.
+ */
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include "kmo_ssl_ctx.h"
+#include "kmod.h"
+
+/* Registered SSL context. */
+struct kmo_ssl_ctx_entry {
+
+    /* Text of the certificate pinned by the context, empty if the context does
+     * not verify the server.
+     */
+    kstr cert;
+
+    /* SSL context. */
+    SSL_CTX *ctx;
+};
+
+/* Registered contexts. */
+static karray ctx_array;
+
+/* True if the registry has been opened. */
+static int ctx_open_flag = 0;
+
+/* This function destroys a registry entry. */
+static void kmo_ssl_ctx_entry_destroy(struct kmo_ssl_ctx_entry *entry) {
+    if (entry == NULL) return;
+    kstr_free(&entry->cert);
+    if (entry->ctx) SSL_CTX_free(entry->ctx);
+    free(entry);
+}
+
+/* This function adds the certificate specified in the certificate store of the
+ * context specified. The certificate has the format used in the KNP code: no
+ * header or footer, and '|' in place of the newlines.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmo_ssl_ctx_add_cert(SSL_CTX *ctx, char *cert) {
+    int error = 0;
+    int i;
+    BIO *cert_bio = NULL;
+    X509 *cert_obj = NULL;
+    X509_STORE *cert_store = NULL;
+    kstr cert_buf;
+    kstr_init(&cert_buf);
+
+    /* Try. */
+    do {
+	/* Recreate the certificate. */
+	kstr_append_cstr(&cert_buf, "-----BEGIN CERTIFICATE-----\n");
+	kstr_append_cstr(&cert_buf, cert);
+	kstr_append_cstr(&cert_buf, "-----END CERTIFICATE-----\n");
+
+	for (i = 0; i < cert_buf.slen; i++) {
+	    if (cert_buf.data[i] == '|') {
+		cert_buf.data[i] = '\n';
+	    }
+	}
+
+	/* Put the certificate text in a buffer. */
+	cert_bio = BIO_new_mem_buf(cert_buf.data, cert_buf.slen);
+
+	if (cert_bio == NULL) {
+	    kmo_seterror("cannot create SSL BIO for reading SSL certificate");
+	    error = -1;
+	    break;
+	}
+
+	/* Create the certificate object with the buffer data. */
+	cert_obj = PEM_read_bio_X509(cert_bio, NULL, 0, NULL);
+
+	if (cert_obj == NULL) {
+	    kmo_seterror("cannot create SSL certificate");
+	    error = -1;
+	    break;
+	}
+
+	/* Get the certificate store. */
+	cert_store = SSL_CTX_get_cert_store(ctx);
+
+	if (cert_store == NULL) {
+	    kmo_seterror("cannot get SSL certificate store");
+	    error = -1;
+	    break;
+	}
+
+	/* Add the certificate in the store. The store is new, so the
+	 * certificate cannot be there already. We still own cert_obj after
+	 * this call.
+	 */
+	if (X509_STORE_add_cert(cert_store, cert_obj) != 1) {
+	    kmo_seterror("cannot store SSL certificate");
+	    error = -1;
+	    break;
+	}
+
+    } while (0);
+
+    if (cert_obj) X509_free(cert_obj);
+    if (cert_bio) BIO_free(cert_bio);
+    kstr_free(&cert_buf);
+
+    return error;
+}
+
+/* This function creates a SSL context pinning the certificate specified, if
+ * any.
+ * This function sets the KMO error string. It returns NULL on failure.
+ */
+static SSL_CTX * kmo_ssl_ctx_new(char *cert) {
+    SSL_METHOD *ssl_method;
+    SSL_CTX *ctx;
+
+    ssl_method = SSLv3_client_method();
+    if (ssl_method == NULL) {
+    	kmo_seterror("cannot initialize SSL method");
+	return NULL;
+    }
+
+    ctx = SSL_CTX_new(ssl_method);
+    if (ctx == NULL) {
+    	kmo_seterror("cannot initialize SSL context");
+	return NULL;
+    }
+
+    /* If we have a certificate, require the server to send us its certificate
+     * and validate it against ours.
+     */
+    if (cert) {
+    	if (kmo_ssl_ctx_add_cert(ctx, cert)) {
+	    SSL_CTX_free(ctx);
+	    return NULL;
+	}
+
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    }
+
+    else {
+    	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    }
+
+    return ctx;
+}
+
+/* This function opens the SSL context registry. */
+void kmo_ssl_ctx_open() {
+    kmod_log_msg(3, "kmo_ssl_ctx_open() called.\n");
+
+    if (ctx_open_flag) kmo_ssl_ctx_close();
+
+    karray_init(&ctx_array);
+    ctx_open_flag = 1;
+}
+
+/* This function frees the SSL context registry. The SSL objects created from
+ * the contexts keep a reference to their context, so they remain usable.
+ */
+void kmo_ssl_ctx_close() {
+    int i;
+
+    if (! ctx_open_flag) return;
+
+    for (i = 0; i < ctx_array.size; i++)
+    	kmo_ssl_ctx_entry_destroy((struct kmo_ssl_ctx_entry *) ctx_array.data[i]);
+
+    karray_free(&ctx_array);
+    ctx_open_flag = 0;
+}
+
+/* This function returns the SSL context pinning the certificate specified, or
+ * the context that does not verify the server if 'cert' is NULL. The context is
+ * created the first time it is requested. The context is owned by the
+ * registry; the caller must not free it.
+ * This function sets the KMO error string. It returns NULL on failure.
+ */
+SSL_CTX * kmo_ssl_ctx_get(char *cert) {
+    int i;
+    struct kmo_ssl_ctx_entry *entry;
+    SSL_CTX *ctx;
+
+    if (! ctx_open_flag) kmo_ssl_ctx_open();
+
+    for (i = 0; i < ctx_array.size; i++) {
+    	entry = (struct kmo_ssl_ctx_entry *) ctx_array.data[i];
+	if (kstr_equal_cstr(&entry->cert, cert ? cert : "")) return entry->ctx;
+    }
+
+    kmod_log_msg(2, "Creating SSL context (%s).\n", cert ? "pinned certificate" : "no verification");
+
+    ctx = kmo_ssl_ctx_new(cert);
+    if (ctx == NULL) return NULL;
+
+    entry = (struct kmo_ssl_ctx_entry *) kmo_calloc(sizeof(struct kmo_ssl_ctx_entry));
+    kstr_init_cstr(&entry->cert, cert ? cert : "");
+    entry->ctx = ctx;
+    karray_add(&ctx_array, entry);
+
+    return ctx;
+}
@@ -0,0 +1,13 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KMO_SSL_CTX_H
+#define _KMO_SSL_CTX_H
+
+#include <openssl/ssl.h>
+#include "kmo_base.h"
+
+void kmo_ssl_ctx_open();
+void kmo_ssl_ctx_close();
+SSL_CTX * kmo_ssl_ctx_get(char *cert);
+
+#endif
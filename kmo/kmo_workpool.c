@@ -0,0 +1,258 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+/* This module implements the worker pool of KMOD. The works are queued in a
+ * list protected by a mutex. The workers sleep on a condition until a work is
+ * queued, and the thread waiting for a group sleeps on another condition until
+ * a work completes. While the waiting thread has works left in the queue, it
+ * executes them itself rather than sleeping.
+ */
+
+#ifdef __WINDOWS__
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "kmo_workpool.h"
+
+#ifdef __WINDOWS__
+typedef CRITICAL_SECTION kmo_workpool_mutex;
+typedef CONDITION_VARIABLE kmo_workpool_cond;
+#define kmo_workpool_lock(m)	    EnterCriticalSection(m)
+#define kmo_workpool_unlock(m)	    LeaveCriticalSection(m)
+#define kmo_workpool_sleep(c, m)    SleepConditionVariableCS(c, m, INFINITE)
+#define kmo_workpool_signal(c)	    WakeConditionVariable(c)
+#define kmo_workpool_broadcast(c)   WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t kmo_workpool_mutex;
+typedef pthread_cond_t kmo_workpool_cond;
+#define kmo_workpool_lock(m)	    pthread_mutex_lock(m)
+#define kmo_workpool_unlock(m)	    pthread_mutex_unlock(m)
+#define kmo_workpool_sleep(c, m)    pthread_cond_wait(c, m)
+#define kmo_workpool_signal(c)	    pthread_cond_signal(c)
+#define kmo_workpool_broadcast(c)   pthread_cond_broadcast(c)
+#endif
+
+struct kmo_workpool {
+
+    /* Mutex protecting the queue, the groups and 'stop'. */
+    kmo_workpool_mutex mutex;
+
+    /* Condition signaled when a work is queued or the pool is stopped. */
+    kmo_workpool_cond work_cond;
+
+    /* Condition signaled when a work completes. */
+    kmo_workpool_cond done_cond;
+
+    /* Queue of the works not yet started. */
+    struct kmo_work *head;
+    struct kmo_work *tail;
+
+    /* True if the workers must exit. */
+    int stop;
+
+    /* Worker threads. */
+    int nb_thread;
+#ifdef __WINDOWS__
+    HANDLE thread_array[KMO_WORKPOOL_MAX_THREAD];
+#else
+    pthread_t thread_array[KMO_WORKPOOL_MAX_THREAD];
+#endif
+};
+
+/* This function removes the first work of the queue and returns it, or returns
+ * NULL if the queue is empty. The mutex must be held.
+ */
+static struct kmo_work * kmo_workpool_pop(struct kmo_workpool *pool) {
+    struct kmo_work *work = pool->head;
+
+    if (work) {
+    	pool->head = work->next;
+	if (pool->head == NULL) pool->tail = NULL;
+	work->next = NULL;
+    }
+
+    return work;
+}
+
+/* This function executes the work specified and marks it completed. The mutex
+ * must be held; it is released while the work executes.
+ */
+static void kmo_workpool_run(struct kmo_workpool *pool, struct kmo_work *work) {
+    struct kmo_work_group *group = work->group;
+
+    kmo_workpool_unlock(&pool->mutex);
+    work->run(work);
+    kmo_workpool_lock(&pool->mutex);
+
+    group->nb_pending--;
+    if (group->nb_pending == 0) kmo_workpool_broadcast(&pool->done_cond);
+}
+
+/* Worker thread. */
+#ifdef __WINDOWS__
+static DWORD WINAPI kmo_workpool_worker(LPVOID arg) {
+#else
+static void * kmo_workpool_worker(void *arg) {
+#endif
+    struct kmo_workpool *pool = (struct kmo_workpool *) arg;
+
+    /* The error string of this thread. */
+    kmo_error_start();
+
+    kmo_workpool_lock(&pool->mutex);
+
+    while (1) {
+    	struct kmo_work *work = kmo_workpool_pop(pool);
+
+	if (work) {
+	    kmo_workpool_run(pool, work);
+	}
+
+	else if (pool->stop) {
+	    break;
+	}
+
+	else {
+	    kmo_workpool_sleep(&pool->work_cond, &pool->mutex);
+	}
+    }
+
+    kmo_workpool_unlock(&pool->mutex);
+
+    kmo_error_end();
+
+    return 0;
+}
+
+/* This function creates a pool having at most the number of worker threads
+ * specified. If a thread cannot be created, the pool keeps the threads created
+ * so far; without threads, the works are executed synchronously.
+ */
+struct kmo_workpool * kmo_workpool_new(int nb_thread) {
+    struct kmo_workpool *pool = (struct kmo_workpool *) kmo_calloc(sizeof(struct kmo_workpool));
+    int i;
+
+    nb_thread = MIN(nb_thread, KMO_WORKPOOL_MAX_THREAD);
+
+#ifdef __WINDOWS__
+    InitializeCriticalSection(&pool->mutex);
+    InitializeConditionVariable(&pool->work_cond);
+    InitializeConditionVariable(&pool->done_cond);
+#else
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+#endif
+
+    for (i = 0; i < nb_thread; i++) {
+#ifdef __WINDOWS__
+	pool->thread_array[i] = CreateThread(NULL, 0, kmo_workpool_worker, pool, 0, NULL);
+	if (pool->thread_array[i] == NULL) break;
+#else
+	if (pthread_create(&pool->thread_array[i], NULL, kmo_workpool_worker, pool)) break;
+#endif
+	pool->nb_thread++;
+    }
+
+    return pool;
+}
+
+/* This function stops the workers and destroys the pool. No work may be
+ * pending.
+ */
+void kmo_workpool_destroy(struct kmo_workpool *pool) {
+    int i;
+
+    if (pool == NULL) return;
+
+    kmo_workpool_lock(&pool->mutex);
+    assert(pool->head == NULL);
+    pool->stop = 1;
+    kmo_workpool_broadcast(&pool->work_cond);
+    kmo_workpool_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->nb_thread; i++) {
+#ifdef __WINDOWS__
+	WaitForSingleObject(pool->thread_array[i], INFINITE);
+	CloseHandle(pool->thread_array[i]);
+#else
+	pthread_join(pool->thread_array[i], NULL);
+#endif
+    }
+
+#ifdef __WINDOWS__
+    DeleteCriticalSection(&pool->mutex);
+#else
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+#endif
+
+    free(pool);
+}
+
+/* This function returns the number of processors of the host, at least 1. */
+int kmo_workpool_get_nb_cpu() {
+    int nb_cpu;
+#ifdef __WINDOWS__
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    nb_cpu = (int) info.dwNumberOfProcessors;
+#else
+    nb_cpu = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(nb_cpu, 1);
+}
+
+/* This function initializes an empty work group. */
+void kmo_work_group_init(struct kmo_work_group *group) {
+    group->nb_pending = 0;
+}
+
+/* This function queues the work specified in the group specified. */
+void kmo_workpool_submit(struct kmo_workpool *pool, struct kmo_work_group *group, struct kmo_work *work) {
+    work->group = group;
+    work->next = NULL;
+
+    /* Execute the work now. */
+    if (pool == NULL || pool->nb_thread == 0) {
+    	work->run(work);
+	return;
+    }
+
+    kmo_workpool_lock(&pool->mutex);
+
+    group->nb_pending++;
+
+    if (pool->tail) pool->tail->next = work;
+    else pool->head = work;
+    pool->tail = work;
+
+    kmo_workpool_signal(&pool->work_cond);
+    kmo_workpool_unlock(&pool->mutex);
+}
+
+/* This function waits for the works of the group specified to complete. The
+ * works still queued are executed by the caller in the meantime.
+ */
+void kmo_workpool_wait(struct kmo_workpool *pool, struct kmo_work_group *group) {
+    if (pool == NULL || pool->nb_thread == 0) return;
+
+    kmo_workpool_lock(&pool->mutex);
+
+    while (group->nb_pending) {
+    	struct kmo_work *work = kmo_workpool_pop(pool);
+
+	if (work) {
+	    kmo_workpool_run(pool, work);
+	}
+
+	else {
+	    kmo_workpool_sleep(&pool->done_cond, &pool->mutex);
+	}
+    }
+
+    kmo_workpool_unlock(&pool->mutex);
+}
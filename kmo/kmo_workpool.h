@@ -0,0 +1,53 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+#ifndef _KMO_WORKPOOL_H
+#define _KMO_WORKPOOL_H
+
+#include "kmo_base.h"
+
+/* Maximum number of worker threads of a pool. */
+#define KMO_WORKPOOL_MAX_THREAD 8
+
+struct kmo_work_group;
+
+/* Unit of work executed by a pool. The object is owned by the submitter and it
+ * must remain valid until the group it belongs to has been waited for. The
+ * function is called from a worker thread, or from the submitter while it
+ * waits. It must not touch the objects used by the main thread in the
+ * meantime. The KMO error string is private to each thread.
+ */
+struct kmo_work {
+
+    /* Function executing the work. */
+    void (*run)(struct kmo_work *work);
+
+    /* Group of the work. */
+    struct kmo_work_group *group;
+
+    /* Next work in the queue of the pool. */
+    struct kmo_work *next;
+};
+
+/* Set of works waited for together. */
+struct kmo_work_group {
+
+    /* Number of works submitted and not yet completed. */
+    int nb_pending;
+};
+
+/* Bounded pool of worker threads executing CPU-bound works, such as hashing,
+ * in the background. The pool and its groups are used by a single thread; the
+ * works are executed in submission order, but they may complete in any order.
+ * A NULL pool, or a pool without threads, executes the works synchronously
+ * when they are submitted.
+ */
+struct kmo_workpool;
+
+struct kmo_workpool * kmo_workpool_new(int nb_thread);
+void kmo_workpool_destroy(struct kmo_workpool *pool);
+int kmo_workpool_get_nb_cpu();
+void kmo_work_group_init(struct kmo_work_group *group);
+void kmo_workpool_submit(struct kmo_workpool *pool, struct kmo_work_group *group, struct kmo_work *work);
+void kmo_workpool_wait(struct kmo_workpool *pool, struct kmo_work_group *group);
+
+#endif
@@ -50,6 +50,14 @@
 #include "maildb.h"
 #include "utils.h"
 #include "kmod_link.h"
+#include "kmo_ssl_cache.h"
+#include "kmo_ssl_ctx.h"
+#include "karena.h"
+#include "kmo_log.h"
+#include "kmo_workpool.h"
+#include "kmo_stats.h"
+#include "kmo_trace.h"
+#include "kmo_heap.h"
 
 /* K3P version. When this is modified, update the file 'k3p_core_defs.h' as well. */
 #define K3P_VERSION 	            "1.8"
@@ -66,18 +74,105 @@
 /* Default K3P & KNP operation timeout in milliseconds. 0 means no timeout. */
 #define DEFAULT_OPERATION_TIMEOUT       8000
 
+/* Default lifetime of the cached signature keys in seconds. 0 disables the
+ * cache.
+ */
+#define DEFAULT_SIG_KEY_CACHE_TTL	86400
+
+/* Default size above which the incoming K3P strings are written in temporary
+ * files instead of being kept in memory. 0 disables this.
+ */
+#define DEFAULT_K3P_SPILL_THRESHOLD	(8*1024*1024)
+
+/* Maximum number of signature keys kept in memory. */
+#define KMOD_SIG_KEY_CACHE_SIZE		64
+
+/* Maximum number of symmetric keys kept in memory. */
+#define KMOD_SYM_KEY_CACHE_SIZE		64
+
+/* Maximum number of mail statuses kept in memory. It must be well above
+ * MAILDB_BATCH_SIZE.
+ */
+#define KMOD_STATUS_CACHE_SIZE		1000
+
+/* Maximum number of mails evaluated by a KPP_EVAL_INCOMING_BATCH command. */
+#define KMOD_EVAL_BATCH_MAX		100
+
+/* Maximum number of signature keys hinted by a K3P_PREFETCH_SIG_KEYS command,
+ * and number of keys fetched by each batch of IKS queries while the plugin is
+ * idle.
+ */
+#define KMOD_PREFETCH_MAX		100
+#define KMOD_PREFETCH_BATCH		20
+
+/* Mail info fields read from the database for a full evaluation status and
+ * for a string status. The string status needs the integer fields and the
+ * attachment statuses, which tell whether the attachments are intact. The OTUT
+ * string is loaded on demand.
+ */
+#define KMOD_FULL_STATUS_FIELDS		(MAILDB_FIELD_SIG_MSG | MAILDB_FIELD_ATTACHMENT | MAILDB_FIELD_MSG)
+#define KMOD_STRING_STATUS_FIELDS	(MAILDB_FIELD_ATTACHMENT)
+
+/* Size of the chunks read from an attachment file when it is hashed. */
+#define KMOD_ATTACHMENT_CHUNK_SIZE	(64*1024)
+
+/* In group commit mode, delay in milliseconds after which the pending maildb
+ * writes are committed if the plugin stays idle, and maximum number of pending
+ * writes.
+ */
+#define KMOD_GROUP_COMMIT_DELAY		2000
+#define KMOD_GROUP_COMMIT_MAX_SIZE	500
+
+/* The unsigned mails rejected without a full evaluation are written to the
+ * maildb in bulk when the plugin stays idle for KMOD_PLAIN_MAIL_DELAY
+ * milliseconds, or when KMOD_PLAIN_MAIL_MAX_SIZE of them are pending.
+ */
+#define KMOD_PLAIN_MAIL_DELAY		100
+#define KMOD_PLAIN_MAIL_MAX_SIZE	500
+
+/* The maildb maintenance begins after the plugin has been idle for
+ * KMOD_MAINT_IDLE_DELAY milliseconds, and runs in slices of at most
+ * KMOD_MAINT_SLICE milliseconds while the plugin stays idle. A cycle is
+ * performed every KMOD_MAINT_INTERVAL seconds.
+ */
+#define KMOD_MAINT_IDLE_DELAY		5000
+#define KMOD_MAINT_SLICE		10
+#define KMOD_MAINT_INTERVAL		(24*60*60)
+
+/* Maximum size of the trace file before it is truncated. */
+#define KMOD_MAX_TRACE_SIZE	    (1024*1024)
+
 /* Maximum size of the KMOD log before it is truncated. */
 #define KMOD_MAX_KMOD_LOG_SIZE	    100*1024
 
+/* Size of the ring buffer of each log. */
+#define KMOD_LOG_RING_SIZE	    (1024*1024)
+
+/* Maximum number of bytes logged per second in each log. */
+#define KMOD_LOG_MAX_RATE	    (4*1024*1024)
+
+/* Maximum size of each log file. */
+#define KMOD_LOG_MAX_SIZE	    (512*1024*1024)
+
 /* KMOD-KPP connection type:
  * Inherited socket placed in file descriptor 0 (stdin),
  * KMOD connects to KPP.
  * KPP connects to KMOD.
+ * KMOD connects to KPP on a Unix-domain socket.
+ * KPP connects to KMOD on a Unix-domain socket.
  */
 #define KPP_CONN_NONE	    	    0
 #define KPP_CONN_INHERITED  	    1
 #define KPP_CONN_KMOD_CONNECT	    2
 #define KPP_CONN_KPP_CONNECT	    3
+#define KPP_CONN_UNIX_KMOD_CONNECT  4
+#define KPP_CONN_UNIX_KPP_CONNECT   5
+
+/* Size of the send and receive buffers of the Unix-domain sockets used to
+ * communicate with the plugin. The default buffers are small and a large mail
+ * would take many round trips.
+ */
+#define KMOD_UNIX_SOCK_BUF_SIZE	    (1024*1024)
 
 /* Directory used to store KMO files. */
 #ifdef __WINDOWS__
@@ -91,9 +186,9 @@
 
 
 /* Logging globals. */
-FILE *k3p_log = NULL;
-FILE *knp_log = NULL;
-FILE *kmod_log = NULL;
+struct kmo_log *k3p_log = NULL;
+struct kmo_log *knp_log = NULL;
+struct kmo_log *kmod_log = NULL;
 int k3p_log_mode = 0;
 
 /* KMOD logging level:
@@ -102,7 +197,7 @@ int k3p_log_mode = 0;
  * 2: Same as 1, plus important calls.
  * 3: same as 2, with more details.
  */
-static int kmod_log_level = 0;
+int kmod_log_level = 0;
 
 /* True if the logs should be truncated before dealing with a new session. */
 static int kmod_truncate_log_flag = 0;
@@ -110,9 +205,56 @@ static int kmod_truncate_log_flag = 0;
 /* Operation timeout for the K3P and the KNP. */
 static int operation_timeout = DEFAULT_OPERATION_TIMEOUT;
 
+/* Lifetime of the cached signature keys in seconds. */
+static int sig_key_cache_ttl = DEFAULT_SIG_KEY_CACHE_TTL;
+
+/* Size above which the incoming K3P strings are written in temporary files. */
+static int k3p_spill_threshold = DEFAULT_K3P_SPILL_THRESHOLD;
+
+/* Size above which the KNP payloads are compressed. 0 disables this. */
+static int knp_compress_threshold = 0;
+
+/* True if the maildb writes are grouped in periodic commits. */
+static int group_commit_flag = 0;
+
+/* Duration in milliseconds above which the trace of a command is written in
+ * the trace file. 0 disables this.
+ */
+static int trace_threshold = 0;
+
 /* Characters allowed in a file name. */
 static char kmod_allowed_file_char[256];
 
+/* Node of the domain trie. The children of a node are kept in a singly linked
+ * list to keep the nodes small; a domain name only uses a few dozen distinct
+ * characters.
+ */
+struct kmod_domain_node {
+    
+    /* Index of the first child and of the next sibling, or 0 if none. The
+     * root (index 0) is never a child, so 0 is a safe null value.
+     */
+    int child;
+    int sibling;
+    
+    /* Case-folded character leading to this node. */
+    char c;
+    
+    /* True if a domain name ends at this node. */
+    char terminal;
+};
+
+/* Trie of the case-folded domain names of the KPS. It is compiled once when
+ * the user info is obtained so that classifying an address costs a single
+ * scan of the characters following its '@', independently of the number of
+ * domains.
+ */
+struct kmod_domain_trie {
+    struct kmod_domain_node *node_array;
+    int size;
+    int alloc;
+};
+
 
 /* The high-level state of KMOD is kept inside this object. */
 struct kmod_context {
@@ -128,6 +270,12 @@ struct kmod_context {
      */
     int kpp_conn_port;
     
+    /* If the connection method type is KPP_CONN_UNIX_KMOD_CONNECT or
+     * KPP_CONN_UNIX_KPP_CONNECT, this field contains the path to the socket.
+     * By default, this is "kmod.sock" in the Teambox directory.
+     */
+    kstr kpp_conn_path;
+    
     /* KMOD tool info. */
     struct kmod_tool_info tool_info;
    
@@ -140,8 +288,9 @@ struct kmod_context {
     /* Member ID of the user, or 0 if none. */
     uint64_t user_mid;
 
-    /* Array of domain names. */
+    /* Array of domain names, and the trie compiled from it. */
     karray domain_array;
+    struct kmod_domain_trie domain_trie;
     
     /* KPG address and port, if any, when packaging without OTUT. */
     int use_kpg;
@@ -162,6 +311,11 @@ struct kmod_context {
 
     /* Single address to use when contacting online services. */
     kstr all_req_str;
+    
+    /* Path to the file where the statistics are written at the end of each
+     * session, if any.
+     */
+    kstr stats_path;
 
     /* KMOD user mail database. */
     maildb *mail_db;
@@ -178,15 +332,172 @@ struct kmod_context {
     /* Transfer hub. */
     struct kmo_transfer_hub hub;
     
+    /* Pool of the workers hashing the attachments, NULL until the logs are
+     * opened.
+     */
+    struct kmo_workpool *workpool;
+    
+    /* Array of kmod_sig_key_entry objects, the most recently used last. */
+    karray sig_key_cache;
+    
+    /* Array of kmod_sym_key_entry objects, the most recently used last. */
+    karray sym_key_cache;
+    
+    /* Mail statuses cached in memory, indexed by message ID, and list of the
+     * kmod_status_entry objects, the most recently used first.
+     */
+    khash status_cache;
+    struct kmod_status_entry *status_lru_first;
+    struct kmod_status_entry *status_lru_last;
+    
+    /* Arena holding the objects allocated while a K3P command is handled. It
+     * is reset when the command completes.
+     */
+    karena arena;
+    
+    /* Time at which the pending maildb writes were first noticed in group
+     * commit mode. Zero if there are none.
+     */
+    struct timeval group_commit_time;
+    
+    /* Message IDs of the unsigned mails rejected by kmod_eval_incoming() that
+     * have not been written to the maildb yet.
+     */
+    karray plain_mail_array;
+    
+    /* Member IDs whose signature keys were hinted by the plugin and have not
+     * been fetched yet, the first to fetch first.
+     */
+    int64_t prefetch_mid_array[KMOD_PREFETCH_MAX];
+    int prefetch_mid_size;
+    
+    /* Time at which the next maildb maintenance cycle may begin, from
+     * kmo_stats_now(), and true if a cycle is in progress.
+     */
+    uint64_t maint_time;
+    int maint_flag;
+    
     /* Initialized scratch string. */
     kstr str;
 };
 
+/* Signature key cached in memory. */
+struct kmod_sig_key_entry {
+    
+    /* Key data, as stored in the database. */
+    maildb_sig_key_info info;
+    
+    /* Parsed signature key. */
+    struct kmocrypt_signed_pkey *key_obj;
+};
+
+/* Symmetric key of an encrypted mail cached in memory. */
+struct kmod_sym_key_entry {
+    
+    /* KSN and hash of the mail. */
+    kstr ksn;
+    kstr hash;
+    
+    /* Decrypted symmetric key data. */
+    kstr key_data;
+    
+    /* Parsed symmetric key. */
+    kmocrypt_symkey *key_obj;
+};
+
+/* Status of a mail cached in memory, as returned by KPP_GET_EVAL_STATUS and
+ * KPP_GET_STRING_STATUS.
+ */
+struct kmod_status_entry {
+    
+    /* Mail info and sender info, as read from the database. The message ID is
+     * stored in the mail info.
+     */
+    maildb_mail_info mail_info;
+    maildb_sender_info sender_info;
+    
+    /* Neighbors in the list of the entries, the most recently used first. */
+    struct kmod_status_entry *prev;
+    struct kmod_status_entry *next;
+};
+
+static void kmod_sig_key_cache_flush(struct kmod_context *kc);
+static void kmod_sym_key_cache_flush(struct kmod_context *kc);
+static void kmod_status_cache_flush(struct kmod_context *kc);
+static void kmod_flush_plain_mail(struct kmod_context *kc);
+
+/* This function frees the nodes of the domain trie. */
+static void kmod_trie_free(struct kmod_domain_trie *trie) {
+    free(trie->node_array);
+    memset(trie, 0, sizeof(*trie));
+}
+
+/* This function appends a node to the domain trie and returns its index. */
+static int kmod_trie_new_node(struct kmod_domain_trie *trie, char c) {
+    struct kmod_domain_node *node;
+    
+    if (trie->size == trie->alloc) {
+    	trie->alloc = trie->alloc ? trie->alloc * 2 : 64;
+	trie->node_array = (struct kmod_domain_node *)
+	    kmo_realloc(trie->node_array, trie->alloc * sizeof(struct kmod_domain_node));
+    }
+    
+    node = &trie->node_array[trie->size];
+    node->child = 0;
+    node->sibling = 0;
+    node->c = c;
+    node->terminal = 0;
+    return trie->size++;
+}
+
+/* This function returns the index of the child of the node specified that is
+ * reached with the character specified, or 0 if there is none.
+ */
+static inline int kmod_trie_find_child(struct kmod_domain_trie *trie, int index, char c) {
+    index = trie->node_array[index].child;
+    
+    while (index != 0 && trie->node_array[index].c != c) {
+    	index = trie->node_array[index].sibling;
+    }
+    
+    return index;
+}
+
+/* This function compiles the domain names of the KPS into the domain trie. */
+static void kmod_compile_domain_trie(struct kmod_context *kc) {
+    struct kmod_domain_trie *trie = &kc->domain_trie;
+    int i, j;
+    
+    trie->size = 0;
+    kmod_trie_new_node(trie, 0);
+    
+    for (i = 0; i < kc->domain_array.size; i++) {
+	kstr *domain_name = (kstr *) kc->domain_array.data[i];
+	int index = 0;
+	
+	for (j = 0; j < domain_name->slen; j++) {
+	    char c = tolower(domain_name->data[j]);
+	    int child = kmod_trie_find_child(trie, index, c);
+	    
+	    if (child == 0) {
+	    	child = kmod_trie_new_node(trie, c);
+		trie->node_array[child].sibling = trie->node_array[index].child;
+		trie->node_array[index].child = child;
+	    }
+	    
+	    index = child;
+	}
+	
+	trie->node_array[index].terminal = 1;
+    }
+}
+
 /* This function initializes the KMOD context. */
 static void kmod_context_init(struct kmod_context *kc) {
     memset(kc, 0, sizeof(struct kmod_context));
     kc->kpp_conn_type = KPP_CONN_NONE;
     kc->kpp_conn_port = K3P_SOCKET_PORT;
+    kstr_init(&kc->kpp_conn_path);
     k3p_init_tool_info(&kc->tool_info);
     kstr_assign_cstr(&kc->tool_info.sig_marker, KRYPTIVA_BODY_START);
     kstr_assign_cstr(&kc->tool_info.kmod_version, KMOD_VERSION);
@@ -194,12 +505,14 @@ static void kmod_context_init(struct kmod_context *kc) {
     k3p_init_mua(&kc->mua);
     k3p_init_server_info(&kc->server_info);
     karray_init(&kc->domain_array);
+    memset(&kc->domain_trie, 0, sizeof(kc->domain_trie));
     kstr_init(&kc->kpg_addr);
     kstr_init(&kc->teambox_dir_path);
     kstr_init(&kc->kryptiva_db_path);
     kstr_init(&kc->log_date);
     kstr_init(&kc->enc_key_lookup_str);
     kstr_init(&kc->all_req_str);
+    kstr_init(&kc->stats_path);
     k3p_proto_init(&kc->k3p);
     kc->k3p.transfer.driver = kmo_sock_driver;
     kc->k3p.hub = &kc->hub;
@@ -207,7 +520,15 @@ static void kmod_context_init(struct kmod_context *kc) {
     kc->knp.server_info = &kc->server_info;
     kc->knp.use_kpg = 0;
     kstr_init(&kc->knp.kpg_addr);
+    knp_pool_init(&kc->knp);
+    knp_health_init(&kc->knp);
+    kmo_resolver_init(&kc->knp.resolver);
     kmo_transfer_hub_init(&kc->hub);
+    karray_init(&kc->sig_key_cache);
+    karray_init(&kc->sym_key_cache);
+    khash_init_func(&kc->status_cache, khash_kstr_key, khash_kstr_cmp);
+    karray_init(&kc->plain_mail_array);
+    karena_init(&kc->arena, 0);
     kstr_init(&kc->str);
 }
 
@@ -218,16 +539,36 @@ static void kmod_context_free(struct kmod_context *kc) {
     k3p_free_server_info(&kc->server_info);
     kmo_clear_kstr_array(&kc->domain_array);
     karray_free(&kc->domain_array);
+    kmod_trie_free(&kc->domain_trie);
     kstr_free(&kc->kpg_addr);
     kstr_free(&kc->teambox_dir_path);
+    kstr_free(&kc->kpp_conn_path);
     kstr_free(&kc->kryptiva_db_path);
     kstr_free(&kc->log_date);
     kstr_free(&kc->enc_key_lookup_str);
     kstr_free(&kc->all_req_str);
-    if (kc->mail_db) maildb_destroy(kc->mail_db);
+    kstr_free(&kc->stats_path);
+    
+    if (kc->mail_db) {
+    	kmod_flush_plain_mail(kc);
+	maildb_destroy(kc->mail_db);
+    }
+    
+    kmo_clear_kstr_array(&kc->plain_mail_array);
+    karray_free(&kc->plain_mail_array);
     k3p_proto_free(&kc->k3p);
     kstr_free(&kc->knp.kpg_addr);
+    knp_pool_free(&kc->knp);
+    knp_health_free(&kc->knp);
+    kmo_resolver_free(&kc->knp.resolver);
     kmo_transfer_hub_free(&kc->hub);
+    kmod_sig_key_cache_flush(kc);
+    karray_free(&kc->sig_key_cache);
+    kmod_sym_key_cache_flush(kc);
+    karray_free(&kc->sym_key_cache);
+    kmod_status_cache_flush(kc);
+    khash_free(&kc->status_cache);
+    karena_free(&kc->arena);
     kstr_free(&kc->str);
 }
 
@@ -244,10 +585,24 @@ void kmod_log_msg(int level, const char *format, ...) {
     if (level > kmod_log_level || kmod_log == NULL) return;
     
     va_start(arg, format);
-    vfprintf(kmod_log, format, arg);
+    kmo_log_vprintf(kmod_log, format, arg);
     va_end(arg);
 }
 
+#ifdef BODY_CHANGED_DEBUG
+/* This function dumps a body in the KMOD log. */
+static void kmod_dump_body(const char *title, kstr *body) {
+    FILE *file;
+    if (kmod_log == NULL) return;
+    
+    file = kmo_log_hold(kmod_log);
+    fprintf(file, "%s:\n", title);
+    util_dump_buf_ascii(body->data, body->slen, file);
+    fprintf(file, "END END END.\n\n");
+    kmo_log_release(kmod_log);
+}
+#endif
+
 /* This function tries to delete the logs having the date specified. */
 static void kmod_delete_log(struct kmod_context *kc, kstr *date) {
    kstr_sf(&kc->str, "%s/kmod_logs/%s_k3p.log", kc->teambox_dir_path.data, date->data);
@@ -263,25 +618,31 @@ static void kmod_delete_log(struct kmod_context *kc, kstr *date) {
    if (util_check_regular_file_exist(kc->str.data)) util_delete_regular_file(kc->str.data);
 }
 
+/* This function writes the messages buffered in the logs to the files. It is
+ * called by kmo_fatalerror(), since the process then exits without closing the
+ * logs.
+ */
+static void kmod_flush_logs() {
+    kmo_log_flush(k3p_log);
+    kmo_log_flush(knp_log);
+    kmo_log_flush(kmod_log);
+}
+
 /* This function closes the logs, if they are open. The OPEN_LOG file is
  * deleted, if it exists. No error checking is performed.
  */
 static void kmod_close_log(struct kmod_context *kc) {
     
-    if (k3p_log) {
-    	fclose(k3p_log);
-    	k3p_log = NULL;
-    }
+    kmo_set_fatal_hook(NULL);
+    
+    kmo_log_close(k3p_log);
+    k3p_log = NULL;
 
-    if (knp_log) {
-    	fclose(knp_log);
-    	knp_log = NULL;
-    }
+    kmo_log_close(knp_log);
+    knp_log = NULL;
     
-    if (kmod_log) {
-    	fclose(kmod_log);
-    	kmod_log = NULL;
-    }
+    kmo_log_close(kmod_log);
+    kmod_log = NULL;
     
     if (kc->log_date.slen > 0) {
     	kstr_sf(&kc->str, "%s/kmod_logs/%s_OPEN_LOG", kc->teambox_dir_path.data, kc->log_date.data);
@@ -289,26 +650,47 @@ static void kmod_close_log(struct kmod_context *kc) {
     }
 }
 
-/* Sort function for kmod_open_log(). */
+/* Sort function for kmod_clean_logs(). */
 static int kmod_open_log_sort(const void *key_1, const void *key_2) {
     kstr **str_1 = (kstr **) key_1;
     kstr **str_2 = (kstr **) key_2;
     return strcmp((**str_1).data, (**str_2).data);
 }
 
+/* This function opens the log file whose path is in kc->str and starts its
+ * flusher. The flusher flushes the file after each batch of messages, so the
+ * file does not need to be unbuffered.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_open_log_file(struct kmod_context *kc, struct kmo_log **log, int payload_mode) {
+    FILE *file = fopen(kc->str.data, "wb");
+    
+    if (file == NULL) {
+	kmo_seterror("cannot open '%s': %s", kc->str.data, kmo_syserror());
+	return -1;
+    }
+    
+    *log = kmo_log_open(file, KMOD_LOG_RING_SIZE, KMOD_LOG_MAX_RATE, KMOD_LOG_MAX_SIZE, payload_mode);
+    
+    if (*log == NULL) {
+    	fclose(file);
+	return -1;
+    }
+    
+    return 0;
+}
+
 /* This function should be called to open the logs at startup, if required.
+ * The old logs are removed later by kmod_clean_logs(), since listing the log
+ * directory is slow.
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int kmod_open_log(struct kmod_context *kc) {
     int error = 0;
-    int i;
-    karray log_file_array;
-    karray clean_date_array;
-    karray error_date_array;
-    khash date_hash;
     time_t now;
     struct tm *tm;
     FILE *open_log_file = NULL;
+    int payload_mode = KMO_LOG_PAYLOAD_FULL;
     
     /* If the file 'debug' exists in the teambox directory, set the logging
      * level to 3 and disable log truncation.
@@ -323,10 +705,11 @@ static int kmod_open_log(struct kmod_context *kc) {
     
     if (! kmod_log_level) return 0;
     
-    karray_init(&log_file_array);
-    karray_init(&clean_date_array);
-    karray_init(&error_date_array);
-    khash_init_func(&date_hash, khash_kstr_key, khash_kstr_cmp);
+    /* If the file 'debug_digest' exists in the teambox directory, log the
+     * length and digest of the K3P and KNP payloads instead of the payloads.
+     */
+    kstr_sf(&kc->str, "%s/debug_digest", kc->teambox_dir_path.data);
+    if (util_check_regular_file_exist(kc->str.data)) payload_mode = KMO_LOG_PAYLOAD_DIGEST;
     
     /* Get the current date for the logs. */
     now = time(NULL);
@@ -337,91 +720,18 @@ static int kmod_open_log(struct kmod_context *kc) {
 						               tm->tm_hour, tm->tm_min, tm->tm_sec);
     /* Try. */
     do {
-    	/* Obtain the list of the log files in the KMOD log directory. */
-    	kstr_sf(&kc->str, "%s/kmod_logs/", kc->teambox_dir_path.data);
-	error = util_list_dir(kc->str.data, &log_file_array);
-    	if (error) break;
-	
-	/* Sort the logs in two categories: cleanly closed logs and incorrectly
-	 * closed logs.
-	 */
-	for (i = 0; i < log_file_array.size; i++) {
-	    kstr *log_file = (kstr *) log_file_array.data[i];
-	    
-	    /* No regexp support is a pain...it's apparently a valid date. */
-	    if (log_file->slen > 22 && ! strncmp(log_file->data + 10, "_at_", 4)) {
-		kstr_assign_buf(&kc->str, log_file->data, 22);
-		
-		/* It's the first time we saw this date. */
-		if (! khash_exist(&date_hash, &kc->str)) {
-		    
-		    /* Add the date in the hash. */
-		    kstr *date = kstr_new();
-		    kstr_assign_kstr(date, &kc->str);
-		    khash_add(&date_hash, date, date);
-		    
-		    /* Check if the logs for this date have been closed correctly. */
-		    kstr_sf(&kc->str, "%s/kmod_logs/%s_OPEN_LOG", kc->teambox_dir_path.data, date->data);
-		    
-		    /* Error logs. */
-		    if (util_check_regular_file_exist(kc->str.data)) {
-		    	karray_add(&error_date_array, date);
-		    }
-		    
-		    /* Clean logs. */
-		    else {
-		    	karray_add(&clean_date_array, date);
-		    }
-		}
-	    }
-	}
-	
-	qsort(clean_date_array.data, clean_date_array.size, sizeof(void *), kmod_open_log_sort);
-	qsort(error_date_array.data, error_date_array.size, sizeof(void *), kmod_open_log_sort);
-	
-	/* Keep at most 20 clean logs and 10 error logs. */
-	for (i = 0; i < clean_date_array.size - 20; i++) {
-	    kmod_delete_log(kc, (kstr *) clean_date_array.data[i]);
-	}
-	
-	for (i = 0; i < error_date_array.size - 10; i++) {
-	    kmod_delete_log(kc, (kstr *) error_date_array.data[i]);
-	}
-	
 	/* Open the logs. */
 	kstr_sf(&kc->str, "%s/kmod_logs/%s_k3p.log", kc->teambox_dir_path.data, kc->log_date.data);
-	k3p_log = fopen(kc->str.data, "wb"); 
-	if (k3p_log == NULL) {
-	    kmo_seterror("cannot open '%s': %s", kc->str.data, kmo_syserror());
-	    error = -1;
-	    break;
-	}
+	error = kmod_open_log_file(kc, &k3p_log, payload_mode);
+	if (error) break;
 	
 	kstr_sf(&kc->str, "%s/kmod_logs/%s_knp.log", kc->teambox_dir_path.data, kc->log_date.data);
-	knp_log = fopen(kc->str.data, "wb"); 
-	if (knp_log == NULL) {
-	    kmo_seterror("cannot open '%s': %s", kc->str.data, kmo_syserror());
-	    error = -1;
-	    break;
-	}
+	error = kmod_open_log_file(kc, &knp_log, payload_mode);
+	if (error) break;
 	
     	kstr_sf(&kc->str, "%s/kmod_logs/%s_kmod.log", kc->teambox_dir_path.data, kc->log_date.data);
-	kmod_log = fopen(kc->str.data, "wb"); 
-	if (kmod_log == NULL) {
-	    kmo_seterror("cannot open '%s': %s", kc->str.data, kmo_syserror());
-	    error = -1;
-	    break;
-	}
-	
-	/* Make the logs unbuffered. */
-	if (setvbuf(kmod_log, NULL, _IONBF, 0) ||
-	    setvbuf(k3p_log, NULL, _IONBF, 0) || 
-	    setvbuf(knp_log, NULL, _IONBF, 0)) {
-	    
-	    kmo_seterror("failed to make logs unbuffered");
-	    error = -1;
-	    break;
-    	}
+	error = kmod_open_log_file(kc, &kmod_log, KMO_LOG_PAYLOAD_FULL);
+	if (error) break;
 	
 	/* Create the OPEN_LOG file. */
 	kstr_sf(&kc->str, "%s/kmod_logs/%s_OPEN_LOG", kc->teambox_dir_path.data, kc->log_date.data);
@@ -441,10 +751,88 @@ static int kmod_open_log(struct kmod_context *kc) {
     }
     
     else {
+    	kmo_set_fatal_hook(kmod_flush_logs);
     	kmod_log_msg(1, "Logs opened: level=%d, truncate=%d. KMOD version %s build %s.\n",
 		     kmod_log_level, kmod_truncate_log_flag, K3P_VERSION, BUILD_ID);
     }
     
+    return error;
+}
+
+/* This function removes the old logs, keeping at most 20 clean logs and 10
+ * error logs besides the logs of the current session. It is called once the
+ * plugin is connected. No error checking is performed.
+ */
+static void kmod_clean_logs(struct kmod_context *kc) {
+    int i;
+    karray log_file_array;
+    karray clean_date_array;
+    karray error_date_array;
+    khash date_hash;
+    
+    if (! kmod_log_level) return;
+    
+    karray_init(&log_file_array);
+    karray_init(&clean_date_array);
+    karray_init(&error_date_array);
+    khash_init_func(&date_hash, khash_kstr_key, khash_kstr_cmp);
+    
+    /* Obtain the list of the log files in the KMOD log directory. */
+    kstr_sf(&kc->str, "%s/kmod_logs/", kc->teambox_dir_path.data);
+    
+    if (util_list_dir(kc->str.data, &log_file_array)) {
+    	kmod_log_msg(1, "Cannot list the logs: %s.\n", kmo_strerror());
+    }
+    
+    /* Sort the logs in two categories: cleanly closed logs and incorrectly
+     * closed logs.
+     */
+    for (i = 0; i < log_file_array.size; i++) {
+	kstr *log_file = (kstr *) log_file_array.data[i];
+
+	/* No regexp support is a pain...it's apparently a valid date. */
+	if (log_file->slen > 22 && ! strncmp(log_file->data + 10, "_at_", 4)) {
+	    kstr_assign_buf(&kc->str, log_file->data, 22);
+	    
+	    /* Skip the logs of the current session. */
+	    if (kstr_equal_kstr(&kc->str, &kc->log_date)) continue;
+
+	    /* It's the first time we saw this date. */
+	    if (! khash_exist(&date_hash, &kc->str)) {
+
+		/* Add the date in the hash. */
+		kstr *date = kstr_new();
+		kstr_assign_kstr(date, &kc->str);
+		khash_add(&date_hash, date, date);
+
+		/* Check if the logs for this date have been closed correctly. */
+		kstr_sf(&kc->str, "%s/kmod_logs/%s_OPEN_LOG", kc->teambox_dir_path.data, date->data);
+
+		/* Error logs. */
+		if (util_check_regular_file_exist(kc->str.data)) {
+		    karray_add(&error_date_array, date);
+		}
+
+		/* Clean logs. */
+		else {
+		    karray_add(&clean_date_array, date);
+		}
+	    }
+	}
+    }
+
+    qsort(clean_date_array.data, clean_date_array.size, sizeof(void *), kmod_open_log_sort);
+    qsort(error_date_array.data, error_date_array.size, sizeof(void *), kmod_open_log_sort);
+
+    /* Keep at most 20 clean logs and 10 error logs. */
+    for (i = 0; i < clean_date_array.size - 20; i++) {
+	kmod_delete_log(kc, (kstr *) clean_date_array.data[i]);
+    }
+
+    for (i = 0; i < error_date_array.size - 10; i++) {
+	kmod_delete_log(kc, (kstr *) error_date_array.data[i]);
+    }
+    
     kmo_clear_kstr_array(&log_file_array);
     karray_free(&log_file_array);
     
@@ -455,7 +843,15 @@ static int kmod_open_log(struct kmod_context *kc) {
     karray_free(&error_date_array);
     
     khash_free(&date_hash);
-    
+}
+
+/* This function truncates the log file of the log specified.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_truncate_log_file(struct kmo_log *log) {
+    int error = util_truncate_file(kmo_log_hold(log));
+    if (! error) kmo_log_reset_size(log);
+    kmo_log_release(log);
     return error;
 }
 
@@ -463,18 +859,27 @@ static int kmod_open_log(struct kmod_context *kc) {
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int kmod_truncate_log() {
+    int error = 0;
     k3p_log_mode = 0;
     
     if (kmod_log) {
     	int log_size;
-	if (util_get_file_pos(kmod_log, &log_size)) return -1;
-	if (log_size > KMOD_MAX_KMOD_LOG_SIZE && util_truncate_file(kmod_log)) return -1;
+	FILE *file = kmo_log_hold(kmod_log);
+	error = util_get_file_pos(file, &log_size);
+	
+	if (! error && log_size > KMOD_MAX_KMOD_LOG_SIZE) {
+	    error = util_truncate_file(file);
+	    if (! error) kmo_log_reset_size(kmod_log);
+	}
+	
+	kmo_log_release(kmod_log);
+	if (error) return -1;
     }
     
     kmod_log_msg(2, "kmod_truncate_log() called.\n");
     
-    if (k3p_log && util_truncate_file(k3p_log)) return -1;
-    if (knp_log && util_truncate_file(knp_log)) return -1;
+    if (k3p_log && kmod_truncate_log_file(k3p_log)) return -1;
+    if (knp_log && kmod_truncate_log_file(knp_log)) return -1;
     
     return 0;
 }
@@ -602,6 +1007,13 @@ static int kmod_sig_get_ksn(struct kmod_crypt_sig *self, char **ksn, size_t *len
     	return kmocrypt_signature_get_ksn2(self->obj2, ksn, len);
 }
 
+static int kmod_sig_get_hash_algo(struct kmod_crypt_sig *self) {
+    if (self->major == 1)
+    	return self->obj1->hash_algo;
+    else
+    	return self->obj2->hash_algo;
+}
+
 static uint64_t kmod_sig_get_mid(struct kmod_crypt_sig *self) {
     if (self->major == 1)
     	return self->obj1->keyid;
@@ -617,10 +1029,18 @@ static int kmod_sig_has_symkey_for(struct kmod_crypt_sig *self, uint64_t mid) {
 }
 
 static int kmod_sig_validate(struct kmod_crypt_sig *self, kmocrypt_pkey *key) {
+    int error;
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_CRYPT);
+    
     if (self->major == 1)
-    	return kmocrypt_signature_validate(self->obj1, key);
+    	error = kmocrypt_signature_validate(self->obj1, key);
     else
-    	return kmocrypt_signature_validate2(self->obj2, key);
+    	error = kmocrypt_signature_validate2(self->obj2, key);
+    
+    kmo_heap_set_tag(tag);
+    kmo_trace_span("crypt.validate", start);
+    return error;
 }
 
 static int kmod_sig_contain(struct kmod_crypt_sig *self, int type) {
@@ -636,29 +1056,30 @@ static int kmod_is_exchange_addr(char *addr) {
 }
 
 /* This function returns true if the address specified should be queried by the
- * KPS to determine if it is the address of a member.
+ * KPS to determine if it is the address of a member, i.e. if "@<domain>" occurs
+ * in the address (ignoring case) for one of the domains of the KPS.
  */
 static int kmod_is_addr_of_kps_domain(char *addr, struct kmod_context *kc) {
-    int i, ret = 0;
-    kstr str;
-    kstr_init(&str);
+    struct kmod_domain_trie *trie = &kc->domain_trie;
     
-    /* Check the domain names. */
-    for (i = 0; i < kc->domain_array.size; i++) {
-	kstr *domain_name = (kstr *) kc->domain_array.data[i];
-	kstr_assign_cstr(&str, "@");
-	kstr_append_kstr(&str, domain_name);
-	char *domain_loc = portable_strcasestr(addr, str.data);
+    if (trie->size == 0) return 0;
+    
+    for (; (addr = strchr(addr, '@')) != NULL; addr++) {
+    	int index = 0;
+    	char *p;
 	
-	/* The address belongs to one of the domains of the KPS. */
-	if (domain_loc != NULL) {
-	    ret = 1;
-	    break;
+	if (trie->node_array[0].terminal) return 1;
+	
+	for (p = addr + 1; *p; p++) {
+	    index = kmod_trie_find_child(trie, index, tolower(*p));
+	    if (index == 0) break;
+	    
+	    /* The address belongs to one of the domains of the KPS. */
+	    if (trie->node_array[index].terminal) return 1;
 	}
     }
     
-    kstr_free(&str);
-    return ret;
+    return 0;
 }
 
 /* This function enables the KPG in the KNP. */
@@ -692,6 +1113,7 @@ static int kmod_is_otut_set(struct kmod_otut *otut) {
 static void kmod_flush_user_info(struct kmod_context *kc) {
     kc->user_mid = 0;
     kmo_clear_kstr_array(&kc->domain_array);
+    kc->domain_trie.size = 0;
     kc->use_kpg = 0;
 }
 
@@ -887,77 +1309,76 @@ static void kmod_trim_whitespace(kstr *str) {
     str->data[new_len] = 0;
 }
 
-/* This function cleans up the TO/CC field passed by the plugin to be signed. So
- * far this function fixes the Outlook bogus single quotes damage.
+/* This function cleans up the TO/CC field passed by the plugin to be signed.
+ * The cleaned up field is written in 'dst' in a single pass over 'src'; it is
+ * also converted to lowercase if 'lower_flag' is true. So far this function
+ * fixes the Outlook bogus single quotes damage.
  */
-static void kmod_cleanup_signable_to_cc(kstr *field) {
-    int read_pos = 0;
-    int write_pos = 0;
+static void kmod_cleanup_signable_to_cc(kstr *dst, kstr *src, int lower_flag) {
+    char *in = src->data;
+    char *end = src->data + src->slen;
+    char *out;
     
     kmod_log_msg(2, "kmod_cleanup_signable_to_cc() called.\n");
     
+    kstr_grow(dst, src->slen);
+    out = dst->data;
+    
     /* We want to remove leading and trailing single quotes in the display name
      * parts.
      */
-    while (1) {
+    while (in < end) {
     	char *first_double_quote;
 	char *second_double_quote;
+	char *name_end;
 	
-	/* Scan until '"' is found. */
-	while (read_pos < field->slen && field->data[read_pos] != '"') {
-	    field->data[write_pos++] = field->data[read_pos++];
+	/* Copy until '"' is found. */
+	if (*in != '"') {
+	    *out++ = lower_flag ? tolower(*in) : *in;
+	    in++;
+	    continue;
 	}
 	
-	/* End of string. */
-	if (read_pos == field->slen) break;
-	
 	/* We got '"'. This is necessarily a character introducing the TO/CC
 	 * name. Find the ending '"'. There cannot be another double quote in
 	 * the name as per the spec.
 	 */
-	assert(field->data[read_pos] == '"');
-	first_double_quote = field->data + read_pos;
-	read_pos++;
-	
-	while (read_pos < field->slen && field->data[read_pos] != '"') {
-	    read_pos++;
-	}
+	first_double_quote = in;
+	second_double_quote = memchr(in + 1, '"', end - in - 1);
 	
 	/* End of string. This is unexpected. */
-	if (read_pos == field->slen) {
+	if (second_double_quote == NULL) {
 	    kmod_log_msg(1, "kmod_cleanup_signable_to_cc(): plugin error: no matching '\"' found in name.\n");
 	    break;
 	}
 	
-	/* We got the second '"'. Record its position and skip it. */
-	assert(field->data[read_pos] == '"');
-	second_double_quote = field->data + read_pos;
-	read_pos++;
-	
-	/* Write '"'. */
-	field->data[write_pos++] = '"';
-	
 	/* We have "'...'". Only copy the stuff inside the single quotes. */
 	if (second_double_quote - first_double_quote >= 3 &&
 	    first_double_quote[1] == '\'' && second_double_quote[-1] == '\'') {
-	    
-	    memmove(field->data + write_pos, first_double_quote + 2, second_double_quote - first_double_quote - 3);
-	    write_pos += second_double_quote - first_double_quote - 3;
+	    in = first_double_quote + 2;
+	    name_end = second_double_quote - 1;
 	}
 	
 	/* It's something else, copy all the stuff. */
 	else {
-	    memmove(field->data + write_pos, first_double_quote + 1, second_double_quote - first_double_quote - 1);
-	    write_pos += second_double_quote - first_double_quote - 1;
+	    in = first_double_quote + 1;
+	    name_end = second_double_quote;
+	}
+	
+	/* Write '"', the name and '"'. */
+	*out++ = '"';
+	
+	for (; in < name_end; in++) {
+	    *out++ = lower_flag ? tolower(*in) : *in;
 	}
 	
-	/* Write '"'. */
-	field->data[write_pos++] = '"';
+	*out++ = '"';
+	in = second_double_quote + 1;
     }
     
     /* Null terminate the string and set its length. */
-    field->data[write_pos] = 0;
-    field->slen = write_pos;
+    *out = 0;
+    dst->slen = out - dst->data;
 }
 
 /* This function returns true if the name specified is a valid name for an
@@ -991,9 +1412,12 @@ static int kmod_is_valid_attachment_name(kstr *name) {
 /* This function fetches an array of attachments from the plugin. If silent_flag
  * is true, attachments in error are marked as such and all attachments are
  * read (best effort). Otherwise, the function aborts as soon as an error occurs.
+ * If read_flag is false, the attachment files are only checked here. Their
+ * data is read on demand by kmod_hash_attachment().
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int kmod_fetch_attachment(struct kmod_mail *orig_mail, karray *att_array, int silent_flag) {
+static int kmod_fetch_attachment(karena *arena, struct kmod_mail *orig_mail, karray *att_array,
+    	    	    	    	 int silent_flag, int read_flag) {
     int error = 0;
     int i;
     
@@ -1004,7 +1428,7 @@ static int kmod_fetch_attachment(struct kmod_mail *orig_mail, karray *att_array,
     /* Fetch the attachments. */
     for (i = 0; i < orig_mail->attachments.size; i++) {
     	struct kmod_mail_attachment *mail_att = (struct kmod_mail_attachment *) orig_mail->attachments.data[i];
-    	struct kmod_attachment *att = (struct kmod_attachment *) kmo_calloc(sizeof(struct kmod_attachment));
+    	struct kmod_attachment *att = (struct kmod_attachment *) karena_calloc(arena, sizeof(struct kmod_attachment));
 	karray_add(att_array, att);
 	
 	/* Validate the tie. */
@@ -1028,18 +1452,20 @@ static int kmod_fetch_attachment(struct kmod_mail *orig_mail, karray *att_array,
 	    }
 	}
     
-    	/* Get the name, encoding, mime type and attachment data. */
-	att->name = kstr_new();
-	kstr_assign_kstr(att->name, &mail_att->name);
+    	/* Get the name, encoding, mime type and attachment data (or file
+	 * path). They are moved, the original mail does not need them.
+	 */
+	att->name = karena_kstr_new(arena);
+	kstr_take(att->name, &mail_att->name);
 	
-	att->encoding = kstr_new();
-	kstr_assign_kstr(att->encoding, &mail_att->encoding);
+	att->encoding = karena_kstr_new(arena);
+	kstr_take(att->encoding, &mail_att->encoding);
     	
-	att->mime_type = kstr_new();
-	kstr_assign_kstr(att->mime_type, &mail_att->mime_type);
+	att->mime_type = karena_kstr_new(arena);
+	kstr_take(att->mime_type, &mail_att->mime_type);
 	
-	att->data = kstr_new();
-	kstr_assign_kstr(att->data, &mail_att->data);
+	att->data = karena_kstr_new(arena);
+	kstr_take(att->data, &mail_att->data);
 	
     	/* Validate the attachment name. */
 	if (! kmod_is_valid_attachment_name(att->name)) {
@@ -1056,13 +1482,10 @@ static int kmod_fetch_attachment(struct kmod_mail *orig_mail, karray *att_array,
 	    }
 	}
     
-	/* If we have received the data already, copy it then clear it to save memory. */
-	if (! mail_att->data_is_file_path) {
-	    kstr_shrink(&mail_att->data, 1024);
-	}
-	
-	/* Otherwise, read the data from the file specified. */
-	else {
+	/* If we have not received the data already, read the data from the
+	 * file specified.
+	 */
+	if (mail_att->data_is_file_path) {
 	    FILE *file = NULL;
 	    int file_size;
 	    
@@ -1070,6 +1493,13 @@ static int kmod_fetch_attachment(struct kmod_mail *orig_mail, karray *att_array,
 	    do {
 	    	error = util_open_file(&file, att->data->data, "rb");
 		if (error) break;
+		
+		/* Keep the path. */
+		if (! read_flag) {
+		    att->data_is_file_path = 1;
+		    error = util_close_file(&file, 0);
+		    break;
+		}
 	
 		error = util_get_file_size(file, &file_size);
 		if (error) break;
@@ -1107,23 +1537,94 @@ static int kmod_fetch_attachment(struct kmod_mail *orig_mail, karray *att_array,
     return error;
 }
 
-/* This function clears and destroys an attachment array. */
-static void kmod_free_attachment_array(karray *att_array) {
-    int i;
+/* This function feeds the data of the attachment specified to 'mail_ctx', if it
+ * is not NULL, and computes the digest of the data with the algorithm 'algo',
+ * if it is not 0 and the digest is not already known. The attachment file, if
+ * any, is read by chunks, once for all the digests.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_hash_attachment(struct kmod_attachment *att, struct kmocrypt_hash_ctx *mail_ctx, int algo) {
+    int error = 0;
+    struct kmocrypt_hash_ctx payload_ctx;
+    FILE *file = NULL;
+    char *chunk = NULL;
+    
+    kmod_log_msg(3, "kmod_hash_attachment() called.\n");
+    
+    if (algo && att->payload_hash_len && att->payload_hash_algo == algo) algo = 0;
+    if (mail_ctx == NULL && algo == 0) return 0;
     
-    if (att_array == NULL) return;
+    payload_ctx.hd = NULL;
     
-    for (i = 0; i < att_array->size; i++) {
-    	struct kmod_attachment *att = (struct kmod_attachment *) att_array->data[i];
+    /* Try. */
+    do {
+    	if (algo) {
+	    assert(kmocrypt_hash_len(algo) <= KMOD_ATTACHMENT_MAX_DIGEST_LEN);
+	    
+	    error = kmocrypt_hash_init(&payload_ctx, algo);
+	    if (error) break;
+	}
 	
-	kstr_destroy(att->data);
-	kstr_destroy(att->name);
-	kstr_destroy(att->encoding);
-	kstr_destroy(att->mime_type);
-	free(att);
-    }
+	/* The data is in memory. */
+	if (! att->data_is_file_path) {
+	    if (mail_ctx) kmocrypt_hash_update(mail_ctx, att->data->data, att->data->slen);
+	    if (algo) kmocrypt_hash_update(&payload_ctx, att->data->data, att->data->slen);
+	}
+	
+	/* Read the file by chunks. */
+	else {
+	    int file_size;
+	    int left;
+	    
+	    error = util_open_file(&file, att->data->data, "rb");
+	    if (error) break;
+	    
+	    error = util_get_file_size(file, &file_size);
+	    if (error) break;
+	    
+	    chunk = (char *) kmo_malloc(KMOD_ATTACHMENT_CHUNK_SIZE);
+	    
+	    for (left = file_size; left > 0; left -= KMOD_ATTACHMENT_CHUNK_SIZE) {
+	    	int len = MIN(left, KMOD_ATTACHMENT_CHUNK_SIZE);
+		
+		error = util_read_file(file, chunk, len);
+		if (error) break;
+		
+		if (mail_ctx) kmocrypt_hash_update(mail_ctx, chunk, len);
+		if (algo) kmocrypt_hash_update(&payload_ctx, chunk, len);
+	    }
+	    
+	    if (error) break;
+	    
+	    error = util_close_file(&file, 0);
+	    if (error) break;
+	}
+	
+	if (algo) {
+	    att->payload_hash_algo = algo;
+	    att->payload_hash_len = kmocrypt_hash_final(&payload_ctx, att->payload_hash);
+	}
+	
+    } while (0);
+    
+    util_close_file(&file, 1);
+    kmocrypt_hash_free(&payload_ctx);
+    free(chunk);
     
-    karray_destroy(att_array);
+    return error;
+}
+
+/* This function destroys an attachment allocated on the heap. The attachments
+ * added by the signature code are allocated this way; the others come from the
+ * arena.
+ */
+static void kmod_destroy_attachment(void *obj) {
+    struct kmod_attachment *att = (struct kmod_attachment *) obj;
+    kstr_destroy(att->data);
+    kstr_destroy(att->name);
+    kstr_destroy(att->encoding);
+    kstr_destroy(att->mime_type);
+    free(att);
 }
 
 /* This function maps maildb field statuses to K3P field statuses. */
@@ -1390,23 +1891,27 @@ static void kmod_mail_info_2_kmod_otut(maildb_mail_info *mail_info, struct kmod_
 
 /* This function converts a mail_info object to an kmod_eval_res object (with
  * the subscriber name and the default password provided). The eval_res object
- * should have been cleared prior to this call.
+ * should have been cleared prior to this call. If 'move_flag' is true, the
+ * messages of the mail_info object, the subscriber name and the default
+ * password are moved to the eval_res object instead of being copied.
  */
 static void kmod_mail_info_2_eval_res(maildb_mail_info *mail_info, kstr *subscriber_name, kstr *default_pwd,
-    	    	    	    	      struct kmod_eval_res *eval_res) {
+    	    	    	    	      struct kmod_eval_res *eval_res, int move_flag) {
+    void (*copy_func) (kstr *, kstr *) = move_flag ? kstr_take : kstr_assign_kstr;
+    
     kmod_log_msg(2, "kmod_mail_info_2_eval_res() called.\n");
     assert(mail_info->status == 0 || mail_info->status == 1);
     
     eval_res->display_pref = mail_info->display_pref;
     eval_res->string_status = kmod_get_mail_info_string_status(mail_info);
     eval_res->sig_valid = mail_info->status;
-    kstr_assign_kstr(&eval_res->sig_msg, &mail_info->sig_msg);
+    copy_func(&eval_res->sig_msg, &mail_info->sig_msg);
     
     if (mail_info->status == 1) {
 	eval_res->original_packaging = mail_info->original_packaging;
 	
 	assert(subscriber_name != NULL);
-	kstr_assign_kstr(&eval_res->subscriber_name, subscriber_name);
+	copy_func(&eval_res->subscriber_name, subscriber_name);
 
 	eval_res->from_name_status = kmod_get_mail_info_field_status(mail_info, MAILDB_STATUS_FROM_NAME);
 	eval_res->from_addr_status = kmod_get_mail_info_field_status(mail_info, MAILDB_STATUS_FROM_ADDR);
@@ -1438,14 +1943,14 @@ static void kmod_mail_info_2_eval_res(maildb_mail_info *mail_info, kstr *subscri
 	}
 
 	eval_res->encryption_status = mail_info->encryption_status;
-	kstr_assign_kstr(&eval_res->decryption_error_msg, &mail_info->decryption_error_msg);
+	copy_func(&eval_res->decryption_error_msg, &mail_info->decryption_error_msg);
 	
 	if (default_pwd) {
-	    kstr_assign_kstr(&eval_res->default_pwd, default_pwd);
+	    copy_func(&eval_res->default_pwd, default_pwd);
 	}
 	
 	eval_res->pod_status = mail_info->pod_status;
-	kstr_assign_kstr(&eval_res->pod_msg, &mail_info->pod_msg);
+	copy_func(&eval_res->pod_msg, &mail_info->pod_msg);
 	
 	kmod_mail_info_2_kmod_otut(mail_info, &eval_res->otut);
     }
@@ -1522,6 +2027,8 @@ static int kmod_get_user_info(struct kmod_context *kc) {
 	    
 	    if (error) break;
 	    
+	    kmod_compile_domain_trie(kc);
+	    
 	    /* KPG kludge. */
 	    if (! knp_msg_read_uint32(query->res_payload, &i) && i == 1) {
 		kc->use_kpg = 1;
@@ -1559,6 +2066,11 @@ struct kmod_eval_state {
     
     /* Mail to evaluate. Memory not owned by this object. */
     struct kmod_mail *orig_mail;
+    
+    /* Arena of the K3P command. The strings and the attachments of this
+     * object are allocated in it; they are freed when the arena is reset.
+     */
+    karena *arena;
 
     /* Array of attachments received from the plugin. We might also append
      * some attachments in this array when we evaluate the mail.
@@ -1580,6 +2092,14 @@ struct kmod_eval_state {
     /* Public signature key object. */
     struct kmocrypt_signed_pkey *sig_key_obj;
     
+    /* True if 'sig_key_obj' belongs to the signature key cache. */
+    int sig_key_cached;
+    
+    /* True if the signature key data was obtained from the cache rather than
+     * from the IKS.
+     */
+    int sig_key_from_cache;
+    
     /* Subscriber name, if any. */
     kstr *subscriber_name;
     
@@ -1648,6 +2168,20 @@ struct kmod_eval_state {
     /* Decryption email. */
     kstr *dec_email;
     
+    /* Kryptiva markers of the text and HTML bodies of the original mail. They
+     * are located once, by kmod_eval_get_markers().
+     */
+    struct mail_markers text_markers;
+    struct mail_markers html_markers;
+    
+    /* Pool hashing the attachments, group of the hashing works in progress
+     * and array of these works. The attachments being hashed must not be
+     * modified until the group has been waited for.
+     */
+    struct kmo_workpool *workpool;
+    struct kmo_work_group hash_group;
+    karray hash_work_array;
+    
     /* Initialized scratch payload. */
     kbuffer payload;
     
@@ -1656,33 +2190,120 @@ struct kmod_eval_state {
 };
 
 /* This function initializes the kmod_eval_state object. */
-static void kmod_eval_init(struct kmod_eval_state *state, struct kmod_mail *orig_mail) {
+static void kmod_eval_init(struct kmod_eval_state *state, karena *arena, struct kmo_workpool *workpool,
+    	    	    	   struct kmod_mail *orig_mail) {
     memset(state, 0, sizeof(struct kmod_eval_state));
     state->orig_mail = orig_mail;
+    state->arena = arena;
+    state->workpool = workpool;
+    kmo_work_group_init(&state->hash_group);
+    karray_init(&state->hash_work_array);
     kbuffer_init(&state->payload, 200);
     kstr_init(&state->str);
 }
 
+/* This function returns the Kryptiva markers of the body of the original mail
+ * specified. The body is scanned the first time the markers are requested.
+ */
+static struct mail_markers * kmod_eval_get_markers(struct kmod_eval_state *state, kstr *body) {
+    struct mail_markers *markers;
+    
+    assert(body == &state->orig_mail->body.text || body == &state->orig_mail->body.html);
+    markers = (body == &state->orig_mail->body.text) ? &state->text_markers : &state->html_markers;
+    if (markers->body != body) mail_scan_markers(body, markers);
+    
+    return markers;
+}
+
+/* Work computing the digest of an attachment in the worker pool. */
+struct kmod_hash_work {
+    struct kmo_work work;
+    
+    /* Attachment to hash and digest algorithm. */
+    struct kmod_attachment *att;
+    int algo;
+    
+    /* Result of kmod_hash_attachment() and error string, if any. */
+    int error;
+    kstr err_str;
+};
+
+/* This function computes the digest of the attachment of a work. It runs on a
+ * worker thread, which charges its heap blocks to the evaluation.
+ */
+static void kmod_hash_work_run(struct kmo_work *work) {
+    struct kmod_hash_work *hash_work = (struct kmod_hash_work *) work;
+    int tag = kmo_heap_set_tag(KMO_HEAP_EVAL);
+    
+    hash_work->error = kmod_hash_attachment(hash_work->att, NULL, hash_work->algo);
+    if (hash_work->error) kstr_assign_kstr(&hash_work->err_str, kmo_kstrerror());
+    
+    kmo_heap_set_tag(tag);
+}
+
+/* This function starts computing, in the worker pool, the missing digests of
+ * the attachments received with the algorithm specified. The attachments in
+ * error are skipped, and so are the attachments stored in files if
+ * 'skip_file_flag' is true. kmod_eval_wait_hash() must be called before the
+ * digests and the statuses of the attachments are used.
+ */
+static void kmod_eval_start_hash(struct kmod_eval_state *state, int algo, int skip_file_flag) {
+    int i;
+    
+    if (algo == 0) return;
+    
+    for (i = 0; i < state->recv_att_array->size; i++) {
+    	struct kmod_attachment *att = (struct kmod_attachment *) state->recv_att_array->data[i];
+	struct kmod_hash_work *hash_work;
+	
+	if (att->status == KMO_EVAL_ATTACHMENT_ERROR) continue;
+	if (att->payload_hash_len && att->payload_hash_algo == algo) continue;
+	if (skip_file_flag && att->data_is_file_path) continue;
+	
+	hash_work = (struct kmod_hash_work *) karena_calloc(state->arena, sizeof(struct kmod_hash_work));
+	hash_work->work.run = kmod_hash_work_run;
+	hash_work->att = att;
+	hash_work->algo = algo;
+	kstr_init(&hash_work->err_str);
+	karray_add(&state->hash_work_array, hash_work);
+	
+	kmo_workpool_submit(state->workpool, &state->hash_group, &hash_work->work);
+    }
+}
+
+/* This function waits for the digests started by kmod_eval_start_hash() and
+ * marks the attachments that could not be hashed as being in error.
+ */
+static void kmod_eval_wait_hash(struct kmod_eval_state *state) {
+    int i;
+    
+    kmo_workpool_wait(state->workpool, &state->hash_group);
+    
+    for (i = 0; i < state->hash_work_array.size; i++) {
+    	struct kmod_hash_work *hash_work = (struct kmod_hash_work *) state->hash_work_array.data[i];
+	
+	if (hash_work->error) {
+	    hash_work->att->status = KMO_EVAL_ATTACHMENT_ERROR;
+	    kmod_log_msg(1, "Attachment error: %s.\n", hash_work->err_str.data);
+	}
+	
+	kstr_free(&hash_work->err_str);
+    }
+    
+    state->hash_work_array.size = 0;
+}
+
 /* This function frees the kmod_eval_state object. */
 static void kmod_eval_free(struct kmod_eval_state *state) {
-    kmod_free_attachment_array(state->recv_att_array);
-    kstr_destroy(state->sig_text);
+    kmod_eval_wait_hash(state);
+    karray_free(&state->hash_work_array);
     
     if (state->sig_obj) {
     	kmod_sig_free(state->sig_obj);
     	free(state->sig_obj);
     }
     
-    kstr_destroy(state->sig_key_data);
-    kstr_destroy(state->sig_key_tm_data);
-    kmocrypt_signed_pkey_destroy(state->sig_key_obj);
-    kstr_destroy(state->subscriber_name);
-    kstr_destroy(state->default_pwd);
-    kstr_destroy(state->inter_sym_key_data);
-    kstr_destroy(state->sym_key_data);
-    kstr_destroy(state->text_body);
-    kstr_destroy(state->html_body);
-    kmod_free_attachment_array(state->decrypted_att_array);
+    if (! state->sig_key_cached) kmocrypt_signed_pkey_destroy(state->sig_key_obj);
     
     if (state->prev_mail_info) {
     	maildb_free_mail_info(state->prev_mail_info);
@@ -1694,11 +2315,160 @@ static void kmod_eval_free(struct kmod_eval_state *state) {
 	free(state->mail_info);
     }
     
-    kstr_destroy(state->dec_email);
     kbuffer_clean(&state->payload);
     kstr_free(&state->str);
 }
 
+/* This function frees a mail status cache entry. */
+static void kmod_status_entry_destroy(struct kmod_status_entry *entry) {
+    if (entry == NULL) return;
+    maildb_free_mail_info(&entry->mail_info);
+    maildb_free_sender_info(&entry->sender_info);
+    free(entry);
+}
+
+/* This function returns a new mail status cache entry for the message ID
+ * specified. The entry is not in the cache yet.
+ */
+static struct kmod_status_entry * kmod_status_entry_new(kstr *msg_id) {
+    struct kmod_status_entry *entry = (struct kmod_status_entry *) kmo_calloc(sizeof(struct kmod_status_entry));
+    maildb_init_mail_info(&entry->mail_info);
+    maildb_init_sender_info(&entry->sender_info);
+    kstr_assign_kstr(&entry->mail_info.msg_id, msg_id);
+    return entry;
+}
+
+/* This function unlinks the entry specified from the list of the mail status
+ * cache.
+ */
+static void kmod_status_cache_unlink(struct kmod_context *kc, struct kmod_status_entry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else kc->status_lru_first = entry->next;
+    
+    if (entry->next) entry->next->prev = entry->prev;
+    else kc->status_lru_last = entry->prev;
+    
+    entry->prev = entry->next = NULL;
+}
+
+/* This function links the entry specified at the front of the list of the mail
+ * status cache.
+ */
+static void kmod_status_cache_link(struct kmod_context *kc, struct kmod_status_entry *entry) {
+    entry->prev = NULL;
+    entry->next = kc->status_lru_first;
+    
+    if (kc->status_lru_first) kc->status_lru_first->prev = entry;
+    else kc->status_lru_last = entry;
+    
+    kc->status_lru_first = entry;
+}
+
+/* This function removes the status of the mail having the message ID specified
+ * from the memory cache, if it is there.
+ */
+static void kmod_status_cache_remove(struct kmod_context *kc, kstr *msg_id) {
+    struct kmod_status_entry *entry = (struct kmod_status_entry *) khash_get(&kc->status_cache, msg_id);
+    if (entry == NULL) return;
+    
+    khash_remove(&kc->status_cache, msg_id);
+    kmod_status_cache_unlink(kc, entry);
+    kmod_status_entry_destroy(entry);
+}
+
+/* This function removes all the mail statuses cached in memory. */
+static void kmod_status_cache_flush(struct kmod_context *kc) {
+    while (kc->status_lru_first) {
+    	struct kmod_status_entry *entry = kc->status_lru_first;
+	kc->status_lru_first = entry->next;
+	kmod_status_entry_destroy(entry);
+    }
+    
+    kc->status_lru_last = NULL;
+    khash_clear(&kc->status_cache);
+}
+
+/* This function looks up the status of the mail having the message ID
+ * specified in the memory cache. The entry must hold the fields of a full
+ * status if 'full_flag' is true, and those of a string status otherwise.
+ * This function returns the cache entry found, or NULL if there is none.
+ */
+static struct kmod_status_entry * kmod_status_cache_lookup(struct kmod_context *kc, kstr *msg_id, int full_flag) {
+    struct kmod_status_entry *entry = (struct kmod_status_entry *) khash_get(&kc->status_cache, msg_id);
+    uint32_t field_mask = full_flag ? KMOD_FULL_STATUS_FIELDS : KMOD_STRING_STATUS_FIELDS;
+    
+    if (entry == NULL) return NULL;
+    
+    if ((entry->mail_info.field_mask & field_mask) != field_mask) return NULL;
+    
+    /* Mark the entry as the most recently used. */
+    kmod_status_cache_unlink(kc, entry);
+    kmod_status_cache_link(kc, entry);
+    return entry;
+}
+
+/* This function adds the entry specified to the memory cache, which takes
+ * ownership of it. The previous entry of the message ID is replaced, and the
+ * least recently used entry is evicted if the cache is full.
+ */
+static void kmod_status_cache_add(struct kmod_context *kc, struct kmod_status_entry *entry) {
+    kmod_status_cache_remove(kc, &entry->mail_info.msg_id);
+    
+    if (kc->status_cache.size >= KMOD_STATUS_CACHE_SIZE) {
+    	kmod_status_cache_remove(kc, &kc->status_lru_last->mail_info.msg_id);
+    }
+    
+    khash_add(&kc->status_cache, &entry->mail_info.msg_id, entry);
+    kmod_status_cache_link(kc, entry);
+}
+
+/* This function updates the name of the sender specified in the mail statuses
+ * cached in memory.
+ */
+static void kmod_status_cache_set_sender(struct kmod_context *kc, maildb_sender_info *sender_info) {
+    struct kmod_status_entry *entry;
+    
+    for (entry = kc->status_lru_first; entry; entry = entry->next) {
+    	if (entry->sender_info.mid == sender_info->mid) {
+	    kstr_assign_kstr(&entry->sender_info.name, &sender_info->name);
+	}
+    }
+}
+
+/* This function removes the statuses of the mails having the entry ID
+ * specified from the memory cache.
+ */
+static void kmod_status_cache_remove_entry_id(struct kmod_context *kc, int64_t entry_id) {
+    struct kmod_status_entry *entry = kc->status_lru_first;
+    
+    while (entry) {
+    	struct kmod_status_entry *next = entry->next;
+	if (entry->mail_info.entry_id == entry_id) kmod_status_cache_remove(kc, &entry->mail_info.msg_id);
+	entry = next;
+    }
+}
+
+/* This function stores the mail info specified in the database. The status of
+ * the mail cached in memory, if any, is discarded. The mail info objects that
+ * have no message ID (the mails sent locally) may replace an entry having one,
+ * so the whole cache is discarded for them. Several message IDs may share the
+ * entry written, so their statuses are discarded too.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_set_mail_info(struct kmod_context *kc, maildb_mail_info *mail_info) {
+    int error;
+    
+    if (mail_info->msg_id.slen) kmod_status_cache_remove(kc, &mail_info->msg_id);
+    else kmod_status_cache_flush(kc);
+    
+    error = maildb_set_mail_info(kc->mail_db, mail_info);
+    
+    /* The entry ID is set when the object is written. */
+    if (mail_info->entry_id > 0) kmod_status_cache_remove_entry_id(kc, mail_info->entry_id);
+    
+    return error;
+}
+
 /* This function writes the 'maildb_mail_info' and 'maildb_sender_info' objects
  * to the database. It also obtains the entry ID associated to the
  * maildb_mail_info object in the database.
@@ -1737,10 +2507,12 @@ static int kmod_eval_write_maildb_info(struct kmod_context *kc, struct kmod_eval
 	if (state->mail_info->status == 1) {    	    
     	    error = maildb_set_sender_info(kc->mail_db, &sender_info);
     	    if (error) break;
+	    
+	    kmod_status_cache_set_sender(kc, &sender_info);
 	}
 	
 	/* Store the mail info in the database. */
-	error = maildb_set_mail_info(kc->mail_db, state->mail_info);
+	error = kmod_set_mail_info(kc, state->mail_info);
 	if (error) break;
 	
     } while (0);
@@ -1776,10 +2548,102 @@ static void kmod_eval_check_pod(struct kmod_eval_state *state) {
     }
 }
 
-/* This function decrypts the decoded text body of an encrypted mail.
+/* This function frees a symmetric key cache entry. */
+static void kmod_sym_key_entry_destroy(struct kmod_sym_key_entry *entry) {
+    if (entry == NULL) return;
+    kstr_free(&entry->ksn);
+    kstr_free(&entry->hash);
+    kstr_free(&entry->key_data);
+    kmocrypt_symkey_destroy(entry->key_obj);
+    free(entry);
+}
+
+/* This function removes all the symmetric keys cached in memory. */
+static void kmod_sym_key_cache_flush(struct kmod_context *kc) {
+    int i;
+    
+    for (i = 0; i < kc->sym_key_cache.size; i++)
+    	kmod_sym_key_entry_destroy((struct kmod_sym_key_entry *) kc->sym_key_cache.data[i]);
+    
+    kc->sym_key_cache.size = 0;
+}
+
+/* This function returns true if the binary strings specified are equal. */
+static int kmod_sym_key_equal(kstr *first, kstr *second) {
+    return (first->slen == second->slen && ! memcmp(first->data, second->data, first->slen));
+}
+
+/* This function looks up the symmetric key of the mail having the KSN and
+ * the hash specified in the memory cache.
+ * This function returns the cache entry found, or NULL if there is none.
+ */
+static struct kmod_sym_key_entry * kmod_sym_key_cache_lookup(struct kmod_context *kc, kstr *ksn, kstr *hash) {
+    int i;
+    
+    if (ksn->slen == 0 || hash->slen == 0) return NULL;
+    
+    for (i = kc->sym_key_cache.size - 1; i >= 0; i--) {
+    	struct kmod_sym_key_entry *entry = (struct kmod_sym_key_entry *) kc->sym_key_cache.data[i];
+	
+	if (kmod_sym_key_equal(&entry->ksn, ksn) && kmod_sym_key_equal(&entry->hash, hash)) {
+	    
+	    /* Mark the entry as the most recently used. */
+	    memmove(kc->sym_key_cache.data + i, kc->sym_key_cache.data + i + 1,
+	    	    (kc->sym_key_cache.size - i - 1) * sizeof(void *));
+	    kc->sym_key_cache.data[kc->sym_key_cache.size - 1] = entry;
+	    return entry;
+	}
+    }
+    
+    return NULL;
+}
+
+/* This function adds the parsed symmetric key of the mail having the KSN and
+ * the hash specified to the memory cache, which takes ownership of it. The
+ * entry of the mail, if any, is replaced in place, otherwise the least recently
+ * used entry is evicted if the cache is full.
+ */
+static void kmod_sym_key_cache_add(struct kmod_context *kc, kstr *ksn, kstr *hash, kstr *key_data,
+    	    	    	    	   kmocrypt_symkey *key_obj) {
+    struct kmod_sym_key_entry *entry;
+    
+    if (ksn->slen == 0 || hash->slen == 0) {
+    	kmocrypt_symkey_destroy(key_obj);
+	return;
+    }
+    
+    /* Replace the stale key. The lookup marks the entry as the most recently
+     * used.
+     */
+    entry = kmod_sym_key_cache_lookup(kc, ksn, hash);
+    
+    if (entry) {
+    	kstr_assign_kstr(&entry->key_data, key_data);
+	kmocrypt_symkey_destroy(entry->key_obj);
+	entry->key_obj = key_obj;
+	return;
+    }
+    
+    if (kc->sym_key_cache.size >= KMOD_SYM_KEY_CACHE_SIZE) {
+    	kmod_sym_key_entry_destroy((struct kmod_sym_key_entry *) kc->sym_key_cache.data[0]);
+	memmove(kc->sym_key_cache.data, kc->sym_key_cache.data + 1, (kc->sym_key_cache.size - 1) * sizeof(void *));
+	kc->sym_key_cache.size--;
+    }
+    
+    entry = (struct kmod_sym_key_entry *) kmo_malloc(sizeof(struct kmod_sym_key_entry));
+    kstr_init_kstr(&entry->ksn, ksn);
+    kstr_init_kstr(&entry->hash, hash);
+    kstr_init_kstr(&entry->key_data, key_data);
+    entry->key_obj = key_obj;
+    karray_add(&kc->sym_key_cache, entry);
+}
+
+/* This function decrypts the decoded text body of an encrypted mail. The
+ * parsed symmetric key is taken from the memory cache, if it is there, and
+ * it is cached once it has decrypted the body.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int kmod_eval_decrypt_body(struct kmod_eval_state *state) {
+static int kmod_eval_decrypt_body(struct kmod_context *kc, struct kmod_eval_state *state) {
     kmod_log_msg(2, "kmod_eval_decrypt_body() called.\n");
     
     assert(state->text_body_status == KMOD_BODY_DECODED);    
@@ -1787,37 +2651,66 @@ static int kmod_eval_decrypt_body(struct kmod_eval_state *state) {
     int error = 0;
     int i;
     kmocrypt_symkey *sym_key_obj = NULL;
-    char *decrypted_data = (char *) kmo_malloc(state->text_body->slen);
-    int decrypted_data_len = state->text_body->slen;
-    kbuffer msg;
-    uint64_t magic;
-
-    kbuffer_init(&msg, 1000);
+    struct kmod_sym_key_entry *entry;
+    uint8_t *data = (uint8_t *) state->text_body->data;
+    uint32_t offset;
+    uint32_t len;
+    uint64_t start;
+    int tag;
     
     /* Try. */
     do {
-	/* Create the symmetric key. */
-    	sym_key_obj = kmocrypt_symkey_new(state->sym_key_data->data, state->sym_key_data->slen);
+	/* Use the cached symmetric key if it is the same, otherwise create
+	 * the symmetric key.
+	 */
+	entry = kmod_sym_key_cache_lookup(kc, &state->mail_info->ksn, &state->mail_info->hash);
 	
-	if (sym_key_obj == NULL) {
-	    error = -1;
-	    break;
+	if (entry && kmod_sym_key_equal(&entry->key_data, state->sym_key_data)) {
+	    kmod_log_msg(3, "kmod_eval_decrypt_body(): using the cached symmetric key.\n");
+	    kmo_stats_count(KMO_STAT_SYM_KEY_CACHE_HIT);
+	}
+	
+	else {
+	    kmo_stats_count(KMO_STAT_SYM_KEY_CACHE_MISS);
+	    entry = NULL;
+	    sym_key_obj = kmocrypt_symkey_new(state->sym_key_data->data, state->sym_key_data->slen);
+	    
+	    if (sym_key_obj == NULL) {
+		error = -1;
+		break;
+	    }
 	}
 
-	/* Decrypt the decoded data. */
-	kstr_grow(&state->str, state->text_body->slen);
-	error = kmocrypt_symkey_decrypt(sym_key_obj, state->text_body->data, state->text_body->slen,
-					decrypted_data, &decrypted_data_len);
+	/* Decrypt the decoded data in place. The decrypted message is located
+	 * at 'offset' in the body. If the key is wrong, the body is left
+	 * as is, so that another key may be tried later.
+	 */
+	start = kmo_stats_now();
+	tag = kmo_heap_set_tag(KMO_HEAP_CRYPT);
+	error = kmocrypt_symkey_decrypt_in_place(entry ? entry->key_obj : sym_key_obj, data,
+	    	    	    	    	    	 state->text_body->slen, &offset);
+	kmo_heap_set_tag(tag);
+	kmo_trace_span("crypt.decrypt", start);
 	if (error) break;
 	
-	/* Verify the magic numbers. */
-	kbuffer_write(&msg, decrypted_data, decrypted_data_len);
+	len = state->text_body->slen - offset;
 	
+	/* Verify the magic numbers in place. Each one is a KNP uint64 value:
+	 * a type byte followed by the number in network byte order.
+	 */
 	for (i = 0; i < 2; i++) {
-	    error = knp_msg_read_uint64(&msg, &magic);
-	    if (error) break;
+	    uint64_t magic;
+	    uint8_t *pos = data + offset + i * 9;
+	    
+	    if ((uint32_t) (i + 1) * 9 > len || *pos != KNP_UINT64) {
+	    	kmo_seterror("cannot read uint64 value in message");
+		error = -1;
+		break;
+	    }
 	    
-	    if (magic != KNP_ENC_BODY_MAGIC) {
+	    memcpy(&magic, pos + 1, sizeof(magic));
+	    
+	    if (ntohll(magic) != KNP_ENC_BODY_MAGIC) {
 	    	kmo_seterror("invalid magic number in decrypted message payload");
 		error = -1;
 		break;
@@ -1828,16 +2721,22 @@ static int kmod_eval_decrypt_body(struct kmod_eval_state *state) {
 
 	/* Replace the decoded data with the decrypted data. */
 	state->text_body_status = KMOD_BODY_DECRYPTED;
-	kstr_assign_buf(state->text_body, decrypted_data, decrypted_data_len);
+	memmove(data, data + offset, len);
+	data[len] = 0;
+	state->text_body->slen = len;
 	
-	/* The symmetric key data is valid. */
+	/* The symmetric key data is valid. Cache it. */
 	state->sym_key_valid = 1;
+	
+	if (sym_key_obj) {
+	    kmod_sym_key_cache_add(kc, &state->mail_info->ksn, &state->mail_info->hash, state->sym_key_data,
+	    	    	    	   sym_key_obj);
+	    sym_key_obj = NULL;
+	}
 
     } while (0);
     
     if (sym_key_obj != NULL) kmocrypt_symkey_destroy(sym_key_obj);
-    kbuffer_clean(&msg);
-    free(decrypted_data);
  
     return error;
 }
@@ -1891,13 +2790,20 @@ static int kmod_eval_check_encryption(struct kmod_context *kc, struct kmod_eval_
 	if (error) break;
 	
 	/* We might have obtained the key data from the previous mail info
-	 * entry. Try it in that case.
+	 * entry, or the key might be cached in memory even though the entry
+	 * does not have it. Try it in that case.
 	 */
+	if (state->mail_info->sym_key.slen == 0) {
+	    struct kmod_sym_key_entry *entry =
+	    	kmod_sym_key_cache_lookup(kc, &state->mail_info->ksn, &state->mail_info->hash);
+	    if (entry) kstr_assign_kstr(&state->mail_info->sym_key, &entry->key_data);
+	}
+	
 	if (state->mail_info->sym_key.slen > 0) {
 	    assert(state->sym_key_data == NULL);
-	    state->sym_key_data = kstr_new();
+	    state->sym_key_data = karena_kstr_new(state->arena);
 	    kstr_assign_kstr(state->sym_key_data, &state->mail_info->sym_key);
-	    kmod_eval_decrypt_body(state);
+	    kmod_eval_decrypt_body(kc, state);
 	    
 	    /* The decryption key appears to be working. Tell the plugin that the
 	     * mail is decrypted. We should be able to honor our words later.
@@ -1912,8 +2818,6 @@ static int kmod_eval_check_encryption(struct kmod_context *kc, struct kmod_eval_
 
 		break;
 	    }
-	    
-	    kstr_destroy(state->sym_key_data);
 	    state->sym_key_data = NULL;
 	}
 	
@@ -1944,10 +2848,9 @@ static int kmod_eval_check_encryption(struct kmod_context *kc, struct kmod_eval_
 	    state->mail_info->encryption_status = KMO_DECRYPTION_STATUS_ENCRYPTED_WITH_PWD;
 
 	    /* Get the default password from the database, if any. */
-	    state->default_pwd = kstr_new();
+	    state->default_pwd = karena_kstr_new(state->arena);
 	    
 	    if (maildb_get_pwd(kc->mail_db, &state->orig_mail->from_addr, state->default_pwd)) {
-	    	kstr_destroy(state->default_pwd);
 		state->default_pwd = NULL;
 	    }
 	}
@@ -2041,15 +2944,11 @@ static void kmod_eval_check_field(struct kmod_eval_state *state) {
 	    	    	    	    	    	         KMO_SP_TYPE_FROM_ADDR, MAILDB_STATUS_FROM_ADDR);
     
     /* The TO and CC strings need to be cleaned up. */
-    kstr_assign_kstr(&state->str, &state->orig_mail->to);
-    kmod_cleanup_signable_to_cc(&state->str);
-    strntolower(state->str.data, state->str.slen);
+    kmod_cleanup_signable_to_cc(&state->str, &state->orig_mail->to, 1);
     mail_info->field_status |= kmod_eval_one_check_field(state, &state->str,
 	    	    	    	    	    	         KMO_SP_TYPE_TO, MAILDB_STATUS_TO);
     
-    kstr_assign_kstr(&state->str, &state->orig_mail->cc);
-    kmod_cleanup_signable_to_cc(&state->str);
-    strntolower(state->str.data, state->str.slen);
+    kmod_cleanup_signable_to_cc(&state->str, &state->orig_mail->cc, 1);
     mail_info->field_status |= kmod_eval_one_check_field(state, &state->str,
 	    	    	    	    	    	         KMO_SP_TYPE_CC, MAILDB_STATUS_CC);
     
@@ -2075,9 +2974,7 @@ static void kmod_eval_check_field(struct kmod_eval_state *state) {
 	    kmod_trim_whitespace(&state->str);
 	
 	#ifdef BODY_CHANGED_DEBUG
-	fprintf(kmod_log, "RECEIVING: dumping signed text body:\n");
-	util_dump_buf_ascii(state->str.data, state->str.slen, kmod_log);
-	fprintf(kmod_log, "END END END.\n\n");
+	kmod_dump_body("RECEIVING: dumping signed text body", &state->str);
 	#endif  
     }
 
@@ -2098,9 +2995,7 @@ static void kmod_eval_check_field(struct kmod_eval_state *state) {
 	    kmod_trim_whitespace(&state->str);
 	
 	#ifdef BODY_CHANGED_DEBUG
-	fprintf(kmod_log, "RECEIVING: dumping signed HTML body:\n");
-	util_dump_buf_ascii(state->str.data, state->str.slen, kmod_log);
-	fprintf(kmod_log, "END END END.\n\n");
+	kmod_dump_body("RECEIVING: dumping signed HTML body", &state->str);
 	#endif  
     }
 
@@ -2110,9 +3005,19 @@ static void kmod_eval_check_field(struct kmod_eval_state *state) {
     /* Remember the number of attachments received from the plugin. */
     mail_info->att_plugin_nbr = state->recv_att_array->size;
     
-    /* Verify the attachments. */
+    /* Compute the missing attachment digests in parallel, including those
+     * started by kmod_eval_compute_hash(), then verify the attachments.
+     */
+    kmod_eval_start_hash(state, kmod_sig_get_hash_algo(state->sig_obj), 0);
+    kmod_eval_wait_hash(state);
+    
     kmod_sig_check_attachments(state->sig_obj, state->recv_att_array);
     
+    /* Have the arena free the dropped attachments listed by the check. */
+    for (i = (int) mail_info->att_plugin_nbr; i < state->recv_att_array->size; i++) {
+    	karena_add_cleanup(state->arena, kmod_destroy_attachment, state->recv_att_array->data[i]);
+    }
+    
     /* Create the attachments blob for the DB, replacing the previous one as
      * needed.
      */
@@ -2130,54 +3035,287 @@ static void kmod_eval_check_field(struct kmod_eval_state *state) {
     kbuffer_clean(&buf);
 }
 
-/* This function removes the signature tags and other junk from the mail
- * bodies.
- * This function sets the KMO error string. It returns -1 on failure.
+/* This function removes the signature tags and other junk from the mail
+ * bodies.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_eval_remove_sig(struct kmod_eval_state *state) {
+    int error = 0;
+    
+    kmod_log_msg(2, "kmod_eval_remove_sig() called.\n");
+    
+    /* Remove the signature from the signed mail bodies. */
+    if (state->sig_obj->pkg_type == KMO_P_TYPE_SIGN) {
+    	if (state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_TEXT ||
+	    state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_TEXT_N_HTML) {
+
+	    state->text_body = karena_kstr_new(state->arena);
+	    state->text_body_status = KMOD_BODY_UNSIGNED;
+	    error = mail_strip_text_signature(&state->orig_mail->body.text, state->text_body,
+	    	    	    	    	      kmod_eval_get_markers(state, &state->orig_mail->body.text));
+	    if (error) return -1;
+	}
+
+	if (state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_HTML ||
+	    state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_TEXT_N_HTML) {
+
+	    state->html_body = karena_kstr_new(state->arena);
+	    state->html_body_status = KMOD_BODY_UNSIGNED;
+	    error = mail_strip_html_signature(&state->orig_mail->body.html, state->html_body);
+	    if (error) return -1;
+	}
+    }
+
+    /* Remove the signature from the encrypted body. */
+    else {
+
+	/* If the mail is encrypted and/or requires a PoD, we should have
+	 * a text body and only a text body. However, some MUA automatically 
+	 * generate HTML mails from text mails and therefore we may receive
+	 * an HTML body here. Consequently, if the mail has an HTML body and
+	 * no text body, we use the HTML body. If a text body is provided,
+	 * we ignore the HTML body, if any.
+	 */
+	kstr *body = (state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_HTML) ?
+	    	     &state->orig_mail->body.html : &state->orig_mail->body.text;
+	
+	state->text_body = karena_kstr_new(state->arena);
+	state->text_body_status = KMOD_BODY_ENCODED;
+	error = mail_get_encrypted_body(body, state->text_body, kmod_eval_get_markers(state, body));
+	if (error) return -1;
+    }
+    
+    return 0;
+}
+
+/* This function parses the signature key data specified.
+ * This function sets the KMO error string. It returns NULL on failure.
+ */
+static struct kmocrypt_signed_pkey * kmod_parse_sig_key(kstr *key_data) {
+    struct kmocrypt_signed_pkey *key_obj;
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_CRYPT);
+    kbuffer *buffer = kbuffer_new(32);
+    kbuffer_write(buffer, key_data->data, strlen(key_data->data));
+    key_obj = kmocrypt_sign_get_pkey(buffer);
+    kbuffer_destroy(buffer);
+    kmo_heap_set_tag(tag);
+    kmo_trace_span("crypt.parse_key", start);
+    return key_obj;
+}
+
+/* This function frees a signature key cache entry. */
+static void kmod_sig_key_entry_destroy(struct kmod_sig_key_entry *entry) {
+    if (entry == NULL) return;
+    maildb_free_sig_key_info(&entry->info);
+    kmocrypt_signed_pkey_destroy(entry->key_obj);
+    free(entry);
+}
+
+/* This function removes the signature key cache entry at the position
+ * specified from the memory cache and returns it.
+ */
+static struct kmod_sig_key_entry * kmod_sig_key_cache_take(struct kmod_context *kc, int pos) {
+    struct kmod_sig_key_entry *entry = (struct kmod_sig_key_entry *) kc->sig_key_cache.data[pos];
+    memmove(kc->sig_key_cache.data + pos, kc->sig_key_cache.data + pos + 1,
+    	    (kc->sig_key_cache.size - pos - 1) * sizeof(void *));
+    kc->sig_key_cache.size--;
+    return entry;
+}
+
+/* This function removes all the signature keys cached in memory. */
+static void kmod_sig_key_cache_flush(struct kmod_context *kc) {
+    int i;
+    
+    for (i = 0; i < kc->sig_key_cache.size; i++)
+    	kmod_sig_key_entry_destroy((struct kmod_sig_key_entry *) kc->sig_key_cache.data[i]);
+    
+    kc->sig_key_cache.size = 0;
+}
+
+/* This function returns true if the signature key data specified has outlived
+ * its lifetime.
+ */
+static int kmod_sig_key_is_expired(maildb_sig_key_info *info) {
+    int64_t now = time(NULL);
+    return (now - info->fetch_time >= sig_key_cache_ttl || info->fetch_time > now + 60);
+}
+
+/* This function adds an entry in the memory cache, evicting the least recently
+ * used entry if the cache is full.
+ */
+static void kmod_sig_key_cache_add(struct kmod_context *kc, struct kmod_sig_key_entry *entry) {
+    if (kc->sig_key_cache.size >= KMOD_SIG_KEY_CACHE_SIZE)
+    	kmod_sig_key_entry_destroy(kmod_sig_key_cache_take(kc, 0));
+    
+    karray_add(&kc->sig_key_cache, entry);
+}
+
+/* This function removes the signature key of the member specified from the
+ * memory cache and from the database.
+ */
+static void kmod_sig_key_cache_remove(struct kmod_context *kc, int64_t mid) {
+    int i;
+    
+    for (i = 0; i < kc->sig_key_cache.size; i++) {
+    	struct kmod_sig_key_entry *entry = (struct kmod_sig_key_entry *) kc->sig_key_cache.data[i];
+	
+	if (entry->info.mid == mid) {
+	    kmod_sig_key_entry_destroy(kmod_sig_key_cache_take(kc, i));
+	    break;
+	}
+    }
+    
+    if (maildb_rm_sig_key_info(kc->mail_db, mid)) {
+    	kmod_log_msg(1, "Cannot remove cached signature key: %s.\n", kmo_strerror());
+    }
+}
+
+/* This function looks up the signature key of the member specified in the
+ * memory cache, then in the database. Expired keys are removed.
+ * This function returns the cache entry found, or NULL if there is none.
+ */
+static struct kmod_sig_key_entry * kmod_sig_key_cache_lookup(struct kmod_context *kc, int64_t mid) {
+    int i;
+    int error;
+    struct kmod_sig_key_entry *entry = NULL;
+    
+    /* Look in memory. */
+    for (i = 0; i < kc->sig_key_cache.size; i++) {
+    	entry = (struct kmod_sig_key_entry *) kc->sig_key_cache.data[i];
+	
+	if (entry->info.mid == mid) {
+	    if (kmod_sig_key_is_expired(&entry->info)) {
+	    	kmod_sig_key_cache_remove(kc, mid);
+		return NULL;
+	    }
+	    
+	    /* Mark the entry as the most recently used. */
+	    karray_add(&kc->sig_key_cache, kmod_sig_key_cache_take(kc, i));
+	    return entry;
+	}
+    }
+    
+    /* Look in the database. */
+    entry = (struct kmod_sig_key_entry *) kmo_calloc(sizeof(struct kmod_sig_key_entry));
+    maildb_init_sig_key_info(&entry->info);
+    error = maildb_get_sig_key_info(kc->mail_db, &entry->info, mid);
+    
+    if (error) {
+    	if (error == -1) kmod_log_msg(1, "Cannot read cached signature key: %s.\n", kmo_strerror());
+	kmod_sig_key_entry_destroy(entry);
+	return NULL;
+    }
+    
+    if (kmod_sig_key_is_expired(&entry->info)) {
+    	kmod_sig_key_entry_destroy(entry);
+	kmod_sig_key_cache_remove(kc, mid);
+	return NULL;
+    }
+    
+    entry->key_obj = kmod_parse_sig_key(&entry->info.key_data);
+    
+    if (entry->key_obj == NULL) {
+    	kmod_log_msg(1, "Cannot parse cached signature key: %s.\n", kmo_strerror());
+	kmod_sig_key_entry_destroy(entry);
+	kmod_sig_key_cache_remove(kc, mid);
+	return NULL;
+    }
+    
+    kmod_sig_key_cache_add(kc, entry);
+    return entry;
+}
+
+/* This function sets the signature key data of the eval state from the cache
+ * entry specified. The key object is borrowed from the cache.
+ */
+static void kmod_sig_key_cache_apply(struct kmod_eval_state *state, struct kmod_sig_key_entry *entry) {
+    state->sig_key_tm_data = karena_kstr_new(state->arena);
+    kstr_assign_kstr(state->sig_key_tm_data, &entry->info.tm_key_data);
+    state->sig_key_data = karena_kstr_new(state->arena);
+    kstr_assign_kstr(state->sig_key_data, &entry->info.key_data);
+    state->sig_key_obj = entry->key_obj;
+    state->sig_key_cached = 1;
+    state->sig_key_from_cache = 1;
+    
+    if (! state->subscriber_name)
+    	state->subscriber_name = karena_kstr_new(state->arena);
+    
+    kstr_assign_kstr(state->subscriber_name, &entry->info.subscriber_name);
+}
+
+/* This function stores the signature key data obtained from the IKS in the
+ * cache. The cache takes ownership of the key object of the eval state.
  */
-static int kmod_eval_remove_sig(struct kmod_eval_state *state) {
-    int error = 0;
+static void kmod_sig_key_cache_store(struct kmod_context *kc, struct kmod_eval_state *state) {
+    struct kmod_sig_key_entry *entry;
     
-    kmod_log_msg(2, "kmod_eval_remove_sig() called.\n");
+    if (sig_key_cache_ttl == 0) return;
     
-    /* Remove the signature from the signed mail bodies. */
-    if (state->sig_obj->pkg_type == KMO_P_TYPE_SIGN) {
-    	if (state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_TEXT ||
-	    state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_TEXT_N_HTML) {
-
-	    state->text_body = kstr_new();
-	    state->text_body_status = KMOD_BODY_UNSIGNED;
-	    error = mail_strip_text_signature(&state->orig_mail->body.text, state->text_body);
-	    if (error) return -1;
-	}
-
-	if (state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_HTML ||
-	    state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_TEXT_N_HTML) {
-
-	    state->html_body = kstr_new();
-	    state->html_body_status = KMOD_BODY_UNSIGNED;
-	    error = mail_strip_html_signature(&state->orig_mail->body.html, state->html_body);
-	    if (error) return -1;
-	}
+    kmod_sig_key_cache_remove(kc, state->mail_info->mid);
+    
+    entry = (struct kmod_sig_key_entry *) kmo_calloc(sizeof(struct kmod_sig_key_entry));
+    maildb_init_sig_key_info(&entry->info);
+    entry->info.mid = state->mail_info->mid;
+    entry->info.fetch_time = time(NULL);
+    kstr_assign_kstr(&entry->info.tm_key_data, state->sig_key_tm_data);
+    kstr_assign_kstr(&entry->info.key_data, state->sig_key_data);
+    kstr_assign_kstr(&entry->info.subscriber_name, state->subscriber_name);
+    entry->key_obj = state->sig_key_obj;
+    state->sig_key_cached = 1;
+    
+    kmod_sig_key_cache_add(kc, entry);
+    
+    /* The cache is an optimization. Don't fail the evaluation. */
+    if (maildb_set_sig_key_info(kc->mail_db, &entry->info)) {
+    	kmod_log_msg(1, "Cannot write cached signature key: %s.\n", kmo_strerror());
     }
+}
 
-    /* Remove the signature from the encrypted body. */
-    else {
+/* This function forgets the signature key data of the eval state and removes
+ * it from the cache. This is used when the cached key turns out to be stale.
+ */
+static void kmod_sig_key_cache_discard(struct kmod_context *kc, struct kmod_eval_state *state) {
+    assert(state->sig_key_from_cache);
+    
+    state->sig_key_data = NULL;
+    state->sig_key_tm_data = NULL;
+    state->sig_key_obj = NULL;
+    state->sig_key_cached = 0;
+    state->sig_key_from_cache = 0;
+    kmod_sig_key_cache_remove(kc, state->mail_info->mid);
+}
 
-	/* If the mail is encrypted and/or requires a PoD, we should have
-	 * a text body and only a text body. However, some MUA automatically 
-	 * generate HTML mails from text mails and therefore we may receive
-	 * an HTML body here. Consequently, if the mail has an HTML body and
-	 * no text body, we use the HTML body. If a text body is provided,
-	 * we ignore the HTML body, if any.
-	 */
-	state->text_body = kstr_new();
-	state->text_body_status = KMOD_BODY_ENCODED;
-	error = mail_get_encrypted_body(state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_HTML ?
-	    	    	    	    	&state->orig_mail->body.html : &state->orig_mail->body.text,
-					state->text_body);
-	if (error) return -1;
-    }
+/* This function reads the signature key data from the reply of the IKS and
+ * stores it in the cache.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_eval_read_sig_key_reply(struct kmod_context *kc, struct kmod_eval_state *state,
+    	    	    	    	    	struct knp_query *query) {
+    assert(query->res_type == KNP_RES_GET_SIGN_KEY);
+    
+    /* Get the timestamp key data. */
+    state->sig_key_tm_data = karena_kstr_new(state->arena);
+    if (knp_msg_read_kstr(query->res_payload, state->sig_key_tm_data)) return -1;
+    
+    /* Get the key data. */
+    state->sig_key_data = karena_kstr_new(state->arena);
+    if (knp_msg_read_kstr(query->res_payload, state->sig_key_data)) return -1;
+    
+    /* Get the key. Assume the timestamp is correct since we got it directly
+     * from the server.
+     */
+    state->sig_key_obj = kmod_parse_sig_key(state->sig_key_data);
+    if (! state->sig_key_obj) return -1;
     
+    /* Get the subscriber name. */
+    if (! state->subscriber_name)
+	state->subscriber_name = karena_kstr_new(state->arena);
+    
+    if (knp_msg_read_kstr(query->res_payload, state->subscriber_name)) return -1;
+    
+    /* Remember the key for the next mails of this member. */
+    kmod_sig_key_cache_store(kc, state);
     return 0;
 }
 
@@ -2188,13 +3326,26 @@ static int kmod_eval_do_sig_key_query(struct kmod_context *kc, struct kmod_eval_
     int error = 0;
     int convert_flag = 0;
     struct knp_query *query;
-    kbuffer *buffer = NULL;
     
     kmod_log_msg(2, "kmod_eval_do_sig_key_query() called.\n");
     
     /* Don't fetch the key if we already have it. */
     if (state->sig_key_data) return 0;
     
+    /* Use the cached key, if any. */
+    if (sig_key_cache_ttl) {
+    	struct kmod_sig_key_entry *entry = kmod_sig_key_cache_lookup(kc, state->mail_info->mid);
+	
+	if (entry) {
+	    kmod_log_msg(2, "Using cached signature key of member %lld.\n", (long long) entry->info.mid);
+	    kmo_stats_count(KMO_STAT_SIG_KEY_CACHE_HIT);
+	    kmod_sig_key_cache_apply(state, entry);
+	    return 0;
+	}
+	
+	kmo_stats_count(KMO_STAT_SIG_KEY_CACHE_MISS);
+    }
+    
     kbuffer_clear(&state->payload);
     knp_msg_write_uint64(&state->payload, state->mail_info->mid);
     
@@ -2229,32 +3380,11 @@ static int kmod_eval_do_sig_key_query(struct kmod_context *kc, struct kmod_eval_
 	    convert_flag = 1;
 	    break;
 	}
-
-        /* Get the timestamp key data. */
-        state->sig_key_tm_data = kstr_new();
-        error = knp_msg_read_kstr(query->res_payload, state->sig_key_tm_data);
-        if (error) { convert_flag = 1; break; }
-    	
-	/* Get the key data. */
-	state->sig_key_data = kstr_new();
-	error = knp_msg_read_kstr(query->res_payload, state->sig_key_data);
-	if (error) { convert_flag = 1; break; }
-    	
-        /* Get the key. Assume the timestamp is correct since we got it directly
-         * from the server.
-	 */
-        buffer = kbuffer_new(32);
-        kbuffer_write(buffer, state->sig_key_data->data, strlen(state->sig_key_data->data));
-    	
-        state->sig_key_obj = kmocrypt_sign_get_pkey(buffer);
-        if (!state->sig_key_obj) { convert_flag = 1; break; }
-    	
-	/* Get the subscriber name. */
-	if (! state->subscriber_name)
-	    state->subscriber_name = kstr_new();
 	
-	error = knp_msg_read_kstr(query->res_payload, state->subscriber_name);
-	if (error) { convert_flag = 1; break; }
+	if (kmod_eval_read_sig_key_reply(kc, state, query)) {
+	    convert_flag = 1;
+	    break;
+	}
 	
     } while (0);
     
@@ -2263,7 +3393,6 @@ static int kmod_eval_do_sig_key_query(struct kmod_context *kc, struct kmod_eval_
     	error = kmod_convert_to_serv_error(&kc->k3p, query);
     }
     
-    kbuffer_destroy(buffer);
     knp_query_destroy(query);
     return error;
 }
@@ -2283,6 +3412,16 @@ static int kmod_eval_verify_sig(struct kmod_context *kc, struct kmod_eval_state
     error = kmod_eval_do_sig_key_query(kc, state);
     if (error) return error;
     
+    /* If the signature does not validate with the cached key, the member may
+     * have changed his key since we cached it. Ask the IKS again.
+     */
+    if (state->sig_key_from_cache && kmod_sig_validate(state->sig_obj, state->sig_key_obj->key)) {
+	kmod_log_msg(2, "Signature does not validate with the cached key, querying the IKS.\n");
+	kmod_sig_key_cache_discard(kc, state);
+	error = kmod_eval_do_sig_key_query(kc, state);
+	if (error) return error;
+    }
+    
     /* Verify the signature. Note that the mail_info statuses and the signature message
      * will be set later, should this call fails.
      */
@@ -2291,7 +3430,9 @@ static int kmod_eval_verify_sig(struct kmod_context *kc, struct kmod_eval_state
 
 /* This function computes the hash of the mail. */
 static void kmod_eval_compute_hash(struct kmod_eval_state *state) {
-    kbuffer in, out;
+    struct kmocrypt_hash_ctx ctx;
+    uint8_t digest[20];
+    int sig_algo = 0;
     int i;
     
     kmod_log_msg(2, "kmod_eval_compute_hash() called.\n");
@@ -2299,17 +3440,19 @@ static void kmod_eval_compute_hash(struct kmod_eval_state *state) {
     /* Don't recompute the hash if we already have it. */
     if (state->mail_info->hash.slen) return;
     
-    kbuffer_init(&in, 2000);
-    kbuffer_init(&out, 20);
+    /* Failure here should never happen. */
+    if (kmocrypt_hash_init(&ctx, GCRY_MD_SHA1)) {
+    	kmo_fatalerror("%s", kmo_strerror());
+    }
     
     /* Put the from name, from address, TO, CC, subject, the bodies and the attachments
      * in the hash.
      */
-    kbuffer_write(&in, state->orig_mail->from_name.data, state->orig_mail->from_name.slen);
-    kbuffer_write(&in, state->orig_mail->from_addr.data, state->orig_mail->from_addr.slen);
-    kbuffer_write(&in, state->orig_mail->to.data, state->orig_mail->to.slen);
-    kbuffer_write(&in, state->orig_mail->cc.data, state->orig_mail->cc.slen);
-    kbuffer_write(&in, state->orig_mail->subject.data, state->orig_mail->subject.slen);
+    kmocrypt_hash_update(&ctx, state->orig_mail->from_name.data, state->orig_mail->from_name.slen);
+    kmocrypt_hash_update(&ctx, state->orig_mail->from_addr.data, state->orig_mail->from_addr.slen);
+    kmocrypt_hash_update(&ctx, state->orig_mail->to.data, state->orig_mail->to.slen);
+    kmocrypt_hash_update(&ctx, state->orig_mail->cc.data, state->orig_mail->cc.slen);
+    kmocrypt_hash_update(&ctx, state->orig_mail->subject.data, state->orig_mail->subject.slen);
     
     /* The hash of a body may change when the message is moved in another
      * folder. Therefore, we try to hash only the content inside the Kryptiva
@@ -2321,12 +3464,13 @@ static void kmod_eval_compute_hash(struct kmod_eval_state *state) {
     	kstr body;
 	kstr_init(&body);
 	
-	if (! mail_strip_text_signature(&state->orig_mail->body.text, &body)) {
-	    kbuffer_write(&in, body.data, body.slen);
+	if (! mail_strip_text_signature(&state->orig_mail->body.text, &body,
+	    	    	    	    	kmod_eval_get_markers(state, &state->orig_mail->body.text))) {
+	    kmocrypt_hash_update(&ctx, body.data, body.slen);
 	}
     	
 	else {
-	    kbuffer_write(&in, state->orig_mail->body.text.data, state->orig_mail->body.text.slen);
+	    kmocrypt_hash_update(&ctx, state->orig_mail->body.text.data, state->orig_mail->body.text.slen);
 	}
 
 	kstr_free(&body);
@@ -2339,29 +3483,43 @@ static void kmod_eval_compute_hash(struct kmod_eval_state *state) {
 	kstr_init(&body);
     
 	if (! mail_strip_html_signature(&state->orig_mail->body.text, &body)) {
-	    kbuffer_write(&in, body.data, body.slen);
+	    kmocrypt_hash_update(&ctx, body.data, body.slen);
 	}
     	
 	else {
-	    kbuffer_write(&in, state->orig_mail->body.html.data, state->orig_mail->body.html.slen);
+	    kmocrypt_hash_update(&ctx, state->orig_mail->body.html.data, state->orig_mail->body.html.slen);
 	}
 
 	kstr_free(&body);
     }
     
-    /* Hash the attachments. */
+    /* Hash the attachments. The attachment data is streamed in the hash. The
+     * digests required to check the signature are computed by the worker pool
+     * in the meantime, while the signature key is obtained and the signature
+     * is validated; the digests of the attachments stored in files are
+     * computed here, so that the files are read once.
+     */
+    if (state->sig_obj) sig_algo = kmod_sig_get_hash_algo(state->sig_obj);
+    kmod_eval_start_hash(state, sig_algo, 1);
+    
     for (i = 0; i < state->recv_att_array->size; i++) {
     	struct kmod_attachment *att = (struct kmod_attachment *) state->recv_att_array->data[i];
-	kbuffer_write(&in, att->data->data, att->data->slen);
-	kbuffer_write(&in, att->name->data, att->name->slen);
+	int algo = (att->data_is_file_path && att->status != KMO_EVAL_ATTACHMENT_ERROR) ? sig_algo : 0;
+	
+	/* The signature digest is useless for an attachment in error. If the
+	 * file could not be opened, its path is hashed, as always.
+	 */
+	if (kmod_hash_attachment(att, &ctx, algo)) {
+	    att->status = KMO_EVAL_ATTACHMENT_ERROR;
+	    kmod_log_msg(1, "Attachment error: %s.\n", kmo_strerror());
+	}
+	
+	kmocrypt_hash_update(&ctx, att->name->data, att->name->slen);
     }
     
     /* Compute the hash. */
-    kmocrypt_sha1_hash(&in, &out);
-    kstr_assign_buf(&state->mail_info->hash, out.data, 20);
-    
-    kbuffer_clean(&in);
-    kbuffer_clean(&out);
+    kmocrypt_hash_final(&ctx, digest);
+    kstr_assign_buf(&state->mail_info->hash, digest, 20);
 }
 
 /* This function fetches the mail information stored in the database, if any.
@@ -2431,7 +3589,7 @@ static void kmod_eval_get_prev_mail_info(struct kmod_context *kc, struct kmod_ev
 	      
 	    if (! error) {
 	    	if (! state->subscriber_name)
-		    state->subscriber_name = kstr_new();
+		    state->subscriber_name = karena_kstr_new(state->arena);
 		        
 		kstr_assign_kstr(state->subscriber_name, &sender_info.name);
 	    }
@@ -2539,11 +3697,10 @@ static int kmod_eval_get_sig_info(struct kmod_context *kc, struct kmod_eval_stat
     	body = &state->orig_mail->body.html;
     }
     
-    state->sig_text = kstr_new();
-    error = mail_get_signature(body, state->sig_text);
+    state->sig_text = karena_kstr_new(state->arena);
+    error = mail_get_signature(body, state->sig_text, kmod_eval_get_markers(state, body));
     
     if (error) {
-    	kstr_destroy(state->sig_text);
 	state->sig_text = NULL;
     	return -1;
     }
@@ -2631,8 +3788,8 @@ static int kmod_eval_msg(struct kmod_context *kc, struct kmod_eval_state *state)
     
     /* Fetch the attachments. This should not fail. */
     assert(state->recv_att_array == NULL);
-    state->recv_att_array = karray_new();
-    error = kmod_fetch_attachment(state->orig_mail, state->recv_att_array, 1);
+    state->recv_att_array = karena_karray_new(state->arena);
+    error = kmod_fetch_attachment(state->arena, state->orig_mail, state->recv_att_array, 1, 0);
     assert(error == 0);
    
     /* Try to fill up 'mail_info' while updating the state. */
@@ -2653,7 +3810,9 @@ static int kmod_eval_msg(struct kmod_context *kc, struct kmod_eval_state *state)
 	html_body = &state->orig_mail->body.html;
     }
     
-    k3p_mail_status = mail_get_mail_status(text_body, html_body);
+    k3p_mail_status = mail_get_mail_status(text_body, html_body,
+    	    	    	    	    	   text_body ? kmod_eval_get_markers(state, text_body) : NULL,
+					   html_body ? kmod_eval_get_markers(state, html_body) : NULL);
     
     /* This is an unsigned mail. We're done. */
     if (k3p_mail_status == 2) {
@@ -2823,13 +3982,12 @@ static int kmod_process_send_mail(struct kmod_context *kc, struct kmod_eval_stat
 	assert(att->tie != 0);
 	mail_att->tie = att->tie;
 	mail_att->data_is_file_path = kc->mua.incoming_attachment_is_file_path;
-	kstr_assign_kstr(&mail_att->data, att->data);
+	kstr_swap(&mail_att->data, att->data);
 	kstr_assign_kstr(&mail_att->name, att->name);
 	kstr_assign_kstr(&mail_att->encoding, att->encoding);
 	kstr_assign_kstr(&mail_att->mime_type, att->mime_type);
 	
-	/* Save memory. */
-	kstr_destroy(att->data);
+	/* The data has been moved. */
 	att->data = NULL;
     }
     
@@ -2839,7 +3997,7 @@ static int kmod_process_send_mail(struct kmod_context *kc, struct kmod_eval_stat
     k3p_write_mail(k3p, &mail);
     
     if (state->want_dec_email) {
-	if (state->dec_email) k3p_write_kstr(k3p, state->dec_email);
+	if (state->dec_email) k3p_write_kstr_ref(k3p, state->dec_email);
 	else k3p_write_cstr(k3p, "");
     }
     
@@ -2867,7 +4025,7 @@ static int kmod_process_extract_field(struct kmod_context *kc, struct kmod_eval_
     
     /* Free the text body. */
     state->text_body_status = KMOD_BODY_NONE;
-    kstr_destroy(state->text_body);
+    kstr_shrink(state->text_body, 0);
     state->text_body = NULL;
     
     /* Flush the magic numbers. This should not fail since we've done it before. */
@@ -2905,7 +4063,7 @@ static int kmod_process_extract_field(struct kmod_context *kc, struct kmod_eval_
 		}
 
 		state->text_body_status = KMOD_BODY_EXTRACTED;
-		state->text_body = kstr_new();
+		state->text_body = karena_kstr_new(state->arena);
 		error = knp_msg_read_kstr(&msg, state->text_body);
     	    	if (error) break;
 	    }
@@ -2918,7 +4076,7 @@ static int kmod_process_extract_field(struct kmod_context *kc, struct kmod_eval_
 		}
 
 		state->html_body_status = KMOD_BODY_EXTRACTED;
-		state->html_body = kstr_new();
+		state->html_body = karena_kstr_new(state->arena);
 		error = knp_msg_read_kstr(&msg, state->html_body);
     	    	if (error) break;
 	    }
@@ -2926,7 +4084,8 @@ static int kmod_process_extract_field(struct kmod_context *kc, struct kmod_eval_
 	
 	/* Attachments. */
 	else if (part == KNP_MAIL_PART_IMPLICIT || part == KNP_MAIL_PART_EXPLICIT || part == KNP_MAIL_PART_UNKNOWN) {
-	    struct kmod_attachment *att = (struct kmod_attachment *) kmo_calloc(sizeof(struct kmod_attachment));
+	    struct kmod_attachment *att = (struct kmod_attachment *) karena_calloc(state->arena,
+	    	    	    	    	    	    	    	    	    	   sizeof(struct kmod_attachment));
 	    
 	    switch (part) {
 	    	case KNP_MAIL_PART_IMPLICIT: att->tie = K3P_MAIL_ATTACHMENT_IMPLICIT; break;
@@ -2939,19 +4098,19 @@ static int kmod_process_extract_field(struct kmod_context *kc, struct kmod_eval_
 	    karray_add(state->decrypted_att_array, att);
 	    
 	    /* Read the data. */
-	    att->encoding = kstr_new();
+	    att->encoding = karena_kstr_new(state->arena);
 	    error = knp_msg_read_kstr(&msg, att->encoding);
 	    if (error) break;
     	    
-	    att->mime_type = kstr_new();
+	    att->mime_type = karena_kstr_new(state->arena);
 	    error = knp_msg_read_kstr(&msg, att->mime_type);
 	    if (error) break;
     	    
-	    att->name = kstr_new();
+	    att->name = karena_kstr_new(state->arena);
 	    error = knp_msg_read_kstr(&msg, att->name);
 	    if (error) break;
     	    
-	    att->data = kstr_new();
+	    att->data = karena_kstr_new(state->arena);
 	    error = knp_msg_read_kstr(&msg, att->data);
 	    if (error) break;
 	    
@@ -3158,11 +4317,10 @@ static int kmod_process_do_sym_key_query(struct kmod_context *kc, int contact,
 	
     	/* Get the fully decrypted symmetric key. */
 	assert(state->sym_key_data == NULL);
-	state->sym_key_data = kstr_new();	
+	state->sym_key_data = karena_kstr_new(state->arena);	
     	error = knp_msg_read_kstr(query->res_payload, state->sym_key_data);
 	
 	if (error) {
-	    kstr_destroy(state->sym_key_data);
 	    state->sym_key_data = NULL;
 	    convert_flag = 1;
 	    break;
@@ -3196,10 +4354,9 @@ static int kmod_process_do_sym_key_query(struct kmod_context *kc, int contact,
 	if (error) { convert_flag = 1; break; }
 	
 	/* Read the decryption ticket, if there is one. */
-	state->dec_email = kstr_new();
+	state->dec_email = karena_kstr_new(state->arena);
 	
 	if (knp_msg_read_kstr(query->res_payload, state->dec_email)) {
-	    kstr_destroy(state->dec_email);
 	    state->dec_email = NULL;
 	}
     
@@ -3243,7 +4400,7 @@ static int kmod_process_get_sym_key(struct kmod_context *kc,
 
     /* Create the intermediate symmetric key data. It is empty initially. */
     assert(state->inter_sym_key_data == NULL);
-    state->inter_sym_key_data = kstr_new();
+    state->inter_sym_key_data = karena_kstr_new(state->arena);
 
     /* Encryption only. Contact the OUS to decrypt with the password, or contact
      * the KPS to decrypt with the private encryption key.
@@ -3301,7 +4458,7 @@ static int kmod_process_decrypt_mail(struct kmod_context *kc,
 	if (error) return error;
 	
 	/* Try to decrypt. */
-	error = kmod_eval_decrypt_body(state);
+	error = kmod_eval_decrypt_body(kc, state);
 	if (error) return error;
     }
 
@@ -3328,7 +4485,7 @@ static int kmod_process_incoming(struct kmod_context *kc, struct kmod_mail_proce
     kmod_log_msg(2, "kmod_process_incoming() called.\n");
 
     /* Initialize the eval state and the error string */
-    kmod_eval_init(&state, &req->mail);
+    kmod_eval_init(&state, &kc->arena, kc->workpool, &req->mail);
     state.use_prev_display_pref = 1;
     kstr_init(&error_msg);
     if (want_dec_email) state.want_dec_email = 1;
@@ -3336,7 +4493,7 @@ static int kmod_process_incoming(struct kmod_context *kc, struct kmod_mail_proce
     kmod_log_msg(3, "kmod_process_incoming: want_dec_email is %d.\n", want_dec_email);
     
     /* Create the decrypted attachment array. */
-    state.decrypted_att_array = karray_new();
+    state.decrypted_att_array = karena_karray_new(state.arena);
     
     /* Try. */
     do {
@@ -3501,92 +4658,488 @@ static int kmod_process_incoming(struct kmod_context *kc, struct kmod_mail_proce
     	
 	} while (0);
 	
-	/* If we fail here, KMO has failed, don't attempt to recover. */
+	/* If we fail here, KMO has failed, don't attempt to recover. */
+    }
+    
+    /* An error occurred and it was reported successfully, keep interacting. */
+    else if (error == -2) {
+    	error = 0;
+    }
+    
+    /* An error occurred and it was not reported successfully, stop interacting. */
+    else {
+    	assert(error == -3);
+	error = -1;
+    }
+    
+    /* Free the eval state and the error string. */
+    kmod_eval_free(&state);
+    kstr_free(&error_msg);
+ 
+    return error;
+}
+                          
+/* This function returns true if the mail specified is obviously an unsigned
+ * mail, i.e. if none of its bodies contains the body start tag. Such a mail is
+ * classified as unsigned by mail_get_mail_status(). The invalid requests are
+ * left to kmod_eval_msg().
+ */
+static int kmod_eval_is_plain_mail(struct kmod_mail *mail) {
+    int type = mail->body.type;
+    
+    if (! mail->msg_id.slen) return 0;
+    
+    if (type != K3P_MAIL_BODY_TYPE_TEXT && type != K3P_MAIL_BODY_TYPE_HTML &&
+	type != K3P_MAIL_BODY_TYPE_TEXT_N_HTML) {
+	return 0;
+    }
+    
+    if (type != K3P_MAIL_BODY_TYPE_HTML && mail_has_body_start_tag(&mail->body.text)) return 0;
+    if (type != K3P_MAIL_BODY_TYPE_TEXT && mail_has_body_start_tag(&mail->body.html)) return 0;
+    
+    return 1;
+}
+
+/* This function writes the unsigned mails rejected by kmod_eval_incoming()
+ * to the maildb. A failure is logged but not reported to the plugin: the mails
+ * will be evaluated again.
+ */
+static void kmod_flush_plain_mail(struct kmod_context *kc) {
+    
+    int i;
+    
+    if (kc->plain_mail_array.size == 0) return;
+    
+    kmod_log_msg(2, "kmod_flush_plain_mail() called.\n");
+    
+    for (i = 0; i < kc->plain_mail_array.size; i++) {
+    	kmod_status_cache_remove(kc, (kstr *) kc->plain_mail_array.data[i]);
+    }
+    
+    if (maildb_set_unsigned_mail(kc->mail_db, &kc->plain_mail_array)) {
+    	kmod_log_msg(1, "Cannot write the unsigned mails: %s.\n", kmo_strerror());
+    }
+    
+    kmo_clear_kstr_array(&kc->plain_mail_array);
+}
+
+/* This function tells the plugin that the mail specified, which was found to
+ * be unsigned by kmod_eval_is_plain_mail(), is an unsigned mail. The mail is
+ * written to the maildb later, along with the other unsigned mails.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_eval_reject_plain_mail(struct kmod_context *kc, struct kmod_mail *orig_mail) {
+    kstr *msg_id = kstr_new();
+    
+    kmod_log_msg(2, "kmod_eval_reject_plain_mail() called.\n");
+    kmo_stats_count(KMO_STAT_EVAL_FAST_REJECT);
+    
+    kstr_assign_kstr(msg_id, &orig_mail->msg_id);
+    karray_add(&kc->plain_mail_array, msg_id);
+    
+    k3p_write_inst(&kc->k3p, KMO_EVAL_STATUS);
+    k3p_write_uint32(&kc->k3p, 2);
+    return k3p_send_data(&kc->k3p);
+}
+
+/* This function evaluates an incoming message.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_eval_incoming(struct kmod_context *kc, struct kmod_mail *orig_mail) {
+    int error = 0;
+    struct kmod_eval_state state;
+    k3p_proto *k3p = &kc->k3p;
+    
+    /* Answer the unsigned mails right away. */
+    if (kmod_eval_is_plain_mail(orig_mail)) {
+    	return kmod_eval_reject_plain_mail(kc, orig_mail);
+    }
+    
+    /* The evaluation reads the previous mail info from the maildb. */
+    kmod_flush_plain_mail(kc);
+
+    /* Initialize the eval state. */
+    kmod_eval_init(&state, &kc->arena, kc->workpool, orig_mail);
+    
+    kmod_log_msg(2, "kmod_eval_incoming() called.\n");
+   
+    /* Evaluate the message. */
+    error = kmod_eval_msg(kc, &state);
+
+    if (error == 0) {
+    	struct kmod_eval_res eval_res;
+	k3p_init_eval_res(&eval_res);
+	    
+	/* Try. */
+    	do {
+	    /* Store the information in the database. */
+	    error = kmod_eval_write_maildb_info(kc, &state);
+	    if (error) break;
+	    
+	    /* Send the evaluation result to the plugin. */
+	    k3p_write_inst(k3p, KMO_EVAL_STATUS);
+	    
+	    /* The mail is an unsigned mail. */
+	    if (state.mail_info->status == 3) {
+	    	k3p_write_uint32(k3p, 2);
+	    }
+
+	    /* The mail is a Kryptiva mail. */
+	    else {
+		kmod_mail_info_2_eval_res(state.mail_info, state.subscriber_name, state.default_pwd, &eval_res, 1);
+		k3p_write_uint32(k3p, 1);
+		k3p_write_eval_res(k3p, &eval_res);
+    	    }
+	    
+	    error = k3p_send_data(k3p);
+	    if (error) break;
+	    
+	} while (0);
+	
+	k3p_free_eval_res(&eval_res);
+	
+	/* If we fail here, KMO has failed, don't attempt to recover. */
+    }
+    
+    /* An error occurred and it was reported successfully, keep interacting. */
+    else if (error == -2) {
+    	error = 0;
+    }
+    
+    /* An error occurred and it was not reported successfully, stop interacting. */
+    else {
+    	assert(error == -3);
+	error = -1;
+    }
+
+    /* Free the eval state. */
+    kmod_eval_free(&state);
+   
+    return error;
+}
+
+/* This function determines the member who signed the mail of the eval state
+ * specified, so that its signature key can be fetched before the mail is
+ * evaluated. The mails that need special handling are skipped. This function
+ * does not talk to the plugin. It returns -1 if the member is not known.
+ */
+static int kmod_eval_peek_mid(struct kmod_eval_state *state, int64_t *mid) {
+    int error = 0;
+    struct kmod_mail *mail = state->orig_mail;
+    struct kmod_crypt_sig sig;
+    kstr *text_body = NULL;
+    kstr *html_body = NULL;
+    kstr sig_text;
+    
+    if (! mail->msg_id.slen) return -1;
+    
+    if (mail->body.type == K3P_MAIL_BODY_TYPE_TEXT || mail->body.type == K3P_MAIL_BODY_TYPE_TEXT_N_HTML) {
+    	text_body = &mail->body.text;
+    }
+    
+    if (mail->body.type == K3P_MAIL_BODY_TYPE_HTML || mail->body.type == K3P_MAIL_BODY_TYPE_TEXT_N_HTML) {
+    	html_body = &mail->body.html;
+    }
+    
+    if (! text_body && ! html_body) return -1;
+    
+    /* Not a Kryptiva mail. */
+    if (mail_get_mail_status(text_body, html_body,
+    	    	    	     text_body ? kmod_eval_get_markers(state, text_body) : NULL,
+			     html_body ? kmod_eval_get_markers(state, html_body) : NULL) == 2) {
+	return -1;
+    }
+    
+    kstr_init(&sig_text);
+    
+    /* Try. */
+    do {
+	error = mail_get_signature(text_body ? text_body : html_body, &sig_text,
+	    	    	    	   kmod_eval_get_markers(state, text_body ? text_body : html_body));
+	if (error) break;
+	
+	error = kmod_sig_init(&sig, sig_text.data, sig_text.slen);
+	if (error) break;
+	
+	/* The KPG changes the servers contacted. */
+	if (kmod_sig_contain(&sig, KMO_SP_TYPE_KPG)) error = -1;
+	else *mid = kmod_sig_get_mid(&sig);
+	
+	kmod_sig_free(&sig);
+	
+    } while (0);
+    
+    kstr_free(&sig_text);
+    
+    return error ? -1 : 0;
+}
+
+/* This function fetches the signature keys of the members specified that are
+ * not cached yet, with a single batch of IKS queries, and stores them in the
+ * signature key cache. The errors are not reported here: the evaluation of the
+ * mails queries the IKS again if a key is still missing.
+ * This function sets the KMO error string. It returns 0, -2, or -3.
+ */
+static int kmod_fetch_sig_keys(struct kmod_context *kc, int64_t *mid_array, int nb_mid) {
+    int error = 0;
+    int nb_query = 0;
+    int i, j;
+    struct kmod_eval_state *state_array;
+    struct knp_query **query_array;
+    
+    kmod_log_msg(2, "kmod_fetch_sig_keys() called.\n");
+    
+    /* The keys would not be kept. */
+    if (sig_key_cache_ttl == 0 || nb_mid == 0) return 0;
+    
+    state_array = (struct kmod_eval_state *) kmo_calloc(nb_mid * sizeof(struct kmod_eval_state));
+    query_array = (struct knp_query **) kmo_calloc(nb_mid * sizeof(struct knp_query *));
+    
+    for (i = 0; i < nb_mid; i++) {
+    	struct kmod_eval_state *state = state_array + nb_query;
+	int skip_flag = 0;
+	
+	/* Fetch each key once. */
+	for (j = 0; j < nb_query && ! skip_flag; j++) {
+	    if (state_array[j].mail_info->mid == mid_array[i]) skip_flag = 1;
+	}
+	
+	if (skip_flag || kmod_sig_key_cache_lookup(kc, mid_array[i])) continue;
+	
+	kmod_eval_init(state, &kc->arena, kc->workpool, NULL);
+	state->mail_info = (maildb_mail_info *) kmo_malloc(sizeof(maildb_mail_info));
+	maildb_init_mail_info(state->mail_info);
+	state->mail_info->mid = mid_array[i];
+	
+	knp_msg_write_uint64(&state->payload, mid_array[i]);
+	query_array[nb_query] = knp_query_new(KNP_CONTACT_IKS, KNP_CMD_LOGIN_ANON, KNP_CMD_GET_SIGN_KEY,
+	    	    	    	    	      &state->payload, &kc->all_req_str);
+	nb_query++;
+    }
+    
+    kmod_log_msg(2, "Fetching %d signature keys for %d members.\n", nb_query, nb_mid);
+    
+    if (nb_query) error = knp_query_exec_batch(query_array, nb_query, &kc->knp);
+    
+    for (i = 0; i < nb_query; i++) {
+    	struct kmod_eval_state *state = state_array + i;
+	
+	if (! error && query_array[i]->res_type == KNP_RES_GET_SIGN_KEY &&
+	    kmod_eval_read_sig_key_reply(kc, state, query_array[i])) {
+	    kmod_log_msg(1, "Cannot read signature key of member %lld: %s.\n",
+	    	    	 (long long) state->mail_info->mid, kmo_strerror());
+	}
+	
+	knp_query_destroy(query_array[i]);
+	kmod_eval_free(state);
+    }
+    
+    free(state_array);
+    free(query_array);
+    
+    return error;
+}
+
+/* This function fetches the signature keys of the mails specified that are not
+ * cached yet, with a single batch of IKS queries. See kmod_fetch_sig_keys().
+ * This function sets the KMO error string. It returns 0, -2, or -3.
+ */
+static int kmod_eval_prefetch_sig_keys(struct kmod_context *kc, struct kmod_mail *mail_array, int nb_mail) {
+    int error = 0;
+    int nb_mid = 0;
+    int i;
+    int64_t *mid_array;
+    
+    kmod_log_msg(2, "kmod_eval_prefetch_sig_keys() called.\n");
+    
+    /* The keys would not be kept. */
+    if (sig_key_cache_ttl == 0) return 0;
+    
+    mid_array = (int64_t *) kmo_calloc((nb_mail + 1) * sizeof(int64_t));
+    
+    for (i = 0; i < nb_mail; i++) {
+    	struct kmod_eval_state state;
+	
+	kmod_eval_init(&state, &kc->arena, kc->workpool, mail_array + i);
+	if (! kmod_eval_peek_mid(&state, mid_array + nb_mid)) nb_mid++;
+	kmod_eval_free(&state);
     }
     
-    /* An error occurred and it was reported successfully, keep interacting. */
-    else if (error == -2) {
-    	error = 0;
-    }
+    error = kmod_fetch_sig_keys(kc, mid_array, nb_mid);
+    free(mid_array);
     
-    /* An error occurred and it was not reported successfully, stop interacting. */
-    else {
-    	assert(error == -3);
-	error = -1;
+    return error;
+}
+
+/* This function adds the member specified to the signature keys to prefetch,
+ * unless it is already there or there are too many.
+ */
+static void kmod_prefetch_add(struct kmod_context *kc, int64_t mid) {
+    int i;
+    
+    if (mid == 0 || kc->prefetch_mid_size == KMOD_PREFETCH_MAX) return;
+    
+    for (i = 0; i < kc->prefetch_mid_size; i++) {
+    	if (kc->prefetch_mid_array[i] == mid) return;
     }
     
-    /* Free the eval state and the error string. */
-    kmod_eval_free(&state);
-    kstr_free(&error_msg);
- 
-    return error;
+    kc->prefetch_mid_array[kc->prefetch_mid_size++] = mid;
 }
-                          
-/* This function evaluates an incoming message.
+
+/* This function remembers the signature keys that the plugin wants prefetched,
+ * in place of the previous ones, and replies right away. The keys are fetched
+ * by kmod_wait_for_prefetch() while the plugin is idle.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int kmod_eval_incoming(struct kmod_context *kc, struct kmod_mail *orig_mail) {
+static int kmod_prefetch_sig_keys(struct kmod_context *kc) {
     int error = 0;
-    struct kmod_eval_state state;
+    uint32_t nb_msg, nb_mid, i;
+    kstr str;
+    maildb_mail_info mail_info;
     k3p_proto *k3p = &kc->k3p;
-
-    /* Initialize the eval state. */
-    kmod_eval_init(&state, orig_mail);
     
-    kmod_log_msg(2, "kmod_eval_incoming() called.\n");
-   
-    /* Evaluate the message. */
-    error = kmod_eval_msg(kc, &state);
-
-    if (error == 0) {
-    	struct kmod_eval_res eval_res;
-	k3p_init_eval_res(&eval_res);
+    kmod_log_msg(2, "kmod_prefetch_sig_keys() called.\n");
+    
+    kstr_init(&str);
+    maildb_init_mail_info(&mail_info);
+    kc->prefetch_mid_size = 0;
+    
+    /* Try. */
+    do {
+	/* The senders of the mails already evaluated are in the maildb. Only
+	 * the valid signatures that did not go through a KPG are kept.
+	 */
+	error = k3p_read_uint32(k3p, &nb_msg);
+	if (error) break;
+	
+	for (i = 0; i < nb_msg; i++) {
+	    int lookup_error;
 	    
-	/* Try. */
-    	do {
-	    /* Store the information in the database. */
-	    error = kmod_eval_write_maildb_info(kc, &state);
+	    error = k3p_read_kstr(k3p, &str);
 	    if (error) break;
 	    
-	    /* Send the evaluation result to the plugin. */
-	    k3p_write_inst(k3p, KMO_EVAL_STATUS);
+	    lookup_error = maildb_get_mail_info_from_msg_id(kc->mail_db, &mail_info, &str);
 	    
-	    /* The mail is an unsigned mail. */
-	    if (state.mail_info->status == 3) {
-	    	k3p_write_uint32(k3p, 2);
+	    if (lookup_error == -1) {
+	    	kmod_log_msg(1, "Maildb error while finding mail: %s\n", kmo_strerror());
 	    }
-
-	    /* The mail is a Kryptiva mail. */
-	    else {
-		kmod_mail_info_2_eval_res(state.mail_info, state.subscriber_name, state.default_pwd, &eval_res);
-		k3p_write_uint32(k3p, 1);
-		k3p_write_eval_res(k3p, &eval_res);
-    	    }
 	    
-	    error = k3p_send_data(k3p);
+	    else if (lookup_error == 0 && mail_info.status == 1 && ! mail_info.kpg_port) {
+	    	kmod_prefetch_add(kc, mail_info.mid);
+	    }
+	}
+	
+	if (error) break;
+	
+	error = k3p_read_uint32(k3p, &nb_mid);
+	if (error) break;
+	
+	for (i = 0; i < nb_mid; i++) {
+	    char *end;
+	    int64_t mid;
+	    
+	    error = k3p_read_kstr(k3p, &str);
 	    if (error) break;
 	    
-	} while (0);
+	    mid = strtoll(str.data, &end, 10);
+	    if (*end == 0) kmod_prefetch_add(kc, mid);
+	}
 	
-	k3p_free_eval_res(&eval_res);
+	if (error) break;
 	
-	/* If we fail here, KMO has failed, don't attempt to recover. */
-    }
+	kmod_log_msg(2, "The plugin hinted %d signature keys.\n", kc->prefetch_mid_size);
+	
+	k3p_write_inst(k3p, K3P_COMMAND_OK);
+	error = k3p_send_data(k3p);
+	if (error) break;
+	
+    } while (0);
     
-    /* An error occurred and it was reported successfully, keep interacting. */
-    else if (error == -2) {
-    	error = 0;
-    }
+    kstr_free(&str);
+    maildb_free_mail_info(&mail_info);
     
-    /* An error occurred and it was not reported successfully, stop interacting. */
-    else {
-    	assert(error == -3);
-	error = -1;
-    }
+    return error;
+}
 
-    /* Free the eval state. */
-    kmod_eval_free(&state);
-   
+/* This function evaluates several incoming mails. The signature keys needed
+ * are fetched with a single batch of queries, then each mail is evaluated and
+ * its result is sent to the plugin as soon as it is available, tagged with its
+ * request ID.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_eval_incoming_batch(struct kmod_context *kc) {
+    int error = 0;
+    int nb_read = 0;
+    int i;
+    uint32_t nb_mail;
+    uint32_t *id_array = NULL;
+    struct kmod_mail *mail_array = NULL;
+    k3p_proto *k3p = &kc->k3p;
+    
+    kmod_log_msg(2, "kmod_eval_incoming_batch() called.\n");
+    
+    /* Try. */
+    do {
+	/* Get the mails. */
+	error = k3p_read_uint32(k3p, &nb_mail);
+	if (error) break;
+	
+	if (nb_mail > KMOD_EVAL_BATCH_MAX) {
+	    kmod_log_msg(1, "Invalid request: too many mails in batch (%u).\n", nb_mail);
+	    kmod_handle_invalid_request(k3p);
+	    error = -1;
+	    break;
+	}
+	
+	id_array = (uint32_t *) kmo_calloc((nb_mail + 1) * sizeof(uint32_t));
+	mail_array = (struct kmod_mail *) kmo_calloc((nb_mail + 1) * sizeof(struct kmod_mail));
+	
+	for (nb_read = 0; nb_read < (int) nb_mail; nb_read++) {
+	    k3p_init_mail(mail_array + nb_read);
+	    
+	    error = k3p_read_uint32(k3p, id_array + nb_read);
+	    if (error) break;
+	    
+	    error = k3p_read_mail(k3p, mail_array + nb_read);
+	    if (error) break;
+	}
+	
+	/* Count the mail being read. */
+	if (error) {
+	    nb_read++;
+	    break;
+	}
+	
+	/* Fetch the signature keys of all the mails at once. */
+	error = kmod_eval_prefetch_sig_keys(kc, mail_array, nb_mail);
+	
+	/* The plugin aborted. */
+	if (error == -2) {
+	    error = 0;
+	    break;
+	}
+	
+	if (error) {
+	    error = -1;
+	    break;
+	}
+	
+	/* Evaluate the mails. The tag is sent along with the reply. */
+	for (i = 0; i < (int) nb_mail; i++) {
+	    k3p_write_inst(k3p, KMO_EVAL_BATCH_RESULT);
+	    k3p_write_uint32(k3p, id_array[i]);
+	    
+	    error = kmod_eval_incoming(kc, mail_array + i);
+	    kmod_disable_kpg(kc);
+	    if (error) break;
+	}
+	
+    } while (0);
+    
+    for (i = 0; i < nb_read; i++) k3p_free_mail(mail_array + i);
+    free(mail_array);
+    free(id_array);
+    
     return error;
 }
 
@@ -3599,12 +5152,11 @@ static int kmod_mark_unsigned_mail(struct kmod_context *kc) {
     int i;
     uint32_t nb_mail;
     k3p_proto *k3p = &kc->k3p;
-    maildb_mail_info mail_info;
+    karray msg_id_array;
     
     kmod_log_msg(2, "kmod_mark_unsigned_mail() called.\n");
     
-    maildb_init_mail_info(&mail_info);
-    mail_info.status = 3;
+    karray_init(&msg_id_array);
     
     /* Try. */
     do {    
@@ -3612,23 +5164,28 @@ static int kmod_mark_unsigned_mail(struct kmod_context *kc) {
 	error = k3p_read_uint32(k3p, &nb_mail);
 	if (error) break;
 
-	/* Get the IDs and set their statuses in the DB. */
+	/* Get the IDs. */
 	for (i = 0; i < (int) nb_mail; i++) {
-	    error = k3p_read_kstr(k3p, &mail_info.msg_id);
+	    kstr *msg_id = kstr_new();
+	    karray_add(&msg_id_array, msg_id);
+	    
+	    error = k3p_read_kstr(k3p, msg_id);
 	    if (error) break;
 	    
-	    if (mail_info.msg_id.slen == 0) {
+	    if (msg_id->slen == 0) {
 	    	kmo_seterror("empty message ID");
 		error = -1;
 		break;
 	    }
-	    
-	    error = maildb_set_mail_info(kc->mail_db, &mail_info);
-	    if (error) break;
 	}
 	
 	if (error) break;
 	
+	/* Set their statuses in the DB. */
+	for (i = 0; i < msg_id_array.size; i++) kmod_status_cache_remove(kc, (kstr *) msg_id_array.data[i]);
+	error = maildb_set_unsigned_mail(kc->mail_db, &msg_id_array);
+	if (error) break;
+	
 	/* Tell the plugin that we did it. */
 	k3p_write_inst(k3p, KMO_MARK_UNSIGNED_MAIL);
     	error = k3p_send_data(k3p);
@@ -3636,7 +5193,8 @@ static int kmod_mark_unsigned_mail(struct kmod_context *kc) {
 	
     } while (0);
 
-    maildb_free_mail_info(&mail_info);
+    for (i = 0; i < msg_id_array.size; i++) kstr_destroy((kstr *) msg_id_array.data[i]);
+    karray_free(&msg_id_array);
     
     return error;
 }
@@ -3704,7 +5262,7 @@ static int kmod_set_display_pref(struct kmod_context *kc) {
 	    /* Very well, change the status. */
 	    else {
 	    	mail_info.display_pref = display_pref;
-		error = maildb_set_mail_info(kc->mail_db, &mail_info);
+		error = kmod_set_mail_info(kc, &mail_info);
 		if (error) break;
 		
 		k3p_write_inst(k3p, KMO_SET_DISPLAY_PREF_ACK);
@@ -3751,20 +5309,28 @@ static int kmod_get_eval_status_send_status(struct kmod_context *kc, maildb_mail
 	struct kmod_eval_res eval_res;
 	k3p_init_eval_res(&eval_res);
 	
-	kmod_check_otut_info_integrity(mail_info);
-	
 	/* Try. */
 	do {
 	    /* Full status. */
 	    if (full_flag) {
 	    
+		/* The OTUT string is rarely present. Load it only when the
+		 * mail has an OTUT to check.
+		 */
+		if (mail_info->otut_status == KMO_OTUT_STATUS_USABLE || mail_info->otut_status == KMO_OTUT_STATUS_USED) {
+		    error = maildb_load_mail_info(kc->mail_db, mail_info, MAILDB_FIELD_OTUT);
+		    if (error) break;
+		}
+		
+		kmod_check_otut_info_integrity(mail_info);
+	    
 		/* Tell the plugin that this is a Kryptiva mail. */
 		k3p_write_uint32(k3p, 1);
 
 		/* Fill up 'eval_res'. We cannot get passwords from the database here,
 		 * since we don't have the from address.
 		 */
-		kmod_mail_info_2_eval_res(mail_info, &sender_info->name, NULL, &eval_res);
+		kmod_mail_info_2_eval_res(mail_info, &sender_info->name, NULL, &eval_res, 0);
 	    
 		/* Send 'eval_res' to the plugin. */
 		k3p_write_eval_res(k3p, &eval_res);
@@ -3787,22 +5353,30 @@ static int kmod_get_eval_status_send_status(struct kmod_context *kc, maildb_mail
 
 /* This function evaluates the status of messages and returns the results
  * to the plugin (either the complete statuses or just the "string" statuses).
+ * The statuses are looked up MAILDB_BATCH_SIZE messages at a time, and each
+ * batch of results is sent as soon as it is ready.
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int kmod_get_eval_status(struct kmod_context *kc, int full_flag) {
     int eval_cnt;
     int error = 0;
-    int i;
+    int i, start;
     k3p_proto *k3p = &kc->k3p;
     karray id_array;
-    maildb_mail_info mail_info;
-    maildb_sender_info sender_info;
+    karray entry_array;
+    karray miss_array;
+    karray batch_id_array;
+    karray mail_info_array;
+    karray sender_info_array;
     
     kmod_log_msg(2, "kmod_get_eval_status() called.\n");
     
     karray_init(&id_array);
-    maildb_init_mail_info(&mail_info);
-    maildb_init_sender_info(&sender_info);
+    karray_init(&entry_array);
+    karray_init(&miss_array);
+    karray_init(&batch_id_array);
+    karray_init(&mail_info_array);
+    karray_init(&sender_info_array);
 
     /* Try. */
     do {
@@ -3835,61 +5409,121 @@ static int kmod_get_eval_status(struct kmod_context *kc, int full_flag) {
 	/* Write back the evaluation results. */
 	k3p_write_inst(k3p, full_flag ? KMO_EVAL_STATUS : KMO_STRING_STATUS);
 	
-	for (i = 0; i < eval_cnt; i++) {
-	    kstr *id_str = (kstr *) id_array.data[i];
-   
-	    /* Get the information from the database. */
-	    maildb_clear_sender_info(&sender_info);
-	    error = maildb_get_mail_info_from_msg_id(kc->mail_db, &mail_info, id_str);
+	for (start = 0; start < eval_cnt; start += MAILDB_BATCH_SIZE) {
+	    int batch_cnt = MIN(eval_cnt - start, MAILDB_BATCH_SIZE);
+	    int cache_flag = 1;
+	    
+	    /* Prepare the batch. The statuses cached in memory are used as they
+	     * are, the others are looked up in the database.
+	     */
+	    entry_array.size = 0;
+	    miss_array.size = 0;
+	    batch_id_array.size = mail_info_array.size = sender_info_array.size = 0;
 	    
-	    /* Get the server info if required and if no error occurred. */
-	    if (! error && mail_info.status == 1) {
-	    	error = maildb_get_sender_info(kc->mail_db, &sender_info, mail_info.mid);
+	    for (i = 0; i < batch_cnt; i++) {
+	    	kstr *msg_id = (kstr *) id_array.data[start + i];
+		struct kmod_status_entry *entry = kmod_status_cache_lookup(kc, msg_id, full_flag);
 		
-		/* Not found? Shouldn't happen. */
-		if (error == -2) {
-		    kmo_seterror("cannot find sender info");
-		    error = -1;
+		if (entry) {
+		    kmo_stats_count(KMO_STAT_STATUS_CACHE_HIT);
+		}
+		
+		else {
+		    kmo_stats_count(KMO_STAT_STATUS_CACHE_MISS);
+		    entry = kmod_status_entry_new(msg_id);
+		    karray_add(&miss_array, entry);
+		    karray_add(&batch_id_array, msg_id);
+		    karray_add(&mail_info_array, &entry->mail_info);
+		    karray_add(&sender_info_array, &entry->sender_info);
 		}
 		
-		assert(error == 0 || error == -1);
+		karray_add(&entry_array, entry);
 	    }
 	    
-	    /* An error occurred. Log the error. Pretend the information is not there. */
-	    if (error == -1) {
-	    	kmod_log_msg(1, "Maildb error while finding mail: %s\n", kmo_strerror()); 
-		error = kmod_get_eval_status_send_status(kc, NULL, NULL, full_flag);
-		if (error) break;
+	    /* Get the information from the database. If an error occurs, log
+	     * the error and pretend the information is not there.
+	     */
+	    if (batch_id_array.size &&
+	    	maildb_get_mail_info_batch(kc->mail_db, &batch_id_array, &mail_info_array, &sender_info_array,
+	    	    	    	    	   full_flag ? KMOD_FULL_STATUS_FIELDS : KMOD_STRING_STATUS_FIELDS)) {
+	    	kmod_log_msg(1, "Maildb error while finding mail: %s\n", kmo_strerror());
+		cache_flag = 0;
+		
+		for (i = 0; i < miss_array.size; i++)
+		    ((struct kmod_status_entry *) miss_array.data[i])->mail_info.entry_id = 0;
 	    }
-
-	    /* The information is not in the database.*/
-	    else if (error == -2) {
-	    	error = kmod_get_eval_status_send_status(kc, NULL, NULL, full_flag);
+	    
+	    /* The lookup clears the message IDs of the mail info objects, which
+	     * are the keys of the cache entries.
+	     */
+	    for (i = 0; i < miss_array.size; i++) {
+	    	struct kmod_status_entry *entry = (struct kmod_status_entry *) miss_array.data[i];
+		kstr_assign_kstr(&entry->mail_info.msg_id, (kstr *) batch_id_array.data[i]);
+	    }
+	    
+	    for (i = 0; i < batch_cnt; i++) {
+	    	struct kmod_status_entry *entry = (struct kmod_status_entry *) entry_array.data[i];
+	    	maildb_mail_info *mail_info = &entry->mail_info;
+		maildb_sender_info *sender_info = &entry->sender_info;
+		
+		/* The information is not in the database.*/
+		if (mail_info->entry_id == 0) {
+		    error = kmod_get_eval_status_send_status(kc, NULL, NULL, full_flag);
+		}
+		
+		/* The sender info is missing. Shouldn't happen. */
+		else if (mail_info->status == 1 && sender_info->mid == 0) {
+		    kmod_log_msg(1, "Maildb error while finding mail: cannot find sender info\n");
+		    error = kmod_get_eval_status_send_status(kc, NULL, NULL, full_flag);
+		}
+		
+		/* The information is in the database.*/
+		else {
+		    error = kmod_get_eval_status_send_status(kc, mail_info, sender_info, full_flag);
+		}
+		
 		if (error) break;
 	    }
-
-	    /* The information is in the database.*/
-	    else {
-	    	assert(error == 0);
-		error = kmod_get_eval_status_send_status(kc, &mail_info, &sender_info, full_flag);
-		if (error) break;		
+	    
+	    /* Cache the statuses looked up, once the whole batch has been
+	     * written, so that no entry of the batch is evicted before it is
+	     * used.
+	     */
+	    for (i = 0; i < miss_array.size; i++) {
+	    	struct kmod_status_entry *entry = (struct kmod_status_entry *) miss_array.data[i];
+		
+		if (cache_flag && ! error) kmod_status_cache_add(kc, entry);
+		else kmod_status_entry_destroy(entry);
 	    }
+	    
+	    miss_array.size = 0;
+	    
+	    if (error) break;
+	    
+	    /* Send this batch while we look up the next one. */
+	    error = k3p_send_data(k3p);
+	    if (error) break;
 	}
 	
 	if (error) break;
 	
-	error = k3p_send_data(k3p);
-	if (error) break;
+	/* Send the instruction alone if there was no ID. */
+	if (eval_cnt == 0) {
+	    error = k3p_send_data(k3p);
+	    if (error) break;
+	}
 	
     } while (0);
     
-    maildb_free_sender_info(&sender_info);
-    maildb_free_mail_info(&mail_info);
-    
     for (i = 0; i < id_array.size; i++)
     	kstr_destroy((kstr *) id_array.data[i]);
     
     karray_free(&id_array);
+    karray_free(&entry_array);
+    karray_free(&miss_array);
+    karray_free(&batch_id_array);
+    karray_free(&mail_info_array);
+    karray_free(&sender_info_array);
 
     return error;
 }
@@ -3951,6 +5585,11 @@ struct kmod_pkg_state {
     /* Mail to package. Memory not owned by this object. */
     struct kmod_mail *orig_mail;
     
+    /* Arena of the K3P command. The strings, the attachments, the recipients
+     * and the passwords of this object are allocated in it.
+     */
+    karena *arena;
+    
     /* Number of passwords required for encryption. */
     int nb_pwd_needed;
     
@@ -3974,14 +5613,24 @@ struct kmod_pkg_state {
     /* Attachment array. */
     karray *att_array;
     
+    /* Attachment files referenced by the package payload (struct
+     * knp_file_ref). Their content is streamed from the disk when the payload
+     * is sent.
+     */
+    karray *file_ref_array;
+    
     /* OTUT mail. */
     maildb_mail_info *otut_mail;
     
     /* OTUT ticket. */
     kstr *otut_ticket;
     
-    /* Server package query output. */
-    kstr *pkg_output;
+    /* Server package query output. It points inside 'pkg_res_payload', which
+     * is taken from the query so that the output is not copied.
+     */
+    char *pkg_output;
+    uint32_t pkg_output_len;
+    kbuffer *pkg_res_payload;
     
     /* KSN of the packaged mail. */
     kstr *pkg_ksn;
@@ -3997,10 +5646,12 @@ struct kmod_pkg_state {
 };
 
 /* This function initializes the kmod_pkg_state object. */
-static void kmod_package_init(struct kmod_pkg_state *state, uint32_t pack_type, struct kmod_mail *orig_mail) {
+static void kmod_package_init(struct kmod_pkg_state *state, karena *arena, uint32_t pack_type,
+    	    	    	      struct kmod_mail *orig_mail) {
     memset(state, 0, sizeof(struct kmod_pkg_state));
     state->pack_type = pack_type;
     state->orig_mail = orig_mail;
+    state->arena = arena;
     karray_init(&state->pwd_array);
     khash_init_func(&state->pwd_hash, khash_cstr_key, khash_cstr_cmp);
     kbuffer_init(&state->payload, 200);
@@ -4011,30 +5662,16 @@ static void kmod_package_init(struct kmod_pkg_state *state, uint32_t pack_type,
 static void kmod_package_free(struct kmod_pkg_state *state) {
     int i;
     
+    /* The addresses come from the address parser, not from the arena. */
     for (i = 0; i < state->nb_rec; i++) {
-    	struct kmod_pkg_rec *rec = &state->rec_array[i];
-	kstr_destroy(rec->addr);
-	kstr_destroy(rec->key);
-	kstr_destroy(rec->pwd);
-    }
-    
-    free(state->rec_array);
-    
-    for (i = 0; i < state->pwd_array.size; i++) {
-    	struct kmod_pkg_pwd *pkg_pwd = (struct kmod_pkg_pwd *) state->pwd_array.data[i];
-	kstr_destroy(pkg_pwd->otut);
-    	free(pkg_pwd);
+	kstr_destroy(state->rec_array[i].addr);
     }
     
     karray_free(&state->pwd_array);
     khash_free(&state->pwd_hash); 
-    kmod_free_attachment_array(state->att_array);
-    kstr_destroy(state->otut_ticket);
     maildb_free_mail_info(state->otut_mail);
     free(state->otut_mail);
-    kstr_destroy(state->pkg_output);
-    kstr_destroy(state->pkg_ksn);
-    kstr_destroy(state->pkg_key);
+    kbuffer_destroy(state->pkg_res_payload);
     kbuffer_clean(&state->payload);
     kstr_free(&state->str);
 }
@@ -4045,7 +5682,9 @@ static void kmod_package_free(struct kmod_pkg_state *state) {
 static int kmod_pkg_send_pkg_output(k3p_proto *k3p, struct kmod_pkg_state *state) {
     int error = 0;
     struct kmod_mail_body body;
+    krope encrypted_body;
     k3p_init_mail_body(&body);
+    krope_init(&encrypted_body, 0);
     
     kmod_log_msg(2, "kmod_pkg_send_pkg_output() called.\n");
     
@@ -4054,31 +5693,43 @@ static int kmod_pkg_send_pkg_output(k3p_proto *k3p, struct kmod_pkg_state *state
 	/* If it's a signature, put the signature in both mail bodies. */
 	if (state->pack_type == KPP_SIGN_MAIL) {
 	    body.type = state->orig_mail->body.type;
+	    kstr_assign_buf(&state->str, state->pkg_output, state->pkg_output_len);
 
 	    if (state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_TEXT ||
 		state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_TEXT_N_HTML) {
 
 		mail_build_signed_text_body(state->pack_type, &state->orig_mail->body.text,
-		    	    	    	    state->pkg_output, &body.text);
+		    	    	    	    &state->str, &body.text);
 	    }
 
 	    if (state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_HTML ||
 		state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_TEXT_N_HTML) {
 
 		mail_build_signed_html_body(state->pack_type, &state->orig_mail->body.html,
-		    	    	    	    state->pkg_output, &body.html);
+		    	    	    	    &state->str, &body.html);
 	    }
 	}
 
-	/* It's a full encrypted body. */
+	/* It's a full encrypted body. The package output is sent from the reply
+	 * of the server, without being copied in the body.
+	 */
 	else {
     	    body.type = K3P_MAIL_BODY_TYPE_TEXT;
-	    mail_build_encrypted_body(state->pack_type, state->pkg_output, &body.text);
+	    mail_build_encrypted_body(state->pack_type, state->pkg_output, state->pkg_output_len, &encrypted_body);
 	}
 	
 	/* Finally, send the output to the plugin. */
 	k3p_write_inst(k3p, KMO_PACK_ACK);
-	k3p_write_mail_body(k3p, &body);
+	
+	if (encrypted_body.len) {
+	    k3p_write_uint32(k3p, body.type);
+	    k3p_write_krope_ref(k3p, &encrypted_body);
+	    k3p_write_kstr(k3p, &body.html);
+	}
+	
+	else {
+	    k3p_write_mail_body(k3p, &body);
+	}
 	
 	if (k3p_send_data(k3p)) {
 	    error = -3;
@@ -4088,6 +5739,7 @@ static int kmod_pkg_send_pkg_output(k3p_proto *k3p, struct kmod_pkg_state *state
     } while (0);
 
     k3p_free_mail_body(&body);
+    krope_clean(&encrypted_body);
     
     return error;
 }
@@ -4111,7 +5763,7 @@ static int kmod_pkg_write_sym_key(struct kmod_context *kc, struct kmod_pkg_state
     	mail_info.status = 2;
 	kstr_assign_kstr(&mail_info.ksn, state->pkg_ksn);
 	kstr_assign_kstr(&mail_info.sym_key, state->pkg_key);
-	error = maildb_set_mail_info(kc->mail_db, &mail_info);
+	error = kmod_set_mail_info(kc, &mail_info);
 	if (error) break;
 	
     } while (0);
@@ -4136,6 +5788,7 @@ static int kmod_pkg_do_output_query(struct kmod_context *kc, struct kmod_pkg_sta
     
     /* Contact the KPS or the OPS to package the mail. */
     query = knp_query_new(contact, login_type, KNP_CMD_PACKAGE_MAIL, &state->payload, &kc->all_req_str);
+    query->cmd_file_array = state->file_ref_array;
     
     if (login_type == KNP_CMD_LOGIN_OTUT) {
     	query->login_otut = kstr_new();
@@ -4165,7 +5818,7 @@ static int kmod_pkg_do_output_query(struct kmod_context *kc, struct kmod_pkg_sta
 		/* Update the status of the OTUT mail in the database. */
 		state->otut_mail->otut_status = KMO_OTUT_STATUS_ERROR;
 		kstr_assign_cstr(&state->otut_mail->otut_msg, "server refused token");
-		error = maildb_set_mail_info(kc->mail_db, state->otut_mail);
+		error = kmod_set_mail_info(kc, state->otut_mail);
 		
 		/* We can't handle DB errors. */
 		if (error) { error = -3; break; }
@@ -4202,13 +5855,14 @@ static int kmod_pkg_do_output_query(struct kmod_context *kc, struct kmod_pkg_sta
 	    break;
 	}
 	
-	/* Get the packaging output. */
-	state->pkg_output = kstr_new();
-	error = knp_msg_read_kstr(query->res_payload, state->pkg_output);
+	/* Get the packaging output. The encrypted body can be large, hence it
+	 * is left in the reply payload.
+	 */
+	error = knp_msg_read_str_view(query->res_payload, &state->pkg_output, &state->pkg_output_len);
 	if (error) { convert_flag = 1; break; }
 	
 	/* Get the KSN. */
-	state->pkg_ksn = kstr_new();
+	state->pkg_ksn = karena_kstr_new(state->arena);
 	error = knp_msg_read_kstr(query->res_payload, state->pkg_ksn);
 	if (error) { convert_flag = 1; break; }
 	
@@ -4220,7 +5874,7 @@ static int kmod_pkg_do_output_query(struct kmod_context *kc, struct kmod_pkg_sta
 	}
 	
 	/* Get the symmetric key. */
-	state->pkg_key = kstr_new();
+	state->pkg_key = karena_kstr_new(state->arena);
 	error = knp_msg_read_kstr(query->res_payload, state->pkg_key);
 	if (error) { convert_flag = 1; break; }
 	
@@ -4230,7 +5884,7 @@ static int kmod_pkg_do_output_query(struct kmod_context *kc, struct kmod_pkg_sta
 	    /* Update the status of the OTUT mail in the database. */
 	    state->otut_mail->otut_status = KMO_OTUT_STATUS_USED;
 	    format_time(time(NULL), &state->otut_mail->otut_msg);
-	    error = maildb_set_mail_info(kc->mail_db, state->otut_mail);
+	    error = kmod_set_mail_info(kc, state->otut_mail);
 	    
 	    /* We can't handle DB errors. */
 	    if (error) { error = -3; break; }
@@ -4243,6 +5897,12 @@ static int kmod_pkg_do_output_query(struct kmod_context *kc, struct kmod_pkg_sta
     	error = kmod_convert_to_serv_error(k3p, query);
     }
     
+    /* Keep the reply payload, which holds the packaging output. */
+    else if (! error) {
+    	kbuffer_destroy(state->pkg_res_payload);
+	state->pkg_res_payload = knp_query_take_res_payload(query);
+    }
+    
     knp_query_destroy(query);
     return error;
 }
@@ -4251,6 +5911,7 @@ static int kmod_pkg_do_output_query(struct kmod_context *kc, struct kmod_pkg_sta
  * This function sets the KMO error string. It returns 0, -1, -2, or -3.
  */
 static int kmod_pkg_get_pkg_output(struct kmod_context *kc, struct kmod_pkg_state *state) {
+    int error = 0;
     int i;
     uint32_t pkg_type = 0;
     kstr stripped_html_body;
@@ -4259,6 +5920,7 @@ static int kmod_pkg_get_pkg_output(struct kmod_context *kc, struct kmod_pkg_stat
     
     /* Build the message payload. */
     kbuffer_clear(&state->payload);
+    state->file_ref_array = karena_karray_new(state->arena);
     
     switch (state->pack_type) {
     	case KPP_SIGN_MAIL:
@@ -4284,12 +5946,10 @@ static int kmod_pkg_get_pkg_output(struct kmod_context *kc, struct kmod_pkg_stat
     knp_msg_write_uint32(&state->payload, kc->mua.lang);
     
     /* The TO and CC strings need to be cleaned up. */
-    kstr_assign_kstr(&state->str, &state->orig_mail->to);
-    kmod_cleanup_signable_to_cc(&state->str);
+    kmod_cleanup_signable_to_cc(&state->str, &state->orig_mail->to, 0);
     knp_msg_write_kstr(&state->payload, &state->str);
     
-    kstr_assign_kstr(&state->str, &state->orig_mail->cc);
-    kmod_cleanup_signable_to_cc(&state->str);
+    kmod_cleanup_signable_to_cc(&state->str, &state->orig_mail->cc, 0);
     knp_msg_write_kstr(&state->payload, &state->str);
     
     knp_msg_write_uint32(&state->payload, state->nb_rec);
@@ -4374,9 +6034,7 @@ static int kmod_pkg_get_pkg_output(struct kmod_context *kc, struct kmod_pkg_stat
 	{
 	    kstr_assign_kstr(&str, &state->orig_mail->body.text);
 	    kmod_trim_whitespace(&str);
-	    fprintf(kmod_log, "SENDING: dumping signed text body:\n");
-    	    util_dump_buf_ascii(str.data, str.slen, kmod_log);
-    	    fprintf(kmod_log, "END END END.\n\n");
+	    kmod_dump_body("SENDING: dumping signed text body", &str);
 	}
 	
 	if (state->orig_mail->body.type == K3P_MAIL_BODY_TYPE_HTML ||
@@ -4384,9 +6042,7 @@ static int kmod_pkg_get_pkg_output(struct kmod_context *kc, struct kmod_pkg_stat
 	{
 	    kstr_assign_kstr(&str, &stripped_html_body);
 	    kmod_trim_whitespace(&str);
-	    fprintf(kmod_log, "SENDING: dumping signed HTML body:\n");
-    	    util_dump_buf_ascii(str.data, str.slen, kmod_log);
-    	    fprintf(kmod_log, "END END END.\n\n");
+	    kmod_dump_body("SENDING: dumping signed HTML body", &str);
 	}
 	
 	kstr_free(&str);
@@ -4415,13 +6071,35 @@ static int kmod_pkg_get_pkg_output(struct kmod_context *kc, struct kmod_pkg_stat
 	knp_msg_write_kstr(&state->payload, att->encoding);
 	knp_msg_write_kstr(&state->payload, att->mime_type);
 	knp_msg_write_kstr(&state->payload, att->name);
-	knp_msg_write_kstr(&state->payload, att->data);
 	
-	/* Flush the data to save memory. */
-	kstr_destroy(att->data);
-	att->data = NULL;
+	/* The content of the file is sent from the disk. */
+	if (att->data_is_file_path) {
+	    struct knp_file_ref *ref = (struct knp_file_ref *) karena_calloc(state->arena, sizeof(struct knp_file_ref));
+	    FILE *file = NULL;
+	    int file_size = 0;
+	    
+	    error = util_open_file(&file, att->data->data, "rb");
+	    if (error) break;
+	    
+	    error = util_get_file_size(file, &file_size);
+	    util_close_file(&file, 1);
+	    if (error) break;
+	    
+	    knp_msg_write_file_ref(&state->payload, ref, att->data, file_size);
+	    karray_add(state->file_ref_array, ref);
+	}
+	
+	else {
+	    knp_msg_write_kstr(&state->payload, att->data);
+	
+	    /* Flush the data to save memory. */
+	    kstr_shrink(att->data, 0);
+	    att->data = NULL;
+	}
     }
     
+    if (error) return -1;
+    
     /* Write the PoD return address if required. */
     if (pkg_type & KNP_PKG_TYPE_POD) {
     	
@@ -4512,7 +6190,7 @@ static int kmod_pkg_get_otut_string(struct kmod_context *kc, struct kmod_pkg_sta
 	
 	for (i = 0; i < state->pwd_array.size; i++) {
 	    struct kmod_pkg_pwd *pkg_pwd = (struct kmod_pkg_pwd *) state->pwd_array.data[i];
-	    pkg_pwd->otut = kstr_new();
+	    pkg_pwd->otut = karena_kstr_new(state->arena);
 	    error = knp_msg_read_kstr(query->res_payload, pkg_pwd->otut);
 	    if (error) { convert_flag = 1; break; }
 	}
@@ -4578,7 +6256,7 @@ static int kmod_pkg_get_otut_ticket(struct kmod_context *kc, struct kmod_pkg_sta
 	    break;
 	}
 
-    	state->otut_ticket = kstr_new();
+    	state->otut_ticket = karena_kstr_new(state->arena);
 
     	if (knp_msg_read_kstr(query->res_payload, state->otut_ticket)) {
 	    error = kmod_convert_to_serv_error(k3p, query);
@@ -4629,7 +6307,7 @@ static int kmod_pkg_recv_pwd(struct kmod_context *kc, struct kmod_pkg_state *sta
 		if (! rec->key_flag && ! rec->ref_flag && kstr_equal_kstr(rec->addr, &rp.recipient)) {
 		    struct kmod_pkg_pwd *pkg_pwd; 
 		    rec->ref_flag = 1;
-		    rec->pwd = kstr_new();
+		    rec->pwd = karena_kstr_new(state->arena);
 		    kstr_assign_kstr(rec->pwd, &rp.password);
 		    rec->give_otut = rp.give_otut;
 		    rec->save_pwd = rp.save_pwd;
@@ -4640,7 +6318,7 @@ static int kmod_pkg_recv_pwd(struct kmod_context *kc, struct kmod_pkg_state *sta
 		    pkg_pwd = (struct kmod_pkg_pwd *) khash_get(&state->pwd_hash, rec->pwd->data);
 
 		    if (pkg_pwd == NULL) {
-			pkg_pwd = (struct kmod_pkg_pwd *) kmo_calloc(sizeof(struct kmod_pkg_pwd));
+			pkg_pwd = (struct kmod_pkg_pwd *) karena_calloc(state->arena, sizeof(struct kmod_pkg_pwd));
 			pkg_pwd->pwd = rec->pwd;
 			khash_add(&state->pwd_hash, rec->pwd->data, pkg_pwd);
 			karray_add(&state->pwd_array, pkg_pwd);
@@ -4737,48 +6415,51 @@ static int kmod_pkg_ask_pwd(struct kmod_context *kc, struct kmod_pkg_state *stat
     }
 }
 
-/* This function does the query to ask the server about the recipient addresses.
- * This function sets the KMO error string. It returns 0, -2, or -3.
+/* This function creates the query asking the server about the recipient
+ * addresses that must be sent to the contact specified. The command payload of
+ * the query is written in 'payload'.
  */
-static int kmod_pkg_do_rec_addr_query(struct kmod_context *kc, struct kmod_pkg_state *state, int contact,
-                                      int input_nb) {
-    int error = 0;
-    int convert_flag = 0;
+static struct knp_query * kmod_pkg_new_rec_addr_query(struct kmod_context *kc, struct kmod_pkg_state *state,
+    	    	    	    	    	    	      int contact, int input_nb, kbuffer *payload) {
     int i;
-    uint32_t output_nb;
-    struct knp_query *query = NULL;
+    uint32_t output_nb = 0;
     
-    kmod_log_msg(2, "kmod_pkg_do_rec_addr_query() called.\n");
-    
-    /* Ask the server about the recipient addresses. */
-    kbuffer_clear(&state->payload);
-    knp_msg_write_uint32(&state->payload, input_nb);
-    output_nb = 0;
+    knp_msg_write_uint32(payload, input_nb);
     
     for (i = 0; i < state->nb_rec; i++) {
     	if (contact == state->rec_array[i].contact) {
 	    output_nb++;
 	    
 	    if (kc->enc_key_lookup_str.slen) {
-		knp_msg_write_kstr(&state->payload, &kc->enc_key_lookup_str);
+		knp_msg_write_kstr(payload, &kc->enc_key_lookup_str);
 	    }
 	    
 	    else {
-		knp_msg_write_kstr(&state->payload, state->rec_array[i].addr);
+		knp_msg_write_kstr(payload, state->rec_array[i].addr);
 	    }
 	}
     }
     
     assert(input_nb == (int) output_nb);
-       
-    query = knp_query_new(contact, KNP_CMD_LOGIN_ANON, KNP_CMD_GET_ENC_KEY, &state->payload, 
-                          &kc->all_req_str);
+    
+    return knp_query_new(contact, KNP_CMD_LOGIN_ANON, KNP_CMD_GET_ENC_KEY, payload, &kc->all_req_str);
+}
+
+/* This function processes the result of the query asking the server about the
+ * recipient addresses.
+ * This function sets the KMO error string. It returns 0, -2, or -3.
+ */
+static int kmod_pkg_handle_rec_addr_reply(struct kmod_context *kc, struct kmod_pkg_state *state,
+    	    	    	    	    	  struct knp_query *query, int contact, int input_nb) {
+    int error = 0;
+    int convert_flag = 0;
+    int i;
+    uint32_t output_nb;
+    
+    kmod_log_msg(2, "kmod_pkg_handle_rec_addr_reply() called.\n");
     
     /* Try. */
     do {
-    	error = knp_query_exec(query, &kc->knp);
-	if (error) break;
-	
 	if (query->res_type == KNP_RES_SERV_ERROR) {
 	    error = kmod_handle_server_error(&kc->k3p, query);
 	    break;
@@ -4822,7 +6503,7 @@ static int kmod_pkg_do_rec_addr_query(struct kmod_context *kc, struct kmod_pkg_s
 	    /* The server knows about this address. */
 	    if (state->str.slen) {
 		rec->key_flag = 1;
-		rec->key = kstr_new();
+		rec->key = karena_kstr_new(state->arena);
 		kstr_assign_kstr(rec->key, &state->str);
 	    }
 
@@ -4842,7 +6523,6 @@ static int kmod_pkg_do_rec_addr_query(struct kmod_context *kc, struct kmod_pkg_s
     	error = kmod_convert_to_serv_error(&kc->k3p, query);
     }
 
-    knp_query_destroy(query);
     return error;
 }
 
@@ -4853,6 +6533,11 @@ static int kmod_pkg_do_rec_addr_query(struct kmod_context *kc, struct kmod_pkg_s
 static int kmod_pkg_check_rec_addr(struct kmod_context *kc, struct kmod_pkg_state *state) {
     int nb_insider = 0;
     int nb_outsider = 0;
+    int nb_query = 0;
+    int contact_array[2];
+    int input_nb_array[2];
+    kbuffer payload_array[2];
+    struct knp_query *query_array[2];
     int i;
     
     kmod_log_msg(2, "kmod_pkg_check_rec_addr() called.\n");
@@ -4887,13 +6572,39 @@ static int kmod_pkg_check_rec_addr(struct kmod_context *kc, struct kmod_pkg_stat
     
     /* If there are some insiders, query the KPS about those addresses. */
     if (nb_insider) {
-    	int error = kmod_pkg_do_rec_addr_query(kc, state, KNP_CONTACT_KPS, nb_insider); 
-	if (error) return error;
+    	contact_array[nb_query] = KNP_CONTACT_KPS;
+	input_nb_array[nb_query] = nb_insider;
+	nb_query++;
     }
     
     /* If there are some outsiders, query the EKS about those addresses. */
     if (nb_outsider) {
-    	int error = kmod_pkg_do_rec_addr_query(kc, state, KNP_CONTACT_EKS, nb_outsider);
+    	contact_array[nb_query] = KNP_CONTACT_EKS;
+	input_nb_array[nb_query] = nb_outsider;
+	nb_query++;
+    }
+    
+    /* The queries are pipelined if they go to the same server. */
+    if (nb_query) {
+    	int error = 0;
+	
+	for (i = 0; i < nb_query; i++) {
+	    kbuffer_init(&payload_array[i], 100);
+	    query_array[i] = kmod_pkg_new_rec_addr_query(kc, state, contact_array[i], input_nb_array[i],
+	    	    	    	    	    	    	 &payload_array[i]);
+	}
+	
+	error = knp_query_exec_batch(query_array, nb_query, &kc->knp);
+	
+	for (i = 0; i < nb_query && ! error; i++) {
+	    error = kmod_pkg_handle_rec_addr_reply(kc, state, query_array[i], contact_array[i], input_nb_array[i]);
+	}
+	
+	for (i = 0; i < nb_query; i++) {
+	    knp_query_destroy(query_array[i]);
+	    kbuffer_clean(&payload_array[i]);
+	}
+	
 	if (error) return error;
     }
     
@@ -4992,7 +6703,7 @@ static int kmod_pkg_parse_address(struct kmod_pkg_state *state) {
 	}
     	
 	/* Transfer the addresses. */
-	state->rec_array = (struct kmod_pkg_rec *) kmo_calloc(state->nb_rec * sizeof(struct kmod_pkg_rec));
+	state->rec_array = (struct kmod_pkg_rec *) karena_calloc(state->arena, state->nb_rec * sizeof(struct kmod_pkg_rec));
 
 	for (i = 0; i < state->nb_rec; i++) {
     	    state->rec_array[i].addr = (kstr *) addr_array.data[i];
@@ -5022,7 +6733,7 @@ static int kmod_package(struct kmod_context *kc, uint32_t pack_type, struct kmod
     }
     
     /* Initialize the package state. */
-    kmod_package_init(&state, pack_type, orig_mail);
+    kmod_package_init(&state, &kc->arena, pack_type, orig_mail);
     
     /* Try. */
     do {
@@ -5065,8 +6776,8 @@ static int kmod_package(struct kmod_context *kc, uint32_t pack_type, struct kmod
 	}
 	
 	/* Fetch the attachments. */
-	state.att_array = karray_new();
-	error = kmod_fetch_attachment(orig_mail, state.att_array, 0);
+	state.att_array = karena_karray_new(state.arena);
+	error = kmod_fetch_attachment(state.arena, orig_mail, state.att_array, 0, 0);
 	if (error) break;
 	
 	/* Handle encryption. */
@@ -5300,55 +7011,69 @@ static int handle_close_kappsd_session(struct kmod_context *kc) {
     return k3p_send_data(k3p);
 }
 
-static int handle_exchange_kaapsd_message(struct kmod_context *kc) {
+/* This function reads the elements of a kappsd message sent by the plugin, up
+ * to the instruction ending it, and writes them in 'in_buf'.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_read_kappsd_message(struct kmod_context *kc, kbuffer *in_buf) {
     int error = 0;
-    int in_type = 0, out_type = 0;
-    kbuffer in_buf, out_buf;
     kstr str;
     k3p_proto *k3p = &kc->k3p;
 
-    kbuffer_init(&in_buf, 0);
-    kbuffer_init(&out_buf, 0);
     kstr_init(&str);
 
     /* This code makes me cry. */
-    do {
-	while (1) {
-	    struct k3p_element *el = NULL;
+    while (1) {
+	struct k3p_element *el = NULL;
 
-	    /* Read more elements, if needed. */
-	    if (k3p->element_array_pos == k3p->element_array.size) {
-		k3p->element_array_pos = k3p->element_array.size = 0;
-		error = k3p_receive_element(k3p);
-		if (error) break;
-	    }
+	/* Read more elements, if needed. */
+	if (k3p->element_array_pos == k3p->element_array_size) {
+	    k3p->element_array_pos = k3p->element_array_size = 0;
+	    error = k3p_receive_element(k3p);
+	    if (error) break;
+	}
 
-	    el = (struct k3p_element *) k3p->element_array.data[k3p->element_array_pos];
+	el = &k3p->element_array[k3p->element_array_pos];
 
-	    /* Stop on instruction. */
-	    if (el->type == K3P_EL_INS) {
-		int i;
-		error = k3p_read_inst(k3p, &i);
-		break;
-	    }
+	/* Stop on instruction. */
+	if (el->type == K3P_EL_INS) {
+	    int i;
+	    error = k3p_read_inst(k3p, &i);
+	    break;
+	}
 
-	    else if (el->type == K3P_EL_INT) {
-		uint32_t i;
-		error = k3p_read_uint32(k3p, &i);
-		if (error) break;
-		link_msg_write_uint32(&in_buf, i);
-	    }
+	else if (el->type == K3P_EL_INT) {
+	    uint32_t i;
+	    error = k3p_read_uint32(k3p, &i);
+	    if (error) break;
+	    link_msg_write_uint32(in_buf, i);
+	}
 
-	    else {
-		error = k3p_read_kstr(k3p, &str);
-		if (error) break;
-		link_msg_write_kstr(&in_buf, &str);
-	    }
+	else {
+	    error = k3p_read_kstr(k3p, &str);
+	    if (error) break;
+	    link_msg_write_kstr(in_buf, &str);
 	}
+    }
 
-	if (error) break;
+    kstr_free(&str);
+
+    return error;
+}
+
+/* This function writes the reply of kappsd to the plugin, or the error that
+ * occurred if 'reply_error' is true, and sends it.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_write_kappsd_reply(struct kmod_context *kc, int reply_error, kbuffer *out_buf) {
+    int error = 0;
+    kstr str;
+    k3p_proto *k3p = &kc->k3p;
+
+    kstr_init(&str);
 
-	if (kmod_exchange_kappsd_message(in_type, &in_buf, &out_type, &out_buf)) {
+    do {
+	if (reply_error) {
 	    k3p_write_inst(k3p, 1);
 	    k3p_write_kstr(k3p, kmo_kstrerror());
 	}
@@ -5356,17 +7081,17 @@ static int handle_exchange_kaapsd_message(struct kmod_context *kc) {
 	else {
 	    k3p_write_inst(k3p, 0);
 
-	    while (out_buf.pos != out_buf.len) {
+	    while (out_buf->pos != out_buf->len) {
 	    
-		if (out_buf.data[out_buf.pos] == KNP_UINT32) {
+		if (out_buf->data[out_buf->pos] == KNP_UINT32) {
 		    uint32_t i;
-		    error = link_msg_read_uint32(&out_buf, &i);
+		    error = link_msg_read_uint32(out_buf, &i);
 		    if (error) break;
 		    k3p_write_uint32(k3p, i);
 		}
 
 		else {
-		    error = link_msg_read_str(&out_buf, &str);
+		    error = link_msg_read_str(out_buf, &str);
 		    if (error) break;
 		    k3p_write_kstr(k3p, &str);
 		}
@@ -5381,12 +7106,95 @@ static int handle_exchange_kaapsd_message(struct kmod_context *kc) {
     } while (0);
 
     kstr_free(&str);
+
+    return error;
+}
+
+static int handle_exchange_kaapsd_message(struct kmod_context *kc) {
+    int error = 0;
+    int in_type = 0, out_type = 0;
+    kbuffer in_buf, out_buf;
+
+    kbuffer_init(&in_buf, 0);
+    kbuffer_init(&out_buf, 0);
+
+    do {
+	error = kmod_read_kappsd_message(kc, &in_buf);
+	if (error) break;
+
+	error = kmod_write_kappsd_reply(kc, kmod_exchange_kappsd_message(in_type, &in_buf, &out_type, &out_buf) != 0,
+	    	    	    	    	&out_buf);
+	if (error) break;
+
+    } while (0);
+
     kbuffer_clean(&in_buf);
     kbuffer_clean(&out_buf);
 
     return error;
 }
 
+/* This function sends a message of the plugin to kappsd and replies with its
+ * stream ID, without waiting for the reply of kappsd.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int handle_send_kappsd_message(struct kmod_context *kc) {
+    int error = 0;
+    uint32_t stream_id = 0;
+    kbuffer in_buf;
+    k3p_proto *k3p = &kc->k3p;
+
+    kbuffer_init(&in_buf, 0);
+
+    do {
+	error = kmod_read_kappsd_message(kc, &in_buf);
+	if (error) break;
+
+	if (kmod_send_kappsd_message(0, &in_buf, &stream_id)) {
+	    k3p_write_inst(k3p, 1);
+	    k3p_write_kstr(k3p, kmo_kstrerror());
+	}
+
+	else {
+	    k3p_write_inst(k3p, 0);
+	    k3p_write_uint32(k3p, stream_id);
+	}
+
+	error = k3p_send_data(k3p);
+	if (error) break;
+
+    } while (0);
+
+    kbuffer_clean(&in_buf);
+
+    return error;
+}
+
+/* This function receives the reply of kappsd to the message sent on the stream
+ * specified by the plugin.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int handle_recv_kappsd_message(struct kmod_context *kc) {
+    int error = 0;
+    uint32_t stream_id, out_type = 0;
+    kbuffer out_buf;
+
+    kbuffer_init(&out_buf, 0);
+
+    do {
+	error = k3p_read_uint32(&kc->k3p, &stream_id);
+	if (error) break;
+
+	error = kmod_write_kappsd_reply(kc, kmod_recv_kappsd_message(stream_id, &out_type, &out_buf) != 0, &out_buf);
+	if (error) break;
+
+    } while (0);
+
+    kbuffer_clean(&out_buf);
+
+    return error;
+}
+
 /* Better late than never: this function exucutes a query and checks if a server
  * error occurred or if some component must be upgraded. It returns 1 if the
  * caller should stop processing, 0 otherwise. 'error' is updated as needed.
@@ -6040,17 +7848,324 @@ static int kmod_login_test(struct kmod_context *kc) {
     return error;
 }
 
-/* This function sets the server information used by KMO.
+/* This function sets the server information used by KMO.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_set_server_info(struct kmod_context *kc) {
+    kmod_log_msg(2, "kmod_set_server_info() called.\n");
+
+    /* Flush the cached user info. */
+    kmod_flush_user_info(kc);
+    
+    /* The pooled connections were opened with the old server info. */
+    knp_pool_flush(&kc->knp);
+    
+    /* Read the server info. */
+    return k3p_read_server_info(&kc->k3p, &kc->server_info);
+}
+
+/* This function commits the pending maildb writes in group commit mode. A
+ * failure is logged but not reported to the plugin: the writes are lost, the
+ * mails will be evaluated again.
+ */
+static void kmod_commit_maildb_group(struct kmod_context *kc) {
+    
+    if (! group_commit_flag) return;
+    
+    timerclear(&kc->group_commit_time);
+    
+    if (maildb_get_group_size(kc->mail_db) == 0) return;
+    
+    kmod_log_msg(2, "kmod_commit_maildb_group() called.\n");
+    
+    if (maildb_commit_group(kc->mail_db)) {
+    	kmod_log_msg(1, "Cannot commit the maildb writes: %s.\n", kmo_strerror());
+    }
+}
+
+/* This function returns true if the next instruction of the plugin comes within
+ * the delay specified, in milliseconds. It returns true as well if we cannot
+ * wait for the plugin.
+ */
+static int kmod_plugin_is_active(struct kmod_context *kc, int delay) {
+    k3p_proto *k3p = &kc->k3p;
+    fd_set read_set;
+    struct timeval tv;
+    
+    /* The next instruction has already been received. */
+    if (k3p->element_array_pos < k3p->element_array_size || k3p->data_buf.pos < k3p->data_buf.len) {
+    	return 1;
+    }
+    
+    /* The transfer hub may have read ahead of the instruction. */
+    if (kmo_transfer_hub_has_input(k3p->hub, k3p->transfer.fd)) {
+    	return 1;
+    }
+    
+    /* We cannot wait on the inherited handle on Windows. */
+    #ifdef __WINDOWS__
+    if (kc->kpp_conn_type == KPP_CONN_INHERITED) return 1;
+    #endif
+    
+    util_set_timeval_msec(&tv, delay);
+    FD_ZERO(&read_set);
+    FD_SET((unsigned int) k3p->transfer.fd, &read_set);
+    
+    return (select(k3p->transfer.fd + 1, &read_set, NULL, NULL, &tv) != 0);
+}
+
+/* In group commit mode, this function commits the pending maildb writes if
+ * there are too many of them, or if the plugin stays idle long enough.
+ */
+static void kmod_wait_for_group_commit(struct kmod_context *kc) {
+    struct timeval elapsed;
+    int delay;
+    
+    if (! group_commit_flag) return;
+    
+    if (maildb_get_group_size(kc->mail_db) == 0) {
+    	timerclear(&kc->group_commit_time);
+	return;
+    }
+    
+    if (! timerisset(&kc->group_commit_time)) {
+    	util_get_current_time(&kc->group_commit_time);
+    }
+    
+    util_get_elapsed_time(&kc->group_commit_time, &elapsed);
+    delay = KMOD_GROUP_COMMIT_DELAY - util_get_timeval_msec(&elapsed);
+    
+    if (delay <= 0 || maildb_get_group_size(kc->mail_db) >= KMOD_GROUP_COMMIT_MAX_SIZE) {
+    	kmod_commit_maildb_group(kc);
+	return;
+    }
+    
+    /* Wait for the plugin. Commit if it stays idle. If we cannot wait, the
+     * writes will be committed later.
+     */
+    if (! kmod_plugin_is_active(kc, delay)) {
+    	kmod_commit_maildb_group(kc);
+    }
+}
+
+/* This function writes the pending unsigned mails to the maildb if there are
+ * too many of them, or if the plugin stays idle long enough.
+ */
+static void kmod_wait_for_plain_mail(struct kmod_context *kc) {
+    
+    if (kc->plain_mail_array.size == 0) return;
+    
+    if (kc->plain_mail_array.size >= KMOD_PLAIN_MAIL_MAX_SIZE ||
+    	! kmod_plugin_is_active(kc, KMOD_PLAIN_MAIL_DELAY)) {
+	kmod_flush_plain_mail(kc);
+    }
+}
+
+/* This function runs the maildb maintenance while the plugin is idle, in
+ * slices of KMOD_MAINT_SLICE milliseconds. The plugin waits at most for one
+ * maintenance step when it sends an instruction. This function sets the KMO
+ * error string. It returns -1 if the database is corrupted.
+ */
+static int kmod_maintain_maildb(struct kmod_context *kc) {
+    
+    if (kmo_stats_now() < kc->maint_time) return 0;
+    
+    /* Wait until the plugin is idle for a while to begin a cycle. */
+    if (kmod_plugin_is_active(kc, kc->maint_flag ? 0 : KMOD_MAINT_IDLE_DELAY)) return 0;
+    
+    if (! kc->maint_flag) kmod_log_msg(2, "Beginning the maildb maintenance.\n");
+    kc->maint_flag = 1;
+    
+    while (1) {
+    	uint64_t slice_end = kmo_stats_now() + KMOD_MAINT_SLICE * 1000;
+	int done_flag = 0;
+	int error = 0;
+	
+	while (! done_flag && ! error && kmo_stats_now() < slice_end) {
+	    error = maildb_maintain(kc->mail_db, &done_flag);
+	}
+	
+	/* The maintenance may have removed mails from the database. */
+	kmod_status_cache_flush(kc);
+	
+	if (error == -2) {
+	    return -1;
+	}
+	
+	/* Other errors are not fatal. Try again at the next cycle. */
+	if (error) {
+	    kmod_log_msg(1, "The maildb maintenance failed: %s.\n", kmo_strerror());
+	}
+	
+	if (done_flag) {
+	    kmod_log_msg(2, "The maildb maintenance is done.\n");
+	    kc->maint_flag = 0;
+	    kc->maint_time = kmo_stats_now() + (uint64_t) KMOD_MAINT_INTERVAL * 1000000;
+	    return 0;
+	}
+	
+	if (kmod_plugin_is_active(kc, 0)) return 0;
+    }
+}
+
+/* This function fetches the signature keys hinted by the plugin, a batch at a
+ * time, while the plugin is idle. The fetch stops as soon as the plugin sends an
+ * instruction; the keys left are fetched the next time the plugin is idle.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_wait_for_prefetch(struct kmod_context *kc) {
+    
+    while (kc->prefetch_mid_size && ! kmod_plugin_is_active(kc, 0)) {
+    	int nb_mid = (kc->prefetch_mid_size < KMOD_PREFETCH_BATCH) ? kc->prefetch_mid_size : KMOD_PREFETCH_BATCH;
+	uint64_t start = kmo_stats_now();
+	int error;
+	
+	kc->k3p.knp_yield_flag = 1;
+	error = kmod_fetch_sig_keys(kc, kc->prefetch_mid_array, nb_mid);
+	kc->k3p.knp_yield_flag = 0;
+	kmo_stats_record_time(kmo_stats_get_timer("eval.prefetch"), start);
+	
+	/* The plugin sent an instruction. */
+	if (error == -2) return 0;
+	if (error) return -1;
+	
+	kc->prefetch_mid_size -= nb_mid;
+	memmove(kc->prefetch_mid_array, kc->prefetch_mid_array + nb_mid, kc->prefetch_mid_size * sizeof(int64_t));
+    }
+    
+    return 0;
+}
+
+/* This function is called before waiting for the next instruction of the
+ * plugin. It commits the pending maildb writes, prefetches the hinted
+ * signature keys and maintains the maildb while the plugin is idle.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_wait_for_plugin(struct kmod_context *kc) {
+    kmod_wait_for_plain_mail(kc);
+    kmod_wait_for_group_commit(kc);
+    if (kmod_wait_for_prefetch(kc)) return -1;
+    return kmod_maintain_maildb(kc);
+}
+
+/* This function appends the runtime statistics of KMOD to the string
+ * specified, as kmo_stats_dump() does.
+ */
+static void kmod_dump_stats(kstr *str) {
+    struct kmo_ssl_cache_stats *ssl_stats = kmo_ssl_cache_get_stats();
+    
+    kmo_stats_dump(str);
+    kmo_heap_dump(str);
+    kmo_stats_dump_counter(str, "ssl_cache.handshake", ssl_stats->nb_handshake, ssl_stats->nb_handshake);
+    kmo_stats_dump_counter(str, "ssl_cache.offered", ssl_stats->nb_offered, ssl_stats->nb_offered);
+    kmo_stats_dump_counter(str, "ssl_cache.resumed", ssl_stats->nb_resumed, ssl_stats->nb_resumed);
+}
+
+/* This function sends the runtime statistics of KMOD to the plugin.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_get_stats(struct kmod_context *kc) {
+    int error = 0;
+    kstr str;
+    
+    kmod_log_msg(2, "kmod_get_stats() called.\n");
+    
+    kstr_init(&str);
+    kmod_dump_stats(&str);
+    
+    k3p_write_inst(&kc->k3p, K3P_COMMAND_OK);
+    k3p_write_kstr(&kc->k3p, &str);
+    error = k3p_send_data(&kc->k3p);
+    
+    kstr_free(&str);
+    return error;
+}
+
+/* This function writes the runtime statistics of KMOD in the statistics file,
+ * if one was specified. Failures are logged.
+ */
+static void kmod_write_stats(struct kmod_context *kc) {
+    FILE *file = NULL;
+    kstr str;
+    
+    if (kc->stats_path.slen == 0) return;
+    
+    kstr_init(&str);
+    kmod_dump_stats(&str);
+    
+    if (util_open_file(&file, kc->stats_path.data, "wb") ||
+    	util_write_file(file, str.data, str.slen) ||
+	util_close_file(&file, 0)) {
+	kmod_log_msg(1, "Cannot write the statistics: %s.\n", kmo_strerror());
+	util_close_file(&file, 1);
+    }
+    
+    kstr_free(&str);
+}
+
+/* This function sends the spans of the flight recorder to the plugin, as a
+ * Chrome trace.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int kmod_set_server_info(struct kmod_context *kc) {
-    kmod_log_msg(2, "kmod_set_server_info() called.\n");
+static int kmod_get_trace(struct kmod_context *kc) {
+    int error = 0;
+    kstr str;
+    
+    kmod_log_msg(2, "kmod_get_trace() called.\n");
+    
+    kstr_init(&str);
+    kmo_trace_dump(&str);
+    
+    k3p_write_inst(&kc->k3p, K3P_COMMAND_OK);
+    k3p_write_kstr(&kc->k3p, &str);
+    error = k3p_send_data(&kc->k3p);
+    
+    kstr_free(&str);
+    return error;
+}
 
-    /* Flush the cached user info. */
-    kmod_flush_user_info(kc);
+/* This function appends the spans recorded since the time specified to the
+ * trace file "kmod_trace.json" of the Teambox directory. The file uses the
+ * JSON array format of the Chrome traces, whose closing ']' is optional. It is
+ * started anew when it grows too large. Failures are logged.
+ */
+static void kmod_write_trace(struct kmod_context *kc, uint64_t start) {
+    int error = 0;
+    int size = 0;
+    FILE *file = NULL;
+    kstr str;
     
-    /* Read the server info. */
-    return k3p_read_server_info(&kc->k3p, &kc->server_info);
+    kstr_init(&str);
+    kstr_sf(&kc->str, "%s/kmod_trace.json", kc->teambox_dir_path.data);
+    
+    /* Try. */
+    do {
+	error = util_open_file(&file, kc->str.data, "ab");
+	if (error) break;
+	
+	error = util_file_seek(file, 0, SEEK_END) || util_get_file_pos(file, &size);
+	if (error) break;
+	
+	if (size >= KMOD_MAX_TRACE_SIZE) {
+	    error = util_truncate_file(file);
+	    if (error) break;
+	    
+	    size = 0;
+	}
+	
+	if (size == 0) kstr_assign_cstr(&str, "[\n");
+	kmo_trace_dump_events(&str, start);
+	
+	error = util_write_file(file, str.data, str.slen) || util_close_file(&file, 0);
+	
+    } while (0);
+    
+    if (error) {
+	kmod_log_msg(1, "Cannot write the trace: %s.\n", kmo_strerror());
+	util_close_file(&file, 1);
+    }
+    
+    kstr_free(&str);
 }
 
 /* This function loops while expecting session commands from the plugin.
@@ -6061,16 +8176,31 @@ static int kmod_interaction_loop(struct kmod_context *kc) {
     while (1) {
     	int error = 0;
 	int cmd;
+	uint64_t start;
 	k3p_proto *k3p = &kc->k3p;
 	
     	assert(k3p->state == K3P_INTERACTING);
 	
 	/* Get the next command. */
-	if (k3p_read_inst(k3p, &cmd)) {
+	if (kmod_wait_for_plugin(kc) || k3p_read_inst(k3p, &cmd)) {
 	    return -1;
 	}
 	
 	kmod_log_msg(2, "KMOD interaction loop: command %x.\n", cmd);
+	start = kmo_stats_now();
+	
+	/* The blocks allocated for the command are charged to K3P until the
+	 * command is handed to its subsystem.
+	 */
+	kmo_heap_set_tag(KMO_HEAP_K3P);
+	kmo_heap_begin_command();
+	
+	/* The other commands may read the statuses of the pending unsigned
+	 * mails.
+	 */
+	if (cmd != KPP_EVAL_INCOMING && cmd != KPP_EVAL_INCOMING_BATCH) {
+	    kmod_flush_plain_mail(kc);
+	}
 	
 	switch (cmd) {
 	
@@ -6082,8 +8212,10 @@ static int kmod_interaction_loop(struct kmod_context *kc) {
 	    	struct kmod_mail_process_req process_req;
 		k3p_init_mail_process_req(&process_req);
 		error = k3p_read_mail_process_req(k3p, &process_req);
+		kmo_trace_span("k3p.read_mail", start);
 		
 		if (! error) {
+		    kmo_heap_set_tag(KMO_HEAP_EVAL);
 		    error = kmod_process_incoming(kc, &process_req, want_dec_email);
 		    kmod_disable_kpg(kc);
 		}
@@ -6097,8 +8229,10 @@ static int kmod_interaction_loop(struct kmod_context *kc) {
 	    	struct kmod_mail mail;
 		k3p_init_mail(&mail);
 		error = k3p_read_mail(k3p, &mail);
+		kmo_trace_span("k3p.read_mail", start);
 		
 		if (! error) {
+		    kmo_heap_set_tag(KMO_HEAP_EVAL);
 		    error = kmod_eval_incoming(kc, &mail);
 		    kmod_disable_kpg(kc);
 		}
@@ -6107,6 +8241,12 @@ static int kmod_interaction_loop(struct kmod_context *kc) {
 		break;
 	    }
 	    
+	    /* Evaluate several incoming messages. */
+	    case KPP_EVAL_INCOMING_BATCH:
+	    	kmo_heap_set_tag(KMO_HEAP_EVAL);
+	    	error = kmod_eval_incoming_batch(kc);
+		break;
+	    
 	    /* Mark some messages as unsigned mails. */
 	    case KPP_MARK_UNSIGNED_MAIL:
 	    	error = kmod_mark_unsigned_mail(kc);
@@ -6135,8 +8275,10 @@ static int kmod_interaction_loop(struct kmod_context *kc) {
 	    	struct kmod_mail mail;
 		k3p_init_mail(&mail);
 		error = k3p_read_mail(k3p, &mail);
+		kmo_trace_span("k3p.read_mail", start);
 		
 		if (! error) {
+		    kmo_heap_set_tag(KMO_HEAP_PKG);
 		    error = kmod_package(kc, cmd, &mail);
 		    kmod_disable_kpg(kc);
 		}
@@ -6171,6 +8313,8 @@ static int kmod_interaction_loop(struct kmod_context *kc) {
 	    /* End the current session. */
 	    case KPP_END_SESSION: {
 	    	k3p->state = K3P_ACTIVE;
+		kmod_commit_maildb_group(kc);
+		kmod_write_stats(kc);
 		break;
 	    }
 	    
@@ -6190,6 +8334,16 @@ static int kmod_interaction_loop(struct kmod_context *kc) {
 		break;
 	    }
 	    
+	    case K3P_SEND_KAPPSD_MESSAGE: {
+	    	error = handle_send_kappsd_message(kc);
+		break;
+	    }
+	    
+	    case K3P_RECV_KAPPSD_MESSAGE: {
+	    	error = handle_recv_kappsd_message(kc);
+		break;
+	    }
+	    
 	    /* KAS hacks. */
 	    case K3P_GET_KWS_TICKET: {
 	    	error = kmod_get_kws_ticket(kc);
@@ -6211,6 +8365,24 @@ static int kmod_interaction_loop(struct kmod_context *kc) {
 		break;
 	    }
 	    
+	    /* Get the runtime statistics. */
+	    case K3P_GET_STATS: {
+	    	error = kmod_get_stats(kc);
+		break;
+	    }
+	    
+	    /* Get the trace of the last commands. */
+	    case K3P_GET_TRACE: {
+	    	error = kmod_get_trace(kc);
+		break;
+	    }
+	    
+	    /* Prefetch the signature keys of the mails about to be displayed. */
+	    case K3P_PREFETCH_SIG_KEYS: {
+	    	error = kmod_prefetch_sig_keys(kc);
+		break;
+	    }
+	    
 	    /* Oops. */
 	    default:
 	    	kmod_log_msg(1, "Invalid request: unexpected instruction (%x) in session context.\n", cmd);
@@ -6218,6 +8390,31 @@ static int kmod_interaction_loop(struct kmod_context *kc) {
 		error = -1;
 	}
 	
+	kmo_stats_record_time(kmo_stats_get_timer("k3p.%x", cmd), start);
+	kmo_heap_end_command(cmd);
+	
+#ifdef __KMO_HEAP_STATS__
+	/* Report the peak growth of the heap during the command. */
+	{
+	    kstr report;
+	    kstr_init(&report);
+	    kmo_heap_dump_command(&report);
+	    kmod_log_msg(2, "KMOD heap usage of command %x: %s", cmd, report.data);
+	    kstr_free(&report);
+	}
+#endif
+	
+	/* Keep the trace of the slow commands. */
+	if (trace_threshold && kmo_stats_now() - start >= (uint64_t) trace_threshold * 1000) {
+	    kmod_write_trace(kc, start);
+	}
+	
+	/* Release the objects allocated while handling the command, and the
+	 * temporary files of the large strings received with it.
+	 */
+	karena_reset(&kc->arena);
+	k3p_remove_spill_files(k3p);
+	
 	/* We're done if an error occurred or if we're no longer interacting. */
 	if (error || k3p->state != K3P_INTERACTING) {
 	    kmod_log_msg(3, "KMOD interaction loop: returning %d.\n", error);
@@ -6246,8 +8443,7 @@ static int kmod_loop(struct kmod_context *kc) {
 	
 	/* Get the next command. There is no timeout here. */
 	k3p->timeout_enabled = 0;
-	
-	if (k3p_read_inst(k3p, &cmd)) {
+	if (kmod_wait_for_plugin(kc) || k3p_read_inst(k3p, &cmd)) {
 	    return -1;
 	}
     
@@ -6288,6 +8484,52 @@ static int kmod_loop(struct kmod_context *kc) {
     }
 }
 
+/* This function returns true if KMOD communicates with the plugin over a
+ * Unix-domain socket that it creates.
+ */
+static int kmod_is_unix_conn(struct kmod_context *kc) {
+    return (kc->kpp_conn_type == KPP_CONN_UNIX_KMOD_CONNECT || kc->kpp_conn_type == KPP_CONN_UNIX_KPP_CONNECT);
+}
+
+/* This function creates the socket used to connect with the plugin and sets it
+ * unblocking.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_create_plugin_sock(struct kmod_context *kc, int *fd) {
+    #ifdef __UNIX__
+    if (kmod_is_unix_conn(kc)) {
+    	if (kmo_sock_create_unix(fd)) return -1;
+    }
+    
+    else
+    #endif
+    if (kmo_sock_create(fd)) return -1;
+    
+    return kmo_sock_set_unblocking(*fd);
+}
+
+/* This function selects the communication driver of the plugin connection once
+ * it has been established. The Unix-domain sockets, including an inherited
+ * socketpair, use the Unix driver, which receives the attachment descriptors.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_setup_plugin_conn(struct kmod_context *kc) {
+    #ifdef __UNIX__
+    struct kmo_data_transfer *transfer = &kc->k3p.transfer;
+    
+    if (kmo_sock_is_unix(transfer->fd)) {
+    	kmod_log_msg(2, "Using the Unix-domain socket driver for the plugin.\n");
+	transfer->driver = kmo_unix_driver;
+	
+	/* Not fatal: the default buffers work, only slower. */
+	if (kmo_sock_set_buffer_size(transfer->fd, KMOD_UNIX_SOCK_BUF_SIZE))
+	    kmod_log_msg(1, "Cannot enlarge the plugin socket buffers: %s.\n", kmo_strerror());
+    }
+    #endif
+    
+    return 0;
+}
+
 /* This function connects KMOD with the plugin.
  * This function sets the KMO error string. It returns -1 on failure.
  */
@@ -6298,6 +8540,9 @@ static int kmod_connect_to_plugin(struct kmod_context *kc) {
     
     kmod_log_msg(1, "Connecting to plugin.\n");
     
+    if (kmod_is_unix_conn(kc) && kc->kpp_conn_path.slen == 0)
+    	kstr_sf(&kc->kpp_conn_path, "%s/kmod.sock", kc->teambox_dir_path.data);
+    
     /* The caller should already have set the timeout_enabled flag. */
     
     /* We're inheriting the socket. Set the K3P file descriptor. */
@@ -6313,17 +8558,19 @@ static int kmod_connect_to_plugin(struct kmod_context *kc) {
     }
     
     /* We're waiting for an incoming connection. */
-    else if (kc->kpp_conn_type == KPP_CONN_KPP_CONNECT) {
+    else if (kc->kpp_conn_type == KPP_CONN_KPP_CONNECT || kc->kpp_conn_type == KPP_CONN_UNIX_KPP_CONNECT) {
 	int accept_fd = -1;
 
 	/* Try. */
 	do {
-	    error = kmo_sock_create(&accept_fd);
-	    if (error) break;
-	    
-	    error = kmo_sock_set_unblocking(accept_fd);
+	    error = kmod_create_plugin_sock(kc, &accept_fd);
 	    if (error) break;
 	    
+	    #ifdef __UNIX__
+	    if (kmod_is_unix_conn(kc))
+	    	error = kmo_sock_bind_unix(accept_fd, kc->kpp_conn_path.data);
+	    else
+	    #endif
 	    error = kmo_sock_bind(accept_fd, kc->kpp_conn_port);
 	    if (error) break;
 	    
@@ -6378,12 +8625,17 @@ static int kmod_connect_to_plugin(struct kmod_context *kc) {
 	} while (0);
 		
     	kmo_sock_close(&accept_fd);
+	
+	/* Nobody else may connect to us. */
+	if (kmod_is_unix_conn(kc)) unlink(kc->kpp_conn_path.data);
+	
 	if (error) return -1;
     }
     
     /* We must connect to the plugin. */
-    else if (kc->kpp_conn_type == KPP_CONN_KMOD_CONNECT) {
+    else if (kc->kpp_conn_type == KPP_CONN_KMOD_CONNECT || kc->kpp_conn_type == KPP_CONN_UNIX_KMOD_CONNECT) {
     	int connect_fd = -1;
+	char *host = kmod_is_unix_conn(kc) ? kc->kpp_conn_path.data : "127.0.0.1";
 	FILE *file_ptr = NULL;
 	kstr secret_file_path;
 	kstr_init(&secret_file_path);
@@ -6408,13 +8660,15 @@ static int kmod_connect_to_plugin(struct kmod_context *kc) {
 	    if (error) break;
 	    
 	    /* Connect to the plugin. */
-	    error = kmo_sock_create(&connect_fd);
-	    if (error) break;
-	    
-	    error = kmo_sock_set_unblocking(connect_fd);
+	    error = kmod_create_plugin_sock(kc, &connect_fd);
 	    if (error) break;
 	    
-	    error = kmo_sock_connect(connect_fd, "127.0.0.1", kc->kpp_conn_port);
+	    #ifdef __UNIX__
+	    if (kmod_is_unix_conn(kc))
+	    	error = kmo_sock_connect_unix(connect_fd, host);
+	    else
+	    #endif
+	    error = kmo_sock_connect(connect_fd, host, kc->kpp_conn_port);
 	    if (error) break;
 	    
 	    /* Wait for the connection. */
@@ -6436,7 +8690,7 @@ static int kmod_connect_to_plugin(struct kmod_context *kc) {
 	    assert(transfer->status == KMO_COMM_TRANS_COMPLETED);
     	    
 	    /* It seems there is a connection, try it. */
-	    error = kmo_sock_connect_check(connect_fd, "127.0.0.1");
+	    error = kmo_sock_connect_check(connect_fd, host);
 	    if (error) break;
 	    
 	    /* Send the random data to the plugin. */
@@ -6474,6 +8728,8 @@ static int kmod_connect_to_plugin(struct kmod_context *kc) {
     
     else assert(0);
     
+    if (kmod_setup_plugin_conn(kc)) return -1;
+    
     kmod_log_msg(1, "Connected to plugin, waiting for KPP_CONNECT_KMO.\n");
     
     /* At this point the K3P file descriptor is valid. The timeout may or may
@@ -6567,9 +8823,41 @@ static int kmod_create_teambox_dir(struct kmod_context *kc) {
 	if (error) return error;
     }
     
+    /* Create the directory of the K3P temporary files. */
+    kstr_sf(&kc->str, "%s/tmp", kc->teambox_dir_path.data);
+
+    if (! util_check_dir_exist(kc->str.data)) {
+    	error = util_create_dir(kc->str.data);
+	if (error) return error;
+    }
+    
     return 0;
 }
 
+/* This function removes the K3P temporary files left behind by a previous
+ * instance of KMOD that did not exit cleanly. Errors are ignored.
+ */
+static void kmod_clean_tmp_dir(struct kmod_context *kc) {
+    karray file_array;
+    int i;
+    
+    karray_init(&file_array);
+    kstr_sf(&kc->str, "%s/tmp", kc->teambox_dir_path.data);
+    
+    if (util_list_dir(kc->str.data, &file_array) == 0) {
+    	for (i = 0; i < file_array.size; i++) {
+	    kstr *name = (kstr *) file_array.data[i];
+	    if (strncmp(name->data, "k3p_", 4)) continue;
+	    
+	    kstr_sf(&kc->str, "%s/tmp/%s", kc->teambox_dir_path.data, name->data);
+	    util_delete_regular_file(kc->str.data);
+	}
+    }
+    
+    kmo_clear_kstr_array(&file_array);
+    karray_free(&file_array);
+}
+
 /* This function sets the path to the Teambox directory, if necessary.
  * This function sets the KMO error string. It returns -1 on failure.
  */
@@ -6603,9 +8891,12 @@ static void kmod_print_banner() {
 
 /* This function prints the usage on the stream specified. */
 static void kmod_print_usage(FILE *stream) {
-    fprintf(stream, "Usage: kmod -C {inherited|kmod_connect|kpp_connect} [-p port]\n"
+    fprintf(stream, "Usage: kmod -C {inherited|kmod_connect|kpp_connect|unix_kmod_connect|\n"
+		    "            unix_kpp_connect} [-p port] [-u <path>]\n"
 		    "            [-l log_level] [-k <Teambox dir path>] [-d <dbpath>]\n"
-		    "            [-m <timeout_ms>] [-a <address>] [-h -v -D -t]\n"
+		    "            [-m <timeout_ms>] [-s <seconds>] [-a <address>] [-S <path>]\n"
+		    "            [-b <bytes>] [-Z <bytes>] [-T <ms>]\n"
+		    "            [-h -v -D -t -w]\n"
 		    "\n"
 		    "-C <method>      Specify the way KMOD will communicate with the plugin.\n"
 		    "                   inherited: use the socket inherited from stdin.\n"
@@ -6613,8 +8904,15 @@ static void kmod_print_usage(FILE *stream) {
 		    "                     specified.\n"
 		    "                   kpp_connect: the plugin connects to KMOD on the port\n"
 		    "                     specified.\n"
+		    "                   unix_kmod_connect, unix_kpp_connect: same as above, on\n"
+		    "                     the Unix-domain socket specified (Unix only).\n"
+		    "                   The plugin may pass the attachment file descriptors\n"
+		    "                   on a Unix-domain socket, including an inherited\n"
+		    "                   socketpair.\n"
 		    "-p <port>        Specify the port used to connect to/from KMOD. The default\n"
 		    "                   port is 31000.\n"
+		    "-u <path>        Specify the path of the Unix-domain socket. The default is\n"
+		    "                   \"kmod.sock\" in the Teambox directory.\n"
 		    "-l <level>       Log level of KMOD: from 0 to 3, where 3 is most verbose.\n"
 		    "-k <path>        Path to the Teambox directory used by KMOD. If not specified,\n"
 		    "-d <path>          an OS-dependent \"teambox\" directory is used.\n"
@@ -6624,8 +8922,26 @@ static void kmod_print_usage(FILE *stream) {
 		    "                   contact kmod.\n"
 		    "-t               Trunk the logs at every request, to keep them small.\n"
 		    "-m               Set the timeout (in milliseconds) for the K3P and the KNP.\n"
+		    "-s <seconds>     Set the lifetime of the cached signature keys. The default\n"
+		    "                   is one day. 0 disables the cache.\n"
+		    "-w               Use write-ahead logging for the mail database and group\n"
+		    "                   the writes in periodic commits. Faster on slow disks, but\n"
+		    "                   the last evaluations may be lost on a crash.\n"
 		    "-a <address>     Use the specified address to lookup encryption keys.\n"
                     "-z <address>     Use the specified server for all KNP requests.\n"
+		    "-S <path>        Write the runtime statistics in the specified file at the\n"
+		    "                   end of each session.\n"
+		    "-b <bytes>       Write the K3P strings larger than this size, such as large\n"
+		    "                   attachments, in temporary files of the Teambox directory\n"
+		    "                   instead of keeping them in memory. The default is 8 MB.\n"
+		    "                   0 disables this.\n"
+		    "-Z <bytes>       Compress the KNP messages larger than this size when the\n"
+		    "                   server supports it. The default is 0, which disables the\n"
+		    "                   compression.\n"
+		    "-T <ms>          Append the trace of the commands that take longer than\n"
+		    "                   this duration to \"kmod_trace.json\" in the Teambox\n"
+		    "                   directory, in the Chrome trace format. The default is 0,\n"
+		    "                   which disables this.\n"
 		    );
 }
 
@@ -6649,6 +8965,240 @@ static inline void initialize_allowed_file_char() {
 }
 
 /* The root of all KMO evil. */
+/* This function records the duration of the startup phase specified, which
+ * began at 'start', in the statistics and in the log. It returns the current
+ * time, which is the beginning of the next phase.
+ */
+static uint64_t kmod_end_startup_phase(const char *name, uint64_t start) {
+    uint64_t now = kmo_stats_now();
+    kmo_stats_record_time(kmo_stats_get_timer("startup.%s", name), start);
+    kmod_log_msg(1, "Startup phase %s: %llu ms.\n", name, (unsigned long long) ((now - start) / 1000));
+    return now;
+}
+
+/* This function does the part of the initialization that the plugin handshake
+ * does not need: the crypto libraries and the workers, the mail database and
+ * the cleanup of the old logs and temporary files. The mail database is
+ * checked later by its maintenance, while the plugin is idle.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int kmod_init_after_connect(struct kmod_context *kc) {
+    uint64_t phase_start = kmo_stats_now();
+    
+    /* Initialize kmocrypt. */
+    kmocrypt_init();
+
+    /* Initialise the SSL library. */
+    SSL_library_init();
+    SSL_load_error_strings();
+    OpenSSL_add_all_algorithms();
+    
+    /* Start the workers. kmocrypt must be initialized for them. */
+    kc->workpool = kmo_workpool_new(kmo_workpool_get_nb_cpu());
+
+    /* Load the SSL sessions negociated previously. */
+    kmo_ssl_cache_open(kc->teambox_dir_path.data);
+    
+    /* Create the SSL contexts used to contact the servers. */
+    knp_init_ssl_ctx();
+    
+    phase_start = kmod_end_startup_phase("crypto", phase_start);
+    
+    /* Open the KMO mail database. */
+    if (kmod_open_mail_db(kc)) return -1;
+    
+    /* Enable the group commit mode. */
+    if (group_commit_flag && maildb_set_group_commit(kc->mail_db, 1)) return -1;
+    
+    phase_start = kmod_end_startup_phase("maildb", phase_start);
+    
+    /* Remove the old logs and temporary files. */
+    kmod_clean_logs(kc);
+    kmod_clean_tmp_dir(kc);
+    kmod_end_startup_phase("log_cleanup", phase_start);
+    
+    return 0;
+}
+
+#ifdef __TEST__
+/* Internal tests of KMOD. They are run by kmo_do_tests(). */
+
+#define KMOD_TEST_DB_PATH	"kmod_test.db"
+
+/* This function fills the mail info specified with a signed mail having one
+ * intact attachment.
+ */
+static void test_fill_signed_mail(maildb_mail_info *mail_info, char *msg_id) {
+    kbuffer buf;
+    
+    kstr_assign_cstr(&mail_info->msg_id, msg_id);
+    kstr_assign_cstr(&mail_info->hash, "hash1_01234567890123");
+    kstr_assign_cstr(&mail_info->ksn, "ksn1_6789012345678901234");
+    mail_info->status = 1;
+    mail_info->display_pref = 1;
+    mail_info->mid = 1;
+    mail_info->field_status = 2 << (MAILDB_STATUS_TEXT_BODY * 2);
+    mail_info->encryption_status = KMO_DECRYPTION_STATUS_NONE;
+    mail_info->pod_status = KMO_POD_STATUS_NONE;
+    mail_info->otut_status = KMO_OTUT_STATUS_NONE;
+    
+    kbuffer_init(&buf, 64);
+    kbuffer_write32(&buf, 8);
+    kbuffer_write(&buf, (uint8_t *) "file.txt", 8);
+    kbuffer_write32(&buf, KMO_EVAL_ATTACHMENT_INTACT);
+    kstr_assign_buf(&mail_info->attachment_status, buf.data, buf.len);
+    mail_info->attachment_nbr = 1;
+    kbuffer_clean(&buf);
+}
+
+/* This function opens an empty mail database in the context specified. */
+static void test_open_mail_db(struct kmod_context *kc) {
+    kmod_context_init(kc);
+    unlink(KMOD_TEST_DB_PATH);
+    kc->mail_db = maildb_sqlite_new(KMOD_TEST_DB_PATH);
+    assert(kc->mail_db);
+}
+
+/* This function closes the mail database of the context specified. */
+static void test_close_mail_db(struct kmod_context *kc) {
+    kmod_context_free(kc);
+    unlink(KMOD_TEST_DB_PATH);
+}
+
+/* Check the string status of a signed mail with an attachment, read with the
+ * fields of a string status.
+ */
+static void test_string_status() {
+    struct kmod_context kc;
+    maildb_mail_info mail_info;
+    maildb_mail_info read_info;
+    maildb_sender_info sender_info;
+    karray id_array, mail_info_array, sender_info_array;
+    int error;
+    
+    test_open_mail_db(&kc);
+    maildb_init_mail_info(&mail_info);
+    maildb_init_mail_info(&read_info);
+    maildb_init_sender_info(&sender_info);
+    karray_init(&id_array);
+    karray_init(&mail_info_array);
+    karray_init(&sender_info_array);
+    
+    test_fill_signed_mail(&mail_info, "id1");
+    error = kmod_set_mail_info(&kc, &mail_info);
+    assert(! error);
+    
+    karray_add(&id_array, &mail_info.msg_id);
+    karray_add(&mail_info_array, &read_info);
+    karray_add(&sender_info_array, &sender_info);
+    error = maildb_get_mail_info_batch(kc.mail_db, &id_array, &mail_info_array, &sender_info_array,
+    	    	    	    	       KMOD_STRING_STATUS_FIELDS);
+    assert(! error);
+    assert(read_info.entry_id != 0);
+    
+    /* The attachment statuses are needed to tell the mail is intact. */
+    assert(kmod_get_mail_info_string_status(&mail_info) == 5);
+    assert(kmod_get_mail_info_string_status(&read_info) == 5);
+    (void) error;
+    
+    karray_free(&id_array);
+    karray_free(&mail_info_array);
+    karray_free(&sender_info_array);
+    maildb_free_mail_info(&mail_info);
+    maildb_free_mail_info(&read_info);
+    maildb_free_sender_info(&sender_info);
+    test_close_mail_db(&kc);
+}
+
+/* This function reads the status of the mail having the message ID specified
+ * from the database and caches it, like a string status lookup.
+ */
+static struct kmod_status_entry * test_cache_status(struct kmod_context *kc, kstr *msg_id) {
+    struct kmod_status_entry *entry = kmod_status_entry_new(msg_id);
+    karray id_array, mail_info_array, sender_info_array;
+    int error;
+    
+    karray_init(&id_array);
+    karray_init(&mail_info_array);
+    karray_init(&sender_info_array);
+    karray_add(&id_array, msg_id);
+    karray_add(&mail_info_array, &entry->mail_info);
+    karray_add(&sender_info_array, &entry->sender_info);
+    
+    error = maildb_get_mail_info_batch(kc->mail_db, &id_array, &mail_info_array, &sender_info_array,
+    	    	    	    	       KMOD_STRING_STATUS_FIELDS);
+    assert(! error);
+    assert(entry->mail_info.entry_id != 0);
+    kstr_assign_kstr(&entry->mail_info.msg_id, msg_id);
+    kmod_status_cache_add(kc, entry);
+    (void) error;
+    
+    karray_free(&id_array);
+    karray_free(&mail_info_array);
+    karray_free(&sender_info_array);
+    return entry;
+}
+
+/* Check that writing the entry shared by two message IDs discards the cached
+ * status of both.
+ */
+static void test_status_cache_shared_entry() {
+    struct kmod_context kc;
+    maildb_mail_info mail_info;
+    struct kmod_status_entry *entry;
+    kstr id1, id2;
+    int64_t entry_id;
+    int error;
+    
+    test_open_mail_db(&kc);
+    maildb_init_mail_info(&mail_info);
+    kstr_init_cstr(&id1, "id1");
+    kstr_init_cstr(&id2, "id2");
+    
+    /* Both message IDs refer to the same hash, hence to the same entry. */
+    test_fill_signed_mail(&mail_info, "id1");
+    error = kmod_set_mail_info(&kc, &mail_info);
+    assert(! error);
+    
+    kstr_assign_kstr(&mail_info.msg_id, &id2);
+    error = kmod_set_mail_info(&kc, &mail_info);
+    assert(! error);
+    
+    /* Cache the status of both mails. */
+    entry = test_cache_status(&kc, &id1);
+    entry_id = entry->mail_info.entry_id;
+    entry = test_cache_status(&kc, &id2);
+    assert(entry->mail_info.entry_id == entry_id);
+    
+    assert(kmod_status_cache_lookup(&kc, &id1, 0) != NULL);
+    assert(kmod_status_cache_lookup(&kc, &id2, 0) != NULL);
+    
+    /* Rewrite the entry through the first message ID, as when a copy of an
+     * encrypted mail is decrypted.
+     */
+    kstr_assign_kstr(&mail_info.msg_id, &id1);
+    mail_info.encryption_status = KMO_DECRYPTION_STATUS_DECRYPTED;
+    error = kmod_set_mail_info(&kc, &mail_info);
+    assert(! error);
+    assert(mail_info.entry_id == entry_id);
+    
+    assert(kmod_status_cache_lookup(&kc, &id1, 0) == NULL);
+    assert(kmod_status_cache_lookup(&kc, &id2, 0) == NULL);
+    (void) error;
+    (void) entry_id;
+    
+    kstr_free(&id1);
+    kstr_free(&id2);
+    maildb_free_mail_info(&mail_info);
+    test_close_mail_db(&kc);
+}
+
+void kmod_do_tests() {
+    test_string_status();
+    test_status_cache_shared_entry();
+}
+#endif
+
 int main(int argc, char **argv) {
     
     /* Error status: 0=>keep going, -1=>exit with failure, -2=>exit with success. */
@@ -6673,7 +9223,7 @@ int main(int argc, char **argv) {
     do {
 	/* Parse the arguments. */
 	while (1) {
-	    int cmd = getopt(argc, argv, "C:p:l:k:d:m:a:hvDtz:");
+	    int cmd = getopt(argc, argv, "C:p:u:l:k:d:m:s:a:S:b:Z:T:hvDtwz:");
 
 	    /* Error. */
 	    if (cmd == '?' || cmd == ':') {
@@ -6691,6 +9241,14 @@ int main(int argc, char **argv) {
 
 		else if (strcasecmp(optarg, "kpp_connect") == 0)
 		    kc.kpp_conn_type = KPP_CONN_KPP_CONNECT;
+		
+		#ifdef __UNIX__
+		else if (strcasecmp(optarg, "unix_kmod_connect") == 0)
+		    kc.kpp_conn_type = KPP_CONN_UNIX_KMOD_CONNECT;
+		
+		else if (strcasecmp(optarg, "unix_kpp_connect") == 0)
+		    kc.kpp_conn_type = KPP_CONN_UNIX_KPP_CONNECT;
+		#endif
 
         	else {
 		    fprintf(stderr, "Invalid transport specified (%s).\n", optarg);
@@ -6710,6 +9268,10 @@ int main(int argc, char **argv) {
 		}
 	    }
 
+	    else if (cmd == 'u') {
+	    	kstr_assign_cstr(&kc.kpp_conn_path, optarg);
+	    }
+
 	    else if (cmd == 'l') {
 		if (! strcmp(optarg, "0")) kmod_log_level = 0;
     		else if (! strcmp(optarg, "1")) kmod_log_level = 1;
@@ -6740,6 +9302,50 @@ int main(int argc, char **argv) {
 		}
 	    }
 
+	    else if (cmd == 's') {
+		char *end;
+		sig_key_cache_ttl = strtol(optarg, &end, 10);
+
+		if (*end != 0 || sig_key_cache_ttl < 0) {
+    		    fprintf(stderr, "Invalid signature key lifetime (%s).\n", optarg);
+		    error = -1;
+		    break;
+		}
+	    }
+
+	    else if (cmd == 'b') {
+		char *end;
+		k3p_spill_threshold = strtol(optarg, &end, 10);
+
+		if (*end != 0 || k3p_spill_threshold < 0) {
+    		    fprintf(stderr, "Invalid K3P string size (%s).\n", optarg);
+		    error = -1;
+		    break;
+		}
+	    }
+
+	    else if (cmd == 'Z') {
+		char *end;
+		knp_compress_threshold = strtol(optarg, &end, 10);
+
+		if (*end != 0 || knp_compress_threshold < 0) {
+    		    fprintf(stderr, "Invalid KNP payload size (%s).\n", optarg);
+		    error = -1;
+		    break;
+		}
+	    }
+
+	    else if (cmd == 'T') {
+		char *end;
+		trace_threshold = strtol(optarg, &end, 10);
+
+		if (*end != 0 || trace_threshold < 0) {
+    		    fprintf(stderr, "Invalid trace threshold (%s).\n", optarg);
+		    error = -1;
+		    break;
+		}
+	    }
+
 	    else if (cmd == 'h') {
     		kmod_print_usage(stdout);
 		error = -2;
@@ -6758,6 +9364,9 @@ int main(int argc, char **argv) {
 	    else if (cmd == 't')
 		kmod_truncate_log_flag = 1;
 	    
+	    else if (cmd == 'w')
+		group_commit_flag = 1;
+	    
 	    else if (cmd == 'a') {
 		kstr_assign_cstr(&kc.enc_key_lookup_str, optarg);
 	    }
@@ -6766,6 +9375,9 @@ int main(int argc, char **argv) {
                 kstr_assign_cstr(&kc.all_req_str, optarg);
             }
 
+	    else if (cmd == 'S')
+		kstr_assign_cstr(&kc.stats_path, optarg);
+
 	    /* Out of args. */
 	    else if (cmd == -1)
 		break;
@@ -6788,14 +9400,6 @@ int main(int argc, char **argv) {
     	
 	/* Initialize the allowed character table for attachments. */
     	initialize_allowed_file_char();
-
-	/* Initialize kmocrypt. */
-	kmocrypt_init();
-
-	/* Initialise the SSL library. */
-	SSL_library_init();
-	SSL_load_error_strings();
-	OpenSSL_add_all_algorithms();
 	    
 	/* Ignore SIGPIPE on UNIX. */
 	#ifdef __UNIX__
@@ -6804,6 +9408,8 @@ int main(int argc, char **argv) {
         
 	/* Try. */
 	do {	
+	    uint64_t phase_start = kmo_stats_now();
+	    
 	    /* Get the path to the Teambox directory. */
 	    error = kmod_get_teambox_path(&kc);
 	    if (error) break;
@@ -6811,10 +9417,16 @@ int main(int argc, char **argv) {
 	    /* Create the Teambox directory if it doesn't exist. */
 	    error = kmod_create_teambox_dir(&kc);
 	    if (error) break;
+	    
+	    /* Write the large K3P strings in the temporary directory. */
+	    kc.k3p.spill_threshold = k3p_spill_threshold;
+	    kstr_sf(&kc.k3p.spill_dir, "%s/tmp", kc.teambox_dir_path.data);
 
 	    /* Open the logs. */
 	    error = kmod_open_log(&kc);
 	    if (error) break;
+	    
+	    phase_start = kmod_end_startup_phase("logs", phase_start);
 
 	    /* Initialize Windows stuff. */
     	    #ifdef __WINDOWS__
@@ -6826,23 +9438,22 @@ int main(int argc, char **argv) {
 		break;
 	    }
 	    #endif
-
-	    /* Open the KMO mail database. */
-	    error = kmod_open_mail_db(&kc);
-	    if (error) break;
-	    
-	    /* Verify the integrity of the database. */
-	    int maildb_integrity_check(maildb *mdb);
-	    error = maildb_integrity_check(kc.mail_db);
-	    if (error) break;
 	    
-	    /* Connect to the plugin. */
+	    /* Connect to the plugin. The handshake does not need the crypto
+	     * libraries nor the mail database, so they are initialized
+	     * afterwards and the plugin does not wait for them.
+	     */
 	    kc.k3p.timeout_enabled = !is_standalone;
 	    error = kmod_connect_to_plugin(&kc);
 	    if (error) break;
+	    
+	    phase_start = kmod_end_startup_phase("plugin_connect", phase_start);
+	    error = kmod_init_after_connect(&kc);
+	    if (error) break;
 
-	    /* Set the timeout value for the KNP. */
+	    /* Set the timeout value and the compression threshold for the KNP. */
 	    kc.knp.timeout = operation_timeout;
+	    kc.knp.compress_threshold = knp_compress_threshold;
 
 	    /* Enter the main loop. */
 	    error = kmod_loop(&kc);
@@ -6865,6 +9476,17 @@ int main(int argc, char **argv) {
     	    kmod_log_msg(1, "No error occurred, exiting.\n");
 	}
 
+	/* Free the SSL session cache and the SSL contexts. */
+	kmo_ssl_cache_close();
+	kmo_ssl_ctx_close();
+	
+	/* Stop the workers, which may log. */
+	kmo_workpool_destroy(kc.workpool);
+	kc.workpool = NULL;
+	
+	/* Free the statistics. */
+	kmo_stats_free();
+	
 	/* Close the logs. */
 	kmod_close_log(&kc);
 	
@@ -5,21 +5,32 @@
 
 #include "kmo_base.h"
 
+struct kmo_log;
+
 /* This file is used to obtain a log of the transactions between KMOD and a
  * plugin. The log is formatted in a way that enable a program to replay the 
  * transactions that occurred. The log is used to generate the KMOD tests.
  */
-extern FILE *k3p_log;
+extern struct kmo_log *k3p_log;
 
 /* Same as above, but for the KNP. */
-extern FILE *knp_log;
+extern struct kmo_log *knp_log;
 
 /* This file logs the actions performed by KMOD. */
-extern FILE *kmod_log;
+extern struct kmo_log *kmod_log;
 
 /* K3P log mode: 0: none, 1: input, 2: output. */
 extern int k3p_log_mode;
 
+/* KMOD logging level. */
+extern int kmod_log_level;
+
 void kmod_log_msg(int level, const char *format, ...);
 
+/* This macro logs a level 3 message. The arguments are not evaluated and
+ * kmod_log_msg() is not called unless that level is enabled, so it can be used
+ * on the hot paths.
+ */
+#define kmod_log_trace(...) do { if (kmod_log_level >= 3) kmod_log_msg(3, __VA_ARGS__); } while (0)
+
 #endif
@@ -0,0 +1,1207 @@
+/* Copyright (C) 2006-2012 Opersys inc., All rights reserved. */
+
+/* This program benchmarks KMOD by replaying recorded K3P sessions against it.
+ * It is the native counterpart of the replay/kmo_replay and replay/knp_replay
+ * scripts: instead of validating a single replay, it runs many replays
+ * concurrently and at a configurable rate, and reports the latency of each K3P
+ * instruction and the throughput.
+ *
+ * Each worker starts its own KMOD process in 'kpp_connect' mode, with its own
+ * Teambox directory, and plays one of the K3P logs specified on the command
+ * line (the *_k3p.log files produced by KMOD). The latency of an instruction
+ * is the time elapsed between the moment the last input element is sent and
+ * the moment the last output element recorded in the log is received.
+ *
+ * If a KNP log is specified, a stub server serves the recorded KNP replies in
+ * place of the KPS/KOS. The stub replies to each request with the next reply
+ * recorded for a request of the same type. KMOD must be built with the
+ * 'debug_kos_address' and 'debug_kos_port' options pointing to the stub, and
+ * without NDEBUG so that it does not check the server certificate. The sessions
+ * must have been recorded with the KOS, not with a KPS. The logs must have been
+ * recorded with the full payloads, not with the payload digests.
+ *
+ * This program is only supported on UNIX.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "kmo_base.h"
+#include "knp_core_defs.h"
+#include "utils.h"
+
+/* Block types of a K3P session. */
+#define BENCH_BLOCK_INPUT   1
+#define BENCH_BLOCK_OUTPUT  2
+
+/* Number of sub-buckets per power of 2 in the latency histograms. */
+#define BENCH_HIST_SUB_BITS 4
+#define BENCH_HIST_SUB	    (1 << BENCH_HIST_SUB_BITS)
+
+/* Number of buckets in the latency histograms. The latencies are in
+ * microseconds and fit on 32 bits.
+ */
+#define BENCH_HIST_SIZE     ((32 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+/* Time allowed to KMOD to start listening, in milliseconds. */
+#define BENCH_CONNECT_TIMEOUT	10000
+
+/* Default base port of the KMOD processes. */
+#define BENCH_DEF_KMOD_PORT	32000
+
+/* Default port of the stub KNP server. */
+#define BENCH_DEF_STUB_PORT	4443
+
+/* Block of a K3P session: the elements sent to KMOD in a row, or the elements
+ * received from KMOD in a row.
+ */
+struct bench_block {
+
+    /* BENCH_BLOCK_INPUT or BENCH_BLOCK_OUTPUT. */
+    int type;
+
+    /* Input block: the bytes to send. */
+    kstr data;
+
+    /* Input block: instruction the block belongs to. */
+    kstr ins;
+
+    /* Output block: kinds of the elements expected: 'N' for an instruction, 'I'
+     * for an integer and 'S' for a string.
+     */
+    kstr kinds;
+};
+
+/* K3P session recorded in a log. */
+struct bench_session {
+    char *path;
+
+    /* Array of bench_block. */
+    karray block_array;
+};
+
+/* Latency histogram. */
+struct bench_hist {
+    uint64_t count;
+    uint32_t max;
+    uint32_t bucket[BENCH_HIST_SIZE];
+};
+
+/* Replies recorded for one KNP request type. */
+struct bench_knp_replies {
+    uint32_t type;
+
+    /* Array of kstr, each holding a whole KNP message. */
+    karray reply_array;
+
+    /* Next reply to serve. */
+    int next;
+};
+
+/* Worker state. */
+struct bench_worker {
+    int id;
+    pthread_t thread;
+
+    /* Number of sessions played and failed. */
+    int nb_session;
+    int nb_error;
+
+    /* Number of instructions played. */
+    uint64_t nb_ins;
+
+    /* Hash of instruction code kstr => bench_hist. */
+    khash hist_hash;
+};
+
+/* Benchmark options. */
+static char *kmod_path = "./kmod";
+static char *teambox_base = "bench_teambox";
+static int kmod_base_port = BENCH_DEF_KMOD_PORT;
+static int nb_worker = 1;
+static int nb_total_session = 1;
+static double session_rate = 0.0;
+static char *knp_log_path = NULL;
+static int stub_port = BENCH_DEF_STUB_PORT;
+static char *stub_cert_path = NULL;
+static char *stub_key_path = NULL;
+
+/* Array of bench_session. */
+static karray session_array;
+
+/* Number of sessions started so far. */
+static int nb_session_started = 0;
+
+/* Time at which the next session may start, in microseconds, when the rate is
+ * limited.
+ */
+static uint64_t next_session_time = 0;
+
+/* Protects the session counter, the pacing and the stub reply cursors. */
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Stub KNP server state. Hash of request type => bench_knp_replies. */
+static khash stub_reply_hash;
+static SSL_CTX *stub_ssl_ctx = NULL;
+static int stub_fd = -1;
+static volatile int stub_stop_flag = 0;
+static pthread_t stub_thread;
+
+/* This function returns the current time in microseconds. */
+static uint64_t bench_now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* This function returns the histogram bucket of the latency specified. */
+static int bench_hist_bucket(uint32_t value) {
+    int e;
+
+    if (value < BENCH_HIST_SUB) return value;
+
+    for (e = 31; ! (value & (1u << e)); e--) {}
+    return (e - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB + ((value >> (e - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+/* This function returns the smallest latency falling in the bucket specified. */
+static uint32_t bench_hist_value(int bucket) {
+    int e, sub;
+
+    if (bucket < BENCH_HIST_SUB) return bucket;
+
+    e = bucket / BENCH_HIST_SUB + BENCH_HIST_SUB_BITS - 1;
+    sub = bucket % BENCH_HIST_SUB;
+    return (uint32_t) (BENCH_HIST_SUB + sub) << (e - BENCH_HIST_SUB_BITS);
+}
+
+/* This function adds a latency to the histogram. */
+static void bench_hist_add(struct bench_hist *hist, uint32_t value) {
+    hist->count++;
+    hist->bucket[bench_hist_bucket(value)]++;
+    if (value > hist->max) hist->max = value;
+}
+
+/* This function adds the content of a histogram to another. */
+static void bench_hist_merge(struct bench_hist *hist, struct bench_hist *other) {
+    int i;
+
+    hist->count += other->count;
+    if (other->max > hist->max) hist->max = other->max;
+    for (i = 0; i < BENCH_HIST_SIZE; i++) hist->bucket[i] += other->bucket[i];
+}
+
+/* This function returns the latency at the percentile specified. */
+static uint32_t bench_hist_percentile(struct bench_hist *hist, double percentile) {
+    uint64_t target = (uint64_t) (hist->count * percentile / 100.0);
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < BENCH_HIST_SIZE; i++) {
+    	seen += hist->bucket[i];
+	if (seen > target) return bench_hist_value(i);
+    }
+
+    return hist->max;
+}
+
+/* This function reads the whole file specified in 'buf'.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_read_file(char *path, kstr *buf) {
+    int error = 0;
+    int size;
+    FILE *file = NULL;
+
+    /* Try. */
+    do {
+    	error = util_open_file(&file, path, "rb");
+	if (error) break;
+
+	error = util_get_file_size(file, &size);
+	if (error) break;
+
+	kstr_grow(buf, size);
+	error = util_read_file(file, buf->data, size);
+	if (error) break;
+
+	buf->data[size] = 0;
+	buf->slen = size;
+
+    } while (0);
+
+    util_close_file(&file, 1);
+    return error;
+}
+
+/* This function parses a decimal number terminated by '>' at the position
+ * specified.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_parse_number(kstr *buf, int *pos, uint32_t *value) {
+    int start = *pos;
+    *value = 0;
+
+    while (*pos < buf->slen && buf->data[*pos] >= '0' && buf->data[*pos] <= '9') {
+    	*value = *value * 10 + (buf->data[*pos] - '0');
+	(*pos)++;
+    }
+
+    if (*pos == start || *pos == buf->slen || buf->data[*pos] != '>') {
+    	kmo_seterror("invalid number at offset %d", start);
+	return -1;
+    }
+
+    (*pos)++;
+    return 0;
+}
+
+/* This function returns the current block of the session if it has the type
+ * specified, otherwise it appends a new block of that type.
+ */
+static struct bench_block * bench_get_block(struct bench_session *session, int type, kstr *ins) {
+    struct bench_block *block = NULL;
+
+    if (session->block_array.size) {
+    	block = (struct bench_block *) session->block_array.data[session->block_array.size - 1];
+	if (block->type == type) return block;
+    }
+
+    block = (struct bench_block *) kmo_calloc(sizeof(struct bench_block));
+    block->type = type;
+    kstr_init(&block->data);
+    kstr_init_kstr(&block->ins, ins);
+    kstr_init(&block->kinds);
+    karray_add(&session->block_array, block);
+    return block;
+}
+
+/* This function loads the K3P session recorded in the log specified.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_load_session(struct bench_session *session) {
+    int error = 0;
+    int pos = 0;
+    int mode = BENCH_BLOCK_INPUT;
+    kstr buf, ins;
+
+    kstr_init(&buf);
+    kstr_init_cstr(&ins, "????????");
+
+    /* Try. */
+    do {
+    	error = bench_read_file(session->path, &buf);
+	if (error) break;
+
+	while (1) {
+	    struct bench_block *block;
+	    char *p;
+	    uint32_t value;
+
+	    while (pos < buf.slen && isspace(buf.data[pos])) pos++;
+	    if (pos == buf.slen) break;
+
+	    p = buf.data + pos;
+
+	    if (! strncmp(p, "INPUT>", 6)) {
+	    	mode = BENCH_BLOCK_INPUT;
+		pos += 6;
+		continue;
+	    }
+
+	    if (! strncmp(p, "OUTPUT>", 7)) {
+	    	mode = BENCH_BLOCK_OUTPUT;
+		pos += 7;
+		continue;
+	    }
+
+	    if (pos + 3 > buf.slen) {
+	    	kmo_seterror("truncated element at offset %d", pos);
+		error = -1;
+		break;
+	    }
+
+	    if (! strncmp(p, "INS", 3)) {
+	    	if (pos + 11 > buf.slen) {
+		    kmo_seterror("truncated instruction at offset %d", pos);
+		    error = -1;
+		    break;
+		}
+
+		/* An input instruction starts a new request. */
+		if (mode == BENCH_BLOCK_INPUT) kstr_assign_buf(&ins, p + 3, 8);
+
+		block = bench_get_block(session, mode, &ins);
+		if (mode == BENCH_BLOCK_INPUT) kstr_append_buf(&block->data, p, 11);
+		else kstr_append_char(&block->kinds, 'N');
+		pos += 11;
+	    }
+
+	    else if (! strncmp(p, "INT", 3)) {
+	    	int start = pos;
+		pos += 3;
+		error = bench_parse_number(&buf, &pos, &value);
+		if (error) break;
+
+		block = bench_get_block(session, mode, &ins);
+		if (mode == BENCH_BLOCK_INPUT) kstr_append_buf(&block->data, buf.data + start, pos - start);
+		else kstr_append_char(&block->kinds, 'I');
+	    }
+
+	    else if (! strncmp(p, "STR", 3)) {
+	    	int start = pos;
+		pos += 3;
+		error = bench_parse_number(&buf, &pos, &value);
+		if (error) break;
+
+		if (value > (uint32_t) (buf.slen - pos)) {
+		    kmo_seterror("truncated string at offset %d", start);
+		    error = -1;
+		    break;
+		}
+
+		pos += value;
+
+		/* The log writes a newline after each string. */
+		if (pos < buf.slen && ! isspace(buf.data[pos])) {
+		    kmo_seterror("string length mismatch at offset %d (payloads logged as digests?)", start);
+		    error = -1;
+		    break;
+		}
+
+		block = bench_get_block(session, mode, &ins);
+		if (mode == BENCH_BLOCK_INPUT) kstr_append_buf(&block->data, buf.data + start, pos - start);
+		else kstr_append_char(&block->kinds, 'S');
+	    }
+
+	    else {
+	    	kmo_seterror("unknown element at offset %d", pos);
+		error = -1;
+		break;
+	    }
+	}
+
+	if (error) break;
+
+    } while (0);
+
+    if (error) kmo_seterror("cannot load %s: %s", session->path, kmo_strerror());
+
+    kstr_free(&buf);
+    kstr_free(&ins);
+    return error;
+}
+
+/* This function frees a session. */
+static void bench_free_session(struct bench_session *session) {
+    int i;
+
+    for (i = 0; i < session->block_array.size; i++) {
+    	struct bench_block *block = (struct bench_block *) session->block_array.data[i];
+	kstr_free(&block->data);
+	kstr_free(&block->ins);
+	kstr_free(&block->kinds);
+	free(block);
+    }
+
+    karray_free(&session->block_array);
+    free(session);
+}
+
+/* This function reads a line of the KNP log, up to a newline or a '>'. */
+static int bench_knp_read_line(kstr *buf, int *pos, kstr *line) {
+    int start = *pos;
+
+    while (*pos < buf->slen && buf->data[*pos] != '\n' && buf->data[*pos] != '>') (*pos)++;
+
+    if (*pos == buf->slen) {
+    	kmo_seterror("truncated line at offset %d", start);
+	return -1;
+    }
+
+    kstr_assign_buf(line, buf->data + start, *pos - start);
+    (*pos)++;
+    return 0;
+}
+
+/* This function parses the dump of a KNP payload, as produced by
+ * knp_msg_dump(), back in binary form.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_knp_parse_payload(kstr *buf, int *pos, kbuffer *payload) {
+    int error = 0;
+    kstr line;
+    kstr_init(&line);
+
+    while (1) {
+    	uint32_t len;
+
+	/* An empty line ends the payload. */
+	if (*pos < buf->slen && buf->data[*pos] == '\n') {
+	    (*pos)++;
+	    break;
+	}
+
+	error = bench_knp_read_line(buf, pos, &line);
+	if (error) break;
+
+	if (kstr_equal_cstr(&line, "uint32")) {
+	    error = bench_knp_read_line(buf, pos, &line);
+	    if (error) break;
+	    kbuffer_write8(payload, KNP_UINT32);
+	    kbuffer_write32(payload, strtoul(line.data, NULL, 10));
+	}
+
+	else if (kstr_equal_cstr(&line, "uint64")) {
+	    error = bench_knp_read_line(buf, pos, &line);
+	    if (error) break;
+	    kbuffer_write8(payload, KNP_UINT64);
+	    kbuffer_write64(payload, strtoull(line.data, NULL, 10));
+	}
+
+	else if (sscanf(line.data, "string %u", &len) == 1) {
+
+	    /* Skip the space before the string and the newline after it. */
+	    if (*pos + 1 + len + 1 > (uint32_t) buf->slen) {
+	    	kmo_seterror("truncated string at offset %d", *pos);
+		error = -1;
+		break;
+	    }
+
+	    kbuffer_write8(payload, KNP_STR);
+	    kbuffer_write32(payload, len);
+	    kbuffer_write(payload, (uint8_t *) buf->data + *pos + 1, len);
+	    *pos += 1 + len + 1;
+	}
+
+	else {
+	    kmo_seterror("unexpected KNP payload line '%s'", line.data);
+	    error = -1;
+	    break;
+	}
+    }
+
+    kstr_free(&line);
+    return error;
+}
+
+/* This function loads the KNP replies recorded in the KNP log.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_load_knp_log(char *path) {
+    int error = 0;
+    int pos = 0;
+    uint32_t request_type = 0;
+    int have_request = 0;
+    kstr buf, line;
+    kbuffer payload;
+
+    kstr_init(&buf);
+    kstr_init(&line);
+    kbuffer_init(&payload, 1024);
+
+    /* Try. */
+    do {
+    	error = bench_read_file(path, &buf);
+	if (error) break;
+
+	while (1) {
+	    char side[16];
+	    uint32_t major, minor, cat, id, len;
+
+	    while (pos < buf.slen && buf.data[pos] == '\n') pos++;
+	    if (pos == buf.slen) break;
+
+	    error = bench_knp_read_line(&buf, &pos, &line);
+	    if (error) break;
+
+	    if (sscanf(line.data, "%15s version=%u,%u type=%u,%u len=%u", side, &major, &minor, &cat, &id, &len) != 6) {
+	    	if (strstr(line.data, "badly formatted payload")) kmo_seterror("badly formatted payload in log");
+		else kmo_seterror("expected KNP message header, got '%s'", line.data);
+		error = -1;
+		break;
+	    }
+
+	    /* Skip the newline after the header. */
+	    if (pos < buf.slen && buf.data[pos] == '\n') pos++;
+
+	    if (pos < buf.slen && buf.data[pos] == '<') {
+	    	kmo_seterror("the payloads were logged as digests and cannot be replayed");
+		error = -1;
+		break;
+	    }
+
+	    kbuffer_clear(&payload);
+	    error = bench_knp_parse_payload(&buf, &pos, &payload);
+	    if (error) break;
+
+	    if (! strcmp(side, "INPUT")) {
+	    	request_type = KNP_MAGIC_NUMBER | (cat << 8) | id;
+		have_request = 1;
+	    }
+
+	    else if (have_request) {
+	    	struct bench_knp_replies *replies =
+		    (struct bench_knp_replies *) khash_get(&stub_reply_hash, &request_type);
+		kbuffer msg;
+		kstr *reply;
+
+		if (replies == NULL) {
+		    replies = (struct bench_knp_replies *) kmo_calloc(sizeof(struct bench_knp_replies));
+		    replies->type = request_type;
+		    karray_init(&replies->reply_array);
+		    khash_add(&stub_reply_hash, &replies->type, replies);
+		}
+
+		kbuffer_init(&msg, payload.len + 16);
+		kbuffer_write32(&msg, major);
+		kbuffer_write32(&msg, minor);
+		kbuffer_write32(&msg, KNP_MAGIC_NUMBER | (cat << 8) | id);
+		kbuffer_write32(&msg, payload.len);
+		kbuffer_write(&msg, payload.data, payload.len);
+
+		reply = kstr_new();
+		kstr_assign_buf(reply, msg.data, msg.len);
+		karray_add(&replies->reply_array, reply);
+		kbuffer_clean(&msg);
+
+		have_request = 0;
+	    }
+	}
+
+	if (error) break;
+
+    } while (0);
+
+    if (error) kmo_seterror("cannot load %s: %s", path, kmo_strerror());
+
+    kstr_free(&buf);
+    kstr_free(&line);
+    kbuffer_clean(&payload);
+    return error;
+}
+
+/* This function reads exactly 'len' bytes from the SSL connection.
+ * It returns -1 on failure or end of file.
+ */
+static int bench_ssl_read(SSL *ssl, void *buf, int len) {
+    while (len > 0) {
+    	int n = SSL_read(ssl, buf, len);
+	if (n <= 0) return -1;
+	buf = (char *) buf + n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+/* This function serves the requests of one KMOD connection. */
+static void * bench_stub_conn(void *arg) {
+    int fd = (int) (long) arg;
+    SSL *ssl = SSL_new(stub_ssl_ctx);
+    kbuffer msg;
+
+    kbuffer_init(&msg, 1024);
+
+    /* Try. */
+    do {
+    	if (ssl == NULL || ! SSL_set_fd(ssl, fd) || SSL_accept(ssl) <= 0) break;
+
+	while (1) {
+	    struct bench_knp_replies *replies;
+	    kstr *reply;
+	    uint32_t request_type, len;
+
+	    kbuffer_clear(&msg);
+	    if (bench_ssl_read(ssl, kbuffer_append_nbytes(&msg, 16), 16)) break;
+
+	    kbuffer_read32(&msg);
+	    kbuffer_read32(&msg);
+	    request_type = kbuffer_read32(&msg);
+	    len = kbuffer_read32(&msg);
+
+	    if (len > 20*1024*1024) break;
+	    if (len && bench_ssl_read(ssl, kbuffer_append_nbytes(&msg, len), len)) break;
+
+	    replies = (struct bench_knp_replies *) khash_get(&stub_reply_hash, &request_type);
+
+	    if (replies == NULL) {
+	    	fprintf(stderr, "Stub: no reply recorded for KNP request %x.\n", request_type);
+		break;
+	    }
+
+	    pthread_mutex_lock(&bench_mutex);
+	    reply = (kstr *) replies->reply_array.data[replies->next];
+	    replies->next = (replies->next + 1) % replies->reply_array.size;
+	    pthread_mutex_unlock(&bench_mutex);
+
+	    if (SSL_write(ssl, reply->data, reply->slen) != reply->slen) break;
+	}
+
+    } while (0);
+
+    if (ssl) SSL_free(ssl);
+    close(fd);
+    kbuffer_clean(&msg);
+    return NULL;
+}
+
+/* This function accepts the KMOD connections to the stub server. */
+static void * bench_stub_loop(void *arg) {
+    (void) arg;
+    
+    while (! stub_stop_flag) {
+    	struct pollfd pfd;
+	pthread_t thread;
+	int fd;
+
+	pfd.fd = stub_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 100) <= 0) continue;
+
+	fd = accept(stub_fd, NULL, NULL);
+	if (fd < 0) continue;
+
+	if (pthread_create(&thread, NULL, bench_stub_conn, (void *) (long) fd)) {
+	    close(fd);
+	    continue;
+	}
+
+	pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/* This function starts the stub KNP server.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_start_stub() {
+    struct sockaddr_in addr;
+    int opt = 1;
+
+    if (stub_cert_path == NULL || stub_key_path == NULL) {
+    	kmo_seterror("the stub server needs a certificate and a key (-S and -K)");
+	return -1;
+    }
+
+    stub_ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+
+    if (stub_ssl_ctx == NULL ||
+        SSL_CTX_use_certificate_file(stub_ssl_ctx, stub_cert_path, SSL_FILETYPE_PEM) != 1 ||
+	SSL_CTX_use_PrivateKey_file(stub_ssl_ctx, stub_key_path, SSL_FILETYPE_PEM) != 1) {
+	kmo_seterror("cannot load the stub server certificate: %s", ERR_error_string(ERR_get_error(), NULL));
+	return -1;
+    }
+
+    stub_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (stub_fd < 0) {
+    	kmo_seterror("cannot create socket: %s", kmo_syserror());
+	return -1;
+    }
+
+    setsockopt(stub_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(stub_port);
+
+    if (bind(stub_fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(stub_fd, 64)) {
+    	kmo_seterror("cannot listen on port %d: %s", stub_port, kmo_syserror());
+	return -1;
+    }
+
+    if (pthread_create(&stub_thread, NULL, bench_stub_loop, NULL)) {
+    	kmo_seterror("cannot create the stub server thread");
+	return -1;
+    }
+
+    return 0;
+}
+
+/* This function stops the stub KNP server. */
+static void bench_stop_stub() {
+    if (stub_fd != -1) {
+    	stub_stop_flag = 1;
+	pthread_join(stub_thread, NULL);
+	close(stub_fd);
+	stub_fd = -1;
+    }
+
+    if (stub_ssl_ctx) SSL_CTX_free(stub_ssl_ctx);
+}
+
+/* This function waits until the next session may start. It returns -1 if all
+ * the sessions have been started.
+ */
+static int bench_pace() {
+    uint64_t start_time = 0;
+
+    pthread_mutex_lock(&bench_mutex);
+
+    if (nb_session_started == nb_total_session) {
+    	pthread_mutex_unlock(&bench_mutex);
+	return -1;
+    }
+
+    nb_session_started++;
+
+    if (session_rate > 0.0) {
+    	uint64_t now = bench_now();
+	start_time = MAX(now, next_session_time);
+	next_session_time = start_time + (uint64_t) (1000000.0 / session_rate);
+    }
+
+    pthread_mutex_unlock(&bench_mutex);
+
+    if (start_time) {
+    	uint64_t now = bench_now();
+	if (start_time > now) usleep(start_time - now);
+    }
+
+    return 0;
+}
+
+/* This function writes all the data specified to the socket.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_write_all(int fd, char *buf, int len) {
+    while (len > 0) {
+    	int n = write(fd, buf, len);
+
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    kmo_seterror("cannot send to KMOD: %s", kmo_syserror());
+	    return -1;
+	}
+
+	buf += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+/* This function reads exactly 'len' bytes from the socket. If 'buf' is NULL,
+ * the bytes are discarded.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_read_all(int fd, char *buf, uint32_t len) {
+    char discard[4096];
+
+    while (len > 0) {
+    	int n = read(fd, buf ? buf : discard, buf ? len : MIN(len, sizeof(discard)));
+
+	if (n < 0 && errno == EINTR) continue;
+
+	if (n <= 0) {
+	    kmo_seterror(n ? "cannot receive from KMOD: %s" : "KMOD closed the connection", kmo_syserror());
+	    return -1;
+	}
+
+	if (buf) buf += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+/* This function receives the elements of an output block from KMOD.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_recv_block(int fd, struct bench_block *block) {
+    int i;
+
+    for (i = 0; i < block->kinds.slen; i++) {
+    	char head[3];
+	char c;
+	uint32_t value = 0;
+
+	if (bench_read_all(fd, head, 3)) return -1;
+
+	if (block->kinds.data[i] == 'N') {
+	    if (strncmp(head, "INS", 3)) goto mismatch;
+	    if (bench_read_all(fd, NULL, 8)) return -1;
+	    continue;
+	}
+
+	if (strncmp(head, block->kinds.data[i] == 'I' ? "INT" : "STR", 3)) goto mismatch;
+
+	while (1) {
+	    if (bench_read_all(fd, &c, 1)) return -1;
+	    if (c == '>') break;
+
+	    if (c < '0' || c > '9') {
+	    	kmo_seterror("invalid number received from KMOD");
+		return -1;
+	    }
+
+	    value = value * 10 + (c - '0');
+	}
+
+	if (block->kinds.data[i] == 'S' && bench_read_all(fd, NULL, value)) return -1;
+	continue;
+
+    mismatch:
+    	kmo_seterror("KMOD sent '%.3s' where the log has element %d of kind '%c'", head, i, block->kinds.data[i]);
+	return -1;
+    }
+
+    return 0;
+}
+
+/* This function starts a KMOD process for the worker specified and connects
+ * to it.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_start_kmod(struct bench_worker *worker, pid_t *pid, int *fd) {
+    struct sockaddr_in addr;
+    uint64_t deadline;
+    char port_str[16];
+    kstr dir;
+    int error = 0;
+    int port = kmod_base_port + worker->id;
+
+    kstr_init(&dir);
+    kstr_sf(&dir, "%s/worker_%d", teambox_base, worker->id);
+    sprintf(port_str, "%d", port);
+
+    *fd = -1;
+    *pid = fork();
+
+    if (*pid == 0) {
+    	execl(kmod_path, kmod_path, "-C", "kpp_connect", "-p", port_str, "-k", dir.data, "-l", "0", "-D",
+	      (char *) NULL);
+	fprintf(stderr, "Cannot execute %s: %s.\n", kmod_path, kmo_syserror());
+	_exit(1);
+    }
+
+    /* Try. */
+    do {
+    	if (*pid < 0) {
+	    kmo_seterror("cannot fork: %s", kmo_syserror());
+	    error = -1;
+	    break;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	/* Loop until KMOD listens. */
+	deadline = bench_now() + BENCH_CONNECT_TIMEOUT * 1000;
+
+	while (1) {
+	    *fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	    if (*fd < 0) {
+	    	kmo_seterror("cannot create socket: %s", kmo_syserror());
+		error = -1;
+		break;
+	    }
+
+	    if (! connect(*fd, (struct sockaddr *) &addr, sizeof(addr))) break;
+
+	    close(*fd);
+	    *fd = -1;
+
+	    if (bench_now() > deadline || waitpid(*pid, NULL, WNOHANG) == *pid) {
+	    	kmo_seterror("cannot connect to KMOD on port %d", port);
+		*pid = -1;
+		error = -1;
+		break;
+	    }
+
+	    usleep(10000);
+	}
+
+    } while (0);
+
+    kstr_free(&dir);
+    return error;
+}
+
+/* This function plays a session with the worker specified.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int bench_play_session(struct bench_worker *worker, struct bench_session *session) {
+    int error = 0;
+    int fd = -1;
+    int i;
+    pid_t pid = -1;
+    uint64_t send_time = 0;
+    uint64_t latency;
+
+    /* Try. */
+    do {
+    	error = bench_start_kmod(worker, &pid, &fd);
+	if (error) break;
+
+	for (i = 0; i < session->block_array.size; i++) {
+	    struct bench_block *block = (struct bench_block *) session->block_array.data[i];
+	    struct bench_hist *hist;
+
+	    if (block->type == BENCH_BLOCK_INPUT) {
+	    	error = bench_write_all(fd, block->data.data, block->data.slen);
+		if (error) break;
+
+		send_time = bench_now();
+		continue;
+	    }
+
+	    error = bench_recv_block(fd, block);
+	    if (error) break;
+
+	    /* Account the reply to the instruction of the last input block. */
+	    if (i == 0) continue;
+	    block = (struct bench_block *) session->block_array.data[i - 1];
+
+	    hist = (struct bench_hist *) khash_get(&worker->hist_hash, &block->ins);
+
+	    if (hist == NULL) {
+	    	hist = (struct bench_hist *) kmo_calloc(sizeof(struct bench_hist));
+		khash_add(&worker->hist_hash, &block->ins, hist);
+	    }
+
+	    latency = bench_now() - send_time;
+	    bench_hist_add(hist, latency > 0xffffffffu ? 0xffffffffu : (uint32_t) latency);
+	    worker->nb_ins++;
+	}
+
+	if (error) break;
+
+    } while (0);
+
+    if (fd != -1) close(fd);
+    if (pid > 0) waitpid(pid, NULL, 0);
+
+    return error;
+}
+
+/* Worker thread. */
+static void * bench_worker_loop(void *arg) {
+    struct bench_worker *worker = (struct bench_worker *) arg;
+
+    while (bench_pace() == 0) {
+    	struct bench_session *session =
+	    (struct bench_session *) session_array.data[worker->nb_session % session_array.size];
+
+	worker->nb_session++;
+
+	if (bench_play_session(worker, session)) {
+	    fprintf(stderr, "Worker %d: session %s failed: %s.\n", worker->id, session->path, kmo_strerror());
+	    worker->nb_error++;
+	}
+    }
+
+    return NULL;
+}
+
+/* This function prints the report of the benchmark. */
+static void bench_report(struct bench_worker *worker_array, uint64_t elapsed) {
+    khash hist_hash;
+    karray ins_array;
+    int nb_session = 0, nb_error = 0;
+    uint64_t nb_ins = 0;
+    double seconds = elapsed / 1000000.0;
+    int i, j;
+
+    khash_init_func(&hist_hash, khash_kstr_key, khash_kstr_cmp);
+    karray_init(&ins_array);
+
+    for (i = 0; i < nb_worker; i++) {
+    	struct bench_worker *worker = worker_array + i;
+	int index = -1;
+
+	nb_session += worker->nb_session;
+	nb_error += worker->nb_error;
+	nb_ins += worker->nb_ins;
+
+	for (j = 0; j < worker->hist_hash.size; j++) {
+	    kstr *ins;
+	    struct bench_hist *hist, *total;
+	    khash_iter_next(&worker->hist_hash, &index, (void **) &ins, (void **) &hist);
+	    total = (struct bench_hist *) khash_get(&hist_hash, ins);
+
+	    if (total == NULL) {
+	    	total = (struct bench_hist *) kmo_calloc(sizeof(struct bench_hist));
+		khash_add(&hist_hash, ins, total);
+		karray_add(&ins_array, ins);
+	    }
+
+	    bench_hist_merge(total, hist);
+	    free(hist);
+	}
+
+	khash_free(&worker->hist_hash);
+    }
+
+    printf("Sessions: %d (%d failed) in %.2f s, %.2f sessions/s, %.2f instructions/s.\n\n",
+    	   nb_session, nb_error, seconds, nb_session / seconds, nb_ins / seconds);
+    printf("%-12s %10s %10s %10s %10s\n", "Instruction", "Count", "p50 (us)", "p99 (us)", "max (us)");
+
+    for (i = 0; i < ins_array.size; i++) {
+    	kstr *ins = (kstr *) ins_array.data[i];
+	struct bench_hist *hist = (struct bench_hist *) khash_get(&hist_hash, ins);
+
+	printf("%-12s %10llu %10u %10u %10u\n", ins->data, (unsigned long long) hist->count,
+	       bench_hist_percentile(hist, 50.0), bench_hist_percentile(hist, 99.0), hist->max);
+    }
+
+    for (j = 0; j < ins_array.size; j++) free(khash_get(&hist_hash, ins_array.data[j]));
+    khash_free(&hist_hash);
+    karray_free(&ins_array);
+}
+
+static void bench_print_usage(FILE *stream) {
+    fprintf(stream, "Usage: kmod_bench [-k <kmod path>] [-d <Teambox base dir>] [-p <base port>]\n"
+		    "                  [-c <workers>] [-n <sessions>] [-r <sessions/s>]\n"
+		    "                  [-N <KNP log> -S <cert> -K <key> [-P <port>]]\n"
+		    "                  <K3P log>...\n"
+		    "\n"
+		    "-k <path>        Path to the KMOD program. The default is ./kmod.\n"
+		    "-d <path>        Directory in which the Teambox directory of each worker is\n"
+		    "                   created. The default is bench_teambox.\n"
+		    "-p <port>        Port of the KMOD of the first worker; the next workers use\n"
+		    "                   the next ports. The default is 32000.\n"
+		    "-c <workers>     Number of sessions played concurrently. The default is 1.\n"
+		    "-n <sessions>    Total number of sessions played. The default is 1.\n"
+		    "-r <sessions/s>  Maximum rate at which the sessions are started. The default\n"
+		    "                   is unlimited.\n"
+		    "-N <path>        Serve the KNP replies recorded in this KNP log. KMOD must be\n"
+		    "                   built with debug_kos_address=127.0.0.1 and debug_kos_port\n"
+		    "                   set to the stub port.\n"
+		    "-S <path>        PEM certificate of the stub KNP server.\n"
+		    "-K <path>        PEM private key of the stub KNP server.\n"
+		    "-P <port>        Port of the stub KNP server. The default is 4443.\n"
+		    );
+}
+
+int main(int argc, char **argv) {
+    int error = 0;
+    int i, index;
+    uint64_t start_time;
+    struct bench_worker *worker_array = NULL;
+
+    kmo_error_start();
+    karray_init(&session_array);
+    khash_init_func(&stub_reply_hash, khash_int_key, khash_int_cmp);
+
+    SSL_library_init();
+    SSL_load_error_strings();
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Try. */
+    do {
+    	while (1) {
+	    int cmd = getopt(argc, argv, "k:d:p:c:n:r:N:S:K:P:h");
+
+	    if (cmd == -1) break;
+	    else if (cmd == 'k') kmod_path = optarg;
+	    else if (cmd == 'd') teambox_base = optarg;
+	    else if (cmd == 'p') kmod_base_port = atoi(optarg);
+	    else if (cmd == 'c') nb_worker = atoi(optarg);
+	    else if (cmd == 'n') nb_total_session = atoi(optarg);
+	    else if (cmd == 'r') session_rate = atof(optarg);
+	    else if (cmd == 'N') knp_log_path = optarg;
+	    else if (cmd == 'S') stub_cert_path = optarg;
+	    else if (cmd == 'K') stub_key_path = optarg;
+	    else if (cmd == 'P') stub_port = atoi(optarg);
+
+	    else {
+	    	bench_print_usage(cmd == 'h' ? stdout : stderr);
+		error = -1;
+		break;
+	    }
+	}
+
+	if (error) break;
+
+	if (optind == argc || nb_worker <= 0 || nb_total_session <= 0 || kmod_base_port <= 0) {
+	    bench_print_usage(stderr);
+	    error = -1;
+	    break;
+	}
+
+	/* Load the sessions. */
+	for (i = optind; i < argc; i++) {
+	    struct bench_session *session = (struct bench_session *) kmo_calloc(sizeof(struct bench_session));
+	    session->path = argv[i];
+	    karray_init(&session->block_array);
+	    karray_add(&session_array, session);
+
+	    error = bench_load_session(session);
+	    if (error) break;
+	}
+
+	if (error) break;
+
+	/* Start the stub server. */
+	if (knp_log_path) {
+	    error = bench_load_knp_log(knp_log_path);
+	    if (error) break;
+
+	    error = bench_start_stub();
+	    if (error) break;
+	}
+
+	if (! util_check_dir_exist(teambox_base)) {
+	    error = util_create_dir(teambox_base);
+	    if (error) break;
+	}
+
+	/* Run the workers. */
+	worker_array = (struct bench_worker *) kmo_calloc(nb_worker * sizeof(struct bench_worker));
+	start_time = bench_now();
+
+	for (i = 0; i < nb_worker; i++) {
+	    worker_array[i].id = i;
+	    khash_init_func(&worker_array[i].hist_hash, khash_kstr_key, khash_kstr_cmp);
+
+	    if (pthread_create(&worker_array[i].thread, NULL, bench_worker_loop, worker_array + i)) {
+	    	kmo_seterror("cannot create the worker threads");
+		error = -1;
+		nb_worker = i;
+		break;
+	    }
+	}
+
+	for (i = 0; i < nb_worker; i++) pthread_join(worker_array[i].thread, NULL);
+
+	if (error) break;
+
+	bench_report(worker_array, bench_now() - start_time);
+
+    } while (0);
+
+    if (error && kmo_strerror()[0]) fprintf(stderr, "Error: %s.\n", kmo_strerror());
+
+    bench_stop_stub();
+
+    for (i = 0; i < session_array.size; i++) bench_free_session((struct bench_session *) session_array.data[i]);
+    karray_free(&session_array);
+
+    index = -1;
+
+    for (i = 0; i < stub_reply_hash.size; i++) {
+	struct bench_knp_replies *replies = (struct bench_knp_replies *) khash_iter_next_value(&stub_reply_hash, &index);
+	kmo_clear_kstr_array(&replies->reply_array);
+	karray_free(&replies->reply_array);
+	free(replies);
+    }
+
+    khash_free(&stub_reply_hash);
+    free(worker_array);
+    kmo_error_end();
+
+    return error ? 1 : 0;
+}
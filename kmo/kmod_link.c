@@ -9,6 +9,8 @@
 #include "kbuffer.h"
 #include "kmo_comm.h"
 #include "kmo_sock.h"
+#include "kmo_ssl_cache.h"
+#include "kmo_ssl_ctx.h"
 
 #define kmod_data_transfer kmo_data_transfer
 #define kmod_transfer_hub kmo_transfer_hub
@@ -51,9 +53,22 @@
 #define KNP_STR			    3
 #define KNP_BIN			    4
 
+/* Flag set in the type of a message whose header carries a stream ID. The
+ * stream ID follows the type in the header. The reply to such a message
+ * carries the stream ID of the request, so that several requests can be in
+ * flight on the same session. The messages without the flag have stream ID 0.
+ */
+#define KLINK_STREAM_FLAG	    0x80000000
+
+/* Type of the message sent by KMOD to learn whether kappsd supports the stream
+ * IDs. Such a kappsd replies with a message of the same type. KMOD uses the
+ * stream IDs only after receiving that reply, since an older kappsd cannot
+ * parse them.
+ */
+#define KLINK_STREAM_HELLO	    0x7fff0001
+
 /* KNP SSL driver. */
 struct knp_ssl_driver {
-    SSL_CTX *ssl_ctx;
     SSL *ssl;
 };
 
@@ -254,10 +269,12 @@ static int klink_session_ssl_transfer(struct klink_session *session, int read_fl
 	
     return 0;
 }
-/* This function sends a message to the server.
+/* This function sends a message on the stream specified, 0 if the message has
+ * no stream.
  * This function sets the KMOD error string. It returns 0, -1, -2, or -3.
  */
-static int klink_session_send_msg(struct klink_session *self, uint32_t msg_type, kbuffer *payload) {
+static int klink_session_send_msg(struct klink_session *self, uint32_t stream_id, uint32_t msg_type,
+    	    	    	    	  kbuffer *payload) {
     int error = 0;
     kbuffer msg;
     kbuffer_init(&msg);
@@ -267,7 +284,15 @@ static int klink_session_send_msg(struct klink_session *self, uint32_t msg_type,
     /* Try. */
     do {
 	/* Send the message. */
-	kbuffer_write32(&msg, msg_type);
+	if (stream_id) {
+	    kbuffer_write32(&msg, msg_type | KLINK_STREAM_FLAG);
+	    kbuffer_write32(&msg, stream_id);
+	}
+	
+	else {
+	    kbuffer_write32(&msg, msg_type);
+	}
+	
 	kbuffer_write32(&msg, payload->len);
 	kbuffer_write(&msg, payload->data, payload->len);
 
@@ -281,10 +306,12 @@ static int klink_session_send_msg(struct klink_session *self, uint32_t msg_type,
     return error;
 }
 
-/* This function receives a message from the server.
+/* This function receives a message, and the stream it belongs to (0 if the
+ * message has no stream).
  * This function sets the KMOD error string. It returns 0, -1, -2, or -3.
  */
-static int klink_session_recv_msg(struct klink_session *self, uint32_t *msg_type, kbuffer *payload) {
+static int klink_session_recv_msg(struct klink_session *self, uint32_t *stream_id, uint32_t *msg_type,
+    	    	    	    	  kbuffer *payload) {
     int error = 0;
     uint32_t header_len = 2*4;
     uint32_t payload_size;
@@ -301,6 +328,20 @@ static int klink_session_recv_msg(struct klink_session *self, uint32_t *msg_type
 
 	lbuffer_read32(payload, msg_type);
 	lbuffer_read32(payload, &payload_size);
+	*stream_id = 0;
+	
+	/* The header is longer by the stream ID, which came first. */
+	if (*msg_type & KLINK_STREAM_FLAG) {
+	    *msg_type &= ~KLINK_STREAM_FLAG;
+	    *stream_id = payload_size;
+	    
+	    payload->pos = payload->len = 0;
+	    error = klink_session_ssl_transfer(self, 1, kbuffer_write_nbytes(payload, 4), 4,
+	    	    	    	    	       "cannot receive KAPPS message header");
+	    if (error) break;
+	    
+	    lbuffer_read32(payload, &payload_size);
+	}
 	
 	/* Receive the payload. */
 	payload->pos = payload->len = 0;
@@ -542,22 +583,63 @@ int link_msg_dump(kbuffer *buf, kstr *dump_str) {
 
 #ifdef __KAPPSD__
 
-/* This function negociates a SSL session with the client.
- * This function sets the KMOD error string. It returns 0, -1, -2, or -3.
- */ 
-static int klink_session_negociate_server_session(struct klink_session *session) {
-    int error = 0;
+/* Default number of pre-forked workers handling the connections. */
+#define KAPPSD_DEFAULT_POOL_SIZE	8
+
+/* Default number of connections handled by a worker before it is replaced. */
+#define KAPPSD_DEFAULT_WORKER_MAX_CONN	1000
+
+/* Pre-forked worker process. */
+struct kappsd_worker {
+    
+    /* Process ID, 0 if the slot is free. */
+    pid_t pid;
+    
+    /* Control socket used to pass the connections to the worker. The
+     * worker writes one byte on it when it is done with a connection.
+     */
+    int ctl_fd;
+    
+    /* True if the worker is handling a connection. */
+    int busy_flag;
+    
+    /* Number of connections passed to the worker. */
+    int nb_conn;
+};
+
+/* Size of the worker pool. 0 means fork one process per connection. */
+static int kappsd_pool_size = KAPPSD_DEFAULT_POOL_SIZE;
+
+/* Number of connections handled by a worker before it exits. */
+static int kappsd_worker_max_conn = KAPPSD_DEFAULT_WORKER_MAX_CONN;
+
+/* Array of kappsd_pool_size workers. */
+static struct kappsd_worker *kappsd_pool = NULL;
+
+/* SSL context shared by all the server sessions. It is created before the
+ * workers are forked.
+ */
+static SSL_CTX *kappsd_ssl_ctx = NULL;
+
+/* This function sets the size of the worker pool and the number of connections
+ * handled by a worker before it is replaced. It must be called before
+ * kappsd_linkage_loop().
+ */
+void kappsd_linkage_set_pool(int pool_size, int worker_max_conn) {
+    assert(pool_size >= 0 && worker_max_conn > 0);
+    kappsd_pool_size = pool_size;
+    kappsd_worker_max_conn = worker_max_conn;
+}
+
+/* This function creates the SSL context shared by the server sessions.
+ * This function sets the KMOD error string. It returns -1 on failure.
+ */
+static int kappsd_init_ssl_ctx() {
     SSL_METHOD *ssl_method;
-    BIO *ssl_bio;
     char *ssl_cert_file = global_opts.ssl_cert_path.data;
     char *ssl_key_file = global_opts.ssl_key_path.data;
     
-    kmod_log_msg(3, "klink_session_negociate_server_session() called.\n");
-    
-    /* Create the SSL driver. */
-    struct knp_ssl_driver *driver = (struct knp_ssl_driver *) kcalloc(sizeof(struct knp_ssl_driver));
-    assert(session->ssl_driver == NULL);
-    session->ssl_driver = driver;
+    if (kappsd_ssl_ctx) return 0;
     
     ssl_method = SSLv3_server_method();
     if (ssl_method == NULL) {
@@ -565,26 +647,49 @@ static int klink_session_negociate_server_session(struct klink_session *session)
 	return -1;
     }
     
-    driver->ssl_ctx = SSL_CTX_new(ssl_method);
-    if (driver->ssl_ctx == NULL) {
+    kappsd_ssl_ctx = SSL_CTX_new(ssl_method);
+    if (kappsd_ssl_ctx == NULL) {
     	kmod_set_error("cannot initialize SSL context");
 	return -1;
     }
 
-    if (SSL_CTX_use_certificate_chain_file(driver->ssl_ctx, ssl_cert_file) != 1 ||
-	SSL_CTX_use_PrivateKey_file(driver->ssl_ctx, ssl_key_file, SSL_FILETYPE_PEM) != 1 ||
-	SSL_CTX_load_verify_locations(driver->ssl_ctx, ssl_cert_file, NULL) != 1) {
+    if (SSL_CTX_use_certificate_chain_file(kappsd_ssl_ctx, ssl_cert_file) != 1 ||
+	SSL_CTX_use_PrivateKey_file(kappsd_ssl_ctx, ssl_key_file, SSL_FILETYPE_PEM) != 1 ||
+	SSL_CTX_load_verify_locations(kappsd_ssl_ctx, ssl_cert_file, NULL) != 1) {
 	kmod_set_error("cannot load certificate");
+	SSL_CTX_free(kappsd_ssl_ctx);
+	kappsd_ssl_ctx = NULL;
 	return -1;
     }
     
+    return 0;
+}
+
+/* This function negociates a SSL session with the client.
+ * This function sets the KMOD error string. It returns 0, -1, -2, or -3.
+ */ 
+static int klink_session_negociate_server_session(struct klink_session *session) {
+    int error = 0;
+    BIO *ssl_bio;
+    
+    kmod_log_msg(3, "klink_session_negociate_server_session() called.\n");
+    
+    /* Create the SSL driver. The SSL context is shared, it is not owned by the
+     * driver.
+     */
+    struct knp_ssl_driver *driver = (struct knp_ssl_driver *) kcalloc(sizeof(struct knp_ssl_driver));
+    assert(session->ssl_driver == NULL);
+    session->ssl_driver = driver;
+    
+    if (kappsd_init_ssl_ctx()) return -1;
+    
     ssl_bio = BIO_new_socket(session->transfer.fd, BIO_NOCLOSE);
     if (ssl_bio == NULL) {
     	kmod_set_error("cannot initialize SSL BIO");
 	return -1;
     }
     
-    driver->ssl = SSL_new(driver->ssl_ctx);
+    driver->ssl = SSL_new(kappsd_ssl_ctx);
     if (driver->ssl == NULL) {
     	kmod_set_error("cannot initialize SSL session");
 	return -1;
@@ -633,7 +738,7 @@ static int klink_session_negociate_server_session(struct klink_session *session)
 /* Process a single connection. */
 static void kappsd_handle_conn(int *sock) {
     int error = 0;
-    uint32_t in_type, out_type;
+    uint32_t stream_id, in_type, out_type;
     kbuffer in_buf, out_buf;
     struct klink_session session;
     struct kmod_data_transfer *transfer = &session.transfer;
@@ -673,13 +778,19 @@ static void kappsd_handle_conn(int *sock) {
 	error = klink_session_negociate_server_session(&session);
 	if (error) break;
 	
-	/* Loop processing messages. */
+	/* Loop processing messages. The client may send the next requests
+	 * without waiting for the replies. They are answered in order, on their
+	 * stream.
+	 */
 	while (1) {
 	
-	    /* Wait for message. Stop on error. */
+	    /* Wait for message, unless SSL already has the next request.
+	     * Stop on error.
+	     */
 	    transfer->op_timeout = 0;
 	    
-	    if (klink_session_wait_for_data(&session, 1, "waiting for next request")) {
+	    if (! SSL_pending(session.ssl_driver->ssl) &&
+	    	klink_session_wait_for_data(&session, 1, "waiting for next request")) {
 		kmod_log_msg(2, "-> No more requests from KMOD, job complete (%s).\n", kmod_strerror());
 		break;
 	    }
@@ -687,18 +798,25 @@ static void kappsd_handle_conn(int *sock) {
 	    transfer->op_timeout = op_timeout;
 	    
 	    /* Receive the message payload. Stop on error. */
-	    if (klink_session_recv_msg(&session, &in_type, &in_buf)) {
+	    if (klink_session_recv_msg(&session, &stream_id, &in_type, &in_buf)) {
 		kmod_log_msg(2, "=> No more requests from KMOD, job complete (%s).\n", kmod_strerror());
 		break;
 	    }
 	    
-	    /* Build the message payload. */
+	    /* Build the message payload. We support the stream IDs. */
 	    out_buf.pos = out_buf.len = 0;
-	    error = kappsd_handle_plugin_request(in_type, &in_buf, &out_type, &out_buf);
-	    if (error) break;
+	    
+	    if (in_type == KLINK_STREAM_HELLO) {
+	    	out_type = KLINK_STREAM_HELLO;
+	    }
+	    
+	    else {
+		error = kappsd_handle_plugin_request(in_type, &in_buf, &out_type, &out_buf);
+		if (error) break;
+	    }
 	    
 	    /* Send the message payload. */
-	    error = klink_session_send_msg(&session, out_type, &out_buf);
+	    error = klink_session_send_msg(&session, stream_id, out_type, &out_buf);
 	    if (error) break;
 	}
 	
@@ -708,7 +826,6 @@ static void kappsd_handle_conn(int *sock) {
     
     if (session.ssl_driver) {
     	if (session.ssl_driver->ssl) SSL_free(session.ssl_driver->ssl);
-	if (session.ssl_driver->ssl_ctx) SSL_CTX_free(session.ssl_driver->ssl_ctx);
 	free (session.ssl_driver);
 	session.ssl_driver = NULL;
     }
@@ -730,13 +847,311 @@ static void collect_zombie() {
     while (waitpid(-1, NULL, WNOHANG) > 0) {}
 }
 
-/* Loop accepting connections. */
+/* This function passes the connection specified and the tunnel port obtained
+ * for it to the worker specified.
+ * This function sets the KMOD error string. It returns -1 on failure.
+ */
+static int kappsd_send_conn(struct kappsd_worker *worker, int conn_sock) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    int flags = 0;
+    
+    #ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+    #endif
+    
+    iov.iov_base = (void *) &global_opts.tunnel_port;
+    iov.iov_len = sizeof(global_opts.tunnel_port);
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &conn_sock, sizeof(int));
+    
+    if (sendmsg(worker->ctl_fd, &msg, flags) != (ssize_t) iov.iov_len) {
+    	kmod_set_error("cannot pass connection to worker %d: %s", (int) worker->pid, strerror(errno));
+	return -1;
+    }
+    
+    return 0;
+}
+
+/* This function receives a connection from the parent process, and sets the
+ * tunnel port obtained for it.
+ * This function sets the KMOD error string. It returns -1 on failure, -2 if
+ * the parent closed the control socket.
+ */
+static int kappsd_recv_conn(int ctl_fd, int *conn_sock) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    ssize_t len;
+    
+    iov.iov_base = (void *) &global_opts.tunnel_port;
+    iov.iov_len = sizeof(global_opts.tunnel_port);
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    
+    do {
+    	len = recvmsg(ctl_fd, &msg, 0);
+    } while (len < 0 && errno == EINTR);
+    
+    if (len == 0) return -2;
+    
+    if (len != (ssize_t) iov.iov_len) {
+    	kmod_set_error("cannot receive connection: %s", len < 0 ? strerror(errno) : "short message");
+	return -1;
+    }
+    
+    cmsg = CMSG_FIRSTHDR(&msg);
+    
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    	kmod_set_error("cannot receive connection: no socket received");
+	return -1;
+    }
+    
+    memcpy(conn_sock, CMSG_DATA(cmsg), sizeof(int));
+    return 0;
+}
+
+/* This function is the main loop of a worker. It handles the connections
+ * passed by the parent until the parent closes the control socket.
+ */
+static void kappsd_worker_loop(int ctl_fd) {
+    
+    kmod_log_msg(2, "Worker process started.\n");
+    
+    while (1) {
+    	int conn_sock = -1;
+	int error = kappsd_recv_conn(ctl_fd, &conn_sock);
+	
+	if (error == -2) break;
+	
+	if (error) {
+	    kmod_log_msg(2, "Worker error: %s\n", kmod_strerror());
+	    break;
+	}
+	
+	/* Clear the captcha of the previous connection, if any. */
+	kstr_reset(&global_opts.captcha);
+	
+	kappsd_handle_conn(&conn_sock);
+	
+	/* Tell the parent we're ready for the next connection. */
+	if (write(ctl_fd, "", 1) != 1) break;
+    }
+    
+    kmod_log_msg(2, "Worker process exiting.\n");
+}
+
+/* This function forks a worker in the slot specified. 'conn_sock' is the
+ * connection being dispatched, which the worker must not keep open: the client
+ * would not see the connection close when the worker handling it is done.
+ * This function sets the KMOD error string. It returns -1 on failure.
+ */
+static int kappsd_spawn_worker(struct kappsd_worker *worker, int listen_sock, int conn_sock) {
+    int sv[2];
+    pid_t pid;
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    	kmod_set_error("cannot create control socket: %s", strerror(errno));
+	return -1;
+    }
+    
+    pid = fork();
+    
+    if (pid == -1) {
+    	kmod_set_error("fork failed: %s", kmod_syserror());
+	close(sv[0]);
+	close(sv[1]);
+	return -1;
+    }
+    
+    /* Child. It only keeps its control socket. */
+    if (pid == 0) {
+    	int i;
+	
+	close(sv[0]);
+	close(listen_sock);
+	if (conn_sock != -1) close(conn_sock);
+	
+	for (i = 0; i < kappsd_pool_size; i++) {
+	    if (kappsd_pool[i].ctl_fd != -1) close(kappsd_pool[i].ctl_fd);
+	}
+	
+	kappsd_worker_loop(sv[1]);
+	exit(0);
+    }
+    
+    /* Parent. */
+    close(sv[1]);
+    worker->pid = pid;
+    worker->ctl_fd = sv[0];
+    worker->busy_flag = 0;
+    worker->nb_conn = 0;
+    return 0;
+}
+
+/* This function releases the slot of the worker specified. The worker exits
+ * when it has finished handling its current connection, if any.
+ */
+static void kappsd_release_worker(struct kappsd_worker *worker) {
+    if (worker->ctl_fd != -1) close(worker->ctl_fd);
+    worker->pid = 0;
+    worker->ctl_fd = -1;
+    worker->busy_flag = 0;
+    worker->nb_conn = 0;
+}
+
+/* This function returns an idle worker, forking it if needed. NULL is returned
+ * if all the workers are busy. 'conn_sock' is the connection being dispatched.
+ * This function sets the KMOD error string. It returns -1 on failure.
+ */
+static int kappsd_get_idle_worker(int listen_sock, int conn_sock, struct kappsd_worker **worker) {
+    int i;
+    struct kappsd_worker *free_slot = NULL;
+    
+    *worker = NULL;
+    
+    for (i = 0; i < kappsd_pool_size; i++) {
+    	if (kappsd_pool[i].pid == 0) {
+	    if (free_slot == NULL) free_slot = &kappsd_pool[i];
+	}
+	
+	else if (! kappsd_pool[i].busy_flag) {
+	    *worker = &kappsd_pool[i];
+	    return 0;
+	}
+    }
+    
+    if (free_slot) {
+    	if (kappsd_spawn_worker(free_slot, listen_sock, conn_sock)) return -1;
+	*worker = free_slot;
+    }
+    
+    return 0;
+}
+
+/* This function passes the connection specified to an idle worker. If the
+ * worker has died, the connection is passed to another one. The connection is
+ * closed in this process.
+ * This function sets the KMOD error string. It returns -1 on failure.
+ */
+static int kappsd_dispatch_conn(int listen_sock, int *conn_sock) {
+    struct kappsd_worker *worker;
+    int nb_try;
+    
+    /* Each failure releases a slot, which is then filled by a new worker. Give
+     * up if the new workers fail too.
+     */
+    for (nb_try = 0; nb_try <= kappsd_pool_size; nb_try++) {
+    	if (kappsd_get_idle_worker(listen_sock, *conn_sock, &worker)) return -1;
+	
+	/* We only accept connections when a worker is available. */
+	assert(worker != NULL);
+	
+	if (! kappsd_send_conn(worker, *conn_sock)) {
+	    worker->busy_flag = 1;
+	    worker->nb_conn++;
+	    break;
+	}
+	
+	/* The worker has died. Try another one. */
+	kmod_log_msg(2, "Worker unavailable: %s\n", kmod_strerror());
+	kappsd_release_worker(worker);
+    }
+    
+    if (nb_try > kappsd_pool_size) kmod_log_msg(2, "Dropping connection: no worker can take it.\n");
+    
+    ksock_close(conn_sock);
+    return 0;
+}
+
+/* This function processes the notifications of the busy workers. */
+static void kappsd_check_workers(fd_set *read_set) {
+    int i;
+    
+    for (i = 0; i < kappsd_pool_size; i++) {
+    	struct kappsd_worker *worker = &kappsd_pool[i];
+	char c;
+	
+	if (worker->pid == 0 || ! worker->busy_flag || ! FD_ISSET(worker->ctl_fd, read_set)) continue;
+	
+	if (read(worker->ctl_fd, &c, 1) != 1) {
+	    kmod_log_msg(2, "Worker %d died.\n", (int) worker->pid);
+	    kappsd_release_worker(worker);
+	}
+	
+	/* Replace the worker once it has handled enough connections. */
+	else if (worker->nb_conn >= kappsd_worker_max_conn) {
+	    kmod_log_msg(2, "Retiring worker %d.\n", (int) worker->pid);
+	    kappsd_release_worker(worker);
+	}
+	
+	else {
+	    worker->busy_flag = 0;
+	}
+    }
+}
+
+/* This function returns true if a worker can take a connection. */
+static int kappsd_has_idle_worker() {
+    int i;
+    
+    for (i = 0; i < kappsd_pool_size; i++) {
+    	if (kappsd_pool[i].pid == 0 || ! kappsd_pool[i].busy_flag) return 1;
+    }
+    
+    return 0;
+}
+
+/* This function waits for the workers to finish their current connection and
+ * exit.
+ */
+static void kappsd_drain_pool() {
+    int i;
+    
+    if (kappsd_pool == NULL) return;
+    
+    kmod_log_msg(2, "Waiting for the workers to exit.\n");
+    
+    for (i = 0; i < kappsd_pool_size; i++) {
+    	pid_t pid = kappsd_pool[i].pid;
+	kappsd_release_worker(&kappsd_pool[i]);
+	if (pid) while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {}
+    }
+    
+    collect_zombie();
+    kfree(kappsd_pool);
+    kappsd_pool = NULL;
+}
+
+/* Loop accepting connections. If the worker pool is enabled, the connections
+ * are accepted here and passed to the pre-forked workers. This process remains
+ * the only one that obtains the tunnel ports, which must be synchronized.
+ */
 int kappsd_linkage_loop() { 
     int error = 0;
     int listen_sock = -1;
     int conn_sock = -1;
+    int pool_flag = global_opts.fork_flag && kappsd_pool_size > 0;
     fd_set read_set;
     struct timeval tv;
+    int i;
     
     kmod_log_msg(3, "kmod_linkage_loop() called.\n");
     
@@ -754,14 +1169,38 @@ int kappsd_linkage_loop() {
 	error = ksock_set_unblocking(listen_sock);
 	if (error) break;
 	
+	/* Create the SSL context before forking, so that it is shared. */
+	error = kappsd_init_ssl_ctx();
+	if (error) break;
+	
+	/* Initialize the worker pool. The workers are forked on demand. */
+	if (pool_flag) {
+	    kappsd_pool = (struct kappsd_worker *) kcalloc(kappsd_pool_size * sizeof(struct kappsd_worker));
+	    for (i = 0; i < kappsd_pool_size; i++) kappsd_pool[i].ctl_fd = -1;
+	}
+	
 	/* Loop accepting connections. */
 	while (1) {
-	    /* Wait for a connection. */
+	    int max_fd = listen_sock;
+	    int accept_flag = ! pool_flag || kappsd_has_idle_worker();
+	    
+	    /* Wait for a connection, if we can handle it, or for a worker to
+	     * become idle.
+	     */
 	    FD_ZERO(&read_set);
-	    FD_SET((unsigned int) listen_sock, &read_set);
+	    if (accept_flag) FD_SET((unsigned int) listen_sock, &read_set);
+	    
+	    for (i = 0; pool_flag && i < kappsd_pool_size; i++) {
+	    	if (kappsd_pool[i].pid && kappsd_pool[i].busy_flag) {
+		    FD_SET((unsigned int) kappsd_pool[i].ctl_fd, &read_set);
+		    max_fd = MAX(max_fd, kappsd_pool[i].ctl_fd);
+		}
+	    }
+	    
 	    tv.tv_sec = 1;
 	    tv.tv_usec = 0;
-	    select(listen_sock + 1, &read_set, NULL, NULL, &tv);
+	    
+	    if (select(max_fd + 1, &read_set, NULL, NULL, &tv) < 0) FD_ZERO(&read_set);
 	    
 	    /* Check if we must quit. */
 	    if (global_opts.quit_flag) break;
@@ -769,6 +1208,12 @@ int kappsd_linkage_loop() {
 	    /* Collect zombies. */
 	    collect_zombie();
 	    
+	    if (pool_flag) {
+	    	kappsd_check_workers(&read_set);
+		
+		if (! accept_flag || ! FD_ISSET(listen_sock, &read_set)) continue;
+	    }
+	    
 	    /* Try to accept a connection. */
 	    error = ksock_accept(listen_sock, &conn_sock);
 	    
@@ -800,6 +1245,12 @@ int kappsd_linkage_loop() {
 		kappsd_handle_conn(&conn_sock);
 	    }
 	    
+	    /* Pass the connection to a worker. */
+	    else if (pool_flag) {
+	    	error = kappsd_dispatch_conn(listen_sock, &conn_sock);
+		if (error) break;
+	    }
+	    
 	    /* Fork. */
 	    else {
 		error = fork();
@@ -818,6 +1269,7 @@ int kappsd_linkage_loop() {
 		
 		/* Parent. */
 		else {
+		    error = 0;
 		    ksock_close(&conn_sock);
 		}
 	    }
@@ -830,20 +1282,74 @@ int kappsd_linkage_loop() {
     ksock_close(&listen_sock);
     ksock_close(&conn_sock);
     
+    /* Let the workers finish their current connection. */
+    kappsd_drain_pool();
+    
     return error;
 }
 
 #else
 
+/* Maximum number of kappsd requests in flight. */
+#define KMOD_KAPPSD_MAX_STREAM	64
+
+/* Kappsd request in flight. */
+struct kmod_kappsd_stream {
+    
+    /* Stream ID of the request. */
+    uint32_t id;
+    
+    /* True if the reply has been received, in 'type' and 'payload', while
+     * another reply was being waited for.
+     */
+    int done_flag;
+    uint32_t type;
+    kbuffer payload;
+};
+
 static struct klink_session *kappsd_session = NULL;
 static struct kmod_transfer_hub kappsd_hub;
 
+/* Array of the requests in flight on the session, and the stream ID of the
+ * next request.
+ */
+static karray kappsd_stream_array;
+static uint32_t kappsd_next_stream_id = 1;
+
+/* True if kappsd has told us that it supports the stream IDs. Otherwise, the
+ * messages are sent without stream ID and at most one request is in flight.
+ */
+static int kappsd_stream_flag = 0;
+
+/* This function returns the position of the request in flight having the
+ * stream ID specified, or -1 if there is none.
+ */
+static int kmod_kappsd_find_stream(uint32_t stream_id) {
+    int i;
+    
+    for (i = 0; i < kappsd_stream_array.size; i++) {
+    	if (((struct kmod_kappsd_stream *) kappsd_stream_array.data[i])->id == stream_id) return i;
+    }
+    
+    return -1;
+}
+
+/* This function forgets the request in flight at the position specified. */
+static void kmod_kappsd_remove_stream(int index) {
+    struct kmod_kappsd_stream *stream = (struct kmod_kappsd_stream *) kappsd_stream_array.data[index];
+    
+    kbuffer_clean(&stream->payload);
+    kfree(stream);
+    kappsd_stream_array.data[index] = kappsd_stream_array.data[kappsd_stream_array.size - 1];
+    kappsd_stream_array.size--;
+}
+
 /* This function negociates a SSL session with the server.
  * This function sets the KMOD error string. It returns 0, -1, -2, or -3.
  */ 
-static int klink_session_negociate_client_session(struct klink_session *session) {
+static int klink_session_negociate_client_session(struct klink_session *session, char *server_id) {
     int error = 0;
-    SSL_METHOD *ssl_method;
+    SSL_CTX *ssl_ctx;
     BIO *ssl_bio;
     
     kmod_log_msg(3, "klink_session_negociate_client_session() called.\n");
@@ -853,19 +1359,11 @@ static int klink_session_negociate_client_session(struct klink_session *session)
     assert(session->ssl_driver == NULL);
     session->ssl_driver = driver;
     
-    ssl_method = SSLv3_client_method();
-    if (ssl_method == NULL) {
-    	kmod_set_error("cannot initialize SSL method");
-	return -1;
-    }
-    
-    driver->ssl_ctx = SSL_CTX_new(ssl_method);
-    if (driver->ssl_ctx == NULL) {
-    	kmod_set_error("cannot initialize SSL context");
-	return -1;
-    }
+    /* Get the shared SSL context. The server is not verified. */
+    ssl_ctx = kmo_ssl_ctx_get(NULL);
+    if (ssl_ctx == NULL) return -1;
 
-    driver->ssl = SSL_new(driver->ssl_ctx);
+    driver->ssl = SSL_new(ssl_ctx);
     if (driver->ssl == NULL) {
     	kmod_set_error("cannot initialize SSL session");
 	return -1;
@@ -880,8 +1378,8 @@ static int klink_session_negociate_client_session(struct klink_session *session)
     /* Set SSL BIO. 'ssl_bio' is owned by 'ssl', do not free. */
     SSL_set_bio(driver->ssl, ssl_bio, ssl_bio);
     
-    /* If we need a certificate, require the server to send us its certificate. */
-    SSL_set_verify(driver->ssl, SSL_VERIFY_NONE, NULL);
+    /* Offer the session we negociated previously with this server, if any. */
+    kmo_ssl_cache_apply(driver->ssl, server_id);
 
     /* Loop until we connect or fail. */
     while (1) {
@@ -912,26 +1410,28 @@ static int klink_session_negociate_client_session(struct klink_session *session)
 	    /* Life is tough. */
 	    else {
 		kmod_set_error("SSL negociation failed: %s", get_ssl_error_string(ssl_error));
+		kmo_ssl_cache_remove(server_id);
         	return -1;
 	    }
 	}
     }
 
+    /* Remember the session for the next connection to this server. */
+    kmo_ssl_cache_store(driver->ssl, server_id);
+
     return 0;
 }
 
     
-/* This function connects KMOD to kappsd. */
-int kmod_open_kappsd_session(char *host, int port) {
+/* This function connects KMOD to the kappsd specified and negociates the SSL
+ * session.
+ * This function sets the KMOD error string. It returns 0, -1, -2, or -3.
+ */
+static int kmod_connect_kappsd(char *host, int port, char *server_id) {
     int error = 0;
     
-    // YAK.
-    host = "kaskappsd.teambox.co";
-    port = 443;
-    
-    kmod_log_msg(3, "kmod_open_kappsd_session() called.\n");
-    
-    if (kappsd_session) kmod_close_kappsd_session();
+    karray_init(&kappsd_stream_array);
+    kappsd_stream_flag = 0;
     
     do {
     	struct klink_session *session = kappsd_session = kcalloc(sizeof(struct klink_session));
@@ -962,7 +1462,7 @@ int kmod_open_kappsd_session(char *host, int port) {
 	error = ksock_connect_check(*sock, host);
 	if (error) break;
 	
-	error = klink_session_negociate_client_session(session);
+	error = klink_session_negociate_client_session(session, server_id);
 	if (error) break;
     
     } while (0);
@@ -972,6 +1472,60 @@ int kmod_open_kappsd_session(char *host, int port) {
     return error;
 }
 
+/* This function asks kappsd whether it supports the stream IDs. The probe and
+ * its reply have no stream ID. This function returns -1 if the session was
+ * lost, which is what an older kappsd may do with an unknown message.
+ */
+static int kmod_probe_kappsd_streams() {
+    int error = 0;
+    uint32_t stream_id, out_type = 0;
+    kbuffer in_buf, out_buf;
+    
+    kbuffer_init(&in_buf);
+    kbuffer_init(&out_buf);
+    
+    error = klink_session_send_msg(kappsd_session, 0, KLINK_STREAM_HELLO, &in_buf);
+    if (! error) error = klink_session_recv_msg(kappsd_session, &stream_id, &out_type, &out_buf);
+    
+    /* Any other reply is an error reply of an older kappsd. */
+    if (! error && out_type == KLINK_STREAM_HELLO) kappsd_stream_flag = 1;
+    kmod_log_msg(2, "The kappsd %s the stream IDs.\n", kappsd_stream_flag ? "supports" : "does not support");
+    
+    kbuffer_clean(&in_buf);
+    kbuffer_clean(&out_buf);
+    
+    return error ? -1 : 0;
+}
+
+/* This function connects KMOD to kappsd. */
+int kmod_open_kappsd_session(char *host, int port) {
+    int error = 0;
+    kstr server_id;
+    
+    // YAK.
+    host = "kaskappsd.teambox.co";
+    port = 443;
+    
+    kmod_log_msg(3, "kmod_open_kappsd_session() called.\n");
+    
+    if (kappsd_session) kmod_close_kappsd_session();
+    
+    kstr_init(&server_id);
+    kstr_sf(&server_id, "%s:%d", host, port);
+    
+    error = kmod_connect_kappsd(host, port, server_id.data);
+    
+    /* If the probe cost us the session, reconnect without the stream IDs. */
+    if (! error && kmod_probe_kappsd_streams()) {
+    	kmod_close_kappsd_session();
+	error = kmod_connect_kappsd(host, port, server_id.data);
+    }
+    
+    kstr_free(&server_id);
+    
+    return error;
+}
+
 /* This function disconnects KMOD from kappsd. */
 void kmod_close_kappsd_session() {
     kmod_log_msg(3, "kmod_close_kappsd_session() called.\n");
@@ -982,7 +1536,6 @@ void kmod_close_kappsd_session() {
 
 	if (session->ssl_driver) {
     	    if (session->ssl_driver->ssl) SSL_free(session->ssl_driver->ssl);
-	    if (session->ssl_driver->ssl_ctx) SSL_CTX_free(session->ssl_driver->ssl_ctx);
 	    free (session->ssl_driver);
 	    session->ssl_driver = NULL;
 	}
@@ -993,34 +1546,165 @@ void kmod_close_kappsd_session() {
 	kappsd_session = NULL;
 	
 	kmod_transfer_hub_clean(&kappsd_hub);
+	
+	/* The replies still expected are lost with the session. */
+	while (kappsd_stream_array.size) kmod_kappsd_remove_stream(kappsd_stream_array.size - 1);
+	karray_free(&kappsd_stream_array);
     }
 }
 
-/* This function exchanges messages with kappsd. */
-int kmod_exchange_kappsd_message(uint32_t in_type, kbuffer *in_buf, uint32_t *out_type, kbuffer *out_buf) {
+/* This function receives the replies of the requests in flight and keeps them
+ * until they are asked for. It is used when kappsd does not support the stream
+ * IDs: the replies come in order and at most one request is in flight.
+ * This function sets the KMOD error string. It returns 0, -1, -2, or -3.
+ */
+static int kmod_kappsd_drain_streams(struct klink_session *session) {
+    int i;
+    
+    for (i = 0; i < kappsd_stream_array.size; i++) {
+    	struct kmod_kappsd_stream *stream = (struct kmod_kappsd_stream *) kappsd_stream_array.data[i];
+	uint32_t recv_id;
+	int error;
+	
+	if (stream->done_flag) continue;
+	
+	error = klink_session_recv_msg(session, &recv_id, &stream->type, &stream->payload);
+	if (error) return error;
+	
+	stream->done_flag = 1;
+    }
+    
+    return 0;
+}
+
+/* This function sends a request to kappsd without waiting for the reply. The
+ * stream ID of the request is set in 'stream_id'; the reply is obtained with
+ * kmod_recv_kappsd_message().
+ * This function sets the KMOD error string. It returns 0, -1, -2, or -3.
+ */
+int kmod_send_kappsd_message(uint32_t in_type, kbuffer *in_buf, uint32_t *stream_id) {
     int error = 0;
     struct klink_session *session = kappsd_session;
+    struct kmod_kappsd_stream *stream;
     
-    kmod_log_msg(3, "kmod_exchange_kappsd_message() called.\n");
+    kmod_log_msg(3, "kmod_send_kappsd_message() called.\n");
     
-    do {
-	if (session == NULL) {
-	    kmod_set_error("the kappsd session is closed");
-	    error = -1;
-	    break;
+    if (session == NULL) {
+	kmod_set_error("the kappsd session is closed");
+	return -1;
+    }
+    
+    if (kappsd_stream_array.size == KMOD_KAPPSD_MAX_STREAM) {
+    	kmod_set_error("too many kappsd requests in flight");
+	return -1;
+    }
+    
+    /* Without the stream IDs, the reply of the request in flight must be
+     * received before the next request is sent.
+     */
+    if (! kappsd_stream_flag) {
+    	error = kmod_kappsd_drain_streams(session);
+	if (error) return error;
+    }
+    
+    /* Stream 0 means no stream. */
+    if (kappsd_next_stream_id == 0) kappsd_next_stream_id = 1;
+    *stream_id = kappsd_next_stream_id++;
+    
+    error = klink_session_send_msg(session, kappsd_stream_flag ? *stream_id : 0, in_type, in_buf);
+    if (error) return error;
+    
+    stream = (struct kmod_kappsd_stream *) kcalloc(sizeof(struct kmod_kappsd_stream));
+    stream->id = *stream_id;
+    kbuffer_init(&stream->payload);
+    karray_add(&kappsd_stream_array, stream);
+    
+    return 0;
+}
+
+/* This function receives the reply to the request sent on the stream
+ * specified. The replies received meanwhile for the other requests in flight
+ * are kept until they are asked for.
+ * This function sets the KMOD error string. It returns 0, -1, -2, or -3.
+ */
+int kmod_recv_kappsd_message(uint32_t stream_id, uint32_t *out_type, kbuffer *out_buf) {
+    int error = 0;
+    struct klink_session *session = kappsd_session;
+    int index = kmod_kappsd_find_stream(stream_id);
+    
+    kmod_log_msg(3, "kmod_recv_kappsd_message() called.\n");
+    
+    if (session == NULL) {
+	kmod_set_error("the kappsd session is closed");
+	return -1;
+    }
+    
+    if (index == -1) {
+    	kmod_set_error("no kappsd request in flight on stream %u", stream_id);
+	return -1;
+    }
+    
+    while (1) {
+    	struct kmod_kappsd_stream *stream = (struct kmod_kappsd_stream *) kappsd_stream_array.data[index];
+	uint32_t recv_id;
+	int recv_index;
+	
+	/* The reply was received while another one was waited for. */
+	if (stream->done_flag) {
+	    *out_type = stream->type;
+	    out_buf->pos = out_buf->len = 0;
+	    kbuffer_write(out_buf, stream->payload.data, stream->payload.len);
+	    kmod_kappsd_remove_stream(index);
+	    return 0;
 	}
 	
-	/* Send the message payload. */
-	error = klink_session_send_msg(session, in_type, in_buf);
-	if (error) break;
-
-	/* Receive the message payload. */
-	error = klink_session_recv_msg(session, out_type, out_buf);
-	if (error) break;
+	error = klink_session_recv_msg(session, &recv_id, out_type, out_buf);
+	if (error) return error;
+	
+	/* Without the stream IDs, the reply is the one of the only request in
+	 * flight.
+	 */
+	if (recv_id == stream_id || ! kappsd_stream_flag) {
+	    kmod_kappsd_remove_stream(index);
+	    return 0;
+	}
+	
+	/* Keep the reply of the other stream. */
+	recv_index = kmod_kappsd_find_stream(recv_id);
+	
+	if (recv_index == -1 || ((struct kmod_kappsd_stream *) kappsd_stream_array.data[recv_index])->done_flag) {
+	    kmod_set_error("unexpected kappsd reply on stream %u", recv_id);
+	    return -1;
+	}
+	
+	stream = (struct kmod_kappsd_stream *) kappsd_stream_array.data[recv_index];
+	stream->done_flag = 1;
+	stream->type = *out_type;
+	kbuffer_write(&stream->payload, out_buf->data, out_buf->len);
+    }
+}
 
-    } while (0);
+/* This function sends a request to kappsd and receives its reply. */
+int kmod_exchange_kappsd_message(uint32_t in_type, kbuffer *in_buf, uint32_t *out_type, kbuffer *out_buf) {
+    uint32_t stream_id;
+    int error;
     
-    return error;
+    kmod_log_msg(3, "kmod_exchange_kappsd_message() called.\n");
+    
+    /* A plain exchange has no stream ID, unless other requests are in
+     * flight.
+     */
+    if (kappsd_session && kappsd_stream_array.size == 0) {
+    	error = klink_session_send_msg(kappsd_session, 0, in_type, in_buf);
+	if (error) return error;
+	
+	return klink_session_recv_msg(kappsd_session, &stream_id, out_type, out_buf);
+    }
+    
+    error = kmod_send_kappsd_message(in_type, in_buf, &stream_id);
+    if (error) return error;
+    
+    return kmod_recv_kappsd_message(stream_id, out_type, out_buf);
 }
 
 #endif
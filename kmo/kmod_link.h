@@ -6,9 +6,12 @@
 int kmod_open_kappsd_session(char *host, int port);
 void kmod_close_kappsd_session();
 int kmod_exchange_kappsd_message(uint32_t in_type, kbuffer *in_buf, uint32_t *out_type, kbuffer *out_buf);
+int kmod_send_kappsd_message(uint32_t in_type, kbuffer *in_buf, uint32_t *stream_id);
+int kmod_recv_kappsd_message(uint32_t stream_id, uint32_t *out_type, kbuffer *out_buf);
 
 #elif defined(__KAPPSD__)
 #include "kappsd.h"
+void kappsd_linkage_set_pool(int pool_size, int worker_max_conn);
 int kappsd_linkage_loop();
 
 #endif
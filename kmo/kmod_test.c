@@ -75,6 +75,32 @@ static void test_khash() {
     khash_add(&h, &nb2, &nb2);
     assert(khash_get(&h, &nb3) == &nb1);
     
+    /* Remove keys while the table grows, then check the others. */
+    {
+        static int nb_array[1000];
+        int index = -1;
+        int sum = 0;
+        int i;
+        
+        khash_clear(&h);
+        
+        for (i = 0; i < 1000; i++) {
+            nb_array[i] = i;
+            khash_add(&h, &nb_array[i], &nb_array[i]);
+            if (i % 3 == 0) khash_remove(&h, &nb_array[i / 2]);
+        }
+        
+        for (i = 0; i < h.size; i++) sum += *(int *) khash_iter_next_value(&h, &index);
+        
+        for (i = 0; i < 1000; i++) {
+            if (khash_exist(&h, &nb_array[i])) sum -= i;
+        }
+        
+        assert(sum == 0);
+        assert(! khash_exist(&h, &nb_array[0]));
+        assert(khash_get(&h, &nb_array[999]) == &nb_array[999]);
+    }
+    
     khash_free(&h);
     kstr_free(&str);
 }
@@ -107,6 +133,15 @@ static void test_kstr() {
     kstr_append_kstr(&str2, &str1);
     kstr_append_cstr(&str2, "ar");
     assert(kstr_equal_cstr(&str2, "foobar"));
+    
+    /* Exchange and move a short string and a long string. */
+    kstr_sf(&str1, "%s and a string too long to be stored inline", "foobar");
+    kstr_swap(&str1, &str2);
+    assert(kstr_equal_cstr(&str1, "foobar"));
+    kstr_take(&str3, &str2);
+    assert(str2.slen == 0 && str3.slen > KSTR_INLINE_SIZE);
+    kstr_take(&str3, &str1);
+    assert(kstr_equal_cstr(&str3, "foobar") && str1.slen == 0);
 
     kstr_free(&str1);
     kstr_free(&str2);
@@ -222,6 +257,38 @@ static void test_b64() {
     kbuffer_clean(&c);
 }
 
+static void test_krope() {
+    krope rope;
+    kbuffer flat;
+    uint8_t buf[10];
+    uint32_t nb, value;
+    char *slice = strdup("slice");
+    
+    krope_init(&rope, 4);
+    kbuffer_init(&flat, 0);
+    
+    krope_write(&rope, "testing", 7);
+    krope_adopt(&rope, slice, 5, free);
+    krope_write32(&rope, 0x01020304);
+    assert(rope.len == 16 && rope.nb_seg == 4);
+    
+    /* The reads advance the rope, so they are not done in assert(). */
+    nb = krope_read(&rope, buf, 9);
+    assert(nb == 9 && memcmp(buf, "testingsl", 9) == 0);
+    krope_seek(&rope, 12, SEEK_SET);
+    value = krope_read32(&rope);
+    assert(value == 0x01020304);
+    assert(krope_left(&rope) == 0);
+    (void) nb;
+    (void) value;
+    
+    krope_flatten(&rope, &flat);
+    assert(flat.len == 16 && memcmp(flat.data, "testingslice", 12) == 0);
+    
+    kbuffer_clean(&flat);
+    krope_clean(&rope);
+}
+
 static void test_util_bin_to_hex() {
     unsigned char in[4] = { 0xaf, 0x00, 0xfa, 0x0d };
     kstr out;
@@ -232,6 +299,7 @@ static void test_util_bin_to_hex() {
 }
 
 void kmo_do_tests() {
+    void kmod_do_tests(void);
     kmo_error_start();
     
     test_karray();
@@ -241,7 +309,9 @@ void kmo_do_tests() {
     test_knp_msg();
     test_mail_parse_addr_field();
     test_b64();
+    test_krope();
     test_util_bin_to_hex();
+    kmod_do_tests();
     
     kmo_error_end();
     
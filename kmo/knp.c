@@ -3,17 +3,19 @@
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <zlib.h>
 #include "knp.h"
 #include "utils.h"
 #include "base64.h"
 #include "kmo_sock.h"
 #include "kmod.h"
+#include "kmo_log.h"
+#include "kmo_ssl_cache.h"
+#include "kmo_ssl_ctx.h"
+#include "kmo_resolver.h"
+#include "kmo_stats.h"
+#include "kmo_heap.h"
 
-#ifdef __UNIX__
-#include <adns.h>
-#else
-#include <windns.h>
-#endif
 
 /* Teambox online servers info. */
 static char *ops_address = "ops.teambox.co";
@@ -64,10 +66,56 @@ daoYu0cMOAziTOKeG1GoDvVsnDOgpSpa0hHH7duuUuUENRQBOEk=|\
 
 /* KNP SSL driver. */
 struct knp_ssl_driver {
-    SSL_CTX *ssl_ctx;
     SSL *ssl;
 };
 
+/* Idle connection kept in the KNP connection pool. */
+struct knp_pool_conn {
+    
+    /* Key of the connection. */
+    uint32_t contact;
+    kstr server_addr;
+    uint32_t server_port;
+    uint32_t login_type;
+    
+    /* Socket and SSL driver of the connection. */
+    int fd;
+    struct knp_ssl_driver *ssl_driver;
+    
+    /* Time at which the connection was opened and last used. */
+    time_t conn_time;
+    time_t use_time;
+    
+    /* True if the server accepts the compressed commands. */
+    int compress_flag;
+};
+
+/* This function destroys a SSL driver. */
+static void knp_ssl_driver_destroy(struct knp_ssl_driver *driver) {
+    if (driver == NULL) return;
+    if (driver->ssl) SSL_free(driver->ssl);
+    free(driver);
+}
+
+/* This function opens the SSL context registry and creates the contexts used
+ * to contact the servers, so that the certificates are parsed once at startup.
+ * A failure is not fatal: the context will be created again when it is needed,
+ * and the error will be reported then.
+ */
+void knp_init_ssl_ctx() {
+    kmo_ssl_ctx_open();
+    
+    if (kmo_ssl_ctx_get(NULL) == NULL) {
+    	kmod_log_msg(1, "Cannot create the SSL context: %s.\n", kmo_strerror());
+    }
+    
+    #ifdef NDEBUG
+    if (kmo_ssl_ctx_get(kos_cert) == NULL) {
+    	kmod_log_msg(1, "Cannot create the KOS SSL context: %s.\n", kmo_strerror());
+    }
+    #endif
+}
+
 /* This function creates and initializes a KNP query.
  * The login OTUT must be set manually if it's needed.
  */
@@ -103,6 +151,17 @@ void knp_query_destroy(struct knp_query *self) {
     free(self);
 }
 
+/* This function returns the result payload of the query and gives its
+ * ownership to the caller, who must destroy it with kbuffer_destroy(). The
+ * strings obtained with knp_msg_read_str_view() remain valid after the query
+ * is destroyed.
+ */
+kbuffer * knp_query_take_res_payload(struct knp_query *self) {
+    kbuffer *payload = self->res_payload;
+    self->res_payload = NULL;
+    return payload;
+}
+
 /* This function closes the connection with the server, if it is open. */
 void knp_query_disconnect(struct knp_query *self) {
     
@@ -112,12 +171,9 @@ void knp_query_disconnect(struct knp_query *self) {
     	self->transfer.driver.disconnect(&self->transfer.fd);
     }
     
-    if (self->ssl_driver) {
-    	if (self->ssl_driver->ssl) SSL_free(self->ssl_driver->ssl);
-	if (self->ssl_driver->ssl_ctx) SSL_CTX_free(self->ssl_driver->ssl_ctx);
-	free (self->ssl_driver);
-	self->ssl_driver = NULL;
-    }
+    knp_ssl_driver_destroy(self->ssl_driver);
+    self->ssl_driver = NULL;
+    self->compress_flag = 0;
 }
 
 /* This function handles a connection error that occurred while processing a
@@ -145,8 +201,14 @@ static int knp_handle_k3p_activity(k3p_proto *k3p) {
     
     kmod_log_msg(3, "knp_handle_k3p_activity() called.\n");
     
+    /* Let the interaction loop handle the instruction. */
+    if (k3p->knp_yield_flag && k3p->element_array_pos != k3p->element_array_size) {
+    	kmo_seterror("the plugin sent an instruction");
+	return -2;
+    }
+    
     /* Loop until we've read all buffered K3P elements. */
-    while (k3p->element_array_pos != k3p->element_array.size) {
+    while (k3p->element_array_pos != k3p->element_array_size) {
 	
 	/* Read the next instruction. */
 	if (k3p_read_inst(k3p, &cmd))
@@ -161,17 +223,22 @@ static int knp_handle_k3p_activity(k3p_proto *k3p) {
     return 0;
 }
 
-/* This function executes the specified KNP transfer. While the KNP transfer is
- * progressing, this function monitors the K3P connection for activity. If the
- * plugin asks to abort the current K3P transaction, this function returns -2.
- * If the K3P connection is lost, this function sets the KMO error string and
- * returns -3. Otherwise, this function returns 0 when the KNP transfer is
- * completed (successfully or not). 
+/* This function executes the specified KNP transfers in parallel. While the
+ * KNP transfers are progressing, this function monitors the K3P connection for
+ * activity. If the plugin asks to abort the current K3P transaction, this
+ * function returns -2. If the K3P connection is lost, this function sets the
+ * KMO error string and returns -3. Otherwise, this function returns 0 when at
+ * least one of the KNP transfers is completed (successfully or not), or when
+ * 'deadline' is reached if it is not NULL. If 'resolver' is not NULL, the
+ * pending DNS lookups of the resolver are processed while the KNP transfers
+ * progress.
  */
-static int knp_exec_transfer(struct kmo_data_transfer *knp_transfer, k3p_proto *k3p) {
+static int knp_exec_transfer_array(struct kmo_data_transfer **transfer_array, int nb_transfer, k3p_proto *k3p,
+    	    	    	    	   struct kmo_resolver *resolver, struct timeval *deadline) {
     int error = 0;
+    int i;
     
-    kmod_log_msg(3, "knp_exec_transfer() called.\n");
+    kmod_log_msg(3, "knp_exec_transfer_array() called.\n");
     
     /* At this point the transfer hub should be empty. */
     assert(! k3p->hub->transfer_hash.size);
@@ -183,25 +250,53 @@ static int knp_exec_transfer(struct kmo_data_transfer *knp_transfer, k3p_proto *
     /* There should be no data in the K3P data buffer. */
     assert(! k3p->data_buf.len);
     
-    /* Set the status of the KNP transfer to pending, should we return early. */
-    knp_transfer->status = KMO_COMM_TRANS_PENDING;
+    /* Set the status of the KNP transfers to pending, should we return early. */
+    for (i = 0; i < nb_transfer; i++) transfer_array[i]->status = KMO_COMM_TRANS_PENDING;
     
     /* There might be buffered K3P elements. Process them now. */
     error = knp_handle_k3p_activity(k3p);
     if (error) return error;
     
-    /* Add the KNP transfer in the hub. */
-    kmo_transfer_hub_add(k3p->hub, knp_transfer);
+    /* Add the KNP transfers in the hub. */
+    for (i = 0; i < nb_transfer; i++) kmo_transfer_hub_add(k3p->hub, transfer_array[i]);
     
-    /* Loop until the KNP transfer is completed or an error occurs. */
+    /* Loop until a KNP transfer is completed, the deadline is reached or an
+     * error occurs.
+     */
     while (1) {
-	/* Add the K3P transfer in the hub. */
+    	struct kmo_data_transfer *resolver_transfer = NULL;
+	int done_flag = 0;
+	
+	/* Add the DNS transfer in the hub, if lookups are pending. */
+	if (resolver) {
+	    resolver_transfer = kmo_resolver_get_transfer(resolver);
+	    if (resolver_transfer) kmo_transfer_hub_add(k3p->hub, resolver_transfer);
+	}
+	
+	/* Add the K3P transfer in the hub. Its timeout tells us when the
+	 * deadline is reached.
+	 */
 	k3p->transfer.read_flag = 1;
 	assert(! k3p->data_buf.len);
 	k3p->transfer.buf = kbuffer_begin_write(&k3p->data_buf, 4096);
 	k3p->transfer.min_len = 1;
 	k3p->transfer.max_len = 4096;
 	k3p->transfer.op_timeout = 0;
+	
+	if (deadline) {
+	    struct timeval now;
+	    util_get_monotonic_time(&now);
+	    
+	    if (util_timeval_cmp(&now, deadline) >= 0) {
+	    	k3p->transfer.op_timeout = 1;
+	    }
+	    
+	    else {
+	    	k3p->transfer.op_timeout = (deadline->tv_sec - now.tv_sec) * 1000 +
+		    	    	    	   (deadline->tv_usec - now.tv_usec) / 1000 + 1;
+	    }
+	}
+	
 	kmo_transfer_hub_add(k3p->hub, &k3p->transfer);
 	
 	/* Wait for the transfers to complete. */
@@ -210,6 +305,12 @@ static int knp_exec_transfer(struct kmo_data_transfer *knp_transfer, k3p_proto *
 	/* Remove the K3P transfer from the hub. */
 	kmo_transfer_hub_remove(k3p->hub, &k3p->transfer);
 	
+	/* Process the DNS activity. */
+	if (resolver_transfer) {
+	    kmo_transfer_hub_remove(k3p->hub, resolver_transfer);
+	    if (resolver_transfer->status != KMO_COMM_TRANS_PENDING) kmo_resolver_process(resolver);
+	}
+	
 	/* The K3P transfer is completed. */
 	if (k3p->transfer.status == KMO_COMM_TRANS_COMPLETED) {
 	    
@@ -227,12 +328,15 @@ static int knp_exec_transfer(struct kmo_data_transfer *knp_transfer, k3p_proto *
 	    if (error) break;
 	}
 	
+	/* The deadline is reached. */
+	else if (k3p->transfer.status == KMO_COMM_TRANS_ERROR && k3p->transfer.err_msg == NULL) {
+	    assert(deadline);
+	    done_flag = 1;
+	}
+	
 	/* An error occurred with the K3P transfer. */
 	else if (k3p->transfer.status == KMO_COMM_TRANS_ERROR) {
 	    
-	    /* It can't be a timeout. */
-	    assert(k3p->transfer.err_msg);
-	        
 	    /* Bail out. */
 	    k3p_proto_disconnect(k3p);
 	    kmo_seterror("cannot read data from plugin: %s", k3p->transfer.err_msg->data);
@@ -245,23 +349,37 @@ static int knp_exec_transfer(struct kmo_data_transfer *knp_transfer, k3p_proto *
 	    assert(k3p->transfer.status == KMO_COMM_TRANS_PENDING);
 	}
 	
-	/* The KNP transfer is finished. */
-	if (knp_transfer->status == KMO_COMM_TRANS_COMPLETED || knp_transfer->status == KMO_COMM_TRANS_ERROR) {
-	    break;
+	/* A KNP transfer is finished. */
+	for (i = 0; i < nb_transfer; i++) {
+	    if (transfer_array[i]->status == KMO_COMM_TRANS_COMPLETED ||
+	    	transfer_array[i]->status == KMO_COMM_TRANS_ERROR) {
+		done_flag = 1;
+	    }
+	    
+	    /* The KNP transfer is still pending. */
+	    else {
+		assert(transfer_array[i]->status == KMO_COMM_TRANS_PENDING);
+	    }
 	}
 	
-	/* The KNP transfer is still pending. */
-	else {
-	    assert(knp_transfer->status == KMO_COMM_TRANS_PENDING);
-	}
+	if (done_flag) break;
     }
     
-    /* Remove the KNP transfer from the hub. */
-    kmo_transfer_hub_remove(k3p->hub, knp_transfer);
+    /* Remove the KNP transfers from the hub. */
+    for (i = 0; i < nb_transfer; i++) kmo_transfer_hub_remove(k3p->hub, transfer_array[i]);
     
     return error;
 }
 
+/* This function executes the specified KNP transfer. This function returns 0
+ * when the KNP transfer is completed (successfully or not), -2 or -3. See
+ * knp_exec_transfer_array().
+ */
+static int knp_exec_transfer(struct kmo_data_transfer *knp_transfer, k3p_proto *k3p,
+    	    	    	     struct kmo_resolver *resolver) {
+    return knp_exec_transfer_array(&knp_transfer, 1, k3p, resolver, NULL);
+}
+
 /* This function waits for the connection to become readable or writable. This
  * function chats with the plugin as required and calls 
  * knp_query_handle_conn_error() if an error occurs with the connection.
@@ -276,7 +394,7 @@ static int knp_query_wait_for_data(struct knp_query *query, int read_flag, char
     transfer->read_flag = read_flag;
     transfer->buf = NULL;
     transfer->min_len = transfer->max_len = 0;
-    error = knp_exec_transfer(transfer, k3p);
+    error = knp_exec_transfer(transfer, k3p, query->resolver);
     if (error) return error;
     
     if (transfer->status != KMO_COMM_TRANS_COMPLETED) {
@@ -335,7 +453,7 @@ static int knp_handle_proxy(struct knp_query *query, k3p_proto *k3p, kstr *proxy
 	transfer->read_flag = 0;
 	transfer->buf = msg.data;
 	transfer->min_len = transfer->max_len = msg.slen;
-	error = knp_exec_transfer(transfer, k3p);
+	error = knp_exec_transfer(transfer, k3p, query->resolver);
 	if (error) break;
 	
 	if (transfer->status != KMO_COMM_TRANS_COMPLETED) {
@@ -356,7 +474,7 @@ static int knp_handle_proxy(struct knp_query *query, k3p_proto *k3p, kstr *proxy
 	    transfer->read_flag = 1;
 	    transfer->buf = &c;
 	    transfer->min_len = transfer->max_len = 1;
-	    error = knp_exec_transfer(transfer, k3p);
+	    error = knp_exec_transfer(transfer, k3p, query->resolver);
 	    if (error) break;
 
 	    if (transfer->status != KMO_COMM_TRANS_COMPLETED) {
@@ -462,9 +580,9 @@ static char * get_ssl_error_string(int error) {
 /* This function negociates a SSL session with the server.
  * This function sets the KMO error string. It returns 0, -1, -2, or -3.
  */ 
-static int knp_negociate_ssl_session(struct knp_query *query, char *cert, k3p_proto *k3p) {
+static int knp_negociate_ssl_session(struct knp_query *query, char *cert, char *server_id, k3p_proto *k3p) {
     int error = 0;
-    SSL_METHOD *ssl_method;
+    SSL_CTX *ssl_ctx;
     BIO *ssl_bio;
     
     kmod_log_msg(3, "knp_negociate_ssl_session() called.\n");
@@ -474,19 +592,11 @@ static int knp_negociate_ssl_session(struct knp_query *query, char *cert, k3p_pr
     assert(query->ssl_driver == NULL);
     query->ssl_driver = driver;
     
-    ssl_method = SSLv3_client_method();
-    if (ssl_method == NULL) {
-    	kmo_seterror("cannot initialize SSL method");
-	return -1;
-    }
-    
-    driver->ssl_ctx = SSL_CTX_new(ssl_method);
-    if (driver->ssl_ctx == NULL) {
-    	kmo_seterror("cannot initialize SSL context");
-	return -1;
-    }
+    /* Get the shared SSL context for this certificate. */
+    ssl_ctx = kmo_ssl_ctx_get(cert);
+    if (ssl_ctx == NULL) return -1;
 
-    driver->ssl = SSL_new(driver->ssl_ctx);
+    driver->ssl = SSL_new(ssl_ctx);
     if (driver->ssl == NULL) {
     	kmo_seterror("cannot initialize SSL session");
 	return -1;
@@ -501,95 +611,8 @@ static int knp_negociate_ssl_session(struct knp_query *query, char *cert, k3p_pr
     /* Set SSL BIO. 'ssl_bio' is owned by 'ssl', do not free. */
     SSL_set_bio(driver->ssl, ssl_bio, ssl_bio);
     
-    /* If we have a certificate, set it in SSL. */
-    if (cert) {
-    	int i;
-	BIO *cert_bio = NULL;
-	X509 *cert_obj = NULL;
-	X509_STORE *cert_store = NULL;
-	X509_OBJECT x509_obj;
-	kstr cert_buf;
-	kstr_init(&cert_buf);
-
-	/* Try. */
-	do {
-	    /* Recreate the certificate. */
-	    kstr_append_cstr(&cert_buf, "-----BEGIN CERTIFICATE-----\n");
-	    kstr_append_cstr(&cert_buf, cert);
-	    kstr_append_cstr(&cert_buf, "-----END CERTIFICATE-----\n");
-
-	    for (i = 0; i < cert_buf.slen; i++) {
-		if (cert_buf.data[i] == '|') {
-		    cert_buf.data[i] = '\n';
-		}
-	    }
-
-	    /* Put the certificate text in a buffer. */
-	    cert_bio = BIO_new_mem_buf(cert_buf.data, cert_buf.slen);
-
-	    if (cert_bio == NULL) {
-		kmo_seterror("cannot create SSL BIO for reading SSL certificate");
-		error = -1;
-		break;   
-	    }
-
-	    /* Create the certificate object with the buffer data. */
-	    cert_obj = PEM_read_bio_X509(cert_bio, NULL, 0, NULL);
-
-	    if (cert_obj == NULL) {
-		kmo_seterror("cannot create SSL certificate");
-		error = -1;
-		break;
-	    }
-
-	    /* Add the certificate in the certificate store if it is not
-	     * already present.
-	     */
-
-	    /* Get the certificate store. */
-	    cert_store = SSL_CTX_get_cert_store(driver->ssl_ctx);
-
-	    if (cert_store == NULL) {
-		kmo_seterror("cannot get SSL certificate store");
-		error = -1;
-		break;
-	    }
-
-	    /* Understanding SSL's API is a daunting task. I've peeked at
-	     * the source code and that code should work. For now. Sigh.
-	     * Wouldn't it be nice if programmers bothered to make
-	     * *library* APIs that are somewhat sane...
-	     *
-	     * Check if the certificate is already in the store.
-	     */
-	    x509_obj.type = X509_LU_X509;
-	    x509_obj.data.x509 = cert_obj;
-
-	    /* It seems the certificate is already in the store. */
-	    if (X509_OBJECT_retrieve_match(cert_store->objs, &x509_obj)) {
-		/* Void. */
-	    }
-
-	    /* Add the certificate in the store. We still own cert_obj after
-	     * this call.
-	     */
-	    else if (X509_STORE_add_cert(cert_store, cert_obj) != 1) {
-		kmo_seterror("cannot store SSL certificate");
-		error = -1;
-		break;
-	    }
-
-    	} while (0);
-
-	if (cert_obj) X509_free(cert_obj);
-	if (cert_bio) BIO_free(cert_bio);
-	kstr_free(&cert_buf);
-	
-	if (error) return error;
-    }
-
-    /* If we need a certificate, require the server to send us its certificate. */
-    SSL_set_verify(driver->ssl, cert ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, NULL);
+    /* Offer the session we negociated previously with this server, if any. */
+    kmo_ssl_cache_apply(driver->ssl, server_id);
 
     /* Loop until we connect or fail. */
     while (1) {
@@ -620,6 +643,7 @@ static int knp_negociate_ssl_session(struct knp_query *query, char *cert, k3p_pr
 	    /* Life is tough. */
 	    else {
 		kmo_seterror("SSL negociation failed: %s", get_ssl_error_string(ssl_error));
+		kmo_ssl_cache_remove(server_id);
         	return -1;
 	    }
 	}
@@ -633,6 +657,7 @@ static int knp_negociate_ssl_session(struct knp_query *query, char *cert, k3p_pr
 
 	if (peer_cert == NULL) {
 	    kmo_seterror("the server did not send its SSL certificate");
+	    kmo_ssl_cache_remove(server_id);
 	    return -1;
 	}
 
@@ -641,10 +666,14 @@ static int knp_negociate_ssl_session(struct knp_query *query, char *cert, k3p_pr
 	/* Verify the certificate. */
 	if (SSL_get_verify_result(driver->ssl) != X509_V_OK) {
 	    kmo_seterror("the SSL certificate of the server is invalid");
+	    kmo_ssl_cache_remove(server_id);
 	    return -1;
 	}
     }
     
+    /* Remember the session for the next connection to this server. */
+    kmo_ssl_cache_store(driver->ssl, server_id);
+    
     return 0;
 }
 
@@ -707,301 +736,580 @@ static int knp_query_ssl_transfer(struct knp_query *query, int read_flag, char *
     return 0;
 }
 
-static int ksock_get_host_addr_list(char *host, unsigned long *addr_array, int *nb_addr) {
-    /* Resolve the server address. */
-    struct hostent *he = gethostbyname(host);   
-    int i = 0;
+/* This function looks up the addresses of the host or the service specified
+ * with the resolver of KNP. While the lookup is in progress, this function
+ * chats with the plugin as required.
+ * This function sets the KMO error string. It returns 0, -1, -2, or -3.
+ */
+static int knp_query_resolve(struct knp_query *self, struct knp_proto *knp, char *name, int srv_flag, int port,
+    	    	    	     struct kmo_resolver_result *result) {
+    int error = 0;
+    struct timeval deadline;
     
-    if (he == NULL) {
-    	kmo_seterror("cannot resolve %s", host);
-	return -1;
-    }
+    kmod_log_msg(3, "knp_query_resolve() called.\n");
     
-    /* Copy the addresses. */
-    while (he->h_addr_list[i] && i < *nb_addr) {
-	addr_array[i] = ((struct in_addr *) (he->h_addr_list[i]))->s_addr;
-	i++;
+    if (knp->timeout) {
+    	struct timeval now;
+	deadline.tv_sec = knp->timeout / 1000;
+	deadline.tv_usec = (knp->timeout % 1000) * 1000;
+	util_get_monotonic_time(&now);
+	util_timeval_add(&deadline, &deadline, &now);
     }
     
-    assert(i);
-    *nb_addr = i;
-    return 0;
-}
-
-#ifdef __UNIX__
-/* BACKPORT.
- *
- * There exist a port of ADNS 1.0 to Windows. But the author of ADNS didn't merge
- * the bloody port in version 1.2. I spent 1.5 days trying to get this shitty
- * library to work on Windows, to no avail. So I'm using the Windows API.
- */
- 
-/* This function resolves the srv name specified and copies the addresses and
- * ports found to 'addr_array' and 'port_array'. Up to '*nb_addr' addresses and
- * ports will be copied. On success, '*nb_addr' is set to the number of
- * addresses actually copied. This function returns -1 on failure, 0 on success.
- */
-static int knp_query_resolve_srv_name(char *srv_name, unsigned long *addr_array, unsigned int *port_array,
-				      int *nb_addr) {
-    int error = 0;
-    adns_state state;
-    adns_answer *answer = NULL;
-    
-    /* Try. */
-    do {
-	int r;
-	int i, j;
-	int nb_out = 0;
-	
-	/* Initialize the ADNS state. */
-	r = adns_init(&state, 0, NULL);
-	if (r) {
-	    kmo_seterror("cannot resolve %s: %s", srv_name, kmo_syserror(r));
-	    error = -1;
-	    state = NULL; /* Don't call adns_finish(): ADNS sucks. */
-	    break;
-	}
+    while (1) {
+    	struct kmo_data_transfer *transfer;
 	
-	/* Perform the query. */
-	r = adns_synchronous(state, srv_name, adns_r_srv, 0, &answer);
-	if (r) {
-	    kmo_seterror("cannot resolve %s: %s", srv_name, kmo_syserror(r));
-	    error = -1;
-	    break;
-	}
+	error = kmo_resolver_lookup(&knp->resolver, name, srv_flag, port, result);
 	
-	/* The query failed. */
-	if (answer->status != adns_s_ok) {
-	    kmo_seterror("cannot resolve %s: %s", srv_name, adns_strerror(answer->status));
-	    error = -1;
-	    break;
+	if (error == -1) {
+	    knp_query_handle_conn_error(self, KMO_SERROR_UNREACHABLE);
+	    return -1;
 	}
 	
-	/* We got the results. */
-	for (i = 0; i < answer->nrrs; i++) {
-	    unsigned int port = answer->rrs.srvha[i].port;
-	    
-	    /* No addresses returned so resolve the SRV host name. */
-	    if (! answer->rrs.srvha[i].ha.naddrs) {
-		int nb = *nb_addr - nb_out;
-		
-                /* Ignore errors, since it's likely the DNS that's badly
-                 * configured if this function fails.
-                 */
-		if (ksock_get_host_addr_list(answer->rrs.srvha[i].ha.host, addr_array + nb_out, &nb)) {
-		    continue;
-		}
-		
-		for (j = 0; j < nb; j++) {
-		    port_array[nb_out + j] = port;
-		}
-		
-		nb_out += nb;
-	    }
-	    
-	    /* Use the returned addresses. */
-	    else {
-		for (j = 0; j < answer->rrs.srvha[i].ha.naddrs; j++) {
-		    unsigned long addr = answer->rrs.srvha[i].ha.addrs[j].addr.inet.sin_addr.s_addr;
-		    
-		    if (nb_out == *nb_addr) {
-			goto out;
-		    }
-		    
-		    addr_array[nb_out] = addr;
-		    port_array[nb_out] = port;
-		    nb_out++;
-		}
-	    }
+	if (error == 0) return 0;
+	
+	/* The lookup is in progress. Wait for ADNS. */
+	transfer = kmo_resolver_get_transfer(&knp->resolver);
+	
+	if (transfer == NULL) {
+	    kmo_seterror("cannot resolve %s: lookup stalled", name);
+	    knp_query_handle_conn_error(self, KMO_SERROR_UNREACHABLE);
+	    return -1;
 	}
 	
-	out:
+	error = knp_exec_transfer(transfer, knp->k3p, NULL);
+	if (error) return error;
 	
-	*nb_addr = nb_out;
+	kmo_resolver_process(&knp->resolver);
 	
-	if (nb_out == 0) {
-	    kmo_seterror("cannot resolve %s: no addresses found for service", srv_name);
-	    error = -1;
-	    break;
+	if (knp->timeout) {
+	    struct timeval now;
+	    util_get_monotonic_time(&now);
+	    
+	    if (util_timeval_cmp(&now, &deadline) >= 0) {
+	    	kmo_seterror("cannot resolve %s: timeout", name);
+		knp_query_handle_conn_error(self, KMO_SERROR_TIMEOUT);
+		return -1;
+	    }
 	}
+    }
+}
+
+/* This function initializes the health of the KNP servers. */
+void knp_health_init(struct knp_proto *knp) {
+    karray_init(&knp->endpoint_array);
+}
+
+/* This function frees the health of the KNP servers. */
+void knp_health_free(struct knp_proto *knp) {
+    int i;
+    
+    for (i = 0; i < knp->endpoint_array.size; i++) {
+    	struct knp_endpoint *endpoint = (struct knp_endpoint *) knp->endpoint_array.data[i];
+	kstr_free(&endpoint->addr);
+	free(endpoint);
+    }
+    
+    karray_free(&knp->endpoint_array);
+}
+
+/* This function returns the health of the server of the query specified. The
+ * server address and port must be set in the query.
+ */
+static struct knp_endpoint * knp_get_endpoint(struct knp_proto *knp, struct knp_query *query) {
+    struct knp_endpoint *endpoint;
+    int i;
+    
+    for (i = 0; i < knp->endpoint_array.size; i++) {
+    	endpoint = (struct knp_endpoint *) knp->endpoint_array.data[i];
 	
-    } while (0);
+	if (endpoint->port == query->server_port && kstr_equal_kstr(&endpoint->addr, &query->server_addr)) {
+	    return endpoint;
+	}
+    }
     
-    free(answer);
-    adns_finish(state);
+    endpoint = (struct knp_endpoint *) kmo_calloc(sizeof(struct knp_endpoint));
+    kstr_init_kstr(&endpoint->addr, &query->server_addr);
+    endpoint->port = query->server_port;
+    karray_add(&knp->endpoint_array, endpoint);
     
-    return error;
+    return endpoint;
 }
-#else
 
-/* Sort function for knp_query_resolve_srv_name(). */
-static int srv_entry_sort(DNS_SRV_DATA **key_1, DNS_SRV_DATA **key_2) {
-    if ((*key_1)->wPriority > (*key_2)->wPriority) return -1;
-    if ((*key_1)->wPriority < (*key_2)->wPriority) return 1;
+/* This function returns the timeout of the connection attempts to the server
+ * specified, in milliseconds, given the operation timeout. A probe gets the
+ * operation timeout, since the server may have become slower than what was
+ * measured.
+ */
+static uint32_t knp_endpoint_connect_timeout(struct knp_endpoint *endpoint, uint32_t timeout) {
+    uint64_t adaptive;
+    
+    if (timeout == 0 || endpoint->srtt == 0 || endpoint->open_flag) return timeout;
+    
+    adaptive = 4 * (endpoint->srtt + 4 * endpoint->rttvar) / 1000;
+    if (adaptive < KNP_MIN_CONNECT_TIMEOUT) adaptive = KNP_MIN_CONNECT_TIMEOUT;
+    adaptive <<= endpoint->backoff;
+    
+    return (adaptive < timeout) ? adaptive : timeout;
+}
+
+/* This function doubles the connection timeout of the server specified after a
+ * connection attempt has timed out.
+ */
+static void knp_endpoint_backoff(struct knp_endpoint *endpoint) {
+    if (endpoint->backoff < KNP_MAX_CONNECT_BACKOFF) endpoint->backoff++;
+}
+
+/* This function updates the smoothed connection time of the server specified
+ * with the connection time specified, in microseconds.
+ */
+static void knp_endpoint_record_rtt(struct knp_endpoint *endpoint, uint64_t rtt) {
+    
+    if (endpoint->srtt == 0) {
+    	endpoint->srtt = rtt;
+	endpoint->rttvar = rtt / 2;
+    }
+    
+    else {
+    	uint64_t delta = (endpoint->srtt > rtt) ? endpoint->srtt - rtt : rtt - endpoint->srtt;
+	endpoint->rttvar = (3 * endpoint->rttvar + delta) / 4;
+	endpoint->srtt = (7 * endpoint->srtt + rtt) / 8;
+    }
+    
+    /* The smoothed time must remain set. */
+    if (endpoint->srtt == 0) endpoint->srtt = 1;
+    
+    endpoint->backoff = 0;
+}
+
+/* Attempt to connect to one of the addresses of a server. */
+struct knp_connect_attempt {
+    
+    /* Address of the server, and its numeric form. */
+    struct kmo_sock_addr *addr;
+    char addr_str[100];
+    
+    /* Transfer used to wait for the connection. */
+    struct kmo_data_transfer transfer;
+    
+    /* Time at which the attempt times out, if there is a timeout. */
+    struct timeval deadline;
+    
+    /* Time at which the attempt was started, from kmo_stats_now(). */
+    uint64_t start;
+};
+
+/* This function starts a connection attempt.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int knp_connect_attempt_start(struct knp_connect_attempt *attempt, uint32_t timeout) {
+    struct kmo_data_transfer *transfer = &attempt->transfer;
+    
+    if (kmo_sock_create_family(&transfer->fd, attempt->addr->addr.sa.sa_family) ||
+    	kmo_sock_set_unblocking(transfer->fd) ||
+	kmo_sock_connect_addr(transfer->fd, attempt->addr, attempt->addr_str)) {
+	kmo_sock_close(&transfer->fd);
+	return -1;
+    }
+    
+    transfer->read_flag = 0;
+    transfer->buf = NULL;
+    transfer->min_len = transfer->max_len = 0;
+    attempt->start = kmo_stats_now();
+    
+    if (timeout) {
+    	struct timeval now;
+	attempt->deadline.tv_sec = timeout / 1000;
+	attempt->deadline.tv_usec = (timeout % 1000) * 1000;
+	util_get_monotonic_time(&now);
+	util_timeval_add(&attempt->deadline, &attempt->deadline, &now);
+    }
+    
     return 0;
 }
 
-static int knp_query_resolve_srv_name(char *srv_name, unsigned long *addr_array, unsigned int *port_array,
-				      int *nb_addr) {
-    int error;
-    int i, j;
-    int used_addr = 0;
-    PDNS_RECORD record_list = NULL;
-    PDNS_RECORD record;
-    karray srv_array;
+/* This function connects to the first reachable address of the list
+ * specified. The addresses are tried in order, but a new attempt is started
+ * every KNP_CONNECT_DELAY milliseconds without waiting for the previous ones
+ * to fail, and the first connection established wins. The addresses that fail
+ * are reported to the resolver, which returns them last for a while. 'name' is
+ * the name of the host or service, used for the error messages.
+ * This function sets the KMO error string. It returns 0, -1, -2, or -3.
+ */
+static int knp_query_connect_addr(struct knp_query *self, struct knp_proto *knp, char *name,
+    	    	    	    	  struct kmo_resolver_result *result) {
+    int error = 0;
+    int i;
+    int nb_started = 0;
+    int winner = -1;
+    struct knp_endpoint *endpoint = knp_get_endpoint(knp, self);
+    uint32_t timeout = knp_endpoint_connect_timeout(endpoint, knp->timeout);
+    struct knp_connect_attempt attempt_array[KMO_RESOLVER_MAX_ADDR];
+    struct timeval next_start;
     
-    kmod_log_msg(3, "knp_query_resolve_srv_name() called.\n");
+    kmod_log_msg(3, "knp_query_connect_addr() called.\n");
     
-    karray_init(&srv_array);
+    assert(result->nb_addr);
+    assert(self->transfer.fd == -1);
     
-    /* Try. */
-    do {
-	/* Ask Windows to resolve that. */
-	error = DnsQuery_A(srv_name, 33, DNS_QUERY_STANDARD, NULL, &record_list, NULL);
+    for (i = 0; i < result->nb_addr; i++) {
+    	struct knp_connect_attempt *attempt = attempt_array + i;
+	attempt->addr = result->addr_array + i;
+	kmo_sock_addr_str(attempt->addr, attempt->addr_str, sizeof(attempt->addr_str));
+	kmo_data_transfer_init(&attempt->transfer);
+	attempt->transfer.driver = kmo_sock_driver;
+    }
+    
+    while (1) {
+	struct kmo_data_transfer *transfer_array[KMO_RESOLVER_MAX_ADDR];
+	int nb_transfer = 0;
+	struct timeval now;
 	
-	if (error) {
-            /* No easy way to get the error string? Screw it! */
-	    kmo_seterror("cannot resolve %s (error %d)", srv_name, error);
-	    error = -1;
-	    break;
-	}
+	util_get_monotonic_time(&now);
 	
-	/* We got the data. */
-	record = record_list;
+	for (i = 0; i < nb_started; i++) {
+	    if (attempt_array[i].transfer.fd != -1) nb_transfer++;
+	}
 	
-        /* Not using constant names since they're not all defined in my
-         * environment.
-         */
-	while (record) {
-	    
-            /* 1 = DNS_TYPE_A. Resolved address. Ignore. We can't depend on it
-             * being set.
-             */
-	    if (record->wType == 1) {
-                /* void */
-	    }
+	/* Start the next attempt if the previous attempts have failed or if
+	 * they are taking too long.
+	 */
+	while (nb_started < result->nb_addr && (! nb_transfer || util_timeval_cmp(&now, &next_start) >= 0)) {
+	    struct knp_connect_attempt *attempt = attempt_array + nb_started++;
 	    
-	    /* 33 = DNS_TYPE_SRV. SRV entry. */
-	    else if (record->wType == 33) {
-		karray_add(&srv_array, &record->Data.SRV);
-	    }
+	    kmod_log_msg(3, "Connecting to %s (%s).\n", name, attempt->addr_str);
 	    
-	    else {
-		kmo_seterror("cannot resolve %s (received unexpected DNS entry of type %d)", srv_name, record->wType);
-		error = -1;
-		break;
+	    if (knp_connect_attempt_start(attempt, timeout)) {
+	    	kmod_log_msg(2, "%s.\n", kmo_strerror());
+		kmo_resolver_report(&knp->resolver, attempt->addr, 1);
+		continue;
 	    }
 	    
-	    record = record->pNext;
+	    nb_transfer++;
+	    next_start.tv_sec = KNP_CONNECT_DELAY / 1000;
+	    next_start.tv_usec = (KNP_CONNECT_DELAY % 1000) * 1000;
+	    util_timeval_add(&next_start, &next_start, &now);
 	}
 	
-	if (error) break;
-	
-	if (! srv_array.size) {
-	    kmo_seterror("cannot resolve %s: no addresses returned", srv_name);
+	/* All the attempts have failed. The KMO error string is set. */
+	if (! nb_transfer) {
 	    error = -1;
 	    break;
 	}
 	
-	/* Sort the SRV array. */
-	qsort(srv_array.data, srv_array.size, sizeof(void *), (int (*)(const void *, const void *)) srv_entry_sort);
+	/* Wait for the attempts in progress, without extending their
+	 * deadlines.
+	 */
+	nb_transfer = 0;
 	
-	/* Resolve each host. */
-	for (i = 0; i < srv_array.size && used_addr < *nb_addr; i++) {
-	    DNS_SRV_DATA *srv = (DNS_SRV_DATA *) srv_array.data[i];
-	    int nb = *nb_addr - used_addr;
+	for (i = 0; i < nb_started; i++) {
+	    struct knp_connect_attempt *attempt = attempt_array + i;
+	    if (attempt->transfer.fd == -1) continue;
 	    
-	    error = ksock_get_host_addr_list(srv->pNameTarget, addr_array + used_addr, &nb);
-	    if (error) {
-		error = 0;
-		continue;
+	    attempt->transfer.op_timeout = 0;
+	    
+	    if (timeout) {
+	    	if (util_timeval_cmp(&now, &attempt->deadline) >= 0) {
+		    attempt->transfer.op_timeout = 1;
+		}
+		
+		else {
+		    attempt->transfer.op_timeout = (attempt->deadline.tv_sec - now.tv_sec) * 1000 +
+		    	    	    	    	   (attempt->deadline.tv_usec - now.tv_usec) / 1000 + 1;
+		}
+	    }
+	    
+	    transfer_array[nb_transfer++] = &attempt->transfer;
+	}
+	
+	error = knp_exec_transfer_array(transfer_array, nb_transfer, knp->k3p, &knp->resolver,
+	    	    	    	    	nb_started < result->nb_addr ? &next_start : NULL);
+	if (error) break;
+	
+	/* Check the attempts that are finished. */
+	for (i = 0; i < nb_started && winner == -1; i++) {
+	    struct knp_connect_attempt *attempt = attempt_array + i;
+	    struct kmo_data_transfer *transfer = &attempt->transfer;
+	    
+	    if (transfer->fd == -1 || transfer->status == KMO_COMM_TRANS_PENDING) continue;
+	    
+	    if (transfer->status == KMO_COMM_TRANS_COMPLETED) {
+	    	if (! kmo_sock_connect_check(transfer->fd, attempt->addr_str)) {
+		    winner = i;
+		    break;
+		}
 	    }
 	    
-	    for (j = 0; j < nb; j++) {
-		port_array[used_addr + j] = srv->wPort;
+	    else {
+	    	kmo_seterror("cannot connect to %s (%s): %s", name, attempt->addr_str,
+		    	     kmo_data_transfer_err(transfer));
+		
+		/* The server may be slower than the timeout allows. */
+		if (transfer->err_msg == NULL) knp_endpoint_backoff(endpoint);
 	    }
 	    
-	    used_addr += nb;
+	    kmod_log_msg(2, "%s.\n", kmo_strerror());
+	    kmo_resolver_report(&knp->resolver, attempt->addr, 1);
+	    kmo_sock_close(&transfer->fd);
 	}
 	
-    } while (0);
+	if (winner != -1) break;
+    }
     
-    /* Great API MS! Keep it up! */
-    if (record_list) DnsRecordListFree(record_list, DnsFreeRecordList);
+    /* Keep the winning connection and close the others. */
+    for (i = 0; i < result->nb_addr; i++) {
+    	struct knp_connect_attempt *attempt = attempt_array + i;
+	
+	if (i == winner) {
+	    kmod_log_msg(3, "Connected to %s (%s).\n", name, attempt->addr_str);
+	    knp_endpoint_record_rtt(endpoint, kmo_stats_now() - attempt->start);
+	    kmo_resolver_report(&knp->resolver, attempt->addr, 0);
+	    self->transfer.fd = attempt->transfer.fd;
+	    attempt->transfer.fd = -1;
+	}
+	
+	kmo_sock_close(&attempt->transfer.fd);
+	kmo_data_transfer_free(&attempt->transfer);
+    }
     
-    karray_free(&srv_array);
+    if (error == -1) {
+    	knp_query_handle_conn_error(self, KMO_SERROR_UNREACHABLE);
+    }
     
-    *nb_addr = used_addr;
     return error;
 }
-#endif
 
-/* BACKPORT.
- * This function sets the KMO error string. It returns 0, -1, -2, or -3.
+/* This function determines the address and the port of the server to contact
+ * for the query, and the proxy to use, if any. The server address and port are
+ * set in the query.
+ * This function sets the KMO error string. It returns -1 on failure.
  */
-static int knp_query_srv_connect(struct knp_query *self, struct knp_proto *knp, char *srv_name) {
-    int error = 0;
-    int i;
-    int nb_addr = 4;
-    unsigned long addr_array[4];
-    unsigned int port_array[4];
-    struct kmo_data_transfer *transfer = &self->transfer;
-    
-    kmod_log_msg(3, "knp_query_srv_connect() called.\n");
-    
-    /* Resolve srv name. */
-    if (knp_query_resolve_srv_name(srv_name, addr_array, port_array, &nb_addr)) {
-	knp_query_handle_conn_error(self, KMO_SERROR_UNREACHABLE);
-	return -1;
+static int knp_query_select_server(struct knp_query *self, struct knp_proto *knp, int *use_srv, int *use_proxy,
+    	    	    	    	   kstr *proxy_addr, uint32_t *proxy_port, kstr *proxy_login, kstr *proxy_pwd,
+				   char **cert) {
+    kmod_log_msg(3, "knp_query_select_server() called.\n");
+    
+    *use_srv = 0;
+    *use_proxy = 0;
+    *proxy_port = 0;
+    *cert = NULL;
+    
+    /* We're contacting the KPS. */
+    if (self->contact == KNP_CONTACT_KPS && k3p_is_using_kps(knp->server_info)) {
+	kstr_assign_kstr(&self->server_addr, &knp->server_info->kps_net_addr);
+	self->server_port = knp->server_info->kps_port_num;
+
+	if (knp->server_info->kps_use_proxy) {
+	    *use_proxy = 1;
+	    kstr_assign_kstr(proxy_addr, &knp->server_info->kps_proxy_net_addr);
+	    *proxy_port = knp->server_info->kps_proxy_port_num;
+	    kstr_assign_kstr(proxy_login, &knp->server_info->kps_proxy_login);
+	    kstr_assign_kstr(proxy_pwd, &knp->server_info->kps_proxy_pwd);
+	}
+    }
+
+    /* We're contacting the KOS. */
+    else {
+	#ifdef __DEBUG_KOS_ADDRESS__
+	kstr_assign_cstr(&self->server_addr, __DEBUG_KOS_ADDRESS__);
+	if (ops_address || ous_address || ots_address || iks_address || eks_address) {}
+	#else
+
+	/* This is the option to use a one-stop server for all
+	   online service requests. */
+	if (self->all_req_str.slen > 0) {
+	    kstr_assign_kstr(&self->server_addr, &self->all_req_str);
+	}
+
+	else if (knp->server_info->kos_use_proxy || knp->use_kpg) {
+	    switch (self->contact) {
+		case KNP_CONTACT_KPS: kstr_assign_cstr(&self->server_addr, ops_address); break;
+		case KNP_CONTACT_OPS: kstr_assign_cstr(&self->server_addr, ops_address); break;
+		case KNP_CONTACT_OUS: kstr_assign_cstr(&self->server_addr, ous_address); break;
+		case KNP_CONTACT_OTS: kstr_assign_cstr(&self->server_addr, ots_address); break;
+		case KNP_CONTACT_IKS: kstr_assign_cstr(&self->server_addr, iks_address); break;
+		case KNP_CONTACT_EKS: kstr_assign_cstr(&self->server_addr, eks_address); break;
+		default: assert(0);
+	    };
+
+	    if (knp->use_kpg) {
+		switch (self->contact) {
+		    case KNP_CONTACT_OPS: kstr_assign_cstr(&self->server_addr, knp->kpg_addr.data); break;
+		    case KNP_CONTACT_OUS: kstr_assign_cstr(&self->server_addr, knp->kpg_addr.data); break;
+		    case KNP_CONTACT_OTS: kstr_assign_cstr(&self->server_addr, knp->kpg_addr.data); break;
+		};
+	    }
+	}
+
+	else {
+	    *use_srv = 1;
+
+	    switch (self->contact) {
+		case KNP_CONTACT_KPS: kstr_assign_cstr(&self->server_addr, srv_ops_address); break;
+		case KNP_CONTACT_OPS: kstr_assign_cstr(&self->server_addr, srv_ops_address); break;
+		case KNP_CONTACT_OUS: kstr_assign_cstr(&self->server_addr, srv_ous_address); break;
+		case KNP_CONTACT_OTS: kstr_assign_cstr(&self->server_addr, srv_ots_address); break;
+		case KNP_CONTACT_IKS: kstr_assign_cstr(&self->server_addr, srv_iks_address); break;
+		case KNP_CONTACT_EKS: kstr_assign_cstr(&self->server_addr, srv_eks_address); break;
+		default: assert(0);
+	    };
+	}
+	#endif
+
+	#ifdef __DEBUG_KOS_PORT__
+	self->server_port = __DEBUG_KOS_PORT__;
+	if (kos_port) {}
+	#else
+	self->server_port = kos_port;
+
+	if (knp->use_kpg) {
+	    switch (self->contact) {
+		case KNP_CONTACT_OPS: self->server_port = knp->kpg_port; break;
+		case KNP_CONTACT_OUS: self->server_port = knp->kpg_port; break;
+		case KNP_CONTACT_OTS: self->server_port = knp->kpg_port; break;
+	    };
+	}
+	#endif
+
+	if (knp->server_info->kos_use_proxy) {
+	    *use_proxy = 1;
+	    kstr_assign_kstr(proxy_addr, &knp->server_info->kos_proxy_net_addr);
+	    *proxy_port = knp->server_info->kos_proxy_port_num;
+	    kstr_assign_kstr(proxy_login, &knp->server_info->kos_proxy_login);
+	    kstr_assign_kstr(proxy_pwd, &knp->server_info->kos_proxy_pwd);
+	}
+
+	#ifdef NDEBUG
+	*cert = kos_cert;
+	#else
+	if (kos_cert) {}
+	#endif
+    }
+
+    /* Validate our contact information. */
+    if (self->server_addr.slen == 0 || self->server_port == 0) {
+	kmo_seterror("invalid server information");
+	return -1;
+    }
+
+    if (*use_proxy && (proxy_addr->slen == 0 || *proxy_port == 0)) {
+	kmo_seterror("invalid proxy information");
+	return -1;
     }
     
-    /* Try to connect with each address. */
-    for (i = 0; i < nb_addr; i++) {
-	int has_more = (i < nb_addr - 1);
-	char addr_str[100];
-	char reason_str[200];
-	
-	/* inet_ntoa(): why make an API simple when you just screw up. */
-	sprintf(addr_str, "%s", inet_ntoa(*(struct in_addr*) &addr_array[i]));
-	sprintf(reason_str, "cannot connect to %s", addr_str);
-	
-	kmo_sock_close(&transfer->fd);
+    return 0;
+}
+
+/* This function adds the time elapsed since the time specified to the timer of
+ * the phase specified ("connect", "tls", "login" or "command") of the queries
+ * having the same contact and command as the query specified.
+ */
+static void knp_query_record_phase(struct knp_query *self, char *phase, uint64_t start) {
+    char *contact;
+    
+    switch (self->contact) {
+    	case KNP_CONTACT_KPS: contact = "kps"; break;
+    	case KNP_CONTACT_OPS: contact = "ops"; break;
+    	case KNP_CONTACT_OUS: contact = "ous"; break;
+    	case KNP_CONTACT_OTS: contact = "ots"; break;
+    	case KNP_CONTACT_IKS: contact = "iks"; break;
+    	case KNP_CONTACT_EKS: contact = "eks"; break;
+	default: contact = "unknown";
+    }
+    
+    kmo_stats_record_time(kmo_stats_get_timer("knp.%s.%u.%s", contact,
+    	    	    	  self->cmd_type ? self->cmd_type - KNP_CMD_CAT : 0, phase), start);
+}
+
+/* This function checks the health of the server of the query specified before
+ * it connects. If the server is down, the query fails right away with a server
+ * error, and this function returns -1. Otherwise, the health of the server is
+ * returned in 'endpoint' so that the outcome of the query can be reported with
+ * knp_query_report_health(). It is NULL if the server cannot be determined.
+ */
+static int knp_query_check_health(struct knp_query *self, struct knp_proto *knp, struct knp_endpoint **endpoint) {
+    int use_srv, use_proxy;
+    uint32_t proxy_port;
+    char *cert;
+    kstr proxy_addr, proxy_login, proxy_pwd;
+    uint64_t now;
+    
+    *endpoint = NULL;
+    
+    kstr_init(&proxy_addr);
+    kstr_init(&proxy_login);
+    kstr_init(&proxy_pwd);
+    
+    /* If this fails, let the connection code report the error. */
+    if (! knp_query_select_server(self, knp, &use_srv, &use_proxy, &proxy_addr, &proxy_port,
+    	    	    	    	  &proxy_login, &proxy_pwd, &cert)) {
+	*endpoint = knp_get_endpoint(knp, self);
+    }
+    
+    kstr_free(&proxy_addr);
+    kstr_free(&proxy_login);
+    kstr_free(&proxy_pwd);
+    
+    if (*endpoint == NULL || ! (*endpoint)->open_flag) return 0;
+    
+    now = kmo_stats_now();
+    
+    /* Probe the server. The other queries keep failing while the probe is in
+     * flight: the next probe is not due before another delay, unless the
+     * outcome of this one is reported first.
+     */
+    if (now >= (*endpoint)->retry_time) {
+    	kmod_log_msg(2, "Probing server %s:%u.\n", self->server_addr.data, self->server_port);
+	(*endpoint)->retry_time = now + (uint64_t) (*endpoint)->open_delay * 1000;
+	return 0;
+    }
+    
+    kmo_seterror("cannot contact %s:%u: the server is down, retrying in %u seconds", self->server_addr.data,
+    	    	 self->server_port, (uint32_t) (((*endpoint)->retry_time - now) / 1000000) + 1);
+    knp_query_handle_conn_error(self, KMO_SERROR_UNREACHABLE);
+    kmo_stats_count(KMO_STAT_KNP_BREAKER_REJECT);
+    *endpoint = NULL;
+    
+    return -1;
+}
+
+/* This function updates the health of the server specified with the outcome of
+ * the query specified. The failures that don't tell whether the server is up
+ * are ignored.
+ */
+static void knp_query_report_health(struct knp_query *self, struct knp_endpoint *endpoint) {
+    
+    if (endpoint == NULL) return;
+    
+    /* The server could not be reached. */
+    if (self->res_type == KNP_RES_SERV_ERROR &&
+    	(self->serv_error_id == KMO_SERROR_UNREACHABLE || self->serv_error_id == KMO_SERROR_TIMEOUT)) {
 	
-	error = kmo_sock_create(&transfer->fd);
-	if (error) break;
+	endpoint->nb_failure++;
 	
-	error = kmo_sock_set_unblocking(transfer->fd);
-	if (error) break;
+	if (endpoint->open_flag || endpoint->nb_failure >= KNP_BREAKER_THRESHOLD) {
+	    if (! endpoint->open_flag) endpoint->open_delay = KNP_BREAKER_OPEN_DELAY;
+	    else if (endpoint->open_delay < KNP_BREAKER_MAX_DELAY / 2) endpoint->open_delay *= 2;
+	    else endpoint->open_delay = KNP_BREAKER_MAX_DELAY;
 	    
-	error = kmo_sock_connect(transfer->fd, addr_str, port_array[i]);
-	if (error) {
-	    if (has_more) continue;
-	    knp_query_handle_conn_error(self, KMO_SERROR_UNREACHABLE);
-	    return -1;
-	}
-	
-	error = knp_query_wait_for_data(self, 0, reason_str, knp->k3p);
-	if (error) {
-	    if (error == -1) {
-		if (has_more) continue;
-		self->serv_error_id = KMO_SERROR_UNREACHABLE;
-	    }
+	    endpoint->open_flag = 1;
+	    endpoint->retry_time = kmo_stats_now() + (uint64_t) endpoint->open_delay * 1000;
+	    kmo_stats_count(KMO_STAT_KNP_BREAKER_OPEN);
 	    
-	    return error;
+	    kmod_log_msg(1, "Server %s:%u is down, failing its queries for %u seconds.\n",
+	    	    	 endpoint->addr.data, endpoint->port, endpoint->open_delay / 1000);
 	}
-    	
-	error = kmo_sock_connect_check(transfer->fd, addr_str);
-	if (error) {
-	    if (has_more) continue;
-	    knp_query_handle_conn_error(self, KMO_SERROR_UNREACHABLE);
-	    return -1;
+    }
+    
+    else if (self->res_type != KNP_RES_SERV_ERROR) {
+    	if (endpoint->open_flag) {
+	    kmod_log_msg(1, "Server %s:%u is back.\n", endpoint->addr.data, endpoint->port);
 	}
 	
-	return 0;
+    	endpoint->nb_failure = 0;
+	endpoint->open_flag = 0;
+	endpoint->open_delay = 0;
     }
-    
-    assert(0);
-    return -1;
 }
 
 /* This function connects to the specified server (possibly through a proxy) and
@@ -1026,7 +1334,8 @@ static int knp_query_connect(struct knp_query *self, struct knp_proto *knp) {
     kstr proxy_login;
     kstr proxy_pwd;
     char *cert = NULL;
-    struct kmo_data_transfer *transfer = &self->transfer;
+    struct kmo_resolver_result result;
+    uint64_t start = kmo_stats_now();
     
     kstr_init(&str);
     kstr_init(&proxy_addr);
@@ -1035,143 +1344,23 @@ static int knp_query_connect(struct knp_query *self, struct knp_proto *knp) {
     
     /* Try. */
     do {
-	/* We're contacting the KPS. */
-	if (self->contact == KNP_CONTACT_KPS && k3p_is_using_kps(knp->server_info)) {
-	    kstr_assign_kstr(&self->server_addr, &knp->server_info->kps_net_addr);
-	    self->server_port = knp->server_info->kps_port_num;
-	    
-	    if (knp->server_info->kps_use_proxy) {
-	    	use_proxy = 1;
-	    	kstr_assign_kstr(&proxy_addr, &knp->server_info->kps_proxy_net_addr);
-		proxy_port = knp->server_info->kps_proxy_port_num;
-		kstr_assign_kstr(&proxy_login, &knp->server_info->kps_proxy_login);
-		kstr_assign_kstr(&proxy_pwd, &knp->server_info->kps_proxy_pwd);
-	    }
-	}
-	
-	/* We're contacting the KOS. */
-	else {
-	    #ifdef __DEBUG_KOS_ADDRESS__
-	    kstr_assign_cstr(&self->server_addr, __DEBUG_KOS_ADDRESS__);
-	    if (ops_address || ous_address || ots_address || iks_address || eks_address) {}
-	    #else
-
-            /* This is the option to use a one-stop server for all
-               online service requests. */
-            if (self->all_req_str.slen > 0) {
-                kstr_assign_kstr(&self->server_addr, &self->all_req_str);
-            }
-	    
-	    else if (knp->server_info->kos_use_proxy || knp->use_kpg) {
-		switch (self->contact) {
-		    case KNP_CONTACT_KPS: kstr_assign_cstr(&self->server_addr, ops_address); break;
-		    case KNP_CONTACT_OPS: kstr_assign_cstr(&self->server_addr, ops_address); break;
-		    case KNP_CONTACT_OUS: kstr_assign_cstr(&self->server_addr, ous_address); break;
-		    case KNP_CONTACT_OTS: kstr_assign_cstr(&self->server_addr, ots_address); break;
-		    case KNP_CONTACT_IKS: kstr_assign_cstr(&self->server_addr, iks_address); break;
-		    case KNP_CONTACT_EKS: kstr_assign_cstr(&self->server_addr, eks_address); break;
-		    default: assert(0);
-		};
-		
-		if (knp->use_kpg) {
-		    switch (self->contact) {
-			case KNP_CONTACT_OPS: kstr_assign_cstr(&self->server_addr, knp->kpg_addr.data); break;
-			case KNP_CONTACT_OUS: kstr_assign_cstr(&self->server_addr, knp->kpg_addr.data); break;
-			case KNP_CONTACT_OTS: kstr_assign_cstr(&self->server_addr, knp->kpg_addr.data); break;
-		    };
-		}
-	    }
-	    
-	    else {
-		use_srv = 1;
-		
-		switch (self->contact) {
-		    case KNP_CONTACT_KPS: kstr_assign_cstr(&self->server_addr, srv_ops_address); break;
-		    case KNP_CONTACT_OPS: kstr_assign_cstr(&self->server_addr, srv_ops_address); break;
-		    case KNP_CONTACT_OUS: kstr_assign_cstr(&self->server_addr, srv_ous_address); break;
-		    case KNP_CONTACT_OTS: kstr_assign_cstr(&self->server_addr, srv_ots_address); break;
-		    case KNP_CONTACT_IKS: kstr_assign_cstr(&self->server_addr, srv_iks_address); break;
-		    case KNP_CONTACT_EKS: kstr_assign_cstr(&self->server_addr, srv_eks_address); break;
-		    default: assert(0);
-		};
-	    }
-	    #endif
-	    
-	    #ifdef __DEBUG_KOS_PORT__
-	    self->server_port = __DEBUG_KOS_PORT__;
-	    if (kos_port) {}
-	    #else
-	    self->server_port = kos_port;
-	    
-	    if (knp->use_kpg) {
-		switch (self->contact) {
-		    case KNP_CONTACT_OPS: self->server_port = knp->kpg_port; break;
-		    case KNP_CONTACT_OUS: self->server_port = knp->kpg_port; break;
-		    case KNP_CONTACT_OTS: self->server_port = knp->kpg_port; break;
-		};
-	    }
-	    #endif
-	    
-	    if (knp->server_info->kos_use_proxy) {
-	    	use_proxy = 1;
-	    	kstr_assign_kstr(&proxy_addr, &knp->server_info->kos_proxy_net_addr);
-		proxy_port = knp->server_info->kos_proxy_port_num;
-		kstr_assign_kstr(&proxy_login, &knp->server_info->kos_proxy_login);
-		kstr_assign_kstr(&proxy_pwd, &knp->server_info->kos_proxy_pwd);
-	    }
-	    
-	    #ifdef NDEBUG
-	    cert = kos_cert;
-	    #else
-	    if (kos_cert) {}
-	    #endif
-	}
-	
-	/* Validate our contact information. */
-	if (self->server_addr.slen == 0 || self->server_port == 0) {
-	    kmo_seterror("invalid server information");
-    	    knp_query_handle_conn_error(self, KMO_SERROR_MISC);
-	    error = -1;
-    	    break;
-	}
-	
-	if (use_proxy && (proxy_addr.slen == 0 || proxy_port == 0)) {
-	    kmo_seterror("invalid proxy information");
+	/* Determine the server to contact. */
+	error = knp_query_select_server(self, knp, &use_srv, &use_proxy, &proxy_addr, &proxy_port,
+	    	    	    	    	&proxy_login, &proxy_pwd, &cert);
+	if (error) {
     	    knp_query_handle_conn_error(self, KMO_SERROR_MISC);
-	    error = -1;
 	    break;
 	}
     	
 	/* Connect to the proxy or the end server directly. */
 	if (! use_srv) {
-	    error = kmo_sock_create(&transfer->fd);
-	    if (error) break;
-	
-	    error = kmo_sock_set_unblocking(transfer->fd);
-	    if (error) break;
-	
-	    error = kmo_sock_connect(transfer->fd, 
-				     use_proxy ? proxy_addr.data : self->server_addr.data,
-				     use_proxy ? proxy_port : self->server_port);
-	    if (error) {
-		knp_query_handle_conn_error(self, KMO_SERROR_UNREACHABLE);
-		break;
-	    }
-	    
-	    kstr_sf(&str, "cannot connect to %s", use_proxy ? proxy_addr.data : self->server_addr.data);
-	    error = knp_query_wait_for_data(self, 0, str.data, knp->k3p);
+	    char *host = use_proxy ? proxy_addr.data : self->server_addr.data;
 	    
-	    if (error) {
-		if (error == -1) self->serv_error_id = KMO_SERROR_UNREACHABLE;
-		break;
-	    }
-	    
-	    error = kmo_sock_connect_check(transfer->fd, use_proxy ? proxy_addr.data : self->server_addr.data);
+	    error = knp_query_resolve(self, knp, host, 0, use_proxy ? proxy_port : self->server_port, &result);
+	    if (error) break;
 	    
-	    if (error) {
-		knp_query_handle_conn_error(self, KMO_SERROR_UNREACHABLE);
-		break;
-	    }
+	    error = knp_query_connect_addr(self, knp, host, &result);
+	    if (error) break;
 	    
 	    /* If there is a proxy, asks it to connect us to the end server. */
 	    if (use_proxy) {
@@ -1182,14 +1371,24 @@ static int knp_query_connect(struct knp_query *self, struct knp_proto *knp) {
 	
 	/* Connect using the SRV entries. */
 	else {
-	    error = knp_query_srv_connect(self, knp, self->server_addr.data);
+	    error = knp_query_resolve(self, knp, self->server_addr.data, 1, 0, &result);
+	    if (error) break;
+	    
+	    error = knp_query_connect_addr(self, knp, self->server_addr.data, &result);
 	    if (error) break;
 	}
 	
+	knp_query_record_phase(self, "connect", start);
+	
 	/* Negociate the SSL session. */
-	error = knp_negociate_ssl_session(self, cert, knp->k3p);
+	start = kmo_stats_now();
+	kstr_sf(&str, "%s:%u", self->server_addr.data, self->server_port);
+	error = knp_negociate_ssl_session(self, cert, str.data, knp->k3p);
+	knp_query_record_phase(self, "tls", start);
 	if (error) break;
 	
+	self->conn_time = time(NULL);
+	
     } while (0);
     
     if (error) knp_query_disconnect(self);
@@ -1210,66 +1409,230 @@ static void knp_log_msg(char *side, uint32_t major, uint32_t minor, uint32_t msg
     assert(knp_log);
     int error = 0;
     kstr dump;
+    int cat = (msg_type & 0xff00) >> 8;
+    int id = msg_type & 0xff;
+
+    /* Don't bother dumping the payload if only its digest is logged. */
+    if (kmo_log_get_payload_mode(knp_log) == KMO_LOG_PAYLOAD_DIGEST) {
+	kmo_log_printf(knp_log, "%s version=%u,%u type=%u,%u len=%u address=%s port=%u>\n",
+	    	       side, major, minor, cat, id, payload->len, addr->data, port);
+	kmo_log_payload(knp_log, payload->data, payload->len);
+	kmo_log_write(knp_log, "\n\n", 2);
+	return;
+    }
 
     kstr_init(&dump);
     error = knp_msg_dump(payload->data, payload->len, &dump);
 
     if (error) {
-	fprintf(knp_log, "%s: badly formatted payload: %s.\n", side, kmo_strerror());
-	fwrite(payload->data, 1, payload->len, knp_log);
+	kmo_log_printf(knp_log, "%s: badly formatted payload: %s.\n", side, kmo_strerror());
+	kmo_log_write(knp_log, payload->data, payload->len);
     }
 
     else {
-    	int cat = (msg_type & 0xff00) >> 8;
-	int id = msg_type & 0xff;
-    
-	fprintf(knp_log, "%s version=%u,%u type=%u,%u len=%u address=%s port=%u>\n",
-	    	side, major, minor, cat, id, payload->len, addr->data, port);
-	fwrite(dump.data, 1, dump.slen, knp_log);
+	kmo_log_printf(knp_log, "%s version=%u,%u type=%u,%u len=%u address=%s port=%u>\n",
+	    	       side, major, minor, cat, id, payload->len, addr->data, port);
+	kmo_log_write(knp_log, dump.data, dump.slen);
     }
 
-    fprintf(knp_log, "\n");
+    kmo_log_write(knp_log, "\n", 1);
     kstr_free(&dump);
 }
 
-/* This function sends a message to the server.
+/* This function sends the content of the file referenced to the server, by
+ * chunks. The file must not have changed since it was referenced.
+ * This function sets the KMO error string. It returns 0, -1, -2, or -3.
+ */
+static int knp_query_send_file(struct knp_query *query, struct knp_file_ref *ref, char *chunk, k3p_proto *k3p) {
+    int error = 0;
+    FILE *file = NULL;
+    int file_size;
+    uint32_t left;
+    
+    kmod_log_msg(3, "knp_query_send_file() called.\n");
+    
+    /* Try. */
+    do {
+    	error = util_open_file(&file, ref->path->data, "rb");
+	if (error) break;
+	
+	error = util_get_file_size(file, &file_size);
+	if (error) break;
+	
+	if ((uint32_t) file_size != ref->len) {
+	    kmo_seterror("cannot send %s: the file has changed", ref->path->data);
+	    error = -1;
+	    break;
+	}
+	
+	for (left = ref->len; left > 0; ) {
+	    uint32_t len = left < KNP_FILE_CHUNK_SIZE ? left : KNP_FILE_CHUNK_SIZE;
+	    
+	    error = util_read_file(file, chunk, len);
+	    if (error) break;
+	    
+	    error = knp_query_ssl_transfer(query, 0, chunk, len, "cannot send KNP message", k3p);
+	    if (error) break;
+	    
+	    left -= len;
+	}
+	
+	if (error) break;
+	
+    } while (0);
+    
+    util_close_file(&file, 1);
+    
+    return error;
+}
+
+/* This function compresses the payload specified in 'packed', which must be
+ * empty. It returns true if the payload has been compressed, false if
+ * compressing it would not save anything.
+ */
+static int knp_compress_payload(kbuffer *payload, kbuffer *packed) {
+    uLongf len = compressBound(payload->len);
+    uint8_t *buf;
+    
+    kbuffer_write32(packed, payload->len);
+    buf = kbuffer_begin_write(packed, len);
+    
+    if (compress2(buf, &len, payload->data, payload->len, Z_DEFAULT_COMPRESSION) != Z_OK ||
+    	4 + len >= payload->len) {
+	kbuffer_end_write(packed, 0);
+	return 0;
+    }
+    
+    kbuffer_end_write(packed, len);
+    kmo_stats_add(KMO_STAT_KNP_COMPRESS_RAW, payload->len);
+    kmo_stats_add(KMO_STAT_KNP_COMPRESS_PACKED, packed->len);
+    return 1;
+}
+
+/* This function uncompresses the compressed payload 'packed' in 'payload',
+ * which must be empty.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int knp_uncompress_payload(kbuffer *packed, kbuffer *payload) {
+    uint32_t raw_len;
+    uLongf len;
+    
+    if (packed->len < 4) {
+    	kmo_seterror("cannot receive KNP message: invalid compressed payload");
+	return -1;
+    }
+    
+    raw_len = kbuffer_read32(packed);
+    
+    if (raw_len > KNP_MAX_PAYLOAD_SIZE) {
+	kmo_seterror("incoming KNP message is too big (%u bytes)", raw_len);
+	return -1;
+    }
+    
+    len = raw_len;
+    
+    if (uncompress(kbuffer_append_nbytes(payload, raw_len), &len, kbuffer_current_pos(packed), kbuffer_left(packed)) != Z_OK ||
+    	len != raw_len) {
+	kmo_seterror("cannot receive KNP message: invalid compressed payload");
+	return -1;
+    }
+    
+    kmo_stats_add(KMO_STAT_KNP_DECOMPRESS_PACKED, packed->len);
+    kmo_stats_add(KMO_STAT_KNP_DECOMPRESS_RAW, raw_len);
+    return 0;
+}
+
+/* This function sends a message to the server. The content of the files
+ * referenced in 'file_array', if it is not NULL, is streamed from the disk at
+ * its place in the payload.
  * This function sets the KMO error string. It returns 0, -1, -2, or -3.
  */
-static int knp_query_send_msg(struct knp_query *query, uint32_t msg_type, kbuffer *payload, k3p_proto *k3p) {
+static int knp_query_send_msg(struct knp_query *query, uint32_t msg_type, kbuffer *payload, karray *file_array,
+    	    	    	      k3p_proto *k3p) {
     int error = 0;
-    kbuffer msg;
+    int nb_file = file_array ? file_array->size : 0;
+    uint32_t minor = query->compress_threshold ? KNP_MINOR_VERSION_COMPRESS : KNP_MINOR_VERSION;
+    uint32_t payload_len;
+    uint32_t pos = 0;
+    char *chunk = NULL;
+    int i;
+    kbuffer msg, packed;
     kbuffer_init(&msg, 100);
+    kbuffer_init(&packed, 0);
     
     kmod_log_msg(3, "knp_query_send_msg() called.\n");
     
+    if (knp_log && ! nb_file) {
+	knp_log_msg("INPUT", KNP_MAJOR_VERSION, minor, msg_type, payload, &query->server_addr, query->server_port);
+    }
+    
+    /* Compress the payload if the server accepts it. The payloads streamed
+     * from files are not compressed, since their size must be known before
+     * they are sent.
+     */
+    if (query->compress_flag && ! nb_file && payload->len > query->compress_threshold &&
+        knp_compress_payload(payload, &packed)) {
+    	payload = &packed;
+	minor |= KNP_MINOR_COMPRESSED;
+    }
+    
+    payload_len = payload->len;
+    
+    for (i = 0; i < nb_file; i++)
+    	payload_len += ((struct knp_file_ref *) file_array->data[i])->len;
+    
     /* Try. */
     do {
 	/* Validate the payload size. */
-	if (payload->len > KNP_MAX_PAYLOAD_SIZE) {
-	    kmo_seterror("outgoing KNP message is too big (%d bytes)", payload->len);
+	if (payload_len > KNP_MAX_PAYLOAD_SIZE) {
+	    kmo_seterror("outgoing KNP message is too big (%d bytes)", payload_len);
 	    error = -1;
 	    break;
 	}
 
 	/* Send the message. */
 	kbuffer_write32(&msg, KNP_MAJOR_VERSION);
-	kbuffer_write32(&msg, KNP_MINOR_VERSION);
+	kbuffer_write32(&msg, minor);
 	kbuffer_write32(&msg, msg_type);
-	kbuffer_write32(&msg, payload->len);
-	kbuffer_write(&msg, payload->data, payload->len);
+	kbuffer_write32(&msg, payload_len);
 
-	if (knp_log) {
-	    knp_log_msg("INPUT", KNP_MAJOR_VERSION, KNP_MINOR_VERSION, msg_type, payload,
-    	                &query->server_addr, query->server_port);
+	/* The payload cannot be dumped without the content of the files. */
+	if (knp_log && nb_file) {
+	    kmo_log_printf(knp_log, "INPUT version=%u,%u type=%u,%u len=%u files=%d address=%s port=%u>\n\n",
+	    	    	   KNP_MAJOR_VERSION, minor, (msg_type & 0xff00) >> 8, msg_type & 0xff,
+			   payload_len, nb_file, query->server_addr.data, query->server_port);
 	}
+	
+	if (nb_file) chunk = (char *) kmo_malloc(KNP_FILE_CHUNK_SIZE);
+	
+	/* Send the payload up to each file, then the file. */
+	for (i = 0; i <= nb_file; i++) {
+	    struct knp_file_ref *ref = (i < nb_file) ? (struct knp_file_ref *) file_array->data[i] : NULL;
+	    uint32_t end = ref ? ref->offset : payload->len;
+	    
+	    assert(pos <= end && end <= payload->len);
+	    kbuffer_write(&msg, payload->data + pos, end - pos);
+	    pos = end;
 
-	error = knp_query_ssl_transfer(query, 0, msg.data, msg.len, "cannot send KNP message", k3p);
+	    error = knp_query_ssl_transfer(query, 0, msg.data, msg.len, "cannot send KNP message", k3p);
+	    if (error) break;
+	    
+	    kbuffer_clear(&msg);
+	    
+	    if (ref) {
+	    	error = knp_query_send_file(query, ref, chunk, k3p);
+		if (error) break;
+	    }
+	}
+	
 	if (error) break;
 	
     } while (0);
     
     if (error) knp_query_disconnect(query);
     kbuffer_clean(&msg);
+    kbuffer_clean(&packed);
+    free(chunk);
     
     return error;
 }
@@ -1282,6 +1645,8 @@ static int knp_query_recv_msg(struct knp_query *query, uint32_t *msg_type, kbuff
     uint32_t header_len = 4*4;
     uint32_t major, minor;
     uint32_t payload_size;
+    kbuffer packed;
+    kbuffer_init(&packed, 0);
     
     kmod_log_msg(3, "knp_query_recv_msg() called.\n");
     
@@ -1319,11 +1684,25 @@ static int knp_query_recv_msg(struct knp_query *query, uint32_t *msg_type, kbuff
 	    break;
 	}
 
+	query->server_minor = minor;
+	
 	/* Receive the payload. */
         kbuffer_clear(payload);
-	error = knp_query_ssl_transfer(query, 1, kbuffer_append_nbytes(payload, payload_size), payload_size, 
-	    	    	    	       "cannot receive KNP message", k3p);
-	if (error) break;
+	
+	if (minor & KNP_MINOR_COMPRESSED) {
+	    error = knp_query_ssl_transfer(query, 1, kbuffer_append_nbytes(&packed, payload_size), payload_size, 
+	    	    	    	           "cannot receive KNP message", k3p);
+	    if (error) break;
+	    
+	    error = knp_uncompress_payload(&packed, payload);
+	    if (error) break;
+	}
+	
+	else {
+	    error = knp_query_ssl_transfer(query, 1, kbuffer_append_nbytes(payload, payload_size), payload_size, 
+	    	    	    	           "cannot receive KNP message", k3p);
+	    if (error) break;
+	}
     	
 	if (knp_log) {
 	    knp_log_msg("OUTPUT", major, minor, *msg_type, payload, &query->server_addr, query->server_port); 
@@ -1332,107 +1711,369 @@ static int knp_query_recv_msg(struct knp_query *query, uint32_t *msg_type, kbuff
     } while (0);
     
     if (error) knp_query_disconnect(query);
+    kbuffer_clean(&packed);
     
     return error;
 }
 
-/* This function executes a server query. The function expects that the server
- * info have been set. Furthermore, it expects that there is something to do,
- * i.e. login and/or perform a query. If the function manages to login to the
- * server, the connection is not closed until the query is destroyed or the
- * connection is lost. It is possible to execute another query to the server by
- * calling knp_query_set_cmd() (still unimplemented since it's not needed ATM).
- * This function sets the KMO error string. It returns 0, -2, or -3.
+/* This function initializes the KNP connection pool. */
+void knp_pool_init(struct knp_proto *knp) {
+    karray_init(&knp->pool);
+    knp->pool_idle_timeout = KNP_POOL_IDLE_TIMEOUT;
+    knp->pool_max_age = KNP_POOL_MAX_AGE;
+    
+    /* A lingering connection causes problems if we contact the same
+     * single-threaded server for debugging.
+     */
+    #ifdef __DEBUG_KOS_ADDRESS__
+    knp->pool_max_age = 0;
+    #endif
+}
+
+/* This function closes the pooled connections and frees the KNP connection
+ * pool.
  */
-int knp_query_exec(struct knp_query *self, struct knp_proto *knp) {
-    kmod_log_msg(3, "knp_query_exec() called.\n");
+void knp_pool_free(struct knp_proto *knp) {
+    knp_pool_flush(knp);
+    karray_free(&knp->pool);
+}
 
-    assert(knp != NULL);
-    assert(knp->k3p != NULL);
-    assert(knp->k3p->state == K3P_INTERACTING);
-    assert(knp->k3p->transfer.fd != -1);
-    assert(knp->server_info != NULL);
-    assert(self->transfer.fd == -1 || self->cmd_type);
-    assert(self->res_type == 0);
-    assert(self->res_payload == NULL);
-    assert(self->serv_error_msg == NULL);
-    
-    int error = 0;
-    uint32_t msg_type;
+/* This function destroys a pooled connection, closing it. */
+static void knp_pool_conn_destroy(struct knp_pool_conn *conn) {
+    kmo_sock_close(&conn->fd);
+    knp_ssl_driver_destroy(conn->ssl_driver);
+    kstr_free(&conn->server_addr);
+    free(conn);
+}
+
+/* This function closes all the pooled connections. It must be called when the
+ * server info changes.
+ */
+void knp_pool_flush(struct knp_proto *knp) {
+    int i;
     
-    /* The local payload is used to transfer the data of the messages. It may
-     * eventually become the result payload of the query.
-     */
-    kbuffer *local_payload = kbuffer_new(1024);
+    for (i = 0; i < knp->pool.size; i++)
+    	knp_pool_conn_destroy((struct knp_pool_conn *) knp->pool.data[i]);
     
-    /* Set the operation timeout. */
-    self->transfer.op_timeout = knp->timeout;
+    knp->pool.size = 0;
+}
 
-     /* Try. */
-    do {
-	/* If we're not connected, connect to the server. */
-	if (self->transfer.fd == -1) {
-    	    error = knp_query_connect(self, knp);
-	    if (error) break;
-	    
-	    /* Do login. */
-	    if (self->login_type != KNP_CMD_LOGIN_ANON) {
-	    	
-		/* Write the login message. */
-		if (self->login_type == KNP_CMD_LOGIN_USER) {
-	    	    knp_msg_write_kstr(local_payload, &knp->server_info->kps_login);
-		    knp_msg_write_kstr(local_payload, &knp->server_info->kps_pwd);
-		    knp_msg_write_uint32(local_payload, knp->server_info->encrypted_pwd_flag);
-		}
+/* This function removes the connection at the position specified from the
+ * pool. The connection is not destroyed.
+ */
+static void knp_pool_remove(struct knp_proto *knp, int pos) {
+    memmove(knp->pool.data + pos, knp->pool.data + pos + 1, (knp->pool.size - pos - 1) * sizeof(void *));
+    knp->pool.size--;
+}
 
-		else {
-	    	    assert(self->login_type == KNP_CMD_LOGIN_OTUT);
-		    assert(self->login_otut != NULL);
-		    knp_msg_write_kstr(local_payload, self->login_otut);
-		}
+/* This function returns true if the idle connection specified still looks
+ * usable. An idle connection should not be readable: either the server has
+ * closed it or it sent us something we did not ask for.
+ */
+static int knp_pool_conn_alive(struct knp_pool_conn *conn) {
+    fd_set read_set;
+    struct timeval tv = { 0, 0 };
+    
+    if (SSL_pending(conn->ssl_driver->ssl)) return 0;
+    
+    FD_ZERO(&read_set);
+    FD_SET((unsigned int) conn->fd, &read_set);
+    return (select(conn->fd + 1, &read_set, NULL, NULL, &tv) == 0);
+}
 
-		/* Send the login message. */
-    		error = knp_query_send_msg(self, self->login_type, local_payload, knp->k3p);
-		if (error) break;
+/* This function closes the pooled connections that have been idle for too long
+ * or that are too old.
+ */
+static void knp_pool_prune(struct knp_proto *knp, time_t now) {
+    int i = 0;
+    
+    while (i < knp->pool.size) {
+    	struct knp_pool_conn *conn = (struct knp_pool_conn *) knp->pool.data[i];
+	
+	if (now - conn->use_time >= (time_t) knp->pool_idle_timeout ||
+	    now - conn->conn_time >= (time_t) knp->pool_max_age || now < conn->use_time) {
+	    kmod_log_msg(3, "knp_pool_prune(): closing connection to %s.\n", conn->server_addr.data);
+	    knp_pool_remove(knp, i);
+	    knp_pool_conn_destroy(conn);
+	}
+	
+	else {
+	    i++;
+	}
+    }
+}
 
-		/* Receive the reply. */
-		error = knp_query_recv_msg(self, &msg_type, local_payload, knp->k3p);
-		if (error) break;
+/* This function returns true if the connection of the query may be taken from
+ * or returned to the pool. Login-only queries always need a new connection and
+ * OTUT logins are good for one query only.
+ */
+static int knp_pool_can_use(struct knp_query *self, struct knp_proto *knp) {
+    return (knp->pool_max_age && self->cmd_type &&
+    	    (self->login_type == KNP_CMD_LOGIN_ANON || self->login_type == KNP_CMD_LOGIN_USER));
+}
 
-		/* Upgrade required. */
-		if (msg_type == KNP_RES_UPGRADE_PLUGIN || msg_type == KNP_RES_UPGRADE_KPS) {
-		    knp_query_disconnect(self);
-		    self->res_type = msg_type;
-		    error = 0;
-		    break;
-		}
-		
-		/* Login failed. There are two cases here. If we were only doing a login
-		 * to the server, the result type is the error returned by the server.
-		 * Otherwise, we set the result type to 'KNP_RES_LOGIN_ERROR', to allow
-		 * the caller to distinguish between a login failure and the command
-		 * failure. The semantics here are pretty messy :-/.
-		 */
-		if (msg_type != KNP_RES_LOGIN_OK) {
-		    knp_query_disconnect(self);
-		    
-		    if (self->cmd_type)
-		    	self->res_type = KNP_RES_LOGIN_ERROR;
-		    else
-		    	self->res_type = msg_type;
-		    
-		    error = -1;
-		    break;
-		}
-		
-		/* Assign the result message type and payload to the query. */
-		self->res_type = msg_type;
-		self->res_payload = local_payload;
+/* This function looks for a pooled connection that can be used by the query.
+ * If one is found, the query takes ownership of the connection and this
+ * function returns true.
+ */
+static int knp_pool_get(struct knp_query *self, struct knp_proto *knp) {
+    int i;
+    int found = 0;
+    int use_srv, use_proxy;
+    uint32_t proxy_port;
+    char *cert;
+    kstr proxy_addr, proxy_login, proxy_pwd;
+    
+    if (! knp_pool_can_use(self, knp)) return 0;
+    
+    knp_pool_prune(knp, time(NULL));
+    if (! knp->pool.size) return 0;
+    
+    kstr_init(&proxy_addr);
+    kstr_init(&proxy_login);
+    kstr_init(&proxy_pwd);
+    
+    /* Determine the server to contact. If this fails, let the connection code
+     * report the error.
+     */
+    if (! knp_query_select_server(self, knp, &use_srv, &use_proxy, &proxy_addr, &proxy_port,
+    	    	    	    	  &proxy_login, &proxy_pwd, &cert)) {
+	
+	/* Search the most recently used connection first. */
+	for (i = knp->pool.size - 1; i >= 0; i--) {
+	    struct knp_pool_conn *conn = (struct knp_pool_conn *) knp->pool.data[i];
+
+	    if (conn->contact != self->contact || conn->login_type != self->login_type ||
+		conn->server_port != self->server_port || ! kstr_equal_kstr(&conn->server_addr, &self->server_addr)) {
+		continue;
 	    }
+
+	    knp_pool_remove(knp, i);
+
+	    /* The server closed the connection in the mean time. */
+	    if (! knp_pool_conn_alive(conn)) {
+		kmod_log_msg(3, "knp_pool_get(): pooled connection to %s is dead.\n", conn->server_addr.data);
+		knp_pool_conn_destroy(conn);
+		continue;
+	    }
+
+	    kmod_log_msg(3, "knp_pool_get(): reusing connection to %s.\n", conn->server_addr.data);
+
+	    /* Take the connection. */
+	    self->transfer.fd = conn->fd;
+	    self->ssl_driver = conn->ssl_driver;
+	    self->conn_time = conn->conn_time;
+	    self->compress_flag = conn->compress_flag;
+	    conn->fd = -1;
+	    conn->ssl_driver = NULL;
+	    knp_pool_conn_destroy(conn);
+	    found = 1;
+	    break;
 	}
+    }
+    
+    kstr_free(&proxy_addr);
+    kstr_free(&proxy_login);
+    kstr_free(&proxy_pwd);
+    
+    return found;
+}
+
+/* This function puts the connection of the query in the pool, if possible. The
+ * query no longer owns the connection afterwards.
+ */
+static void knp_pool_put(struct knp_query *self, struct knp_proto *knp) {
+    struct knp_pool_conn *conn;
+    time_t now = time(NULL);
+    
+    if (self->transfer.fd == -1 || self->ssl_driver == NULL || ! knp_pool_can_use(self, knp)) return;
+    
+    /* Don't keep connections on which something went wrong. */
+    if (self->res_type == KNP_RES_SERV_ERROR || self->res_type == KNP_RES_LOGIN_ERROR ||
+    	self->res_type == KNP_RES_UPGRADE_PLUGIN || self->res_type == KNP_RES_UPGRADE_KPS) {
+	return;
+    }
+    
+    knp_pool_prune(knp, now);
+    
+    /* The connection is too old to be reused. */
+    if (now - self->conn_time >= (time_t) knp->pool_max_age) return;
+    
+    /* Make room by closing the least recently used connection. */
+    if (knp->pool.size >= KNP_POOL_MAX_CONN) {
+    	knp_pool_conn_destroy((struct knp_pool_conn *) knp->pool.data[0]);
+	knp_pool_remove(knp, 0);
+    }
+    
+    conn = (struct knp_pool_conn *) kmo_calloc(sizeof(struct knp_pool_conn));
+    conn->contact = self->contact;
+    kstr_init_kstr(&conn->server_addr, &self->server_addr);
+    conn->server_port = self->server_port;
+    conn->login_type = self->login_type;
+    conn->fd = self->transfer.fd;
+    conn->ssl_driver = self->ssl_driver;
+    conn->conn_time = self->conn_time;
+    conn->use_time = now;
+    conn->compress_flag = self->compress_flag;
+    karray_add(&knp->pool, conn);
+    
+    self->transfer.fd = -1;
+    self->ssl_driver = NULL;
+}
+
+/* This function connects the query to the server and logs in, unless the query
+ * is already connected. The connection is taken from the connection pool if
+ * possible. If the login fails or if the server asks for an upgrade, the result
+ * type is set and the connection is closed; the login failure is reported by
+ * returning -1.
+ * This function sets the KMO error string. It returns 0, -1, -2, or -3.
+ */
+static int knp_query_login(struct knp_query *self, struct knp_proto *knp, kbuffer *local_payload) {
+    int error = 0;
+    uint32_t msg_type;
+    uint64_t start;
+    
+    /* If we're not connected, reuse a pooled connection or connect to the
+     * server.
+     */
+    if (self->transfer.fd != -1) return 0;
+    
+    if (knp_pool_get(self, knp)) {
+    	kmo_stats_count(KMO_STAT_KNP_POOL_HIT);
+	return 0;
+    }
+    
+    if (knp_pool_can_use(self, knp)) kmo_stats_count(KMO_STAT_KNP_POOL_MISS);
+    
+    error = knp_query_connect(self, knp);
+    if (error) return error;
+    
+    /* Do login. */
+    if (self->login_type == KNP_CMD_LOGIN_ANON) return 0;
+    
+    start = kmo_stats_now();
+    
+    /* Write the login message. */
+    if (self->login_type == KNP_CMD_LOGIN_USER) {
+	knp_msg_write_kstr(local_payload, &knp->server_info->kps_login);
+	knp_msg_write_kstr(local_payload, &knp->server_info->kps_pwd);
+	knp_msg_write_uint32(local_payload, knp->server_info->encrypted_pwd_flag);
+    }
+
+    else {
+	assert(self->login_type == KNP_CMD_LOGIN_OTUT);
+	assert(self->login_otut != NULL);
+	knp_msg_write_kstr(local_payload, self->login_otut);
+    }
+
+    /* Send the login message. */
+    error = knp_query_send_msg(self, self->login_type, local_payload, NULL, knp->k3p);
+    if (error) return error;
+
+    /* Receive the reply. */
+    error = knp_query_recv_msg(self, &msg_type, local_payload, knp->k3p);
+    knp_query_record_phase(self, "login", start);
+    if (error) return error;
+
+    /* Upgrade required. */
+    if (msg_type == KNP_RES_UPGRADE_PLUGIN || msg_type == KNP_RES_UPGRADE_KPS) {
+	knp_query_disconnect(self);
+	self->res_type = msg_type;
+	return 0;
+    }
+
+    /* Login failed. There are two cases here. If we were only doing a login
+     * to the server, the result type is the error returned by the server.
+     * Otherwise, we set the result type to 'KNP_RES_LOGIN_ERROR', to allow
+     * the caller to distinguish between a login failure and the command
+     * failure. The semantics here are pretty messy :-/.
+     */
+    if (msg_type != KNP_RES_LOGIN_OK) {
+	knp_query_disconnect(self);
+
+	if (self->cmd_type)
+	    self->res_type = KNP_RES_LOGIN_ERROR;
+	else
+	    self->res_type = msg_type;
+
+	return -1;
+    }
+
+    /* The server accepts compressed commands only if it compressed its reply
+     * to the login. The login is never compressed, so a server that merely
+     * echoes our minor version does not set the flag.
+     */
+    self->compress_flag = (self->compress_threshold && (self->server_minor & KNP_MINOR_COMPRESSED));
+    
+    /* Assign the result message type and payload to the query. */
+    self->res_type = msg_type;
+    self->res_payload = local_payload;
+    return 0;
+}
+
+/* This function checks the preconditions of the execution of a query. */
+static void knp_query_check_exec(struct knp_query *self, struct knp_proto *knp) {
+    assert(knp != NULL);
+    assert(knp->k3p != NULL);
+    assert(knp->k3p->state == K3P_INTERACTING);
+    assert(knp->k3p->transfer.fd != -1);
+    assert(knp->server_info != NULL);
+    assert(self->transfer.fd == -1 || self->cmd_type);
+    assert(self->res_type == 0);
+    assert(self->res_payload == NULL);
+    assert(self->serv_error_msg == NULL);
+    
+    (void) self;
+    (void) knp;
+}
+
+/* This function executes a server query. The function expects that the server
+ * info have been set. Furthermore, it expects that there is something to do,
+ * i.e. login and/or perform a query. If the function manages to login to the
+ * server, the connection is not closed until the query is destroyed or the
+ * connection is lost. It is possible to execute another query to the server by
+ * calling knp_query_set_cmd() (still unimplemented since it's not needed ATM).
+ * When the query has a command, the connection is taken from the connection
+ * pool if possible and it is returned to the pool once the command has been
+ * executed.
+ * This function sets the KMO error string. It returns 0, -2, or -3.
+ */
+int knp_query_exec(struct knp_query *self, struct knp_proto *knp) {
+    kmod_log_msg(3, "knp_query_exec() called.\n");
+
+    knp_query_check_exec(self, knp);
+    
+    int error = 0;
+    uint32_t msg_type;
+    
+    /* The local payload is used to transfer the data of the messages. It may
+     * eventually become the result payload of the query.
+     */
+    int tag = kmo_heap_set_tag(KMO_HEAP_KNP);
+    kbuffer *local_payload = kbuffer_new(1024);
+    struct knp_endpoint *endpoint = NULL;
+    
+    /* Set the operation timeout. */
+    self->transfer.op_timeout = knp->timeout;
+    
+    /* Process the DNS lookups while the query waits. */
+    self->resolver = &knp->resolver;
+    self->compress_threshold = knp->compress_threshold;
+
+     /* Try. */
+    do {
+	/* Fail right away if the server is down. */
+	if (self->transfer.fd == -1 && knp_query_check_health(self, knp, &endpoint)) break;
 	
-	/* If there is a command, process it. */
-	if (self->cmd_type) {
+	/* Connect and login, if needed. */
+	error = knp_query_login(self, knp, local_payload);
+	if (error) break;
+	
+	/* If there is a command, process it, unless the server wants us to
+	 * upgrade.
+	 */
+	if (self->cmd_type && self->transfer.fd != -1) {
+	    uint64_t start = kmo_stats_now();
 	    assert(self->cmd_payload);
 	    
 	    /* Clear the result message type and payload, if any. */
@@ -1440,11 +2081,12 @@ int knp_query_exec(struct knp_query *self, struct knp_proto *knp) {
 	    self->res_payload = NULL;
 	    
 	    /* Send the command message. */
-	    error = knp_query_send_msg(self, self->cmd_type, self->cmd_payload, knp->k3p);
+	    error = knp_query_send_msg(self, self->cmd_type, self->cmd_payload, self->cmd_file_array, knp->k3p);
 	    if (error) break;
 
 	    /* Receive the result. */
 	    error = knp_query_recv_msg(self, &msg_type, local_payload, knp->k3p);
+	    knp_query_record_phase(self, "command", start);
 	    if (error) break;
 	
 	    /* Assign the result message type and payload to the query. */
@@ -1466,11 +2108,232 @@ int knp_query_exec(struct knp_query *self, struct knp_proto *knp) {
 	error = 0;
     }
     
+    if (! error) knp_query_report_health(self, endpoint);
+    
+    /* Keep the connection for the next queries. */
+    if (! error && self->cmd_type) knp_pool_put(self, knp);
+    
     /* Destroy the local buffer, if it did not become the result payload. */
     if (self->res_payload != local_payload)
     	kbuffer_destroy(local_payload);
     
     assert((self->res_type && ! error) || (! self->res_type && (error == -2 || error == -3)));
+    kmo_heap_set_tag(tag);
+    return error;
+}
+
+/* This function returns true if the two queries specified can share a
+ * connection, i.e. if they log in the same way on the same server.
+ */
+static int knp_query_same_server(struct knp_query *first, struct knp_query *second, struct knp_proto *knp) {
+    int same_flag = 0;
+    int use_srv, use_proxy;
+    uint32_t proxy_port;
+    char *cert;
+    kstr proxy_addr, proxy_login, proxy_pwd;
+    
+    if (first->login_type != second->login_type) return 0;
+    
+    if (first->login_type == KNP_CMD_LOGIN_OTUT && ! kstr_equal_kstr(first->login_otut, second->login_otut)) {
+    	return 0;
+    }
+    
+    kstr_init(&proxy_addr);
+    kstr_init(&proxy_login);
+    kstr_init(&proxy_pwd);
+    
+    /* If this fails, let the connection code report the error. */
+    if (! knp_query_select_server(first, knp, &use_srv, &use_proxy, &proxy_addr, &proxy_port,
+    	    	    	    	  &proxy_login, &proxy_pwd, &cert) &&
+	! knp_query_select_server(second, knp, &use_srv, &use_proxy, &proxy_addr, &proxy_port,
+    	    	    	    	  &proxy_login, &proxy_pwd, &cert)) {
+	same_flag = (first->server_port == second->server_port &&
+	    	     kstr_equal_kstr(&first->server_addr, &second->server_addr));
+    }
+    
+    kstr_free(&proxy_addr);
+    kstr_free(&proxy_login);
+    kstr_free(&proxy_pwd);
+    
+    return same_flag;
+}
+
+/* This function pipelines the commands of the queries specified on a single
+ * connection, opened for the first query. All the commands are written before
+ * the replies are read, in order. If the connection fails, the queries that
+ * did not get their reply get the connection error as their result.
+ * This function sets the KMO error string. It returns 0, -2, or -3.
+ */
+static int knp_query_exec_pipeline(struct knp_query **query_array, int nb_query, struct knp_proto *knp) {
+    int error = 0;
+    int nb_done = 0;
+    int i;
+    struct knp_query *first = query_array[0];
+    struct knp_query *conn;
+    kbuffer *local_payload = kbuffer_new(1024);
+    struct knp_endpoint *endpoint = NULL;
+    uint64_t start;
+    
+    kmod_log_msg(3, "knp_query_exec_pipeline() called.\n");
+    
+    /* The connection belongs to a query of its own, so that the connection
+     * errors don't clobber the results received.
+     */
+    conn = knp_query_new(first->contact, first->login_type, first->cmd_type, first->cmd_payload,
+    	    	    	 &first->all_req_str);
+    
+    if (first->login_otut) {
+    	conn->login_otut = kstr_new();
+	kstr_assign_kstr(conn->login_otut, first->login_otut);
+    }
+    
+    conn->transfer.op_timeout = knp->timeout;
+    conn->resolver = &knp->resolver;
+    conn->compress_threshold = knp->compress_threshold;
+    
+    /* Try. */
+    do {
+	/* Fail right away if the server is down. */
+	if (knp_query_check_health(conn, knp, &endpoint)) break;
+	
+	/* Connect and login, if needed. */
+	error = knp_query_login(conn, knp, local_payload);
+	if (error) break;
+	
+	/* The server wants us to upgrade. */
+	if (conn->transfer.fd == -1) break;
+	
+	conn->res_type = 0;
+	conn->res_payload = NULL;
+	start = kmo_stats_now();
+	
+	/* Write all the commands. */
+	for (i = 0; i < nb_query; i++) {
+	    error = knp_query_send_msg(conn, query_array[i]->cmd_type, query_array[i]->cmd_payload,
+	    	    	    	       query_array[i]->cmd_file_array, knp->k3p);
+	    if (error) break;
+	}
+	
+	if (error) break;
+	
+	/* Read the replies. */
+	for (; nb_done < nb_query; nb_done++) {
+	    uint32_t msg_type;
+	    
+	    error = knp_query_recv_msg(conn, &msg_type, local_payload, knp->k3p);
+	    if (error) break;
+	    
+	    /* The command took the time elapsed since the commands were
+	     * written.
+	     */
+	    knp_query_record_phase(query_array[nb_done], "command", start);
+	    query_array[nb_done]->res_type = msg_type;
+	    query_array[nb_done]->res_payload = local_payload;
+	    local_payload = kbuffer_new(1024);
+	}
+	
+    } while (0);
+    
+    /* A miscellaneous error occured. We did not handle the error yet. Convert
+     * it to a server error.
+     */
+    if (error == -1) {
+    	if (! conn->res_type) knp_query_handle_conn_error(conn, KMO_SERROR_MISC);
+	error = 0;
+    }
+    
+    if (! error) knp_query_report_health(conn, endpoint);
+    
+    /* The queries that did not get their reply share the result of the
+     * connection.
+     */
+    if (! error) {
+    	for (i = nb_done; i < nb_query; i++) {
+	    struct knp_query *query = query_array[i];
+	    
+	    assert(conn->res_type);
+	    query->res_type = conn->res_type;
+	    query->serv_error_id = conn->serv_error_id;
+	    
+	    if (conn->serv_error_msg) {
+	    	query->serv_error_msg = kstr_new();
+		kstr_assign_kstr(query->serv_error_msg, conn->serv_error_msg);
+	    }
+	}
+	
+	/* Keep the connection for the next queries. */
+	if (nb_done == nb_query) knp_pool_put(conn, knp);
+    }
+    
+    if (conn->res_payload == local_payload) conn->res_payload = NULL;
+    kbuffer_destroy(local_payload);
+    knp_query_destroy(conn);
+    
+    return error;
+}
+
+/* This function executes the commands of several queries. The commands of the
+ * queries that log in the same way on the same server as the first query are
+ * pipelined on a single connection, so that they cost a single round trip,
+ * provided that their payloads are small enough to be buffered by the
+ * connection. The other queries are executed one after another. The queries
+ * must have a command; their results are the same as if they had been
+ * executed with knp_query_exec(). If this function returns -2 or -3, some
+ * queries may have no result.
+ * This function sets the KMO error string. It returns 0, -2, or -3.
+ */
+int knp_query_exec_batch(struct knp_query **query_array, int nb_query, struct knp_proto *knp) {
+    int error = 0;
+    int i;
+    uint32_t pipeline_size = 0;
+    int tag = kmo_heap_set_tag(KMO_HEAP_KNP);
+    karray pipeline_array, other_array;
+    
+    kmod_log_msg(3, "knp_query_exec_batch() called.\n");
+    
+    karray_init(&pipeline_array);
+    karray_init(&other_array);
+    
+    for (i = 0; i < nb_query; i++) {
+    	struct knp_query *query = query_array[i];
+	
+	knp_query_check_exec(query, knp);
+	assert(query->cmd_type && query->cmd_payload);
+	
+	if (i == 0 || (pipeline_size + query->cmd_payload->len <= KNP_PIPELINE_MAX_SIZE &&
+	    	       knp_query_same_server(query_array[0], query, knp))) {
+	    karray_add(&pipeline_array, query);
+	    pipeline_size += query->cmd_payload->len;
+	}
+	
+	else {
+	    karray_add(&other_array, query);
+	}
+    }
+    
+    /* Try. */
+    do {
+	if (pipeline_array.size > 1) {
+	    error = knp_query_exec_pipeline((struct knp_query **) pipeline_array.data, pipeline_array.size, knp);
+	    if (error) break;
+	}
+	
+	else {
+	    error = knp_query_exec(query_array[0], knp);
+	    if (error) break;
+	}
+	
+	for (i = 0; i < other_array.size; i++) {
+	    error = knp_query_exec((struct knp_query *) other_array.data[i], knp);
+	    if (error) break;
+	}
+	
+    } while (0);
+    
+    karray_free(&pipeline_array);
+    karray_free(&other_array);
+    kmo_heap_set_tag(tag);
+    
     return error;
 }
 
@@ -1504,6 +2367,19 @@ void knp_msg_write_cstr(kbuffer *buf, char *str) {
     kbuffer_write(buf, str, len);
 }
 
+/* This function adds the content of the file 'path', which is 'len' bytes
+ * long, to the buffer as a string. Only the header of the string is written in
+ * the buffer; the content is sent from the file when the message is sent. The
+ * reference 'ref' is filled and must be added to the file array of the query.
+ */
+void knp_msg_write_file_ref(kbuffer *buf, struct knp_file_ref *ref, kstr *path, uint32_t len) {
+    kbuffer_write8(buf, KNP_STR);
+    kbuffer_write32(buf, len);
+    ref->offset = buf->len;
+    ref->path = path;
+    ref->len = len;
+}
+
 /* This function reads a 32 bit unsigned integer from the buffer.
  * This function sets the KMO error string. It returns -1 on failure.
  */
@@ -1530,28 +2406,38 @@ int knp_msg_read_uint64(kbuffer *buf, uint64_t *i) {
     return 0;
 }
 
-/* This function reads a kstr from the buffer.
+/* This function reads a string from the buffer without copying it. '*data' is
+ * set to point to the string inside the buffer, and '*len' to its length. The
+ * string is not terminated by a '0', and it remains valid as long as the
+ * buffer is not modified or freed (see knp_query_take_res_payload()).
  * This function sets the KMO error string. It returns -1 on failure.
  */
-int knp_msg_read_kstr(kbuffer *buf, kstr *str) {
-    uint32_t len;
-    
+int knp_msg_read_str_view(kbuffer *buf, char **data, uint32_t *len) {
     if (! knp_can_read_bytes(buf, 5) || kbuffer_read8(buf) != KNP_STR) {
     	kmo_seterror("cannot read string value in message");
     	return -1;
     }
     
-    len = kbuffer_read32(buf);
+    *len = kbuffer_read32(buf);
     
-    if (! knp_can_read_bytes(buf, len)) {
+    if (! knp_can_read_bytes(buf, *len)) {
     	kmo_seterror("cannot read string value in message");
 	return -1;
     }
     
-    kstr_grow(str, len);
-    kbuffer_read(buf, str->data, len);
-    str->data[len] = 0;
-    str->slen = len;
+    *data = (char *) kbuffer_read_nbytes(buf, *len);
+    return 0;
+}
+
+/* This function reads a kstr from the buffer.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+int knp_msg_read_kstr(kbuffer *buf, kstr *str) {
+    char *data;
+    uint32_t len;
+    
+    if (knp_msg_read_str_view(buf, &data, &len)) return -1;
+    kstr_assign_buf(str, data, len);
     return 0;
 }
 
@@ -1559,23 +2445,13 @@ int knp_msg_read_kstr(kbuffer *buf, kstr *str) {
  * This function sets the KMO error string. It returns -1 on failure.
  */
 int knp_msg_read_kpstr(kbuffer *buf, kpstr *str) {
+    char *data;
     uint32_t len;
     
-    if (! knp_can_read_bytes(buf, 5) || kbuffer_read8(buf) != KNP_STR) {
-    	kmo_seterror("cannot read string value in message");
-    	return -1;
-    }
-    
-    len = kbuffer_read32(buf);
-    
-    if (! knp_can_read_bytes(buf, len)) {
-    	kmo_seterror("cannot read string value in message");
-	return -1;
-    }
-    
+    if (knp_msg_read_str_view(buf, &data, &len)) return -1;
     str->data = kmo_malloc(len);
     str->length = len;
-    kbuffer_read(buf, str->data, len);
+    memcpy(str->data, data, len);
     return 0;
 }
 
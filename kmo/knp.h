@@ -6,10 +6,89 @@
 #include "kmo_base.h"
 #include "k3p.h"
 #include "knp_core_defs.h"
+#include "kmo_resolver.h"
 
 /* Forward declaration of the KNP SSL driver. */
 struct knp_ssl_driver;
 
+/* Default limits of the KNP connection pool. The delays are in seconds. */
+#define KNP_POOL_IDLE_TIMEOUT	    60
+#define KNP_POOL_MAX_AGE    	    600
+#define KNP_POOL_MAX_CONN   	    8
+
+/* Delay in milliseconds after which the next address of a server is tried
+ * while a connection attempt is still in progress.
+ */
+#define KNP_CONNECT_DELAY   	    250
+
+/* The connection attempts to a server time out after 4 times the usual
+ * connection time (the smoothed round trip time plus 4 times its deviation,
+ * like the TCP retransmission timeout), but not before
+ * KNP_MIN_CONNECT_TIMEOUT milliseconds and not after the operation timeout.
+ * The timeout is doubled each time an attempt times out, up to
+ * KNP_MAX_CONNECT_BACKOFF times, and the probes of a server considered down
+ * use the operation timeout.
+ */
+#define KNP_MIN_CONNECT_TIMEOUT	    2000
+#define KNP_MAX_CONNECT_BACKOFF	    6
+
+/* After KNP_BREAKER_THRESHOLD consecutive connection failures, a server is
+ * considered down and the queries for it fail right away. After
+ * KNP_BREAKER_OPEN_DELAY milliseconds, a single query is let through to probe
+ * the server. If it fails, the delay is doubled, up to KNP_BREAKER_MAX_DELAY.
+ */
+#define KNP_BREAKER_THRESHOLD	    3
+#define KNP_BREAKER_OPEN_DELAY	    (15*1000)
+#define KNP_BREAKER_MAX_DELAY	    (5*60*1000)
+
+/* Maximum size of the command payloads pipelined on a connection. The replies
+ * pile up in the socket buffers while the commands are written.
+ */
+#define KNP_PIPELINE_MAX_SIZE	    (64*1024)
+
+/* Size of the chunks in which the files referenced by a payload are sent. */
+#define KNP_FILE_CHUNK_SIZE 	    (64*1024)
+
+/* File whose content is sent as a string of a payload without being copied in
+ * the payload. The content is sent after the first 'offset' bytes of the
+ * payload. See knp_msg_write_file_ref().
+ */
+struct knp_file_ref {
+    uint32_t offset;
+    kstr *path;
+    uint32_t len;
+};
+
+/* Health of a KNP server, identified by address and port. */
+struct knp_endpoint {
+    kstr addr;
+    uint32_t port;
+    
+    /* Smoothed time taken to connect to the server and its mean deviation,
+     * in microseconds. The smoothed time is 0 if it has not been measured.
+     */
+    uint64_t srtt;
+    uint64_t rttvar;
+    
+    /* Number of times the connection timeout is doubled. It is incremented
+     * when a connection attempt times out and reset when one succeeds, like
+     * the backoff of the TCP retransmission timeout.
+     */
+    uint32_t backoff;
+    
+    /* Number of consecutive connection failures. */
+    int nb_failure;
+    
+    /* True if the server is considered down. The queries fail right away
+     * until 'retry_time' (from kmo_stats_now()), then a probe is let through
+     * and 'retry_time' is pushed back by 'open_delay', the last delay used, in
+     * milliseconds.
+     */
+    int open_flag;
+    uint64_t retry_time;
+    uint32_t open_delay;
+};
+
 /* Kryptiva network protocol handler. */
 struct knp_proto {
     	
@@ -26,6 +105,31 @@ struct knp_proto {
     int use_kpg;
     kstr kpg_addr;
     int kpg_port;
+    
+    /* Pool of idle connections to the KNP servers. The connections are kept
+     * open after the queries have been executed and they are reused by the
+     * queries having the same contact, server address and login type.
+     */
+    karray pool;
+    
+    /* Delay in seconds after which an idle pooled connection is closed. */
+    uint32_t pool_idle_timeout;
+    
+    /* Delay in seconds after which a pooled connection is closed, whether
+     * it is idle or not. 0 disables the pool.
+     */
+    uint32_t pool_max_age;
+    
+    /* DNS resolver used to find the servers. It caches the records. */
+    struct kmo_resolver resolver;
+    
+    /* Payloads larger than this are compressed if the server accepts it. 0
+     * disables the compression, which is then not advertised either.
+     */
+    uint32_t compress_threshold;
+    
+    /* Array of knp_endpoint objects, one per server contacted. */
+    karray endpoint_array;
 };
 
 /* Kryptiva network protocol query. */
@@ -65,6 +169,11 @@ struct knp_query {
     /* Command payload. Memory not owned by this object. */
     kbuffer *cmd_payload;
     
+    /* Files referenced by the command payload (struct knp_file_ref), in the
+     * order of their offset, or NULL if none. Memory not owned by this object.
+     */
+    karray *cmd_file_array;
+    
     /* Result type. If res_type == KNP_RES_SERV_ERROR, the payload is NULL and
      * the error message string is set. If res_type == KNP_RES_LOGIN_OK, the
      * payload is not set. Otherwise, the payload is set.
@@ -85,23 +194,52 @@ struct knp_query {
 
     /* SSL driver. */
     struct knp_ssl_driver *ssl_driver;
+    
+    /* Time at which the connection to the server was opened. */
+    time_t conn_time;
 
     /* All request go through this server if this is set. */
     kstr all_req_str;
+    
+    /* Resolver whose DNS lookups are processed while the query waits. Memory
+     * not owned by this object. Set when the query is executed.
+     */
+    struct kmo_resolver *resolver;
+    
+    /* Compression threshold of the KNP, set when the query is executed, and
+     * true if the server accepts the compressed commands on the connection.
+     */
+    uint32_t compress_threshold;
+    int compress_flag;
+    
+    /* Minor version of the last message received from the server, including
+     * KNP_MINOR_COMPRESSED.
+     */
+    uint32_t server_minor;
 };
 
 struct knp_query * knp_query_new(int contact, int login_type, int cmd_type, kbuffer *cmd_payload, 
                                  kstr *all_req_str);
 void knp_query_destroy(struct knp_query *self);
 void knp_query_disconnect(struct knp_query *self);
+kbuffer * knp_query_take_res_payload(struct knp_query *self);
 int knp_query_exec(struct knp_query *self, struct knp_proto *knp);
+int knp_query_exec_batch(struct knp_query **query_array, int nb_query, struct knp_proto *knp);
+void knp_init_ssl_ctx();
+void knp_pool_init(struct knp_proto *knp);
+void knp_pool_free(struct knp_proto *knp);
+void knp_pool_flush(struct knp_proto *knp);
+void knp_health_init(struct knp_proto *knp);
+void knp_health_free(struct knp_proto *knp);
 void knp_msg_write_uint32(kbuffer *buf, uint32_t i);
 void knp_msg_write_uint64(kbuffer *buf, uint64_t i);
 void knp_msg_write_kstr(kbuffer *buf, kstr *str);
 void knp_msg_write_cstr(kbuffer *buf, char *str);
+void knp_msg_write_file_ref(kbuffer *buf, struct knp_file_ref *ref, kstr *path, uint32_t len);
 int knp_msg_read_uint32(kbuffer *buf, uint32_t *i);
 int knp_msg_read_uint64(kbuffer *buf, uint64_t *i);
 int knp_msg_read_kstr(kbuffer *buf, kstr *str);
+int knp_msg_read_str_view(kbuffer *buf, char **data, uint32_t *len);
 int knp_can_read_bytes(kbuffer *buf, uint32_t nb);
 int knp_msg_dump(char *buf, int buf_len, kstr *dump_str);
 
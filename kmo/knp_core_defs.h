@@ -58,10 +58,25 @@
  * - Added 'KNP_CMD_GET_ENC_KEY_BY_ID'.
  * - Added 'KNP_CMD_GET_KWS_TICKET'.
  * - Added 'KNP_CMD_CONVERT_EXCHANGE'.
+ *
+ * Version 4.2:
+ * - Added the compression of the payloads. It is optional: a plugin sending
+ *   its messages with the minor version 2 accepts compressed replies, and a
+ *   server that compresses its reply to the login accepts compressed commands
+ *   on the connection. The minor version of the reply is not enough, since
+ *   some servers echo the minor version of the plugin. A compressed message has
+ *   KNP_MINOR_COMPRESSED set in its minor version. Its payload contains the
+ *   size of the uncompressed payload (32 bits) followed by the zlib stream.
  */
 #define KNP_MAJOR_VERSION   	    4
 #define KNP_MINOR_VERSION   	    1
 
+/* Minor version advertised when the compression is enabled. */
+#define KNP_MINOR_VERSION_COMPRESS  2
+
+/* Flag set in the minor version of a compressed message. */
+#define KNP_MINOR_COMPRESSED	    0x8000
+
 
 /* Protocol commands, replies and other identitifers have the following form:
  * 16 bits: KNP magic number, 8 bits: identifier category, 8 bits: identifier.
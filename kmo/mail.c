@@ -140,6 +140,16 @@ void mail_build_signed_text_body(int pkg_type, kstr *orig_body, kstr *sig, kstr
     kstr_append_kstr(signed_body, sig);
 }
 
+/* Tags located by mail_scan_markers(), indexed by MAIL_MARKER_*. */
+static char *mail_marker_tag[MAIL_NB_MARKER] = {
+    KRYPTIVA_BODY_START,
+    KRYPTIVA_INFO_START,
+    KRYPTIVA_SIG_START,
+    KRYPTIVA_SIG_END,
+    KRYPTIVA_ENC_BODY_START,
+    KRYPTIVA_ENC_BODY_END
+};
+
 /* This function finds the last occurrence of the specified tag.
  * It returns NULL if the tag is not found.
  */
@@ -163,6 +173,115 @@ static char * mail_find_last_tag(char *where, char *tag) {
     }
 }
 
+/* This function locates all the Kryptiva tags of the body specified in a
+ * single pass. All the tags begin with KRYPTIVA_TAG_PREFIX, so the body is
+ * scanned with memchr() for the dash that begins the prefix and the tags are
+ * compared only where the prefix matches.
+ */
+void mail_scan_markers(kstr *body, struct mail_markers *markers) {
+    char *data = body->data;
+    char *end = memchr(data, 0, body->slen);
+    char *p;
+    int prefix_len = strlen(KRYPTIVA_TAG_PREFIX);
+    int i;
+    
+    if (end == NULL) end = data + body->slen;
+    
+    markers->body = body;
+    markers->len = end - data;
+    
+    for (i = 0; i < MAIL_NB_MARKER; i++) markers->count[i] = 0;
+    
+    for (p = data; end - p >= prefix_len && (p = memchr(p, '-', end - p - prefix_len + 1)) != NULL; p++) {
+    	if (portable_strncasecmp(p, KRYPTIVA_TAG_PREFIX, prefix_len)) continue;
+	
+	for (i = 0; i < MAIL_NB_MARKER; i++) {
+	    char *tag = mail_marker_tag[i];
+	    int tag_len = strlen(tag);
+	    
+	    if (end - p < tag_len) continue;
+	    if (portable_strncasecmp(p + prefix_len, tag + prefix_len, tag_len - prefix_len)) continue;
+	    
+	    if (markers->count[i] < MAIL_MARKER_MAX_POS) markers->pos[i][markers->count[i]] = p - data;
+	    markers->count[i]++;
+	    
+	    /* The tags differ after the prefix; no other tag can match here. */
+	    break;
+	}
+    }
+}
+
+/* This function returns true if the body start tag occurs in the body specified.
+ * Like with mail_scan_markers(), the body is scanned up to its first '0' and
+ * the tag is matched without regard to case. This is much cheaper than a full
+ * scan: the C library searches for the dashes with vector instructions and the
+ * other tags are not compared.
+ */
+int mail_has_body_start_tag(kstr *body) {
+    char *data = body->data;
+    char *end = memchr(data, 0, body->slen);
+    char *tag = mail_marker_tag[MAIL_MARKER_BODY_START];
+    int tag_len = strlen(tag);
+    char *p;
+    
+    if (end == NULL) end = data + body->slen;
+    
+    for (p = data; end - p >= tag_len && (p = memchr(p, '-', end - p - tag_len + 1)) != NULL; p++) {
+    	if (! portable_strncasecmp(p, tag, tag_len)) return 1;
+    }
+    
+    return 0;
+}
+
+/* This function returns the first occurrence of the tag specified at or after
+ * the offset 'from', like portable_strcasestr(). It returns NULL if the tag is
+ * not found.
+ */
+static char * mail_marker_find_first(struct mail_markers *markers, int marker, int from) {
+    char *data = markers->body->data;
+    int i;
+    
+    if (from > markers->len) return NULL;
+    
+    for (i = 0; i < markers->count[marker] && i < MAIL_MARKER_MAX_POS; i++) {
+    	if (markers->pos[marker][i] >= from) return data + markers->pos[marker][i];
+    }
+    
+    /* Some occurrences were not kept. */
+    if (markers->count[marker] > MAIL_MARKER_MAX_POS) {
+    	return portable_strcasestr(data + from, mail_marker_tag[marker]);
+    }
+    
+    return NULL;
+}
+
+/* This function returns the last occurrence of the tag specified when the
+ * occurrences are searched from the offset 'from' without overlap, like
+ * mail_find_last_tag(). It returns NULL if the tag is not found.
+ */
+static char * mail_marker_find_last(struct mail_markers *markers, int marker, int from) {
+    char *data = markers->body->data;
+    int tag_len = strlen(mail_marker_tag[marker]);
+    int last = -1;
+    int i;
+    
+    if (from > markers->len) return NULL;
+    
+    /* Some occurrences were not kept. */
+    if (markers->count[marker] > MAIL_MARKER_MAX_POS) {
+    	return mail_find_last_tag(data + from, mail_marker_tag[marker]);
+    }
+    
+    for (i = 0; i < markers->count[marker]; i++) {
+    	if (markers->pos[marker][i] >= from) {
+	    last = markers->pos[marker][i];
+	    from = last + tag_len;
+	}
+    }
+    
+    return (last == -1) ? NULL : data + last;
+}
+
 /* This function tries to find the tags specified for building an HTML body. It
  * returns true if the tags were found.
  */
@@ -249,22 +368,27 @@ void mail_build_signed_html_body(int pkg_type, kstr *orig_body, kstr *sig, kstr
     kstr_append_buf(signed_body, post_footer, post_footer_s);
 }
 
-/* This function builds an encrypted text body. */
-void mail_build_encrypted_body(int pkg_type, kstr *content, kstr *encrypted_body) {
+/* This function builds an encrypted text body in the rope specified, which
+ * must be empty. The content is not copied: it is adopted by the rope, so it
+ * must stay valid as long as the rope is used.
+ */
+void mail_build_encrypted_body(int pkg_type, char *content, int content_len, krope *encrypted_body) {
+    char *pkg_type_str = mail_get_pkg_type_str(pkg_type);
+    
     kmod_log_msg(2, "mail_build_encrypted_body() called.\n");
     
-    kstr_clear(encrypted_body);
+    assert(encrypted_body->len == 0);
     
     /* Write the body header. */
-    kstr_append_cstr(encrypted_body, KRYPTIVA_BODY_START);
-    kstr_append_char(encrypted_body, '\n');
+    krope_write(encrypted_body, (uint8_t *) KRYPTIVA_BODY_START, strlen(KRYPTIVA_BODY_START));
+    krope_write8(encrypted_body, '\n');
 
     /* Write the packaging type. */
-    kstr_append_cstr(encrypted_body, mail_get_pkg_type_str(pkg_type));
-    kstr_append_char(encrypted_body, '\n');
+    krope_write(encrypted_body, (uint8_t *) pkg_type_str, strlen(pkg_type_str));
+    krope_write8(encrypted_body, '\n');
 
-    /* Write the new body content. */
-    kstr_append_kstr(encrypted_body, content);
+    /* Adopt the new body content. */
+    krope_adopt(encrypted_body, (uint8_t *) content, content_len, NULL);
 }
 
 /* This function returns a pointer to the beginning of the '\n*<pre>\n*' string
@@ -332,7 +456,9 @@ static char * mail_remove_pre(char *mail_str, char *scan_str, int remove_leading
 /* This function returns 0 if the mail specified is a gray Zone mail, 1 if it is
  * a Kryptiva mail, and 2 if it is an unsigned mail. NULL bodies are ignored.
  */
-int mail_get_mail_status(kstr *text_body, kstr *html_body) {
+int mail_get_mail_status(kstr *text_body, kstr *html_body, struct mail_markers *text_markers,
+    	    	    	 struct mail_markers *html_markers) {
+    struct mail_markers scan_markers;
     
     /* Status as described above, plus '3' for empty body. */
     int text_status = 3;
@@ -349,7 +475,14 @@ int mail_get_mail_status(kstr *text_body, kstr *html_body) {
     
     if (text_body) {
     	char *data = text_body->data;
-    	char *marker = portable_strcasestr(data, KRYPTIVA_BODY_START);
+    	char *marker;
+	
+	if (text_markers == NULL) {
+	    mail_scan_markers(text_body, &scan_markers);
+	    text_markers = &scan_markers;
+	}
+	
+	marker = mail_marker_find_first(text_markers, MAIL_MARKER_BODY_START, 0);
     	
 	kmod_log_msg(3, "mail_get_mail_status(): scanning the text body.\n");
 	
@@ -413,11 +546,18 @@ int mail_get_mail_status(kstr *text_body, kstr *html_body) {
     
     if (html_body) {
     	char *data = html_body->data;
-    	char *marker = portable_strcasestr(data, KRYPTIVA_BODY_START);
+    	char *marker;
 	char *before_pre = NULL;
 	char *prev_tag_start = NULL;
 	char tag_ok_flag = 0;
 	
+	if (html_markers == NULL) {
+	    mail_scan_markers(html_body, &scan_markers);
+	    html_markers = &scan_markers;
+	}
+	
+	marker = mail_marker_find_first(html_markers, MAIL_MARKER_BODY_START, 0);
+	
 	kmod_log_msg(3, "mail_get_mail_status(): scanning the HTML body.\n");
 	
 	/* Determine if the tag is OK. */
@@ -501,9 +641,11 @@ int mail_get_mail_status(kstr *text_body, kstr *html_body) {
 }
 
 /* This function extracts the signature from the specified mail body.
+ * 'markers' are the markers of the body, or NULL to scan the body here.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-int mail_get_signature(kstr *target_body, kstr *sig) {
+int mail_get_signature(kstr *target_body, kstr *sig, struct mail_markers *markers) {
+    struct mail_markers scan_markers;
     char *sig_start, *sig_end;
     
     kmod_log_msg(2, "mail_get_signature() called.\n");
@@ -514,8 +656,13 @@ int mail_get_signature(kstr *target_body, kstr *sig) {
 	return -1;
     }
     
+    if (markers == NULL) {
+    	mail_scan_markers(target_body, &scan_markers);
+	markers = &scan_markers;
+    }
+    
     /* Find the last KRYPTIVA_SIG_START tag. */
-    sig_start = mail_find_last_tag(target_body->data, KRYPTIVA_SIG_START);
+    sig_start = mail_marker_find_last(markers, MAIL_MARKER_SIG_START, 0);
     
     if (sig_start == NULL) {
     	kmo_seterror("Kryptiva signature header not found");
@@ -523,7 +670,7 @@ int mail_get_signature(kstr *target_body, kstr *sig) {
     }
     
     sig_start += strlen(KRYPTIVA_SIG_START);
-    sig_end = mail_find_last_tag(sig_start, KRYPTIVA_SIG_END);
+    sig_end = mail_marker_find_last(markers, MAIL_MARKER_SIG_END, sig_start - target_body->data);
     
     if (sig_end == NULL) {
     	kmo_seterror("Kryptiva signature footer not found");
@@ -545,14 +692,22 @@ int mail_get_signature(kstr *target_body, kstr *sig) {
 }
 
 /* This function removes the signature from a text mail.
+ * 'markers' are the markers of the body, or NULL to scan the body here.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-int mail_strip_text_signature(kstr *body_str, kstr *out_str) {
+int mail_strip_text_signature(kstr *body_str, kstr *out_str, struct mail_markers *markers) {
+    struct mail_markers scan_markers;
     char *body_start, *body_end;
+    int pos;
     
     kmod_log_msg(2, "mail_strip_text_signature() called.\n");
     
-    body_start = portable_strcasestr(body_str->data, KRYPTIVA_BODY_START);
+    if (markers == NULL) {
+    	mail_scan_markers(body_str, &scan_markers);
+	markers = &scan_markers;
+    }
+    
+    body_start = mail_marker_find_first(markers, MAIL_MARKER_BODY_START, 0);
     
     if (body_start == NULL) {
     	kmo_seterror("cannot find body start");
@@ -560,7 +715,8 @@ int mail_strip_text_signature(kstr *body_str, kstr *out_str) {
     }
     
     /* Skip PACKAGING TYPE. */
-    body_start = portable_strcasestr(body_start + strlen(KRYPTIVA_BODY_START) + 5, "\n");
+    pos = body_start - body_str->data + strlen(KRYPTIVA_BODY_START) + 5;
+    body_start = pos < markers->len ? memchr(body_str->data + pos, '\n', markers->len - pos) : NULL;
     
     if (body_start == NULL) {
         kmo_seterror("cannot find packaging type end");
@@ -570,7 +726,7 @@ int mail_strip_text_signature(kstr *body_str, kstr *out_str) {
     /* Skip the '\n'. */
     body_start++;
     
-    body_end = mail_find_last_tag(body_start, KRYPTIVA_INFO_START);
+    body_end = mail_marker_find_last(markers, MAIL_MARKER_INFO_START, body_start - body_str->data);
 
     if (body_end == NULL) {
         kmo_seterror("cannot find body end");
@@ -597,12 +753,14 @@ int mail_strip_html_signature(kstr *raw_body_str, kstr *out_str) {
     
     /* Try. */
     do {
+    	struct mail_markers markers;
     	char *marker;
     	char *prolog_start, *prolog_end;
 	char *info_start, *info_end;
     	
 	/* Find the body marker. */
-	marker = portable_strcasestr(stripped_body.data, KRYPTIVA_BODY_START);
+	mail_scan_markers(&stripped_body, &markers);
+	marker = mail_marker_find_first(&markers, MAIL_MARKER_BODY_START, 0);
 
 	if (marker == NULL) {
             kmo_seterror("cannot find body marker");
@@ -634,7 +792,7 @@ int mail_strip_html_signature(kstr *raw_body_str, kstr *out_str) {
 	prolog_end += strlen("</pre>");
 	
 	/* Find the info marker. */
-	marker = mail_find_last_tag(prolog_end, KRYPTIVA_INFO_START);
+	marker = mail_marker_find_last(&markers, MAIL_MARKER_INFO_START, prolog_end - stripped_body.data);
 	
 	if (marker == NULL) {
             kmo_seterror("cannot find info marker");
@@ -683,15 +841,22 @@ int mail_strip_html_signature(kstr *raw_body_str, kstr *out_str) {
 
 /* This function extracts the encrypted data embedded in an email.
  * Normally the encrypted body data is placed inside a text email.
+ * 'markers' are the markers of the body, or NULL to scan the body here.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-int mail_get_encrypted_body(kstr *target_body, kstr *out_str) {
+int mail_get_encrypted_body(kstr *target_body, kstr *out_str, struct mail_markers *markers) {
+    struct mail_markers scan_markers;
     int i = 0;
     char *enc_start, *enc_end;
     
     kmod_log_msg(2, "mail_get_encrypted_body() called.\n");
     
-    enc_start = portable_strcasestr(target_body->data, KRYPTIVA_ENC_BODY_START);
+    if (markers == NULL) {
+    	mail_scan_markers(target_body, &scan_markers);
+	markers = &scan_markers;
+    }
+    
+    enc_start = mail_marker_find_first(markers, MAIL_MARKER_ENC_START, 0);
     
     if (enc_start == NULL) {
     	kmo_seterror("cannot find encrypted body start");
@@ -699,7 +864,7 @@ int mail_get_encrypted_body(kstr *target_body, kstr *out_str) {
     }
     
     enc_start += sizeof(KRYPTIVA_ENC_BODY_START);
-    enc_end = portable_strcasestr(enc_start, KRYPTIVA_ENC_BODY_END);
+    enc_end = mail_marker_find_first(markers, MAIL_MARKER_ENC_END, enc_start - target_body->data);
 
     if (enc_end == NULL) {
     	kmo_seterror("cannot find encrypted body end");
@@ -5,6 +5,7 @@
 
 #include "kmo_base.h"
 #include "k3p_core_defs.h"
+#include "krope.h"
 
 /* Kryptive message tags. */
 #define KRYPTIVA_BODY_START \
@@ -24,20 +25,57 @@
 
 #define KRYPTIVA_ENC_BODY_END \
 	"----- KRYPTIVA ENCRYPTED DATA END -----"
-	
 
+/* Common prefix of the Kryptiva message tags. */
+#define KRYPTIVA_TAG_PREFIX \
+	"----- KRYPTIVA "
+
+/* Kryptiva message tags located by mail_scan_markers(). */
+#define MAIL_MARKER_BODY_START	0
+#define MAIL_MARKER_INFO_START	1
+#define MAIL_MARKER_SIG_START	2
+#define MAIL_MARKER_SIG_END	3
+#define MAIL_MARKER_ENC_START	4
+#define MAIL_MARKER_ENC_END	5
+#define MAIL_NB_MARKER		6
+
+/* Number of occurrences of a tag kept by mail_scan_markers(). */
+#define MAIL_MARKER_MAX_POS	8
+
+/* Offsets of the Kryptiva message tags in a mail body. Like with
+ * portable_strcasestr(), the body is scanned up to its first '0' and the tags
+ * are matched without regard to case.
+ */
+struct mail_markers {
+    
+    /* Body scanned. Memory not owned by this object. */
+    kstr *body;
+    
+    /* Number of characters scanned. */
+    int len;
+    
+    /* Number of occurrences of each tag, overlapping occurrences included. */
+    int count[MAIL_NB_MARKER];
+    
+    /* Offsets of the first occurrences of each tag, in order. */
+    int pos[MAIL_NB_MARKER][MAIL_MARKER_MAX_POS];
+};
+	
 char * mail_get_pkg_type_str(int pkg_type);
 void mail_repair_outlook_html_damage(kstr *body);
 void mail_get_signable_html_body(kstr *in, kstr *out);
 void mail_put_space_before_body_end(kstr *in);
 void mail_build_signed_text_body(int pkg_type, kstr *orig_body, kstr *sig, kstr *signed_body);
 void mail_build_signed_html_body(int pkg_type, kstr *orig_body, kstr *sig, kstr *signed_body);
-void mail_build_encrypted_body(int pkg_type, kstr *content, kstr *encrypted_body);
-int mail_get_mail_status(kstr *text_body, kstr *html_body);
-int mail_get_signature(kstr *target_body, kstr *sig);
-int mail_strip_text_signature(kstr * body_str, kstr *out_str);
+void mail_build_encrypted_body(int pkg_type, char *content, int content_len, krope *encrypted_body);
+void mail_scan_markers(kstr *body, struct mail_markers *markers);
+int mail_has_body_start_tag(kstr *body);
+int mail_get_mail_status(kstr *text_body, kstr *html_body, struct mail_markers *text_markers,
+    	    	    	 struct mail_markers *html_markers);
+int mail_get_signature(kstr *target_body, kstr *sig, struct mail_markers *markers);
+int mail_strip_text_signature(kstr * body_str, kstr *out_str, struct mail_markers *markers);
 int mail_strip_html_signature(kstr *raw_body_str, kstr *out_str);
-int mail_get_encrypted_body(kstr *target_body, kstr *out_str);
+int mail_get_encrypted_body(kstr *target_body, kstr *out_str, struct mail_markers *markers);
 int mail_parse_addr_field(kstr *addr_field, karray *addr_array);
 		   
 #endif
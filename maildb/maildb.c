@@ -18,6 +18,7 @@ void maildb_init_mail_info(maildb_mail_info *mail_info) {
     kstr_init(&mail_info->otut_string);
     kstr_init(&mail_info->otut_msg);
     kstr_init(&mail_info->kpg_addr);
+    mail_info->field_mask = MAILDB_FIELD_ALL;
 }
 
 /* Get the mail to be ready to reuse.
@@ -44,6 +45,7 @@ void maildb_clear_mail_info(maildb_mail_info *mail_info) {
     kstr_shrink(&mail_info->otut_string, 1024);
     kstr_shrink(&mail_info->otut_msg, 1024);
     kstr_shrink(&mail_info->kpg_addr, 1024);
+    mail_info->field_mask = MAILDB_FIELD_ALL;
 }
 
 /* Free the strings members in mail_info */
@@ -76,3 +78,27 @@ void maildb_free_sender_info(maildb_sender_info *sender_info) {
     
     kstr_free(&sender_info->name);
 }
+
+void maildb_init_sig_key_info(maildb_sig_key_info *sig_key_info) {
+    sig_key_info->mid = 0;
+    sig_key_info->fetch_time = 0;
+    kstr_init(&sig_key_info->tm_key_data);
+    kstr_init(&sig_key_info->key_data);
+    kstr_init(&sig_key_info->subscriber_name);
+}
+
+void maildb_clear_sig_key_info(maildb_sig_key_info *sig_key_info) {
+    sig_key_info->mid = 0;
+    sig_key_info->fetch_time = 0;
+    kstr_clear(&sig_key_info->tm_key_data);
+    kstr_clear(&sig_key_info->key_data);
+    kstr_clear(&sig_key_info->subscriber_name);
+}
+
+void maildb_free_sig_key_info(maildb_sig_key_info *sig_key_info) {
+    if (sig_key_info == NULL) return;
+    
+    kstr_free(&sig_key_info->tm_key_data);
+    kstr_free(&sig_key_info->key_data);
+    kstr_free(&sig_key_info->subscriber_name);
+}
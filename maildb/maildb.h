@@ -4,9 +4,19 @@
 #define __KMOMAILDB_H__
 
 #include "kmo_base.h"
+#include "kmo_heap.h"
+#include "kmo_stats.h"
 
 #define KMOMAILDB_VERSION 1
 
+/* Number of message IDs looked up by a single query in
+ * maildb_get_mail_info_batch().
+ */
+#define MAILDB_BATCH_SIZE   	100
+
+/* Number of writes done in a single transaction by maildb_set_unsigned_mail(). */
+#define MAILDB_BULK_WRITE_SIZE	1000
+
 /** Email fields status bitfield (we store everything in 1 int).
  * Value 0: absent.
  * Value 1: changed.
@@ -23,6 +33,22 @@ enum {
     MAILDB_STATUS_HTML_BODY     = 6
 };
 
+/** Groups of fields of a mail info object read from the database, used as a
+ * bit mask. The integer fields are small and they are read together; the
+ * strings and the blobs are read only when they are requested.
+ */
+enum {
+    MAILDB_FIELD_BASE           = (1 << 0), /* status, display pref, mid, packaging, statuses, counts, KPG port. */
+    MAILDB_FIELD_HASH           = (1 << 1), /* hash, ksn. */
+    MAILDB_FIELD_SIG_MSG        = (1 << 2), /* sig_msg. */
+    MAILDB_FIELD_ATTACHMENT     = (1 << 3), /* attachment_status. */
+    MAILDB_FIELD_SYM_KEY        = (1 << 4), /* sym_key. */
+    MAILDB_FIELD_MSG            = (1 << 5), /* decryption_error_msg, pod_msg, otut_msg. */
+    MAILDB_FIELD_OTUT           = (1 << 6), /* otut_string. */
+    MAILDB_FIELD_KPG            = (1 << 7), /* kpg_addr. */
+    MAILDB_FIELD_ALL            = (1 << 8) - 1
+};
+
 /** The content of a mail entry */
 typedef struct _maildb_mail_info {
     int64_t	    	entry_id; /** < Entry ID of this object. It is set when writing / reading this object. */
@@ -53,6 +79,8 @@ typedef struct _maildb_mail_info {
     kstr                otut_msg; /** < message associated with the otut. */
     kstr                kpg_addr; /** True if there is a KPG address and port. */
     int                 kpg_port;
+    uint32_t            field_mask; /** < MAILDB_FIELD_* groups that are valid. The other fields are empty
+    	    	    	    	     *    until they are loaded with maildb_load_mail_info(). */
 } maildb_mail_info;
 
 
@@ -63,6 +91,18 @@ typedef struct _maildb_sender {
 } maildb_sender_info;
 
 
+/** Signature key data obtained from the IKS, cached to avoid querying the IKS
+ * for every mail received from the same member.
+ */
+typedef struct _maildb_sig_key_info {
+    int64_t             mid;	    	    /* Member ID of the key owner. */
+    kstr                tm_key_data;	    /* Timestamp key data. */
+    kstr                key_data;   	    /* Signature key data. */
+    kstr                subscriber_name;    /* Name of the subscriber. */
+    int64_t             fetch_time; 	    /* Time at which the data was obtained from the IKS. */
+} maildb_sig_key_info;
+
+
 /** A maildb is the object type that represent a database for storing the
  * status of the mail and the passwords.
  */
@@ -83,6 +123,9 @@ struct _maildb_ops {
     int  (*set_mail_info)    	(maildb                *mdb,
                               	 maildb_mail_info      *mail_info);
     
+    int  (*set_unsigned_mail)  	(maildb                *mdb,
+                              	 karray                *msg_id_array);
+    
     int  (*get_mail_info_from_entry_id) (maildb                *mdb,
                              	    	 maildb_mail_info      *mail_info,
                             	    	 int64_t               entry_id);
@@ -96,6 +139,16 @@ struct _maildb_ops {
                             	    	 kstr                  *hash,
 					 kstr                  *ksn);
 					 	      
+    int  (*get_mail_info_batch) (maildb                *mdb,
+    	    	    	    	 karray                *msg_id_array,
+				 karray                *mail_info_array,
+				 karray                *sender_info_array,
+				 uint32_t               field_mask);
+					 	      
+    int  (*load_mail_info)      (maildb                *mdb,
+    	    	    	    	 maildb_mail_info      *mail_info,
+				 uint32_t               field_mask);
+					 	      
     int  (*set_sender_info)  	(maildb                *mdb,
                              	 maildb_sender_info    *sender_info);
 			      
@@ -106,6 +159,16 @@ struct _maildb_ops {
     int  (*rm_sender_info)      (maildb                *mdb,
                                  int64_t                mid);
 			      
+    int  (*set_sig_key_info)  	(maildb                *mdb,
+                             	 maildb_sig_key_info   *sig_key_info);
+			      
+    int  (*get_sig_key_info) 	(maildb                *mdb,
+                             	 maildb_sig_key_info   *sig_key_info,
+                             	 int64_t                mid);
+			      
+    int  (*rm_sig_key_info)     (maildb                *mdb,
+                                 int64_t                mid);
+			      
     int  (*set_pwd)             (maildb                *mdb,
                                  kstr                  *email,
                                  kstr                  *pwd);
@@ -120,6 +183,16 @@ struct _maildb_ops {
     
     int  (*rm_pwd)   	    	(maildb                *mdb,
     	    	    	    	 kstr                  *email);
+    
+    int  (*set_group_commit)    (maildb                *mdb,
+    	    	    	    	 int                    enable_flag);
+    
+    int  (*commit_group)        (maildb                *mdb);
+    
+    int  (*get_group_size)      (maildb                *mdb);
+    
+    int  (*maintain)            (maildb                *mdb,
+    	    	    	    	 int                   *done_flag);
 };
 
 maildb * maildb_sqlite_new(char *db_name);
@@ -129,48 +202,213 @@ static inline void maildb_destroy(maildb *mdb) {
 }
 
 static inline int maildb_set_mail_info(maildb *mdb, maildb_mail_info *mail_info) {
-    return mdb->ops->set_mail_info (mdb, mail_info);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->set_mail_info(mdb, mail_info);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_SET_MAIL_INFO, start);
+    return error;
+}
+
+/* This function marks each message ID of 'msg_id_array' (array of kstr) as an
+ * unsigned mail, like maildb_set_mail_info() with status 3, using far fewer
+ * transactions.
+ */
+static inline int maildb_set_unsigned_mail(maildb *mdb, karray *msg_id_array) {
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->set_unsigned_mail(mdb, msg_id_array);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_SET_UNSIGNED_MAIL, start);
+    return error;
 }
 
 static inline int maildb_get_mail_info_from_entry_id(maildb *mdb, maildb_mail_info *mail_info, int64_t entry_id) {
-    return mdb->ops->get_mail_info_from_entry_id(mdb, mail_info, entry_id);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->get_mail_info_from_entry_id(mdb, mail_info, entry_id);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_GET_MAIL_INFO, start);
+    return error;
 }
 
 static inline int maildb_get_mail_info_from_msg_id(maildb *mdb, maildb_mail_info *mail_info, kstr *msg_id) {
-    return mdb->ops->get_mail_info_from_msg_id(mdb, mail_info, msg_id);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->get_mail_info_from_msg_id(mdb, mail_info, msg_id);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_GET_MAIL_INFO, start);
+    return error;
 }
 
 static inline int maildb_get_mail_info_from_hash(maildb *mdb, maildb_mail_info *mail_info, 
     	    	    	    	    	    	 kstr *hash, kstr *ksn) {
-    return mdb->ops->get_mail_info_from_hash(mdb, mail_info, hash, ksn);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->get_mail_info_from_hash(mdb, mail_info, hash, ksn);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_GET_MAIL_INFO, start);
+    return error;
+}
+
+/* This function looks up the mail info and the sender info of each message ID
+ * of 'msg_id_array' (array of kstr). The results are stored in the
+ * initialized objects of 'mail_info_array' and 'sender_info_array', at the
+ * position of the message ID. The entry ID of a mail info is set to 0 if the
+ * message ID is unknown. The member ID of a sender info is set to 0 if there is
+ * no sender info. Only the MAILDB_FIELD_* groups of 'field_mask' are read, in
+ * addition to MAILDB_FIELD_BASE.
+ */
+static inline int maildb_get_mail_info_batch(maildb *mdb, karray *msg_id_array, karray *mail_info_array,
+    	    	    	    	    	     karray *sender_info_array, uint32_t field_mask) {
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->get_mail_info_batch(mdb, msg_id_array, mail_info_array, sender_info_array, field_mask);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_GET_MAIL_INFO_BATCH, start);
+    return error;
+}
+
+/* This function reads the MAILDB_FIELD_* groups of 'field_mask' that have not
+ * been read yet in the mail info specified. The other fields are left intact.
+ */
+static inline int maildb_load_mail_info(maildb *mdb, maildb_mail_info *mail_info, uint32_t field_mask) {
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->load_mail_info(mdb, mail_info, field_mask);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_LOAD_MAIL_INFO, start);
+    return error;
 }
 
 static inline int maildb_set_sender_info(maildb *mdb, maildb_sender_info *sender_info) {
-    return mdb->ops->set_sender_info (mdb, sender_info);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->set_sender_info(mdb, sender_info);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_SENDER_INFO, start);
+    return error;
 }
 
 static inline int maildb_get_sender_info(maildb *mdb, maildb_sender_info *sender_info, uint64_t mid) {
-    return mdb->ops->get_sender_info (mdb, sender_info, mid);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->get_sender_info(mdb, sender_info, mid);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_SENDER_INFO, start);
+    return error;
 }
 
 static inline int maildb_rm_sender_info(maildb *mdb, int64_t mid) {
-    return mdb->ops->rm_sender_info (mdb, mid);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->rm_sender_info(mdb, mid);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_SENDER_INFO, start);
+    return error;
+}
+
+static inline int maildb_set_sig_key_info(maildb *mdb, maildb_sig_key_info *sig_key_info) {
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->set_sig_key_info(mdb, sig_key_info);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_SIG_KEY_INFO, start);
+    return error;
+}
+
+static inline int maildb_get_sig_key_info(maildb *mdb, maildb_sig_key_info *sig_key_info, int64_t mid) {
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->get_sig_key_info(mdb, sig_key_info, mid);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_SIG_KEY_INFO, start);
+    return error;
+}
+
+static inline int maildb_rm_sig_key_info(maildb *mdb, int64_t mid) {
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->rm_sig_key_info(mdb, mid);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_SIG_KEY_INFO, start);
+    return error;
 }
 
 static inline int maildb_set_pwd(maildb *mdb, kstr *email, kstr *pwd) {
-    return mdb->ops->set_pwd (mdb, email, pwd);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->set_pwd(mdb, email, pwd);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_PWD, start);
+    return error;
 }
 
 static inline int maildb_get_pwd(maildb *mdb, kstr *email, kstr *pwd) { 
-    return mdb->ops->get_pwd (mdb, email, pwd);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->get_pwd(mdb, email, pwd);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_PWD, start);
+    return error;
 }
 
 static inline int maildb_get_all_pwd(maildb *mdb, karray *addr_array, karray *pwd_array) { 
-    return mdb->ops->get_all_pwd (mdb, addr_array, pwd_array);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->get_all_pwd(mdb, addr_array, pwd_array);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_PWD, start);
+    return error;
 }
 
 static inline int maildb_rm_pwd(maildb *mdb, kstr *email) { 
-    return mdb->ops->rm_pwd(mdb, email);
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->rm_pwd(mdb, email);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_PWD, start);
+    return error;
+}
+
+/* This function enables or disables the group commit mode. In this mode, the
+ * writes are not committed to the disk until maildb_commit_group() is called.
+ */
+static inline int maildb_set_group_commit(maildb *mdb, int enable_flag) {
+    return mdb->ops->set_group_commit(mdb, enable_flag);
+}
+
+/* This function commits the writes done since the last group commit, if any. */
+static inline int maildb_commit_group(maildb *mdb) {
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->commit_group(mdb);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_COMMIT_GROUP, start);
+    return error;
+}
+
+/* This function returns the number of write operations not yet committed in
+ * group commit mode.
+ */
+static inline int maildb_get_group_size(maildb *mdb) {
+    return mdb->ops->get_group_size(mdb);
+}
+
+/* This function performs one short step of the maintenance of the database:
+ * quick check, pruning of the evaluation results that are no longer referenced,
+ * statistics update and incremental vacuum. '*done_flag' is set to true when the
+ * last step of the cycle has been performed; the next call begins a new cycle.
+ * The group transaction is committed first. This function returns -1 on
+ * failure, and -2 if the database is corrupted.
+ */
+static inline int maildb_maintain(maildb *mdb, int *done_flag) {
+    uint64_t start = kmo_stats_now();
+    int tag = kmo_heap_set_tag(KMO_HEAP_MAILDB);
+    int error = mdb->ops->maintain(mdb, done_flag);
+    kmo_heap_set_tag(tag);
+    kmo_stats_add_time(KMO_STAT_MAILDB_MAINTAIN, start);
+    return error;
 }
 
 void maildb_init_mail_info(maildb_mail_info *mail_info);
@@ -179,6 +417,9 @@ void maildb_free_mail_info(maildb_mail_info *mail_info);
 void maildb_init_sender_info(maildb_sender_info *sender_info);
 void maildb_clear_sender_info(maildb_sender_info *sender_info);
 void maildb_free_sender_info(maildb_sender_info *sender_info);
+void maildb_init_sig_key_info(maildb_sig_key_info *sig_key_info);
+void maildb_clear_sig_key_info(maildb_sig_key_info *sig_key_info);
+void maildb_free_sig_key_info(maildb_sig_key_info *sig_key_info);
 
 #endif
 
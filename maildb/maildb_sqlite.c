@@ -31,9 +31,17 @@
  * 2) The database is cleaned up from time to time by the plugin, which supplies
  *    the complete list of message IDs still in the mail folders.
  *
- * - Note that SQLite (apparently) does not support nested transactions.
+ * - Note that SQLite does not support nested transactions. Savepoints are
+ *   used instead when a write must be atomic within the group transaction.
  * - Note that SQLite barfs if you set an empty string/blob with a NULL pointer.
- * - Note that statements must be finalized before rollback can occur.
+ * - Note that statements must be finalized or reset before rollback can occur.
+ * - The statements used by the maildb operations are prepared once and cached
+ *   in the maildb_sqlite object. They are reset after each use.
+ * - In group commit mode, the database uses write-ahead logging and the writes
+ *   are accumulated in a single open transaction, the group transaction,
+ *   until maildb_commit_group() is called. This trades the durability of the
+ *   last few writes for far fewer disk syncs. Other connections cannot write
+ *   to the database while the group transaction is open.
  *
  * - The following scheme is used for entry IDs:
  *   * -1: no mail_eval_res entry corresponds to the message ID specified
@@ -48,6 +56,88 @@
  * 4) Profit!!!
  */
 
+/* Identifiers of the cached SQL statements. */
+enum {
+    MAILDB_STMT_GET_ENTRY_ID_FROM_MSG_ID,
+    MAILDB_STMT_GET_ENTRY_ID_FROM_HASH,
+    MAILDB_STMT_RM_MAIL_EVAL_RES,
+    MAILDB_STMT_RM_UNREF_MAIL_EVAL_RES,
+    MAILDB_STMT_RM_MAIL_MSG_ID,
+    MAILDB_STMT_CREATE_MAIL_MSG_ID,
+    MAILDB_STMT_CREATE_MAIL_EVAL_RES,
+    MAILDB_STMT_CREATE_MAIL_EVAL_RES_ID,
+    MAILDB_STMT_GET_MAIL_INFO,
+    MAILDB_STMT_LOAD_MAIL_INFO,
+    MAILDB_STMT_GET_MAIL_INFO_BATCH,
+    MAILDB_STMT_RM_SENDER_INFO,
+    MAILDB_STMT_SET_SENDER_INFO,
+    MAILDB_STMT_GET_SENDER_INFO,
+    MAILDB_STMT_RM_SIG_KEY_INFO,
+    MAILDB_STMT_SET_SIG_KEY_INFO,
+    MAILDB_STMT_GET_SIG_KEY_INFO,
+    MAILDB_STMT_RM_PWD,
+    MAILDB_STMT_SET_PWD,
+    MAILDB_STMT_GET_PWD,
+    MAILDB_STMT_GET_ALL_PWD,
+    MAILDB_STMT_MAINT_NEXT_ENTRY_ID,
+    MAILDB_STMT_MAINT_PRUNE,
+    MAILDB_STMT_NB
+};
+
+/* Steps of the maintenance cycle. See maildb_sqlite_maintain(). */
+enum {
+    MAILDB_MAINT_CHECK,
+    MAILDB_MAINT_PRUNE,
+    MAILDB_MAINT_ANALYZE,
+    MAILDB_MAINT_VACUUM,
+    MAILDB_MAINT_NB_STEP
+};
+
+/* Number of evaluation results examined per pruning step, and number of pages
+ * freed per incremental vacuum step.
+ */
+#define MAILDB_MAINT_PRUNE_SIZE     1000
+#define MAILDB_MAINT_VACUUM_PAGES   64
+
+/* Tables checked and analyzed by the maintenance, one per step. */
+static const char *maildb_maint_table_array[] = { "mail_eval_res3", "mail_msg_id", "sender", "sig_key", "pwd" };
+#define MAILDB_MAINT_NB_TABLE	(int) (sizeof(maildb_maint_table_array) / sizeof(char *))
+
+/* Internal database object of the SQLite backend. */
+struct maildb_sqlite {
+    
+    /* SQLite database handle. */
+    sqlite3 *db;
+    
+    /* Cached SQL statements, indexed by statement identifier. NULL if the
+     * statement has not been prepared yet.
+     */
+    sqlite3_stmt *stmt_cache[MAILDB_STMT_NB];
+    
+    /* MAILDB_FIELD_* groups read by the cached MAILDB_STMT_LOAD_MAIL_INFO and
+     * MAILDB_STMT_GET_MAIL_INFO_BATCH statements.
+     */
+    uint32_t load_field_mask;
+    uint32_t batch_field_mask;
+    
+    /* True if the group commit mode is enabled. */
+    int group_flag;
+    
+    /* Number of write operations done in the group transaction. 0 if the group
+     * transaction is not open.
+     */
+    int group_size;
+    
+    /* State of the maintenance cycle: current step, table examined by the
+     * step, last entry ID examined by the pruning and number of evaluation
+     * results pruned.
+     */
+    int maint_step;
+    int maint_table;
+    int64_t maint_entry_id;
+    int maint_nb_pruned;
+};
+
 /* This function binds the specified string on the specifed column of the
  * specified SQL statement. WARNING: The content of text is not copied.
  * It returns an SQL error code.
@@ -116,6 +206,42 @@ static void finalize_stmt(sqlite3 *db, sqlite3_stmt **stmt_handle) {
     }
 }
 
+/* This function returns the cached SQL statement having the identifier
+ * specified, preparing it with the SQL text specified the first time.
+ * It returns an SQL error code.
+ */
+static int prepare_stmt(struct maildb_sqlite *self, int stmt_id, const char *sql, sqlite3_stmt **stmt_handle) {
+    assert(stmt_id >= 0 && stmt_id < MAILDB_STMT_NB);
+    
+    if (self->stmt_cache[stmt_id] == NULL) {
+    	int error = sqlite3_prepare_v2(self->db, sql, -1, &self->stmt_cache[stmt_id], NULL);
+	
+	if (error) {
+	    self->stmt_cache[stmt_id] = NULL;
+	    return error;
+	}
+    }
+    
+    *stmt_handle = self->stmt_cache[stmt_id];
+    return SQLITE_OK;
+}
+
+/* This function resets a cached SQL statement so that it can be reused, if
+ * required. The statement remains owned by the cache.
+ */
+static void release_stmt(sqlite3_stmt **stmt_handle) {
+    
+    if (*stmt_handle) {
+    	
+	/* The error code returned by sqlite3_reset() is the error of the last
+	 * step, which has already been handled.
+	 */
+    	sqlite3_reset(*stmt_handle);
+	sqlite3_clear_bindings(*stmt_handle);
+	*stmt_handle = NULL;
+    }
+}
+
 /* This function begins a transaction. */
 static void begin_transaction(sqlite3 *db) {
     
@@ -134,21 +260,93 @@ static void rollback_transaction(sqlite3 *db) {
     }
 }
 
+/* This function must be called before a write operation is performed. In group
+ * commit mode, it opens the group transaction if required.
+ */
+static void begin_write(struct maildb_sqlite *self) {
+    
+    if (! self->group_flag) return;
+    
+    /* SQLite rolls back the transaction by itself on some errors. */
+    if (self->group_size && sqlite3_get_autocommit(self->db)) {
+    	kmod_log_msg(1, "The maildb group transaction has been rolled back (%d writes lost).\n",
+	    	     self->group_size);
+	self->group_size = 0;
+    }
+    
+    if (self->group_size == 0) begin_transaction(self->db);
+    self->group_size++;
+}
+
+/* This function opens the transaction of a write operation that must be
+ * atomic, even within the group transaction.
+ */
+static void begin_atomic_write(struct maildb_sqlite *self) {
+    
+    if (self->group_flag) {
+    	begin_write(self);
+	
+	/* Failure here should never happen. */
+	if (sqlite3_exec(self->db, "SAVEPOINT atomic_write;", NULL, NULL, NULL)) {
+	    kmo_fatalerror("%s.", sqlite3_errmsg(self->db));
+	}
+    }
+    
+    else {
+    	begin_transaction(self->db);
+    }
+}
+
+/* This function commits the write operation opened by begin_atomic_write() if
+ * 'error' is 0, otherwise it rolls it back.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int end_atomic_write(struct maildb_sqlite *self, int error) {
+    sqlite3 *db = self->db;
+    
+    if (! error && sqlite3_exec(db, self->group_flag ? "RELEASE atomic_write;" : "COMMIT;", NULL, NULL, NULL)) {
+	kmo_seterror(sqlite3_errmsg(db));
+	error = -1;
+    }
+    
+    /* Try to rollback if an error occurred. */
+    if (error) {
+    	
+	/* Keep the other writes of the group transaction, unless SQLite
+	 * already rolled it back.
+	 */
+    	if (self->group_flag) {
+	    if (! sqlite3_get_autocommit(db) &&
+	    	sqlite3_exec(db, "ROLLBACK TO atomic_write; RELEASE atomic_write;", NULL, NULL, NULL)) {
+		kmo_fatalerror("%s.", sqlite3_errmsg(db));
+	    }
+	}
+	
+	else {
+    	    rollback_transaction(db);
+	}
+    }
+    
+    return error;
+}
+
 /* This function gets the entry ID corresponding to the message having the
  * specified message ID. If the message is not found, 0 is assigned.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int get_entry_id_from_msg_id(sqlite3 *db, kstr *msg_id, int64_t *entry_id) {
+static int get_entry_id_from_msg_id(struct maildb_sqlite *self, kstr *msg_id, int64_t *entry_id) {
+    sqlite3 *db = self->db;
     int error = 0;
     sqlite3_stmt *stmt = NULL;
     
-    if (sqlite3_prepare(db, "SELECT entry_id FROM mail_msg_id WHERE msg_id = ?;", -1, &stmt, NULL)) goto ERR;
+    if (prepare_stmt(self, MAILDB_STMT_GET_ENTRY_ID_FROM_MSG_ID,
+                     "SELECT entry_id FROM mail_msg_id WHERE msg_id = ?;", &stmt)) goto ERR;
     if (write_string(stmt, 1, msg_id)) goto ERR;
     error = sqlite3_step(stmt);
     
     /* No such message ID. */
     if (error == SQLITE_DONE) {
-    	finalize_stmt(db, &stmt);
+    	release_stmt(&stmt);
 	*entry_id = 0;
 	return 0;
     }
@@ -160,12 +358,12 @@ static int get_entry_id_from_msg_id(sqlite3 *db, kstr *msg_id, int64_t *entry_id
 
     if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
 
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return -1;
 }
 
@@ -173,7 +371,8 @@ ERR:
  * specified hash and KSN. If the message is not found, 0 is assigned.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int get_entry_id_from_hash(sqlite3 *db, kstr *hash, kstr *ksn, int64_t *entry_id) {
+static int get_entry_id_from_hash(struct maildb_sqlite *self, kstr *hash, kstr *ksn, int64_t *entry_id) {
+    sqlite3 *db = self->db;
     int error = 0;
     sqlite3_stmt *stmt = NULL;
     
@@ -181,7 +380,8 @@ static int get_entry_id_from_hash(sqlite3 *db, kstr *hash, kstr *ksn, int64_t *e
     assert(ksn->slen == 0 || ksn->slen == 24);
     assert(hash->slen || ksn->slen);
     
-    if (sqlite3_prepare(db, "SELECT entry_id FROM mail_eval_res3 WHERE hash = ? AND ksn = ?;", -1, &stmt, NULL)) 
+    if (prepare_stmt(self, MAILDB_STMT_GET_ENTRY_ID_FROM_HASH,
+                     "SELECT entry_id FROM mail_eval_res3 WHERE hash = ? AND ksn = ?;", &stmt)) 
     	goto ERR;
 
     if (write_blob(stmt, 1, hash)) goto ERR;   
@@ -191,7 +391,7 @@ static int get_entry_id_from_hash(sqlite3 *db, kstr *hash, kstr *ksn, int64_t *e
     
     /* No such entry. */
     if (error == SQLITE_DONE) {
-    	finalize_stmt(db, &stmt);
+    	release_stmt(&stmt);
 	*entry_id = 0;
 	return 0;
     }
@@ -202,12 +402,12 @@ static int get_entry_id_from_hash(sqlite3 *db, kstr *hash, kstr *ksn, int64_t *e
     assert(*entry_id != 0);
     if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
 
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return -1;
 }
 
@@ -215,18 +415,20 @@ ERR:
  * if any.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int rm_mail_eval_res(sqlite3 *db, int64_t entry_id) {
+static int rm_mail_eval_res(struct maildb_sqlite *self, int64_t entry_id) {
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
 
-    if (sqlite3_prepare(db, "DELETE FROM mail_eval_res3 WHERE entry_id = ?;", -1, &stmt, NULL)) goto ERR;
+    if (prepare_stmt(self, MAILDB_STMT_RM_MAIL_EVAL_RES,
+                     "DELETE FROM mail_eval_res3 WHERE entry_id = ?;", &stmt)) goto ERR;
     if (sqlite3_bind_int64(stmt, 1, entry_id)) goto ERR;
     if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
 
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return -1;
 }
 
@@ -234,7 +436,8 @@ ERR:
  * if any.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int rm_mail_msg_id(sqlite3 *db, kstr *msg_id) {
+static int rm_mail_msg_id(struct maildb_sqlite *self, kstr *msg_id) {
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
     int ret = -1;
 
@@ -266,7 +469,8 @@ static int rm_mail_msg_id(sqlite3 *db, kstr *msg_id) {
          *   WHERE entry_id
          *    IN (...)
          */
-        if (sqlite3_prepare(db, "DELETE"
+        if (prepare_stmt(self, MAILDB_STMT_RM_UNREF_MAIL_EVAL_RES,
+                                "DELETE"
                                 " FROM mail_eval_res3"
                                 " WHERE entry_id"
                                 "  IN (SELECT entry_id"
@@ -278,23 +482,24 @@ static int rm_mail_msg_id(sqlite3 *db, kstr *msg_id) {
                                 "                     FROM mail_msg_id"
                                 "                     WHERE msg_id = ?))"
                                 "       WHERE nb_ref = 1);",
-                                -1, &stmt, NULL)) break;
+                                &stmt)) break;
         if (write_string(stmt, 1, msg_id)) break;
 
         if (sqlite3_step(stmt) != SQLITE_DONE) break;
 
-        finalize_stmt(db, &stmt);
+        release_stmt(&stmt);
         stmt = NULL;
 
         /* Remove the mail_msg_id entry */
-        if (sqlite3_prepare(db, "DELETE FROM mail_msg_id WHERE msg_id = ?;", -1, &stmt, NULL)) break;
+        if (prepare_stmt(self, MAILDB_STMT_RM_MAIL_MSG_ID,
+                         "DELETE FROM mail_msg_id WHERE msg_id = ?;", &stmt)) break;
         if (write_string(stmt, 1, msg_id)) break;
         if (sqlite3_step(stmt) != SQLITE_DONE) break;
 
         ret = 0;
     } while (0);
 
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
 
     kmo_seterror(sqlite3_errmsg(db));
     return ret;
@@ -303,28 +508,31 @@ static int rm_mail_msg_id(sqlite3 *db, kstr *msg_id) {
 /* This function creates a mail_msg_id entry.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int create_mail_msg_id(sqlite3 *db, kstr *msg_id, int64_t entry_id) {
+static int create_mail_msg_id(struct maildb_sqlite *self, kstr *msg_id, int64_t entry_id) {
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
     assert(msg_id->slen != 0);
     assert(entry_id != 0);
 
-    if (sqlite3_prepare(db, "INSERT INTO mail_msg_id (msg_id, entry_id) VALUES (?, ?);", -1, &stmt, NULL)) goto ERR;
+    if (prepare_stmt(self, MAILDB_STMT_CREATE_MAIL_MSG_ID,
+                     "INSERT INTO mail_msg_id (msg_id, entry_id) VALUES (?, ?);", &stmt)) goto ERR;
     if (write_string(stmt, 1, msg_id)) goto ERR;
     if (sqlite3_bind_int64(stmt, 2, entry_id)) goto ERR;
     if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return -1;
 }
 
 /* This function creates a mail_eval_res entry.
  * This function sets the KMO error string. It returns -1 on failure.
  */
-static int create_mail_eval_res(sqlite3 *db, maildb_mail_info *mail_info, int64_t *entry_id) {
+static int create_mail_eval_res(struct maildb_sqlite *self, maildb_mail_info *mail_info, int64_t *entry_id) {
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
     kstr insert_str;
     int i;
@@ -351,7 +559,8 @@ static int create_mail_eval_res(sqlite3 *db, maildb_mail_info *mail_info, int64_
     }
 
     kstr_append_cstr(&insert_str, "?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);");
-    if (sqlite3_prepare(db, insert_str.data, -1, &stmt, NULL)) goto ERR;
+    if (prepare_stmt(self, *entry_id ? MAILDB_STMT_CREATE_MAIL_EVAL_RES_ID : MAILDB_STMT_CREATE_MAIL_EVAL_RES,
+    	    	     insert_str.data, &stmt)) goto ERR;
     
     i = 1;
     
@@ -388,7 +597,7 @@ static int create_mail_eval_res(sqlite3 *db, maildb_mail_info *mail_info, int64_
     if (sqlite3_bind_int(stmt, i++, mail_info->kpg_port)) goto ERR;
     
     if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     
     /* Obtain/validate the entry ID. */
     if (*entry_id == 0) {
@@ -404,23 +613,127 @@ static int create_mail_eval_res(sqlite3 *db, maildb_mail_info *mail_info, int64_
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     kstr_free(&insert_str);
     return -1;
 }
 
+/* Columns of mail_eval_res3 read by read_mail_info(), in order, with the
+ * MAILDB_FIELD_* group they belong to.
+ */
+static struct {
+    const char *name;
+    uint32_t field;
+} mail_info_column_array[] = {
+    { "hash",	    	    	MAILDB_FIELD_HASH },
+    { "ksn",	    	    	MAILDB_FIELD_HASH },
+    { "status",     	    	MAILDB_FIELD_BASE },
+    { "display_pref",	    	MAILDB_FIELD_BASE },
+    { "sig_msg",    	    	MAILDB_FIELD_SIG_MSG },
+    { "mid",	    	    	MAILDB_FIELD_BASE },
+    { "original_packaging", 	MAILDB_FIELD_BASE },
+    { "mua",	    	    	MAILDB_FIELD_BASE },
+    { "field_status",	    	MAILDB_FIELD_BASE },
+    { "att_plugin_nbr",     	MAILDB_FIELD_BASE },
+    { "attachment_nbr",     	MAILDB_FIELD_BASE },
+    { "attachment_status",  	MAILDB_FIELD_ATTACHMENT },
+    { "sym_key",    	    	MAILDB_FIELD_SYM_KEY },
+    { "encryption_status",  	MAILDB_FIELD_BASE },
+    { "decryption_error_msg",	MAILDB_FIELD_MSG },
+    { "pod_status", 	    	MAILDB_FIELD_BASE },
+    { "pod_msg",    	    	MAILDB_FIELD_MSG },
+    { "otut_status",	    	MAILDB_FIELD_BASE },
+    { "otut_string",	    	MAILDB_FIELD_OTUT },
+    { "otut_msg",   	    	MAILDB_FIELD_MSG },
+    { "kpg_addr",   	    	MAILDB_FIELD_KPG },
+    { "kpg_port",   	    	MAILDB_FIELD_BASE }
+};
+
+#define MAIL_INFO_NB_COLUMN (sizeof(mail_info_column_array) / sizeof(mail_info_column_array[0]))
+
+/* This function appends the columns read by read_mail_info() to the SQL text
+ * specified. The columns that do not belong to the MAILDB_FIELD_* groups of
+ * 'field_mask' are replaced by NULL, so that the position of the columns does
+ * not depend on the mask while SQLite does not fetch their content.
+ */
+static void append_mail_info_columns(kstr *sql, uint32_t field_mask) {
+    int i;
+    
+    for (i = 0; i < (int) MAIL_INFO_NB_COLUMN; i++) {
+    	if (i) kstr_append_cstr(sql, ", ");
+	
+	if (mail_info_column_array[i].field & field_mask) {
+	    kstr_append_cstr(sql, "mail_eval_res3.");
+	    kstr_append_cstr(sql, mail_info_column_array[i].name);
+	}
+	
+	else {
+	    kstr_append_cstr(sql, "NULL");
+	}
+    }
+}
+
+/* This function reads the columns of the MAILDB_FIELD_* groups of 'field_mask'
+ * of the specified SQL statement, starting at the column specified. The column
+ * offsets match mail_info_column_array. The other fields of the mail info are
+ * left intact. It returns the column following the last column read.
+ */
+static int read_mail_info(sqlite3_stmt *stmt, maildb_mail_info *mail_info, int col, uint32_t field_mask) {
+    int i = col;
+    
+    if (field_mask & MAILDB_FIELD_HASH) {
+	read_blob(stmt, &mail_info->hash, i);
+	read_blob(stmt, &mail_info->ksn, i + 1);
+    }
+    
+    if (field_mask & MAILDB_FIELD_BASE) {
+	mail_info->status = sqlite3_column_int(stmt, i + 2);
+	mail_info->display_pref = sqlite3_column_int(stmt, i + 3);
+	mail_info->mid = sqlite3_column_int64(stmt, i + 5);
+	mail_info->original_packaging = sqlite3_column_int(stmt, i + 6);
+	mail_info->mua = sqlite3_column_int(stmt, i + 7);
+	mail_info->field_status = sqlite3_column_int(stmt, i + 8);
+	mail_info->att_plugin_nbr = sqlite3_column_int(stmt, i + 9);
+	mail_info->attachment_nbr = sqlite3_column_int(stmt, i + 10);
+	mail_info->encryption_status = sqlite3_column_int(stmt, i + 13);
+	mail_info->pod_status = sqlite3_column_int(stmt, i + 15);
+	mail_info->otut_status = sqlite3_column_int(stmt, i + 17);
+	mail_info->kpg_port = sqlite3_column_int(stmt, i + 21);
+    }
+    
+    if (field_mask & MAILDB_FIELD_SIG_MSG) read_string(stmt, &mail_info->sig_msg, i + 4);
+    if (field_mask & MAILDB_FIELD_ATTACHMENT) read_blob(stmt, &mail_info->attachment_status, i + 11);
+    if (field_mask & MAILDB_FIELD_SYM_KEY) read_blob(stmt, &mail_info->sym_key, i + 12);
+    
+    if (field_mask & MAILDB_FIELD_MSG) {
+	read_string(stmt, &mail_info->decryption_error_msg, i + 14);
+	read_string(stmt, &mail_info->pod_msg, i + 16);
+	read_string(stmt, &mail_info->otut_msg, i + 19);
+    }
+    
+    if (field_mask & MAILDB_FIELD_OTUT) read_blob(stmt, &mail_info->otut_string, i + 18);
+    if (field_mask & MAILDB_FIELD_KPG) read_string(stmt, &mail_info->kpg_addr, i + 20);
+    
+    mail_info->field_mask |= field_mask;
+    
+    return i + MAIL_INFO_NB_COLUMN;
+}
+
 /* This method sets the specified mail information in the database.
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int maildb_sqlite_set_mail_info(maildb *mdb, maildb_mail_info *mail_info) {
     int error = 0;
-    sqlite3 *db = (sqlite3 *) mdb->db;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
     int64_t entry_id = 0;
     
     assert(mail_info->hash.slen == 0 || mail_info->hash.slen == 20); //FIXME: SHA1 is obsolete, use SHA256
     assert(mail_info->ksn.slen == 0 || mail_info->ksn.slen == 24);
     
-    begin_transaction(db);
+    /* A partially read mail info would erase the fields not read. */
+    assert(mail_info->field_mask == MAILDB_FIELD_ALL);
+    
+    begin_atomic_write(self);
     
     /* Try. */
     do {
@@ -457,12 +770,12 @@ static int maildb_sqlite_set_mail_info(maildb *mdb, maildb_mail_info *mail_info)
                  * entry if it exist and is referred by only one mail_msg_id
                  * entry.
                  */
-		error = rm_mail_msg_id(db, &mail_info->msg_id);
+		error = rm_mail_msg_id(self, &mail_info->msg_id);
 		if (error) break;
             }
 
             /* Get the entry ID corresponding to the specified hash, if any. */
-            error = get_entry_id_from_hash(db, &mail_info->hash, &mail_info->ksn, &entry_id);
+            error = get_entry_id_from_hash(self, &mail_info->hash, &mail_info->ksn, &entry_id);
             if (error) break;
 
 	    /* The mail_eval_res entry has been found in the DB. */
@@ -470,11 +783,11 @@ static int maildb_sqlite_set_mail_info(maildb *mdb, maildb_mail_info *mail_info)
 	    	assert(entry_id != -1);
 
 		/* Delete the mail_eval_res entry. */
-		rm_mail_eval_res(db, entry_id);
+		rm_mail_eval_res(self, entry_id);
 	    }
 
 	    /* Create mail_eval_res entry. */
-	    error = create_mail_eval_res(db, mail_info, &entry_id);
+	    error = create_mail_eval_res(self, mail_info, &entry_id);
 	    if (error) break;
 
     	    /* Set the entry_id field of the mail_info object. */
@@ -483,7 +796,7 @@ static int maildb_sqlite_set_mail_info(maildb *mdb, maildb_mail_info *mail_info)
 	    /* Create mail_msg_id entry. If we are sending the message encrypted,
              * we dont know the msgid the mua will give to the email. */
 	    if (mail_info->msg_id.slen != 0 && (mail_info->status == 0 || mail_info->status == 1)) {
-	    	error = create_mail_msg_id(db, &mail_info->msg_id, entry_id);
+	    	error = create_mail_msg_id(self, &mail_info->msg_id, entry_id);
     	    	if (error) break;
 	    }
 	}
@@ -501,30 +814,106 @@ static int maildb_sqlite_set_mail_info(maildb *mdb, maildb_mail_info *mail_info)
 	    assert(mail_info->ksn.slen == 0);
     	    
 	    /* Delete mail_msg_id entry, if any. */
-	    error = rm_mail_msg_id(db, &mail_info->msg_id);
+	    error = rm_mail_msg_id(self, &mail_info->msg_id);
 	    if (error) break;
 
 	    /* Create mail_msg_id entry. */
-	    error = create_mail_msg_id(db, &mail_info->msg_id, -1);
+	    error = create_mail_msg_id(self, &mail_info->msg_id, -1);
 	    if (error) break;
 	}
 
 	else assert(0);
 
-    	if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL)) {
-	    kmo_seterror(sqlite3_errmsg(db));
-	    error = -1;
-	    break;
+    } while (0);
+    
+    return end_atomic_write(self, error);
+}
+
+static int maildb_sqlite_commit_group(maildb *mdb);
+
+/* This function marks the message IDs specified as unsigned mails. The message
+ * IDs are written MAILDB_BULK_WRITE_SIZE at a time, each group in a single
+ * transaction. In group commit mode, the group transaction is committed when
+ * it grows beyond MAILDB_BULK_WRITE_SIZE writes, so that a large batch does
+ * not lock the database until the end.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int maildb_sqlite_set_unsigned_mail(maildb *mdb, karray *msg_id_array) {
+    int error = 0;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    int start, i;
+    
+    for (start = 0; start < msg_id_array->size; start += MAILDB_BULK_WRITE_SIZE) {
+    	int end = MIN(start + MAILDB_BULK_WRITE_SIZE, msg_id_array->size);
+	
+	begin_atomic_write(self);
+	
+	for (i = start; i < end; i++) {
+	    kstr *msg_id = (kstr *) msg_id_array->data[i];
+	    assert(msg_id->slen != 0);
+	    
+	    /* Same as maildb_sqlite_set_mail_info() with status 3. */
+	    error = rm_mail_msg_id(self, msg_id);
+	    if (error) break;
+	    
+	    error = create_mail_msg_id(self, msg_id, -1);
+	    if (error) break;
+	}
+	
+	if (end_atomic_write(self, error)) return -1;
+	
+	if (self->group_flag) {
+	    
+	    /* begin_write() counted a single write. */
+	    self->group_size += end - start - 1;
+	    
+	    if (self->group_size >= MAILDB_BULK_WRITE_SIZE && maildb_sqlite_commit_group(mdb)) return -1;
 	}
+    }
+    
+    return 0;
+}
 
-    } while (0);
+/* This function reads the MAILDB_FIELD_* groups of 'field_mask' of the
+ * mail_eval_res entry having the entry ID specified, with the cached statement
+ * specified. The statement is prepared again if it was prepared for another
+ * mask.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int read_mail_info_from_entry_id(struct maildb_sqlite *self, int stmt_id, uint32_t *stmt_mask,
+    	    	    	    	    	maildb_mail_info *mail_info, int64_t entry_id, uint32_t field_mask) {
+    sqlite3 *db = self->db;
+    sqlite3_stmt *stmt = NULL;
+    kstr sql;
     
-    /* Try to rollback if an error occurred. */
-    if (error) {
-    	rollback_transaction(db);
+    kstr_init(&sql);
+    
+    if (*stmt_mask != field_mask) finalize_stmt(db, &self->stmt_cache[stmt_id]);
+    
+    if (self->stmt_cache[stmt_id] == NULL) {
+    	kstr_assign_cstr(&sql, "SELECT ");
+	append_mail_info_columns(&sql, field_mask);
+	kstr_append_cstr(&sql, " FROM mail_eval_res3 WHERE mail_eval_res3.entry_id = ?;");
+	*stmt_mask = field_mask;
     }
     
-    return error;
+    if (prepare_stmt(self, stmt_id, sql.data, &stmt)) goto ERR;
+    if (sqlite3_bind_int64(stmt, 1, entry_id)) goto ERR;
+    if (sqlite3_step(stmt) != SQLITE_ROW) goto ERR;
+
+    read_mail_info(stmt, mail_info, 0, field_mask);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
+
+    release_stmt(&stmt);
+    kstr_free(&sql);
+    return 0;
+    
+ERR:
+    kmo_seterror(sqlite3_errmsg(db));
+    release_stmt(&stmt);
+    kstr_free(&sql);
+    return -1;
 }
 
 /* This function returns the mail info having the entry ID specified.
@@ -532,9 +921,8 @@ static int maildb_sqlite_set_mail_info(maildb *mdb, maildb_mail_info *mail_info)
  * -2 if not found.
  */
 static int maildb_sqlite_get_mail_info_from_entry_id(maildb *mdb, maildb_mail_info *mail_info, int64_t entry_id) {
-    sqlite3 *db = (sqlite3 *) mdb->db;
-    sqlite3_stmt *stmt = NULL;
-    int i = 0;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    uint32_t stmt_mask = MAILDB_FIELD_ALL;
 
     /* Clear the mail info. */
     maildb_clear_mail_info(mail_info);
@@ -553,59 +941,33 @@ static int maildb_sqlite_get_mail_info_from_entry_id(maildb *mdb, maildb_mail_in
     assert(entry_id > 0);
     
     /* It's a Kryptiva mail. Read the mail_eval_res info. */
-    if (sqlite3_prepare (db,
-	    	    	 "SELECT hash, ksn, status, display_pref, sig_msg, mid, original_packaging, mua, field_status, "
-	    	    	 "att_plugin_nbr, attachment_nbr, attachment_status, sym_key, encryption_status, "
-			 "decryption_error_msg, pod_status, pod_msg, otut_status, otut_string, "
-			 "otut_msg, kpg_addr, kpg_port "
-			 "FROM mail_eval_res3 WHERE mail_eval_res3.entry_id = ?;",
-			 -1, &stmt, NULL)) goto ERR;
-
-    if (sqlite3_bind_int64(stmt, 1, entry_id)) goto ERR;
-    if (sqlite3_step(stmt) != SQLITE_ROW) goto ERR;
-
-    i = 0;
-    read_blob(stmt, &mail_info->hash, i++);
-    read_blob(stmt, &mail_info->ksn, i++);
-    mail_info->status = sqlite3_column_int(stmt, i++);
-    
-    mail_info->display_pref = sqlite3_column_int(stmt, i++);
-    read_string(stmt, &mail_info->sig_msg, i++);
-    mail_info->mid = sqlite3_column_int64(stmt, i++);
-    mail_info->original_packaging = sqlite3_column_int(stmt, i++);
-    mail_info->mua = sqlite3_column_int(stmt, i++);
-
-    mail_info->field_status = sqlite3_column_int(stmt, i++);
-    mail_info->att_plugin_nbr = sqlite3_column_int(stmt, i++);
-    mail_info->attachment_nbr = sqlite3_column_int(stmt, i++);
-    read_blob(stmt, &mail_info->attachment_status, i++);
-
-    read_blob(stmt, &mail_info->sym_key, i++);
-
-    mail_info->encryption_status = sqlite3_column_int(stmt, i++);
-    read_string(stmt, &mail_info->decryption_error_msg, i++);
-    mail_info->pod_status = sqlite3_column_int(stmt, i++);
-    read_string(stmt, &mail_info->pod_msg, i++);
-
-    mail_info->otut_status = sqlite3_column_int(stmt, i++);
-    read_blob(stmt, &mail_info->otut_string, i++);
-    read_string(stmt, &mail_info->otut_msg, i++);
-    read_string(stmt, &mail_info->kpg_addr, i++);
-    mail_info->kpg_port = sqlite3_column_int(stmt, i++);
-
-    if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
-
-    finalize_stmt(db, &stmt);
+    if (read_mail_info_from_entry_id(self, MAILDB_STMT_GET_MAIL_INFO, &stmt_mask, mail_info, entry_id,
+    	    	    	    	     MAILDB_FIELD_ALL)) return -1;
     
     /* Set the entry_id field of the mail_info object. */
     mail_info->entry_id = entry_id;
     
     return 0;
+}
+
+/* This function reads the fields of the mail info specified that have not been
+ * read yet. See maildb_load_mail_info().
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int maildb_sqlite_load_mail_info(maildb *mdb, maildb_mail_info *mail_info, uint32_t field_mask) {
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
     
-ERR:
-    kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
-    return -1;
+    field_mask &= ~mail_info->field_mask;
+    if (field_mask == 0) return 0;
+    
+    /* There is no mail_eval_res entry: the fields are empty. */
+    if (mail_info->entry_id <= 0) {
+    	mail_info->field_mask |= field_mask;
+	return 0;
+    }
+    
+    return read_mail_info_from_entry_id(self, MAILDB_STMT_LOAD_MAIL_INFO, &self->load_field_mask, mail_info,
+    	    	    	    	    	mail_info->entry_id, field_mask);
 }
 
 /* This function returns the mail info having the message ID specified.
@@ -614,10 +976,10 @@ ERR:
  */
 static int maildb_sqlite_get_mail_info_from_msg_id(maildb *mdb, maildb_mail_info *mail_info, kstr *msg_id) {
     int error = 0;
-    sqlite3 *db = (sqlite3 *) mdb->db;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
     int64_t entry_id;
 
-    error = get_entry_id_from_msg_id(db, msg_id, &entry_id);
+    error = get_entry_id_from_msg_id(self, msg_id, &entry_id);
     if (error) return -1;
     
     return maildb_sqlite_get_mail_info_from_entry_id(mdb, mail_info, entry_id);
@@ -629,10 +991,10 @@ static int maildb_sqlite_get_mail_info_from_msg_id(maildb *mdb, maildb_mail_info
  */
 static int maildb_sqlite_get_mail_info_from_hash(maildb *mdb, maildb_mail_info *mail_info, kstr *hash, kstr *ksn) {
     int error = 0;
-    sqlite3 *db = (sqlite3 *) mdb->db;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
     int64_t entry_id;
     
-    error = get_entry_id_from_hash(db, hash, ksn, &entry_id);
+    error = get_entry_id_from_hash(self, hash, ksn, &entry_id);
     if (error) return -1;
     
     /* If we failed to find the mail, and a hash and a KSN were provided, we redo
@@ -641,7 +1003,7 @@ static int maildb_sqlite_get_mail_info_from_hash(maildb *mdb, maildb_mail_info *
     if (entry_id == 0 && hash->slen > 0 && ksn->slen > 0) {
     	kstr empty_hash;
 	kstr_init(&empty_hash);
-    	error = get_entry_id_from_hash(db, &empty_hash, ksn, &entry_id);
+    	error = get_entry_id_from_hash(self, &empty_hash, ksn, &entry_id);
 	kstr_free(&empty_hash);
     	if (error) return -1;
     }
@@ -649,58 +1011,180 @@ static int maildb_sqlite_get_mail_info_from_hash(maildb *mdb, maildb_mail_info *
     return maildb_sqlite_get_mail_info_from_entry_id(mdb, mail_info, entry_id);
 }
 
+/* This function looks up the mail info and the sender info of the message IDs
+ * specified, MAILDB_BATCH_SIZE message IDs per query. See
+ * maildb_get_mail_info_batch().
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int maildb_sqlite_get_mail_info_batch(maildb *mdb, karray *msg_id_array, karray *mail_info_array,
+    	    	    	    	    	     karray *sender_info_array, uint32_t field_mask) {
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
+    sqlite3_stmt *stmt = NULL;
+    int start, i, j;
+    kstr sql, row_msg_id;
+    
+    assert(msg_id_array->size == mail_info_array->size);
+    assert(msg_id_array->size == sender_info_array->size);
+    
+    kstr_init(&sql);
+    kstr_init(&row_msg_id);
+    
+    for (i = 0; i < msg_id_array->size; i++) {
+    	maildb_mail_info *mail_info = (maildb_mail_info *) mail_info_array->data[i];
+	maildb_sender_info *sender_info = (maildb_sender_info *) sender_info_array->data[i];
+	maildb_clear_mail_info(mail_info);
+	mail_info->entry_id = 0;
+	mail_info->status = 0;
+	maildb_clear_sender_info(sender_info);
+	sender_info->mid = 0;
+    }
+    
+    field_mask |= MAILDB_FIELD_BASE;
+    
+    /* Build the query if it has not been prepared yet for this mask. The
+     * sender table is joined so that the sender info is obtained with the same
+     * query.
+     */
+    if (self->batch_field_mask != field_mask) finalize_stmt(db, &self->stmt_cache[MAILDB_STMT_GET_MAIL_INFO_BATCH]);
+    
+    if (self->stmt_cache[MAILDB_STMT_GET_MAIL_INFO_BATCH] == NULL) {
+	kstr_assign_cstr(&sql, "SELECT mail_msg_id.msg_id, mail_msg_id.entry_id, mail_eval_res3.entry_id, ");
+	append_mail_info_columns(&sql, field_mask);
+	kstr_append_cstr(&sql, ", sender.mid, sender.name FROM mail_msg_id "
+			       "LEFT JOIN mail_eval_res3 ON mail_eval_res3.entry_id = mail_msg_id.entry_id "
+			       "LEFT JOIN sender ON sender.mid = mail_eval_res3.mid "
+			       "WHERE mail_msg_id.msg_id IN (?");
+	
+	for (i = 1; i < MAILDB_BATCH_SIZE; i++) kstr_append_cstr(&sql, ", ?");
+	kstr_append_cstr(&sql, ");");
+	self->batch_field_mask = field_mask;
+    }
+    
+    for (start = 0; start < msg_id_array->size; start += MAILDB_BATCH_SIZE) {
+    	int end = MIN(start + MAILDB_BATCH_SIZE, msg_id_array->size);
+	
+	if (prepare_stmt(self, MAILDB_STMT_GET_MAIL_INFO_BATCH, sql.data, &stmt)) goto ERR;
+	
+	/* Pad the last batch with the last message ID. */
+	for (i = 0; i < MAILDB_BATCH_SIZE; i++) {
+	    kstr *msg_id = (kstr *) msg_id_array->data[MIN(start + i, end - 1)];
+	    if (write_string(stmt, i + 1, msg_id)) goto ERR;
+	}
+	
+	while (1) {
+	    int64_t entry_id;
+	    int error = sqlite3_step(stmt);
+	    if (error == SQLITE_DONE) break;
+	    if (error != SQLITE_ROW) goto ERR;
+	    
+	    read_string(stmt, &row_msg_id, 0);
+	    entry_id = sqlite3_column_int64(stmt, 1);
+	    
+	    /* The mail_eval_res entry is missing. Treat the message ID as
+	     * unknown.
+	     */
+	    if (entry_id > 0 && sqlite3_column_type(stmt, 2) == SQLITE_NULL) continue;
+	    
+	    /* Store the result at every position of the message ID. */
+	    for (i = start; i < end; i++) {
+	    	maildb_mail_info *mail_info = (maildb_mail_info *) mail_info_array->data[i];
+		maildb_sender_info *sender_info = (maildb_sender_info *) sender_info_array->data[i];
+		
+		if (! kstr_equal_kstr((kstr *) msg_id_array->data[i], &row_msg_id)) continue;
+		
+		mail_info->entry_id = entry_id;
+		
+		/* Not a Kryptiva mail. */
+		if (entry_id == -1) {
+		    mail_info->status = 3;
+		    continue;
+		}
+		
+		mail_info->field_mask = 0;
+		j = read_mail_info(stmt, mail_info, 3, field_mask);
+		
+		if (sqlite3_column_type(stmt, j) != SQLITE_NULL) {
+		    sender_info->mid = sqlite3_column_int64(stmt, j);
+		    read_string(stmt, &sender_info->name, j + 1);
+		}
+	    }
+	}
+	
+	release_stmt(&stmt);
+    }
+    
+    kstr_free(&sql);
+    kstr_free(&row_msg_id);
+    return 0;
+    
+ERR:
+    kmo_seterror(sqlite3_errmsg(db));
+    release_stmt(&stmt);
+    kstr_free(&sql);
+    kstr_free(&row_msg_id);
+    return -1;
+}
+
 /* This function deletes the sender info having the member ID specified, if any. */
 static int maildb_sqlite_rm_sender_info(maildb *mdb, int64_t mid) {
-    sqlite3 *db = (sqlite3 *) mdb->db;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
 
-    if (sqlite3_prepare(db, "DELETE FROM sender WHERE mid = ?;", -1, &stmt, NULL)) goto ERR;
+    begin_write(self);
+    if (prepare_stmt(self, MAILDB_STMT_RM_SENDER_INFO, "DELETE FROM sender WHERE mid = ?;", &stmt)) goto ERR;
     if (sqlite3_bind_int64(stmt, 1, mid)) goto ERR;
     if (sqlite3_step (stmt) != SQLITE_DONE) goto ERR;
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return -1;
 }
 
 /* This function sets the specified sender info in the database. */
 static int maildb_sqlite_set_sender_info (maildb *mdb, maildb_sender_info *sender_info) {
-    sqlite3 *db = (sqlite3 *) mdb->db;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
     int i = 1;
 
+    begin_write(self);
     if (maildb_sqlite_rm_sender_info(mdb, sender_info->mid)) goto ERR;
-    if (sqlite3_prepare(db, "INSERT INTO sender (mid, name) VALUES (?,?);", -1, &stmt, NULL)) goto ERR;
+    if (prepare_stmt(self, MAILDB_STMT_SET_SENDER_INFO,
+                     "INSERT INTO sender (mid, name) VALUES (?,?);", &stmt)) goto ERR;
     if (sqlite3_bind_int64(stmt, i++, sender_info->mid)) goto ERR;
     if (write_string(stmt, i++, &sender_info->name)) goto ERR;
     if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
     
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return -1;
 }
 
 /* This function returns the sender info having the member ID specified. */
 static int maildb_sqlite_get_sender_info(maildb *mdb, maildb_sender_info *sender_info, int64_t mid) {
-    sqlite3 *db = (sqlite3 *)mdb->db;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
     int i;
     int error = 0;
 
-    if (sqlite3_prepare(db, "SELECT mid, name FROM sender WHERE mid = ?;", -1, &stmt, NULL)) goto ERR;
+    if (prepare_stmt(self, MAILDB_STMT_GET_SENDER_INFO,
+                     "SELECT mid, name FROM sender WHERE mid = ?;", &stmt)) goto ERR;
     if (sqlite3_bind_int64(stmt, 1, mid)) goto ERR;
     error = sqlite3_step(stmt);
     
     /* No such sender info. */
     if (error == SQLITE_DONE) {
-    	finalize_stmt(db, &stmt);
+    	release_stmt(&stmt);
         return -2;
     }
     
@@ -713,30 +1197,123 @@ static int maildb_sqlite_get_sender_info(maildb *mdb, maildb_sender_info *sender
 
     if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
     
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
+    return -1;
+}
+
+/* This function deletes the signature key info of the member ID specified, if
+ * any.
+ */
+static int maildb_sqlite_rm_sig_key_info(maildb *mdb, int64_t mid) {
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
+    sqlite3_stmt *stmt = NULL;
+
+    begin_write(self);
+    if (prepare_stmt(self, MAILDB_STMT_RM_SIG_KEY_INFO,
+                     "DELETE FROM sig_key WHERE mid = ?;", &stmt)) goto ERR;
+    if (sqlite3_bind_int64(stmt, 1, mid)) goto ERR;
+    if (sqlite3_step (stmt) != SQLITE_DONE) goto ERR;
+    release_stmt(&stmt);
+    return 0;
+    
+ERR:
+    kmo_seterror(sqlite3_errmsg(db));
+    release_stmt(&stmt);
+    return -1;
+}
+
+/* This function sets the specified signature key info in the database. */
+static int maildb_sqlite_set_sig_key_info(maildb *mdb, maildb_sig_key_info *sig_key_info) {
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
+    sqlite3_stmt *stmt = NULL;
+    int i = 1;
+
+    begin_write(self);
+    if (maildb_sqlite_rm_sig_key_info(mdb, sig_key_info->mid)) goto ERR;
+    if (prepare_stmt(self, MAILDB_STMT_SET_SIG_KEY_INFO,
+                     "INSERT INTO sig_key (mid, tm_key_data, key_data, subscriber_name, fetch_time) "
+    	    	    	    "VALUES (?,?,?,?,?);", &stmt)) goto ERR;
+    if (sqlite3_bind_int64(stmt, i++, sig_key_info->mid)) goto ERR;
+    if (write_string(stmt, i++, &sig_key_info->tm_key_data)) goto ERR;
+    if (write_string(stmt, i++, &sig_key_info->key_data)) goto ERR;
+    if (write_string(stmt, i++, &sig_key_info->subscriber_name)) goto ERR;
+    if (sqlite3_bind_int64(stmt, i++, sig_key_info->fetch_time)) goto ERR;
+    if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
+    
+    release_stmt(&stmt);
+    return 0;
+    
+ERR:
+    kmo_seterror(sqlite3_errmsg(db));
+    release_stmt(&stmt);
+    return -1;
+}
+
+/* This function returns the signature key info of the member ID specified. */
+static int maildb_sqlite_get_sig_key_info(maildb *mdb, maildb_sig_key_info *sig_key_info, int64_t mid) {
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
+    sqlite3_stmt *stmt = NULL;
+    int i;
+    int error = 0;
+
+    if (prepare_stmt(self, MAILDB_STMT_GET_SIG_KEY_INFO,
+                     "SELECT mid, tm_key_data, key_data, subscriber_name, fetch_time "
+    	    	    	    "FROM sig_key WHERE mid = ?;", &stmt)) goto ERR;
+    if (sqlite3_bind_int64(stmt, 1, mid)) goto ERR;
+    error = sqlite3_step(stmt);
+    
+    /* No such signature key info. */
+    if (error == SQLITE_DONE) {
+    	release_stmt(&stmt);
+        return -2;
+    }
+    
+    else if (error != SQLITE_ROW) goto ERR;
+    
+    /* Read the signature key info. */
+    i = 0;
+    sig_key_info->mid = sqlite3_column_int64(stmt, i++);
+    read_string(stmt, &sig_key_info->tm_key_data, i++);
+    read_string(stmt, &sig_key_info->key_data, i++);
+    read_string(stmt, &sig_key_info->subscriber_name, i++);
+    sig_key_info->fetch_time = sqlite3_column_int64(stmt, i++);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
+    
+    release_stmt(&stmt);
+    return 0;
+    
+ERR:
+    kmo_seterror(sqlite3_errmsg(db));
+    release_stmt(&stmt);
     return -1;
 }
 
 /* This function deletes the password associated to the email specified, if any. */
 static int maildb_sqlite_rm_pwd(maildb *mdb, kstr *email) {
-    sqlite3 *db = (sqlite3 *) mdb->db;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
     
-    if (sqlite3_prepare(db, "DELETE FROM pwd WHERE email = ?;", -1, &stmt, NULL)) goto ERR;
+    begin_write(self);
+    if (prepare_stmt(self, MAILDB_STMT_RM_PWD, "DELETE FROM pwd WHERE email = ?;", &stmt)) goto ERR;
     if (write_string(stmt, 1, email)) goto ERR;
     if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
     
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return -1;
 }
 
@@ -747,40 +1324,45 @@ ERR:
  * Both cases shouldn't happen at the same time, normally.
  */
 static int maildb_sqlite_set_pwd(maildb *mdb, kstr *email, kstr *pwd) {
-    sqlite3 *db = (sqlite3 *) mdb->db;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
     int i = 1;
 
+    begin_write(self);
     if (maildb_sqlite_rm_pwd(mdb, email)) goto ERR;
 
-    if (sqlite3_prepare(db, "INSERT INTO pwd (email, pwd) VALUES (?,?);", -1, &stmt, NULL)) goto ERR;
+    if (prepare_stmt(self, MAILDB_STMT_SET_PWD,
+                     "INSERT INTO pwd (email, pwd) VALUES (?,?);", &stmt)) goto ERR;
     if (write_string(stmt, i++, email)) goto ERR;
     if (write_string(stmt, i++, pwd)) goto ERR;
     if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
     
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return -1;
 }
 
 /* This function returns the password associated to the email specified. */
 static int maildb_sqlite_get_pwd(maildb *mdb, kstr *email, kstr *pwd) {
-    sqlite3 *db = (sqlite3 *) mdb->db;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
     int i;
     int error = 0;
     
-    if (sqlite3_prepare(db, "SELECT pwd FROM pwd WHERE email = ? COLLATE NOCASE;", -1, &stmt, NULL)) goto ERR;
+    if (prepare_stmt(self, MAILDB_STMT_GET_PWD,
+                     "SELECT pwd FROM pwd WHERE email = ? COLLATE NOCASE;", &stmt)) goto ERR;
     if (write_string(stmt, 1, email)) goto ERR;
     error = sqlite3_step(stmt);
     
     /* No such password. */
     if (error == SQLITE_DONE) {
-    	finalize_stmt(db, &stmt);
+    	release_stmt(&stmt);
         return -2;
     }
     
@@ -792,12 +1374,12 @@ static int maildb_sqlite_get_pwd(maildb *mdb, kstr *email, kstr *pwd) {
     
     if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
     
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return -1;
 }
 
@@ -806,14 +1388,15 @@ ERR:
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int maildb_sqlite_get_all_pwd(maildb *mdb, karray *addr_array, karray *pwd_array) {
-    sqlite3 *db = (sqlite3 *) mdb->db;
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
     sqlite3_stmt *stmt = NULL;
     int error = 0;
     
     addr_array->size = 0;
     pwd_array->size = 0;
     
-    if (sqlite3_prepare(db, "SELECT email, pwd FROM pwd;", -1, &stmt, NULL)) goto ERR;
+    if (prepare_stmt(self, MAILDB_STMT_GET_ALL_PWD, "SELECT email, pwd FROM pwd;", &stmt)) goto ERR;
     
     while (1) {
     	error = sqlite3_step(stmt);
@@ -829,19 +1412,19 @@ static int maildb_sqlite_get_all_pwd(maildb *mdb, karray *addr_array, karray *pw
     	read_string(stmt, str, 1);
     }
     
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return 0;
     
 ERR:
     kmo_seterror(sqlite3_errmsg(db));
-    finalize_stmt(db, &stmt);
+    release_stmt(&stmt);
     return -1;
 }
 
 /* This function verifies the integrity of the database. */
 int maildb_integrity_check(maildb *mdb) {
     int error = 0;
-    sqlite3 *db = (sqlite3 *) mdb->db;
+    sqlite3 *db = ((struct maildb_sqlite *) mdb->db)->db;
     sqlite3_stmt *stmt = NULL;
     kstr val;
     
@@ -895,10 +1478,290 @@ ERR:
     return;
 }
 
+/* This function commits the group transaction, if it is open.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int maildb_sqlite_commit_group(maildb *mdb) {
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
+    int group_size = self->group_size;
+    
+    if (group_size == 0) return 0;
+    self->group_size = 0;
+    
+    /* SQLite rolls back the transaction by itself on some errors. */
+    if (sqlite3_get_autocommit(db)) {
+    	kmo_seterror("the group transaction has been rolled back (%d writes lost)", group_size);
+	return -1;
+    }
+    
+    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL)) {
+    	kmo_seterror(sqlite3_errmsg(db));
+	if (! sqlite3_get_autocommit(db)) rollback_transaction(db);
+	return -1;
+    }
+    
+    return 0;
+}
+
+/* This function enables or disables the group commit mode. Enabling the mode
+ * switches the database to write-ahead logging and relaxes the synchronization
+ * of the disk. Disabling the mode commits the group transaction.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int maildb_sqlite_set_group_commit(maildb *mdb, int enable_flag) {
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    sqlite3 *db = self->db;
+    
+    if (enable_flag == self->group_flag) return 0;
+    
+    if (enable_flag) {
+    
+    	/* The journal mode is persistent. It is harmless to keep it once the
+	 * mode is disabled.
+	 */
+    	if (sqlite3_exec(db, "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;", NULL, NULL, NULL)) {
+	    kmo_seterror(sqlite3_errmsg(db));
+	    return -1;
+	}
+    }
+    
+    else {
+    	if (maildb_sqlite_commit_group(mdb)) return -1;
+	
+	if (sqlite3_exec(db, "PRAGMA synchronous = FULL;", NULL, NULL, NULL)) {
+	    kmo_seterror(sqlite3_errmsg(db));
+	    return -1;
+	}
+    }
+    
+    self->group_flag = enable_flag;
+    return 0;
+}
+
+/* This function returns the number of write operations done in the group
+ * transaction. It returns 0 if the group transaction is not open.
+ */
+static int maildb_sqlite_get_group_size(maildb *mdb) {
+    return ((struct maildb_sqlite *) mdb->db)->group_size;
+}
+
+/* This function executes the pragma specified, which returns a single value,
+ * and returns the first value in 'val'.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int maildb_sqlite_pragma(sqlite3 *db, const char *sql, kstr *val) {
+    sqlite3_stmt *stmt = NULL;
+    int error = 0;
+    
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) || sqlite3_step(stmt) != SQLITE_ROW) {
+    	kmo_seterror(sqlite3_errmsg(db));
+	error = -1;
+    }
+    
+    else {
+    	read_string(stmt, val, 0);
+    }
+    
+    finalize_stmt(db, &stmt);
+    return error;
+}
+
+/* This function checks the table of the current maintenance step with a quick
+ * check, which is much faster than the integrity check. Only the table and its
+ * indices are checked if SQLite supports it; older versions check the whole
+ * database.
+ * This function sets the KMO error string. It returns -1 on failure, and -2 if
+ * the database is corrupted.
+ */
+static int maildb_sqlite_maint_check(struct maildb_sqlite *self, int *step_done_flag) {
+    int error = 0;
+    kstr sql, val;
+    
+    kstr_init(&sql);
+    kstr_init(&val);
+    kstr_sf(&sql, "PRAGMA quick_check(%s);", maildb_maint_table_array[self->maint_table]);
+    
+    error = maildb_sqlite_pragma(self->db, sql.data, &val);
+    
+    if (! error && strcmp(val.data, "ok")) {
+    	kmo_seterror("sqlite database is corrupted (%s)", val.data);
+	error = -2;
+    }
+    
+    self->maint_table++;
+    *step_done_flag = (self->maint_table == MAILDB_MAINT_NB_TABLE);
+    
+    kstr_free(&sql);
+    kstr_free(&val);
+    return error;
+}
+
+/* This function removes the evaluation results that are no longer referenced
+ * by a message ID, among the next MAILDB_MAINT_PRUNE_SIZE evaluation results.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int maildb_sqlite_maint_prune(struct maildb_sqlite *self, int *step_done_flag) {
+    sqlite3 *db = self->db;
+    sqlite3_stmt *stmt = NULL;
+    int64_t last_entry_id = INT64_MAX;
+    int error;
+    
+    /* Find the last entry ID of the window. */
+    if (prepare_stmt(self, MAILDB_STMT_MAINT_NEXT_ENTRY_ID,
+    	    	     "SELECT entry_id FROM mail_eval_res3 WHERE entry_id > ?"
+		     " ORDER BY entry_id LIMIT 1 OFFSET ?;", &stmt)) goto ERR;
+    if (sqlite3_bind_int64(stmt, 1, self->maint_entry_id)) goto ERR;
+    if (sqlite3_bind_int(stmt, 2, MAILDB_MAINT_PRUNE_SIZE - 1)) goto ERR;
+    
+    error = sqlite3_step(stmt);
+    if (error == SQLITE_ROW) last_entry_id = sqlite3_column_int64(stmt, 0);
+    else if (error != SQLITE_DONE) goto ERR;
+    release_stmt(&stmt);
+    
+    /* Remove the unreferenced evaluation results of the window. */
+    if (prepare_stmt(self, MAILDB_STMT_MAINT_PRUNE,
+    	    	     "DELETE FROM mail_eval_res3 WHERE entry_id > ?1 AND entry_id <= ?2"
+		     " AND NOT EXISTS (SELECT 1 FROM mail_msg_id WHERE mail_msg_id.entry_id = mail_eval_res3.entry_id);",
+		     &stmt)) goto ERR;
+    if (sqlite3_bind_int64(stmt, 1, self->maint_entry_id)) goto ERR;
+    if (sqlite3_bind_int64(stmt, 2, last_entry_id)) goto ERR;
+    if (sqlite3_step(stmt) != SQLITE_DONE) goto ERR;
+    release_stmt(&stmt);
+    
+    self->maint_nb_pruned += sqlite3_changes(db);
+    self->maint_entry_id = last_entry_id;
+    *step_done_flag = (last_entry_id == INT64_MAX);
+    
+    if (*step_done_flag && self->maint_nb_pruned)
+    	kmod_log_msg(1, "Pruned %d unreferenced mail evaluation results.\n", self->maint_nb_pruned);
+    
+    return 0;
+    
+ERR:
+    kmo_seterror(sqlite3_errmsg(db));
+    release_stmt(&stmt);
+    return -1;
+}
+
+/* This function updates the statistics of the query planner for the table of
+ * the current maintenance step. The number of rows examined is limited, where
+ * SQLite supports it.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int maildb_sqlite_maint_analyze(struct maildb_sqlite *self, int *step_done_flag) {
+    int error = 0;
+    kstr sql;
+    
+    kstr_init(&sql);
+    kstr_sf(&sql, "PRAGMA analysis_limit = 1000; ANALYZE %s;", maildb_maint_table_array[self->maint_table]);
+    
+    if (sqlite3_exec(self->db, sql.data, NULL, NULL, NULL)) {
+    	kmo_seterror(sqlite3_errmsg(self->db));
+	error = -1;
+    }
+    
+    self->maint_table++;
+    *step_done_flag = (self->maint_table == MAILDB_MAINT_NB_TABLE);
+    
+    kstr_free(&sql);
+    return error;
+}
+
+/* This function returns MAILDB_MAINT_VACUUM_PAGES free pages to the file
+ * system. The databases created before the incremental vacuum was enabled are
+ * left alone, since enabling it requires a full vacuum.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int maildb_sqlite_maint_vacuum(struct maildb_sqlite *self, int *step_done_flag) {
+    int error = 0;
+    kstr val;
+    
+    kstr_init(&val);
+    
+    /* Try. */
+    do {
+    	*step_done_flag = 1;
+	
+	/* 2 is the incremental mode. */
+    	error = maildb_sqlite_pragma(self->db, "PRAGMA auto_vacuum;", &val);
+	if (error || strcmp(val.data, "2")) break;
+	
+	error = maildb_sqlite_pragma(self->db, "PRAGMA freelist_count;", &val);
+	if (error || ! strcmp(val.data, "0")) break;
+	
+	kstr_sf(&val, "PRAGMA incremental_vacuum(%d);", MAILDB_MAINT_VACUUM_PAGES);
+	
+	if (sqlite3_exec(self->db, val.data, NULL, NULL, NULL)) {
+	    kmo_seterror(sqlite3_errmsg(self->db));
+	    error = -1;
+	    break;
+	}
+	
+	*step_done_flag = 0;
+	
+    } while (0);
+    
+    kstr_free(&val);
+    return error;
+}
+
+/* This function performs one short step of the maintenance cycle: the quick
+ * check and the statistics update handle one table per step, the pruning
+ * examines MAILDB_MAINT_PRUNE_SIZE evaluation results per step and the
+ * incremental vacuum frees MAILDB_MAINT_VACUUM_PAGES pages per step. The
+ * cycle is restarted from the beginning after an error.
+ * This function sets the KMO error string. It returns -1 on failure, and -2 if
+ * the database is corrupted.
+ */
+static int maildb_sqlite_maintain(maildb *mdb, int *done_flag) {
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    int step_done_flag = 0;
+    int error = 0;
+    
+    *done_flag = 0;
+    
+    /* The steps are not part of the group transaction. */
+    if (maildb_sqlite_commit_group(mdb)) return -1;
+    
+    switch (self->maint_step) {
+    	case MAILDB_MAINT_CHECK: error = maildb_sqlite_maint_check(self, &step_done_flag); break;
+	case MAILDB_MAINT_PRUNE: error = maildb_sqlite_maint_prune(self, &step_done_flag); break;
+	case MAILDB_MAINT_ANALYZE: error = maildb_sqlite_maint_analyze(self, &step_done_flag); break;
+	case MAILDB_MAINT_VACUUM: error = maildb_sqlite_maint_vacuum(self, &step_done_flag); break;
+	default: assert(0);
+    }
+    
+    if (error || step_done_flag) {
+    	self->maint_step++;
+	self->maint_table = 0;
+	self->maint_entry_id = 0;
+	self->maint_nb_pruned = 0;
+    }
+    
+    if (error || self->maint_step == MAILDB_MAINT_NB_STEP) {
+    	self->maint_step = MAILDB_MAINT_CHECK;
+	*done_flag = 1;
+    }
+    
+    return error;
+}
+
 /* This function frees the database. */
 static void maildb_sqlite_destroy(maildb *mdb) {
-    sqlite3 *db = (sqlite3 *) mdb->db;
-    sqlite3_close(db);
+    struct maildb_sqlite *self = (struct maildb_sqlite *) mdb->db;
+    int i;
+    
+    /* Do not lose the pending writes. */
+    if (maildb_sqlite_commit_group(mdb)) {
+    	kmod_log_msg(1, "Cannot commit the maildb group transaction: %s.\n", kmo_strerror());
+    }
+    
+    for (i = 0; i < MAILDB_STMT_NB; i++)
+    	finalize_stmt(self->db, &self->stmt_cache[i]);
+    
+    sqlite3_close(self->db);
+    free(self);
     free(mdb);
 }
 
@@ -906,6 +1769,15 @@ static void maildb_sqlite_destroy(maildb *mdb) {
  * This function sets the KMO error string. It returns -1 on failure.
  */
 static int maildb_sqlite_initialize(sqlite3 *db) {
+    
+    /* Let the maintenance return the free pages to the file system. This must
+     * be set before the tables are created.
+     */
+    if (sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL;", NULL, NULL, NULL)) {
+        kmo_seterror("database initialization failed: %s", sqlite3_errmsg(db));
+	return -1;
+    }
+    
     begin_transaction(db);
     
     if (sqlite3_exec(db, "CREATE TABLE 'pwd' ('email' varchar(320), 'pwd' varchar(256));"
@@ -914,6 +1786,10 @@ static int maildb_sqlite_initialize(sqlite3 *db) {
                          "CREATE TABLE 'sender' ('mid' integer(20), 'name' varchar(100));"
                          "CREATE UNIQUE INDEX 'sender_index' ON sender (mid);"
 
+                         "CREATE TABLE 'sig_key' ('mid' INTEGER(20), 'tm_key_data' VARCHAR, 'key_data' VARCHAR,"
+                         " 'subscriber_name' VARCHAR, 'fetch_time' INTEGER);"
+                         "CREATE UNIQUE INDEX 'sig_key_index' ON sig_key (mid);"
+
 			 "CREATE TABLE 'mail_msg_id' ('msg_id' VARCHAR(20), 'entry_id' INTEGER);"
 			 "CREATE UNIQUE INDEX 'msg_id_index' ON mail_msg_id (msg_id);"
 
@@ -953,7 +1829,7 @@ static int maildb_sqlite_initialize(sqlite3 *db) {
 			 "CREATE INDEX 'entry_id_index' ON mail_msg_id (entry_id);"
 
                          "CREATE TABLE 'maildb_version' ('version' TINYINT(1));"
-                         "INSERT INTO maildb_version (version) VALUES (4);"
+                         "INSERT INTO maildb_version (version) VALUES (5);"
 
 			 "COMMIT;", NULL, NULL, NULL)) {
         kmo_seterror("database initialization failed: %s", sqlite3_errmsg(db));
@@ -964,6 +1840,26 @@ static int maildb_sqlite_initialize(sqlite3 *db) {
     return 0;
 }
 
+/* This function converts the database format from version 4 to version 5.
+ * This function sets the KMO error string. It returns -1 on failure.
+ */
+static int maildb_convert_to_version_5(sqlite3 *db) {
+    
+    /* Create the signature key table and update the maildb version. */
+    if (sqlite3_exec(db, "BEGIN TRANSACTION;"
+                         "CREATE TABLE 'sig_key' ('mid' INTEGER(20), 'tm_key_data' VARCHAR, 'key_data' VARCHAR,"
+                         " 'subscriber_name' VARCHAR, 'fetch_time' INTEGER);"
+                         "CREATE UNIQUE INDEX 'sig_key_index' ON sig_key (mid);"
+                         "UPDATE maildb_version SET version = 5;"
+			 "COMMIT;", NULL, NULL, NULL)) {
+	kmo_seterror(sqlite3_errmsg(db));
+	rollback_transaction(db);
+	return -1;
+    }
+    
+    return 0;
+}
+
 /* This function converts the database format from version 3 to version 4.
  * This function sets the KMO error string. It returns -1 on failure.
  */
@@ -1236,16 +2132,26 @@ ERR:
 struct _maildb_ops maildb_sqlite_ops = {
     .destroy         = maildb_sqlite_destroy,
     .set_mail_info   = maildb_sqlite_set_mail_info,
+    .set_unsigned_mail = maildb_sqlite_set_unsigned_mail,
     .get_mail_info_from_entry_id = maildb_sqlite_get_mail_info_from_entry_id,
     .get_mail_info_from_msg_id = maildb_sqlite_get_mail_info_from_msg_id,
     .get_mail_info_from_hash = maildb_sqlite_get_mail_info_from_hash,
+    .get_mail_info_batch = maildb_sqlite_get_mail_info_batch,
+    .load_mail_info  = maildb_sqlite_load_mail_info,
     .set_sender_info = maildb_sqlite_set_sender_info,
     .get_sender_info = maildb_sqlite_get_sender_info,
     .rm_sender_info  = maildb_sqlite_rm_sender_info,
+    .set_sig_key_info = maildb_sqlite_set_sig_key_info,
+    .get_sig_key_info = maildb_sqlite_get_sig_key_info,
+    .rm_sig_key_info = maildb_sqlite_rm_sig_key_info,
     .set_pwd         = maildb_sqlite_set_pwd,
     .get_pwd         = maildb_sqlite_get_pwd,
     .get_all_pwd     = maildb_sqlite_get_all_pwd,
-    .rm_pwd 	     = maildb_sqlite_rm_pwd
+    .rm_pwd 	     = maildb_sqlite_rm_pwd,
+    .set_group_commit = maildb_sqlite_set_group_commit,
+    .commit_group    = maildb_sqlite_commit_group,
+    .get_group_size  = maildb_sqlite_get_group_size,
+    .maintain        = maildb_sqlite_maintain
 };
 
 /* This function opens the database if it already exists, or creates a new one
@@ -1273,40 +2179,54 @@ maildb * maildb_sqlite_new(char *db_name)
     if (version == 0) {
     	kmod_log_msg(1, "Initializing new KMOD database.\n");
     	if (maildb_sqlite_initialize(db)) goto ERR;
+	version = 5;
     }
     
     /* Convert database to version 2. */
-    else if (version == 1) {
+    if (version == 1) {
     	kmod_log_msg(1, "Converting KMOD database from version 1 to version 2.\n");
     	if (maildb_convert_to_version_2(db)) goto ERR;
+	version = 2;
     }
     
     /* Convert database to version 3. */
-    else if (version == 2) {
+    if (version == 2) {
     	kmod_log_msg(1, "Converting KMOD database from version 2 to version 3.\n");
     	if (maildb_convert_to_version_3(db)) goto ERR;
+	version = 3;
     }
 	
     /* Convert database to version 4. */
-    else if (version == 3) {
+    if (version == 3) {
     	kmod_log_msg(1, "Converting KMOD database from version 3 to version 4.\n");
     	if (maildb_convert_to_version_4(db)) goto ERR;
+	version = 4;
+    }
+    
+    /* Convert database to version 5. */
+    if (version == 4) {
+    	kmod_log_msg(1, "Converting KMOD database from version 4 to version 5.\n");
+    	if (maildb_convert_to_version_5(db)) goto ERR;
+	version = 5;
     }
     
     /* Database is at current version. */
-    else if (version == 4) {
-    	kmod_log_msg(1, "The KMOD database is at version 4.\n");
+    if (version == 5) {
+    	kmod_log_msg(1, "The KMOD database is at version 5.\n");
     }
     
     /* Database is too recent -- we can't deal with it since we would corrupt it. */
     else {
-    	kmo_seterror("database version %d is unsupported (latest supported version is %d)", version, 4);
+    	kmo_seterror("database version %d is unsupported (latest supported version is %d)", version, 5);
 	goto ERR;
     }
     
     /* Initialize the maildb object. */
+    struct maildb_sqlite *self = (struct maildb_sqlite *) kmo_calloc(sizeof(struct maildb_sqlite));
+    self->db = db;
+    
     maildb *mdb = (maildb *) kmo_calloc(sizeof(maildb));
-    mdb->db = db;
+    mdb->db = self;
     mdb->ops = &maildb_sqlite_ops;
     
     /* All good. */